@@ -1,4 +1,6 @@
 
+// Blocks of an image are decompressed on all cores
+#define TINYEXR_USE_THREAD 1
 #define TINYEXR_IMPLEMENTATION
 #include "tinyexr.h"
 
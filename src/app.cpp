@@ -3,10 +3,22 @@
 #include <imgui/imgui.h>
 #include <imgui/imgui_impl_sdl.h>
 
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
+#include <utility>
+
 #include "app.h"
 #include "geometry/util.h"
 #include "platform/platform.h"
+#include "scene/bench_scenes.h"
 #include "scene/renderer.h"
+#include "util/parallel.h"
+#include "util/line_server.h"
+#include "util/profiler.h"
+#include "util/rand.h"
 
 App::App(Launch_Settings set, Platform* plt)
     : window_dim(plt ? plt->window_draw() : Vec2{1.0f}),
@@ -15,6 +27,27 @@ App::App(Launch_Settings set, Platform* plt)
 
     if(!set.headless) assert(plt);
 
+    undo.set_budget(size_t(std::max(set.undo_memory, 0)) << 20, set.undo_spill);
+
+    gui.set_scene_cache(set.scene_cache);
+
+    // Batch and server jobs and benchmarks each load their own scene
+    if(!set.batch.empty() || set.serve > 0 || set.benchmark) return;
+
+    bool loaded_scene = load(set);
+
+    if(!set.headless) {
+        GL::global_params();
+        Renderer::setup(window_dim);
+        apply_window_dim(plt->window_draw());
+    } else if(loaded_scene) {
+        std::string err = render_headless(set);
+        if(!err.empty()) warn("Error rendering scene: %s", err.c_str());
+    }
+}
+
+bool App::load(const Launch_Settings& set) {
+
     std::string err;
     bool loaded_scene = true;
 
@@ -22,6 +55,9 @@ App::App(Launch_Settings set, Platform* plt)
         info("Loading scene file...");
         Scene::Load_Opts opts;
         opts.new_scene = true;
+        opts.cache_dir = set.scene_cache;
+        // Nothing is edited when rendering without the GUI
+        opts.defer_halfedge = set.headless;
         err = scene.load(opts, undo, gui, set.scene_file);
         gui.set_file(set.scene_file);
     }
@@ -36,23 +72,296 @@ App::App(Launch_Settings set, Platform* plt)
         err = scene.set_env_map(set.env_map_file);
         if(!err.empty()) warn("Error loading environment map: %s", err.c_str());
     }
+    return loaded_scene;
+}
 
-    if(!set.headless) {
+std::string App::render_headless(const Launch_Settings& set) {
+
+    if(set.raster) {
+        // Batch jobs may each rasterize at a different size
+        Renderer::shutdown();
         GL::global_params();
-        Renderer::setup(window_dim);
-        apply_window_dim(plt->window_draw());
-    } else if(loaded_scene) {
+        Renderer::setup(Vec2{(float)set.w, (float)set.h});
+    }
+
+    info("Rendering scene...");
+    std::string err = gui.get_render().headless_render(gui.get_animate(), scene, set);
+
+    if(err.empty()) {
+        auto [build, render] = gui.get_render().completion_time();
+        info("Built scene in %.2fs, rendered in %.2fs", build, render);
+    }
+    return err;
+}
+
+bool App::batch(const std::vector<Launch_Settings>& jobs) {
+
+    // Environment maps stay loaded for later jobs, and a job on the scene the one
+    // before it loaded renders that scene as it is, so the path tracer keeps the BVHs
+    // it built for its meshes
+    Scene_Light::cache_emissive(true);
+
+    size_t failed = 0;
+    for(size_t i = 0; i < jobs.size(); i++) {
+        const Launch_Settings& set = jobs[i];
+        info("Job %zu of %zu: %s", i + 1, jobs.size(), set.output_file.c_str());
+        std::string err = run_job(set);
+        if(!err.empty()) {
+            warn("Error rendering job %zu: %s", i + 1, err.c_str());
+            failed++;
+        }
+    }
+
+    Scene_Light::cache_emissive(false);
+    info("Rendered %zu of %zu jobs", jobs.size() - failed, jobs.size());
+    return failed == 0;
+}
+
+std::string App::run_job(const Launch_Settings& set) {
+
+    if(!job_loaded || set.scene_file != job_scene ||
+       (set.env_map_file != job_env_map && set.env_map_file.empty())) {
+        job_loaded = load(set);
+    } else if(set.env_map_file != job_env_map) {
+        std::string err = scene.set_env_map(set.env_map_file);
+        if(!err.empty()) warn("Error loading environment map: %s", err.c_str());
+    }
+    job_scene = set.scene_file;
+    job_env_map = set.env_map_file;
 
-        info("Rendering scene...");
-        err = gui.get_render().headless_render(gui.get_animate(), scene, set);
+    std::string err = job_loaded ? render_headless(set) : "Scene not loaded.";
+    // Animations leave the scene posed at their last frame
+    if(set.animate) job_loaded = false;
+    return err;
+}
+
+// Requests are one line each, answered by one line: "ok", with the output and the
+// seconds taken for a render, or "error" and why.
+//
+//   render <options>            renders a job, as for a line of a batch file
+//   transform <name> x y z [rx ry rz [sx sy sz]]
+//   material <name> <field> <values>
+//                               type (a Material_Type name), albedo, reflectance,
+//                               transmittance or emissive r g b, intensity or ior v
+//   light <name> <field> <values>
+//                               spectrum r g b, intensity v, angles inner outer
+//   quit
+//
+// Names are of scene items, in double quotes if they contain spaces. Edits change the
+// loaded scene in place, so the next render only rebuilds what they touched; a job
+// naming another scene file loads it, dropping them. Renders report progress as they
+// would from the command line, and --checkpoint writes the image so far as it goes.
+bool App::serve(const Launch_Settings& set, Line_Server& server,
+                const std::function<std::string(const std::string&, Launch_Settings&)>& parse) {
+
+    Scene_Light::cache_emissive(true);
+    if(!set.scene_file.empty()) {
+        job_loaded = load(set);
+        job_scene = set.scene_file;
+        job_env_map = set.env_map_file;
+    }
+
+    bool quit = false;
+    std::string line;
+    while(!quit && server.read(line)) {
+
+        std::istringstream in(line);
+        std::string command;
+        in >> command;
+        if(command.empty()) continue;
+
+        std::string err, reply = "ok";
+        if(command == "quit") {
+            quit = true;
+        } else if(command == "render") {
+            std::string options;
+            std::getline(in >> std::ws, options);
+            Launch_Settings job;
+            err = parse(options, job);
+            if(err.empty()) {
+                info("Job: %s", job.output_file.c_str());
+                auto start = std::chrono::steady_clock::now();
+                err = run_job(job);
+                std::chrono::duration<float> took = std::chrono::steady_clock::now() - start;
+                std::ostringstream out;
+                out << "ok " << std::quoted(job.output_file) << " " << took.count();
+                reply = out.str();
+            }
+        } else if(!job_loaded) {
+            err = "No scene loaded.";
+        } else {
+            err = edit(command, in);
+        }
+
+        if(!err.empty()) {
+            warn("Error serving \"%s\": %s", command.c_str(), err.c_str());
+            reply = "error " + err;
+            std::replace(reply.begin(), reply.end(), '\n', ' ');
+        }
+        server.write(reply);
+    }
+
+    Scene_Light::cache_emissive(false);
+    return quit;
+}
+
+std::string App::edit(const std::string& command, std::istream& args) {
+
+    std::string name, field;
+    args >> std::quoted(name);
+    if(!args) return "Expected an item name.";
+
+    Scene_Item* item = nullptr;
+    scene.for_items([&](Scene_Item& i) {
+        if(!item && std::as_const(i).name() == name) item = &i;
+    });
+    if(!item) return "No item named " + name + ".";
+
+    auto read_spectrum = [&](Spectrum& s) {
+        Spectrum v;
+        if(!(args >> v.r >> v.g >> v.b)) return false;
+        s = v;
+        return true;
+    };
+    auto read_float = [&](float& f) {
+        float v;
+        if(!(args >> v)) return false;
+        f = v;
+        return true;
+    };
+
+    if(command == "transform") {
+        Pose pose = item->pose();
+        Vec3 v;
+        if(!(args >> v.x >> v.y >> v.z)) return "Expected a position.";
+        pose.pos = v;
+        if(args >> v.x >> v.y >> v.z) {
+            pose.euler = v;
+            if(args >> v.x >> v.y >> v.z) pose.scale = v;
+        }
+        if(!pose.valid()) return "Invalid transform.";
+        item->pose() = pose;
+        return {};
+    }
+
+    if(command == "material") {
+        if(!item->is<Scene_Object>()) return name + " is not an object.";
+        Material::Options& opt = item->get<Scene_Object>().material.opt;
+        args >> field;
+        bool ok = false;
+        if(field == "type") {
+            std::string type;
+            args >> std::quoted(type);
+            for(int t = 0; t < (int)Material_Type::count; t++) {
+                if(type == Material_Type_Names[t]) {
+                    opt.type = (Material_Type)t;
+                    ok = true;
+                }
+            }
+        } else if(field == "albedo") {
+            ok = read_spectrum(opt.albedo);
+        } else if(field == "reflectance") {
+            ok = read_spectrum(opt.reflectance);
+        } else if(field == "transmittance") {
+            ok = read_spectrum(opt.transmittance);
+        } else if(field == "emissive") {
+            ok = read_spectrum(opt.emissive);
+        } else if(field == "intensity") {
+            ok = read_float(opt.intensity);
+        } else if(field == "ior") {
+            ok = read_float(opt.ior);
+        }
+        return ok ? std::string() : "Invalid material field " + field + ".";
+    }
 
-        if(!err.empty())
-            warn("Error rendering scene: %s", err.c_str());
-        else {
-            auto [build, render] = gui.get_render().completion_time();
-            info("Built scene in %.2fs, rendered in %.2fs", build, render);
+    if(command == "light") {
+        if(!item->is<Scene_Light>()) return name + " is not a light.";
+        Scene_Light::Options& opt = item->get<Scene_Light>().opt;
+        args >> field;
+        bool ok = false;
+        if(field == "spectrum") {
+            ok = read_spectrum(opt.spectrum);
+        } else if(field == "intensity") {
+            ok = read_float(opt.intensity);
+        } else if(field == "angles") {
+            Vec2 angles;
+            ok = (bool)(args >> angles.x >> angles.y);
+            if(ok) opt.angle_bounds = angles;
         }
+        return ok ? std::string() : "Invalid light field " + field + ".";
     }
+
+    return "Unknown request " + command + ".";
+}
+
+// The path with _name added to its stem, e.g. out.png to out_glass.png
+static std::string suffixed(const std::string& path, const std::string& name) {
+    std::filesystem::path p(path);
+    std::string file = p.stem().string() + "_" + name + p.extension().string();
+    return (p.parent_path() / file).string();
+}
+
+bool App::benchmark(const Launch_Settings& set) {
+
+    struct Result {
+        std::string name;
+        float build = 0.0f, render = 0.0f;
+    };
+    std::vector<Result> results;
+
+    const std::vector<std::string>& names =
+        set.benchmark_scenes.empty() ? Bench_Scenes::names() : set.benchmark_scenes;
+
+    for(const std::string& name : names) {
+
+        info("Benchmark scene: %s", name.c_str());
+        scene.clear(undo);
+        // Scenes with random placement draw from the main thread's generator
+        RNG::seed(uint64_t(0));
+        Bench_Scenes::View view;
+        std::string err = Bench_Scenes::build(name, scene, view);
+
+        if(err.empty()) {
+            // Everything that would vary the work done from run to run is off
+            Launch_Settings job = set;
+            job.output_file = suffixed(set.output_file, name);
+            if(!set.stats_json.empty()) job.stats_json = suffixed(set.stats_json, name);
+            job.camera = {view.pos.x,    view.pos.y,    view.pos.z,
+                          view.target.x, view.target.y, view.target.z};
+            job.fov = view.fov;
+            job.w_from_ar = false;
+            job.raster = false;
+            job.animate = false;
+            job.deterministic = true;
+            job.adaptive = 0.0f;
+            job.time_limit = 0.0f;
+            job.region.clear();
+            job.shard_index = 0;
+            job.shard_count = 1;
+            job.merge.clear();
+            job.checkpoint = 0.0f;
+            job.resume = false;
+            job.denoise = false;
+            err = render_headless(job);
+        }
+        if(!err.empty()) {
+            warn("Error rendering benchmark scene %s: %s", name.c_str(), err.c_str());
+            return false;
+        }
+        auto [build, render] = gui.get_render().completion_time();
+        results.push_back({name, build, render});
+    }
+    scene.clear(undo);
+
+    double samples = (double)set.w * set.h * set.s;
+    info("Benchmark at %dx%d, %d samples, depth %d, %zu threads:", set.w, set.h, set.s, set.d,
+         parallel_pool().size());
+    info("\t%-12s %10s %10s %12s", "scene", "build (s)", "render (s)", "Msamples/s");
+    for(const Result& r : results) {
+        info("\t%-12s %10.3f %10.3f %12.2f", r.name.c_str(), r.build, r.render,
+             samples / std::max(r.render, 1e-6f) / 1e6);
+    }
+    return true;
 }
 
 App::~App() {
@@ -63,6 +372,10 @@ bool App::quit() {
     return gui.quit(undo);
 }
 
+float App::redraw_interval() {
+    return gui.redraw_interval(scene);
+}
+
 void App::event(SDL_Event e) {
 
     ImGuiIO& IO = ImGui::GetIO();
@@ -206,10 +519,13 @@ void App::render() {
     r.begin();
     r.proj(proj);
 
-    gui.render_3d(scene, undo, camera);
-
-    r.complete();
+    {
+        PROFILE_ZONE("Render 3D");
+        gui.render_3d(scene, undo, camera);
+        r.complete();
+    }
 
+    PROFILE_ZONE("Render UI");
     gui.render_ui(scene, undo, camera);
 }
 
@@ -2,34 +2,123 @@
 #pragma once
 
 #include <SDL2/SDL.h>
+#include <functional>
+#include <iosfwd>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "gui/manager.h"
 #include "lib/mathlib.h"
 #include "util/camera.h"
+#include "util/png_writer.h"
 
 #include "scene/scene.h"
 #include "scene/undo.h"
 
 class Platform;
+class Line_Server;
 
 struct Launch_Settings {
 
     std::string scene_file;
     std::string env_map_file;
     bool headless = false;
+    bool raster = false;
+    // Jobs to render, one command line of options per line, each applied over these
+    std::string batch;
+    // Port on the loopback interface to take jobs and scene edits on (see App::serve),
+    // 0 for none
+    int serve = 0;
+    // Render the built-in benchmark scenes (or just the named ones) and report timings
+    bool benchmark = false;
+    std::vector<std::string> benchmark_scenes;
 
     // If headless is true, use all of these
     std::string output_file = "out.png";
+    std::string bvh_cache;
+    std::string scene_cache;
+    std::string shader_cache;
+    // Camera position then look-at point, and vertical field of view in degrees (0 for
+    // the scene's)
+    std::vector<float> camera;
+    float fov = 0.0f;
+    // Render a left and right eye this far apart, or this many views orbiting the
+    // look-at point, in one pass over one scene build (see PT::Pathtracer::begin_render)
+    float stereo = 0.0f;
+    int turntable = 0;
     int w = 640;
     int h = 360;
     int s = 256;
+    int msaa = 4;
     int d = 8;
+    int tile = 32;
+    int rr = 0;
+    int light_samples = 0;
+    // Path guide training passes (see PT::Pathtracer::set_guiding)
+    int guide = 0;
+    // Caustic photon map (see PT::Pathtracer::set_caustics)
+    int caustic_photons = 0;
+    float caustic_radius = 0.0f;
+    int threads = 0;
+    float adaptive = 0.0f;
+    float time_limit = 0.0f;
+    float spatial = 0.0f;
+    int bvh_profile = (int)PT::BVH_Profile::balanced;
+    int build_memory = 0;
+    // Of paged mesh geometry kept resident (see PT::Pathtracer::set_out_of_core)
+    int geometry_memory = 0;
+    int undo_memory = 2048;
+    int sampler = (int)RNG::Sequence::independent;
+    // Render a PT::Heatmap of traversal cost instead of radiance
+    int heatmap = (int)PT::Heatmap::none;
+    float heatmap_scale = 0.0f;
     bool animate = false;
+    // Write linear EXRs rather than tonemapped PNGs (as when the output ends in .exr),
+    // with albedo, normal and depth layers if aovs is set
+    bool exr = false;
+    bool aovs = false;
+    int png_compression = (int)Png::Compression::fast;
+    bool denoise = false;
+    // With animate, render every frame_step-th frame from frame_start through frame_end
+    // (-1 for the last frame), or just the listed frames if any
+    int frame_start = 0;
+    int frame_end = -1;
+    int frame_step = 1;
+    std::vector<int> frames;
+    // Trace only pixels x0 y0 to x1 y1 (exclusive, from the bottom left), optionally with
+    // region_samples instead of s
+    std::vector<int> region;
+    int region_samples = 0;
+    // Render every shard_count-th tile from shard_index into a shard file, or assemble
+    // the merge shard files into the output image
+    int shard_index = 0;
+    int shard_count = 1;
+    std::vector<std::string> merge;
+    // Save progress to the output path plus .ckpt every this many seconds (0 for
+    // never), and with resume, continue from it (or skip frames already written)
+    float checkpoint = 0.0f;
+    bool resume = false;
+    // Write tiles to the output as they finish instead of holding the whole image
+    // (see PT::Pathtracer::set_tile_sink), for images too large for memory
+    bool poster = false;
     float exp = 1.0f;
     bool w_from_ar = false;
     bool no_bvh = false;
+    bool wavefront = false;
+    bool bvh_stats = false;
+    bool memory_stats = false;
+    bool compress_meshes = false;
+    bool out_of_core = false;
+    bool deterministic = false;
+    bool balance_heuristic = false;
+    bool pin_threads = false;
+    bool pool_stats = false;
+    // JSON Lines of progress events and a final report, for render farm schedulers
+    std::string stats_json;
+    // Chrome trace of the profiler zones recorded over the whole run
+    std::string profile;
+    bool undo_spill = false;
 };
 
 class App {
@@ -37,11 +126,32 @@ public:
     App(Launch_Settings set, Platform* plt = nullptr);
     ~App();
 
+    // Renders each job headless, returning whether all succeeded
+    bool batch(const std::vector<Launch_Settings>& jobs);
+    // Loads the settings' scene, if any, then takes requests from the server until told
+    // to quit, keeping the scene and the path tracer's BVHs between them: edits to the
+    // loaded scene, and jobs parsed from a command line of options. Returns whether it
+    // was told to quit rather than the server failing.
+    bool serve(const Launch_Settings& set, Line_Server& server,
+               const std::function<std::string(const std::string&, Launch_Settings&)>& parse);
+    // Renders each benchmark scene headless with the settings' seeds fixed, then
+    // prints how long each took to build and render
+    bool benchmark(const Launch_Settings& set);
+
     void render();
+    // See Gui::Manager::redraw_interval
+    float redraw_interval();
     bool quit();
     void event(SDL_Event e);
 
 private:
+    bool load(const Launch_Settings& set);
+    std::string render_headless(const Launch_Settings& set);
+    // Renders a job of a batch or server, loading its scene unless the last job left
+    // it loaded
+    std::string run_job(const Launch_Settings& set);
+    // Applies one of the server's scene edits
+    std::string edit(const std::string& command, std::istream& args);
     void apply_window_dim(Vec2 new_dim);
     Vec3 screen_to_world(Vec2 mouse);
 
@@ -59,5 +169,9 @@ private:
     Gui::Manager gui;
     Undo undo;
 
+    // The scene and environment map the last job loaded
+    std::string job_scene, job_env_map;
+    bool job_loaded = false;
+
     bool gui_capture = false;
 };
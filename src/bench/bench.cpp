@@ -0,0 +1,690 @@
+
+// Ray intersection microbenchmarks. Each case traces a fixed batch of rays, either
+// coherent (a pinhole camera's, in scanline order) or incoherent (from random points
+// around the target towards random points inside it), over and over until a minimum
+// time has passed, and reports the best of several runs in millions of rays per
+// second. Rays are the same on every run, so numbers compare across builds.
+//
+// With --build, it instead times BVH builds over meshes and instances of many sizes
+// and leaf sizes, and measures the trees' quality: SAH cost, and nodes visited and
+// primitives tested per ray on a fixed incoherent batch. Results may be saved, and
+// compared against saved ones, failing if any got slower or worse beyond a tolerance.
+//
+// With --halfedge, it times Halfedge_Mesh operations on quad-meshed tori of growing
+// face counts (triangulated first for those that need triangles).
+//
+// With --animation, it reports the cost per frame of playing back an animation:
+// evaluating splines, skinning a mesh to a chain of joints, solving IK, and stepping
+// particles, alone and bouncing off a BVH of meshes.
+
+#include <assimp/Importer.hpp>
+#include <assimp/postprocess.h>
+#include <assimp/scene.h>
+#include <sf_libs/CLI11.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+
+#include "../geometry/halfedge.h"
+#include "../geometry/util.h"
+#include "../rays/object.h"
+#include "../rays/shapes.h"
+#include "../rays/list.h"
+#include "../rays/tri_mesh.h"
+#include "../scene/particles.h"
+#include "../scene/skeleton.h"
+#include "../util/parallel.h"
+#include "../util/rand.h"
+
+static constexpr int runs = 5;
+static constexpr double min_seconds = 0.25;
+
+// A square image of the box, from outside it
+static std::vector<Ray> coherent_rays(BBox box, size_t n) {
+
+    size_t side = (size_t)std::ceil(std::sqrt((double)n));
+    Vec3 center = box.center();
+    float radius = 0.5f * (box.max - box.min).norm();
+    Vec3 eye = center + Vec3{0.3f, 0.4f, 1.0f}.unit() * (2.5f * radius);
+
+    Vec3 forward = (center - eye).unit();
+    Vec3 right = cross(forward, Vec3{0.0f, 1.0f, 0.0f}).unit();
+    Vec3 up = cross(right, forward);
+
+    std::vector<Ray> rays;
+    rays.reserve(side * side);
+    for(size_t y = 0; y < side; y++) {
+        for(size_t x = 0; x < side; x++) {
+            float u = 2.0f * (x + 0.5f) / side - 1.0f;
+            float v = 2.0f * (y + 0.5f) / side - 1.0f;
+            rays.emplace_back(eye, forward + 0.45f * (u * right + v * up));
+        }
+    }
+    return rays;
+}
+
+static std::vector<Ray> incoherent_rays(BBox box, size_t n) {
+
+    RNG::seed(uint64_t(1));
+    Vec3 center = box.center();
+    float radius = 0.5f * (box.max - box.min).norm();
+
+    std::vector<Ray> rays;
+    rays.reserve(n);
+    for(size_t i = 0; i < n; i++) {
+        Vec3 dir;
+        do {
+            dir = Vec3{RNG::unit(), RNG::unit(), RNG::unit()} * 2.0f - Vec3{1.0f};
+        } while(dir.norm_squared() > 1.0f || dir.norm_squared() < 1e-4f);
+        Vec3 from = center + dir.unit() * (2.0f * radius);
+        Vec3 to = box.min + (box.max - box.min) * Vec3{RNG::unit(), RNG::unit(), RNG::unit()};
+        rays.emplace_back(from, to - from);
+    }
+    return rays;
+}
+
+// Best rate over the runs, in millions of rays per second
+static double mrays(const std::vector<Ray>& rays, const std::function<bool(const Ray&)>& trace) {
+
+    // Keeps the calls from being optimized away
+    static volatile size_t sink = 0;
+
+    double best = 0.0;
+    for(int run = 0; run < runs; run++) {
+        size_t traced = 0, hits = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed{};
+        do {
+            for(const Ray& ray : rays) hits += trace(ray);
+            traced += rays.size();
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while(elapsed.count() < min_seconds);
+        sink = sink + hits;
+        best = std::max(best, traced / elapsed.count() / 1e6);
+    }
+    return best;
+}
+
+struct Case {
+    std::string name;
+    BBox box;
+    std::function<bool(const Ray&)> trace;
+};
+
+// Every mesh in a file, in world space, as one
+static std::string load_mesh(const std::string& file, GL::Mesh& mesh) {
+
+    Assimp::Importer importer;
+    const aiScene* scene =
+        importer.ReadFile(file, aiProcess_Triangulate | aiProcess_JoinIdenticalVertices |
+                                    aiProcess_PreTransformVertices | aiProcess_GenNormals);
+    if(!scene) return importer.GetErrorString();
+
+    std::vector<GL::Mesh::Vert> verts;
+    std::vector<GL::Mesh::Index> indices;
+    for(unsigned int m = 0; m < scene->mNumMeshes; m++) {
+        const aiMesh* ai = scene->mMeshes[m];
+        GL::Mesh::Index base = (GL::Mesh::Index)verts.size();
+        for(unsigned int v = 0; v < ai->mNumVertices; v++) {
+            const aiVector3D& p = ai->mVertices[v];
+            Vec3 n = ai->mNormals ? Vec3{ai->mNormals[v].x, ai->mNormals[v].y, ai->mNormals[v].z}
+                                  : Vec3{};
+            verts.push_back({Vec3{p.x, p.y, p.z}, n, 0});
+        }
+        for(unsigned int f = 0; f < ai->mNumFaces; f++) {
+            const aiFace& face = ai->mFaces[f];
+            if(face.mNumIndices != 3) continue;
+            for(unsigned int i = 0; i < 3; i++) indices.push_back(base + face.mIndices[i]);
+        }
+    }
+    if(indices.empty()) return "No triangles in " + file + ".";
+    mesh = GL::Mesh(std::move(verts), std::move(indices));
+    return {};
+}
+
+struct Build_Result {
+    double build_ms = 0.0, sah = 0.0, nodes = 0.0, prims = 0.0;
+};
+
+// Best of up to runs builds, stopping early once min_seconds have passed
+template<typename T>
+static std::pair<T, double> time_build(const std::function<T()>& build) {
+    T built = build();
+    double best = std::numeric_limits<double>::max(), total = 0.0;
+    for(int run = 0; run < runs && total < min_seconds; run++) {
+        auto start = std::chrono::steady_clock::now();
+        built = build();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+        total += elapsed.count();
+    }
+    return {std::move(built), 1e3 * best};
+}
+
+// Traversal work per ray on the incoherent batch over the box
+template<typename T> static void traversal(const T& bvh, BBox box, size_t n, Build_Result& r) {
+    std::vector<Ray> rays = incoherent_rays(box, n);
+    PT::BVH_Counters::enabled = true;
+    PT::BVH_Counters& counters = PT::BVH_Counters::local();
+    counters = {};
+    for(const Ray& ray : rays) bvh.hit(ray);
+    r.nodes = (double)counters.nodes / rays.size();
+    r.prims = (double)counters.primitives / rays.size();
+    PT::BVH_Counters::enabled = false;
+}
+
+static std::map<std::string, Build_Result> read_results(const std::string& file) {
+    std::map<std::string, Build_Result> results;
+    std::ifstream in(file);
+    std::string line;
+    while(std::getline(in, line)) {
+        // Names may hold spaces, so they are last
+        std::istringstream ss(line);
+        Build_Result r;
+        std::string name;
+        if(!(ss >> r.build_ms >> r.sah >> r.nodes >> r.prims)) continue;
+        std::getline(ss >> std::ws, name);
+        results[name] = r;
+    }
+    return results;
+}
+
+struct Build_Suite {
+    std::vector<int> sizes = {10000, 100000, 1000000, 10000000};
+    std::vector<int> instances = {1000, 10000, 100000, 1000000};
+    std::vector<int> leaf_sizes = {1, 2, 4, 8, 16};
+    std::string save, baseline;
+    float time_tolerance = 0.25f, quality_tolerance = 0.01f;
+};
+
+static int build_suite(const Build_Suite& suite, PT::BVH_Options options, size_t n_rays,
+                       const std::string& filter,
+                       const std::vector<std::pair<std::string, GL::Mesh>>& files) {
+
+    std::map<std::string, Build_Result> results;
+    auto wanted = [&filter](const std::string& name) {
+        return filter.empty() || name.find(filter) != std::string::npos;
+    };
+
+    // Tori with about the given number of triangles, then the loaded meshes
+    std::vector<std::pair<std::string, GL::Mesh>> tori;
+    for(int size : suite.sizes) {
+        int sides = std::max((int)std::sqrt(size / 4.0), 2);
+        Util::Gen::Data torus = Util::Gen::torus(0.4f, 1.0f, 2 * sides, sides);
+        tori.emplace_back("torus " + std::to_string(size),
+                          GL::Mesh(std::move(torus.verts), std::move(torus.elems)));
+    }
+    std::vector<std::pair<std::string, const GL::Mesh*>> meshes;
+    for(const auto& [name, mesh] : tori) meshes.emplace_back(name, &mesh);
+    for(const auto& [name, mesh] : files) meshes.emplace_back(name, &mesh);
+
+    std::printf("%-40s %12s %10s %10s %10s\n", "", "build ms", "SAH", "nodes/ray",
+                "prims/ray");
+    auto report = [&](const std::string& name, const Build_Result& r) {
+        std::printf("%-40s %12.2f %10.2f %10.2f %10.2f\n", name.c_str(), r.build_ms, r.sah,
+                    r.nodes, r.prims);
+        std::fflush(stdout);
+        results[name] = r;
+    };
+
+    for(const auto& [mesh_name, mesh] : meshes) {
+        for(int leaf : suite.leaf_sizes) {
+            std::string name = "triangles " + mesh_name + " leaf " + std::to_string(leaf);
+            if(!wanted(name)) continue;
+            PT::BVH_Options opt = options;
+            opt.max_leaf_size = (size_t)leaf;
+            Build_Result r;
+            auto [bvh, ms] = time_build<PT::Tri_Mesh>(
+                [&]() { return PT::Tri_Mesh(*mesh, true, &parallel_pool(), opt); });
+            r.build_ms = ms;
+            r.sah = bvh.stats().sah_cost;
+            traversal(bvh, bvh.bbox(), n_rays, r);
+            report(name, r);
+        }
+    }
+
+    // Instances of one small mesh, scattered and turned at random over a cube that
+    // grows with their number, as a top-level BVH<Object> would hold
+    PT::Tri_Mesh instanced(Util::sphere_mesh(1.0f, 2), true);
+    for(int count : suite.instances) {
+        float extent = 4.0f * std::cbrt((float)count);
+        RNG::seed(uint64_t(2));
+        std::vector<Mat4> transforms;
+        for(int i = 0; i < count; i++) {
+            Vec3 at = Vec3{RNG::unit(), RNG::unit(), RNG::unit()} * extent;
+            Vec3 axis = Vec3{RNG::unit(), RNG::unit(), RNG::unit()} + Vec3{0.1f};
+            transforms.push_back(Mat4::translate(at) * Mat4::rotate(360.0f * RNG::unit(), axis));
+        }
+        for(int leaf : suite.leaf_sizes) {
+            std::string name =
+                "objects " + std::to_string(count) + " leaf " + std::to_string(leaf);
+            if(!wanted(name)) continue;
+            PT::BVH_Options opt = options;
+            opt.max_leaf_size = (size_t)leaf;
+            Build_Result r;
+            auto [bvh, ms] = time_build<PT::BVH<PT::Object>>([&]() {
+                std::vector<PT::Object> objects;
+                objects.reserve(transforms.size());
+                for(size_t i = 0; i < transforms.size(); i++) {
+                    objects.emplace_back(instanced.copy(), (Scene_ID)i, 0, transforms[i]);
+                }
+                return PT::BVH<PT::Object>(std::move(objects), opt, &parallel_pool());
+            });
+            r.build_ms = ms;
+            r.sah = bvh.stats().sah_cost;
+            traversal(bvh, bvh.bbox(), n_rays, r);
+            report(name, r);
+        }
+    }
+
+    if(!suite.save.empty()) {
+        std::ofstream out(suite.save);
+        for(const auto& [name, r] : results) {
+            out << r.build_ms << " " << r.sah << " " << r.nodes << " " << r.prims << " " << name
+                << "\n";
+        }
+        if(!out) {
+            std::fprintf(stderr, "Failed to write %s\n", suite.save.c_str());
+            return 1;
+        }
+    }
+
+    if(suite.baseline.empty()) return 0;
+    std::map<std::string, Build_Result> baseline = read_results(suite.baseline);
+    if(baseline.empty()) {
+        std::fprintf(stderr, "No results in %s\n", suite.baseline.c_str());
+        return 1;
+    }
+    int regressions = 0;
+    auto check = [&](const std::string& name, const char* what, double now, double then,
+                     float tolerance) {
+        if(now <= then * (1.0 + tolerance)) return;
+        std::printf("REGRESSION %s: %s %.3f, was %.3f (+%.1f%%)\n", name.c_str(), what, now,
+                    then, 100.0 * (now / then - 1.0));
+        regressions++;
+    };
+    for(const auto& [name, r] : results) {
+        auto entry = baseline.find(name);
+        if(entry == baseline.end()) continue;
+        const Build_Result& b = entry->second;
+        check(name, "build ms", r.build_ms, b.build_ms, suite.time_tolerance);
+        check(name, "SAH", r.sah, b.sah, suite.quality_tolerance);
+        check(name, "nodes/ray", r.nodes, b.nodes, suite.quality_tolerance);
+        check(name, "prims/ray", r.prims, b.prims, suite.quality_tolerance);
+    }
+    std::printf("%d regressions against %s\n", regressions, suite.baseline.c_str());
+    return regressions ? 1 : 0;
+}
+
+// Best of up to runs calls of op, stopping early once min_seconds have passed; setup
+// runs untimed before each, e.g. to copy the mesh op changes
+static double time_op(const std::function<void()>& setup, const std::function<void()>& op) {
+    double best = std::numeric_limits<double>::max(), total = 0.0;
+    for(int run = 0; run < runs && total < min_seconds; run++) {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        op();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+        total += elapsed.count();
+    }
+    return 1e3 * best;
+}
+
+// A closed torus of about n quads, twice as many around as across
+static void quad_torus(size_t n, std::vector<std::vector<Halfedge_Mesh::Index>>& polys,
+                       std::vector<Vec3>& verts) {
+    size_t sides = std::max((size_t)std::sqrt(n / 2.0), size_t(3)), rings = 2 * sides;
+    for(size_t i = 0; i < rings; i++) {
+        float u = 2.0f * PI_F * i / rings;
+        for(size_t j = 0; j < sides; j++) {
+            float v = 2.0f * PI_F * j / sides;
+            float r = 1.0f + 0.4f * std::cos(v);
+            verts.push_back(Vec3{r * std::cos(u), 0.4f * std::sin(v), r * std::sin(u)});
+        }
+    }
+    auto at = [&](size_t i, size_t j) {
+        return (Halfedge_Mesh::Index)((i % rings) * sides + j % sides);
+    };
+    for(size_t i = 0; i < rings; i++) {
+        for(size_t j = 0; j < sides; j++) {
+            polys.push_back({at(i, j), at(i, j + 1), at(i + 1, j + 1), at(i + 1, j)});
+        }
+    }
+}
+
+static int halfedge_suite(const std::vector<int>& sizes, const std::string& filter) {
+
+    std::printf("%-36s %10s %12s\n", "", "faces", "ms");
+    for(int size : sizes) {
+
+        std::vector<std::vector<Halfedge_Mesh::Index>> polys;
+        std::vector<Vec3> verts;
+        quad_torus((size_t)size, polys, verts);
+
+        Halfedge_Mesh quads, tris, work;
+        std::string err = quads.from_poly(polys, verts);
+        if(!err.empty()) {
+            std::fprintf(stderr, "Failed to build a torus of %d faces: %s\n", size, err.c_str());
+            return 1;
+        }
+        quads.copy_to(tris);
+        tris.triangulate();
+
+        auto run = [&](const std::string& op, Halfedge_Mesh& from, std::function<void()> body) {
+            std::string name = op + " " + std::to_string(size);
+            if(!filter.empty() && name.find(filter) == std::string::npos) return;
+            double ms = time_op([&]() { from.copy_to(work); }, body);
+            std::printf("%-36s %10zu %12.2f\n", name.c_str(), (size_t)from.n_faces(), ms);
+            std::fflush(stdout);
+        };
+
+        run("from_poly", quads, [&]() { work.from_poly(polys, verts); });
+        run("to_mesh", quads, [&]() {
+            std::vector<GL::Mesh::Vert> out_verts;
+            std::vector<GL::Mesh::Index> out_idxs;
+            work.to_mesh(out_verts, out_idxs, false);
+        });
+        run("validate", quads, [&]() { work.validate(); });
+        run("copy_to", quads, [&]() {
+            Halfedge_Mesh copy;
+            work.copy_to(copy);
+        });
+        run("triangulate", quads, [&]() { work.triangulate(); });
+        run("subdivide linear", quads, [&]() { work.subdivide(SubD::linear); });
+        run("subdivide catmull-clark", quads, [&]() { work.subdivide(SubD::catmullclark); });
+        run("subdivide loop", tris, [&]() { work.subdivide(SubD::loop); });
+        run("isotropic_remesh", tris, [&]() { work.isotropic_remesh(); });
+        run("simplify", tris, [&]() { work.simplify(work.n_faces() / 4); });
+    }
+    return 0;
+}
+
+// Mean time of consecutive calls of frame (which advances the state it works on),
+// over at least runs of them and min_seconds
+static double time_frames(const std::function<void(size_t)>& frame) {
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed{};
+    size_t n = 0;
+    while(n < (size_t)runs || elapsed.count() < min_seconds) {
+        frame(n++);
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    return 1e3 * elapsed.count() / n;
+}
+
+// Results that would otherwise go unused are stored here, so aren't optimized away
+static volatile float sink;
+
+struct Animation_Suite {
+    int splines = 1000, knots = 64, joints = 32;
+    std::vector<int> verts = {10000, 100000, 1000000};
+    std::vector<int> particles = {10000, 100000};
+};
+
+// A chain of joints standing on the origin, height tall
+static std::vector<Joint*> joint_chain(Skeleton& skeleton, int n, float height) {
+    std::vector<Joint*> chain = {skeleton.add_root(Vec3{0.0f, height / n, 0.0f})};
+    while((int)chain.size() < n) {
+        chain.push_back(skeleton.add_child(chain.back(), Vec3{0.0f, height / n, 0.0f}));
+    }
+    return chain;
+}
+
+// Bends the chain back and forth over frames
+static void pose_chain(const std::vector<Joint*>& chain, size_t frame) {
+    for(size_t i = 0; i < chain.size(); i++) {
+        float t = 0.1f * frame + 0.3f * i;
+        chain[i]->pose = Vec3{10.0f * std::sin(t), 5.0f * std::cos(t), 10.0f * std::cos(t)};
+    }
+}
+
+static int animation_suite(const Animation_Suite& suite, const std::string& filter) {
+
+    std::printf("%-44s %12s\n", "", "ms/frame");
+    auto report = [&filter](const std::string& name, const std::function<double()>& time) {
+        if(!filter.empty() && name.find(filter) == std::string::npos) return;
+        std::printf("%-44s %12.4f\n", name.c_str(), time());
+        std::fflush(stdout);
+    };
+    std::string per = " (" + std::to_string(suite.splines) + " of " +
+                      std::to_string(suite.knots) + " knots)";
+
+    // A frame evaluates every spline once, at a time between knots
+    RNG::seed(uint64_t(1));
+    std::vector<Spline<Vec3>> vec_splines(suite.splines);
+    std::vector<Spline<Quat>> quat_splines(suite.splines);
+    for(int i = 0; i < suite.splines; i++) {
+        for(int k = 0; k < suite.knots; k++) {
+            Vec3 v{RNG::unit(), RNG::unit(), RNG::unit()};
+            vec_splines[i].set((float)k, v);
+            quat_splines[i].set((float)k, Quat::euler(360.0f * v));
+        }
+    }
+    auto frame_time = [&suite](size_t frame) {
+        return std::fmod(0.37f * frame, (float)std::max(suite.knots - 1, 1));
+    };
+    report("spline<Vec3> at" + per, [&]() {
+        Vec3 sum;
+        double ms = time_frames([&](size_t frame) {
+            for(const auto& spline : vec_splines) sum += spline.at(frame_time(frame));
+        });
+        sink = sum.x;
+        return ms;
+    });
+    report("spline<Quat> at" + per, [&]() {
+        float sum = 0.0f;
+        double ms = time_frames([&](size_t frame) {
+            for(const auto& spline : quat_splines) sum += spline.at(frame_time(frame)).w;
+        });
+        sink = sum;
+        return ms;
+    });
+
+    // A tube skinned to a chain of joints running up its middle
+    std::string chain = " (" + std::to_string(suite.joints) + " joints)";
+    for(int size : suite.verts) {
+        int sides = 32, rings = std::max(size / sides - 1, 1);
+        Util::Gen::Data tube = Util::Gen::tube(0.2f, 4.0f, rings, sides);
+        GL::Mesh bind(std::move(tube.verts), std::move(tube.elems)), posed;
+        std::string verts = " " + std::to_string(bind.verts().size()) + " verts";
+
+        Skeleton skeleton;
+        std::vector<Joint*> joints = joint_chain(skeleton, suite.joints, 4.0f);
+        for(Joint* j : joints) j->radius = 0.5f;
+        Skeleton::Skin_Weights weights;
+
+        report("find_joints" + verts + chain, [&]() {
+            return time_op([&]() { weights.clear(); },
+                           [&]() { skeleton.find_joints(bind, weights); });
+        });
+        weights.clear();
+        skeleton.find_joints(bind, weights);
+        for(auto mode : {Skeleton::Skin_Mode::linear_blend, Skeleton::Skin_Mode::dual_quaternion}) {
+            std::string name = std::string("skin ") + Skeleton::Skin_Mode_Names[(int)mode];
+            report(name + verts + chain, [&]() {
+                skeleton.skin_mode = mode;
+                return time_frames([&](size_t frame) {
+                    pose_chain(joints, frame);
+                    skeleton.skin(bind, posed, weights);
+                });
+            });
+        }
+    }
+
+    // A frame moves the handle at the end of the chain, then solves for it
+    for(auto solver : {Skeleton::IK_Solver::jacobian_transpose,
+                       Skeleton::IK_Solver::damped_least_squares}) {
+        std::string name = std::string("ik ") + Skeleton::IK_Solver_Names[(int)solver];
+        report(name + chain, [&]() {
+            Skeleton skeleton;
+            std::vector<Joint*> joints = joint_chain(skeleton, suite.joints, 4.0f);
+            Skeleton::IK_Handle* handle = skeleton.add_handle(Vec3{}, joints.back());
+            handle->enabled = true;
+            skeleton.ik.solver = solver;
+            return time_frames([&](size_t frame) {
+                float t = 0.05f * frame;
+                handle->target = Vec3{2.0f * std::cos(t), 2.5f + std::sin(t), 2.0f * std::sin(t)};
+                skeleton.do_ik();
+            });
+        });
+    }
+
+    // Particles bouncing off nothing, or a floor and tori in a BVH, after enough time
+    // that as many die each frame as are emitted
+    PT::Object empty(PT::List<PT::Object>(), 0);
+    std::vector<PT::Object> objects;
+    objects.emplace_back(PT::Tri_Mesh(Util::square_mesh(20.0f)), 1);
+    for(int i = 0; i < 8; i++) {
+        float angle = 2.0f * PI_F * i / 8;
+        Mat4 T = Mat4::translate(Vec3{3.0f * std::cos(angle), 0.5f, 3.0f * std::sin(angle)});
+        objects.emplace_back(PT::Tri_Mesh(Util::torus_mesh(0.5f, 1.0f)), i + 2, 0, T);
+    }
+    PT::Object meshes(PT::BVH<PT::Object>(std::move(objects), PT::BVH_Options{}), 0);
+
+    for(int count : suite.particles) {
+        for(const PT::Object* scene : {&empty, &meshes}) {
+            std::string name = "particles step " + std::to_string(count) +
+                               (scene == &empty ? "" : " (BVH collisions)");
+            report(name, [&]() {
+                Scene_Particles particles(1, Pose::moved(Vec3{0.0f, 4.0f, 0.0f}), "bench");
+                particles.opt.enabled = true;
+                particles.opt.velocity = 6.0f;
+                particles.opt.angle = 60.0f;
+                particles.opt.lifetime = 3.0f;
+                particles.opt.pps = count / particles.opt.lifetime;
+                Scene_Particles::Colliders colliders(*scene);
+                particles.step(colliders, particles.opt.lifetime);
+                return time_frames(
+                    [&](size_t) { particles.step(colliders, 1.0f / 60.0f); });
+            });
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+
+    std::string filter;
+    int n_rays = 1 << 16;
+    int profile = (int)PT::BVH_Profile::balanced;
+    std::vector<std::string> files;
+    bool build = false, halfedge = false, animation = false;
+    Build_Suite suite;
+    Animation_Suite anim;
+    std::vector<int> faces = {1000, 10000, 100000, 1000000};
+
+    CLI::App args{"Scotty3D ray intersection benchmarks"};
+    args.add_option("--filter", filter, "Only run cases whose name contains this");
+    args.add_option("--rays", n_rays, "Rays per batch")->check(CLI::PositiveNumber);
+    args.add_option("--bvh_profile", profile,
+                    "BVH build profile: fast-build, balanced or best-trace")
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, int>{{"fast-build", 0}, {"balanced", 1}, {"best-trace", 2}}));
+    args.add_option("--mesh", files, "Also trace the BVHs of the meshes in these files");
+    args.add_flag("--build", build, "Time BVH builds and measure tree quality instead");
+    args.add_option("--sizes", suite.sizes, "Torus triangle counts (with --build)")
+        ->delimiter(',');
+    args.add_option("--instances", suite.instances, "Object counts (with --build)")
+        ->delimiter(',');
+    args.add_option("--leaf_sizes", suite.leaf_sizes, "Maximum leaf sizes (with --build)")
+        ->delimiter(',')
+        ->check(CLI::PositiveNumber);
+    args.add_option("--save", suite.save, "Write build results to this file (with --build)");
+    args.add_option("--baseline", suite.baseline,
+                    "Fail if build results are worse than these saved ones (with --build)");
+    args.add_option("--time_tolerance", suite.time_tolerance,
+                    "Fraction by which builds may be slower than the baseline's");
+    args.add_option("--quality_tolerance", suite.quality_tolerance,
+                    "Fraction by which SAH and traversal costs may exceed the baseline's");
+    args.add_flag("--halfedge", halfedge, "Time halfedge mesh operations instead");
+    args.add_option("--faces", faces, "Torus face counts (with --halfedge)")
+        ->delimiter(',')
+        ->check(CLI::PositiveNumber);
+    args.add_flag("--animation", animation,
+                  "Time spline evaluation, skinning, IK and particles per frame instead");
+    args.add_option("--splines", anim.splines, "Splines evaluated per frame (with --animation)")
+        ->check(CLI::PositiveNumber);
+    args.add_option("--knots", anim.knots, "Knots per spline (with --animation)")
+        ->check(CLI::PositiveNumber);
+    args.add_option("--joints", anim.joints, "Joints per chain (with --animation)")
+        ->check(CLI::PositiveNumber);
+    args.add_option("--verts", anim.verts, "Skinned vertex counts (with --animation)")
+        ->delimiter(',')
+        ->check(CLI::PositiveNumber);
+    args.add_option("--particles", anim.particles, "Particle counts (with --animation)")
+        ->delimiter(',')
+        ->check(CLI::PositiveNumber);
+    CLI11_PARSE(args, argc, argv);
+
+    if(halfedge) return halfedge_suite(faces, filter);
+    if(animation) return animation_suite(anim, filter);
+
+    PT::BVH_Options options = PT::BVH_Options::profile((PT::BVH_Profile)profile);
+
+    std::vector<std::pair<std::string, GL::Mesh>> meshes;
+    for(const std::string& file : files) {
+        GL::Mesh mesh;
+        std::string err = load_mesh(file, mesh);
+        if(!err.empty()) {
+            std::fprintf(stderr, "Failed to load %s: %s\n", file.c_str(), err.c_str());
+            return 1;
+        }
+        meshes.emplace_back(file, std::move(mesh));
+    }
+    if(build) return build_suite(suite, options, (size_t)n_rays, filter, meshes);
+    meshes.emplace(meshes.begin(), "torus", Util::torus_mesh(0.4f, 1.0f, 512, 256));
+    meshes.emplace(meshes.begin(), "ico_sphere", Util::sphere_mesh(1.0f, 6));
+
+    std::vector<Case> cases;
+
+    BBox unit(Vec3{-1.0f}, Vec3{1.0f});
+    cases.push_back({"bbox", unit, [unit](const Ray& ray) {
+                         Vec2 times = ray.dist_bounds;
+                         return unit.hit(ray, times);
+                     }});
+
+    auto sphere = std::make_shared<PT::Sphere>(1.0f);
+    cases.push_back({"sphere", unit, [sphere](const Ray& ray) { return sphere->hit(ray).hit; }});
+    cases.push_back(
+        {"sphere occluded", unit, [sphere](const Ray& ray) { return sphere->occluded(ray); }});
+
+    // A one-triangle mesh without a BVH, which is close to testing Triangle::hit alone
+    GL::Mesh triangle(
+        std::vector<GL::Mesh::Vert>{{Vec3{-1.0f, -1.0f, 0.0f}, Vec3{0.0f, 0.0f, 1.0f}, 0},
+                                    {Vec3{1.0f, -1.0f, 0.0f}, Vec3{0.0f, 0.0f, 1.0f}, 0},
+                                    {Vec3{0.0f, 1.0f, 0.0f}, Vec3{0.0f, 0.0f, 1.0f}, 0}},
+        std::vector<GL::Mesh::Index>{0, 1, 2});
+    auto tri = std::make_shared<PT::Tri_Mesh>(triangle, false);
+    cases.push_back({"triangle", tri->bbox(), [tri](const Ray& ray) { return tri->hit(ray).hit; }});
+
+    auto wanted = [&filter](const std::string& name) {
+        return filter.empty() || name.find(filter) != std::string::npos;
+    };
+    for(auto& [name, mesh] : meshes) {
+        if(!wanted("bvh " + name) && !wanted("bvh occluded " + name)) continue;
+        auto start = std::chrono::steady_clock::now();
+        auto bvh = std::make_shared<PT::Tri_Mesh>(mesh, true, &parallel_pool(), options);
+        std::chrono::duration<double> build = std::chrono::steady_clock::now() - start;
+        std::printf("Built BVH over %zu triangles of %s in %.1fms\n", mesh.indices().size() / 3,
+                    name.c_str(), 1e3 * build.count());
+
+        cases.push_back(
+            {"bvh " + name, bvh->bbox(), [bvh](const Ray& ray) { return bvh->hit(ray).hit; }});
+        cases.push_back({"bvh occluded " + name, bvh->bbox(),
+                         [bvh](const Ray& ray) { return bvh->occluded(ray); }});
+    }
+
+    std::printf("%-40s %12s %12s\n", "Mrays/s", "coherent", "incoherent");
+    for(const Case& c : cases) {
+        if(!wanted(c.name)) continue;
+        double coherent = mrays(coherent_rays(c.box, (size_t)n_rays), c.trace);
+        double incoherent = mrays(incoherent_rays(c.box, (size_t)n_rays), c.trace);
+        std::printf("%-40s %12.2f %12.2f\n", c.name.c_str(), coherent, incoherent);
+    }
+    return 0;
+}
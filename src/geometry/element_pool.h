@@ -0,0 +1,282 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "../lib/log.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+template<typename T> class Element_Pool;
+
+inline size_t pool_ctz(uint64_t v) {
+#ifdef _MSC_VER
+    unsigned long bit;
+    _BitScanForward64(&bit, v);
+    return bit;
+#else
+    return __builtin_ctzll(v);
+#endif
+}
+
+// Memory for pool blocks. Blocks released by cleared or destroyed pools are kept
+// (up to max_cached of them) for the next pool that grows, since undo snapshots and
+// mesh copies build and drop whole meshes at a time and would otherwise go back to
+// the system allocator for every block.
+class Pool_Arena {
+public:
+    static constexpr size_t block_bytes = size_t(64) << 10;
+    static constexpr size_t max_cached = 512;
+
+    static void* allocate() {
+        Cache& cache = get();
+        {
+            std::lock_guard<std::mutex> lock(cache.mutex);
+            if(!cache.blocks.empty()) {
+                void* block = cache.blocks.back();
+                cache.blocks.pop_back();
+                return block;
+            }
+        }
+        return ::operator new(block_bytes, std::align_val_t(block_bytes));
+    }
+    static void release(void* block) {
+        Cache& cache = get();
+        {
+            std::lock_guard<std::mutex> lock(cache.mutex);
+            if(cache.blocks.size() < max_cached) {
+                cache.blocks.push_back(block);
+                return;
+            }
+        }
+        ::operator delete(block, std::align_val_t(block_bytes));
+    }
+
+private:
+    struct Cache {
+        std::mutex mutex;
+        std::vector<void*> blocks;
+    };
+    // Never destroyed, so pools in static storage can still release blocks at exit
+    static Cache& get() {
+        static Cache* cache = new Cache;
+        return *cache;
+    }
+};
+
+// Storage for Halfedge_Mesh elements with the parts of the std::list interface the
+// mesh uses. Elements live in large, aligned blocks, so iterating touches contiguous
+// memory and an iterator is just a pointer: following a reference (e.g.
+// h->twin()->next()) costs what a raw pointer does. Since the block holding an
+// element is found by masking its address, iterators can still step to the next
+// element without knowing their pool.
+//
+// As with std::list, elements never move, new elements come after all existing ones
+// in iteration order, and erasing an element only invalidates references to it.
+// Erased slots are tombstones rather than being reused, since mesh operations rely
+// on the ordering (e.g. visiting only the edges that existed before a subdivision);
+// Halfedge_Mesh::compact() copies the mesh to reclaim them.
+template<typename T> struct Pool_Block {
+    static constexpr size_t bytes = Pool_Arena::block_bytes;
+    static constexpr size_t header = 64;
+    static constexpr size_t capacity = (bytes - header) * 8 / (sizeof(T) * 8 + 1) - 64;
+    static constexpr size_t words = (capacity + 63) / 64;
+
+    T* slot(size_t i) {
+        return std::launder(reinterpret_cast<T*>(storage)) + i;
+    }
+    bool alive(size_t i) const {
+        return (live[i / 64] >> (i % 64)) & 1;
+    }
+
+    Element_Pool<T>* pool = nullptr;
+    size_t number = 0;
+    size_t used = 0;
+    uint64_t live[words] = {};
+    alignas(T) unsigned char storage[capacity * sizeof(T)];
+};
+
+template<typename T, bool Const> class Pool_Iterator {
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = std::conditional_t<Const, const T*, T*>;
+    using reference = std::conditional_t<Const, const T&, T&>;
+
+    Pool_Iterator() = default;
+    explicit Pool_Iterator(pointer ptr) : ptr(ptr) {
+    }
+    template<bool C = Const, typename = std::enable_if_t<!C>>
+    operator Pool_Iterator<T, true>() const {
+        return Pool_Iterator<T, true>(ptr);
+    }
+
+    reference operator*() const {
+        return *ptr;
+    }
+    pointer operator->() const {
+        return ptr;
+    }
+    Pool_Iterator& operator++() {
+        ptr = const_cast<pointer>(Element_Pool<T>::after(ptr));
+        return *this;
+    }
+    Pool_Iterator operator++(int) {
+        Pool_Iterator prev = *this;
+        ++*this;
+        return prev;
+    }
+
+    friend bool operator==(const Pool_Iterator& a, const Pool_Iterator& b) {
+        return a.ptr == b.ptr;
+    }
+    friend bool operator!=(const Pool_Iterator& a, const Pool_Iterator& b) {
+        return a.ptr != b.ptr;
+    }
+
+private:
+    pointer ptr = nullptr;
+    friend class Element_Pool<T>;
+};
+
+template<typename T> class Element_Pool {
+public:
+    using Block = Pool_Block<T>;
+    using iterator = Pool_Iterator<T, false>;
+    using const_iterator = Pool_Iterator<T, true>;
+
+    Element_Pool() = default;
+    Element_Pool(const Element_Pool& src) = delete;
+    Element_Pool(Element_Pool&& src) {
+        *this = std::move(src);
+    }
+    ~Element_Pool() {
+        clear();
+    }
+
+    Element_Pool& operator=(const Element_Pool& src) = delete;
+    Element_Pool& operator=(Element_Pool&& src) {
+        clear();
+        blocks = std::move(src.blocks);
+        count = src.count;
+        src.blocks.clear();
+        src.count = 0;
+        for(Block* block : blocks) block->pool = this;
+        return *this;
+    }
+
+    // Elements are only ever added at the end
+    iterator insert(const_iterator pos, T element) {
+        assert(pos == end());
+        if(blocks.empty() || blocks.back()->used == Block::capacity) {
+            Block* block = new(Pool_Arena::allocate()) Block;
+            block->pool = this;
+            block->number = blocks.size();
+            blocks.push_back(block);
+        }
+        Block* block = blocks.back();
+        size_t i = block->used++;
+        T* slot = new(block->slot(i)) T(std::move(element));
+        block->live[i / 64] |= uint64_t(1) << (i % 64);
+        count++;
+        return iterator(slot);
+    }
+
+    iterator erase(const_iterator pos) {
+        T* element = const_cast<T*>(pos.ptr);
+        iterator next(const_cast<T*>(after(element)));
+        Block* block = block_of(element);
+        size_t i = element - block->slot(0);
+        element->~T();
+        block->live[i / 64] &= ~(uint64_t(1) << (i % 64));
+        count--;
+        return next;
+    }
+
+    void clear() {
+        for(Block* block : blocks) {
+            if constexpr(!std::is_trivially_destructible_v<T>) {
+                for(size_t i = 0; i < block->used; i++) {
+                    if(block->alive(i)) block->slot(i)->~T();
+                }
+            }
+            block->~Block();
+            Pool_Arena::release(block);
+        }
+        blocks.clear();
+        count = 0;
+    }
+
+    iterator begin() {
+        return iterator(const_cast<T*>(first(0, 0)));
+    }
+    const_iterator begin() const {
+        return const_iterator(first(0, 0));
+    }
+    iterator end() {
+        return iterator();
+    }
+    const_iterator end() const {
+        return const_iterator();
+    }
+
+    size_t size() const {
+        return count;
+    }
+    bool empty() const {
+        return count == 0;
+    }
+    // Memory held by the pool's blocks, erased slots included
+    size_t bytes() const {
+        return blocks.size() * Block::bytes;
+    }
+    // Slots taken by erased elements, which compaction would reclaim
+    size_t erased() const {
+        size_t slots = 0;
+        for(const Block* block : blocks) slots += block->used;
+        return slots - count;
+    }
+
+    // The element after element in iteration order, or nullptr at the end
+    static const T* after(const T* element) {
+        Block* block = block_of(element);
+        return block->pool->first(block->number, size_t(element - block->slot(0)) + 1);
+    }
+
+private:
+    static Block* block_of(const T* element) {
+        static_assert(sizeof(Block) <= Block::bytes);
+        return reinterpret_cast<Block*>(reinterpret_cast<uintptr_t>(element) &
+                                        ~uintptr_t(Block::bytes - 1));
+    }
+
+    // The first live element at or after slot i of block b
+    const T* first(size_t b, size_t i) const {
+        for(; b < blocks.size(); b++, i = 0) {
+            Block* block = blocks[b];
+            while(i < block->used) {
+                uint64_t bits = block->live[i / 64] >> (i % 64);
+                if(bits) {
+                    i += pool_ctz(bits);
+                    if(i < block->used) return block->slot(i);
+                    break;
+                }
+                i = (i / 64 + 1) * 64;
+            }
+        }
+        return nullptr;
+    }
+
+    std::vector<Block*> blocks;
+    size_t count = 0;
+};
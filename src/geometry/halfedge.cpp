@@ -1,12 +1,18 @@
 
 #include "halfedge.h"
 
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <functional>
 #include <map>
 #include <set>
 #include <sstream>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "../gui/widgets.h"
+#include "../util/parallel.h"
 
 Halfedge_Mesh::Halfedge_Mesh() {
     next_id = Gui::n_Widget_IDs;
@@ -28,8 +34,11 @@ void Halfedge_Mesh::clear() {
     vertices.clear();
     edges.clear();
     faces.clear();
-    render_dirty_flag = true;
+    by_id.clear();
+    mark_dirty();
     next_id = Gui::n_Widget_IDs;
+    created.clear();
+    checked.clear();
 }
 
 void Halfedge_Mesh::copy_to(Halfedge_Mesh& mesh) {
@@ -43,58 +52,193 @@ Halfedge_Mesh::ElementRef Halfedge_Mesh::copy_to(Halfedge_Mesh& mesh, unsigned i
 
     // Clear any existing elements.
     mesh.clear();
-    ElementRef ret = vertices_begin();
-
-    // These maps will be used to identify elements of the old mesh
-    // with elements of the new mesh.  (Note that we can use a single
-    // map for both interior and boundary faces, because the map
-    // doesn't care which list of faces these iterators come from.)
-    std::unordered_map<unsigned int, HalfedgeRef> halfedgeOldToNew(n_halfedges());
-    std::unordered_map<unsigned int, VertexRef> vertexOldToNew(n_vertices());
-    std::unordered_map<unsigned int, EdgeRef> edgeOldToNew(n_edges());
-    std::unordered_map<unsigned int, FaceRef> faceOldToNew(n_faces());
-
-    // Copy geometry from the original mesh and create a map from
-    // pointers in the original mesh to those in the new mesh.
-    for(HalfedgeCRef h = halfedges_begin(); h != halfedges_end(); h++) {
-        auto hn = mesh.halfedges.insert(mesh.halfedges.end(), *h);
-        if(h->id() == eid) ret = hn;
-        halfedgeOldToNew[h->id()] = hn;
-    }
-    for(VertexCRef v = vertices_begin(); v != vertices_end(); v++) {
-        auto vn = mesh.vertices.insert(mesh.vertices.end(), *v);
-        if(v->id() == eid) ret = vn;
-        vertexOldToNew[v->id()] = vn;
-    }
-    for(EdgeCRef e = edges_begin(); e != edges_end(); e++) {
-        auto en = mesh.edges.insert(mesh.edges.end(), *e);
-        if(e->id() == eid) ret = en;
-        edgeOldToNew[e->id()] = en;
+    // Copy each element, then "search and replace" the references to the old elements
+    // with the new ones. Ids are below next_id, and unique across types, so the new
+    // elements are found through one array by id rather than a map per type.
+    std::vector<VertexRef> vs;
+    std::vector<EdgeRef> es;
+    std::vector<FaceRef> fs;
+    std::vector<HalfedgeRef> hs;
+    vs.reserve(n_vertices());
+    es.reserve(n_edges());
+    fs.reserve(n_faces());
+    hs.reserve(n_halfedges());
+    mesh.by_id.resize(next_id);
+    auto copy = [&](auto& from, auto& to, auto& refs) {
+        for(auto elem = from.begin(); elem != from.end(); elem++) {
+            auto copied = to.insert(to.end(), *elem);
+            mesh.by_id[elem->id()] = copied;
+            refs.push_back(copied);
+        }
+    };
+    copy(halfedges, mesh.halfedges, hs);
+    copy(vertices, mesh.vertices, vs);
+    copy(edges, mesh.edges, es);
+    copy(faces, mesh.faces, fs);
+
+    auto find = [&](auto old) { return std::get<decltype(old)>(*mesh.by_id[old->id()]); };
+    for(HalfedgeRef h : hs) {
+        h->set_neighbors(find(h->next()), find(h->twin()), find(h->vertex()), find(h->edge()),
+                         find(h->face()));
     }
-    for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
-        auto fn = mesh.faces.insert(mesh.faces.end(), *f);
-        if(f->id() == eid) ret = fn;
-        faceOldToNew[f->id()] = fn;
-    }
-
-    // "Search and replace" old pointers with new ones.
-    for(HalfedgeRef he = mesh.halfedges_begin(); he != mesh.halfedges_end(); he++) {
-        he->next() = halfedgeOldToNew[he->next()->id()];
-        he->twin() = halfedgeOldToNew[he->twin()->id()];
-        he->vertex() = vertexOldToNew[he->vertex()->id()];
-        he->edge() = edgeOldToNew[he->edge()->id()];
-        he->face() = faceOldToNew[he->face()->id()];
-    }
-    for(VertexRef v = mesh.vertices_begin(); v != mesh.vertices_end(); v++)
-        v->halfedge() = halfedgeOldToNew[v->halfedge()->id()];
-    for(EdgeRef e = mesh.edges_begin(); e != mesh.edges_end(); e++)
-        e->halfedge() = halfedgeOldToNew[e->halfedge()->id()];
-    for(FaceRef f = mesh.faces_begin(); f != mesh.faces_end(); f++)
-        f->halfedge() = halfedgeOldToNew[f->halfedge()->id()];
-
-    mesh.render_dirty_flag = true;
+    for(VertexRef v : vs) v->halfedge() = find(v->halfedge());
+    for(EdgeRef e : es) e->halfedge() = find(e->halfedge());
+    for(FaceRef f : fs) f->halfedge() = find(f->halfedge());
+
+    mesh.mark_dirty();
     mesh.next_id = next_id;
-    return ret;
+    if(auto elem = mesh.element(eid)) return *elem;
+    return mesh.vertices_begin();
+}
+
+// Serialized meshes are columns of 32-bit words: element ids, the ids they link to,
+// and position bits. Each column is delta-coded and split into byte planes, which
+// turns the mostly sequential ids into long runs of equal bytes.
+static void put_column(std::vector<unsigned char>& out, const std::vector<uint32_t>& column) {
+    size_t n = column.size(), at = out.size();
+    out.resize(at + 4 * n);
+    uint32_t prev = 0;
+    for(size_t i = 0; i < n; i++) {
+        uint32_t delta = column[i] - prev;
+        prev = column[i];
+        for(size_t b = 0; b < 4; b++) out[at + b * n + i] = (unsigned char)(delta >> (8 * b));
+    }
+}
+
+static bool get_column(const std::vector<unsigned char>& in, size_t& at, size_t n,
+                       std::vector<uint32_t>& column) {
+    if((in.size() - at) / 4 < n) return false;
+    column.resize(n);
+    uint32_t prev = 0;
+    for(size_t i = 0; i < n; i++) {
+        uint32_t delta = 0;
+        for(size_t b = 0; b < 4; b++) delta |= uint32_t(in[at + b * n + i]) << (8 * b);
+        prev += delta;
+        column[i] = prev;
+    }
+    at += 4 * n;
+    return true;
+}
+
+void Halfedge_Mesh::serialize(std::vector<unsigned char>& out) {
+
+    do_erase();
+    out.clear();
+
+    put_column(out, {(uint32_t)n_vertices(), (uint32_t)n_edges(), (uint32_t)n_faces(),
+                     (uint32_t)n_halfedges(), next_id, flip_orientation});
+
+    auto put = [&](auto& list, auto word) {
+        std::vector<uint32_t> column;
+        column.reserve(list.size());
+        for(auto elem = list.begin(); elem != list.end(); elem++) column.push_back(word(elem));
+        put_column(out, column);
+    };
+    auto bits = [](float f) {
+        uint32_t u;
+        std::memcpy(&u, &f, 4);
+        return u;
+    };
+
+    put(vertices, [](VertexRef v) { return v->id(); });
+    put(vertices, [](VertexRef v) { return v->halfedge()->id(); });
+    put(vertices, [&](VertexRef v) { return bits(v->pos.x); });
+    put(vertices, [&](VertexRef v) { return bits(v->pos.y); });
+    put(vertices, [&](VertexRef v) { return bits(v->pos.z); });
+    put(edges, [](EdgeRef e) { return e->id(); });
+    put(edges, [](EdgeRef e) { return e->halfedge()->id(); });
+    put(faces, [](FaceRef f) { return f->id(); });
+    put(faces, [](FaceRef f) { return f->halfedge()->id(); });
+    put(faces, [](FaceRef f) { return (uint32_t)f->is_boundary(); });
+    put(halfedges, [](HalfedgeRef h) { return h->id(); });
+    put(halfedges, [](HalfedgeRef h) { return h->twin()->id(); });
+    put(halfedges, [](HalfedgeRef h) { return h->next()->id(); });
+    put(halfedges, [](HalfedgeRef h) { return h->vertex()->id(); });
+    put(halfedges, [](HalfedgeRef h) { return h->edge()->id(); });
+    put(halfedges, [](HalfedgeRef h) { return h->face()->id(); });
+}
+
+bool Halfedge_Mesh::deserialize(const std::vector<unsigned char>& in) {
+
+    clear();
+
+    size_t at = 0;
+    std::vector<uint32_t> header;
+    if(!get_column(in, at, 6, header)) return false;
+    size_t nv = header[0], ne = header[1], nf = header[2], nh = header[3];
+    if(nh == 0 ? nv + ne + nf > 0 : nv == 0 || ne == 0 || nf == 0) return false;
+
+    enum : uint32_t { vertex, edge, face, halfedge };
+    size_t sizes[] = {nv, nv, nv, nv, nv, ne, ne, nf, nf, nf, nh, nh, nh, nh, nh, nh};
+    std::vector<uint32_t> columns[16];
+    for(size_t c = 0; c < 16; c++) {
+        if(!get_column(in, at, sizes[c], columns[c])) return false;
+    }
+    const auto &vid = columns[0], &vhe = columns[1], &vx = columns[2], &vy = columns[3],
+               &vz = columns[4], &eid = columns[5], &ehe = columns[6], &fid = columns[7],
+               &fhe = columns[8], &fbd = columns[9], &hid = columns[10], &htw = columns[11],
+               &hnx = columns[12], &hvt = columns[13], &hed = columns[14], &hfc = columns[15];
+
+    // Where each id is, as its index in its list and its type in the low bits
+    uint32_t ids = header[4];
+    std::vector<uint32_t> slot(ids, UINT32_MAX);
+    auto place = [&](const std::vector<uint32_t>& id, uint32_t type) {
+        for(size_t i = 0; i < id.size(); i++) {
+            if(id[i] >= ids || slot[id[i]] != UINT32_MAX) return false;
+            slot[id[i]] = (uint32_t)(i << 2) | type;
+        }
+        return true;
+    };
+    if(!place(vid, vertex) || !place(eid, edge) || !place(fid, face) || !place(hid, halfedge)) {
+        return false;
+    }
+    // Bad links resolve to the first element of their type, so that the mesh can be
+    // built before giving up on it
+    bool valid = true;
+    auto index = [&](uint32_t id, uint32_t type) -> size_t {
+        if(id >= ids || slot[id] == UINT32_MAX || (slot[id] & 3) != type) {
+            valid = false;
+            return 0;
+        }
+        return slot[id] >> 2;
+    };
+
+    std::vector<VertexRef> vs(nv);
+    std::vector<EdgeRef> es(ne);
+    std::vector<FaceRef> fs(nf);
+    std::vector<HalfedgeRef> hs(nh);
+    for(size_t i = 0; i < nv; i++) vs[i] = vertices.insert(vertices.end(), Vertex(vid[i]));
+    for(size_t i = 0; i < ne; i++) es[i] = edges.insert(edges.end(), Edge(eid[i]));
+    for(size_t i = 0; i < nf; i++) fs[i] = faces.insert(faces.end(), Face(fid[i], fbd[i] != 0));
+    for(size_t i = 0; i < nh; i++) hs[i] = halfedges.insert(halfedges.end(), Halfedge(hid[i]));
+    by_id.resize(ids);
+    for(size_t i = 0; i < nv; i++) by_id[vid[i]] = vs[i];
+    for(size_t i = 0; i < ne; i++) by_id[eid[i]] = es[i];
+    for(size_t i = 0; i < nf; i++) by_id[fid[i]] = fs[i];
+    for(size_t i = 0; i < nh; i++) by_id[hid[i]] = hs[i];
+
+    for(size_t i = 0; i < nv; i++) {
+        std::memcpy(&vs[i]->pos.x, &vx[i], 4);
+        std::memcpy(&vs[i]->pos.y, &vy[i], 4);
+        std::memcpy(&vs[i]->pos.z, &vz[i], 4);
+        vs[i]->halfedge() = hs[index(vhe[i], halfedge)];
+    }
+    for(size_t i = 0; i < ne; i++) es[i]->halfedge() = hs[index(ehe[i], halfedge)];
+    for(size_t i = 0; i < nf; i++) fs[i]->halfedge() = hs[index(fhe[i], halfedge)];
+    for(size_t i = 0; i < nh; i++) {
+        hs[i]->set_neighbors(hs[index(hnx[i], halfedge)], hs[index(htw[i], halfedge)],
+                             vs[index(hvt[i], vertex)], es[index(hed[i], edge)],
+                             fs[index(hfc[i], face)]);
+    }
+    if(!valid) {
+        clear();
+        return false;
+    }
+
+    next_id = ids;
+    flip_orientation = header[5] != 0;
+    mark_dirty();
+    return true;
 }
 
 Vec3 Halfedge_Mesh::Vertex::neighborhood_center() const {
@@ -262,80 +406,134 @@ Vec3 Halfedge_Mesh::center_of(Halfedge_Mesh::ElementRef elem) {
 }
 
 void Halfedge_Mesh::to_mesh(GL::Mesh& mesh, bool split_faces) const {
-
     std::vector<GL::Mesh::Vert> verts;
     std::vector<GL::Mesh::Index> idxs;
+    to_mesh(verts, idxs, split_faces);
+    mesh.recreate(std::move(verts), std::move(idxs));
+}
 
-    if(split_faces) {
+void Halfedge_Mesh::to_mesh(std::vector<GL::Mesh::Vert>& verts, std::vector<GL::Mesh::Index>& idxs,
+                            bool split_faces) const {
+
+    // Two passes, both parallel over faces: count each face's triangles to find
+    // where its output goes, then write them. Elements are gathered first since
+    // the element lists can only be walked in order.
+    std::vector<FaceCRef> faces;
+    faces.reserve(n_faces());
+    for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
+        if(!f->is_boundary()) faces.push_back(f);
+    }
 
-        std::vector<GL::Mesh::Vert> face_verts;
-        for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
+    std::vector<size_t> offsets(faces.size() + 1, 0);
+    parallel_for(0, faces.size(), 1024, [&](size_t i) {
+        unsigned int degree = faces[i]->degree();
+        offsets[i + 1] = degree >= 3 ? degree - 2 : 0;
+    });
+    for(size_t i = 0; i < faces.size(); i++) offsets[i + 1] += offsets[i];
+    size_t n_tris = offsets.back();
 
-            if(f->is_boundary()) continue;
+    verts.clear();
+    idxs.assign(n_tris * 3, 0);
+
+    if(split_faces) {
+
+        // Flat shading only needs positions; each triangle gets its face normal
+        verts.resize(n_tris * 3);
+        parallel_for(0, faces.size(), 256, [&](size_t i) {
+            FaceCRef f = faces[i];
+            size_t out = offsets[i] * 3;
 
             HalfedgeCRef h = f->halfedge();
-            face_verts.clear();
-            do {
-                VertexCRef v = h->vertex();
-                Vec3 n = v->normal();
-                if(flip_orientation) n = -n;
-                face_verts.push_back({v->pos, n, f->id()});
-                h = h->next();
-            } while(h != f->halfedge());
-
-            Vec3 v0 = face_verts[0].pos;
-            for(size_t i = 1; i <= face_verts.size() - 2; i++) {
-                Vec3 v1 = face_verts[i].pos;
-                Vec3 v2 = face_verts[i + 1].pos;
+            Vec3 v0 = h->vertex()->pos;
+            h = h->next();
+            Vec3 v1 = h->vertex()->pos;
+            for(h = h->next(); h != f->halfedge(); h = h->next()) {
+                Vec3 v2 = h->vertex()->pos;
                 Vec3 n = cross(v1 - v0, v2 - v0).unit();
                 if(flip_orientation) n = -n;
-                GL::Mesh::Index idx = (GL::Mesh::Index)verts.size();
-                verts.push_back({v0, n, f->_id});
-                verts.push_back({v1, n, f->_id});
-                verts.push_back({v2, n, f->_id});
-                idxs.push_back(idx);
-                idxs.push_back(idx + 1);
-                idxs.push_back(idx + 2);
+                verts[out] = {v0, n, f->_id};
+                verts[out + 1] = {v1, n, f->_id};
+                verts[out + 2] = {v2, n, f->_id};
+                idxs[out] = (GL::Mesh::Index)out;
+                idxs[out + 1] = (GL::Mesh::Index)(out + 1);
+                idxs[out + 2] = (GL::Mesh::Index)(out + 2);
+                out += 3;
+                v1 = v2;
             }
-        }
+        });
 
     } else {
 
-        // Need to build this map to get vertex's linear index in O(lg n)
-        std::map<VertexCRef, Index> vref_to_idx;
-        Index i = 0;
-        for(VertexCRef v = vertices_begin(); v != vertices_end(); v++, i++) {
-            vref_to_idx[v] = i;
-            Vec3 n = v->normal();
-            if(flip_orientation) n = -n;
-            verts.push_back({v->pos, n, v->_id});
+        // Need to build this map to get vertex's linear index in O(1)
+        std::vector<VertexCRef> vertices;
+        std::unordered_map<unsigned int, Index> id_to_idx(n_vertices());
+        vertices.reserve(n_vertices());
+        for(VertexCRef v = vertices_begin(); v != vertices_end(); v++) {
+            id_to_idx[v->id()] = vertices.size();
+            vertices.push_back(v);
         }
 
-        for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
+        // Each vertex normal is computed once, rather than once per corner
+        verts.resize(vertices.size());
+        parallel_for(0, vertices.size(), 1024, [&](size_t i) {
+            VertexCRef v = vertices[i];
+            Vec3 n = v->normal();
+            if(flip_orientation) n = -n;
+            verts[i] = {v->pos, n, v->_id};
+        });
 
-            if(f->is_boundary()) continue;
+        parallel_for(0, faces.size(), 256, [&](size_t i) {
+            FaceCRef f = faces[i];
+            size_t out = offsets[i] * 3;
 
-            std::vector<Index> face_verts;
             HalfedgeCRef h = f->halfedge();
-            do {
-                face_verts.push_back(vref_to_idx[h->vertex()]);
-                h = h->next();
-            } while(h != f->halfedge());
-
-            assert(face_verts.size() >= 3);
-            for(size_t j = 1; j <= face_verts.size() - 2; j++) {
-                idxs.push_back((GL::Mesh::Index)face_verts[0]);
-                idxs.push_back((GL::Mesh::Index)face_verts[j]);
-                idxs.push_back((GL::Mesh::Index)face_verts[j + 1]);
+            GL::Mesh::Index i0 = (GL::Mesh::Index)id_to_idx.at(h->vertex()->id());
+            h = h->next();
+            GL::Mesh::Index i1 = (GL::Mesh::Index)id_to_idx.at(h->vertex()->id());
+            for(h = h->next(); h != f->halfedge(); h = h->next()) {
+                GL::Mesh::Index i2 = (GL::Mesh::Index)id_to_idx.at(h->vertex()->id());
+                idxs[out++] = i0;
+                idxs[out++] = i1;
+                idxs[out++] = i2;
+                i1 = i2;
             }
-        }
+        });
     }
-
-    mesh.recreate(std::move(verts), std::move(idxs));
 }
 
 void Halfedge_Mesh::mark_dirty() {
     render_dirty_flag = true;
+    dirty_local = false;
+    dirty_ids.clear();
+}
+
+void Halfedge_Mesh::mark_dirty(const Delta& delta) {
+
+    if(!render_dirty_flag) {
+        render_dirty_flag = dirty_local = true;
+        dirty_ids.clear();
+        dirty_new_from = UINT_MAX;
+    }
+    if(!dirty_local) return;
+
+    // Elements created by an operation still in progress are not recorded yet, but
+    // all have ids from begin_id on
+    for(const Delta::States* states : {&delta.before, &delta.after}) {
+        for(const auto& s : states->vertices) dirty_ids.push_back(s.id);
+        for(const auto& s : states->edges) dirty_ids.push_back(s.id);
+        for(const auto& s : states->faces) dirty_ids.push_back(s.id);
+        for(const auto& s : states->halfedges) dirty_ids.push_back(s.id);
+    }
+    dirty_new_from = std::min(dirty_new_from, delta.begin_id);
+}
+
+bool Halfedge_Mesh::take_dirty(std::vector<unsigned int>& ids, unsigned int& new_from) {
+    bool local = render_dirty_flag && dirty_local;
+    render_dirty_flag = dirty_local = false;
+    ids = std::move(dirty_ids);
+    dirty_ids.clear();
+    new_from = dirty_new_from;
+    return local;
 }
 
 std::optional<std::pair<Halfedge_Mesh::ElementRef, std::string>> Halfedge_Mesh::warnings() {
@@ -514,17 +712,251 @@ std::optional<std::pair<Halfedge_Mesh::ElementRef, std::string>> Halfedge_Mesh::
     return std::nullopt;
 }
 
+void Halfedge_Mesh::track_changes() {
+    tracking = true;
+    created.clear();
+}
+
+bool Halfedge_Mesh::erased(ElementRef elem) const {
+    return std::visit(overloaded{[&](VertexRef vert) { return verased.count(vert) > 0; },
+                                 [&](EdgeRef edge) { return eerased.count(edge) > 0; },
+                                 [&](FaceRef face) { return ferased.count(face) > 0; },
+                                 [&](HalfedgeRef halfedge) { return herased.count(halfedge) > 0; }},
+                      elem);
+}
+
+std::optional<std::pair<Halfedge_Mesh::ElementRef, std::string>>
+Halfedge_Mesh::validate_local(const std::vector<ElementRef>& changed) {
+
+    tracking = false;
+    checked.clear();
+
+    // The connectivity may be broken, so every walk gives up after visiting more
+    // halfedges than there are
+    size_t limit = halfedges.size();
+
+    // Gather the halfedges around the changed elements, then the rings around
+    // their vertices
+    std::unordered_set<HalfedgeRef> region;
+    auto add_vertex = [&](VertexRef v) {
+        HalfedgeRef h = v->halfedge();
+        size_t n = 0;
+        do {
+            region.insert(h);
+            region.insert(h->twin());
+            h = h->twin()->next();
+        } while(h != v->halfedge() && n++ < limit);
+    };
+    auto add_face = [&](FaceRef f) {
+        HalfedgeRef h = f->halfedge();
+        size_t n = 0;
+        do {
+            region.insert(h);
+            h = h->next();
+        } while(h != f->halfedge() && n++ < limit);
+    };
+    auto add = [&](ElementRef elem) {
+        std::visit(overloaded{[&](VertexRef vert) { add_vertex(vert); },
+                              [&](EdgeRef edge) {
+                                  region.insert(edge->halfedge());
+                                  region.insert(edge->halfedge()->twin());
+                              },
+                              [&](FaceRef face) { add_face(face); },
+                              [&](HalfedgeRef halfedge) {
+                                  region.insert(halfedge);
+                                  region.insert(halfedge->twin());
+                              }},
+                   elem);
+    };
+    for(const ElementRef& elem : changed) add(elem);
+    for(const ElementRef& elem : created) add(elem);
+    for(VertexRef v : verased) add_vertex(v);
+    for(EdgeRef e : eerased) add(e);
+    for(FaceRef f : ferased) add_face(f);
+    for(HalfedgeRef h : herased) region.insert(h);
+    created.clear();
+
+    std::vector<HalfedgeRef> seeds(region.begin(), region.end());
+    for(HalfedgeRef h : seeds) {
+        if(herased.find(h) == herased.end() && verased.find(h->vertex()) == verased.end()) {
+            add_vertex(h->vertex());
+        }
+    }
+
+    // The same checks as validate(), for the live elements of the region
+    std::unordered_map<VertexRef, std::unordered_set<HalfedgeRef>> v_accessible;
+    std::unordered_map<EdgeRef, std::unordered_set<HalfedgeRef>> e_accessible;
+    std::unordered_map<FaceRef, std::unordered_set<HalfedgeRef>> f_accessible;
+    std::unordered_set<HalfedgeRef> permutation;
+
+    for(HalfedgeRef h : region) {
+
+        if(herased.find(h) != herased.end()) continue;
+
+        if(herased.find(h->next()) != herased.end()) {
+            return {{h, "A live halfedge's next was erased!"}};
+        }
+        if(herased.find(h->twin()) != herased.end()) {
+            return {{h, "A live halfedge's twin was erased!"}};
+        }
+        if(verased.find(h->vertex()) != verased.end()) {
+            return {{h, "A live halfedge's vertex was erased!"}};
+        }
+        if(ferased.find(h->face()) != ferased.end()) {
+            return {{h, "A live halfedge's face was erased!"}};
+        }
+        if(eerased.find(h->edge()) != eerased.end()) {
+            return {{h, "A live halfedge's edge was erased!"}};
+        }
+
+        if(!permutation.insert(h->next()).second) {
+            return {{h->next(), "A halfedge is the next of multiple halfedges!"}};
+        }
+
+        v_accessible.insert({h->vertex(), {}});
+        e_accessible.insert({h->edge(), {}});
+        f_accessible.insert({h->face(), {}});
+    }
+
+    for(auto& [v, accessible] : v_accessible) {
+
+        Vec3 p = v->pos;
+        bool finite = std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z);
+        if(!finite) return {{v, "A vertex position was set to a non-finite value."}};
+
+        HalfedgeRef h = v->halfedge();
+        if(herased.find(h) != herased.end()) {
+            return {{v, "A vertex's halfedge is erased!"}};
+        }
+        do {
+            accessible.insert(h);
+            if(h->vertex() != v) {
+                std::stringstream ss;
+                ss << "A vertex's (" << v->id() << ") halfedge (" << h->id()
+                   << ") does not point to that vertex!";
+                return {{h, ss.str()}};
+            }
+            if(accessible.size() > limit) {
+                return {{v, "A vertex's halfedges do not form a loop!"}};
+            }
+            h = h->twin()->next();
+        } while(h != v->halfedge());
+        checked.push_back(v);
+    }
+
+    for(auto& [e, accessible] : e_accessible) {
+
+        HalfedgeRef h = e->halfedge();
+        if(herased.find(h) != herased.end()) {
+            return {{e, "An edge's halfedge is erased!"}};
+        }
+        do {
+            accessible.insert(h);
+            if(h->edge() != e) {
+                return {{h, "An edge's halfedge does not point to that edge!"}};
+            }
+            if(accessible.size() > 2) {
+                return {{e, "An edge's halfedges do not form a loop!"}};
+            }
+            h = h->twin();
+        } while(h != e->halfedge());
+    }
+
+    for(auto& [f, accessible] : f_accessible) {
+
+        HalfedgeRef h = f->halfedge();
+        if(herased.find(h) != herased.end()) {
+            return {{f, "A face's halfedge is erased!"}};
+        }
+        do {
+            accessible.insert(h);
+            if(h->face() != f) {
+                std::stringstream ss;
+                ss << "A face's (" << f->id() << ") halfedge (" << h->id()
+                   << ") does not point to that face!";
+                return {{h, ss.str()}};
+            }
+            if(accessible.size() > limit) {
+                return {{f, "A face's halfedges do not form a loop!"}};
+            }
+            h = h->next();
+        } while(h != f->halfedge());
+    }
+
+    for(HalfedgeRef h : region) {
+
+        if(herased.find(h) != herased.end()) continue;
+
+        if(h->twin() == h) {
+            return {{h, "A halfedge's twin is itself!"}};
+        }
+        if(h->twin()->twin() != h) {
+            return {{h, "A halfedge's twin's twin is not itself!"}};
+        }
+
+        if(v_accessible[h->vertex()].count(h) == 0) {
+            return {{h, "A halfedge is not accessible from its vertex!"}};
+        }
+        if(e_accessible[h->edge()].count(h) == 0) {
+            return {{h, "A halfedge is not accessible from its edge!"}};
+        }
+        if(f_accessible[h->face()].count(h) == 0) {
+            return {{h, "A halfedge is not accessible from its face!"}};
+        }
+    }
+
+    do_erase();
+    return std::nullopt;
+}
+
+std::optional<std::pair<Halfedge_Mesh::ElementRef, std::string>> Halfedge_Mesh::warnings_local() {
+
+    // Edges are compared around each endpoint, and positions against the vertices
+    // up to two edges away, since those are the ones local operations move together
+    for(VertexRef v : checked) {
+        std::unordered_set<unsigned int> neighbors;
+        HalfedgeRef h = v->halfedge();
+        do {
+            VertexRef u = h->twin()->vertex();
+            if(u == v) {
+                return {{h->edge(), "Edge wrapping single vertex."}};
+            }
+            if(!neighbors.insert(u->id()).second) {
+                return {{h->edge(), "Multiple edges across same vertices."}};
+            }
+            if(u->pos == v->pos) {
+                return {{v, "Vertices with identical positions."}};
+            }
+            HalfedgeRef g = u->halfedge();
+            do {
+                VertexRef w = g->twin()->vertex();
+                if(w != v && w->pos == v->pos) {
+                    return {{v, "Vertices with identical positions."}};
+                }
+                g = g->twin()->next();
+            } while(g != u->halfedge());
+            h = h->twin()->next();
+        } while(h != v->halfedge());
+    }
+
+    return std::nullopt;
+}
+
 void Halfedge_Mesh::do_erase() {
     for(auto& v : verased) {
+        unindex(v->id());
         vertices.erase(v);
     }
     for(auto& e : eerased) {
+        unindex(e->id());
         edges.erase(e);
     }
     for(auto& f : ferased) {
+        unindex(f->id());
         faces.erase(f);
     }
     for(auto& h : herased) {
+        unindex(h->id());
         halfedges.erase(h);
     }
     verased.clear();
@@ -533,447 +965,577 @@ void Halfedge_Mesh::do_erase() {
     herased.clear();
 }
 
-std::string Halfedge_Mesh::from_mesh(const GL::Mesh& mesh) {
+bool Halfedge_Mesh::fragmented() const {
+#ifdef SCOTTY3D_HALFEDGE_LISTS
+    return false;
+#else
+    // Erased elements leave holes in the pools, which only a copy reclaims, so
+    // repack once they take up a third of the storage
+    size_t holes = vertices.erased() + edges.erased() + faces.erased() + halfedges.erased();
+    size_t live = vertices.size() + edges.size() + faces.size() + halfedges.size();
+    return holes > live / 2;
+#endif
+}
 
-    auto idx = mesh.indices();
-    auto v = mesh.verts();
+void Halfedge_Mesh::compact() {
+    Halfedge_Mesh packed;
+    copy_to(packed);
+    packed.flip_orientation = flip_orientation;
+    *this = std::move(packed);
+}
 
-    std::vector<std::vector<Index>> polys;
-    std::vector<Vec3> verts(v.size());
+Halfedge_Mesh::Delta Halfedge_Mesh::begin_delta(const std::vector<ElementRef>& elems) {
+
+    do_erase();
 
-    for(size_t i = 0; i < idx.size(); i += 3) {
-        if(idx[i] != idx[i + 1] && idx[i] != idx[i + 2] && idx[i + 1] != idx[i + 2])
-            polys.push_back({idx[i], idx[i + 1], idx[i + 2]});
+    Delta delta;
+    delta.begin_id = next_id;
+
+    // The vertices of elems, then their neighbors
+    std::unordered_set<VertexRef> ring;
+    for(const ElementRef& elem : elems) {
+        std::visit(overloaded{[&](VertexRef vert) { ring.insert(vert); },
+                              [&](EdgeRef edge) {
+                                  ring.insert(edge->halfedge()->vertex());
+                                  ring.insert(edge->halfedge()->twin()->vertex());
+                              },
+                              [&](FaceRef face) {
+                                  HalfedgeRef h = face->halfedge();
+                                  do {
+                                      ring.insert(h->vertex());
+                                      h = h->next();
+                                  } while(h != face->halfedge());
+                              },
+                              [&](HalfedgeRef halfedge) {
+                                  ring.insert(halfedge->vertex());
+                                  ring.insert(halfedge->twin()->vertex());
+                              }},
+                   elem);
     }
-    for(size_t i = 0; i < v.size(); i++) {
-        verts[i] = v[i].pos;
+    std::vector<VertexRef> seeds(ring.begin(), ring.end());
+    for(VertexRef v : seeds) {
+        HalfedgeRef h = v->halfedge();
+        do {
+            ring.insert(h->twin()->vertex());
+            h = h->twin()->next();
+        } while(h != v->halfedge());
     }
 
-    std::string err = from_poly(polys, verts);
-    if(!err.empty()) return err;
+    // The faces around those, and everything on and across their halfedges
+    std::unordered_set<FaceRef> around;
+    for(VertexRef v : ring) {
+        HalfedgeRef h = v->halfedge();
+        do {
+            around.insert(h->face());
+            h = h->twin()->next();
+        } while(h != v->halfedge());
+    }
+    std::unordered_set<VertexRef> region_verts;
+    std::unordered_set<EdgeRef> region_edges;
+    std::unordered_set<FaceRef> region_faces;
+    std::unordered_set<HalfedgeRef> region_halfedges;
+    for(FaceRef f : around) {
+        HalfedgeRef h = f->halfedge();
+        do {
+            for(HalfedgeRef g : {h, h->twin()}) {
+                region_verts.insert(g->vertex());
+                region_edges.insert(g->edge());
+                region_faces.insert(g->face());
+                region_halfedges.insert(g);
+            }
+            h = h->next();
+        } while(h != f->halfedge());
+    }
 
-    auto valid = validate();
-    if(valid.has_value()) return valid.value().second;
+    for(VertexRef v : region_verts) record(delta.before, v);
+    for(EdgeRef e : region_edges) record(delta.before, e);
+    for(FaceRef f : region_faces) record(delta.before, f);
+    for(HalfedgeRef h : region_halfedges) record(delta.before, h);
+    return delta;
+}
 
-    return {};
+size_t Halfedge_Mesh::bytes() const {
+#ifdef SCOTTY3D_HALFEDGE_LISTS
+    // Each list node also holds two links
+    auto list = [](size_t n, size_t element) { return n * (element + 2 * sizeof(void*)); };
+    size_t total = list(vertices.size(), sizeof(Vertex)) + list(edges.size(), sizeof(Edge)) +
+                   list(faces.size(), sizeof(Face)) + list(halfedges.size(), sizeof(Halfedge));
+#else
+    size_t total = vertices.bytes() + edges.bytes() + faces.bytes() + halfedges.bytes();
+#endif
+    return total + dirty_ids.capacity() * sizeof(unsigned int);
 }
 
-bool Halfedge_Mesh::subdivide(SubD strategy) {
+size_t Halfedge_Mesh::Delta::bytes() const {
+    size_t total = sizeof(Delta);
+    for(const States* states : {&before, &after}) {
+        total += states->vertices.capacity() * sizeof(Vertex_State) +
+                 states->edges.capacity() * sizeof(Edge_State) +
+                 states->faces.capacity() * sizeof(Face_State) +
+                 states->halfedges.capacity() * sizeof(Halfedge_State);
+    }
+    return total;
+}
 
-    std::vector<std::vector<Index>> polys;
-    std::vector<Vec3> verts;
-    std::unordered_map<unsigned int, Index> layout;
+void Halfedge_Mesh::end_delta(Delta& delta) {
+    do_erase();
+    delta.after = changed_since(delta, true);
+    delta.end_id = next_id;
+}
 
-    switch(strategy) {
-    case SubD::linear: {
-        linear_subdivide_positions();
-    } break;
+void Halfedge_Mesh::rollback(const Delta& delta) {
 
-    case SubD::catmullclark: {
-        if(has_boundary()) return false;
-        catmullclark_subdivide_positions();
-    } break;
+    // The operation may have left the mesh broken, so only the ids of what it touched
+    // are looked at. Whatever it erased is either recreated or was created by it.
+    verased.clear();
+    eerased.clear();
+    ferased.clear();
+    herased.clear();
+    tracking = false;
+    created.clear();
+
+    restore(changed_since(delta, false), delta.before);
+}
+
+void Halfedge_Mesh::undo(const Delta& delta) {
+    restore(delta.after, delta.before);
+}
+
+void Halfedge_Mesh::redo(const Delta& delta) {
+    restore(delta.before, delta.after);
+    next_id = std::max(next_id, delta.end_id);
+}
+
+void Halfedge_Mesh::record(Delta::States& states, ElementCRef elem) {
+    std::visit(overloaded{[&](VertexCRef v) {
+                              states.vertices.push_back({v->id(), v->halfedge()->id(), v->pos});
+                          },
+                          [&](EdgeCRef e) {
+                              states.edges.push_back({e->id(), e->halfedge()->id()});
+                          },
+                          [&](FaceCRef f) {
+                              states.faces.push_back(
+                                  {f->id(), f->halfedge()->id(), f->is_boundary()});
+                          },
+                          [&](HalfedgeCRef h) {
+                              states.halfedges.push_back({h->id(), h->twin()->id(),
+                                                          h->next()->id(), h->vertex()->id(),
+                                                          h->edge()->id(), h->face()->id()});
+                          }},
+               elem);
+}
 
-    case SubD::loop: {
-        if(has_boundary()) return false;
-        for(FaceRef f = faces_begin(); f != faces_end(); f++) {
-            if(f->degree() != 3) return false;
+Halfedge_Mesh::Delta::States Halfedge_Mesh::changed_since(const Delta& delta, bool links) {
+
+    // The recorded elements and those created since are found by id, so this only
+    // costs as much as the operation changed
+    Delta::States states;
+    auto add = [&](unsigned int id) {
+        std::optional<ElementRef> elem = element(id);
+        if(!elem.has_value()) return;
+        if(links) {
+            std::visit([&](auto ref) { record(states, ref); }, *elem);
+            return;
         }
-        loop_subdivide();
-        return true;
-    } break;
+        std::visit(overloaded{[&](VertexRef) { states.vertices.push_back({id}); },
+                              [&](EdgeRef) { states.edges.push_back({id}); },
+                              [&](FaceRef) { states.faces.push_back({id}); },
+                              [&](HalfedgeRef) { states.halfedges.push_back({id}); }},
+                   *elem);
+    };
+    for(const auto& s : delta.before.vertices) add(s.id);
+    for(const auto& s : delta.before.edges) add(s.id);
+    for(const auto& s : delta.before.faces) add(s.id);
+    for(const auto& s : delta.before.halfedges) add(s.id);
+    for(unsigned int id = delta.begin_id; id < next_id; id++) add(id);
+    return states;
+}
 
-    default: assert(false);
-    }
+void Halfedge_Mesh::restore(const Delta::States& from, const Delta::States& to) {
 
-    Index idx = 0;
-    size_t nV = vertices.size();
-    size_t nE = edges.size();
-    size_t nF = faces.size() - n_boundaries();
-    verts.resize(nV + nE + nF);
+    do_erase();
 
-    for(VertexRef v = vertices_begin(); v != vertices_end(); v++, idx++) {
-        verts[idx] = v->new_pos;
-        layout[v->id()] = idx;
+    // Mark the elements to has
+    unsigned int bound = next_id;
+    auto grow = [&](const Delta::States& states) {
+        for(const auto& s : states.vertices) bound = std::max(bound, s.id + 1);
+        for(const auto& s : states.edges) bound = std::max(bound, s.id + 1);
+        for(const auto& s : states.faces) bound = std::max(bound, s.id + 1);
+        for(const auto& s : states.halfedges) bound = std::max(bound, s.id + 1);
+    };
+    grow(from);
+    grow(to);
+    std::vector<bool> kept(bound);
+    for(const auto& s : to.vertices) kept[s.id] = true;
+    for(const auto& s : to.edges) kept[s.id] = true;
+    for(const auto& s : to.faces) kept[s.id] = true;
+    for(const auto& s : to.halfedges) kept[s.id] = true;
+
+    // Erase what only from has, and create what to has that is missing
+    auto drop = [&](auto& list, const auto& states) {
+        using Ref = decltype(list.begin());
+        for(const auto& s : states) {
+            std::optional<ElementRef> elem = element(s.id);
+            if(kept[s.id] || !elem.has_value()) continue;
+            list.erase(std::get<Ref>(*elem));
+            unindex(s.id);
+        }
+    };
+    drop(vertices, from.vertices);
+    drop(edges, from.edges);
+    drop(faces, from.faces);
+    drop(halfedges, from.halfedges);
+
+    for(const auto& s : to.vertices) {
+        if(!element(s.id)) index(s.id, vertices.insert(vertices.end(), Vertex(s.id)));
     }
-    for(EdgeRef e = edges_begin(); e != edges_end(); e++, idx++) {
-        verts[idx] = e->new_pos;
-        layout[e->id()] = idx;
+    for(const auto& s : to.edges) {
+        if(!element(s.id)) index(s.id, edges.insert(edges.end(), Edge(s.id)));
     }
-    for(FaceRef f = faces_begin(); f != faces_end(); f++) {
-        if(f->is_boundary()) continue;
-        verts[idx] = f->new_pos;
-        layout[f->id()] = idx;
-        idx++;
+    for(const auto& s : to.faces) {
+        if(!element(s.id)) index(s.id, faces.insert(faces.end(), Face(s.id, s.boundary)));
+    }
+    for(const auto& s : to.halfedges) {
+        if(!element(s.id)) index(s.id, halfedges.insert(halfedges.end(), Halfedge(s.id)));
     }
 
-    for(auto f = faces_begin(); f != faces_end(); f++) {
-        if(f->is_boundary()) continue;
-        Index i = layout[f->id()];
-        HalfedgeRef h = f->halfedge();
-        do {
-            Index j = layout[h->edge()->id()];
-            Index k = layout[h->next()->vertex()->id()];
-            Index l = layout[h->next()->edge()->id()];
-            std::vector<Index> quad = {i, j, k, l};
-            polys.push_back(quad);
-            h = h->next();
-        } while(h != f->halfedge());
+    // Relink them
+    auto find = [this](auto ref, unsigned int id) {
+        std::optional<ElementRef> elem = element(id);
+        assert(elem.has_value());
+        return std::get<decltype(ref)>(*elem);
+    };
+    for(const auto& s : to.vertices) {
+        VertexRef v = find(VertexRef{}, s.id);
+        v->pos = s.pos;
+        v->halfedge() = find(HalfedgeRef{}, s.halfedge);
+    }
+    for(const auto& s : to.edges) {
+        find(EdgeRef{}, s.id)->halfedge() = find(HalfedgeRef{}, s.halfedge);
+    }
+    for(const auto& s : to.faces) {
+        FaceRef f = find(FaceRef{}, s.id);
+        f->halfedge() = find(HalfedgeRef{}, s.halfedge);
+        f->boundary = s.boundary;
+    }
+    for(const auto& s : to.halfedges) {
+        find(HalfedgeRef{}, s.id)
+            ->set_neighbors(find(HalfedgeRef{}, s.next), find(HalfedgeRef{}, s.twin),
+                            find(VertexRef{}, s.vertex), find(EdgeRef{}, s.edge),
+                            find(FaceRef{}, s.face));
     }
 
-    from_poly(polys, verts);
-    return true;
+    Delta touched;
+    touched.before = from;
+    touched.after = to;
+    touched.begin_id = bound;
+    mark_dirty(touched);
 }
 
-std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& polygons,
-                                     const std::vector<Vec3>& verts) {
+std::string Halfedge_Mesh::from_mesh(const GL::Mesh& mesh) {
 
-    // This method initializes the halfedge data structure from a raw list of
-    // polygons, where each input polygon is specified as a list of vertex indices.
-    // The input must describe a manifold, oriented surface, where the orientation
-    // of a polygon is determined by the order of vertices in the list. Polygons
-    // must have at least three vertices.  Note that there are no special conditions
-    // on the vertex indices, i.e., they do not have to start at 0 or 1, nor does
-    // the collection of indices have to be contiguous.  Overall, this initializer
-    // is designed to be robust but perhaps not incredibly fast (though of course
-    // this does not affect the performance of the resulting data structure).  One
-    // could also implement faster initializers that handle important special cases
-    // (e.g., all triangles, or data that is known to be manifold). Since there are
-    // no strong conditions on the indices of polygons, we assume that the list of
-    // vertex positions is given in lexicographic order (i.e., that the lowest index
-    // appearing in any polygon corresponds to the first entry of the list of
-    // positions and so on).
-
-    // define some types, to improve readability
-    typedef std::vector<Index> IndexList;
-    typedef IndexList::const_iterator IndexListCRef;
-    typedef std::vector<IndexList> PolygonList;
-    typedef PolygonList::const_iterator PolygonListCRef;
-    typedef std::pair<Index, Index> IndexPair; // ordered pair of vertex indices,
-                                               // corresponding to an edge of an
-                                               // oriented polygon
+    auto idx = mesh.indices();
+    auto v = mesh.verts();
 
-    // Clear any existing elements.
-    clear();
+    std::vector<Index> face_start, corners;
+    std::vector<Vec3> verts(v.size());
 
-    // Since the vertices in our halfedge mesh are stored in a linked list,
-    // we will temporarily need to keep track of the correspondence between
-    // indices of vertices in our input and pointers to vertices in the new
-    // mesh (which otherwise can't be accessed by index).  Note that since
-    // we're using a general-purpose map (rather than, say, a vector), we can
-    // be a bit more flexible about the indexing scheme: input vertex indices
-    // aren't required to be 0-based or 1-based; in fact, the set of indices
-    // doesn't even have to be contiguous.  Taking advantage of this fact makes
-    // our conversion a bit more robust to different types of input, including
-    // data that comes from a subset of a full mesh.
-
-    // maps a vertex index to the corresponding vertex
-    std::map<Index, VertexRef> indexToVertex;
-
-    // Also store the vertex degree, i.e., the number of polygons that use each
-    // vertex; this information will be used to check that the mesh is manifold.
-    std::map<VertexRef, Size> vertexDegree;
-
-    // First, we do some basic sanity checks on the input.
-    for(PolygonListCRef p = polygons.begin(); p != polygons.end(); p++) {
-        if(p->size() < 3) {
-            // Refuse to build the mesh if any of the polygons have fewer than three
-            // vertices.(Note that if we omit this check the code will still
-            // constructsomething fairlymeaningful for 1- and 2-point polygons, but
-            // enforcing this stricter requirement on the input will help simplify code
-            // further downstream, since it can be certain it doesn't have to check for
-            // these rather degenerate cases.)
-            return "Each polygon must have at least three vertices.";
+    face_start.reserve(idx.size() / 3 + 1);
+    corners.reserve(idx.size());
+    face_start.push_back(0);
+    for(size_t i = 0; i + 2 < idx.size(); i += 3) {
+        if(idx[i] != idx[i + 1] && idx[i] != idx[i + 2] && idx[i + 1] != idx[i + 2]) {
+            corners.insert(corners.end(), {idx[i], idx[i + 1], idx[i + 2]});
+            face_start.push_back(corners.size());
         }
+    }
+    parallel_for(0, v.size(), 4096, [&](size_t i) { verts[i] = v[i].pos; });
 
-        // We want to count the number of distinct vertex indices in this
-        // polygon, to make sure it's the same as the number of vertices
-        // in the polygon---if they disagree, then the polygon is not valid
-        // (or at least, for simplicity we don't handle polygons of this type!).
-        std::set<Index> polygonIndices;
-
-        // loop over polygon vertices
-        for(IndexListCRef i = p->begin(); i != p->end(); i++) {
-            polygonIndices.insert(*i);
-
-            // allocate one vertex for each new index we encounter
-            if(indexToVertex.find(*i) == indexToVertex.end()) {
-                VertexRef v = new_vertex();
-                v->halfedge() = halfedges.end(); // this vertex doesn't yet point to any halfedge
-                indexToVertex[*i] = v;
-                vertexDegree[v] = 1; // we've now seen this vertex only once
-            } else {
-                // keep track of the number of times we've seen this vertex
-                vertexDegree[indexToVertex[*i]]++;
-            }
-        } // end loop over polygon vertices
-
-        // check that all vertices of the current polygon are distinct
-        Size degree = p->size(); // number of vertices in this polygon
-        if(polygonIndices.size() < degree) {
-            std::stringstream stream;
-            stream << "One of the input polygons does not have distinct vertices!" << std::endl;
-            stream << "(vertex indices:";
-            for(IndexListCRef i = p->begin(); i != p->end(); i++) {
-                stream << " " << *i;
-            }
-            stream << ")" << std::endl;
-            return stream.str();
-        } // end check that polygon vertices are distinct
-
-    } // end basic sanity checks on input
-
-    // The number of faces is just the number of polygons in the input.
-    Size nFaces = polygons.size();
-    for(Size i = 0; i < nFaces; i++) new_face();
-
-    // We will store a map from ordered pairs of vertex indices to
-    // the corresponding halfedge object in our new (halfedge) mesh;
-    // this map gets constructed during the next loop over polygons.
-    std::map<IndexPair, HalfedgeRef> pairToHalfedge;
-
-    // Next, we actually build the halfedge connectivity by again looping over
-    // polygons
-    PolygonListCRef p;
-    FaceRef f;
-    for(p = polygons.begin(), f = faces.begin(); p != polygons.end(); p++, f++) {
-
-        std::vector<HalfedgeRef> faceHalfedges; // cyclically ordered list of the half
-                                                // edges of this face
-        Size degree = p->size();                // number of vertices in this polygon
-
-        // loop over the halfedges of this face (equivalently, the ordered pairs of
-        // consecutive vertices)
-        for(Index i = 0; i < degree; i++) {
-
-            Index a = (*p)[i];                // current index
-            Index b = (*p)[(i + 1) % degree]; // next index, in cyclic order
-            IndexPair ab(a, b);
-            HalfedgeRef hab;
-
-            // check if this halfedge already exists; if so, we have a problem!
-            if(pairToHalfedge.find(ab) != pairToHalfedge.end()) {
-                std::stringstream stream;
-                stream << "Found multiple oriented edges with indices (" << a << ", " << b << ")."
-                       << std::endl;
-                stream << "This means that either (i) more than two faces contain this "
-                          "edge (hence the surface is nonmanifold), or"
-                       << std::endl;
-                stream << "(ii) there are exactly two faces containing this edge, but "
-                          "they have the same orientation (hence the surface is"
-                       << std::endl;
-                stream << "not consistently oriented." << std::endl;
-                return stream.str();
-            } else // otherwise, the halfedge hasn't been allocated yet
-            {
-                // so, we point this vertex pair to a new halfedge
-                hab = new_halfedge();
-                pairToHalfedge[ab] = hab;
-
-                // link the new halfedge to its face
-                hab->face() = f;
-                hab->face()->halfedge() = hab;
-
-                // also link it to its starting vertex
-                hab->vertex() = indexToVertex[a];
-                hab->vertex()->halfedge() = hab;
-
-                // keep a list of halfedges in this face, so that we can later
-                // link them together in a loop (via their "next" pointers)
-                faceHalfedges.push_back(hab);
-            }
-
-            // Also, check if the twin of this halfedge has already been constructed
-            // (during construction of a different face).  If so, link the twins
-            // together and allocate their shared halfedge.  By the end of this pass
-            // over polygons, the only halfedges that will not have a twin will hence
-            // be those that sit along the domain boundary.
-            IndexPair ba(b, a);
-            std::map<IndexPair, HalfedgeRef>::iterator iba = pairToHalfedge.find(ba);
-            if(iba != pairToHalfedge.end()) {
-                HalfedgeRef hba = iba->second;
-
-                // link the twins
-                hab->twin() = hba;
-                hba->twin() = hab;
-
-                // allocate and link their edge
-                EdgeRef e = new_edge();
-                hab->edge() = e;
-                hba->edge() = e;
-                e->halfedge() = hab;
-            } else { // If we didn't find a twin...
-                // ...mark this halfedge as being twinless by pointing
-                // it to the end of the list of halfedges. If it remains
-                // twinless by the end of the current loop over polygons,
-                // it will be linked to a boundary face in the next pass.
-                hab->twin() = halfedges.end();
-            }
-        } // end loop over the current polygon's halfedges
+    std::string err = from_flat(face_start, corners, verts);
+    if(!err.empty()) return err;
 
-        // Now that all the halfedges of this face have been allocated,
-        // we can link them together via their "next" pointers.
-        for(Index i = 0; i < degree; i++) {
-            Index j = (i + 1) % degree; // index of the next halfedge, in cyclic order
-            faceHalfedges[i]->next() = faceHalfedges[j];
-        }
+    auto valid = validate();
+    if(valid.has_value()) return valid.value().second;
 
-    } // done building basic halfedge connectivity
+    return {};
+}
 
-    // For each vertex on the boundary, advance its halfedge pointer to one that
-    // is also on the boundary.
-    for(VertexRef v = vertices_begin(); v != vertices_end(); v++) {
-        // loop over halfedges around vertex
-        HalfedgeRef h = v->halfedge();
-        do {
-            if(h->twin() == halfedges.end()) {
-                v->halfedge() = h;
-                break;
-            }
+std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& polygons,
+                                     const std::vector<Vec3>& verts) {
 
-            h = h->twin()->next();
-        } while(h != v->halfedge()); // end loop over halfedges around vertex
-
-    } // done advancing halfedge pointers for boundary vertices
-
-    // Next we construct new faces for each boundary component.
-    for(HalfedgeRef h = halfedges_begin(); h != halfedges_end(); h++) // loop over all halfedges
-    {
-        // Any halfedge that does not yet have a twin is on the boundary of the
-        // domain. If we follow the boundary around long enough we will of course
-        // eventually make a closed loop; we can represent this boundary loop by a
-        // new face. To make clear the distinction between faces and boundary loops,
-        // the boundary face will (i) have a flag indicating that it is a boundary
-        // loop, and (ii) be stored in a list of boundaries, rather than the usual
-        // list of faces.  The reason we need the both the flag *and* the separate
-        // list is that faces are often accessed in two fundamentally different
-        // ways: either by (i) local traversal of the neighborhood of some mesh
-        // element using the halfedge structure, or (ii) global traversal of all
-        // faces (or boundary loops).
-        if(h->twin() == halfedges.end()) {
-            FaceRef b = new_face(true);
-            // keep a list of halfedges along the boundary, so we can link them together
-            std::vector<HalfedgeRef> boundaryHalfedges;
-
-            // We now need to walk around the boundary, creating new
-            // halfedges and edges along the boundary loop as we go.
-            HalfedgeRef i = h;
-            do {
-                // create a twin, which becomes a halfedge of the boundary loop
-                HalfedgeRef t = new_halfedge();
-                // keep a list of all boundary halfedges, in cyclic order
-                boundaryHalfedges.push_back(t);
-                i->twin() = t;
-                t->twin() = i;
-                t->face() = b;
-                t->vertex() = i->next()->vertex();
-
-                // create the shared edge
-                EdgeRef e = new_edge();
-                e->halfedge() = i;
-                i->edge() = e;
-                t->edge() = e;
-
-                // Advance i to the next halfedge along the current boundary loop
-                // by walking around its target vertex and stopping as soon as we
-                // find a halfedge that does not yet have a twin defined.
-                i = i->next();
-                while(i != h && // we're done if we end up back at the beginning of
-                                // the loop
-                      i->twin() != halfedges.end()) // otherwise, we're looking for
-                                                    // the next twinless halfedge
-                                                    // along the loop
-                {
-                    i = i->twin();
-                    i = i->next();
-                }
-            } while(i != h);
-
-            b->halfedge() = boundaryHalfedges.front();
-
-            // The only pointers that still need to be set are the "next" pointers of
-            // the twins; these we can set from the list of boundary halfedges, but we
-            // must use the opposite order from the order in the list, since the
-            // orientation of the boundary loop is opposite the orientation of the
-            // halfedges "inside" the domain boundary.
-            Size degree = boundaryHalfedges.size();
-            for(Index id = 0; id < degree; id++) {
-                Index q = (id - 1 + degree) % degree;
-                boundaryHalfedges[id]->next() = boundaryHalfedges[q];
-            }
-        } // end construction of one of the boundary loops
+    std::vector<Index> face_start, corners;
+    face_start.reserve(polygons.size() + 1);
+    face_start.push_back(0);
+    for(const auto& p : polygons) {
+        corners.insert(corners.end(), p.begin(), p.end());
+        face_start.push_back(corners.size());
+    }
+    return from_flat(face_start, corners, verts);
+}
 
-        // Note that even though we are looping over all halfedges, we will still
-        // construct the appropriate number of boundary loops (and not, say, one
-        // loop per boundary halfedge).  The reason is that as we continue to
-        // iterate through halfedges, we check whether their twin has been assigned,
-        // and since new twins may have been assigned earlier in this loop, we will
-        // end up skipping many subsequent halfedges.
+std::string Halfedge_Mesh::from_flat(const std::vector<Index>& face_start,
+                                     const std::vector<Index>& corners,
+                                     const std::vector<Vec3>& verts) {
 
-    } // done adding "virtual" faces corresponding to boundary loops
+    // This method initializes the halfedge data structure from a list of polygons,
+    // where polygon f is given by the vertex indices corners[face_start[f]] up to
+    // corners[face_start[f + 1] - 1]. The input must describe a manifold, oriented
+    // surface, where the orientation of a polygon is determined by the order of its
+    // vertices, and every polygon must have at least three distinct vertices. The
+    // indices do not have to start at 0 or 1, nor be contiguous: the list of vertex
+    // positions is taken to be in order of index (i.e., the lowest index appearing
+    // in any polygon gets the first position, and so on).
+    //
+    // Every corner of a polygon becomes a halfedge. Twins are found by sorting the
+    // corners by the (unordered) pair of vertices of the edge leaving them, which
+    // also counts the edges and boundary halfedges, so every element is created up
+    // front and the connectivity is linked in parallel.
+
+    constexpr Index none = std::numeric_limits<Index>::max();
 
-    // To make later traversal of the mesh easier, we will now advance the
-    // halfedge
-    // associated with each vertex such that it refers to the *first* non-boundary
-    // halfedge, rather than the last one.
-    for(VertexRef v = vertices_begin(); v != vertices_end(); v++) {
-        v->halfedge() = v->halfedge()->twin()->next();
-    }
+    // Clear any existing elements.
+    clear();
 
-    // Finally, we check that all vertices are manifold.
-    for(VertexRef v = vertices.begin(); v != vertices.end(); v++) {
-        // First check that this vertex is not a "floating" vertex;
-        // if it is then we do not have a valid 2-manifold surface.
-        if(v->halfedge() == halfedges.end()) {
-            return "Some vertices are not referenced by any polygon.";
+    size_t F = face_start.empty() ? 0 : face_start.size() - 1;
+    size_t C = corners.size();
+
+    // Refuse to build the mesh if any polygon has fewer than three vertices, or
+    // repeats one; find the first such polygon.
+    auto degenerate = [&](size_t f) {
+        Index b = face_start[f], e = face_start[f + 1];
+        if(e - b < 3) return true;
+        for(Index i = b; i < e; i++) {
+            for(Index j = i + 1; j < e; j++) {
+                if(corners[i] == corners[j]) return true;
+            }
         }
-
-        // Next, check that the number of halfedges emanating from this vertex in
-        // our half edge data structure equals the number of polygons containing
-        // this vertex, which we counted during our first pass over the mesh.  If
-        // not, then our vertex is not a "fan" of polygons, but instead has some
-        // other (nonmanifold) structure.
-        Size count = 0;
-        HalfedgeRef h = v->halfedge();
-        do {
-            if(!h->face()->is_boundary()) {
-                count++;
+        return false;
+    };
+    size_t bad = parallel_reduce(
+        0, F, 1024, none,
+        [&](size_t b, size_t e) {
+            for(size_t f = b; f < e; f++) {
+                if(degenerate(f)) return f;
             }
-            h = h->twin()->next();
-        } while(h != v->halfedge());
+            return none;
+        },
+        [](size_t a, size_t b) { return std::min(a, b); });
+    if(bad != none) {
+        if(face_start[bad + 1] - face_start[bad] < 3) {
+            return "Each polygon must have at least three vertices.";
+        }
+        std::stringstream stream;
+        stream << "One of the input polygons does not have distinct vertices!" << std::endl;
+        stream << "(vertex indices:";
+        for(Index i = face_start[bad]; i < face_start[bad + 1]; i++) {
+            stream << " " << corners[i];
+        }
+        stream << ")" << std::endl;
+        return stream.str();
+    }
 
-        Size cmp = vertexDegree[v];
-        if(count != cmp) {
-            return "At least one of the vertices is nonmanifold.";
+    // Number the vertices in order of index. Indices are usually (nearly) contiguous,
+    // so look them up in a flat table unless they are spread too thin.
+    std::vector<Index> vertex_of(C);
+    size_t V = 0;
+    Index max_index = parallel_reduce(
+        0, C, 4096, Index(0),
+        [&](size_t b, size_t e) {
+            Index m = 0;
+            for(size_t c = b; c < e; c++) m = std::max(m, corners[c]);
+            return m;
+        },
+        [](Index a, Index b) { return std::max(a, b); });
+    if(C > 0 && max_index < verts.size() + C) {
+        std::vector<Index> dense(max_index + 1, none);
+        for(Index i : corners) dense[i] = 0;
+        for(Index& d : dense) {
+            if(d != none) d = V++;
         }
-    } // end loop over vertices
+        parallel_for(0, C, 4096, [&](size_t c) { vertex_of[c] = dense[corners[c]]; });
+    } else if(C > 0) {
+        std::vector<Index> used(corners);
+        parallel_sort(used.begin(), used.end());
+        used.erase(std::unique(used.begin(), used.end()), used.end());
+        V = used.size();
+        parallel_for(0, C, 4096, [&](size_t c) {
+            vertex_of[c] = std::lower_bound(used.begin(), used.end(), corners[c]) - used.begin();
+        });
+    }
 
-    // Now that we have the connectivity, we copy the list of vertex
-    // positions into member variables of the individual vertices.
-    if(verts.size() < vertices.size()) {
+    if(verts.size() < V) {
         std::stringstream stream;
         stream
             << "The number of vertex positions is different from the number of distinct vertices!"
             << std::endl;
         stream << "(number of positions in input: " << verts.size() << ")" << std::endl;
-        stream << "(number of vertices in mesh: " << vertices.size() << ")" << std::endl;
+        stream << "(number of vertices in mesh: " << V << ")" << std::endl;
         return stream.str();
     }
 
-    // Since an STL map internally sorts its keys, we can iterate over the map
-    // from vertex indices to vertex iterators to visit our (input) vertices in
-    // lexicographic order
-    int i = 0;
-    for(std::map<Index, VertexRef>::const_iterator e = indexToVertex.begin();
-        e != indexToVertex.end(); e++) {
-        // grab a pointer to the vertex associated with the current key (i.e., the
-        // current index)
-        VertexRef v = e->second;
+    std::vector<Index> corner_face(C);
+    parallel_for(0, F, 1024, [&](size_t f) {
+        for(Index c = face_start[f]; c < face_start[f + 1]; c++) corner_face[c] = f;
+    });
+    auto next = [&](Index c) {
+        Index f = corner_face[c];
+        return c + 1 == face_start[f + 1] ? face_start[f] : c + 1;
+    };
+
+    // Sort the corners by edge; the corners of an edge end up next to each other
+    struct Corner_Key {
+        Index lo, hi, corner;
+        bool operator<(const Corner_Key& k) const {
+            if(lo != k.lo) return lo < k.lo;
+            if(hi != k.hi) return hi < k.hi;
+            return corner < k.corner;
+        }
+    };
+    std::vector<Corner_Key> keys(C);
+    parallel_for(0, C, 4096, [&](size_t c) {
+        Index a = vertex_of[c], b = vertex_of[next(c)];
+        keys[c] = {std::min(a, b), std::max(a, b), c};
+    });
+    parallel_sort(keys.begin(), keys.end());
+
+    // Pair up twins. An edge with more than two corners, or with two leaving the
+    // same vertex, has an oriented edge repeated.
+    std::vector<Index> twin(C, none), edge_of(C);
+    size_t E = 0;
+    for(size_t i = 0; i < C;) {
+        size_t j = i + 1;
+        while(j < C && keys[j].lo == keys[i].lo && keys[j].hi == keys[i].hi) j++;
+        Index c0 = keys[i].corner, c1 = j - i > 1 ? keys[i + 1].corner : none;
+        if(j - i > 2 || (c1 != none && vertex_of[c0] == vertex_of[c1])) {
+            if(j - i > 2 && vertex_of[c0] != vertex_of[c1]) c0 = keys[i + 2].corner;
+            Index a = corners[c0], b = corners[next(c0)];
+            std::stringstream stream;
+            stream << "Found multiple oriented edges with indices (" << a << ", " << b << ")."
+                   << std::endl;
+            stream << "This means that either (i) more than two faces contain this "
+                      "edge (hence the surface is nonmanifold), or"
+                   << std::endl;
+            stream << "(ii) there are exactly two faces containing this edge, but "
+                      "they have the same orientation (hence the surface is"
+                   << std::endl;
+            stream << "not consistently oriented." << std::endl;
+            return stream.str();
+        }
+        edge_of[c0] = E;
+        if(c1 != none) {
+            twin[c0] = c1;
+            twin[c1] = c0;
+            edge_of[c1] = E;
+        }
+        E++;
+        i = j;
+    }
+
+    // Corners without a twin are on the boundary; each gets a twin in a boundary
+    // loop. Around a manifold vertex on the boundary, exactly one leaves and one
+    // arrives, and the boundary halfedge after the twin of corner c is the twin of
+    // the one arriving where c leaves.
+    std::vector<Index> boundary, boundary_of(C, none);
+    std::vector<Index> boundary_out(V, none), boundary_in(V, none);
+    for(Index c = 0; c < C; c++) {
+        if(twin[c] != none) continue;
+        Index a = vertex_of[c], b = vertex_of[next(c)];
+        if(boundary_out[a] != none || boundary_in[b] != none) {
+            return "At least one of the vertices is nonmanifold.";
+        }
+        boundary_of[c] = boundary.size();
+        boundary_out[a] = boundary_in[b] = boundary.size();
+        boundary.push_back(c);
+    }
+    size_t B = boundary.size();
+    for(Index v = 0; v < V; v++) {
+        if((boundary_out[v] == none) != (boundary_in[v] == none)) {
+            return "At least one of the vertices is nonmanifold.";
+        }
+    }
+
+    // Each vertex starts from the last corner leaving it, or from the one on the
+    // boundary, and its number of polygons is checked against its ring below
+    std::vector<Index> vertex_corner(V), vertex_degree(V, 0);
+    for(Index c = 0; c < C; c++) {
+        vertex_corner[vertex_of[c]] = c;
+        vertex_degree[vertex_of[c]]++;
+    }
+    for(Index v = 0; v < V; v++) {
+        if(boundary_out[v] != none) vertex_corner[v] = boundary[boundary_out[v]];
+    }
 
-        // set the att of this vertex to the corresponding
-        // position in the input
-        v->pos = verts[i];
-        i++;
+    // Create every element
+    std::vector<VertexRef> vs(V);
+    std::vector<FaceRef> fs(F);
+    std::vector<EdgeRef> es(E);
+    std::vector<HalfedgeRef> hs(C + B);
+    for(Index v = 0; v < V; v++) {
+        vs[v] = new_vertex();
+        vs[v]->pos = verts[v];
     }
+    for(auto& f : fs) f = new_face();
+    for(auto& e : es) e = new_edge();
+    for(auto& h : hs) h = new_halfedge();
+
+    // Boundary loops, following the boundary halfedges around
+    std::vector<FaceRef> boundary_face(B);
+    std::vector<bool> visited(B, false);
+    for(Index k = 0; k < B; k++) {
+        if(visited[k]) continue;
+        FaceRef face = new_face(true);
+        face->halfedge() = hs[C + k];
+        for(Index i = k; !visited[i]; i = boundary_in[vertex_of[boundary[i]]]) {
+            visited[i] = true;
+            boundary_face[i] = face;
+        }
+    }
+
+    // Link everything
+    parallel_for(0, F, 1024, [&](size_t f) { fs[f]->halfedge() = hs[face_start[f]]; });
+    parallel_for(0, C, 4096, [&](size_t c) {
+        HalfedgeRef h = hs[c];
+        h->next() = hs[next(c)];
+        h->twin() = twin[c] != none ? hs[twin[c]] : hs[C + boundary_of[c]];
+        h->vertex() = vs[vertex_of[c]];
+        h->edge() = es[edge_of[c]];
+        h->face() = fs[corner_face[c]];
+        if(twin[c] == none || c < twin[c]) es[edge_of[c]]->halfedge() = h;
+    });
+    parallel_for(0, B, 4096, [&](size_t k) {
+        Index c = boundary[k];
+        HalfedgeRef t = hs[C + k];
+        t->next() = hs[C + boundary_in[vertex_of[c]]];
+        t->twin() = hs[c];
+        t->vertex() = vs[vertex_of[next(c)]];
+        t->edge() = es[edge_of[c]];
+        t->face() = boundary_face[k];
+    });
+
+    // To make later traversal of the mesh easier, each vertex refers to the
+    // halfedge after the twin of its starting corner
+    parallel_for(0, V, 4096, [&](size_t v) {
+        vs[v]->halfedge() = hs[vertex_corner[v]]->twin()->next();
+    });
+
+    // Finally, check that all vertices are manifold: if the polygons around a
+    // vertex do not form a single fan, walking around it will not find them all
+    size_t nonmanifold = parallel_reduce(
+        0, V, 1024, size_t(0),
+        [&](size_t b, size_t e) {
+            for(size_t v = b; v < e; v++) {
+                Size count = 0;
+                HalfedgeRef h = vs[v]->halfedge();
+                do {
+                    if(!h->face()->is_boundary()) count++;
+                    h = h->twin()->next();
+                } while(h != vs[v]->halfedge());
+                if(count != vertex_degree[v]) return size_t(1);
+            }
+            return size_t(0);
+        },
+        [](size_t a, size_t b) { return a + b; });
+    if(nonmanifold) return "At least one of the vertices is nonmanifold.";
+
     return {};
 }
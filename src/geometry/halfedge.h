@@ -127,6 +127,8 @@
 
 #pragma once
 
+#include <algorithm>
+#include <limits>
 #include <list>
 #include <optional>
 #include <set>
@@ -135,6 +137,7 @@
 #include <vector>
 
 #include "../platform/gl.h"
+#include "element_pool.h"
 
 // Types of sub-division
 enum class SubD { linear, catmullclark, loop };
@@ -159,14 +162,21 @@ public:
     class Halfedge;
 
     /*
-        Rather than using raw pointers to mesh elements, we store references
-        as STL::iterators---for convenience, we give shorter names to these
-        iterators (e.g., EdgeRef instead of list<Edge>::iterator).
-    */
-    using VertexRef = std::list<Vertex>::iterator;
-    using EdgeRef = std::list<Edge>::iterator;
-    using FaceRef = std::list<Face>::iterator;
-    using HalfedgeRef = std::list<Halfedge>::iterator;
+        Elements are stored in Element_Pools (see element_pool.h), which keep them
+        in contiguous blocks, or in std::lists if SCOTTY3D_HALFEDGE_LISTS is defined.
+        Either way, rather than using raw pointers to mesh elements, we store
+        references as STL::iterators---for convenience, we give shorter names to these
+        iterators (e.g., EdgeRef instead of Element_List<Edge>::iterator).
+    */
+#ifdef SCOTTY3D_HALFEDGE_LISTS
+    template<typename T> using Element_List = std::list<T>;
+#else
+    template<typename T> using Element_List = Element_Pool<T>;
+#endif
+    using VertexRef = Element_List<Vertex>::iterator;
+    using EdgeRef = Element_List<Edge>::iterator;
+    using FaceRef = Element_List<Face>::iterator;
+    using HalfedgeRef = Element_List<Halfedge>::iterator;
 
     /* This is a special kind of reference that can refer to any of the four
        element types. */
@@ -178,10 +188,10 @@ public:
         used so frequently, we will use "CIter" as a shorthand abbreviation for
         "constant iterator."
     */
-    using VertexCRef = std::list<Vertex>::const_iterator;
-    using EdgeCRef = std::list<Edge>::const_iterator;
-    using FaceCRef = std::list<Face>::const_iterator;
-    using HalfedgeCRef = std::list<Halfedge>::const_iterator;
+    using VertexCRef = Element_List<Vertex>::const_iterator;
+    using EdgeCRef = Element_List<Edge>::const_iterator;
+    using FaceCRef = Element_List<Face>::const_iterator;
+    using HalfedgeCRef = Element_List<Halfedge>::const_iterator;
     using ElementCRef = std::variant<VertexCRef, EdgeCRef, HalfedgeCRef, FaceCRef>;
 
     //////////////////////////////////////////////////////////////////////////////////////////
@@ -563,16 +573,28 @@ public:
         new element. (These methods cannot have const versions, because they modify the mesh!)
     */
     HalfedgeRef new_halfedge() {
-        return halfedges.insert(halfedges.end(), Halfedge(next_id++));
+        HalfedgeRef h = halfedges.insert(halfedges.end(), Halfedge(next_id++));
+        index(h->id(), h);
+        if(tracking) created.push_back(h);
+        return h;
     }
     VertexRef new_vertex() {
-        return vertices.insert(vertices.end(), Vertex(next_id++));
+        VertexRef v = vertices.insert(vertices.end(), Vertex(next_id++));
+        index(v->id(), v);
+        if(tracking) created.push_back(v);
+        return v;
     }
     EdgeRef new_edge() {
-        return edges.insert(edges.end(), Edge(next_id++));
+        EdgeRef e = edges.insert(edges.end(), Edge(next_id++));
+        index(e->id(), e);
+        if(tracking) created.push_back(e);
+        return e;
     }
     FaceRef new_face(bool boundary = false) {
-        return faces.insert(faces.end(), Face(next_id++, boundary));
+        FaceRef f = faces.insert(faces.end(), Face(next_id++, boundary));
+        index(f->id(), f);
+        if(tracking) created.push_back(f);
+        return f;
     }
 
     /*
@@ -656,6 +678,8 @@ public:
     Size n_halfedges() const {
         return halfedges.size();
     };
+    /// Memory held by the element lists (erased elements included, until compact())
+    size_t bytes() const;
 
     bool has_boundary() const;
     Size n_boundaries() const;
@@ -664,6 +688,48 @@ public:
     std::optional<std::pair<ElementRef, std::string>> validate();
     std::optional<std::pair<ElementRef, std::string>> warnings();
 
+    /*
+        Cheaper checks for after a local operation. Call track_changes() first, so that
+        new elements are remembered; validate_local() then only checks the neighborhood
+        of the elements created or erased since, and of the given elements, which must
+        include any existing element the operation relinked. Like validate(), it
+        erases the erased elements if the mesh is valid. warnings_local() checks the
+        neighborhood of the last validate_local().
+    */
+    void track_changes();
+    std::optional<std::pair<ElementRef, std::string>>
+    validate_local(const std::vector<ElementRef>& changed);
+    std::optional<std::pair<ElementRef, std::string>> warnings_local();
+
+    /*
+        Applies a local operation op(mesh, elem), returning an optional element like
+        the operations above, to each of elems in turn. Elements erased by an earlier
+        application are skipped, and nothing is erased or validated in between: pass
+        elems and the result (the live elements op returned) to validate_local() to
+        check all of the changes at once.
+    */
+    template<typename Op>
+    std::vector<ElementRef> apply_batch(const std::vector<ElementRef>& elems, Op&& op) {
+        track_changes();
+        std::vector<ElementRef> results;
+        for(const ElementRef& elem : elems) {
+            if(erased(elem)) continue;
+            std::optional<ElementRef> result = op(*this, elem);
+            if(result.has_value()) results.push_back(*result);
+        }
+        results.erase(std::remove_if(results.begin(), results.end(),
+                                     [this](const ElementRef& elem) { return erased(elem); }),
+                      results.end());
+        return results;
+    }
+    /// Whether elem was erased since the last do_erase()
+    bool erased(ElementRef elem) const;
+    /// The element with the given id, if any (including one erased since the last
+    /// do_erase()). Found in constant time, from an index kept as elements come and go.
+    std::optional<ElementRef> element(unsigned int id) const {
+        return id < by_id.size() ? by_id[id] : std::nullopt;
+    }
+
     //////////////////////////////////////////////////////////////////////////////////////////
     // End methods students should use, begin internal methods - you don't need to use these
     //////////////////////////////////////////////////////////////////////////////////////////
@@ -681,16 +747,32 @@ public:
     Halfedge_Mesh& operator=(Halfedge_Mesh&& src) = default;
     void copy_to(Halfedge_Mesh& mesh);
     ElementRef copy_to(Halfedge_Mesh& mesh, unsigned int eid);
+    /// Flat binary form of the mesh, keeping element ids, laid out to compress well
+    void serialize(std::vector<unsigned char>& out);
+    /// Replaces the mesh with a serialized one; false (leaving it empty) if malformed
+    bool deserialize(const std::vector<unsigned char>& in);
 
     /// Clear mesh of all elements.
     void clear();
-    /// Creates new sub-divided mesh with provided scheme
-    bool subdivide(SubD strategy);
+    /// Creates new sub-divided mesh with provided scheme, applied levels times
+    bool subdivide(SubD strategy, unsigned int levels = 1);
+    /// Quadric error simplification of a triangle mesh: collapses edges, cheapest first,
+    /// until at most target_faces faces are left or the next collapse would cost more than
+    /// max_error (summed squared distance to the original face planes, weighted by area)
+    bool simplify(size_t target_faces,
+                  float max_error = std::numeric_limits<float>::infinity());
     /// Export to renderable vertex-index mesh. Indexes the mesh.
     void to_mesh(GL::Mesh& mesh, bool split_faces) const;
+    /// Same, into plain buffers, which unlike a GL::Mesh may be made on any thread
+    void to_mesh(std::vector<GL::Mesh::Vert>& verts, std::vector<GL::Mesh::Index>& idxs,
+                 bool split_faces) const;
     /// Create mesh from polygon list
     std::string from_poly(const std::vector<std::vector<Index>>& polygons,
                           const std::vector<Vec3>& verts);
+    /// Create mesh from a flat polygon list: polygon f has the vertex indices
+    /// corners[face_start[f]] up to corners[face_start[f + 1] - 1]
+    std::string from_flat(const std::vector<Index>& face_start, const std::vector<Index>& corners,
+                          const std::vector<Vec3>& verts);
     /// Create mesh from renderable triangle mesh (beware of connectivity, does not de-duplicate
     /// vertices)
     std::string from_mesh(const GL::Mesh& mesh);
@@ -699,7 +781,71 @@ public:
     /// or validate() are called
     void do_erase();
 
+    /// Whether erased elements take up enough storage to be worth a compact()
+    bool fragmented() const;
+    /// Repacks element storage, keeping ids. Invalidates every reference into the mesh.
+    void compact();
+
+    /*
+        The changes a local operation made to the mesh: the state of the elements
+        around the operated-on elements before and after it, by id. Undoing or redoing
+        the operation restores those states with one pass over the mesh to find them,
+        rather than keeping copies of the whole mesh.
+    */
+    class Delta {
+    public:
+        /// Memory held by the recorded states
+        size_t bytes() const;
+
+    private:
+        struct Vertex_State {
+            unsigned int id = 0, halfedge = 0;
+            Vec3 pos{};
+        };
+        struct Edge_State {
+            unsigned int id = 0, halfedge = 0;
+        };
+        struct Face_State {
+            unsigned int id = 0, halfedge = 0;
+            bool boundary = false;
+        };
+        struct Halfedge_State {
+            unsigned int id = 0, twin = 0, next = 0, vertex = 0, edge = 0, face = 0;
+        };
+        struct States {
+            std::vector<Vertex_State> vertices;
+            std::vector<Edge_State> edges;
+            std::vector<Face_State> faces;
+            std::vector<Halfedge_State> halfedges;
+        };
+        States before, after;
+        // next_id when the operation began and ended
+        unsigned int begin_id = 0, end_id = 0;
+        friend class Halfedge_Mesh;
+    };
+
+    /*
+        Call begin_delta() before a local operation on elems, and end_delta() once it
+        is done (e.g. after validate_local()), or rollback() to restore the mesh if it
+        failed. The operation may only change the faces around the vertices of elems
+        and of their neighbors, and the halfedges, edges and vertices of those faces.
+    */
+    Delta begin_delta(const std::vector<ElementRef>& elems);
+    void end_delta(Delta& delta);
+    void rollback(const Delta& delta);
+    /// Step the mesh back to before, or forward to after, an ended delta
+    void undo(const Delta& delta);
+    void redo(const Delta& delta);
+
+    /*
+        Viewers redraw the mesh once render_dirty_flag is set. If only deltas were
+        marked dirty since it was last taken, take_dirty() gives the ids they touched
+        (erased elements included), and the id from which every element is new, so
+        only those need redrawing; otherwise it returns false, for all of them.
+    */
     void mark_dirty();
+    void mark_dirty(const Delta& delta);
+    bool take_dirty(std::vector<unsigned int>& ids, unsigned int& new_from);
     bool flipped() const {
         return flip_orientation;
     }
@@ -713,10 +859,29 @@ public:
     static unsigned int id_of(ElementRef elem);
 
 private:
-    std::list<Vertex> vertices;
-    std::list<Edge> edges;
-    std::list<Face> faces;
-    std::list<Halfedge> halfedges;
+    static void record(Delta::States& states, ElementCRef elem);
+    // The recorded elements still live, and those created since the delta began;
+    // without links, only their ids are taken
+    Delta::States changed_since(const Delta& delta, bool links);
+    // Sets the elements of to to their recorded state, creating any that are missing,
+    // and erases the elements of from that to does not have
+    void restore(const Delta::States& from, const Delta::States& to);
+
+    Element_List<Vertex> vertices;
+    Element_List<Edge> edges;
+    Element_List<Face> faces;
+    Element_List<Halfedge> halfedges;
+
+    // Every element in the lists by id. Anything that inserts into or erases from
+    // them keeps it up to date.
+    std::vector<std::optional<ElementRef>> by_id;
+    void index(unsigned int id, ElementRef elem) {
+        if(id >= by_id.size()) by_id.resize(std::max<size_t>(id + 1, by_id.size() * 2));
+        by_id[id] = elem;
+    }
+    void unindex(unsigned int id) {
+        if(id < by_id.size()) by_id[id].reset();
+    }
 
     unsigned int next_id;
     bool flip_orientation = false;
@@ -725,6 +890,16 @@ private:
     std::set<EdgeRef> eerased;
     std::set<FaceRef> ferased;
     std::set<HalfedgeRef> herased;
+
+    // Since render_dirty_flag was set, if only by deltas
+    bool dirty_local = false;
+    std::vector<unsigned int> dirty_ids;
+    unsigned int dirty_new_from = 0;
+
+    // For local validation
+    bool tracking = false;
+    std::vector<ElementRef> created;
+    std::vector<VertexRef> checked;
 };
 
 /*
@@ -0,0 +1,49 @@
+
+#include "neighbor_grid.h"
+#include "../util/parallel.h"
+
+void Neighbor_Grid::build(const std::vector<Vec3>& pts, float cell_size) {
+
+    points = &pts;
+    inv_cell = 1.0f / cell_size;
+    size_t n = pts.size();
+
+    size_t table = 1;
+    while(table < n) table <<= 1;
+    mask = table - 1;
+    if(n_counts != table) {
+        counts.reset(new std::atomic<uint32_t>[table]);
+        n_counts = table;
+    }
+    parallel_for(0, table, 4096, [&](size_t b) { counts[b].store(0, std::memory_order_relaxed); });
+
+    keys.resize(n);
+    parallel_for(0, n, 1024, [&](size_t i) {
+        int64_t x, y, z;
+        cell(pts[i], x, y, z);
+        keys[i] = bucket(x, y, z);
+        counts[keys[i]].fetch_add(1, std::memory_order_relaxed);
+    });
+
+    // The counts become each bucket's next free slot
+    starts.resize(table + 1);
+    uint32_t sum = 0;
+    for(size_t b = 0; b < table; b++) {
+        starts[b] = sum;
+        sum += counts[b].load(std::memory_order_relaxed);
+        counts[b].store(starts[b], std::memory_order_relaxed);
+    }
+    starts[table] = sum;
+
+    sorted.resize(n);
+    parallel_for(0, n, 1024, [&](size_t i) {
+        sorted[counts[keys[i]].fetch_add(1, std::memory_order_relaxed)] = static_cast<uint32_t>(i);
+    });
+
+    // Slots within a bucket went to whichever thread got there first
+    parallel_for(0, table, 4096, [&](size_t b) {
+        if(starts[b + 1] - starts[b] > 1) {
+            std::sort(sorted.begin() + starts[b], sorted.begin() + starts[b + 1]);
+        }
+    });
+}
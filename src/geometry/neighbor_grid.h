@@ -0,0 +1,67 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "../lib/mathlib.h"
+
+// Finds points near each other in O(n). Points are bucketed by the cell of a uniform
+// grid they fall in, hashed into a table about as large as the point set, so the
+// grid needs no bounds. Built from scratch whenever the points move, with a parallel
+// counting sort that reuses its storage.
+class Neighbor_Grid {
+public:
+    // Queries will be for radii up to cell_size. The points must stay as they are
+    // while the grid is queried.
+    void build(const std::vector<Vec3>& points, float cell_size);
+
+    // Calls f(j) for each point j within radius of p, in increasing order of j within
+    // each cell (so that results don't depend on how the build was scheduled)
+    template<typename F> void for_neighbors(Vec3 p, float radius, F&& f) const {
+        if(!points) return;
+        int64_t cx, cy, cz;
+        cell(p, cx, cy, cz);
+        float r2 = radius * radius;
+        // Cells sharing a bucket are visited once
+        uint32_t seen[27];
+        size_t n_seen = 0;
+        for(int64_t dx = -1; dx <= 1; dx++) {
+            for(int64_t dy = -1; dy <= 1; dy++) {
+                for(int64_t dz = -1; dz <= 1; dz++) {
+                    uint32_t b = bucket(cx + dx, cy + dy, cz + dz);
+                    if(std::find(seen, seen + n_seen, b) != seen + n_seen) continue;
+                    seen[n_seen++] = b;
+                    for(uint32_t k = starts[b]; k < starts[b + 1]; k++) {
+                        uint32_t j = sorted[k];
+                        if(((*points)[j] - p).norm_squared() <= r2) f(j);
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    void cell(Vec3 p, int64_t& x, int64_t& y, int64_t& z) const {
+        x = static_cast<int64_t>(std::floor(p.x * inv_cell));
+        y = static_cast<int64_t>(std::floor(p.y * inv_cell));
+        z = static_cast<int64_t>(std::floor(p.z * inv_cell));
+    }
+    uint32_t bucket(int64_t x, int64_t y, int64_t z) const {
+        uint64_t h = static_cast<uint64_t>(x) * 73856093ull ^
+                     static_cast<uint64_t>(y) * 19349663ull ^
+                     static_cast<uint64_t>(z) * 83492791ull;
+        return static_cast<uint32_t>(h & mask);
+    }
+
+    const std::vector<Vec3>* points = nullptr;
+    float inv_cell = 1.0f;
+    uint64_t mask = 0;
+
+    // Points of bucket b are sorted[starts[b], starts[b + 1])
+    std::vector<uint32_t> starts, sorted, keys;
+    std::unique_ptr<std::atomic<uint32_t>[]> counts;
+    size_t n_counts = 0;
+};
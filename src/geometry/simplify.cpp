@@ -0,0 +1,342 @@
+
+#include "halfedge.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <queue>
+#include <unordered_map>
+
+// Quadric error simplification, like subdivision, works on an indexed copy of the mesh
+// and rebuilds the halfedge mesh once at the end. Vertex quadrics live in a flat array
+// and candidate collapses in a binary heap. A collapse changes the cost of every edge
+// around the surviving vertex; instead of finding and re-keying their heap entries,
+// each vertex carries a version that the collapse bumps, entries remember the
+// versions they were computed against, and stale entries are dropped when popped.
+
+namespace {
+
+using Index = Halfedge_Mesh::Index;
+
+// Symmetric 4x4 error quadric, in double precision since errors near zero decide
+// the order of most collapses
+struct Quadric {
+    // xx xy xz xw yy yz yw zz zw ww
+    double q[10] = {};
+
+    // Squared distance to the plane dot(n, p) + d = 0 (n unit length), times weight
+    static Quadric plane(Vec3 n, float d, double weight) {
+        double a = n.x, b = n.y, c = n.z, w = d;
+        Quadric r;
+        r.q[0] = weight * a * a, r.q[1] = weight * a * b, r.q[2] = weight * a * c;
+        r.q[3] = weight * a * w, r.q[4] = weight * b * b, r.q[5] = weight * b * c;
+        r.q[6] = weight * b * w, r.q[7] = weight * c * c, r.q[8] = weight * c * w;
+        r.q[9] = weight * w * w;
+        return r;
+    }
+
+    Quadric& operator+=(const Quadric& o) {
+        for(int i = 0; i < 10; i++) q[i] += o.q[i];
+        return *this;
+    }
+    Quadric operator+(const Quadric& o) const {
+        Quadric r = *this;
+        return r += o;
+    }
+
+    double error(Vec3 p) const {
+        double x = p.x, y = p.y, z = p.z;
+        double e = q[0] * x * x + q[4] * y * y + q[7] * z * z + q[9];
+        e += 2.0 * (q[1] * x * y + q[2] * x * z + q[5] * y * z);
+        e += 2.0 * (q[3] * x + q[6] * y + q[8] * z);
+        return std::max(e, 0.0);
+    }
+
+    // The point of least error, unless the quadric is (nearly) singular, as it is
+    // along flat or straight parts of the mesh
+    bool optimum(Vec3& p) const {
+        double a = q[0], b = q[1], c = q[2], d = q[4], e = q[5], f = q[7];
+        double c0 = d * f - e * e, c1 = c * e - b * f, c2 = b * e - c * d;
+        double det = a * c0 + b * c1 + c * c2;
+        double scale = std::abs(a) + std::abs(d) + std::abs(f);
+        if(std::abs(det) <= 1e-9 * scale * scale * scale) return false;
+        double rx = -q[3], ry = -q[6], rz = -q[8];
+        double x = (c0 * rx + c1 * ry + c2 * rz) / det;
+        double y = (c1 * rx + (a * f - c * c) * ry + (b * c - a * e) * rz) / det;
+        double z = (c2 * rx + (b * c - a * e) * ry + (a * d - b * b) * rz) / det;
+        p = Vec3((float)x, (float)y, (float)z);
+        return std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z);
+    }
+};
+
+// Boundary edges get constraint planes weighted this much more than faces, so open
+// borders keep their shape
+constexpr double boundary_weight = 100.0;
+
+class Simplifier {
+public:
+    // Fails (returns false) unless every face is a triangle
+    bool load(const Halfedge_Mesh& mesh) {
+
+        std::unordered_map<unsigned int, Index> index(mesh.n_vertices());
+        pos.reserve(mesh.n_vertices());
+        for(auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) {
+            index[v->id()] = pos.size();
+            pos.push_back(v->pos);
+        }
+
+        tris.reserve(mesh.n_faces());
+        for(auto f = mesh.faces_begin(); f != mesh.faces_end(); f++) {
+            if(f->is_boundary()) continue;
+            if(f->degree() != 3) return false;
+            auto h = f->halfedge();
+            tris.push_back({index[h->vertex()->id()], index[h->next()->vertex()->id()],
+                            index[h->next()->next()->vertex()->id()]});
+        }
+
+        size_t V = pos.size(), T = tris.size();
+        quadrics.assign(V, {});
+        version.assign(V, 0);
+        vert_alive.assign(V, 1);
+        boundary.assign(V, 0);
+        tri_alive.assign(T, 1);
+        vert_tris.assign(V, {});
+        live_tris = T;
+
+        // Area-weighted face planes
+        for(Index t = 0; t < T; t++) {
+            auto [a, b, c] = tris[t];
+            Vec3 n = cross(pos[b] - pos[a], pos[c] - pos[a]);
+            float len = n.norm();
+            if(len > 0.0f) {
+                n /= len;
+                Quadric fq = Quadric::plane(n, -dot(n, pos[a]), 0.5 * len);
+                quadrics[a] += fq, quadrics[b] += fq, quadrics[c] += fq;
+            }
+            for(Index v : tris[t]) vert_tris[v].push_back(t);
+        }
+
+        // Edges used by one triangle are on the boundary: constrain them with the plane
+        // through the edge perpendicular to its face
+        std::unordered_map<uint64_t, Index> edge_tri(3 * T);
+        for(Index t = 0; t < T; t++) {
+            for(int i = 0; i < 3; i++) {
+                Index a = tris[t][i], b = tris[t][(i + 1) % 3];
+                auto [it, added] = edge_tri.insert({key(a, b), t});
+                if(!added) it->second = none;
+            }
+        }
+        for(auto [k, t] : edge_tri) {
+            if(t == none) continue;
+            Index a = (Index)(k >> 32), b = (Index)(k & 0xffffffff);
+            auto [x, y, z] = tris[t];
+            Vec3 fn = cross(pos[y] - pos[x], pos[z] - pos[x]);
+            Vec3 n = cross(pos[b] - pos[a], fn);
+            float len = n.norm();
+            if(len > 0.0f) {
+                n /= len;
+                Quadric bq = Quadric::plane(n, -dot(n, pos[a]),
+                                            boundary_weight * (pos[b] - pos[a]).norm_squared());
+                quadrics[a] += bq, quadrics[b] += bq;
+            }
+            boundary[a] = boundary[b] = 1;
+        }
+
+        // Each edge once
+        for(auto [k, t] : edge_tri) {
+            push((Index)(k >> 32), (Index)(k & 0xffffffff));
+        }
+        return true;
+    }
+
+    // Collapse edges, cheapest first, until at most target_tris triangles are left or
+    // the cheapest remaining collapse would cost more than max_error; returns the
+    // number of collapses
+    size_t run(size_t target_tris, double max_error) {
+        size_t collapses = 0;
+        while(live_tris > target_tris && !heap.empty()) {
+            Candidate top = heap.top();
+            heap.pop();
+            if(!vert_alive[top.a] || !vert_alive[top.b]) continue;
+            if(version[top.a] != top.version_a || version[top.b] != top.version_b) continue;
+            if(top.cost > max_error) break;
+            if(!collapse(top.a, top.b, top.target)) continue;
+            collapses++;
+        }
+        return collapses;
+    }
+
+    void store(Halfedge_Mesh& mesh) const {
+        std::vector<Index> remap(pos.size(), none);
+        std::vector<Vec3> verts;
+        std::vector<Index> face_start(1, 0), corners;
+        face_start.reserve(live_tris + 1);
+        corners.reserve(3 * live_tris);
+        for(Index t = 0; t < tris.size(); t++) {
+            if(!tri_alive[t]) continue;
+            for(Index v : tris[t]) {
+                if(remap[v] == none) {
+                    remap[v] = verts.size();
+                    verts.push_back(pos[v]);
+                }
+                corners.push_back(remap[v]);
+            }
+            face_start.push_back(corners.size());
+        }
+        mesh.from_flat(face_start, corners, verts);
+    }
+
+private:
+    static constexpr Index none = ~Index(0);
+
+    struct Candidate {
+        double cost;
+        Index a, b;
+        unsigned int version_a, version_b;
+        Vec3 target;
+        bool operator>(const Candidate& o) const {
+            return cost > o.cost;
+        }
+    };
+
+    static uint64_t key(Index a, Index b) {
+        if(a > b) std::swap(a, b);
+        return (uint64_t(a) << 32) | uint64_t(b);
+    }
+
+    void push(Index a, Index b) {
+        Quadric q = quadrics[a] + quadrics[b];
+        Vec3 target;
+        double cost;
+        if(q.optimum(target)) {
+            cost = q.error(target);
+        } else {
+            // Fall back on the best of the endpoints and the midpoint
+            Vec3 mid = 0.5f * (pos[a] + pos[b]);
+            target = pos[a], cost = q.error(pos[a]);
+            if(double e = q.error(pos[b]); e < cost) target = pos[b], cost = e;
+            if(double e = q.error(mid); e < cost) target = mid, cost = e;
+        }
+        heap.push({cost, a, b, version[a], version[b], target});
+    }
+
+    // The vertices sharing a live triangle with v
+    void neighbors(Index v, std::vector<Index>& out) const {
+        out.clear();
+        for(Index t : vert_tris[v]) {
+            if(!tri_alive[t]) continue;
+            for(Index u : tris[t]) {
+                if(u != v) out.push_back(u);
+            }
+        }
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+    }
+
+    bool contains(Index t, Index v) const {
+        return tris[t][0] == v || tris[t][1] == v || tris[t][2] == v;
+    }
+
+    // Merge b into a at target, unless that would break the manifold or fold the surface
+    bool collapse(Index a, Index b, Vec3 target) {
+
+        // The triangles on edge ab and their third vertices
+        shared.clear();
+        opposite.clear();
+        for(Index t : vert_tris[a]) {
+            if(!tri_alive[t] || !contains(t, b)) continue;
+            shared.push_back(t);
+            for(Index v : tris[t]) {
+                if(v != a && v != b) opposite.push_back(v);
+            }
+        }
+        if(shared.empty() || shared.size() > 2) return false;
+        bool edge_on_boundary = shared.size() == 1;
+
+        // An interior edge between two boundary vertices would pinch the surface
+        if(!edge_on_boundary && boundary[a] && boundary[b]) return false;
+
+        // Link condition: a and b may only share the neighbors across edge ab
+        neighbors(a, na);
+        neighbors(b, nb);
+        common.clear();
+        std::set_intersection(na.begin(), na.end(), nb.begin(), nb.end(),
+                              std::back_inserter(common));
+        std::sort(opposite.begin(), opposite.end());
+        if(common != opposite) return false;
+
+        // Keep at least a triangle's worth of neighbors everywhere
+        size_t degree = na.size() + nb.size() - common.size() - 2;
+        if(degree < 3) return false;
+        for(Index o : opposite) {
+            neighbors(o, no);
+            if(!boundary[o] && no.size() <= 3) return false;
+        }
+
+        // No triangle may flip or collapse to nothing
+        for(Index v : {a, b}) {
+            for(Index t : vert_tris[v]) {
+                if(!tri_alive[t] || (contains(t, a) && contains(t, b))) continue;
+                auto [x, y, z] = tris[t];
+                Vec3 before = cross(pos[y] - pos[x], pos[z] - pos[x]);
+                Vec3 p[3] = {pos[x], pos[y], pos[z]};
+                for(int i = 0; i < 3; i++) {
+                    if(tris[t][i] == v) p[i] = target;
+                }
+                Vec3 after = cross(p[1] - p[0], p[2] - p[0]);
+                float la = after.norm(), lb = before.norm();
+                if(la <= 1e-12f * (lb + 1e-12f)) return false;
+                if(dot(before, after) < 0.2f * la * lb) return false;
+            }
+        }
+
+        for(Index t : shared) tri_alive[t] = 0;
+        live_tris -= shared.size();
+        for(Index t : vert_tris[b]) {
+            if(!tri_alive[t]) continue;
+            for(Index& v : tris[t]) {
+                if(v == b) v = a;
+            }
+            vert_tris[a].push_back(t);
+        }
+        vert_tris[b].clear();
+        vert_alive[b] = 0;
+        auto& ts = vert_tris[a];
+        ts.erase(std::remove_if(ts.begin(), ts.end(), [this](Index t) { return !tri_alive[t]; }),
+                 ts.end());
+
+        pos[a] = target;
+        quadrics[a] += quadrics[b];
+        boundary[a] |= boundary[b];
+        version[a]++;
+
+        neighbors(a, na);
+        for(Index n : na) push(a, n);
+        return true;
+    }
+
+    std::vector<Vec3> pos;
+    std::vector<Quadric> quadrics;
+    std::vector<unsigned int> version;
+    std::vector<char> vert_alive, boundary;
+    std::vector<std::array<Index, 3>> tris;
+    std::vector<char> tri_alive;
+    std::vector<std::vector<Index>> vert_tris;
+    size_t live_tris = 0;
+
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> heap;
+
+    // Scratch space for collapse
+    std::vector<Index> shared, opposite, na, nb, no, common;
+};
+
+} // namespace
+
+bool Halfedge_Mesh::simplify(size_t target_faces, float max_error) {
+
+    Simplifier s;
+    if(!s.load(*this)) return false;
+    if(s.run(target_faces, max_error) == 0) return false;
+    s.store(*this);
+    return true;
+}
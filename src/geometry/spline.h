@@ -2,13 +2,116 @@
 #pragma once
 
 #include "../lib/mathlib.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <map>
+#include <memory>
 #include <set>
+#include <vector>
+
+// Index i of the segment [knots[i], knots[i + 1]) containing time, for knots sorted
+// ascending with time in [knots.front(), knots.back()). Playback mostly evaluates in
+// order, so the segment found last (kept in hint) and the one after it are checked
+// before searching.
+inline size_t spline_segment(const std::vector<float>& knots, std::atomic<size_t>& hint,
+                             float time) {
+    size_t i = hint.load(std::memory_order_relaxed);
+    if(i + 1 < knots.size() && knots[i] <= time) {
+        if(time < knots[i + 1]) return i;
+        if(i + 2 < knots.size() && time < knots[i + 2]) {
+            hint.store(i + 1, std::memory_order_relaxed);
+            return i + 1;
+        }
+    }
+    i = std::upper_bound(knots.begin(), knots.end(), time) - knots.begin() - 1;
+    hint.store(i, std::memory_order_relaxed);
+    return i;
+}
+
+// Whether time is one of the whole frames [0, n_frames), and which
+inline bool spline_frame(size_t n_frames, float time, size_t& frame) {
+    if(!(time >= 0.0f && time < (float)n_frames)) return false;
+    frame = (size_t)time;
+    return (float)frame == time;
+}
+
+// A value never returned before, with which every change to a spline is stamped
+inline uint64_t spline_version() {
+    static std::atomic<uint64_t> versions = 0;
+    return ++versions;
+}
+inline uint64_t spline_version(uint64_t combined, uint64_t version) {
+    return (combined ^ version) * 1099511628211ull;
+}
+
+// Whether splines keyed at the given times hold one value over [t0, t1]: before the
+// first knot and after the last, they hold its value
+template<typename K> bool spline_constant(const K& knots, float t0, float t1) {
+    if(knots.size() <= 1) return true;
+    return t1 <= knots.begin()->first || t0 >= knots.rbegin()->first;
+}
+
+// Where an animated item last evaluated its splines, so that it can skip doing so
+// again while they can't have changed value: none has been edited (going by their
+// combined version()), and all are constant from then until now
+struct Spline_Cursor {
+    // Moves the cursor to time, returning true if the splines needn't be evaluated
+    template<typename Constant> bool skip(float time, uint64_t version, Constant&& constant) {
+        bool ret = valid && version == last_version &&
+                   (time == last_time ||
+                    constant(std::min(time, last_time), std::max(time, last_time)));
+        valid = true;
+        last_time = time;
+        last_version = version;
+        return ret;
+    }
+    void reset() {
+        valid = false;
+    }
+
+private:
+    bool valid = false;
+    float last_time = 0.0f;
+    uint64_t last_version = 0;
+};
 
 template<typename T> class Spline {
 public:
     // Returns the interpolated value.
-    T at(float time) const;
+    T at(float time) const {
+        if(control_points.empty()) return T();
+        std::shared_ptr<const Baked> b = bake();
+        size_t frame;
+        if(spline_frame(b->frames.size(), time, frame)) return b->frames[frame];
+        return evaluate(*b, time);
+    }
+
+    // Evaluates at each of times[0, n) into out, as at() would, fetching the baked
+    // form once; times in increasing order are found without searching
+    void at(const float* times, size_t n, T* out) const {
+        if(control_points.empty()) {
+            std::fill(out, out + n, T());
+            return;
+        }
+        std::shared_ptr<const Baked> b = bake();
+        for(size_t i = 0; i < n; i++) out[i] = evaluate(*b, times[i]);
+    }
+
+    // Evaluates every whole frame in [0, n) ahead of time, so at() on those times is
+    // a lookup until the spline next changes
+    void bake_frames(size_t n) const {
+        if(control_points.empty()) return;
+        std::shared_ptr<const Baked> b = bake();
+        if(b->frames.size() == n) return;
+        auto framed = std::make_shared<Baked>();
+        framed->knots = b->knots;
+        framed->values = b->values;
+        framed->tangents = b->tangents;
+        framed->frames.resize(n);
+        for(size_t i = 0; i < n; i++) framed->frames[i] = evaluate(*b, (float)i);
+        std::atomic_store(&baked, std::shared_ptr<const Baked>(std::move(framed)));
+    }
 
     // Purely for convenience, returns the exact same
     // value as at()---simply lets one evaluate a spline
@@ -21,11 +124,15 @@ public:
     // creating a new knot at this time if necessary.
     void set(float time, T value) {
         control_points[time] = value;
+        baked.reset();
+        _version = spline_version();
     }
 
     // Removes the knot closest to the given time
     void erase(float time) {
         control_points.erase(time);
+        baked.reset();
+        _version = spline_version();
     }
 
     // Checks if time t is a control point
@@ -41,12 +148,26 @@ public:
     // Removes all control points
     void clear() {
         control_points.clear();
+        baked.reset();
+        _version = spline_version();
     }
 
     // Removes control points after t
     void crop(float t) {
         auto e = control_points.lower_bound(t);
         control_points.erase(e, control_points.end());
+        baked.reset();
+        _version = spline_version();
+    }
+
+    // Changes, to a value never used before, with every edit. Copies keep it.
+    uint64_t version() const {
+        return _version;
+    }
+
+    // Whether at() gives the same value everywhere in [t0, t1]
+    bool constant(float t0, float t1) const {
+        return spline_constant(control_points, t0, t1);
     }
 
     // Returns set of keys
@@ -58,6 +179,32 @@ public:
 
 private:
     std::map<float, T> control_points;
+    uint64_t _version = 0;
+
+    // The control points in contiguous arrays, with the tangent at each knot, made by
+    // the first evaluation after a change, plus any frames from bake_frames(). Copies
+    // of the spline share it.
+    struct Baked {
+        std::vector<float> knots;
+        std::vector<T> values, tangents, frames;
+        mutable std::atomic<size_t> segment = 0;
+    };
+    mutable std::shared_ptr<const Baked> baked;
+
+    // Evaluations may run on several threads at once, so the baked form is swapped in
+    // atomically (but changing the spline while evaluating it is still a race)
+    std::shared_ptr<const Baked> bake() const {
+        std::shared_ptr<const Baked> b = std::atomic_load(&baked);
+        if(!b) {
+            b = make_baked();
+            std::atomic_store(&baked, b);
+        }
+        return b;
+    }
+    std::shared_ptr<const Baked> make_baked() const;
+
+    // Interpolates the baked control points at time
+    T evaluate(const Baked& b, float time) const;
 
     // Given a time between 0 and 1, evaluates a cubic polynomial with
     // the given endpoint and tangent values at the beginning (0) and
@@ -99,6 +246,27 @@ public:
     std::tuple<T, Ts...> at(float t) const {
         return std::tuple_cat(std::make_tuple(head.at(t)), tail.at(t));
     }
+    // Evaluates each component spline over all of times in turn (through arrays, as
+    // std::vector<bool> has no data())
+    void at(const float* times, size_t n, std::tuple<T, Ts...>* out) const {
+        std::unique_ptr<T[]> first(new T[n]);
+        std::vector<std::tuple<Ts...>> rest(n);
+        head.at(times, n, first.get());
+        tail.at(times, n, rest.data());
+        for(size_t i = 0; i < n; i++) {
+            out[i] = std::tuple_cat(std::make_tuple(std::move(first[i])), std::move(rest[i]));
+        }
+    }
+    void bake_frames(size_t n) const {
+        head.bake_frames(n);
+        tail.bake_frames(n);
+    }
+    uint64_t version() const {
+        return spline_version(head.version(), tail.version());
+    }
+    bool constant(float t0, float t1) const {
+        return head.constant(t0, t1) && tail.constant(t0, t1);
+    }
 
 private:
     Spline<T> head;
@@ -131,6 +299,20 @@ public:
     std::tuple<T> at(float t) const {
         return std::make_tuple(head.at(t));
     }
+    void at(const float* times, size_t n, std::tuple<T>* out) const {
+        std::unique_ptr<T[]> first(new T[n]);
+        head.at(times, n, first.get());
+        for(size_t i = 0; i < n; i++) out[i] = std::make_tuple(std::move(first[i]));
+    }
+    void bake_frames(size_t n) const {
+        head.bake_frames(n);
+    }
+    uint64_t version() const {
+        return head.version();
+    }
+    bool constant(float t0, float t1) const {
+        return head.constant(t0, t1);
+    }
 
 private:
     Spline<T> head;
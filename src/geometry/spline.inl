@@ -5,22 +5,42 @@ template<> class Spline<Quat> {
 public:
     Quat at(float time) const {
         if(values.empty()) return Quat();
-        if(values.size() == 1) return values.begin()->second;
-        if(values.begin()->first > time) return values.begin()->second;
-        auto k2 = values.upper_bound(time);
-        if(k2 == values.end()) return std::prev(values.end())->second;
-        auto k1 = std::prev(k2);
-        float t = (time - k1->first) / (k2->first - k1->first);
-        return slerp(k1->second, k2->second, t);
+        std::shared_ptr<const Baked> b = bake();
+        size_t frame;
+        if(spline_frame(b->frames.size(), time, frame)) return b->frames[frame];
+        return evaluate(*b, time);
+    }
+    void at(const float* times, size_t n, Quat* out) const {
+        if(values.empty()) {
+            std::fill(out, out + n, Quat());
+            return;
+        }
+        std::shared_ptr<const Baked> b = bake();
+        for(size_t i = 0; i < n; i++) out[i] = evaluate(*b, times[i]);
+    }
+    void bake_frames(size_t n) const {
+        if(values.empty()) return;
+        std::shared_ptr<const Baked> b = bake();
+        if(b->frames.size() == n) return;
+        auto framed = std::make_shared<Baked>();
+        framed->knots = b->knots;
+        framed->rotations = b->rotations;
+        framed->frames.resize(n);
+        for(size_t i = 0; i < n; i++) framed->frames[i] = evaluate(*b, (float)i);
+        std::atomic_store(&baked, std::shared_ptr<const Baked>(std::move(framed)));
     }
     Quat operator()(float time) const {
         return at(time);
     }
     void set(float time, Quat value) {
         values[time] = value;
+        baked.reset();
+        _version = spline_version();
     }
     void erase(float time) {
         values.erase(time);
+        baked.reset();
+        _version = spline_version();
     }
     std::set<float> keys() const {
         std::set<float> ret;
@@ -35,14 +55,56 @@ public:
     }
     void clear() {
         values.clear();
+        baked.reset();
+        _version = spline_version();
     }
     void crop(float t) {
         auto e = values.lower_bound(t);
         values.erase(e, values.end());
+        baked.reset();
+        _version = spline_version();
+    }
+    uint64_t version() const {
+        return _version;
+    }
+    bool constant(float t0, float t1) const {
+        return spline_constant(values, t0, t1);
     }
 
 private:
     std::map<float, Quat> values;
+    uint64_t _version = 0;
+
+    // As for Spline<T>, joint rotations being most of what playback evaluates
+    struct Baked {
+        std::vector<float> knots;
+        std::vector<Quat> rotations, frames;
+        mutable std::atomic<size_t> segment = 0;
+    };
+    mutable std::shared_ptr<const Baked> baked;
+
+    std::shared_ptr<const Baked> bake() const {
+        std::shared_ptr<const Baked> b = std::atomic_load(&baked);
+        if(!b) {
+            auto made = std::make_shared<Baked>();
+            for(auto& [t, q] : values) {
+                made->knots.push_back(t);
+                made->rotations.push_back(q);
+            }
+            b = std::move(made);
+            std::atomic_store(&baked, b);
+        }
+        return b;
+    }
+
+    static Quat evaluate(const Baked& b, float time) {
+        const std::vector<float>& knots = b.knots;
+        if(knots.size() == 1 || knots.front() > time) return b.rotations.front();
+        if(time >= knots.back()) return b.rotations.back();
+        size_t i = spline_segment(knots, b.segment, time);
+        float t = (time - knots[i]) / (knots[i + 1] - knots[i]);
+        return slerp(b.rotations[i], b.rotations[i + 1], t);
+    }
 };
 
 template<> class Spline<bool> {
@@ -56,14 +118,23 @@ public:
         return std::prev(k2)->second;
     }
 
+    void at(const float* times, size_t n, bool* out) const {
+        for(size_t i = 0; i < n; i++) out[i] = at(times[i]);
+    }
+    // A map lookup is already about as cheap as a baked frame would be
+    void bake_frames(size_t) const {
+    }
+
     bool operator()(float time) const {
         return at(time);
     }
     void set(float time, bool value) {
         values[time] = value;
+        _version = spline_version();
     }
     void erase(float time) {
         values.erase(time);
+        _version = spline_version();
     }
     std::set<float> keys() const {
         std::set<float> ret;
@@ -78,12 +149,21 @@ public:
     }
     void clear() {
         values.clear();
+        _version = spline_version();
     }
     void crop(float t) {
         auto e = values.lower_bound(t);
         values.erase(e, values.end());
+        _version = spline_version();
+    }
+    uint64_t version() const {
+        return _version;
+    }
+    bool constant(float t0, float t1) const {
+        return spline_constant(values, t0, t1);
     }
 
 private:
     std::map<float, bool> values;
+    uint64_t _version = 0;
 };
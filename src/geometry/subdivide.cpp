@@ -0,0 +1,340 @@
+
+#include "halfedge.h"
+
+#include "../util/parallel.h"
+
+#include <limits>
+#include <unordered_map>
+
+// Global subdivision works on an indexed copy of the mesh rather than on the halfedge
+// elements: every level computes the new positions in parallel and writes the refined
+// connectivity straight into flat arrays, and the halfedge mesh is only rebuilt once
+// at the end. The rules are the same as linear_subdivide_positions,
+// catmullclark_subdivide_positions and loop_subdivide, which work on one level of the
+// halfedge mesh in place.
+
+namespace {
+
+using Index = Halfedge_Mesh::Index;
+constexpr Index none = std::numeric_limits<Index>::max();
+
+// A polygon mesh as flat arrays. Face f has the corners [face_start[f], face_start[f + 1]);
+// corner c sits at vertex corner_vert[c] and is followed by edge corner_edge[c], which
+// leads to the next corner of the face. Each edge knows its vertices and the corners
+// leaving along it (the second is none on the boundary).
+struct Indexed_Mesh {
+    std::vector<Vec3> verts;
+    std::vector<Index> face_start;
+    std::vector<Index> corner_vert, corner_edge;
+    std::vector<std::pair<Index, Index>> edge_verts;
+
+    // Filled in by link()
+    std::vector<Index> corner_face;
+    std::vector<std::pair<Index, Index>> edge_corners;
+    // The corners at vertex v are vert_corners[vert_start[v] .. vert_start[v + 1])
+    std::vector<Index> vert_start, vert_corners;
+
+    size_t n_faces() const {
+        return face_start.size() - 1;
+    }
+    size_t n_corners() const {
+        return corner_vert.size();
+    }
+    Index next(Index c) const {
+        Index f = corner_face[c];
+        return c + 1 == face_start[f + 1] ? face_start[f] : c + 1;
+    }
+    Index prev(Index c) const {
+        Index f = corner_face[c];
+        return c == face_start[f] ? face_start[f + 1] - 1 : c - 1;
+    }
+    // The half of edge e (as split by subdivision) that touches vertex v
+    Index half(Index e, Index v) const {
+        return edge_verts[e].first == v ? 2 * e : 2 * e + 1;
+    }
+    bool closed() const {
+        for(auto [c0, c1] : edge_corners) {
+            if(c1 == none) return false;
+        }
+        return true;
+    }
+
+    // Derive the adjacency from the faces
+    void link() {
+        corner_face.resize(n_corners());
+        parallel_for(0, n_faces(), 1024, [&](size_t f) {
+            for(Index c = face_start[f]; c < face_start[f + 1]; c++) corner_face[c] = f;
+        });
+
+        edge_corners.assign(edge_verts.size(), {none, none});
+        for(Index c = 0; c < n_corners(); c++) {
+            auto& corners = edge_corners[corner_edge[c]];
+            (corners.first == none ? corners.first : corners.second) = c;
+        }
+
+        vert_start.assign(verts.size() + 1, 0);
+        for(Index c = 0; c < n_corners(); c++) vert_start[corner_vert[c] + 1]++;
+        for(size_t v = 0; v < verts.size(); v++) vert_start[v + 1] += vert_start[v];
+        std::vector<Index> fill(vert_start.begin(), vert_start.end() - 1);
+        vert_corners.resize(n_corners());
+        for(Index c = 0; c < n_corners(); c++) vert_corners[fill[corner_vert[c]]++] = c;
+    }
+};
+
+Indexed_Mesh snapshot(const Halfedge_Mesh& mesh) {
+
+    Indexed_Mesh m;
+    std::unordered_map<unsigned int, Index> index(mesh.n_vertices() + mesh.n_edges());
+
+    m.verts.reserve(mesh.n_vertices());
+    for(auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) {
+        index[v->id()] = m.verts.size();
+        m.verts.push_back(v->pos);
+    }
+
+    m.edge_verts.reserve(mesh.n_edges());
+    for(auto e = mesh.edges_begin(); e != mesh.edges_end(); e++) {
+        index[e->id()] = m.edge_verts.size();
+        m.edge_verts.push_back({index[e->halfedge()->vertex()->id()],
+                                index[e->halfedge()->twin()->vertex()->id()]});
+    }
+
+    m.face_start.push_back(0);
+    for(auto f = mesh.faces_begin(); f != mesh.faces_end(); f++) {
+        if(f->is_boundary()) continue;
+        auto h = f->halfedge();
+        do {
+            m.corner_vert.push_back(index[h->vertex()->id()]);
+            m.corner_edge.push_back(index[h->edge()->id()]);
+            h = h->next();
+        } while(h != f->halfedge());
+        m.face_start.push_back(m.corner_vert.size());
+    }
+
+    m.link();
+    return m;
+}
+
+// One level of Catmull-Clark subdivision, or of linear subdivision if linear is set:
+// a new vertex for every vertex, edge and face, and a quad for every corner
+Indexed_Mesh subdivide_quads(const Indexed_Mesh& m, bool linear) {
+
+    size_t V = m.verts.size(), E = m.edge_verts.size(), F = m.n_faces(), C = m.n_corners();
+
+    Indexed_Mesh out;
+    out.verts.resize(V + E + F);
+    Vec3* vert_points = out.verts.data();
+    Vec3* edge_points = vert_points + V;
+    Vec3* face_points = edge_points + E;
+
+    // Faces: the centroid
+    parallel_for(0, F, 1024, [&](size_t f) {
+        Vec3 sum;
+        for(Index c = m.face_start[f]; c < m.face_start[f + 1]; c++) {
+            sum += m.verts[m.corner_vert[c]];
+        }
+        face_points[f] = sum / (float)(m.face_start[f + 1] - m.face_start[f]);
+    });
+
+    // Edges: the midpoint, averaged with the two face points
+    parallel_for(0, E, 1024, [&](size_t e) {
+        auto [a, b] = m.edge_verts[e];
+        Vec3 mid = (m.verts[a] + m.verts[b]) / 2.0f;
+        if(linear) {
+            edge_points[e] = mid;
+        } else {
+            auto [c0, c1] = m.edge_corners[e];
+            Vec3 faces = (face_points[m.corner_face[c0]] + face_points[m.corner_face[c1]]) / 2.0f;
+            edge_points[e] = (faces + mid) / 2.0f;
+        }
+    });
+
+    // Vertices: (Q + 2R + (n - 3)S) / n, where Q and R average the adjacent face
+    // points and edge midpoints
+    parallel_for(0, V, 1024, [&](size_t v) {
+        if(linear) {
+            vert_points[v] = m.verts[v];
+            return;
+        }
+        Vec3 Q, R;
+        for(Index i = m.vert_start[v]; i < m.vert_start[v + 1]; i++) {
+            Index c = m.vert_corners[i];
+            auto [a, b] = m.edge_verts[m.corner_edge[c]];
+            Q += face_points[m.corner_face[c]];
+            R += (m.verts[a] + m.verts[b]) / 2.0f;
+        }
+        float n = (float)(m.vert_start[v + 1] - m.vert_start[v]);
+        vert_points[v] = (Q / n + R * (2.0f / n) + m.verts[v] * (n - 3.0f)) / n;
+    });
+
+    // Edge e splits into 2e and 2e + 1, and the quads of a face are joined by one
+    // edge per corner, 2E + c, from the face point to the point of the corner's edge
+    out.edge_verts.resize(2 * E + C);
+    parallel_for(0, E, 1024, [&](size_t e) {
+        auto [a, b] = m.edge_verts[e];
+        out.edge_verts[2 * e] = {a, V + e};
+        out.edge_verts[2 * e + 1] = {V + e, b};
+    });
+
+    // Corner c becomes the quad (face, edge c, next vertex, next edge)
+    out.face_start.resize(C + 1);
+    out.corner_vert.resize(4 * C);
+    out.corner_edge.resize(4 * C);
+    parallel_for(0, C, 1024, [&](size_t c) {
+        Index n = m.next(c), f = m.corner_face[c];
+        Index e0 = m.corner_edge[c], e1 = m.corner_edge[n], v = m.corner_vert[n];
+
+        Index* verts = &out.corner_vert[4 * c];
+        Index* edges = &out.corner_edge[4 * c];
+        verts[0] = V + E + f;
+        edges[0] = 2 * E + c;
+        verts[1] = V + e0;
+        edges[1] = m.half(e0, v);
+        verts[2] = v;
+        edges[2] = m.half(e1, v);
+        verts[3] = V + e1;
+        edges[3] = 2 * E + n;
+
+        out.face_start[c] = 4 * c;
+        out.edge_verts[2 * E + c] = {V + E + f, V + e0};
+    });
+    out.face_start[C] = 4 * C;
+
+    out.link();
+    return out;
+}
+
+// One level of Loop subdivision of a closed triangle mesh: a new vertex for every
+// vertex and edge, and four triangles for every triangle
+Indexed_Mesh subdivide_loop(const Indexed_Mesh& m) {
+
+    size_t V = m.verts.size(), E = m.edge_verts.size(), F = m.n_faces();
+
+    Indexed_Mesh out;
+    out.verts.resize(V + E);
+
+    // Vertices: (1 - nu) times the original position plus u times each neighbor
+    parallel_for(0, V, 1024, [&](size_t v) {
+        Vec3 neighbors;
+        for(Index i = m.vert_start[v]; i < m.vert_start[v + 1]; i++) {
+            neighbors += m.verts[m.corner_vert[m.next(m.vert_corners[i])]];
+        }
+        float n = (float)(m.vert_start[v + 1] - m.vert_start[v]);
+        float u = n == 3.0f ? 3.0f / 16.0f : 3.0f / (8.0f * n);
+        out.verts[v] = m.verts[v] * (1.0f - n * u) + neighbors * u;
+    });
+
+    // Edges: 3/8 of each endpoint and 1/8 of the two opposite vertices
+    parallel_for(0, E, 1024, [&](size_t e) {
+        auto [a, b] = m.edge_verts[e];
+        auto [c0, c1] = m.edge_corners[e];
+        Vec3 opposite = m.verts[m.corner_vert[m.prev(c0)]] + m.verts[m.corner_vert[m.prev(c1)]];
+        out.verts[V + e] = (m.verts[a] + m.verts[b]) * (3.0f / 8.0f) + opposite / 8.0f;
+    });
+
+    // Edge e splits into 2e and 2e + 1, and the three inner edges of triangle f are
+    // 2E + 3f + j, each cutting off corner j
+    out.edge_verts.resize(2 * E + 3 * F);
+    parallel_for(0, E, 1024, [&](size_t e) {
+        auto [a, b] = m.edge_verts[e];
+        out.edge_verts[2 * e] = {a, V + e};
+        out.edge_verts[2 * e + 1] = {V + e, b};
+    });
+
+    // Triangle f becomes 4f + j for each corner j, and 4f + 3 in the middle
+    out.face_start.resize(4 * F + 1);
+    out.corner_vert.resize(12 * F);
+    out.corner_edge.resize(12 * F);
+    parallel_for(0, F, 1024, [&](size_t f) {
+        Index first = m.face_start[f];
+        Index inner = 2 * E + 3 * f;
+        Index* mid_verts = &out.corner_vert[12 * f + 9];
+        Index* mid_edges = &out.corner_edge[12 * f + 9];
+
+        for(Index j = 0; j < 3; j++) {
+            Index c = first + j;
+            Index v = m.corner_vert[c], e = m.corner_edge[c], ep = m.corner_edge[m.prev(c)];
+
+            Index* verts = &out.corner_vert[12 * f + 3 * j];
+            Index* edges = &out.corner_edge[12 * f + 3 * j];
+            verts[0] = v;
+            edges[0] = m.half(e, v);
+            verts[1] = V + e;
+            edges[1] = inner + j;
+            verts[2] = V + ep;
+            edges[2] = m.half(ep, v);
+
+            out.edge_verts[inner + j] = {V + e, V + ep};
+            mid_verts[j] = V + e;
+            mid_edges[j] = inner + (j + 1) % 3;
+            out.face_start[4 * f + j] = 12 * f + 3 * j;
+        }
+        out.face_start[4 * f + 3] = 12 * f + 9;
+    });
+    out.face_start[4 * F] = 12 * F;
+
+    out.link();
+    return out;
+}
+
+} // namespace
+
+bool Halfedge_Mesh::subdivide(SubD strategy, unsigned int levels) {
+
+    switch(strategy) {
+    case SubD::linear: break;
+    case SubD::catmullclark: {
+        if(has_boundary()) return false;
+    } break;
+    case SubD::loop: {
+        if(has_boundary()) return false;
+        for(FaceRef f = faces_begin(); f != faces_end(); f++) {
+            if(f->degree() != 3) return false;
+        }
+    } break;
+    default: assert(false);
+    }
+
+    Indexed_Mesh m = snapshot(*this);
+    for(unsigned int i = 0; i < levels; i++) {
+        if(strategy == SubD::loop) {
+            m = subdivide_loop(m);
+        } else {
+            m = subdivide_quads(m, strategy == SubD::linear);
+        }
+    }
+
+    // Meshes with boundary need boundary faces, which from_flat finds
+    if(!m.closed()) {
+        from_flat(m.face_start, m.corner_vert, m.verts);
+        return true;
+    }
+
+    // Otherwise every corner is one halfedge, so the connectivity can be linked
+    // directly and in parallel
+    clear();
+    std::vector<VertexRef> vs(m.verts.size());
+    std::vector<EdgeRef> es(m.edge_verts.size());
+    std::vector<FaceRef> fs(m.n_faces());
+    std::vector<HalfedgeRef> hs(m.n_corners());
+    for(size_t v = 0; v < vs.size(); v++) {
+        vs[v] = new_vertex();
+        vs[v]->pos = m.verts[v];
+    }
+    for(auto& e : es) e = new_edge();
+    for(auto& f : fs) f = new_face();
+    for(auto& h : hs) h = new_halfedge();
+
+    parallel_for(0, hs.size(), 4096, [&](size_t c) {
+        auto [c0, c1] = m.edge_corners[m.corner_edge[c]];
+        hs[c]->set_neighbors(hs[m.next(c)], hs[c0 == c ? c1 : c0], vs[m.corner_vert[c]],
+                             es[m.corner_edge[c]], fs[m.corner_face[c]]);
+    });
+    parallel_for(0, vs.size(), 4096,
+                 [&](size_t v) { vs[v]->halfedge() = hs[m.vert_corners[m.vert_start[v]]]; });
+    parallel_for(0, es.size(), 4096,
+                 [&](size_t e) { es[e]->halfedge() = hs[m.edge_corners[e].first]; });
+    parallel_for(0, fs.size(), 4096,
+                 [&](size_t f) { fs[f]->halfedge() = hs[m.face_start[f]]; });
+    return true;
+}
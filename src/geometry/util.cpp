@@ -1,88 +1,113 @@
 
 #include "util.h"
 
+#include <cstring>
+#include <functional>
 #include <map>
+#include <mutex>
+#include <unordered_map>
 
 namespace Util {
 
+// Generated meshes, keyed by generator and parameters. Meshes handed out share the
+// cached buffers until edited (see GL::Mesh::copy), so gizmos, particles and shape
+// approximations asking for the same primitive again cost nothing to build.
+static GL::Mesh cached(std::vector<float> key, const std::function<Gen::Data()>& make) {
+
+    struct Entry {
+        std::shared_ptr<std::vector<GL::Mesh::Vert>> verts;
+        std::shared_ptr<std::vector<GL::Mesh::Index>> elems;
+    };
+    // Keys come from user-set sizes too, so the cache is dropped when it fills up
+    static constexpr size_t max_entries = 256;
+    static std::mutex lock;
+    static std::map<std::vector<float>, Entry> cache;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto entry = cache.find(key);
+        if(entry != cache.end()) return GL::Mesh(entry->second.verts, entry->second.elems);
+    }
+
+    Gen::Data data = make();
+    Entry made{std::make_shared<std::vector<GL::Mesh::Vert>>(std::move(data.verts)),
+               std::make_shared<std::vector<GL::Mesh::Index>>(std::move(data.elems))};
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(cache.size() >= max_entries) cache.clear();
+        cache.emplace(std::move(key), made);
+    }
+    return GL::Mesh(made.verts, made.elems);
+}
+
+// Generators, for the cache keys
+enum class Prim : int { cone, cyl_disjoint, torus, cube, quad, sphere, hemi, capsule, arrow, scale };
+
+static float key(Prim p) {
+    return (float)p;
+}
+
 GL::Mesh cyl_mesh(float radius, float height, int sides, bool cap) {
     return cone_mesh(radius, radius, height, sides, cap);
 }
 
 GL::Mesh arrow_mesh(float rbase, float rtip, float height) {
-    Gen::Data base = Gen::cone(rbase, rbase, 0.75f * height, 10, true);
-    Gen::Data tip = Gen::cone(rtip, 0.001f, 0.25f * height, 10, true);
-    for(auto& v : tip.verts) v.pos.y += 0.7f;
-    return Gen::merge(std::move(base), std::move(tip));
+    return cached({key(Prim::arrow), rbase, rtip, height}, [=]() {
+        Gen::Data base = Gen::cone(rbase, rbase, 0.75f * height, 10, true);
+        Gen::Data tip = Gen::cone(rtip, 0.001f, 0.25f * height, 10, true);
+        for(auto& v : tip.verts) v.pos.y += 0.7f;
+        return Gen::merge_data(std::move(base), std::move(tip));
+    });
 }
 
 GL::Mesh scale_mesh() {
-    Gen::Data base = Gen::cone(0.03f, 0.03f, 0.7f, 10, true);
-    Gen::Data tip = Gen::cube(0.1f);
-    for(auto& v : tip.verts) v.pos.y += 0.7f;
-    return Gen::merge(std::move(base), std::move(tip));
+    return cached({key(Prim::scale)}, []() {
+        Gen::Data base = Gen::cone(0.03f, 0.03f, 0.7f, 10, true);
+        Gen::Data tip = Gen::cube(0.1f);
+        for(auto& v : tip.verts) v.pos.y += 0.7f;
+        return Gen::merge_data(std::move(base), std::move(tip));
+    });
 }
 
 GL::Mesh cone_mesh(float bradius, float tradius, float height, int sides, bool cap) {
-    Gen::Data cone = Gen::cone(bradius, tradius, height, sides, cap);
-    return Gen::dedup({std::move(cone.verts), std::move(cone.elems)});
+    return cached({key(Prim::cone), bradius, tradius, height, (float)sides, (float)cap}, [=]() {
+        return Gen::dedup_data(Gen::cone(bradius, tradius, height, sides, cap));
+    });
 }
 
 GL::Mesh cyl_mesh_disjoint(float radius, float height, int sides) {
-    Gen::Data cone = Gen::cone(radius, radius, height, sides, false);
-    return GL::Mesh(std::move(cone.verts), std::move(cone.elems));
+    return cached({key(Prim::cyl_disjoint), radius, height, (float)sides},
+                  [=]() { return Gen::cone(radius, radius, height, sides, false); });
 }
 
 GL::Mesh torus_mesh(float iradius, float oradius, int segments, int sides) {
-    Gen::Data torus = Gen::torus(iradius, oradius, segments, sides);
-    return Gen::dedup({std::move(torus.verts), std::move(torus.elems)});
+    return cached({key(Prim::torus), iradius, oradius, (float)segments, (float)sides}, [=]() {
+        return Gen::dedup_data(Gen::torus(iradius, oradius, segments, sides));
+    });
 }
 
 GL::Mesh cube_mesh(float r) {
-    Gen::Data cube = Gen::cube(r);
-    return GL::Mesh(std::move(cube.verts), std::move(cube.elems));
+    return cached({key(Prim::cube), r}, [=]() { return Gen::cube(r); });
 }
 
 GL::Mesh square_mesh(float r) {
-    Gen::Data square = Gen::quad(r, r);
-    return GL::Mesh(std::move(square.verts), std::move(square.elems));
+    return quad_mesh(r, r);
 }
 
 GL::Mesh quad_mesh(float x, float y) {
-    Gen::Data square = Gen::quad(x, y);
-    return GL::Mesh(std::move(square.verts), std::move(square.elems));
+    return cached({key(Prim::quad), x, y}, [=]() { return Gen::quad(x, y); });
 }
 
 GL::Mesh sphere_mesh(float r, int i) {
-    Gen::Data ico_sphere = Gen::ico_sphere(r, i);
-    return GL::Mesh(std::move(ico_sphere.verts), std::move(ico_sphere.elems));
+    return cached({key(Prim::sphere), r, (float)i}, [=]() { return Gen::ico_sphere(r, i); });
 }
 
 GL::Mesh hemi_mesh(float r) {
-    Gen::Data hemi = Gen::uv_hemisphere(r);
-    return GL::Mesh(std::move(hemi.verts), std::move(hemi.elems));
+    return cached({key(Prim::hemi), r}, [=]() { return Gen::uv_hemisphere(r); });
 }
 
 GL::Mesh capsule_mesh(float h, float r) {
-
-    Gen::Data bottom = Gen::uv_hemisphere(r);
-    Gen::Data top = Gen::uv_hemisphere(r);
-    for(auto& v : top.verts) v.pos.y = -v.pos.y + h;
-    Gen::Data cyl = Gen::cone(r, r, h, 64, false);
-
-    GL::Mesh::Index cyl_off = (GL::Mesh::Index)bottom.verts.size();
-    GL::Mesh::Index top_off = cyl_off + (GL::Mesh::Index)cyl.verts.size();
-
-    for(auto& i : cyl.elems) i += cyl_off;
-    for(auto& i : top.elems) i += top_off;
-
-    bottom.verts.insert(bottom.verts.end(), cyl.verts.begin(), cyl.verts.end());
-    bottom.elems.insert(bottom.elems.end(), cyl.elems.begin(), cyl.elems.end());
-
-    bottom.verts.insert(bottom.verts.end(), top.verts.begin(), top.verts.end());
-    bottom.elems.insert(bottom.elems.end(), top.elems.begin(), top.elems.end());
-
-    return GL::Mesh(std::move(bottom.verts), std::move(bottom.elems));
+    return cached({key(Prim::capsule), h, r}, [=]() { return Gen::capsule(h, r); });
 }
 
 GL::Lines spotlight_mesh(Vec3 color, float inner, float outer) {
@@ -112,37 +137,174 @@ GL::Lines spotlight_mesh(Vec3 color, float inner, float outer) {
 
 namespace Gen {
 
-GL::Mesh dedup(Data&& d) {
+Data capsule(float h, float r) {
 
-    std::vector<GL::Mesh::Vert> verts;
-    std::vector<GL::Mesh::Index> elems;
+    Data bottom = uv_hemisphere(r);
+    Data top = uv_hemisphere(r);
+    for(auto& v : top.verts) v.pos.y = -v.pos.y + h;
+    Data cyl = cone(r, r, h, 64, false);
+
+    GL::Mesh::Index cyl_off = (GL::Mesh::Index)bottom.verts.size();
+    GL::Mesh::Index top_off = cyl_off + (GL::Mesh::Index)cyl.verts.size();
+
+    for(auto& i : cyl.elems) i += cyl_off;
+    for(auto& i : top.elems) i += top_off;
+
+    bottom.verts.insert(bottom.verts.end(), cyl.verts.begin(), cyl.verts.end());
+    bottom.elems.insert(bottom.elems.end(), cyl.elems.begin(), cyl.elems.end());
+
+    bottom.verts.insert(bottom.verts.end(), top.verts.begin(), top.verts.end());
+    bottom.elems.insert(bottom.elems.end(), top.elems.begin(), top.elems.end());
+
+    return bottom;
+}
+
+Data tube(float radius, float height, int rings, int sides) {
+    Data data;
+    for(int i = 0; i <= rings; i++) {
+        float y = height * i / rings;
+        for(int j = 0; j < sides; j++) {
+            float t = 2.0f * PI_F * j / sides;
+            Vec3 n{std::cos(t), 0.0f, std::sin(t)};
+            data.verts.push_back({n * radius + Vec3{0.0f, y, 0.0f}, n, 0});
+        }
+    }
+    for(int i = 0; i < rings; i++) {
+        for(int j = 0; j < sides; j++) {
+            GL::Mesh::Index a = i * sides + j, b = i * sides + (j + 1) % sides;
+            GL::Mesh::Index c = a + sides, d = b + sides;
+            data.elems.insert(data.elems.end(), {a, c, b, b, c, d});
+        }
+    }
+    return data;
+}
+
+// Hashes the bits of each coordinate, with -0 counted as 0 since they compare equal
+struct Pos_Hash {
+    size_t operator()(Vec3 v) const {
+        size_t h = 0;
+        for(float f : {v.x + 0.0f, v.y + 0.0f, v.z + 0.0f}) {
+            uint32_t bits;
+            std::memcpy(&bits, &f, sizeof(bits));
+            h = (h ^ bits) * 0x100000001b3ull;
+        }
+        return h ^ (h >> 29);
+    }
+};
+
+Data dedup_data(Data&& d) {
+
+    Data out;
+    out.elems.reserve(d.elems.size());
 
     // normals be damned
-    std::map<Vec3, GL::Mesh::Index> v_to_idx;
-
-    for(size_t i = 0; i < d.elems.size(); i++) {
-        GL::Mesh::Index idx = d.elems[i];
-        GL::Mesh::Vert v = d.verts[idx];
-        auto entry = v_to_idx.find(v.pos);
-        GL::Mesh::Index new_idx;
-        if(entry == v_to_idx.end()) {
-            new_idx = (GL::Mesh::Index)verts.size();
-            v_to_idx.insert({v.pos, new_idx});
-            verts.push_back(v);
-        } else {
-            new_idx = entry->second;
+    std::unordered_map<Vec3, GL::Mesh::Index, Pos_Hash> v_to_idx;
+    v_to_idx.reserve(d.verts.size());
+
+    for(GL::Mesh::Index idx : d.elems) {
+        const GL::Mesh::Vert& v = d.verts[idx];
+        auto [entry, added] = v_to_idx.try_emplace(v.pos, (GL::Mesh::Index)out.verts.size());
+        if(added) out.verts.push_back(v);
+        out.elems.push_back(entry->second);
+    }
+
+    return out;
+}
+
+Data cluster(const std::vector<GL::Mesh::Vert>& verts, const std::vector<GL::Mesh::Index>& elems,
+             int res) {
+
+    BBox box;
+    for(const GL::Mesh::Vert& v : verts) box.enclose(v.pos);
+    Vec3 extent = box.max - box.min;
+    float cell = std::max(std::max(extent.x, extent.y), extent.z) / (float)std::max(res, 1);
+    if(!(cell > 0.0f)) cell = 1.0f;
+
+    // Cells by their coordinates, 21 bits each
+    auto key = [&](Vec3 p) {
+        Vec3 c = (p - box.min) / cell;
+        uint64_t x = (uint64_t)std::min(c.x, 2097151.0f);
+        uint64_t y = (uint64_t)std::min(c.y, 2097151.0f);
+        uint64_t z = (uint64_t)std::min(c.z, 2097151.0f);
+        return x | y << 21 | z << 42;
+    };
+
+    Data out;
+    std::vector<GL::Mesh::Index> remap(verts.size());
+    std::vector<float> counts;
+    std::unordered_map<uint64_t, GL::Mesh::Index> cells;
+    cells.reserve(verts.size() / 4);
+    for(size_t i = 0; i < verts.size(); i++) {
+        GL::Mesh::Index next = (GL::Mesh::Index)out.verts.size();
+        auto [entry, added] = cells.try_emplace(key(verts[i].pos), next);
+        if(added) {
+            out.verts.push_back({Vec3{}, Vec3{}, verts[i].id});
+            counts.push_back(0.0f);
         }
-        elems.push_back(new_idx);
+        out.verts[entry->second].pos += verts[i].pos;
+        counts[entry->second] += 1.0f;
+        remap[i] = entry->second;
+    }
+    for(size_t i = 0; i < out.verts.size(); i++) out.verts[i].pos /= counts[i];
+
+    for(size_t i = 0; i + 2 < elems.size(); i += 3) {
+        GL::Mesh::Index a = remap[elems[i]], b = remap[elems[i + 1]], c = remap[elems[i + 2]];
+        if(a == b || b == c || c == a) continue;
+        out.elems.insert(out.elems.end(), {a, b, c});
+
+        // Summed unnormalized, so weighted by area
+        Vec3 n = cross(out.verts[b].pos - out.verts[a].pos, out.verts[c].pos - out.verts[a].pos);
+        out.verts[a].norm += n;
+        out.verts[b].norm += n;
+        out.verts[c].norm += n;
+    }
+    for(GL::Mesh::Vert& v : out.verts) {
+        if(v.norm.norm_squared() > 0.0f) v.norm.normalize();
     }
 
-    return GL::Mesh(std::move(verts), std::move(elems));
+    return out;
 }
 
-GL::Mesh merge(Data&& l, Data&& r) {
+std::vector<Data> lods(const std::vector<GL::Mesh::Vert>& verts,
+                       const std::vector<GL::Mesh::Index>& elems, size_t min_tris) {
+
+    std::vector<Data> levels;
+    size_t tris = elems.size() / 3;
+
+    // A surface clustered at res cells across keeps on the order of res^2 triangles,
+    // so res is guessed from that, then corrected once by how far off it was
+    while(tris / 4 >= min_tris) {
+        size_t target = tris / 4;
+        float res = std::sqrt((float)target / 2.0f);
+        Data level = cluster(verts, elems, (int)res);
+        size_t got = level.elems.size() / 3;
+        if(got > target + target / 2 || got < target / 2) {
+            res *= std::sqrt((float)target / (float)std::max(got, size_t(1)));
+            level = cluster(verts, elems, (int)res);
+            got = level.elems.size() / 3;
+        }
+        if(got < min_tris || got >= tris) break;
+        tris = got;
+        levels.push_back(std::move(level));
+    }
+    return levels;
+}
+
+GL::Mesh dedup(Data&& d) {
+    Data out = dedup_data(std::move(d));
+    return GL::Mesh(std::move(out.verts), std::move(out.elems));
+}
+
+Data merge_data(Data&& l, Data&& r) {
     for(auto& i : r.elems) i += (GL::Mesh::Index)l.verts.size();
     l.verts.insert(l.verts.end(), r.verts.begin(), r.verts.end());
     l.elems.insert(l.elems.end(), r.elems.begin(), r.elems.end());
-    return GL::Mesh(std::move(l.verts), std::move(l.elems));
+    return std::move(l);
+}
+
+GL::Mesh merge(Data&& l, Data&& r) {
+    Data out = merge_data(std::move(l), std::move(r));
+    return GL::Mesh(std::move(out.verts), std::move(out.elems));
 }
 
 LData merge(LData&& l, LData&& r) {
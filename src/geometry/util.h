@@ -34,9 +34,21 @@ struct LData {
 };
 
 GL::Mesh merge(Data&& l, Data&& r);
+Data merge_data(Data&& l, Data&& r);
 LData merge(LData&& l, LData&& r);
 LData circle(Vec3 color, float r, int sides);
+// Merges vertices at identical positions, in time linear in the number of indices
 GL::Mesh dedup(Data&& d);
+Data dedup_data(Data&& d);
+// Vertex clustering: snaps the vertices to a grid of res cells along the longest side
+// of their bounds, merging those in each cell at their average, and drops the
+// triangles that collapse. Normals are recomputed, smooth, from what remains.
+Data cluster(const std::vector<GL::Mesh::Vert>& verts, const std::vector<GL::Mesh::Index>& elems,
+             int res);
+// Levels of detail for a triangle mesh: clusterings with about a quarter of the
+// triangles of the level before, down to (but not under) min_tris
+std::vector<Data> lods(const std::vector<GL::Mesh::Vert>& verts,
+                       const std::vector<GL::Mesh::Index>& elems, size_t min_tris);
 
 // https://wiki.unity3d.com/index.php/ProceduralPrimitives
 Data cube(float r);
@@ -45,6 +57,10 @@ Data ico_sphere(float radius, int level);
 Data uv_hemisphere(float radius);
 Data cone(float bradius, float tradius, float height, int sides, bool caps);
 Data torus(float iradius, float oradius, int segments, int sides);
+Data capsule(float h, float r);
+// An open tube standing on the origin, ringed finely enough to bend smoothly (e.g. when
+// skinned to a chain of joints)
+Data tube(float radius, float height, int rings, int sides);
 
 } // namespace Gen
 } // namespace Util
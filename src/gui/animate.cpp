@@ -136,14 +136,15 @@ void Animate::make_spline(Scene_ID id, const Anim_Pose& pose) {
     GL::Lines& lines = entry->second;
     lines.clear();
 
-    Vec3 prev = pose.at(0.0f).pos;
-    for(int i = 1; i < max_frame; i++) {
+    size_t n = std::max(max_frame, 1);
+    std::vector<float> times(n);
+    std::vector<Pose> poses(n);
+    for(size_t i = 0; i < n; i++) times[i] = (float)i;
+    pose.at(times.data(), n, poses.data());
 
-        float f = (float)i;
+    for(size_t i = 1; i < n; i++) {
         float c = (float)(i % 20) / 19.0f;
-        Vec3 cur = pose.at(f).pos;
-        lines.add(prev, cur, Vec3{c, c, 1.0f});
-        prev = cur;
+        lines.add(poses[i - 1].pos, poses[i].pos, Vec3{c, c, 1.0f});
     }
 }
 
@@ -157,13 +158,15 @@ void Animate::camera_spline() {
     GL::Lines& lines = entry->second;
     lines.clear();
 
-    Vec3 prev = anim_camera.at(0.0f).pos();
-    for(int i = 1; i < max_frame; i++) {
-        float f = (float)i;
+    size_t n = std::max(max_frame, 1);
+    std::vector<float> times(n);
+    std::vector<std::tuple<Vec3, Quat, float, float, float, float>> values(n);
+    for(size_t i = 0; i < n; i++) times[i] = (float)i;
+    anim_camera.splines.at(times.data(), n, values.data());
+
+    for(size_t i = 1; i < n; i++) {
         float c = (float)(i % 20) / 19.0f;
-        Vec3 cur = anim_camera.at(f).pos();
-        lines.add(prev, cur, Vec3{c, c, 1.0f});
-        prev = cur;
+        lines.add(std::get<0>(values[i - 1]), std::get<0>(values[i]), Vec3{c, c, 1.0f});
     }
 }
 
@@ -209,7 +212,22 @@ void Animate::UIsidebar(Manager& manager, Undo& undo, Scene_Maybe obj_opt, Camer
         if(item.is<Scene_Object>()) {
             Scene_Object& obj = item.get<Scene_Object>();
             if(obj.armature.has_bones()) {
+                Skeleton::IK_Options& ik = obj.armature.ik;
+                ImGui::Text("Inverse Kinematics");
+                ImGui::Combo("Solver", (int*)&ik.solver, Skeleton::IK_Solver_Names,
+                             (int)Skeleton::IK_Solver::count);
+                ImGui::SliderInt("Max Iterations", &ik.max_iters, 1, 1000);
+                ImGui::DragFloat("Tolerance", &ik.tolerance, 0.0001f, 0.0f, 1.0f, "%.4f");
+                if(ik.solver == Skeleton::IK_Solver::damped_least_squares) {
+                    ImGui::DragFloat("Damping", &ik.damping, 0.01f, 0.001f, 10.0f, "%.3f");
+                }
+                ImGui::Separator();
                 if(obj.armature.do_ik()) obj.set_pose_dirty();
+
+                if(ImGui::Combo("Skinning", (int*)&obj.armature.skin_mode,
+                                Skeleton::Skin_Mode_Names, (int)Skeleton::Skin_Mode::count))
+                    obj.set_pose_dirty();
+                ImGui::Separator();
             }
         }
     }
@@ -350,6 +368,7 @@ void Animate::timeline(Manager& manager, Undo& undo, Scene& scene, Scene_Maybe o
     if(!playing) {
         if(ImGui::Button("Play")) {
             playing = true;
+            bake_frames(scene);
             last_frame = SDL_GetPerformanceCounter();
         }
     } else {
@@ -390,11 +409,24 @@ void Animate::timeline(Manager& manager, Undo& undo, Scene& scene, Scene_Maybe o
         set_time(scene, (float)current_frame);
     }
 
-    ImGui::SliderInt("Rate", &frame_rate, 1, 240);
+    if(ImGui::SliderInt("Rate", &frame_rate, 1, 240)) simulate.clear_cache();
     frame_rate = clamp(frame_rate, 1, 240);
 
     ImGui::Checkbox("Draw Splines", &visualize_splines);
 
+    if(ImGui::Checkbox("Cache Simulation", &simulate.cache_sim) && !simulate.cache_sim) {
+        simulate.clear_cache();
+    }
+    if(simulate.cache_sim) {
+        int budget_mb = (int)(simulate.cache_budget >> 20);
+        if(ImGui::DragInt("Cache Budget (MB)", &budget_mb, 16.0f, 16, 65536)) {
+            simulate.cache_budget = (size_t)clamp(budget_mb, 16, 65536) << 20;
+        }
+        ImGui::Text("%zu frames cached (%.1f MB)", simulate.cache_frames(),
+                    simulate.cache_bytes() / (1024.0 * 1024.0));
+        if(ImGui::Button("Clear Cache")) simulate.clear_cache();
+    }
+
     ImGui::NextColumn();
 
     Scene_Item* select = nullptr;
@@ -674,14 +706,18 @@ void Animate::timeline(Manager& manager, Undo& undo, Scene& scene, Scene_Maybe o
 }
 
 void Animate::step_sim(Scene& scene) {
-    simulate.step(scene, 1.0f / frame_rate);
+    simulate.step_frame(scene, current_frame, 1.0f / frame_rate);
 }
 
-Camera Animate::set_time(Scene& scene, float time) {
+Camera Animate::set_time(Scene& scene, float time, bool force) {
 
     current_frame = (int)time;
 
-    scene.for_items([time](Scene_Item& item) { item.set_time(time); });
+    // Emitters step from the previous frame's scene, as in playback, so any
+    // simulating happens before the scene moves on
+    simulate.seek_frame(scene, current_frame, 1.0f / frame_rate);
+
+    scene.for_items([time, force](Scene_Item& item) { item.set_time(time, force); });
 
     Camera cam = anim_camera.at(time);
     if(anim_camera.splines.any()) {
@@ -694,12 +730,19 @@ Camera Animate::set_time(Scene& scene, float time) {
     return cam;
 }
 
+void Animate::bake_frames(Scene& scene) {
+    size_t n = std::max(max_frame, 0);
+    scene.for_items([n](Scene_Item& item) { item.bake_frames(n); });
+    anim_camera.splines.bake_frames(n);
+}
+
 void Animate::set_max(int frames) {
     max_frame = frames;
     current_frame = std::min(current_frame, max_frame - 1);
 }
 
 void Animate::set(int n_frames, int fps, bool replace) {
+    simulate.clear_cache();
     if(replace) {
         max_frame = n_frames;
         frame_rate = fps;
@@ -722,6 +765,10 @@ float Animate::fps() const {
     return (float)frame_rate;
 }
 
+const PT::Pathtracer& Animate::tracer() const {
+    return ui_render.tracer();
+}
+
 int Animate::n_frames() const {
     return max_frame;
 }
@@ -731,10 +778,11 @@ std::string Animate::pump_output(Scene& scene) {
 }
 
 void Animate::refresh(Scene& scene) {
-    set_time(scene, (float)current_frame);
+    set_time(scene, (float)current_frame, true);
 }
 
 void Animate::clear() {
+    simulate.clear_cache();
     anim_camera.splines.clear();
     joint_select = nullptr;
     handle_select = nullptr;
@@ -52,8 +52,14 @@ public:
     void step_sim(Scene& scene);
 
     std::string pump_output(Scene& scene);
-    Camera set_time(Scene& scene, float time);
+    // Forcing re-evaluates every item's animation, even where it can't have changed
+    Camera set_time(Scene& scene, float time, bool force = false);
+    // Evaluates every animation at each frame up front, making stepping through them
+    // (playback, rendering) a lookup per spline; edits drop what they invalidate
+    void bake_frames(Scene& scene);
     float fps() const;
+    // What renders the animation, separate from the render window's
+    const PT::Pathtracer& tracer() const;
     int n_frames() const;
     const Anim_Camera& camera() const;
     Anim_Camera& camera();
@@ -1,10 +1,14 @@
 
+#include <algorithm>
 #include <imgui/imgui.h>
+#include <map>
 #include <nfd/nfd.h>
+#include <string_view>
 
 #include "manager.h"
 
 #include "../geometry/util.h"
+#include "../platform/platform.h"
 #include "../scene/renderer.h"
 
 namespace Gui {
@@ -119,10 +123,10 @@ static bool postfix(const std::string& path, const std::string& type) {
 bool Manager::save_scene(Scene& scene, Undo& undo) {
     if(save_file.empty()) {
         char* path = nullptr;
-        NFD_SaveDialog("dae", nullptr, &path);
+        NFD_SaveDialog("dae,assbin", nullptr, &path);
         if(path) {
             save_file = std::string(path);
-            if(!postfix(save_file, ".dae")) {
+            if(!postfix(save_file, ".dae") && !postfix(save_file, ".assbin")) {
                 save_file += ".dae";
             }
             free(path);
@@ -140,10 +144,11 @@ bool Manager::save_scene(Scene& scene, Undo& undo) {
 bool Manager::write_scene(Scene& scene) {
 
     char* path = nullptr;
-    NFD_SaveDialog("dae", nullptr, &path);
+    NFD_SaveDialog("dae,assbin,obj,ply", nullptr, &path);
     if(path) {
         std::string spath(path);
-        if(!postfix(path, ".dae")) {
+        if(!postfix(path, ".dae") && !postfix(path, ".assbin") && !postfix(path, ".obj") &&
+           !postfix(path, ".ply")) {
             spath += ".dae";
         }
         std::string error = scene.write(spath, render.get_cam(), animate);
@@ -158,8 +163,17 @@ void Manager::set_file(std::string save) {
     save_file = save;
 }
 
+void Manager::set_scene_cache(std::string dir) {
+    load_opt.cache_dir = dir;
+}
+
 void Manager::load_scene(Scene& scene, Undo& undo, bool clear) {
 
+    if(scene.loading()) {
+        set_error("Another scene is still loading.");
+        return;
+    }
+
     after_save = [this, &scene, &undo, clear](bool success) {
         if(!success) {
             save_first_shown = true;
@@ -170,23 +184,11 @@ void Manager::load_scene(Scene& scene, Undo& undo, bool clear) {
         NFD_OpenDialog(scene_file_types, nullptr, &path);
         if(!path) return;
 
-        if(clear) {
-            save_file = std::string(path);
-            layout.clear_select();
-            model.unset_mesh();
-        }
-
+        // Finished by UIloading once the file is parsed
+        load_file = std::string(path);
+        load_clears = clear;
         load_opt.new_scene = clear;
-        std::string error = scene.load(load_opt, undo, *this, std::string(path));
-        set_error(error);
-
-        if(clear && error.empty()) {
-            n_actions_at_last_save = undo.n_actions();
-            simulate.build_scene(scene);
-        } else {
-            undo.inc_actions();
-        }
-        simulate.update_time();
+        scene.begin_load(load_opt, load_file);
 
         free(path);
     };
@@ -203,11 +205,21 @@ void Manager::load_image(Scene_Light& light) {
     char* path = nullptr;
     NFD_OpenDialog(image_file_types, nullptr, &path);
     if(path) {
-        std::string error = light.emissive_load(std::string(path));
-        set_error(error);
+        // Swapped in by UIemissive once decoded
+        light.emissive_load_async(std::string(path));
         free(path);
     }
-    light.dirty();
+}
+
+void Manager::UIemissive(Scene& scene, Undo& undo) {
+    scene.for_each<Scene_Light>([&](Scene_Light& light) {
+        Scene_Light::Options old_opt = light.opt;
+        std::string error;
+        if(!light.emissive_poll(error)) return;
+        set_error(error);
+        light.dirty();
+        if(old_opt != light.opt) undo.update_light(light.id(), old_opt);
+    });
 }
 
 void Manager::particles_edit_gui(Undo& undo, Scene_Particles& particles) {
@@ -243,6 +255,8 @@ void Manager::particles_edit_gui(Undo& undo, Scene_Particles& particles) {
     activate();
     ImGui::Checkbox("Enabled", &opt.enabled);
     activate();
+    ImGui::Checkbox("Collide With Each Other", &opt.collide);
+    activate();
 
     if(ImGui::Button("Clear##particles")) {
         particles.clear();
@@ -382,6 +396,15 @@ Mode Manager::item_options(Undo& undo, Mode cur_mode, Scene_Item& item, Pose& ol
                 }
                 if(ImGui::Checkbox("Show Wireframe", &obj.opt.wireframe)) update();
                 if(ImGui::Checkbox("Render", &obj.opt.render)) update();
+                if(ImGui::Checkbox("Light Portal", &obj.opt.portal)) update();
+                if(ImGui::Checkbox("Custom BVH", &obj.opt.custom_bvh)) update();
+                if(obj.opt.custom_bvh) {
+                    ImGui::SameLine();
+                    if(ImGui::Combo("Profile", (int*)&obj.opt.bvh_profile, PT::BVH_Profile_Names,
+                                    (int)PT::BVH_Profile::count)) {
+                        update();
+                    }
+                }
             }
             if(ImGui::Combo("Use Implicit Shape", (int*)&obj.opt.shape_type, PT::Shape_Type_Names,
                             (int)PT::Shape_Type::count)) {
@@ -475,12 +498,9 @@ void Manager::light_edit_gui(Undo& undo, Scene_Light& light) {
         } else {
             if(ImGui::Button("Use Texture Map")) {
                 load_image(light);
-                if(light.opt.has_emissive_map) {
-                    old_opt = start_opt;
-                    U = true;
-                }
             }
         }
+        if(light.emissive_loading()) ImGui::Text("Loading map...");
     } break;
     case Light_Type::spot: {
         ImGui::DragFloat2("Angle Cutoffs", light.opt.angle_bounds.data, 1.0f, 0.0f, 360.0f);
@@ -879,11 +899,37 @@ void Manager::render_ui(Scene& scene, Undo& undo, Camera& cam) {
     UIsidebar(scene, undo, height, cam);
     UIerror();
     UIstudent();
-    UIsettings();
+    UIsettings(undo);
+    UIprofiler();
+    UImemory(scene, undo);
+    UIframe_stats(height);
     UIsavefirst(scene, undo);
+    UIloading(scene, undo);
+    UIemissive(scene, undo);
     set_error(animate.pump_output(scene));
 }
 
+float Manager::redraw_interval(Scene& scene) {
+
+    if(animate.playing_or_rendering() || profiler_recording) return 0.0f;
+    // Outside these modes, particles are simulated in real time
+    if(mode != Mode::model && mode != Mode::rig && mode != Mode::animate &&
+       scene.count<Scene_Particles>() > 0) {
+        return 0.0f;
+    }
+
+    float interval = render.redraw_interval();
+    // The loading dialog's progress, an environment map to swap in, and the cursor of
+    // a text field blinking
+    bool emissive_loading = false;
+    scene.for_each<Scene_Light>(
+        [&](const Scene_Light& light) { emissive_loading |= light.emissive_loading(); });
+    if(scene.loading() || emissive_loading || ImGui::GetIO().WantTextInput) {
+        interval = std::min(interval, Widget_Render::progress_interval);
+    }
+    return interval;
+}
+
 Rig& Manager::get_rig() {
     return rig;
 }
@@ -922,7 +968,43 @@ void Manager::UIsavefirst(Scene& scene, Undo& undo) {
     ImGui::End();
 }
 
-void Manager::UIsettings() {
+void Manager::UIloading(Scene& scene, Undo& undo) {
+
+    if(!scene.loading()) return;
+
+    if(scene.load_ready()) {
+
+        if(load_clears) {
+            save_file = load_file;
+            layout.clear_select();
+            model.unset_mesh();
+        }
+
+        std::string error = scene.finish_load(undo, *this);
+        set_error(error);
+
+        if(load_clears && error.empty()) {
+            n_actions_at_last_save = undo.n_actions();
+            simulate.build_scene(scene);
+        } else {
+            undo.inc_actions();
+        }
+        simulate.update_time();
+        return;
+    }
+
+    Vec2 center = window_dim / 2.0f;
+    ImGui::SetNextWindowPos(Vec2{center.x, center.y}, ImGuiCond_Appearing, Vec2{0.5f, 0.5f});
+    ImGui::Begin("Loading Scene", nullptr,
+                 ImGuiWindowFlags_NoSavedSettings | ImGuiWindowFlags_NoResize |
+                     ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoCollapse);
+    ImGui::Text("%s", load_file.c_str());
+    ImGui::ProgressBar(scene.load_progress(), Vec2{300.0f, 0.0f});
+    if(ImGui::Button("Cancel")) scene.cancel_load();
+    ImGui::End();
+}
+
+void Manager::UIsettings(Undo& undo) {
 
     if(!settings_shown) return;
 
@@ -941,6 +1023,7 @@ void Manager::UIsettings() {
     ImGui::Checkbox("Generate Smooth Normals", &load_opt.gen_smooth_normals);
     ImGui::Checkbox("Fix Infacing Normals", &load_opt.fix_infacing_normals);
     ImGui::Checkbox("Debone", &load_opt.debone);
+    ImGui::Checkbox("Defer Halfedges Until Edited", &load_opt.defer_halfedge);
 
     ImGui::Separator();
     ImGui::Text("UI Renderer");
@@ -950,6 +1033,22 @@ void Manager::UIsettings() {
     if(ImGui::Button("Apply")) {
         Renderer::get().set_samples(samples.n_samples());
     }
+    ImGui::Checkbox("Skin Meshes on GPU", &Renderer::get().gpu_skinning);
+    ImGui::Checkbox("Simplify Distant Meshes", &Renderer::get().mesh_lod);
+    ImGui::Checkbox("Preview Materials", &Renderer::get().material_preview);
+    int skin_cache = (int)(Scene_Object::skin_cache_budget >> 20);
+    if(ImGui::InputInt("Skinned Pose Cache (MB)", &skin_cache)) {
+        Scene_Object::skin_cache_budget = size_t(std::max(skin_cache, 0)) << 20;
+    }
+
+    ImGui::Separator();
+    ImGui::Text("Undo History");
+    int budget = (int)(undo.budget() >> 20);
+    bool spill = undo.spills();
+    bool changed = ImGui::InputInt("Memory Budget (MB)", &budget);
+    changed |= ImGui::Checkbox("Spill to Disk", &spill);
+    if(changed) undo.set_budget(size_t(std::max(budget, 0)) << 20, spill);
+    ImGui::Text("In use: %.1f MB", undo.memory() / (1024.0 * 1024.0));
 
     ImGui::Separator();
     ImGui::Text("GPU: %s", GL::renderer().c_str());
@@ -958,6 +1057,216 @@ void Manager::UIsettings() {
     ImGui::End();
 }
 
+void Manager::UImemory(Scene& scene, Undo& undo) {
+
+    if(!memory_shown) return;
+
+    ImGui::Begin("Memory", &memory_shown,
+                 ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoSavedSettings);
+
+    ImGui::Columns(2);
+    auto row = [](const char* name, size_t bytes) {
+        ImGui::Text("%s", name);
+        ImGui::NextColumn();
+        ImGui::Text("%.1f MB", bytes / (1024.0 * 1024.0));
+        ImGui::NextColumn();
+    };
+    auto tracer = [&](const char* name, const PT::Pathtracer& pt) {
+        PT::Pathtracer::Memory m = pt.memory();
+        row(name, m.scene + m.meshes + m.images);
+        row("    Scene BVH", m.scene);
+        row("    Mesh BVHs", m.meshes);
+        row("    Images", m.images);
+    };
+
+    Scene::Memory s = scene.memory();
+    row("Scene", s.total());
+    row("    Halfedge Meshes", s.halfedge);
+    row("    Mesh Copies", s.meshes);
+    row("    Skinning", s.skinning);
+    row("    Particles", s.particles);
+    row("    Images", s.images);
+    ImGui::Separator();
+    row("Undo History", undo.memory());
+    row("Simulation Cache", simulate.cache_bytes());
+    ImGui::Separator();
+    tracer("Render", render.tracer());
+    tracer("Animation Render", animate.tracer());
+    ImGui::Separator();
+    row("Peak Process Memory", Platform::peak_memory());
+    ImGui::Columns(1);
+
+    ImGui::End();
+}
+
+static ImU32 zone_color(const char* name) {
+    size_t hash = std::hash<std::string_view>()(name);
+    return ImColor::HSV((hash % 360) / 360.0f, 0.45f, 0.9f);
+}
+
+void Manager::UIframe_stats(float menu_height) {
+
+    if(!frame_stats_shown) return;
+
+    // In the viewport's top right corner, under the menu
+    const float pad = 10.0f;
+    ImGui::SetNextWindowPos(Vec2{window_dim.x - pad, menu_height + pad}, ImGuiCond_Always,
+                            Vec2{1.0f, 0.0f});
+    ImGui::SetNextWindowBgAlpha(0.5f);
+    ImGui::Begin("Frame Stats", &frame_stats_shown,
+                 ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_AlwaysAutoResize |
+                     ImGuiWindowFlags_NoSavedSettings | ImGuiWindowFlags_NoFocusOnAppearing |
+                     ImGuiWindowFlags_NoNav | ImGuiWindowFlags_NoMove);
+
+    const Renderer::Frame_Stats& stats = Renderer::get().frame_stats();
+    float fps = stats.frame_ms > 0.0f ? 1000.0f / stats.frame_ms : 0.0f;
+    ImGui::Text("Frame: %.2f ms (%.0f fps)", stats.frame_ms, fps);
+    ImGui::Text("CPU (3D): %.2f ms", stats.cpu_ms);
+
+    float gpu_total = 0.0f;
+    for(const auto& [name, ms] : stats.gpu) gpu_total += ms;
+    if(stats.gpu.empty()) {
+        ImGui::Text("GPU: no timings");
+    } else {
+        ImGui::Text("GPU (3D): %.2f ms", gpu_total);
+        for(const auto& [name, ms] : stats.gpu) ImGui::Text("    %s: %.2f ms", name, ms);
+    }
+
+    ImGui::Separator();
+    ImGui::Text("Draw Calls: %llu", (unsigned long long)stats.draws);
+    ImGui::Text("Triangles: %llu", (unsigned long long)stats.triangles);
+    ImGui::End();
+}
+
+void Manager::UIprofiler() {
+
+    if(!profiler_shown) {
+        if(profiler_recording) Profiler::enable(false);
+        profiler_recording = false;
+        return;
+    }
+
+    int64_t span = (int64_t)(profile_span * 1e9f);
+    if(profiler_recording) Profiler::merge(profile, Profiler::collect(), Profiler::now() - span);
+
+    ImGui::SetNextWindowSize(Vec2{800.0f, 400.0f}, ImGuiCond_FirstUseEver);
+    ImGui::Begin("Profiler", &profiler_shown, ImGuiWindowFlags_NoSavedSettings);
+
+#ifndef SCOTTY3D_PROFILER
+    ImGui::Text("Built without SCOTTY3D_PROFILER, so no zones are recorded.");
+#endif
+    if(ImGui::Checkbox("Record", &profiler_recording)) {
+        Profiler::enable(profiler_recording);
+        // Zones left over from an earlier recording would leave a gap in the timeline
+        if(profiler_recording) Profiler::collect();
+    }
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(150.0f);
+    ImGui::SliderFloat("Span (s)", &profile_span, 0.01f, 2.0f, "%.2f", 2.0f);
+    ImGui::SameLine();
+    if(ImGui::Button("Clear")) profile.clear();
+    ImGui::SameLine();
+    if(ImGui::Button("Export Chrome Trace")) {
+        char* path = nullptr;
+        NFD_SaveDialog("json", nullptr, &path);
+        if(path) {
+            std::string spath(path);
+            if(!postfix(spath, ".json")) spath += ".json";
+            set_error(Profiler::write_chrome_trace(spath, profile));
+            free(path);
+        }
+    }
+
+    // The timeline ends at the last zone recorded, so it holds still when not recording
+    int64_t end = 0;
+    size_t dropped = 0;
+    for(const auto& thread : profile) {
+        for(const auto& zone : thread.zones) end = std::max(end, zone.end);
+        dropped += thread.dropped;
+    }
+    int64_t begin = end - span;
+    if(dropped) ImGui::Text("%zu zones dropped (buffer full)", dropped);
+
+    ImDrawList* draw = ImGui::GetWindowDrawList();
+    float lane = ImGui::GetTextLineHeightWithSpacing();
+    float width = ImGui::GetContentRegionAvail().x;
+    Vec2 mouse = ImGui::GetIO().MousePos;
+    bool hovered = ImGui::IsWindowHovered();
+
+    // One row per thread, with zones stacked by depth under their parents
+    for(const auto& thread : profile) {
+        uint32_t depth = 0;
+        for(const auto& zone : thread.zones) depth = std::max(depth, zone.depth);
+        ImGui::Text("%s", thread.name.c_str());
+        Vec2 origin = ImGui::GetCursorScreenPos();
+        ImGui::Dummy(Vec2{width, lane * (depth + 1)});
+
+        for(const auto& zone : thread.zones) {
+            if(zone.end < begin) continue;
+            float x0 = origin.x + width * (float)(zone.start - begin) / (float)span;
+            float x1 = origin.x + width * (float)(zone.end - begin) / (float)span;
+            x0 = std::max(x0, origin.x);
+            x1 = std::max(x1, x0 + 1.0f);
+            float y0 = origin.y + lane * zone.depth, y1 = y0 + lane - 1.0f;
+
+            draw->AddRectFilled(Vec2{x0, y0}, Vec2{x1, y1}, zone_color(zone.name));
+            if(x1 - x0 > 24.0f) {
+                draw->PushClipRect(Vec2{x0, y0}, Vec2{x1, y1}, true);
+                draw->AddText(Vec2{x0 + 2.0f, y0}, IM_COL32(0, 0, 0, 255), zone.name);
+                draw->PopClipRect();
+            }
+            if(hovered && mouse.x >= x0 && mouse.x < x1 && mouse.y >= y0 && mouse.y < y1) {
+                ImGui::SetTooltip("%s\n%.3f ms", zone.name, (zone.end - zone.start) / 1e6);
+            }
+        }
+    }
+
+    if(ImGui::CollapsingHeader("Totals")) {
+
+        struct Total {
+            size_t count = 0;
+            int64_t time = 0, longest = 0;
+        };
+        std::map<std::string_view, Total> totals;
+        for(const auto& thread : profile) {
+            for(const auto& zone : thread.zones) {
+                if(zone.end < begin) continue;
+                Total& total = totals[zone.name];
+                total.count++;
+                total.time += zone.end - zone.start;
+                total.longest = std::max(total.longest, zone.end - zone.start);
+            }
+        }
+        std::vector<std::pair<std::string_view, Total>> sorted(totals.begin(), totals.end());
+        std::sort(sorted.begin(), sorted.end(),
+                  [](const auto& l, const auto& r) { return l.second.time > r.second.time; });
+
+        ImGui::Columns(4);
+        ImGui::Text("Zone");
+        ImGui::NextColumn();
+        ImGui::Text("Count");
+        ImGui::NextColumn();
+        ImGui::Text("Total (ms)");
+        ImGui::NextColumn();
+        ImGui::Text("Longest (ms)");
+        ImGui::NextColumn();
+        ImGui::Separator();
+        for(const auto& [name, total] : sorted) {
+            ImGui::Text("%.*s", (int)name.size(), name.data());
+            ImGui::NextColumn();
+            ImGui::Text("%zu", total.count);
+            ImGui::NextColumn();
+            ImGui::Text("%.3f", total.time / 1e6);
+            ImGui::NextColumn();
+            ImGui::Text("%.3f", total.longest / 1e6);
+            ImGui::NextColumn();
+        }
+        ImGui::Columns(1);
+    }
+
+    ImGui::End();
+}
+
 void Manager::UIstudent() {
     if(!debug_shown) return;
     ImGui::Begin("Debug Data", &debug_shown, ImGuiWindowFlags_NoSavedSettings);
@@ -1009,6 +1318,9 @@ float Manager::UImenu(Scene& scene, Undo& undo) {
             if(ImGui::MenuItem("Redo (Ctrl+y)")) undo.redo();
             if(ImGui::MenuItem("Edit Debug Data (Ctrl+d)")) debug_shown = true;
             if(ImGui::MenuItem("Settings")) settings_shown = true;
+            if(ImGui::MenuItem("Profiler")) profiler_shown = true;
+            if(ImGui::MenuItem("Memory")) memory_shown = true;
+            ImGui::MenuItem("Frame Stats", nullptr, &frame_stats_shown);
             ImGui::EndMenu();
         }
 
@@ -1186,8 +1498,12 @@ void Manager::render_3d(Scene& scene, Undo& undo, Camera& camera) {
 
     Mat4 view = camera.get_view();
 
+    simulate.check_cache(undo);
     animate.update(scene);
 
+    bool preview = mode != Mode::model && mode != Mode::rig && Renderer::get().material_preview;
+    if(preview) Renderer::get().begin_preview(scene, view);
+
     if(mode != Mode::model && mode != Mode::rig) {
 
         if(mode != Mode::animate && !animate.playing_or_rendering())
@@ -1195,18 +1511,25 @@ void Manager::render_3d(Scene& scene, Undo& undo, Camera& camera) {
         else
             simulate.update_time();
 
+        // Objects entirely off-screen aren't drawn. Lights and emitters are few, and
+        // draw beyond their bounds (environment domes, particles), so are kept.
+        Frustum frustum(camera.get_proj() * view);
         scene.for_items([&, this](Scene_Item& item) {
             bool render = item.id() != layout.selected();
             if(item.is<Scene_Light>()) {
                 const Scene_Light& light = item.get<Scene_Light>();
                 if(light.opt.type == Light_Type::sphere || light.opt.type == Light_Type::hemisphere)
                     render = true;
+            } else if(render && item.is<Scene_Object>()) {
+                render = frustum.intersects(item.bbox());
             }
 
-            if(render) {
+            // Plain static objects are drawn together, after the rest
+            if(render && !(item.is<Scene_Object>() && item.get<Scene_Object>().batch(view))) {
                 item.render(view);
             }
         });
+        Renderer::get().end_batch();
 
     } else {
         simulate.update_time();
@@ -1242,11 +1565,13 @@ void Manager::render_3d(Scene& scene, Undo& undo, Camera& camera) {
 
     default: assert(false);
     }
+
+    if(preview) Renderer::get().end_preview();
 }
 
 void Manager::hover(Vec2 pixel, Vec3 cam, Vec2 spos, Vec3 dir) {
     if(mode == Mode::model) {
-        model.hover(Renderer::get().read_id(pixel));
+        model.hover(cam, dir);
     } else if(mode == Mode::rig) {
         rig.hover(cam, spos, dir);
     }
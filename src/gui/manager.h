@@ -10,6 +10,7 @@
 
 #include "../lib/mathlib.h"
 #include "../util/camera.h"
+#include "../util/profiler.h"
 
 #include "../scene/scene.h"
 #include "../scene/undo.h"
@@ -50,11 +51,16 @@ public:
     void update_dim(Vec2 dim);
     bool keydown(Undo& undo, SDL_Keysym key, Scene& scene, Camera& cam);
     bool quit(Undo& undo);
+    // Seconds until the next frame is due with no input: 0 while the view changes on its
+    // own (playback, simulation, GPU renders), a fraction of a second while background
+    // work shows its progress, or infinite when nothing will change
+    float redraw_interval(Scene& scene);
 
     Rig& get_rig();
     Render& get_render();
     Animate& get_animate();
     void set_file(std::string save);
+    void set_scene_cache(std::string dir);
     void refresh_anim(Scene& scene, Undo& undo);
 
     // Object interaction
@@ -81,8 +87,14 @@ public:
 private:
     void UIerror();
     void UIstudent();
-    void UIsettings();
+    void UIsettings(Undo& undo);
+    void UIprofiler();
+    void UImemory(Scene& scene, Undo& undo);
+    void UIframe_stats(float menu_height);
     void UIsavefirst(Scene& scene, Undo& undo);
+    void UIloading(Scene& scene, Undo& undo);
+    // Swaps in environment maps that finished loading (see load_image)
+    void UIemissive(Scene& scene, Undo& undo);
     void UInew_obj(Undo& undo);
     void UInew_light(Scene& scene, Undo& undo);
     float UImenu(Scene& scene, Undo& undo);
@@ -90,7 +102,7 @@ private:
     void load_image(Scene_Light& image);
     void frame(Scene& scene, Camera& cam);
 
-    static inline const char* scene_file_types = "dae,obj,fbx,glb,gltf,3ds,blend,stl,ply";
+    static inline const char* scene_file_types = "dae,obj,fbx,glb,gltf,3ds,blend,stl,ply,assbin";
     static inline const char* image_file_types = "exr,hdr,hdri,jpg,jpeg,png,tga,bmp,psd,gif";
 
     void render_selected(Scene_Object& obj);
@@ -109,10 +121,18 @@ private:
     bool new_obj_window = false, new_obj_focus = false;
     bool new_light_window = false, new_light_focus = false;
     bool error_shown = false, debug_shown = false, settings_shown = false;
+    bool memory_shown = false, frame_stats_shown = false;
     bool save_first_shown = false, already_denied_save = false;
+    // Zones from the last profile_span seconds the profiler window recorded
+    bool profiler_shown = false, profiler_recording = false;
+    float profile_span = 0.1f;
+    std::vector<Profiler::Thread_Zones> profile;
     std::string error_msg, save_file;
     size_t n_actions_at_last_save = 0;
     std::function<void(bool)> after_save;
+    // The scene load running in the background, if any
+    std::string load_file;
+    bool load_clears = false;
 
     GL::MSAA samples;
     Scene::Load_Opts load_opt;
@@ -0,0 +1,256 @@
+
+#include "mesh_picker.h"
+
+#include <algorithm>
+
+namespace Gui {
+
+// Once this many shapes are outside the BVH (plus one in eight of those in it), it is
+// rebuilt rather than searching them one by one
+static const size_t max_extra = 64;
+
+void Mesh_Picker::clear() {
+    bvh = {};
+    extra.clear();
+    slots.clear();
+    face_tris.clear();
+    dead = 0;
+    moved = false;
+}
+
+void Mesh_Picker::ball(unsigned int id, Vec3 center, float radius) {
+    capsule(id, center, center, radius);
+}
+
+void Mesh_Picker::capsule(unsigned int id, Vec3 a, Vec3 b, float radius) {
+    Shape shape;
+    shape.id = id;
+    shape.a = a;
+    shape.b = b;
+    shape.radius = radius;
+    shape.box = BBox(hmin(a, b) - Vec3(radius), hmax(a, b) + Vec3(radius));
+    set(shape);
+}
+
+void Mesh_Picker::triangles(unsigned int id, const GL::Mesh::Vert* verts, size_t n) {
+    if(n < 3) {
+        erase(id);
+        return;
+    }
+    Shape shape;
+    shape.id = id;
+    shape.face = true;
+    std::vector<Vec3>& tris = face_tris[id];
+    tris.resize(n);
+    for(size_t i = 0; i < n; i++) {
+        tris[i] = verts[i].pos;
+        shape.box.enclose(verts[i].pos);
+    }
+    set(shape);
+}
+
+void Mesh_Picker::set(Shape shape) {
+    auto [entry, fresh] = slots.try_emplace(shape.id);
+    Slot& slot = entry->second;
+    if(fresh) {
+        slot = {false, extra.size()};
+        extra.push_back(shape);
+    } else if(slot.built) {
+        bvh.edit_primitives()[slot.index] = shape;
+        moved = true;
+    } else {
+        extra[slot.index] = shape;
+    }
+}
+
+void Mesh_Picker::erase(unsigned int id) {
+    auto entry = slots.find(id);
+    if(entry == slots.end()) return;
+    Slot slot = entry->second;
+    slots.erase(entry);
+    face_tris.erase(id);
+
+    if(slot.built) {
+        // Left in the tree until the next build, but never found
+        bvh.edit_primitives()[slot.index].id = 0;
+        dead++;
+    } else {
+        if(slot.index + 1 < extra.size()) {
+            extra[slot.index] = extra.back();
+            slots[extra[slot.index].id].index = slot.index;
+        }
+        extra.pop_back();
+    }
+}
+
+void Mesh_Picker::update() {
+
+    std::vector<Shape>& built = bvh.edit_primitives();
+    if(extra.size() + dead > max_extra + built.size() / 8) {
+        std::vector<Shape> shapes;
+        shapes.reserve(built.size() - dead + extra.size());
+        for(const Shape& shape : built) {
+            if(shape.id) shapes.push_back(shape);
+        }
+        shapes.insert(shapes.end(), extra.begin(), extra.end());
+        bvh.build(std::move(shapes), PT::BVH_Options::profile(PT::BVH_Profile::fast_build));
+        extra.clear();
+        dead = 0;
+        moved = false;
+        locate();
+    } else if(moved) {
+        // Refitting may also rebuild, which reorders the primitives
+        bvh.refit();
+        moved = false;
+        locate();
+    }
+}
+
+void Mesh_Picker::locate() {
+    std::vector<Shape>& built = bvh.edit_primitives();
+    for(size_t i = 0; i < built.size(); i++) {
+        if(built[i].id) slots[built[i].id] = {true, i};
+    }
+}
+
+// Distance along the (unit) ray d from o to where it enters the ball, if ahead of o
+static float hit_ball(Vec3 o, Vec3 d, Vec3 center, float radius) {
+    Vec3 oc = o - center;
+    float b = dot(d, oc);
+    float h = b * b - (oc.norm_squared() - radius * radius);
+    if(h < 0.0f) return FLT_MAX;
+    float t = -b - std::sqrt(h);
+    return t >= 0.0f ? t : FLT_MAX;
+}
+
+float Mesh_Picker::hit(const Shape& shape, const Ray& ray) const {
+
+    Vec3 o = ray.point, d = ray.dir;
+    float t = FLT_MAX;
+
+    if(shape.face) {
+        // Moller-Trumbore, from either side
+        const std::vector<Vec3>& tris = face_tris.at(shape.id);
+        for(size_t i = 0; i + 2 < tris.size(); i += 3) {
+            Vec3 e1 = tris[i + 1] - tris[i], e2 = tris[i + 2] - tris[i];
+            Vec3 p = cross(d, e2);
+            float det = dot(e1, p);
+            if(std::abs(det) < 1e-12f) continue;
+            Vec3 s = (o - tris[i]) / det;
+            float u = dot(s, p);
+            if(u < 0.0f || u > 1.0f) continue;
+            Vec3 q = cross(s, e1);
+            float v = dot(d, q);
+            if(v < 0.0f || u + v > 1.0f) continue;
+            float ti = dot(e2, q);
+            if(ti >= 0.0f) t = std::min(t, ti);
+        }
+        return t;
+    }
+
+    // The capsule's side, between its ends, then the balls at its ends
+    Vec3 ba = shape.b - shape.a, oa = o - shape.a;
+    float baba = ba.norm_squared(), bad = dot(ba, d), baoa = dot(ba, oa);
+    float a = baba - bad * bad;
+    if(a > 1e-12f) {
+        float b = baba * dot(d, oa) - baoa * bad;
+        float c = baba * oa.norm_squared() - baoa * baoa - shape.radius * shape.radius * baba;
+        float h = b * b - a * c;
+        if(h >= 0.0f) {
+            float ts = (-b - std::sqrt(h)) / a;
+            float y = baoa + ts * bad;
+            if(ts >= 0.0f && y > 0.0f && y < baba) return ts;
+        }
+    }
+    t = std::min(t, hit_ball(o, d, shape.a, shape.radius));
+    if(baba > 0.0f) t = std::min(t, hit_ball(o, d, shape.b, shape.radius));
+    return t;
+}
+
+// Closest point to p of triangle abc (after Ericson, Real-Time Collision Detection)
+static Vec3 closest_on_triangle(Vec3 p, Vec3 a, Vec3 b, Vec3 c) {
+    Vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = dot(ab, ap), d2 = dot(ac, ap);
+    if(d1 <= 0.0f && d2 <= 0.0f) return a;
+
+    Vec3 bp = p - b;
+    float d3 = dot(ab, bp), d4 = dot(ac, bp);
+    if(d3 >= 0.0f && d4 <= d3) return b;
+
+    float vc = d1 * d4 - d3 * d2;
+    if(vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+
+    Vec3 cp = p - c;
+    float d5 = dot(ab, cp), d6 = dot(ac, cp);
+    if(d6 >= 0.0f && d5 <= d6) return c;
+
+    float vb = d5 * d2 - d1 * d6;
+    if(vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+
+    float va = d3 * d6 - d5 * d4;
+    if(va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+
+    float denom = va + vb + vc;
+    if(denom == 0.0f) return a;
+    return a + ab * (vb / denom) + ac * (vc / denom);
+}
+
+float Mesh_Picker::distance(const Shape& shape, Vec3 p) const {
+
+    if(shape.face) {
+        const std::vector<Vec3>& tris = face_tris.at(shape.id);
+        float d = FLT_MAX;
+        for(size_t i = 0; i + 2 < tris.size(); i += 3) {
+            Vec3 q = closest_on_triangle(p, tris[i], tris[i + 1], tris[i + 2]);
+            d = std::min(d, (p - q).norm());
+        }
+        return d;
+    }
+
+    Vec3 ba = shape.b - shape.a;
+    float baba = ba.norm_squared();
+    float s = baba > 0.0f ? std::clamp(dot(p - shape.a, ba) / baba, 0.0f, 1.0f) : 0.0f;
+    return std::max((p - (shape.a + ba * s)).norm() - shape.radius, 0.0f);
+}
+
+unsigned int Mesh_Picker::pick(const Ray& ray) {
+
+    update();
+
+    unsigned int best = 0;
+    float best_t = ray.dist_bounds.y;
+    auto test = [&](const Shape& shape) {
+        if(!shape.id) return;
+        float t = hit(shape, ray);
+        if(t >= ray.dist_bounds.x && t < best_t) {
+            best_t = t;
+            best = shape.id;
+        }
+    };
+    bvh.reached(ray, test);
+    for(const Shape& shape : extra) test(shape);
+    return best;
+}
+
+unsigned int Mesh_Picker::nearest(Vec3 p, float max_dist) {
+
+    update();
+
+    unsigned int best = 0;
+    float best_d = max_dist;
+    auto test = [&](const Shape& shape) {
+        if(!shape.id) return;
+        float d = distance(shape, p);
+        if(d <= best_d) {
+            best_d = d;
+            best = shape.id;
+        }
+    };
+    bvh.overlapping(BBox(p - Vec3(max_dist), p + Vec3(max_dist)), test);
+    for(const Shape& shape : extra) test(shape);
+    return best;
+}
+
+} // namespace Gui
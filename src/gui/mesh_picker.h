@@ -0,0 +1,68 @@
+
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../platform/gl.h"
+#include "../rays/bvh.h"
+
+namespace Gui {
+
+// Finds which drawn element of the mesh being edited is under the cursor (or near a
+// point) on the CPU, so that hovering does not wait on reading back the id buffer.
+// Vertices are balls and edges and halfedges capsules around the instances Model
+// draws for them, while faces keep their triangles. Shapes live in a BVH; those
+// added since it was built are tested one by one, and those moved in place are
+// refit into it, until enough have changed that it is cheaper to build it again.
+class Mesh_Picker {
+public:
+    void clear();
+
+    // Add or move the shape of element id
+    void ball(unsigned int id, Vec3 center, float radius);
+    void capsule(unsigned int id, Vec3 a, Vec3 b, float radius);
+    void triangles(unsigned int id, const GL::Mesh::Vert* verts, size_t n);
+    void erase(unsigned int id);
+
+    // Id of the element the ray hits first, or 0
+    unsigned int pick(const Ray& ray);
+    // Id of the element closest to p no further than max_dist from it, or 0
+    unsigned int nearest(Vec3 p, float max_dist);
+
+private:
+    // A capsule from a to b (a ball if they are the same), or the triangles of a face
+    struct Shape {
+        unsigned int id = 0;
+        bool face = false;
+        Vec3 a, b;
+        float radius = 0.0f;
+        BBox box;
+
+        BBox bbox() const {
+            return box;
+        }
+    };
+    // Where a shape is: at index of the BVH's primitives, or of extra
+    struct Slot {
+        bool built = false;
+        size_t index = 0;
+    };
+
+    void set(Shape shape);
+    void update();
+    void locate();
+    float hit(const Shape& shape, const Ray& ray) const;
+    float distance(const Shape& shape, Vec3 p) const;
+
+    PT::BVH<Shape> bvh;
+    std::vector<Shape> extra;
+    std::unordered_map<unsigned int, Slot> slots;
+    std::unordered_map<unsigned int, std::vector<Vec3>> face_tris;
+    // BVH primitives erased since the build, which are kept with id 0
+    size_t dead = 0;
+    bool moved = false;
+};
+
+} // namespace Gui
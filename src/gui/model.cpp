@@ -1,5 +1,6 @@
 
 #include <algorithm>
+#include <numeric>
 #include <imgui/imgui.h>
 
 #include "manager.h"
@@ -9,6 +10,7 @@
 #include "../geometry/util.h"
 #include "../scene/renderer.h"
 #include "../scene/undo.h"
+#include "../util/profiler.h"
 
 namespace Gui {
 
@@ -19,9 +21,8 @@ Model::Model()
 
 void Model::begin_transform() {
 
-    my_mesh->copy_to(old_mesh);
-
     auto elem = *selected_element();
+    trans_delta = my_mesh->begin_delta({elem});
     trans_begin = {};
     std::visit(overloaded{[&](Halfedge_Mesh::VertexRef vert) {
                               trans_begin.verts = {vert->pos};
@@ -52,6 +53,7 @@ void Model::update_vertex(Halfedge_Mesh::VertexRef vert) {
         GL::Instances::Info& info = spheres.get(id_to_info[vert->id()].instance);
         vertex_viz(vert, d, info.transform);
         vert_sizes[vert->id()] = d;
+        pickable(vert, info.transform);
     }
 
     Halfedge_Mesh::HalfedgeRef h = vert->halfedge();
@@ -62,14 +64,21 @@ void Model::update_vertex(Halfedge_Mesh::VertexRef vert) {
         GL::Instances::Info& vi = spheres.get(id_to_info[v->id()].instance);
         vertex_viz(v, d, vi.transform);
         vert_sizes[v->id()] = d;
+        pickable(v, vi.transform);
 
         if(!h->face()->is_boundary()) {
+            // Only the face's own triangles are re-uploaded
             size_t idx = id_to_info[h->face()->id()].instance;
-            face_viz(h->face(), face_mesh.edit_verts(), face_mesh.edit_indices(), idx);
+            size_t n = face_verts(h->face());
+            std::vector<GL::Mesh::Vert>& verts = face_mesh.edit_verts(idx, idx + n);
+            face_viz(h->face(), verts, idx);
+            picker.triangles(h->face()->id(), verts.data() + idx, n);
 
             Halfedge_Mesh::HalfedgeRef fh = h->face()->halfedge();
             do {
-                halfedge_viz(fh, arrows.get(id_to_info[fh->id()].instance).transform);
+                Mat4& transform = arrows.get(id_to_info[fh->id()].instance).transform;
+                halfedge_viz(fh, transform);
+                pickable(fh, transform);
                 fh = fh->next();
             } while(fh != h->face()->halfedge());
         }
@@ -82,13 +91,16 @@ void Model::update_vertex(Halfedge_Mesh::VertexRef vert) {
         if(!h->is_boundary()) {
             GL::Instances::Info& hi = arrows.get(id_to_info[h->id()].instance);
             halfedge_viz(h, hi.transform);
+            pickable(h, hi.transform);
         }
         if(!h->twin()->is_boundary()) {
             GL::Instances::Info& thi = arrows.get(id_to_info[h->twin()->id()].instance);
             halfedge_viz(h->twin(), thi.transform);
+            pickable(h->twin(), thi.transform);
         }
         GL::Instances::Info& e = cylinders.get(id_to_info[h->edge()->id()].instance);
         edge_viz(h->edge(), e.transform);
+        pickable(h->edge(), e.transform);
 
         h = h->twin()->next();
     } while(h != vert->halfedge());
@@ -193,6 +205,7 @@ void Model::apply_transform(Widgets& widgets) {
 }
 
 void Model::set_selected(Halfedge_Mesh::ElementRef elem) {
+    multi_selected_ids.clear();
 
     std::visit(overloaded{[&](Halfedge_Mesh::VertexRef vert) { selected_elem_id = vert->id(); },
                           [&](Halfedge_Mesh::EdgeRef edge) { selected_elem_id = edge->id(); },
@@ -219,6 +232,21 @@ std::optional<Halfedge_Mesh::ElementRef> Model::selected_element() {
     return entry->second.ref;
 }
 
+std::vector<Halfedge_Mesh::ElementRef> Model::selected_elements() {
+
+    std::vector<Halfedge_Mesh::ElementRef> elems;
+    auto sel = selected_element();
+    if(!sel.has_value()) return elems;
+
+    elems.push_back(*sel);
+    for(unsigned int id : multi_selected_ids) {
+        auto entry = id_to_info.find(id);
+        if(entry == id_to_info.end()) continue;
+        if(entry->second.ref.index() == sel->index()) elems.push_back(entry->second.ref);
+    }
+    return elems;
+}
+
 void Model::unset_mesh() {
     my_mesh = nullptr;
 }
@@ -324,8 +352,13 @@ void Model::halfedge_viz(Halfedge_Mesh::HalfedgeRef h, Mat4& transform) {
     }
 }
 
+size_t Model::face_verts(Halfedge_Mesh::FaceRef face) {
+    size_t degree = face->degree();
+    return degree < 3 ? 0 : (degree - 2) * 3;
+}
+
 void Model::face_viz(Halfedge_Mesh::FaceRef face, std::vector<GL::Mesh::Vert>& verts,
-                     std::vector<GL::Mesh::Index>& idxs, size_t insert_at) {
+                     size_t insert_at) {
 
     std::vector<GL::Mesh::Vert> face_verts;
     unsigned int id = face->id();
@@ -337,13 +370,10 @@ void Model::face_viz(Halfedge_Mesh::FaceRef face, std::vector<GL::Mesh::Vert>& v
         h = h->next();
     } while(h != face->halfedge());
 
-    id_to_info[face->id()] = {face, insert_at};
-
     if(face_verts.size() < 3) return;
 
     size_t max = insert_at + (face_verts.size() - 2) * 3;
     if(verts.size() < max) verts.resize(max);
-    if(idxs.size() < max) idxs.resize(max);
 
     Vec3 v0 = face_verts[0].pos;
     for(size_t i = 1; i <= face_verts.size() - 2; i++) {
@@ -352,76 +382,309 @@ void Model::face_viz(Halfedge_Mesh::FaceRef face, std::vector<GL::Mesh::Vert>& v
         Vec3 n = cross(v1 - v0, v2 - v0).unit();
         if(my_mesh->flipped()) n = -n;
 
-        idxs[insert_at] = (GL::Mesh::Index)insert_at;
         verts[insert_at++] = {v0, n, id};
-
-        idxs[insert_at] = (GL::Mesh::Index)insert_at;
         verts[insert_at++] = {v1, n, id};
-
-        idxs[insert_at] = (GL::Mesh::Index)insert_at;
         verts[insert_at++] = {v2, n, id};
     }
 }
 
-void Model::rebuild() {
+// Edges between two boundary faces are not drawn, since the boundaries should look
+// contiguous, unless both sides are the same face: then the edge shows that the next
+// vertex is connected
+static bool drawn(Halfedge_Mesh::EdgeRef e) {
+    return !e->halfedge()->is_boundary() || !e->halfedge()->twin()->is_boundary() ||
+           e->halfedge()->face() == e->halfedge()->twin()->face();
+}
+
+void Model::rebuild(bool all) {
 
     if(!my_mesh) return;
+    PROFILE_ZONE("Model Rebuild");
     Halfedge_Mesh& mesh = *my_mesh;
 
-    mesh.render_dirty_flag = false;
+    // Edits check the mesh as they go, so only other changes (e.g. undo) need this
+    bool check = !validated;
+    validated = false;
+
+    // Local edits (and their undos) are patched in where they happened
+    std::vector<unsigned int> ids;
+    unsigned int new_from;
+    bool local = mesh.take_dirty(ids, new_from);
+    if(local && !all && !id_to_info.empty() && !mesh.fragmented()) {
+        rebuild_local(ids, new_from);
+        if(check) validate();
+        return;
+    }
+
+    // Nothing refers into the mesh here, since the element map is rebuilt below
+    if(mesh.fragmented()) mesh.compact();
 
     id_to_info.clear();
     vert_sizes.clear();
+    spheres.clear();
+    cylinders.clear();
+    arrows.clear();
+    free_spheres.clear();
+    free_cylinders.clear();
+    free_arrows.clear();
+    free_face_verts.clear();
+    picker.clear();
 
     std::vector<GL::Mesh::Vert> verts;
     std::vector<GL::Mesh::Index> idxs;
 
     for(auto f = mesh.faces_begin(); f != mesh.faces_end(); f++) {
-        if(!f->is_boundary()) face_viz(f, verts, idxs, verts.size());
+        if(f->is_boundary()) continue;
+        size_t at = verts.size();
+        face_viz(f, verts, at);
+        id_to_info[f->id()] = {f, at, verts.size() - at};
+        picker.triangles(f->id(), verts.data() + at, verts.size() - at);
     }
+    // Every face triangle has its own vertices, so the indices are just 0..n
+    face_end = verts.size();
+    idxs.resize(verts.size());
+    std::iota(idxs.begin(), idxs.end(), GL::Mesh::Index(0));
     face_mesh.recreate(std::move(verts), std::move(idxs));
 
-    // Create sphere for each vertex
-    spheres.clear();
+    // Vertex sizes first, as the edges and halfedges are scaled by them
+    for(auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) place(v);
+    for(auto e = mesh.edges_begin(); e != mesh.edges_end(); e++) place(e);
+    for(auto h = mesh.halfedges_begin(); h != mesh.halfedges_end(); h++) place(h);
+
+    if(check) validate();
+}
+
+void Model::rebuild_local(const std::vector<unsigned int>& ids, unsigned int new_from) {
+
+    Halfedge_Mesh& mesh = *my_mesh;
+
+    unsigned int bound = 0;
+    for(unsigned int id : ids) bound = std::max(bound, id + 1);
+    std::vector<bool> touched(bound), found(bound);
+    for(unsigned int id : ids) touched[id] = true;
+    auto changed = [&](unsigned int id) {
+        if(id >= bound) return id >= new_from;
+        found[id] = touched[id];
+        return touched[id] || id >= new_from;
+    };
+
+    // Find what is still in the mesh with one pass over it
+    std::vector<Halfedge_Mesh::VertexRef> verts;
+    std::vector<Halfedge_Mesh::EdgeRef> edges;
+    std::vector<Halfedge_Mesh::FaceRef> faces;
+    std::vector<Halfedge_Mesh::HalfedgeRef> halfedges;
     for(auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) {
+        if(changed(v->id())) verts.push_back(v);
+    }
+    for(auto e = mesh.edges_begin(); e != mesh.edges_end(); e++) {
+        if(changed(e->id())) edges.push_back(e);
+    }
+    for(auto f = mesh.faces_begin(); f != mesh.faces_end(); f++) {
+        if(changed(f->id())) faces.push_back(f);
+    }
+    for(auto h = mesh.halfedges_begin(); h != mesh.halfedges_end(); h++) {
+        if(changed(h->id())) halfedges.push_back(h);
+    }
 
-        float d;
-        Mat4 transform;
-        vertex_viz(v, d, transform);
-        vert_sizes[v->id()] = d;
-        id_to_info[v->id()] = {v, spheres.add(transform, v->id())};
+    // The rest was erased. Anything new that was also erased since was never drawn.
+    for(unsigned int id : ids) {
+        if(!found[id]) release(id);
     }
 
-    // Create cylinder for each edge
-    cylinders.clear();
-    for(auto e = mesh.edges_begin(); e != mesh.edges_end(); e++) {
+    // Vertex sizes depend on the lengths of their edges, so the neighbors of the
+    // changed vertices are resized too, and whatever is scaled by those sizes redrawn
+    std::unordered_set<Halfedge_Mesh::VertexRef> seeds;
+    auto seed_halfedge = [&](Halfedge_Mesh::HalfedgeRef h) {
+        seeds.insert(h->vertex());
+        seeds.insert(h->twin()->vertex());
+    };
+    for(auto v : verts) seeds.insert(v);
+    for(auto e : edges) seed_halfedge(e->halfedge());
+    for(auto h : halfedges) seed_halfedge(h);
+    for(auto f : faces) {
+        auto h = f->halfedge();
+        do {
+            seeds.insert(h->vertex());
+            h = h->next();
+        } while(h != f->halfedge());
+    }
 
-        // We don't want to render edges between two boundary faces, since the boundaries
-        // should look contiguous
-        if(e->halfedge()->is_boundary() && e->halfedge()->twin()->is_boundary()) {
+    std::unordered_set<Halfedge_Mesh::VertexRef> around = seeds;
+    for(auto v : seeds) {
+        auto h = v->halfedge();
+        do {
+            around.insert(h->twin()->vertex());
+            h = h->twin()->next();
+        } while(h != v->halfedge());
+    }
 
-            // Unless both surrounding boundaries are the same face, in which case we should
-            // render this edge to show that the next vertex is connected
-            if(e->halfedge()->face() != e->halfedge()->twin()->face()) continue;
-        }
+    std::unordered_set<Halfedge_Mesh::EdgeRef> redo_edges(edges.begin(), edges.end());
+    std::unordered_set<Halfedge_Mesh::FaceRef> redo_faces(faces.begin(), faces.end());
+    for(auto v : around) {
+        place(v);
+        auto h = v->halfedge();
+        do {
+            redo_edges.insert(h->edge());
+            redo_faces.insert(h->face());
+            h = h->twin()->next();
+        } while(h != v->halfedge());
+    }
 
-        Mat4 transform;
-        edge_viz(e, transform);
-        id_to_info[e->id()] = {e, cylinders.add(transform, e->id())};
+    for(auto e : redo_edges) place(e);
+    for(auto h : halfedges) place(h);
+    for(auto f : redo_faces) {
+        place(f);
+        auto h = f->halfedge();
+        do {
+            place(h);
+            h = h->next();
+        } while(h != f->halfedge());
     }
+}
 
-    // Create arrow for each halfedge
-    arrows.clear();
-    for(auto h = mesh.halfedges_begin(); h != mesh.halfedges_end(); h++) {
+void Model::place(Halfedge_Mesh::VertexRef v) {
+    float d;
+    Mat4 transform;
+    vertex_viz(v, d, transform);
+    vert_sizes[v->id()] = d;
+    place_instance(spheres, free_spheres, v, transform);
+}
+
+void Model::place(Halfedge_Mesh::EdgeRef e) {
+    if(!drawn(e)) {
+        release(e->id());
+        return;
+    }
+    Mat4 transform;
+    edge_viz(e, transform);
+    place_instance(cylinders, free_cylinders, e, transform);
+}
 
-        if(h->is_boundary()) continue;
+void Model::place(Halfedge_Mesh::HalfedgeRef h) {
+    if(h->is_boundary()) {
+        release(h->id());
+        return;
+    }
+    Mat4 transform;
+    halfedge_viz(h, transform);
+    place_instance(arrows, free_arrows, h, transform);
+}
 
-        Mat4 transform;
-        halfedge_viz(h, transform);
-        id_to_info[h->id()] = {h, arrows.add(transform, h->id())};
+void Model::place(Halfedge_Mesh::FaceRef f) {
+
+    if(f->is_boundary()) {
+        release(f->id());
+        return;
     }
 
-    validate();
+    size_t n = face_verts(f);
+    auto [entry, fresh] = id_to_info.try_emplace(f->id());
+    ElemInfo& info = entry->second;
+    if(!fresh && info.count != n) {
+        free_tris(info.instance, info.count);
+        fresh = true;
+    }
+    if(fresh) {
+        info.instance = alloc_tris(n);
+        info.count = n;
+    }
+    info.ref = f;
+    std::vector<GL::Mesh::Vert>& verts = face_mesh.edit_verts(info.instance, info.instance + n);
+    face_viz(f, verts, info.instance);
+    picker.triangles(f->id(), verts.data() + info.instance, n);
+}
+
+void Model::place_instance(GL::Instances& inst, std::vector<size_t>& free,
+                           Halfedge_Mesh::ElementRef ref, const Mat4& transform) {
+
+    unsigned int id = Halfedge_Mesh::id_of(ref);
+    auto [entry, fresh] = id_to_info.try_emplace(id);
+    ElemInfo& info = entry->second;
+    info.ref = ref;
+
+    if(!fresh) {
+        inst.get(info.instance).transform = transform;
+    } else if(free.empty()) {
+        info.instance = inst.add(transform, id);
+    } else {
+        info.instance = free.back();
+        free.pop_back();
+        inst.get(info.instance) = {id, transform};
+    }
+    pickable(ref, transform);
+}
+
+void Model::release(unsigned int id) {
+
+    auto entry = id_to_info.find(id);
+    if(entry == id_to_info.end()) return;
+    ElemInfo info = entry->second;
+    id_to_info.erase(entry);
+    picker.erase(id);
+
+    // Only the alternative is looked at, as the element itself may be gone
+    auto hide = [&](GL::Instances& inst, std::vector<size_t>& free) {
+        inst.get(info.instance) = {0, Mat4::Zero};
+        free.push_back(info.instance);
+    };
+    switch(info.ref.index()) {
+    case 0: {
+        hide(spheres, free_spheres);
+        vert_sizes.erase(id);
+    } break;
+    case 1: hide(cylinders, free_cylinders); break;
+    case 2: hide(arrows, free_arrows); break;
+    case 3: free_tris(info.instance, info.count); break;
+    default: assert(false);
+    }
+}
+
+void Model::pickable(Halfedge_Mesh::ElementRef ref, const Mat4& transform) {
+
+    // The shapes of the meshes made in the constructor, as the transform scales them.
+    // Arrows are a little narrower than their tips.
+    unsigned int id = Halfedge_Mesh::id_of(ref);
+    float scale = transform[0].xyz().norm();
+    Vec3 base = transform * Vec3{0.0f};
+    switch(ref.index()) {
+    case 0: picker.ball(id, base, 0.05f * scale); break;
+    case 1: picker.capsule(id, base, transform * Vec3{0.0f, 1.0f, 0.0f}, 0.05f * scale); break;
+    case 2: picker.capsule(id, base, transform * Vec3{0.0f, 0.95f, 0.0f}, 0.075f * scale); break;
+    default: break;
+    }
+}
+
+size_t Model::alloc_tris(size_t n) {
+
+    if(n == 0) return 0;
+
+    std::vector<size_t>& free = free_face_verts[n];
+    if(!free.empty()) {
+        size_t at = free.back();
+        free.pop_back();
+        return at;
+    }
+
+    size_t at = face_end;
+    face_end += n;
+    size_t size = face_mesh.verts().size();
+    if(face_end > size) {
+        // Grown with room to spare, as empty triangles, so that most new faces are
+        // uploaded as ranges
+        size_t grown = std::max(face_end, size + size / 2);
+        face_mesh.edit_verts().resize(grown, GL::Mesh::Vert{});
+        std::vector<GL::Mesh::Index>& idxs = face_mesh.edit_indices();
+        idxs.resize(grown);
+        std::iota(idxs.begin() + size, idxs.end(), GL::Mesh::Index(size));
+    }
+    return at;
+}
+
+void Model::free_tris(size_t at, size_t n) {
+    if(n == 0) return;
+    std::vector<GL::Mesh::Vert>& verts = face_mesh.edit_verts(at, at + n);
+    std::fill(verts.begin() + at, verts.begin() + at + n, GL::Mesh::Vert{});
+    free_face_verts[n].push_back(at);
 }
 
 bool Model::begin_bevel(std::string& err) {
@@ -429,7 +692,8 @@ bool Model::begin_bevel(std::string& err) {
     auto sel = selected_element();
     if(!sel.has_value()) return false;
 
-    my_mesh->copy_to(old_mesh);
+    trans_delta = my_mesh->begin_delta({*sel});
+    my_mesh->track_changes();
 
     auto new_face = std::visit(
         overloaded{[&](Halfedge_Mesh::VertexRef vert) {
@@ -447,15 +711,17 @@ bool Model::begin_bevel(std::string& err) {
                    [&](auto) -> std::optional<Halfedge_Mesh::FaceRef> { return std::nullopt; }},
         *sel);
 
-    err = validate();
+    std::vector<Halfedge_Mesh::ElementRef> changed = {*sel};
+    if(new_face.has_value()) changed.push_back(*new_face);
+    err = validate_local(changed);
     if(!err.empty() || !new_face.has_value()) {
-        *my_mesh = std::move(old_mesh);
+        my_mesh->rollback(trans_delta);
         return false;
     }
 
     Halfedge_Mesh::FaceRef face = new_face.value();
 
-    my_mesh->render_dirty_flag = true;
+    my_mesh->mark_dirty(trans_delta);
     set_selected(face);
 
     trans_begin = {};
@@ -474,7 +740,8 @@ bool Model::begin_extrude(std::string& err) {
     auto sel = selected_element();
     if(!sel.has_value()) return false;
     Halfedge_Mesh::FaceRef f;
-    my_mesh->copy_to(old_mesh);
+    trans_delta = my_mesh->begin_delta({*sel});
+    my_mesh->track_changes();
 
     std::optional<Halfedge_Mesh::ElementRef> new_obj = std::visit(
         overloaded{[&](Halfedge_Mesh::FaceRef face) {
@@ -489,22 +756,24 @@ bool Model::begin_extrude(std::string& err) {
                    [&](auto) -> std::optional<Halfedge_Mesh::ElementRef> { return std::nullopt; }},
         *sel);
 
-    err = validate();
+    std::vector<Halfedge_Mesh::ElementRef> changed = {*sel};
+    if(new_obj.has_value()) changed.push_back(*new_obj);
+    err = validate_local(changed);
     if(!err.empty() || !new_obj.has_value()) {
-        *my_mesh = std::move(old_mesh);
+        my_mesh->rollback(trans_delta);
         return false;
     }
     Halfedge_Mesh::ElementRef elem = new_obj.value();
 
     return std::visit(overloaded{[&](Halfedge_Mesh::VertexRef vert) {
-                                     my_mesh->render_dirty_flag = true;
+                                     my_mesh->mark_dirty(trans_delta);
                                      set_selected(vert);
                                      trans_begin = {};
                                      trans_begin.verts.push_back(vert->pos);
                                      return true;
                                  },
                                  [&](Halfedge_Mesh::FaceRef face) {
-                                     my_mesh->render_dirty_flag = true;
+                                     my_mesh->mark_dirty(trans_delta);
                                      set_selected(face);
 
                                      trans_begin = {};
@@ -569,20 +838,58 @@ bool Model::keydown(Widgets& widgets, SDL_Keysym key, Camera& cam) {
 }
 
 template<typename T>
-std::string Model::update_mesh(Undo& undo, Scene_Object& obj, Halfedge_Mesh&& before,
-                               Halfedge_Mesh::ElementRef ref, T&& op) {
+std::string Model::update_mesh(Undo& undo, Scene_Object& obj, Halfedge_Mesh::ElementRef ref,
+                               T&& op) {
 
-    unsigned int id = Halfedge_Mesh::id_of(ref);
+    if(!multi_selected_ids.empty()) {
+        return update_mesh_batch(undo, obj, std::forward<T>(op));
+    }
+
+    Halfedge_Mesh::Delta delta = my_mesh->begin_delta({ref});
+    my_mesh->track_changes();
     std::optional<Halfedge_Mesh::ElementRef> new_ref = op(*my_mesh, ref);
 
-    auto err = validate();
+    std::vector<Halfedge_Mesh::ElementRef> changed = {ref};
+    if(new_ref.has_value()) changed.push_back(*new_ref);
+    auto err = validate_local(changed);
     if(!err.empty() || !new_ref.has_value()) {
-        obj.take_mesh(std::move(before));
+        my_mesh->rollback(delta);
+        obj.set_mesh_dirty();
     } else {
-        my_mesh->render_dirty_flag = true;
         obj.set_mesh_dirty();
         set_selected(*new_ref);
-        undo.update_mesh(obj.id(), std::move(before), id, std::move(op));
+        my_mesh->end_delta(delta);
+        my_mesh->mark_dirty(delta);
+        undo.update_mesh(obj.id(), std::move(delta));
+    }
+
+    return err;
+}
+
+// Applies op to every selected element with one validation, one rebuild and one undo
+// step, rather than one of each per element
+template<typename T>
+std::string Model::update_mesh_batch(Undo& undo, Scene_Object& obj, T&& op) {
+
+    std::vector<Halfedge_Mesh::ElementRef> elems = selected_elements();
+    Halfedge_Mesh::Delta delta = my_mesh->begin_delta(elems);
+    std::vector<Halfedge_Mesh::ElementRef> results = my_mesh->apply_batch(elems, op);
+
+    std::vector<Halfedge_Mesh::ElementRef> changed = elems;
+    changed.insert(changed.end(), results.begin(), results.end());
+    auto err = validate_local(changed);
+    if(!err.empty() || results.empty()) {
+        my_mesh->rollback(delta);
+        obj.set_mesh_dirty();
+    } else {
+        obj.set_mesh_dirty();
+        set_selected(results.front());
+        for(size_t i = 1; i < results.size(); i++) {
+            multi_selected_ids.push_back(Halfedge_Mesh::id_of(results[i]));
+        }
+        my_mesh->end_delta(delta);
+        my_mesh->mark_dirty(delta);
+        undo.update_mesh(obj.id(), std::move(delta));
     }
 
     return err;
@@ -598,18 +905,36 @@ std::string Model::update_mesh_global(Undo& undo, Scene_Object& obj, Halfedge_Me
     if(!err.empty() || !success) {
         obj.take_mesh(std::move(before));
     } else {
-        my_mesh->render_dirty_flag = true;
+        my_mesh->mark_dirty();
         obj.set_mesh_dirty();
         selected_elem_id = 0;
         hovered_elem_id = 0;
+        multi_selected_ids.clear();
         undo.update_mesh_full(obj.id(), std::move(before));
     }
     return err;
 }
 
 std::string Model::validate() {
+    validated = true;
+    return report(my_mesh->validate(), false);
+}
+
+std::string Model::validate_local(const std::vector<Halfedge_Mesh::ElementRef>& changed) {
+
+    auto valid = my_mesh->validate_local(changed);
+#ifndef NDEBUG
+    // Debug builds still check the whole mesh, to catch operations that change
+    // elements they do not report
+    if(!valid.has_value()) valid = my_mesh->validate();
+#endif
+    validated = true;
+    return report(valid, true);
+}
+
+std::string Model::report(std::optional<std::pair<Halfedge_Mesh::ElementRef, std::string>> valid,
+                          bool local) {
 
-    auto valid = my_mesh->validate();
     if(valid.has_value()) {
         auto& msg = valid.value();
         err_id = Halfedge_Mesh::id_of(msg.first);
@@ -617,7 +942,7 @@ std::string Model::validate() {
         return msg.second;
     }
 
-    auto warn = my_mesh->warnings();
+    auto warn = local ? my_mesh->warnings_local() : my_mesh->warnings();
     if(warn.has_value()) {
         auto& msg = warn.value();
         warn_id = Halfedge_Mesh::id_of(msg.first);
@@ -657,6 +982,10 @@ std::optional<std::reference_wrapper<Scene_Object>> Model::set_my_obj(Scene_Mayb
         return std::nullopt;
     }
 
+    // Objects loaded with deferred halfedges get them on first edit
+    std::string err = obj.sync_halfedge();
+    if(!err.empty()) warn("Object %s can't be edited: %s", obj.opt.name, err.c_str());
+
     if(!obj.is_editable()) {
         my_mesh = nullptr;
         return std::nullopt;
@@ -667,10 +996,12 @@ std::optional<std::reference_wrapper<Scene_Object>> Model::set_my_obj(Scene_Mayb
 
     if(old != my_mesh) {
         selected_elem_id = 0;
+        multi_selected_ids.clear();
         hovered_elem_id = 0;
         err_id = 0;
         warn_id = 0;
-        rebuild();
+        validated = false;
+        rebuild(true);
     } else if(old->render_dirty_flag) {
         rebuild();
     }
@@ -695,20 +1026,25 @@ std::string Model::UIsidebar(Undo& undo, Widgets& widgets, Scene_Maybe obj_opt,
 
     ImGui::Separator();
     ImGui::Text("Global Operations");
+    ImGui::SliderInt("Subdivision Levels", &subd_levels, 1, 4);
+    unsigned int levels = (unsigned int)subd_levels;
     if(ImGui::Button("Linear")) {
         mesh.copy_to(before);
-        return update_mesh_global(undo, obj, std::move(before),
-                                  [](Halfedge_Mesh& m) { return m.subdivide(SubD::linear); });
+        return update_mesh_global(undo, obj, std::move(before), [levels](Halfedge_Mesh& m) {
+            return m.subdivide(SubD::linear, levels);
+        });
     }
     if(Manager::wrap_button("Catmull-Clark")) {
         mesh.copy_to(before);
-        return update_mesh_global(undo, obj, std::move(before),
-                                  [](Halfedge_Mesh& m) { return m.subdivide(SubD::catmullclark); });
+        return update_mesh_global(undo, obj, std::move(before), [levels](Halfedge_Mesh& m) {
+            return m.subdivide(SubD::catmullclark, levels);
+        });
     }
     if(Manager::wrap_button("Loop")) {
         mesh.copy_to(before);
-        return update_mesh_global(undo, obj, std::move(before),
-                                  [](Halfedge_Mesh& m) { return m.subdivide(SubD::loop); });
+        return update_mesh_global(undo, obj, std::move(before), [levels](Halfedge_Mesh& m) {
+            return m.subdivide(SubD::loop, levels);
+        });
     }
     if(ImGui::Button("Triangulate")) {
         mesh.copy_to(before);
@@ -733,6 +1069,9 @@ std::string Model::UIsidebar(Undo& undo, Widgets& widgets, Scene_Maybe obj_opt,
         if(sel.has_value()) {
 
             ImGui::Text("Local Operations");
+            if(!multi_selected_ids.empty()) {
+                ImGui::Text("(Applied to %d selected elements)", (int)selected_elements().size());
+            }
             widgets.action_button(Widget_Type::move, "Move [m]", false);
             widgets.action_button(Widget_Type::rotate, "Rotate [r]");
             widgets.action_button(Widget_Type::scale, "Scale [s]");
@@ -742,9 +1081,8 @@ std::string Model::UIsidebar(Undo& undo, Widgets& widgets, Scene_Maybe obj_opt,
                 overloaded{
                     [&](Halfedge_Mesh::VertexRef vert) -> std::string {
                         if(ImGui::Button("Erase [del]")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), vert,
+                                undo, obj, vert,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef vert) {
                                     return m.erase_vertex(std::get<Halfedge_Mesh::VertexRef>(vert));
                                 });
@@ -753,41 +1091,36 @@ std::string Model::UIsidebar(Undo& undo, Widgets& widgets, Scene_Maybe obj_opt,
                     },
                     [&](Halfedge_Mesh::EdgeRef edge) -> std::string {
                         if(ImGui::Button("Erase [del]")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), edge,
+                                undo, obj, edge,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef edge) {
                                     return m.erase_edge(std::get<Halfedge_Mesh::EdgeRef>(edge));
                                 });
                         }
                         if(Manager::wrap_button("Collapse")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), edge,
+                                undo, obj, edge,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef edge) {
                                     return m.collapse_edge(std::get<Halfedge_Mesh::EdgeRef>(edge));
                                 });
                         }
                         if(Manager::wrap_button("Flip")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), edge,
+                                undo, obj, edge,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef edge) {
                                     return m.flip_edge(std::get<Halfedge_Mesh::EdgeRef>(edge));
                                 });
                         }
                         if(Manager::wrap_button("Split")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), edge,
+                                undo, obj, edge,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef edge) {
                                     return m.split_edge(std::get<Halfedge_Mesh::EdgeRef>(edge));
                                 });
                         }
                         if(Manager::wrap_button("Bisect")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), edge,
+                                undo, obj, edge,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef edge) {
                                     return m.bisect_edge(std::get<Halfedge_Mesh::EdgeRef>(edge));
                                 });
@@ -796,25 +1129,22 @@ std::string Model::UIsidebar(Undo& undo, Widgets& widgets, Scene_Maybe obj_opt,
                     },
                     [&](Halfedge_Mesh::FaceRef face) -> std::string {
                         if(ImGui::Button("Collapse")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), face,
+                                undo, obj, face,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef face) {
                                     return m.collapse_face(std::get<Halfedge_Mesh::FaceRef>(face));
                                 });
                         }
                         if(ImGui::Button("Inset")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), face,
+                                undo, obj, face,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef face) {
                                     return m.inset_face(std::get<Halfedge_Mesh::FaceRef>(face));
                                 });
                         }
                         if(ImGui::Button("Inset Vertex")) {
-                            mesh.copy_to(before);
                             return update_mesh(
-                                undo, obj, std::move(before), face,
+                                undo, obj, face,
                                 [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef face) {
                                     return m.inset_vertex(std::get<Halfedge_Mesh::FaceRef>(face));
                                 });
@@ -908,6 +1238,7 @@ std::string Model::UIsidebar(Undo& undo, Widgets& widgets, Scene_Maybe obj_opt,
         ImGui::TextWrapped("(Your operation resulted in an invalid mesh.)");
         if(ImGui::Button("Select Error")) {
             selected_elem_id = err_id;
+            multi_selected_ids.clear();
         }
         if(Manager::wrap_button("Clear")) {
             err_id = 0;
@@ -922,6 +1253,7 @@ std::string Model::UIsidebar(Undo& undo, Widgets& widgets, Scene_Maybe obj_opt,
         ImGui::TextWrapped("(Your mesh is still manifold, but may cause issues when exported.)");
         if(ImGui::Button("Select Next")) {
             selected_elem_id = warn_id;
+            multi_selected_ids.clear();
         }
     }
 
@@ -939,14 +1271,10 @@ void Model::erase_selected(Undo& undo, Scene_Maybe obj_opt) {
     if(!sel_.has_value()) return;
 
     Halfedge_Mesh::ElementRef sel = sel_.value();
-    Halfedge_Mesh& mesh = *my_mesh;
-
-    Halfedge_Mesh before;
-    mesh.copy_to(before);
 
     std::visit(overloaded{[&](Halfedge_Mesh::VertexRef vert) {
                               return update_mesh(
-                                  undo, obj, std::move(before), vert,
+                                  undo, obj, vert,
                                   [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef vert) {
                                       return m.erase_vertex(
                                           std::get<Halfedge_Mesh::VertexRef>(vert));
@@ -954,7 +1282,7 @@ void Model::erase_selected(Undo& undo, Scene_Maybe obj_opt) {
                           },
                           [&](Halfedge_Mesh::EdgeRef edge) {
                               return update_mesh(
-                                  undo, obj, std::move(before), edge,
+                                  undo, obj, edge,
                                   [](Halfedge_Mesh& m, Halfedge_Mesh::ElementRef edge) {
                                       return m.erase_edge(std::get<Halfedge_Mesh::EdgeRef>(edge));
                                   });
@@ -965,6 +1293,7 @@ void Model::erase_selected(Undo& undo, Scene_Maybe obj_opt) {
 
 void Model::clear_select() {
     selected_elem_id = 0;
+    multi_selected_ids.clear();
 }
 
 void Model::render(Scene_Maybe obj_opt, Widgets& widgets, Camera& cam) {
@@ -974,6 +1303,10 @@ void Model::render(Scene_Maybe obj_opt, Widgets& widgets, Camera& cam) {
 
     Mat4 view = cam.get_view();
 
+    // The mesh may have changed under a still cursor. Mid-drag, what is hovered is
+    // what is being dragged.
+    if(hover_ray && !widgets.is_dragging()) hovered_elem_id = picker.pick(*hover_ray);
+
     Renderer::HalfedgeOpt opts(*this);
     opts.modelview = view;
     opts.v_color = v_col;
@@ -998,13 +1331,16 @@ void Model::render(Scene_Maybe obj_opt, Widgets& widgets, Camera& cam) {
 std::string Model::end_transform(Widgets& widgets, Undo& undo, Scene_Object& obj) {
 
     obj.set_mesh_dirty();
-    my_mesh->render_dirty_flag = true;
 
-    auto err = validate();
+    // apply_transform already kept the visualization up to date, so it is only
+    // rebuilt if the mesh is rolled back. Only positions around the selection moved.
+    auto sel = selected_element();
+    auto err = sel.has_value() ? validate_local({*sel}) : validate();
     if(!err.empty()) {
-        obj.take_mesh(std::move(old_mesh));
+        my_mesh->rollback(trans_delta);
     } else {
-        undo.update_mesh_full(obj.id(), std::move(old_mesh));
+        my_mesh->end_delta(trans_delta);
+        undo.update_mesh(obj.id(), std::move(trans_delta));
     }
     return err;
 }
@@ -1050,7 +1386,27 @@ std::string Model::select(Widgets& widgets, Scene_ID click, Vec3 cam, Vec2 spos,
         }
 
     } else if(!widgets.is_dragging() && click >= n_Widget_IDs) {
-        selected_elem_id = (unsigned int)click;
+
+        unsigned int id = (unsigned int)click;
+        if(SDL_GetModState() & KMOD_SHIFT) {
+            // Shift-click adds to the selection, or takes an element out of it
+            auto entry = std::find(multi_selected_ids.begin(), multi_selected_ids.end(), id);
+            if(entry != multi_selected_ids.end()) {
+                multi_selected_ids.erase(entry);
+            } else if(id == selected_elem_id) {
+                selected_elem_id = 0;
+                if(!multi_selected_ids.empty()) {
+                    selected_elem_id = multi_selected_ids.back();
+                    multi_selected_ids.pop_back();
+                }
+            } else {
+                if(selected_elem_id) multi_selected_ids.push_back(selected_elem_id);
+                selected_elem_id = id;
+            }
+        } else {
+            multi_selected_ids.clear();
+            selected_elem_id = id;
+        }
     }
 
     if(widgets.want_drag()) {
@@ -1069,12 +1425,17 @@ unsigned int Model::select_id() const {
     return selected_elem_id;
 }
 
+const std::vector<unsigned int>& Model::multi_select_ids() const {
+    return multi_selected_ids;
+}
+
 unsigned int Model::hover_id() const {
     return hovered_elem_id;
 }
 
-void Model::hover(unsigned int id) {
-    hovered_elem_id = id;
+void Model::hover(Vec3 cam, Vec3 dir) {
+    hover_ray = Ray(cam, dir);
+    hovered_elem_id = picker.pick(*hover_ray);
 }
 
 } // namespace Gui
@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include "mesh_picker.h"
 #include "widgets.h"
 
 #include <SDL2/SDL.h>
@@ -34,13 +35,14 @@ public:
 
     std::tuple<GL::Mesh&, GL::Instances&, GL::Instances&, GL::Instances&> shapes();
     unsigned int select_id() const;
+    const std::vector<unsigned int>& multi_select_ids() const;
     unsigned int hover_id() const;
-    void hover(unsigned int id);
+    void hover(Vec3 cam, Vec3 dir);
 
 private:
     template<typename T>
-    std::string update_mesh(Undo& undo, Scene_Object& obj, Halfedge_Mesh&& before,
-                            Halfedge_Mesh::ElementRef ref, T&& op);
+    std::string update_mesh(Undo& undo, Scene_Object& obj, Halfedge_Mesh::ElementRef ref, T&& op);
+    template<typename T> std::string update_mesh_batch(Undo& undo, Scene_Object& obj, T&& op);
     template<typename T>
     std::string update_mesh_global(Undo& undo, Scene_Object& obj, Halfedge_Mesh&& before, T&& op);
 
@@ -51,24 +53,49 @@ private:
     void set_selected(Halfedge_Mesh::ElementRef elem);
     std::optional<std::reference_wrapper<Scene_Object>> set_my_obj(Scene_Maybe obj_opt);
     std::optional<Halfedge_Mesh::ElementRef> selected_element();
-    void rebuild();
+    std::vector<Halfedge_Mesh::ElementRef> selected_elements();
+    void rebuild(bool all = false);
+    void rebuild_local(const std::vector<unsigned int>& ids, unsigned int new_from);
+
+    // Draw an element into its slot (taking one if it has none), or free its slot if
+    // it is no longer drawn
+    void place(Halfedge_Mesh::VertexRef v);
+    void place(Halfedge_Mesh::EdgeRef e);
+    void place(Halfedge_Mesh::HalfedgeRef h);
+    void place(Halfedge_Mesh::FaceRef f);
+    void place_instance(GL::Instances& inst, std::vector<size_t>& free,
+                        Halfedge_Mesh::ElementRef ref, const Mat4& transform);
+    void release(unsigned int id);
+    void pickable(Halfedge_Mesh::ElementRef ref, const Mat4& transform);
+    size_t alloc_tris(size_t n);
+    void free_tris(size_t at, size_t n);
 
     void update_vertex(Halfedge_Mesh::VertexRef vert);
     void vertex_viz(Halfedge_Mesh::VertexRef v, float& size, Mat4& transform);
     void edge_viz(Halfedge_Mesh::EdgeRef e, Mat4& transform);
     void halfedge_viz(Halfedge_Mesh::HalfedgeRef h, Mat4& transform);
     void face_viz(Halfedge_Mesh::FaceRef face, std::vector<GL::Mesh::Vert>& verts,
-                  std::vector<GL::Mesh::Index>& idxs, size_t insert_at);
+                  size_t insert_at);
+    static size_t face_verts(Halfedge_Mesh::FaceRef face);
 
     std::string validate();
+    std::string validate_local(const std::vector<Halfedge_Mesh::ElementRef>& changed);
+    std::string report(std::optional<std::pair<Halfedge_Mesh::ElementRef, std::string>> valid,
+                       bool local);
     std::string warn_msg, err_msg;
 
     // This all needs to be updated when the mesh connectivity changes
     unsigned int warn_id = 0, err_id = 0;
     unsigned int selected_elem_id = 0, hovered_elem_id = 0;
+    // Elements shift-clicked into the selection besides the selected one. Local
+    // operations apply to those of the same type as it, in one batch.
+    std::vector<unsigned int> multi_selected_ids;
+    // Whether the mesh was checked since the last rebuild
+    bool validated = false;
 
     Halfedge_Mesh* my_mesh = nullptr;
-    Halfedge_Mesh old_mesh;
+    // Changes of the transform, bevel or extrude in progress
+    Halfedge_Mesh::Delta trans_delta;
 
     enum class Bevel { face, edge, vert };
     Bevel beveling;
@@ -79,22 +106,33 @@ private:
     };
 
     Transform_Data trans_begin;
+    int subd_levels = 1;
     GL::Instances spheres, cylinders, arrows;
     GL::Mesh face_mesh;
+    // The same shapes, for hover picking, and the last ray hovered along
+    Mesh_Picker picker;
+    std::optional<Ray> hover_ray;
     Vec3 f_col = Vec3{1.0f}, v_col = Vec3{1.0f}, e_col = Vec3{0.8f}, he_col = Vec3{0.6f},
          err_col = Vec3{1.0f, 0.0f, 0.0f};
 
     // This is a kind of bad design and would be un-necessary if we used
     // a halfedge implementation with contiguous iterators. For now this map must
-    // be updated (along with the instance data) by build_halfedge whenever
-    // the mesh changes its connectivity. Note that build_halfedge also
-    // re-indexes the mesh elements in the provided half-edge mesh.
+    // be updated (along with the instance data) by rebuild whenever the mesh
+    // changes its connectivity. Each element keeps its instance (or, for faces,
+    // its range of count triangle vertices) until it is erased, so that local
+    // edits only rewrite the slots around them; freed slots are hidden, and
+    // reused before the buffers grow.
     struct ElemInfo {
         Halfedge_Mesh::ElementRef ref;
         size_t instance = 0;
+        size_t count = 0;
     };
     std::unordered_map<unsigned int, ElemInfo> id_to_info;
     std::unordered_map<unsigned int, float> vert_sizes;
+    std::vector<size_t> free_spheres, free_cylinders, free_arrows;
+    // Free triangle vertex ranges by length, and the end of those ever used
+    std::unordered_map<size_t, std::vector<size_t>> free_face_verts;
+    size_t face_end = 0;
 };
 
 } // namespace Gui
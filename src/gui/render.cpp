@@ -13,6 +13,8 @@
 namespace Gui {
 
 Render::Render(Scene& scene, Vec2 dim) : ui_camera(dim), ui_render(dim) {
+    bvh_viz.cap(max_bvh_lines);
+    bvh_active.cap(max_bvh_lines);
 }
 
 void Render::update_dim(Vec2 dim) {
@@ -105,6 +107,9 @@ Mode Render::UIsidebar(Manager& manager, Undo& undo, Scene& scene, Scene_Maybe o
         if(ImGui::SliderInt("Level", &bvh_level, 0, (int)bvh_levels)) {
             update_bvh = true;
         }
+        if(bvh_viz.capped() || bvh_active.capped()) {
+            ImGui::TextWrapped("Too many nodes to draw; only some are shown.");
+        }
     }
     bvh_level = clamp(bvh_level, 0, (int)bvh_levels);
 
@@ -129,12 +134,26 @@ std::pair<float, float> Render::completion_time() const {
     return ui_render.completion_time();
 }
 
+const PT::Pathtracer& Render::tracer() const {
+    return ui_render.tracer();
+}
+
+float Render::redraw_interval() const {
+    return ui_render.redraw_interval();
+}
+
 std::string Render::headless_render(Animate& animate, Scene& scene, const Launch_Settings& s0) {
     Launch_Settings set = s0;
     if(set.w_from_ar) {
         set.w = (int)std::ceil(ui_camera.get_ar() * set.h);
     }
-    return ui_render.headless(animate, scene, ui_camera.get(), set);
+    Camera cam = ui_camera.get();
+    if(set.camera.size() == 6) {
+        const auto& c = set.camera;
+        cam.look_at(Vec3{c[3], c[4], c[5]}, Vec3{c[0], c[1], c[2]});
+    }
+    if(set.fov > 0.0f) cam.set_fov(set.fov);
+    return ui_render.headless(animate, scene, cam, set);
 }
 
 } // namespace Gui
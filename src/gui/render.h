@@ -24,6 +24,8 @@ public:
 
     std::string headless_render(Animate& animate, Scene& scene, const Launch_Settings& set);
     std::pair<float, float> completion_time() const;
+    const PT::Pathtracer& tracer() const;
+    float redraw_interval() const;
 
     bool keydown(Widgets& widgets, SDL_Keysym key);
     Mode UIsidebar(Manager& manager, Undo& undo, Scene& scene, Scene_Maybe selected,
@@ -35,6 +37,7 @@ public:
     const Camera& get_cam() const;
 
 private:
+    static constexpr size_t max_bvh_lines = 1 << 20;
     GL::Lines bvh_viz, bvh_active;
     Widget_Camera ui_camera;
     Widget_Render ui_render;
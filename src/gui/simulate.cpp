@@ -1,6 +1,8 @@
 
 #include "../geometry/util.h"
 #include "../scene/renderer.h"
+#include "../util/parallel.h"
+#include "../util/profiler.h"
 
 #include "manager.h"
 #include "simulate.h"
@@ -10,21 +12,111 @@ namespace Gui {
 const char* Solid_Type_Names[(int)Solid_Type::count] = {"Sphere", "Cube", "Cylinder", "Torus",
                                                         "Custom"};
 
-Simulate::Simulate() : thread_pool(std::thread::hardware_concurrency()) {
+Simulate::Simulate() : thread_pool(parallel_pool()) {
     last_update = SDL_GetPerformanceCounter();
 }
 
 Simulate::~Simulate() {
-    thread_pool.wait();
-    thread_pool.stop();
 }
 
 bool Simulate::keydown(Widgets& widgets, Undo& undo, SDL_Keysym key) {
     return false;
 }
 
-void Simulate::step(Scene& scene, float dt) {
-    scene.for_items([this, dt](Scene_Item& item) { item.step(scene_obj, dt); });
+void Simulate::step(Scene& scene, float dt, Scene_Particles::Clock::time_point deadline) {
+
+    PROFILE_ZONE("Simulate");
+    // Items only read the simulation scene, so step concurrently, each emitter running
+    // all of its substeps in one task (and updating its particles in parallel)
+    std::vector<Scene_Item*> items;
+    scene.for_items([&items](Scene_Item& item) { items.push_back(&item); });
+    std::vector<unsigned char> caught_up(items.size(), 1);
+    parallel_for(0, items.size(), 1, [&](size_t i) {
+        PROFILE_ZONE("Step Item");
+        if(items[i]->is<Scene_Particles>()) {
+            caught_up[i] = items[i]->get<Scene_Particles>().step(
+                Scene_Particles::Colliders(scene_obj, spheres), dt, deadline);
+        } else {
+            items[i]->step(scene_obj, dt);
+        }
+    });
+    behind = std::find(caught_up.begin(), caught_up.end(), 0) != caught_up.end();
+    sim_frame = -1;
+}
+
+void Simulate::step_frame(Scene& scene, int frame, float dt) {
+
+    if(cache_sim && (sim_frame == frame || restore_frame(scene, frame))) return;
+
+    bool continues = cache_sim && frame > 0 && sim_frame == frame - 1;
+    step(scene, dt);
+    if(continues) record_frame(scene, frame);
+}
+
+void Simulate::seek_frame(Scene& scene, int frame, float dt) {
+
+    if(!cache_sim || sim_frame == frame || restore_frame(scene, frame)) return;
+
+    if(frame == 0) {
+        clear_particles(scene);
+        record_frame(scene, 0);
+    } else if(sim_frame == frame - 1) {
+        step_frame(scene, frame, dt);
+    }
+}
+
+bool Simulate::restore_frame(Scene& scene, int frame) {
+
+    auto entry = frame_cache.find(frame);
+    if(entry == frame_cache.end()) return false;
+
+    // An emitter added since recording has no state to restore
+    bool ok = true;
+    scene.for_each<Scene_Particles>([&](Scene_Particles& particles) {
+        if(!ok) return;
+        auto data = entry->second.find(particles.id());
+        ok = data != entry->second.end() && particles.restore(data->second);
+    });
+    if(!ok) {
+        clear_cache();
+        return false;
+    }
+    sim_frame = frame;
+    return true;
+}
+
+void Simulate::record_frame(Scene& scene, int frame) {
+
+    sim_frame = frame;
+    if(frame_cache_bytes >= cache_budget) return;
+
+    Frame_Cache& entry = frame_cache[frame];
+    scene.for_each<Scene_Particles>([&](Scene_Particles& particles) {
+        std::vector<unsigned char>& data = entry[particles.id()];
+        frame_cache_bytes -= data.size();
+        data = particles.snapshot();
+        frame_cache_bytes += data.size();
+    });
+}
+
+void Simulate::check_cache(Undo& undo) {
+    if(cache_actions != undo.n_actions()) {
+        clear_cache();
+        cache_actions = undo.n_actions();
+    }
+}
+
+void Simulate::clear_cache() {
+    frame_cache.clear();
+    frame_cache_bytes = 0;
+}
+
+size_t Simulate::cache_frames() const {
+    return frame_cache.size();
+}
+
+size_t Simulate::cache_bytes() const {
+    return frame_cache_bytes;
 }
 
 void Simulate::update_time() {
@@ -44,7 +136,10 @@ void Simulate::update(Scene& scene, Undo& undo) {
     float dt = clamp((float)(udt / freq), 0.0f, 0.05f);
     last_update = time;
 
-    step(scene, dt);
+    auto budget = std::chrono::duration<float>(step_budget);
+    step(scene, dt,
+         Scene_Particles::Clock::now() +
+             std::chrono::duration_cast<Scene_Particles::Clock::duration>(budget));
 }
 
 void Simulate::render(Scene_Maybe obj_opt, Widgets& widgets, Camera& cam) {
@@ -69,42 +164,122 @@ void Simulate::render(Scene_Maybe obj_opt, Widgets& widgets, Camera& cam) {
 void Simulate::build_scene(Scene& scene) {
 
     if(!scene.has_sim()) return;
+    PROFILE_ZONE("Collision BVH");
 
+    // Rebuilds run while the user edits the scene, so any render or preview sharing
+    // the pool goes first (the BVH builds' own subtasks inherit this priority)
+    Thread_Pool::Scoped_Priority background(Thread_Pool::Priority::background);
     std::vector<PT::Object> obj_list;
-    std::vector<std::future<PT::Object>> futures;
-
-    scene.for_items([&, this](Scene_Item& item) {
-        if(item.is<Scene_Object>()) {
-            Scene_Object& obj = item.get<Scene_Object>();
-            futures.push_back(thread_pool.enqueue([&]() {
-                if(obj.is_shape()) {
-                    PT::Shape shape(obj.opt.shape);
-                    return PT::Object(std::move(shape), obj.id(), 0, obj.pose.transform());
-                } else {
-                    PT::Tri_Mesh mesh(obj.posed_mesh(), use_bvh);
-                    return PT::Object(std::move(mesh), obj.id(), 0, obj.pose.transform());
-                }
-            }));
+    // A simulation running beside a render gets at most half of the workers
+    Task_Group builds(thread_pool, std::max(size_t(1), thread_pool.size() / 2));
+
+    // As in PT::Pathtracer::build_scene, meshes that only moved are refit. This runs
+    // on every scene change, so build speed matters more than tracing speed.
+    std::unordered_map<Scene_ID, PT::Tri_Mesh> cache;
+    PT::BVH_Options options;
+    options.method = PT::BVH_Options::Method::lbvh;
+
+    // Posing regenerates the mesh, so it happens here rather than in the tasks
+    struct Build {
+        Scene_Object* obj;
+        PT::Tri_Mesh* mesh;
+        const GL::Mesh* posed;
+    };
+    std::vector<Build> jobs;
+    // Particles sweep uniformly scaled spheres exactly, so these are left out of the
+    // BVH, unless there are so many that searching it is cheaper
+    std::vector<Scene_Object*> sphere_objs;
+    scene.for_each<Scene_Object>([&, this](Scene_Object& obj) {
+        PT::Tri_Mesh* mesh = nullptr;
+        if(!obj.is_shape()) {
+            mesh = &(cache[obj.id()] = std::move(mesh_cache[obj.id()]));
+        } else if(obj.opt.shape.get_if<PT::Sphere>()) {
+            Mat4 T = obj.pose.transform();
+            float s = T[0].xyz().norm();
+            if(std::abs(T[1].xyz().norm() - s) <= EPS_F * s &&
+               std::abs(T[2].xyz().norm() - s) <= EPS_F * s) {
+                sphere_objs.push_back(&obj);
+                return;
+            }
         }
+        jobs.push_back({&obj, mesh, mesh ? &obj.posed_mesh() : nullptr});
     });
+    spheres.clear();
+    if(sphere_objs.size() > max_spheres) {
+        for(Scene_Object* obj : sphere_objs) jobs.push_back({obj, nullptr, nullptr});
+    } else {
+        for(Scene_Object* obj : sphere_objs) {
+            Mat4 T = obj->pose.transform();
+            float r = obj->opt.shape.get<PT::Sphere>().radius * T[0].xyz().norm();
+            spheres.push_back({T[3].xyz(), r});
+        }
+    }
+
+    // If every object's geometry is as it was last time, only the top level needs
+    // refitting, around those that moved
+    std::vector<Collider> next;
+    for(const Build& job : jobs) {
+        next.push_back({job.obj->id(), job.posed ? job.posed->revision() : 0,
+                        job.obj->opt.shape, job.obj->pose.transform()});
+    }
+    bool same = built && built_bvh == use_bvh && next.size() == colliders.size() &&
+                std::equal(next.begin(), next.end(), colliders.begin(),
+                           [](const Collider& a, const Collider& b) {
+                               return a.id == b.id && a.revision == b.revision &&
+                                      !(a.shape != b.shape);
+                           });
+    if(same) {
+        for(auto& [id, mesh] : cache) mesh_cache[id] = std::move(mesh);
+        std::unordered_map<Scene_ID, Mat4> moved;
+        for(size_t i = 0; i < next.size(); i++) {
+            if(next[i].T != colliders[i].T) moved[next[i].id] = next[i].T;
+        }
+        if(!moved.empty()) {
+            scene_obj.edit_objects(
+                [&moved](PT::Object& obj) {
+                    auto entry = moved.find(obj.id());
+                    if(entry != moved.end()) obj.set_trans(entry->second);
+                },
+                &thread_pool);
+        }
+        colliders = std::move(next);
+        return;
+    }
 
-    for(auto& f : futures) {
-        obj_list.push_back(f.get());
+    // Each task fills its own slot, so the list is sized before any of them start. Each
+    // job is of a different object, so no two tasks read (and lazily cache) one Pose.
+    obj_list.resize(jobs.size());
+    for(size_t i = 0; i < jobs.size(); i++) {
+        builds.run([&, i]() {
+            const Build& job = jobs[i];
+            const Scene_Object& obj = *job.obj;
+            if(!job.mesh) {
+                PT::Shape shape(obj.opt.shape);
+                obj_list[i] = PT::Object(std::move(shape), obj.id(), 0, obj.pose.transform());
+            } else {
+                job.mesh->refit(*job.posed, use_bvh, &thread_pool, options);
+                obj_list[i] = PT::Object(job.mesh->copy(), obj.id(), 0, obj.pose.transform());
+            }
+        });
     }
 
+    builds.wait();
+    mesh_cache = std::move(cache);
+    colliders = std::move(next);
+    built = true;
+    built_bvh = use_bvh;
+
     if(use_bvh) {
-        scene_obj = PT::Object(PT::BVH<PT::Object>(std::move(obj_list)));
+        options.max_leaf_size = 1;
+        scene_obj = PT::Object(PT::BVH<PT::Object>(std::move(obj_list), options, &thread_pool));
     } else {
         scene_obj = PT::Object(PT::List<PT::Object>(std::move(obj_list)));
     }
 }
 
 void Simulate::clear_particles(Scene& scene) {
-    scene.for_items([](Scene_Item& item) {
-        if(item.is<Scene_Particles>()) {
-            item.get<Scene_Particles>().clear();
-        }
-    });
+    scene.for_each<Scene_Particles>([](Scene_Particles& particles) { particles.clear(); });
+    sim_frame = -1;
 }
 
 void Simulate::update_bvh(Scene& scene, Undo& undo) {
@@ -130,8 +305,17 @@ Mode Simulate::UIsidebar(Manager& manager, Scene& scene, Undo& undo, Widgets& wi
 
     if(ImGui::Checkbox("Use BVH", &use_bvh)) {
         clear_particles(scene);
+        clear_cache();
         build_scene(scene);
     }
+    float budget_ms = step_budget * 1000.0f;
+    if(ImGui::DragFloat("Step Budget (ms)", &budget_ms, 0.1f, 1.0f, 100.0f, "%.1f")) {
+        step_budget = clamp(budget_ms, 1.0f, 100.0f) / 1000.0f;
+    }
+    if(ImGui::DragInt("Max Bounces", &Scene_Particles::max_bounces, 0.1f, 1, 64)) {
+        Scene_Particles::max_bounces = clamp(Scene_Particles::max_bounces, 1, 64);
+    }
+    if(behind) ImGui::Text("Simulation is catching up");
 
     if(ImGui::CollapsingHeader("Add New Emitter")) {
         ImGui::PushID(0);
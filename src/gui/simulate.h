@@ -3,7 +3,7 @@
 
 #include "../rays/pathtracer.h"
 #include "../scene/particles.h"
-#include "../util/thread_pool.h"
+#include "../util/parallel.h"
 
 #include "widgets.h"
 #include <SDL2/SDL.h>
@@ -25,7 +25,28 @@ public:
     void update(Scene& scene, Undo& undo);
     void update_time();
 
-    void step(Scene& scene, float dt);
+    // Simulates dt seconds of every item. With a deadline, emitters stop there and
+    // catch up on the rest over later calls (see Scene_Particles::step).
+    void step(Scene& scene, float dt,
+              Scene_Particles::Clock::time_point deadline =
+                  Scene_Particles::Clock::time_point::max());
+
+    // Brings emitters to their state at an animation frame: restored from the cache
+    // if there, otherwise simulated for dt (recorded when the previous frame's state
+    // was known). Without caching, this just steps.
+    void step_frame(Scene& scene, int frame, float dt);
+    // As step_frame, but only simulates onward from the previous frame, and starts
+    // over from no particles at frame 0. Does nothing without caching.
+    void seek_frame(Scene& scene, int frame, float dt);
+    // Any scene edit may change how the simulation plays out, so drops the cache
+    void check_cache(Undo& undo);
+    void clear_cache();
+    size_t cache_frames() const;
+    size_t cache_bytes() const;
+    // Record each animation frame's particles, so replaying, scrubbing, and rendering
+    // restore states instead of re-simulating them
+    bool cache_sim = false;
+    size_t cache_budget = size_t(1) << 30;
 
     void clear_particles(Scene& scene);
     void update_bvh(Scene& scene, Undo& undo);
@@ -36,9 +57,34 @@ public:
 
 private:
     PT::Object scene_obj;
+    std::unordered_map<Scene_ID, PT::Tri_Mesh> mesh_cache;
     bool use_bvh = true;
+    // Seconds of each UI frame that real-time simulation may take
+    float step_budget = 0.01f;
+    bool behind = false;
+
+    // What scene_obj was built from, to tell when only transforms have changed
+    struct Collider {
+        Scene_ID id = 0;
+        uint64_t revision = 0;
+        PT::Shape shape;
+        Mat4 T;
+    };
+    std::vector<Collider> colliders;
+    bool built = false, built_bvh = false;
+    std::vector<Scene_Particles::Colliders::Sphere> spheres;
+    static constexpr size_t max_spheres = 32;
+
+    // Compressed snapshots of each emitter (see Scene_Particles::snapshot) per frame
+    using Frame_Cache = std::unordered_map<Scene_ID, std::vector<unsigned char>>;
+    std::unordered_map<int, Frame_Cache> frame_cache;
+    size_t frame_cache_bytes = 0, cache_actions = 0;
+    // The frame whose state the emitters hold, or -1 if they have left the timeline
+    int sim_frame = -1;
+    bool restore_frame(Scene& scene, int frame);
+    void record_frame(Scene& scene, int frame);
 
-    Thread_Pool thread_pool;
+    Thread_Pool& thread_pool;
     Pose old_pose;
     size_t cur_actions = 0;
     Uint64 last_update;
@@ -1,9 +1,12 @@
 
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <imgui/imgui.h>
 #include <iomanip>
 #include <iostream>
 #include <nfd/nfd.h>
-#include <sf_libs/stb_image_write.h>
 #include <sstream>
 
 #include "animate.h"
@@ -13,7 +16,11 @@
 #include "../app.h"
 #include "../geometry/util.h"
 #include "../platform/platform.h"
+#include "../rays/denoise.h"
 #include "../scene/renderer.h"
+#include "../util/image_stream.h"
+#include "../util/parallel.h"
+#include "../util/png_writer.h"
 
 namespace Gui {
 
@@ -615,6 +622,7 @@ void Widget_Camera::generate_cage() {
 Widget_Render::Widget_Render(Vec2 dim) : pathtracer(*this, dim) {
     out_w = (size_t)dim.x / 2;
     out_h = (size_t)dim.y / 2;
+    ray_log.cap(max_logged_rays);
 }
 
 void Widget_Render::open() {
@@ -623,8 +631,7 @@ void Widget_Render::open() {
 }
 
 void Widget_Render::log_ray(const Ray& ray, float t, Spectrum color) {
-    std::lock_guard<std::mutex> lock(log_mut);
-    ray_log.add(ray.point, ray.at(t), Vec3(color.r, color.g, color.b));
+    ray_log.add_shared(ray.point, ray.at(t), Vec3(color.r, color.g, color.b));
 }
 
 void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
@@ -645,16 +652,52 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     if(method == 1) {
         ImGui::InputInt("Samples", &out_samples, 1, 100);
         ImGui::InputInt("Max Ray Depth", &out_depth, 1, 32);
+        ImGui::InputInt("Roulette Depth", &out_rr_depth, 1, 32);
+        ImGui::InputInt("Light Samples", &light_samples, 1, 4);
+        ImGui::InputInt("Guide Passes", &guide_passes, 1, 4);
+        if(ImGui::IsItemHovered()) {
+            ImGui::SetTooltip("Train a path guide for indirect bounces, 0 to disable");
+        }
+        ImGui::InputInt("Caustic Photons", &caustic_photons, 10000, 100000);
+        if(ImGui::IsItemHovered()) {
+            ImGui::SetTooltip("Photons traced for caustics through mirrors and glass, 0 to "
+                              "disable");
+        }
+        if(caustic_photons > 0) {
+            ImGui::InputFloat("Caustic Radius", &caustic_radius, 0.01f, 0.1f, "%.3f");
+            if(ImGui::IsItemHovered()) ImGui::SetTooltip("0 to fit it to the scene");
+        }
         ImGui::SliderFloat("Exposure", &exposure, 0.01f, 10.0f, "%.2f", 2.5f);
+        ImGui::SliderFloat("Adaptive Error", &adaptive_error, 0.0f, 0.2f, "%.3f");
+        ImGui::InputFloat("Time Limit (s)", &time_limit, 1.0f, 10.0f, "%.1f");
+        ImGui::Checkbox("Region", &use_region);
+        if(use_region) {
+            ImGui::SameLine();
+            ImGui::InputInt4("x0 y0 x1 y1", region);
+            ImGui::InputInt("Region Samples", &region_samples, 1, 100);
+            if(ImGui::IsItemHovered()) ImGui::SetTooltip("0 for the render's samples");
+        }
     } else {
         ImGui::Combo("Samples", (int*)&msaa.samples, GL::Sample_Count_Names, msaa.n_options());
         out_samples = msaa.n_samples();
+        ImGui::Checkbox("Preview Materials", &use_materials);
+        if(use_materials) {
+            ImGui::SliderFloat("Exposure", &exposure, 0.01f, 10.0f, "%.2f", 2.5f);
+        }
     }
 
     out_w = std::max(1, out_w);
     out_h = std::max(1, out_h);
     out_samples = std::max(1, out_samples);
     out_depth = std::max(1, out_depth);
+    out_rr_depth = std::max(0, out_rr_depth);
+    light_samples = std::max(0, light_samples);
+    guide_passes = std::max(0, guide_passes);
+    caustic_photons = std::max(0, caustic_photons);
+    caustic_radius = std::max(0.0f, caustic_radius);
+    time_limit = std::max(0.0f, time_limit);
+    for(int& r : region) r = std::max(0, r);
+    region_samples = std::max(0, region_samples);
 
     if(ImGui::Button("Set Width via AR")) {
         out_w = (size_t)std::ceil(cam.get_ar() * out_h);
@@ -665,6 +708,79 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     }
     ImGui::SameLine();
     ImGui::Checkbox("Use BVH", &use_bvh);
+    if(method == 1) {
+        ImGui::SameLine();
+        ImGui::Checkbox("Wavefront", &use_wavefront);
+        ImGui::SameLine();
+        ImGui::Checkbox("Preview", &use_preview);
+        ImGui::SameLine();
+        ImGui::Checkbox("Raster Primary", &use_raster_primary);
+        if(ImGui::IsItemHovered()) {
+            ImGui::SetTooltip("Rasterize the scene's depth first, so camera rays only search "
+                              "the BVH as far as the surfaces it shows");
+        }
+        ImGui::SameLine();
+        ImGui::Checkbox("Count Rays", &use_counters);
+        ImGui::SameLine();
+        ImGui::Checkbox("Deterministic", &use_deterministic);
+        ImGui::SameLine();
+        ImGui::Checkbox("Follow Camera", &use_follow);
+        if(ImGui::IsItemHovered()) {
+            ImGui::SetTooltip("Restart the render as the render camera moves, starting from "
+                              "the last one where the same surfaces show");
+        }
+        if(PT::GPU_Tracer::supported()) {
+            ImGui::SameLine();
+            ImGui::Checkbox("GPU", &use_gpu);
+            if(ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Path trace in compute shaders, for a fast preview: no "
+                                  "particles, photon map, guiding or adaptive sampling");
+            }
+        }
+        if(PT::can_denoise()) {
+            ImGui::SameLine();
+            ImGui::Checkbox("Denoise", &use_denoise);
+        }
+        ImGui::Combo("Sampler", &sampler, RNG::Sequence_Names, (int)RNG::Sequence::count);
+        ImGui::Combo("Heatmap", &heatmap, PT::Heatmap_Names, (int)PT::Heatmap::count);
+        if(heatmap != (int)PT::Heatmap::none) {
+            ImGui::InputFloat("Heatmap Scale (0: auto)", &heatmap_scale);
+            heatmap_scale = std::max(heatmap_scale, 0.0f);
+        }
+        if(use_bvh) {
+            ImGui::Combo("BVH Profile", &bvh_profile, PT::BVH_Profile_Names,
+                         (int)PT::BVH_Profile::count);
+            ImGui::Checkbox("Compress Meshes", &use_compression);
+        }
+    }
+}
+
+// First-hit features written as layers alongside a render (see Pathtracer::render_aovs),
+// with this many jittered samples per pixel, as they converge far faster than color
+static const size_t aov_samples = 16;
+struct Aovs {
+    HDR_Image albedo, normal, depth;
+    std::vector<HDR_Image::Layer> layers() const {
+        return {{"albedo", &albedo, "RGB"}, {"normal", &normal, "XYZ"}, {"depth", &depth, "Z"}};
+    }
+};
+
+// Denoises a copy of a finished render, guided by its albedo and normals
+static std::string denoise_render(PT::Pathtracer& tracer, HDR_Image& out, Aovs& aovs) {
+    tracer.render_aovs(aovs.albedo, aovs.normal, aovs.depth, aov_samples);
+    out = tracer.get_output().copy();
+    return PT::denoise(out, &aovs.albedo, &aovs.normal);
+}
+
+static std::string frame_path(const std::string& folder, int frame,
+                              const std::string& ext = ".png") {
+    std::stringstream str;
+    str << std::setfill('0') << std::setw(4) << frame;
+#ifdef _WIN32
+    return folder + "\\" + str.str() + ext;
+#else
+    return folder + "/" + str.str() + ext;
+#endif
 }
 
 std::string Widget_Render::step(Animate& animate, Scene& scene) {
@@ -680,29 +796,23 @@ std::string Widget_Render::step(Animate& animate, Scene& scene) {
             return "No output folder!";
         }
 
-        Camera cam = animate.set_time(scene, (float)next_frame);
+        if(next_frame == 0) animate.bake_frames(scene);
+        Camera cam = animate.set_time(scene, (float)next_frame, next_frame == 0);
 
         if(method == 0) {
 
             animate.step_sim(scene);
             std::vector<unsigned char> data;
 
-            Renderer::get().save(scene, cam, out_w, out_h, out_samples);
+            Renderer::get().save(scene, cam, out_w, out_h, out_samples, use_materials, exposure);
             Renderer::get().saved(data);
 
-            std::stringstream str;
-            str << std::setfill('0') << std::setw(4) << next_frame;
-#ifdef _WIN32
-            std::string path = folder + "\\" + str.str() + ".png";
-#else
-            std::string path = folder + "/" + str.str() + ".png";
-#endif
+            std::string path = frame_path(folder, next_frame);
 
-            stbi_flip_vertically_on_write(true);
-            if(!stbi_write_png(path.c_str(), (int)out_w, (int)out_h, 4, data.data(),
-                               (int)out_w * 4)) {
+            std::string err = Png::write(path, data.data(), out_w, out_h, true);
+            if(!err.empty()) {
                 animating = false;
-                return "Failed to write output!";
+                return err;
             }
 
             next_frame++;
@@ -716,20 +826,24 @@ std::string Widget_Render::step(Animate& animate, Scene& scene) {
             if(!pathtracer.in_progress()) {
                 std::vector<unsigned char> data;
 
-                pathtracer.get_output().tonemap_to(data, exposure);
-                std::stringstream str;
-                str << std::setfill('0') << std::setw(4) << next_frame;
-#ifdef _WIN32
-                std::string path = folder + "\\" + str.str() + ".png";
-#else
-                std::string path = folder + "/" + str.str() + ".png";
-#endif
+                if(use_denoise) {
+                    Aovs aovs;
+                    HDR_Image image;
+                    std::string err = denoise_render(pathtracer, image, aovs);
+                    if(!err.empty()) {
+                        animating = false;
+                        return err;
+                    }
+                    image.tonemap_to(data, exposure);
+                } else {
+                    pathtracer.get_output().tonemap_to(data, exposure);
+                }
+                std::string path = frame_path(folder, next_frame);
 
-                stbi_flip_vertically_on_write(false);
-                if(!stbi_write_png(path.c_str(), (int)out_w, (int)out_h, 4, data.data(),
-                                   (int)out_w * 4)) {
+                std::string err = Png::write(path, data.data(), out_w, out_h);
+                if(!err.empty()) {
                     animating = false;
-                    return "Failed to write output!";
+                    return err;
                 }
 
                 animate.step_sim(scene);
@@ -782,10 +896,27 @@ void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam,
             max_frame = last_frame;
             next_frame = 0;
             folder = std::string(output_path);
+            // Animations are always rendered on the CPU
+            gpu.cancel();
+            on_gpu = false;
+            pending_cam.reset();
+            pathtracer.cancel();
             if(method == 1) {
                 init = true;
                 ray_log.clear();
-                pathtracer.set_params(out_w, out_h, out_samples, out_depth, use_bvh);
+                pathtracer.set_params(out_w, out_h, out_samples, out_depth, use_bvh,
+                                      adaptive_error, out_rr_depth,
+                                      (PT::BVH_Profile)bvh_profile, (RNG::Sequence)sampler);
+                pathtracer.set_time_limit(time_limit);
+                pathtracer.set_wavefront(use_wavefront);
+                pathtracer.set_deterministic(use_deterministic);
+                pathtracer.set_light_samples(size_t(light_samples));
+                pathtracer.set_guiding(size_t(guide_passes));
+                pathtracer.set_caustics(size_t(caustic_photons), caustic_radius);
+                pathtracer.set_reprojection(false);
+                pathtracer.set_compress_meshes(use_bvh && use_compression);
+                pathtracer.set_heatmap((PT::Heatmap)heatmap, heatmap_scale);
+                pathtracer.set_preview(false);
             }
         }
     }
@@ -805,12 +936,203 @@ void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam,
     ImGui::End();
 }
 
+template<typename Buckets> static std::string histogram(const Buckets& buckets) {
+    std::stringstream ss;
+    for(size_t i = 0; i < buckets.size(); i++) {
+        if(buckets[i]) ss << " " << i << ":" << buckets[i];
+    }
+    return ss.str();
+}
+
+static void log_bvh_stats(const char* name, const PT::BVH_Stats& s) {
+    if(s.nodes == 0) return;
+    info("%s BVH: %zu nodes, %zu leaves, %zu primitives, %.1f KB", name, s.nodes, s.leaves,
+         s.primitives, s.bytes / 1024.0);
+    info("	SAH cost: %.2f, max depth: %zu", s.sah_cost, s.max_depth);
+    info("	leaves by depth:%s", histogram(s.depths).c_str());
+    info("	leaves by size:%s", histogram(s.leaf_sizes).c_str());
+}
+
+static void log_bvh_counters(const PT::BVH_Counters& c, float seconds) {
+    info("Traced %llu camera, %llu secondary and %llu shadow rays",
+         (unsigned long long)c.camera_rays, (unsigned long long)c.secondary_rays,
+         (unsigned long long)c.shadow_rays);
+    if(!c.rays()) return;
+    double s = std::max((double)seconds, 1e-9);
+    info("	Mrays/s: %.2f total, %.2f camera, %.2f secondary, %.2f shadow", c.rays() / s / 1e6,
+         c.camera_rays / s / 1e6, c.secondary_rays / s / 1e6, c.shadow_rays / s / 1e6);
+    info("	rays by bounce:%s", histogram(c.bounces).c_str());
+    info("	per ray: %.1f nodes visited, %.1f primitives tested", (double)c.nodes / c.rays(),
+         (double)c.primitives / c.rays());
+}
+
+static void log_memory(const Scene& scene, const PT::Pathtracer& tracer) {
+    auto mb = [](size_t bytes) { return bytes / (1024.0 * 1024.0); };
+    Scene::Memory s = scene.memory();
+    PT::Pathtracer::Memory t = tracer.memory();
+    info("Scene memory: %.1f MB", mb(s.total()));
+    info("\thalfedge meshes %.1f MB, mesh copies %.1f MB, skinning %.1f MB", mb(s.halfedge),
+         mb(s.meshes), mb(s.skinning));
+    info("\tparticles %.1f MB, images %.1f MB", mb(s.particles), mb(s.images));
+    info("Render memory: %.1f MB", mb(t.scene + t.meshes + t.images));
+    info("\tscene BVH %.1f MB, mesh BVHs %.1f MB, images %.1f MB", mb(t.scene), mb(t.meshes),
+         mb(t.images));
+    if(t.paged) info("\tpaged mesh geometry %.1f MB", mb(t.paged));
+    info("Peak process memory: %.1f MB", mb(Platform::peak_memory()));
+}
+
+static void log_pool_stats(const Thread_Pool::Stats& s) {
+    Thread_Pool::Worker_Stats total;
+    for(const auto& w : s.workers) {
+        total.tasks += w.tasks;
+        total.steals += w.steals;
+        total.busy += w.busy;
+        total.idle += w.idle;
+    }
+    double capacity = std::max(s.seconds * s.workers.size(), 1e-9);
+    info("Thread pool: %zu workers over %.2fs, %.1f%% busy, %.1f%% asleep", s.workers.size(),
+         s.seconds, 100.0 * total.busy / capacity, 100.0 * total.idle / capacity);
+    info("\t%llu tasks, %llu stolen, %llu run by waiting threads, at most %zu queued",
+         (unsigned long long)total.tasks, (unsigned long long)total.steals,
+         (unsigned long long)s.external.tasks, s.max_queued);
+    info("\tqueue wait by log2 us:%s", histogram(s.queue_wait).c_str());
+    double span = std::max(s.seconds, 1e-9);
+    for(size_t i = 0; i < s.workers.size(); i++) {
+        const auto& w = s.workers[i];
+        info("\tworker %zu: %llu tasks, %llu steals, %.1f%% busy, %.1f%% asleep", i,
+             (unsigned long long)w.tasks, (unsigned long long)w.steals, 100.0 * w.busy / span,
+             100.0 * w.idle / span);
+    }
+}
+
+// Headless progress and statistics as JSON Lines: "progress" events at most once a
+// second, a "frame" event per animation frame, and a "report" at the end. Each line is
+// flushed as written, so a scheduler can follow the file while the render runs.
+class Stats_Json {
+public:
+    std::string open(const std::string& file) {
+        out.open(file);
+        if(!out) return "Failed to open " + file + " for writing.";
+        return {};
+    }
+    bool enabled() const {
+        return out.is_open();
+    }
+
+    void progress(float f) {
+        if(!enabled()) return;
+        double now = elapsed();
+        if(now - last_progress < 1.0) return;
+        last_progress = now;
+        std::stringstream ss;
+        ss << "{\"event\": \"progress\", \"time\": " << now << ", \"progress\": " << f << "}";
+        write(ss.str());
+    }
+
+    // Adds a finished render to the report, as the given animation frame if not -1
+    void render(const PT::Pathtracer& tracer, int frame = -1) {
+        if(!enabled()) return;
+        auto [build_s, render_s] = tracer.completion_time();
+        float spp = tracer.achieved_samples();
+        build += build_s;
+        render_time += render_s;
+        samples += spp;
+        renders++;
+        counters += tracer.counters();
+        if(frame < 0) return;
+        std::stringstream ss;
+        ss << "{\"event\": \"frame\", \"time\": " << elapsed() << ", \"frame\": " << frame
+           << ", \"build\": " << build_s << ", \"render\": " << render_s
+           << ", \"samples\": " << spp << "}";
+        write(ss.str());
+    }
+
+    void report(const PT::Pathtracer& tracer, const Thread_Pool::Stats& pool,
+                const Scene& scene) {
+        if(!enabled()) return;
+        auto [scene_stats, mesh_stats] = tracer.bvh_stats();
+        auto bvh = [](const PT::BVH_Stats& s) {
+            std::stringstream ss;
+            ss << "{\"nodes\": " << s.nodes << ", \"leaves\": " << s.leaves
+               << ", \"primitives\": " << s.primitives << ", \"bytes\": " << s.bytes
+               << ", \"max_depth\": " << s.max_depth << ", \"sah_cost\": " << s.sah_cost
+               << "}";
+            return ss.str();
+        };
+        double busy = 0.0, idle = 0.0;
+        for(const auto& w : pool.workers) {
+            busy += w.busy;
+            idle += w.idle;
+        }
+        double capacity = std::max(pool.seconds * pool.workers.size(), 1e-9);
+        Scene::Memory sm = scene.memory();
+        PT::Pathtracer::Memory tm = tracer.memory();
+
+        std::stringstream ss;
+        ss << "{\"event\": \"report\", \"time\": " << elapsed() << ", \"renders\": " << renders
+           << ", \"build\": " << build << ", \"render\": " << render_time
+           << ", \"samples\": " << samples / std::max<size_t>(renders, 1)
+           << ", \"rays\": {\"camera\": " << counters.camera_rays
+           << ", \"secondary\": " << counters.secondary_rays
+           << ", \"shadow\": " << counters.shadow_rays
+           << ", \"per_second\": " << counters.rays() / std::max(render_time, 1e-9)
+           << ", \"by_bounce\": [";
+        for(size_t i = 0; i < counters.bounces.size(); i++) {
+            ss << (i ? ", " : "") << counters.bounces[i];
+        }
+        ss << "]}"
+           << ", \"peak_memory\": " << Platform::peak_memory()
+           << ", \"memory\": {\"halfedge\": " << sm.halfedge << ", \"meshes\": " << sm.meshes
+           << ", \"skinning\": " << sm.skinning << ", \"particles\": " << sm.particles
+           << ", \"images\": " << sm.images << ", \"scene_bvh\": " << tm.scene
+           << ", \"mesh_bvhs\": " << tm.meshes << ", \"paged_meshes\": " << tm.paged
+           << ", \"render_images\": " << tm.images << "}"
+           << ", \"bvh\": {\"scene\": " << bvh(scene_stats) << ", \"mesh\": " << bvh(mesh_stats)
+           << "}, \"threads\": {\"workers\": " << pool.workers.size()
+           << ", \"busy\": " << busy / capacity << ", \"asleep\": " << idle / capacity << "}}";
+        write(ss.str());
+    }
+
+private:
+    double elapsed() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    void write(const std::string& line) {
+        out << line << std::endl;
+    }
+
+    std::ofstream out;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double last_progress = -1.0;
+    double build = 0.0, render_time = 0.0, samples = 0.0;
+    size_t renders = 0;
+    PT::BVH_Counters counters;
+};
+
+static void bvh_stats_UI(const char* name, const PT::BVH_Stats& s) {
+    if(s.nodes == 0) return;
+    ImGui::PushID(name);
+    ImGui::Text("%s: %zu nodes, %zu leaves, %zu primitives, %.1f KB", name, s.nodes, s.leaves,
+                s.primitives, s.bytes / 1024.0);
+    ImGui::Text("SAH cost %.2f, max depth %zu", s.sah_cost, s.max_depth);
+    std::vector<float> depths(s.depths.begin(), s.depths.end());
+    std::vector<float> sizes(s.leaf_sizes.begin(), s.leaf_sizes.end());
+    ImGui::PlotHistogram("Leaves by Depth", depths.data(), (int)depths.size(), 0, nullptr, 0.0f,
+                         FLT_MAX, {0.0f, 40.0f});
+    ImGui::PlotHistogram("Leaves by Size", sizes.data(), (int)sizes.size(), 0, nullptr, 0.0f,
+                         FLT_MAX, {0.0f, 40.0f});
+    ImGui::PopID();
+}
+
 static bool postfix(const std::string& path, const std::string& type) {
     if(path.length() >= type.length())
         return path.compare(path.length() - type.length(), type.length(), type) == 0;
     return false;
 }
 
+// Milliseconds of each interface frame a GPU render may take
+static const float gpu_budget_ms = 10.0f;
+
 bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::string& err) {
 
     bool ret = false;
@@ -821,27 +1143,91 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
     ImGui::Separator();
     ImGui::Text("Render");
 
-    if(pathtracer.in_progress()) {
+    // GPU renders advance a few samples per frame, leaving the interface responsive
+    if(on_gpu) gpu.step(gpu_budget_ms);
+
+    // CPU renders build their scene on the pool from a snapshot (see
+    // Pathtracer::build_async), so it can be edited meanwhile, and begin once built
+    if(pending_cam && !pathtracer.building()) {
+        raster_primary(scene, *pending_cam);
+        pathtracer.begin_render(scene, *pending_cam);
+        pending_cam.reset();
+    }
+
+    if(on_gpu ? gpu.in_progress() : pending_cam || pathtracer.in_progress()) {
 
         if(ImGui::Button("Cancel")) {
-            pathtracer.cancel();
+            if(on_gpu) {
+                gpu.cancel();
+            } else {
+                // A build can't be stopped partway, so this waits for it to finish, after
+                // which nothing else touches the pathtracer's scene
+                pending_cam.reset();
+                pathtracer.cancel();
+            }
         }
 
         ImGui::SameLine();
-        ImGui::ProgressBar(pathtracer.progress());
+        if(on_gpu) {
+            ImGui::ProgressBar(gpu.progress());
+        } else if(pending_cam) {
+            ImGui::ProgressBar(0.0f, ImVec2(-1, 0), "Building scene...");
+        } else {
+            ImGui::ProgressBar(pathtracer.progress());
+        }
 
     } else {
 
         if(ImGui::Button("Start Render")) {
 
-            if(method == 1) {
+            on_gpu = method == 1 && use_gpu && PT::GPU_Tracer::supported();
+            if(on_gpu) {
                 has_rendered = true;
+                denoised = false;
+                ret = true;
+                PT::GPU_Scene data;
+                pathtracer.gpu_scene(scene, data);
+                std::string gpu_err = gpu.build(std::move(data));
+                if(gpu_err.empty()) {
+                    gpu.begin_render(cam.get(), out_w, out_h, out_samples, out_depth);
+                } else {
+                    err = gpu_err;
+                    on_gpu = has_rendered = false;
+                }
+                followed_view = cam.get().get_view();
+                followed_proj = cam.get().get_proj();
+            } else if(method == 1) {
+                has_rendered = true;
+                denoised = false;
                 ret = true;
                 ray_log.clear();
-                pathtracer.set_params(out_w, out_h, out_samples, out_depth, use_bvh);
-                pathtracer.begin_render(scene, cam.get());
+                pathtracer.set_params(out_w, out_h, out_samples, out_depth, use_bvh,
+                                      adaptive_error, out_rr_depth,
+                                      (PT::BVH_Profile)bvh_profile, (RNG::Sequence)sampler);
+                pathtracer.set_time_limit(time_limit);
+                pathtracer.set_wavefront(use_wavefront);
+                pathtracer.set_deterministic(use_deterministic);
+                pathtracer.set_light_samples(size_t(light_samples));
+                pathtracer.set_guiding(size_t(guide_passes));
+                pathtracer.set_caustics(size_t(caustic_photons), caustic_radius);
+                pathtracer.set_reprojection(use_follow);
+                pathtracer.set_compress_meshes(use_bvh && use_compression);
+                pathtracer.set_preview(use_preview);
+                pathtracer.set_counters(use_counters);
+                pathtracer.set_heatmap((PT::Heatmap)heatmap, heatmap_scale);
+                if(use_region) {
+                    pathtracer.set_region(region[0], region[1], region[2], region[3],
+                                          region_samples);
+                } else {
+                    pathtracer.set_region(0, 0, 0, 0);
+                }
+                pathtracer.build_async(scene);
+                pending_cam = cam.get();
+                followed_view = cam.get().get_view();
+                followed_proj = cam.get().get_proj();
             } else {
-                Renderer::get().save(scene, cam.get(), out_w, out_h, out_samples);
+                Renderer::get().save(scene, cam.get(), out_w, out_h, out_samples, use_materials,
+                                     exposure);
             }
         }
     }
@@ -858,28 +1244,47 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
             }
 
             std::vector<unsigned char> data;
+            bool flip = false;
 
-            if(method == 1) {
-                pathtracer.get_output().tonemap_to(data, exposure);
-                stbi_flip_vertically_on_write(false);
+            if(method == 1 && on_gpu) {
+                gpu.read_output(gpu_image);
+                gpu_image.tonemap_to(data, exposure);
+            } else if(method == 1) {
+                (denoised ? denoised_image : pathtracer.get_output()).tonemap_to(data, exposure);
             } else {
                 Renderer::get().saved(data);
-                stbi_flip_vertically_on_write(true);
+                flip = true;
             }
 
-            if(!stbi_write_png(spath.c_str(), (int)out_w, (int)out_h, 4, data.data(),
-                               (int)out_w * 4)) {
-                err = "Failed to write png!";
-            }
+            err = Png::write(spath, data.data(), out_w, out_h, flip);
             free(path);
         }
     }
 
-    if(method == 1 && has_rendered) {
+    if(method == 1 && has_rendered && !on_gpu && !pending_cam) {
         ImGui::SameLine();
         if(ImGui::Button("Add Samples")) {
             pathtracer.set_samples((int)out_samples);
             pathtracer.begin_render(scene, cam.get(), true);
+            denoised = false;
+        }
+    }
+
+    // The render camera moves with the view while it is being moved (see
+    // Widget_Camera::moving), so following it keeps a render of what is in view
+    if(method == 1 && has_rendered && use_follow && !animating && !pending_cam) {
+        const Camera& c = cam.get();
+        if(c.get_view() != followed_view || c.get_proj() != followed_proj) {
+            followed_view = c.get_view();
+            followed_proj = c.get_proj();
+            if(on_gpu) {
+                gpu.begin_render(c, out_w, out_h, out_samples, out_depth);
+            } else {
+                pathtracer.set_reprojection(true);
+                raster_primary(scene, c);
+                pathtracer.begin_render(scene, c);
+            }
+            denoised = false;
         }
     }
 
@@ -887,13 +1292,55 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
     float w = std::min(avail, (float)out_w);
     float h = (w / out_w) * out_h;
 
-    if(method == 1) {
-        ImGui::Image((ImTextureID)(long long)pathtracer.get_output_texture(exposure).get_id(),
-                     {w, h});
+    if(method == 1 && on_gpu) {
+        const GL::Tex2D& tex = gpu.get_output_texture(exposure);
+        ImGui::Image((ImTextureID)(long long)tex.get_id(), {w, h});
+    } else if(method == 1) {
+        // Once a render finishes, it is denoised (and the result shown) just once
+        if(!use_denoise) denoised = false;
+        // Nothing about the last render is shown while the next one's scene builds
+        bool rendered = has_rendered && !pending_cam;
+        if(use_denoise && rendered && !denoised && !pathtracer.in_progress()) {
+            Aovs aovs;
+            std::string denoise_err = denoise_render(pathtracer, denoised_image, aovs);
+            if(!denoise_err.empty()) err = denoise_err;
+            denoised = denoise_err.empty();
+            use_denoise = denoised;
+        }
+        const GL::Tex2D& tex = denoised ? denoised_image.get_texture(exposure)
+                                        : pathtracer.get_output_texture(exposure);
+        ImGui::Image((ImTextureID)(long long)tex.get_id(), {w, h});
 
-        if(!pathtracer.in_progress() && has_rendered) {
+        if(!pathtracer.in_progress() && rendered) {
             auto [build, render] = pathtracer.completion_time();
-            ImGui::Text("Scene built in %.2fs, rendered in %.2fs.", build, render);
+            ImGui::Text("Scene built in %.2fs, rendered in %.2fs (%.1f spp).", build, render,
+                        pathtracer.achieved_samples());
+        }
+
+        if(rendered && ImGui::CollapsingHeader("BVH Stats")) {
+            auto [scene_stats, mesh_stats] = pathtracer.bvh_stats();
+            bvh_stats_UI("Scene", scene_stats);
+            bvh_stats_UI("Meshes", mesh_stats);
+        }
+
+        PT::BVH_Counters c = pathtracer.counters();
+        if(rendered && c.rays() && ImGui::CollapsingHeader("Ray Stats")) {
+            ImGui::Text("Rays: %llu camera, %llu secondary, %llu shadow",
+                        (unsigned long long)c.camera_rays, (unsigned long long)c.secondary_rays,
+                        (unsigned long long)c.shadow_rays);
+            // Rates are only known once the render has finished
+            if(!pathtracer.in_progress()) {
+                double s = std::max((double)pathtracer.completion_time().second, 1e-9);
+                ImGui::Text("Mrays/s: %.2f total, %.2f camera, %.2f secondary, %.2f shadow",
+                            c.rays() / s / 1e6, c.camera_rays / s / 1e6,
+                            c.secondary_rays / s / 1e6, c.shadow_rays / s / 1e6);
+            }
+            ImGui::Text("Per ray: %.1f nodes visited, %.1f primitives tested",
+                        (double)c.nodes / c.rays(), (double)c.primitives / c.rays());
+            std::vector<float> bounces(c.bounces.begin(), c.bounces.end());
+            while(bounces.size() > 1 && bounces.back() == 0.0f) bounces.pop_back();
+            ImGui::PlotHistogram("Rays by Bounce", bounces.data(), (int)bounces.size(), 0,
+                                 nullptr, 0.0f, FLT_MAX, {0.0f, 40.0f});
         }
     } else {
         ImGui::Image((ImTextureID)(long long)Renderer::get().saved(), {w, h}, {0.0f, 1.0f},
@@ -904,77 +1351,491 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
     return ret;
 }
 
+static void print_progress(float f) {
+    std::cout << "Progress: [";
+
+    int width = std::min(Platform::console_width() - 30, 50);
+    if(width) {
+        int bar = (int)(width * f);
+        for(int i = 0; i < bar; i++) std::cout << "-";
+        for(int i = bar; i < width; i++) std::cout << " ";
+        std::cout << "] ";
+    }
+
+    float percent = 100.0f * f;
+    if(percent < 10.0f) std::cout << "0";
+    std::cout << percent << "%\r";
+    std::cout.flush();
+}
+
+// Path-traced headless renders may be written as linear EXRs, rasterized ones not
+void Widget_Render::raster_primary(Scene& scene, const Camera& cam) {
+    std::vector<float> depth;
+    if(use_raster_primary && !use_wavefront) {
+        Renderer::get().save_depth(scene, cam, out_w, out_h, depth);
+    }
+    pathtracer.set_primary_depth(std::move(depth));
+}
+
+static bool exr_output(const Launch_Settings& set) {
+    const std::string& out = set.output_file;
+    bool named = !set.animate && set.turntable <= 0 && out.size() >= 4 &&
+                 out.compare(out.size() - 4, 4, ".exr") == 0;
+    return !set.raster && (set.exr || named);
+}
+
+static std::string write_image(const HDR_Image& image, const std::string& path, bool exr,
+                               const Launch_Settings& set,
+                               const std::vector<HDR_Image::Layer>& layers = {}) {
+    if(exr) return image.save_exr(path, layers);
+    auto [w, h] = image.dimension();
+    std::vector<unsigned char> data;
+    image.tonemap_to(data, set.exp);
+    return Png::write(path, data.data(), w, h, false, (Png::Compression)set.png_compression);
+}
+
+// The cameras of a stereo pair or turntable around cam, and the files each is written to
+static void view_cameras(const Camera& cam, const Launch_Settings& set, bool exr,
+                         std::vector<Camera>& cams, std::vector<std::string>& paths) {
+
+    Vec3 pos = cam.pos(), center = cam.center();
+    if(set.stereo > 0.0f) {
+        // Each eye keeps the view direction, moved along the camera's right
+        Vec3 right = cam.get_view().inverse().rotate(Vec3{1.0f, 0.0f, 0.0f}).unit();
+        Vec3 half = right * (0.5f * set.stereo);
+        const std::string& out = set.output_file;
+        size_t ext = out.find_last_of('.');
+        size_t slash = out.find_last_of("/\\");
+        if(ext == std::string::npos || (slash != std::string::npos && ext < slash)) {
+            ext = out.size();
+        }
+        const char* eyes[2] = {"_left", "_right"};
+        for(int e = 0; e < 2; e++) {
+            Vec3 shift = e == 0 ? -half : half;
+            cams.push_back(cam);
+            cams.back().look_at(center + shift, pos + shift);
+            paths.push_back(out.substr(0, ext) + eyes[e] + out.substr(ext));
+        }
+    } else {
+        for(int i = 0; i < set.turntable; i++) {
+            Mat4 spin = Mat4::rotate(360.0f * (float)i / (float)set.turntable,
+                                     Vec3{0.0f, 1.0f, 0.0f});
+            cams.push_back(cam);
+            cams.back().look_at(center, center + spin.rotate(pos - center));
+            paths.push_back(frame_path(set.output_file, i, exr ? ".exr" : ".png"));
+        }
+    }
+}
+
+// The animation frames a headless render outputs, in increasing order
+static std::vector<int> output_frames(const Launch_Settings& set, int n_frames) {
+
+    std::vector<int> frames;
+    if(!set.frames.empty()) {
+        for(int f : set.frames) {
+            if(f >= 0 && f < n_frames) {
+                frames.push_back(f);
+            } else {
+                warn("Skipping frame %d, outside the animation's %d frames.", f, n_frames);
+            }
+        }
+        std::sort(frames.begin(), frames.end());
+        frames.erase(std::unique(frames.begin(), frames.end()), frames.end());
+    } else {
+        int end = set.frame_end < 0 ? n_frames - 1 : std::min(set.frame_end, n_frames - 1);
+        for(int f = std::max(set.frame_start, 0); f <= end; f += std::max(set.frame_step, 1)) {
+            frames.push_back(f);
+        }
+    }
+
+    if(set.resume) {
+        std::error_code ec;
+        size_t n = frames.size();
+        frames.erase(std::remove_if(frames.begin(), frames.end(),
+                                    [&](int f) {
+                                        return std::filesystem::exists(
+                                            frame_path(set.output_file, f,
+                                                       exr_output(set) ? ".exr" : ".png"),
+                                            ec);
+                                    }),
+                     frames.end());
+        if(frames.size() < n) info("Resuming: %zu frames already written.", n - frames.size());
+    }
+    return frames;
+}
+
+// Poses the scene at frame, having last posed it at prev (or never, if negative).
+// Emitters only simulate forward one frame at a time, so if there are any, the
+// frames in between are simulated (but not rendered) first.
+static Camera pose_frame(Animate& animate, Scene& scene, int prev, int frame) {
+
+    bool particles = scene.has_sim();
+    for(int f = prev + 1; particles && f < frame; f++) {
+        animate.set_time(scene, (float)f, prev < 0);
+        if(f > 0) animate.step_sim(scene);
+    }
+
+    Camera cam = animate.set_time(scene, (float)frame, prev < 0);
+    if(frame > 0) animate.step_sim(scene);
+    return cam;
+}
+
+std::string Widget_Render::headless_raster(Animate& animate, Scene& scene, const Camera& cam,
+                                           const Launch_Settings& set) {
+
+    info("Render settings:");
+    info("\twidth: %d", set.w);
+    info("\theight: %d", set.h);
+    info("\tmsaa samples: %d", set.msaa);
+    info("\texposure: %f", set.exp);
+
+    out_w = set.w;
+    out_h = set.h;
+    int samples = std::max(set.msaa, 1);
+    Renderer& renderer = Renderer::get();
+    Png::Compression compression = (Png::Compression)set.png_compression;
+
+    auto read = [&](const Camera& frame_cam) {
+        std::vector<unsigned char> data;
+        renderer.save(scene, frame_cam, set.w, set.h, samples, true, set.exp);
+        renderer.saved(data);
+        return data;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    if(set.animate) {
+        std::vector<int> frames = output_frames(set, animate.n_frames());
+        if(frames.empty()) return "No animation frames to output!";
+
+        // Each frame is encoded and written on the pool while the next is posed and
+        // drawn, one at a time so that at most one image waits for it
+        Task_Group writes(parallel_pool());
+        std::string write_err;
+        animate.bake_frames(scene);
+        for(size_t i = 0; i < frames.size(); i++) {
+            Camera frame_cam = pose_frame(animate, scene, i ? frames[i - 1] : -1, frames[i]);
+            std::vector<unsigned char> data = read(frame_cam);
+            writes.wait();
+            if(!write_err.empty()) return write_err;
+            std::string path = frame_path(set.output_file, frames[i]);
+            writes.run(Thread_Pool::Priority::background,
+                       [&, data = std::move(data), path = std::move(path)]() {
+                           write_err = Png::write(path, data.data(), set.w, set.h, true,
+                                                  compression);
+                       });
+            print_progress((float)(i + 1) / frames.size());
+        }
+        writes.wait();
+        std::cout << std::endl;
+        if(!write_err.empty()) return write_err;
+    } else {
+        std::vector<unsigned char> data = read(cam);
+        std::string err = Png::write(set.output_file, data.data(), set.w, set.h, true, compression);
+        if(!err.empty()) return err;
+    }
+
+    std::chrono::duration<float, std::milli> took = std::chrono::steady_clock::now() - start;
+    info("Rasterized in %.1fms", took.count());
+    return {};
+}
+
 std::string Widget_Render::headless(Animate& animate, Scene& scene, const Camera& cam,
                                     const Launch_Settings& set) {
 
+    if(!set.merge.empty()) {
+        HDR_Image image;
+        std::string err = PT::Pathtracer::merge_shards(set.merge, image);
+        if(err.empty()) err = write_image(image, set.output_file, exr_output(set), set);
+        if(!err.empty()) return err;
+        info("Merged %zu shards", set.merge.size());
+        return {};
+    }
+    if(set.raster) return headless_raster(animate, scene, cam, set);
+    if(set.shard_count > 1 && set.animate) {
+        return "Animations split across machines by frames (see --frames), not shards.";
+    }
+    bool exr = exr_output(set);
+    if(set.aovs && !exr) return "AOVs are written as EXR layers, so need EXR output.";
+    if(set.denoise && !PT::can_denoise()) return "This build can't denoise (see SCOTTY3D_OIDN).";
+    if(set.denoise && set.shard_count > 1) return "Shards are only parts of a frame, so can't be denoised.";
+    if(set.poster && (set.animate || set.shard_count > 1 || set.checkpoint > 0.0f || set.resume ||
+                      set.region.size() == 4 || set.aovs || set.denoise)) {
+        return "Posters are written as their tiles finish, so can't be animated, sharded, "
+               "checkpointed, cropped, denoised or given AOVs.";
+    }
+    if(set.out_of_core && (set.no_bvh || !set.compress_meshes || set.bvh_cache.empty())) {
+        return "Out-of-core meshes are paged from compressed files in the BVH cache, so need "
+               "--compress_meshes and --bvh_cache.";
+    }
+    bool multi_view = set.stereo > 0.0f || set.turntable > 0;
+    if(set.stereo > 0.0f && set.turntable > 0) return "Render stereo or a turntable, not both.";
+    if(multi_view && (set.animate || set.shard_count > 1 || set.poster || set.checkpoint > 0.0f ||
+                      set.resume || set.aovs || set.denoise)) {
+        return "Stereo and turntable views render together into separate images, so can't be "
+               "animated, sharded, streamed, checkpointed, denoised or given AOVs.";
+    }
+
     info("Render settings:");
     info("\twidth: %d", set.w);
     info("\theight: %d", set.h);
     info("\tsamples: %d", set.s);
     info("\tmax depth: %d", set.d);
+    if(set.rr > 0) info("\troulette depth: %d", set.rr);
+    if(set.light_samples > 0) {
+        info("\tlight samples: %d (%s heuristic)", set.light_samples,
+             set.balance_heuristic ? "balance" : "power");
+    }
+    if(set.guide > 0) info("\tpath guide training passes: %d", set.guide);
+    if(set.caustic_photons > 0) {
+        info("\tcaustic photons: %d (radius %f)", set.caustic_photons, set.caustic_radius);
+    }
+    info("\ttile size: %d", set.tile);
+    if(set.adaptive > 0.0f) info("\tadaptive sampling error: %f", set.adaptive);
+    if(set.time_limit > 0.0f && !set.deterministic) info("\ttime limit: %fs", set.time_limit);
+    info("\tsampler: %s", RNG::Sequence_Names[set.sampler]);
+    if(set.heatmap) info("\theatmap: %s", PT::Heatmap_Names[set.heatmap]);
     info("\texposure: %f", set.exp);
-    info("\trender threads: %u", std::thread::hardware_concurrency());
+    info("\trender threads: %zu%s", parallel_pool().size(), set.pin_threads ? " (pinned)" : "");
     if(set.no_bvh) info("\tusing object list instead of BVH");
+    if(!set.no_bvh) info("\tBVH profile: %s", PT::BVH_Profile_Names[set.bvh_profile]);
+    if(!set.no_bvh && set.spatial > 0.0f) info("\tspatial split threshold: %g", set.spatial);
+    if(!set.no_bvh && !set.bvh_cache.empty()) info("\tBVH cache: %s", set.bvh_cache.c_str());
+    if(!set.no_bvh && set.compress_meshes) info("\tcompressing meshes");
+    if(set.build_memory > 0) info("\tbuild memory limit: %d MB", set.build_memory);
+    if(set.out_of_core) {
+        if(set.geometry_memory > 0) {
+            info("\tpaging mesh geometry (%d MB resident)", set.geometry_memory);
+        } else {
+            info("\tpaging mesh geometry");
+        }
+    }
+    if(set.wavefront) info("\tusing wavefront integrator");
+    if(set.deterministic) info("\tdeterministic");
+    if(set.denoise) info("\tdenoising");
+    if(set.shard_count > 1) info("\tshard: %d of %d", set.shard_index, set.shard_count);
+    if(set.poster) info("\tstreaming tiles to the output");
+    if(set.stereo > 0.0f) info("\tstereo eye separation: %f", set.stereo);
+    if(set.turntable > 0) info("\tturntable views: %d", set.turntable);
+    if(set.region.size() == 4) {
+        info("\tregion: (%d, %d) to (%d, %d)", set.region[0], set.region[1], set.region[2],
+             set.region[3]);
+    }
+
+    Stats_Json stats;
+    if(!set.stats_json.empty()) {
+        std::string err = stats.open(set.stats_json);
+        if(!err.empty()) return err;
+    }
+    bool profile_pool = set.pool_stats || stats.enabled();
 
     out_w = set.w;
     out_h = set.h;
-    pathtracer.set_params(set.w, set.h, set.s, set.d, !set.no_bvh);
-
-    auto print_progress = [](float f) {
-        std::cout << "Progress: [";
-
-        int width = std::min(Platform::console_width() - 30, 50);
-        if(width) {
-            int bar = (int)(width * f);
-            for(int i = 0; i < bar; i++) std::cout << "-";
-            for(int i = bar; i < width; i++) std::cout << " ";
-            std::cout << "] ";
+    auto configure = [&set, &stats](PT::Pathtracer& pt) {
+        pt.set_params(set.w, set.h, set.s, set.d, !set.no_bvh, set.adaptive,
+                      std::max(set.rr, 0), (PT::BVH_Profile)set.bvh_profile,
+                      (RNG::Sequence)set.sampler);
+        pt.set_tile_size(set.tile);
+        pt.set_time_limit(set.time_limit);
+        pt.set_wavefront(set.wavefront);
+        pt.set_deterministic(set.deterministic);
+        pt.set_light_samples(size_t(std::max(set.light_samples, 0)), !set.balance_heuristic);
+        pt.set_guiding(size_t(std::max(set.guide, 0)));
+        pt.set_caustics(size_t(std::max(set.caustic_photons, 0)),
+                        std::max(set.caustic_radius, 0.0f));
+        if(set.spatial > 0.0f) pt.set_spatial_splits(set.spatial);
+        pt.set_bvh_cache(set.bvh_cache);
+        pt.set_compress_meshes(!set.no_bvh && set.compress_meshes);
+        pt.set_build_memory(size_t(std::max(set.build_memory, 0)) << 20);
+        pt.set_out_of_core(set.out_of_core, size_t(std::max(set.geometry_memory, 0)) << 20);
+        pt.set_counters(set.bvh_stats || stats.enabled());
+        pt.set_heatmap((PT::Heatmap)set.heatmap, set.heatmap_scale);
+        if(set.region.size() == 4) {
+            pt.set_region(set.region[0], set.region[1], set.region[2], set.region[3],
+                          size_t(std::max(set.region_samples, 0)));
+        } else {
+            pt.set_region(0, 0, 0, 0);
         }
-
-        float percent = 100.0f * f;
-        if(percent < 10.0f) std::cout << "0";
-        std::cout << percent << "%\r";
-        std::cout.flush();
     };
+    configure(pathtracer);
+    pathtracer.set_shard(size_t(std::max(set.shard_index, 0)),
+                         size_t(std::max(set.shard_count, 1)));
 
     std::cout << std::fixed << std::setw(2) << std::setprecision(2) << std::setfill('0');
     if(set.animate) {
 
-        method = 1;
-        init = true;
-        animating = true;
-        max_frame = animate.n_frames();
-        next_frame = 0;
-        folder = set.output_file;
-        while(next_frame < max_frame) {
-            std::string err = step(animate, scene);
-            if(!err.empty()) return err;
-            print_progress(((float)next_frame + pathtracer.progress()) / (max_frame + 1));
-            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        // Frames are pipelined: while one Pathtracer renders a frame, the scene is posed
+        // and simulated for the next, which the other Pathtracer builds (its jobs running
+        // ahead of render tiles on the pool), and the previous frame is tonemapped and
+        // written on the pool in the background.
+        PT::Pathtracer spare(*this, Vec2{(float)set.w, (float)set.h});
+        configure(spare);
+        PT::Pathtracer* tracers[2] = {&pathtracer, &spare};
+        Task_Group writes(parallel_pool());
+        std::mutex write_mut;
+        std::string write_err;
+
+        std::vector<int> frames = output_frames(set, animate.n_frames());
+        if(frames.empty()) return "No animation frames to output!";
+        info("\tframes: %zu, %d through %d", frames.size(), frames.front(), frames.back());
+
+        if(profile_pool) parallel_pool().set_profiling(true);
+        animate.bake_frames(scene);
+        Camera frame_cam = pose_frame(animate, scene, -1, frames[0]);
+        for(size_t i = 0; i < frames.size(); i++) {
+
+            PT::Pathtracer& tracer = *tracers[i % 2];
+            tracer.begin_render(scene, frame_cam);
+            if(i + 1 < frames.size()) {
+                frame_cam = pose_frame(animate, scene, frames[i], frames[i + 1]);
+                tracers[(i + 1) % 2]->build(scene);
+            }
+            while(!tracer.wait(std::chrono::milliseconds(250))) {
+                float f = ((float)i + tracer.progress()) / frames.size();
+                print_progress(f);
+                stats.progress(f);
+            }
+            stats.render(tracer, frames[i]);
+
+            // Only one frame is written at a time, so at most one image waits for it
+            writes.wait();
+            {
+                std::lock_guard<std::mutex> lock(write_mut);
+                if(!write_err.empty()) return write_err;
+            }
+            Aovs aovs;
+            HDR_Image image;
+            if(set.denoise) {
+                std::string err = denoise_render(tracer, image, aovs);
+                if(!err.empty()) return err;
+            } else {
+                if(set.aovs) tracer.render_aovs(aovs.albedo, aovs.normal, aovs.depth, aov_samples);
+                image = tracer.get_output().copy();
+            }
+            writes.run(Thread_Pool::Priority::background,
+                       [&, image = std::move(image), aovs = std::move(aovs),
+                        path = frame_path(set.output_file, frames[i], exr ? ".exr" : ".png")]() {
+                           std::vector<HDR_Image::Layer> layers;
+                           if(set.aovs) layers = aovs.layers();
+                           std::string err = write_image(image, path, exr, set, layers);
+                           if(!err.empty()) {
+                               std::lock_guard<std::mutex> lock(write_mut);
+                               write_err = err;
+                           }
+                       });
         }
+        writes.wait();
+        print_progress(1.0f);
         std::cout << std::endl;
+        if(!write_err.empty()) return write_err;
+        const PT::Pathtracer& last = *tracers[(frames.size() - 1) % 2];
+        if(set.memory_stats) log_memory(scene, last);
+        if(profile_pool) {
+            Thread_Pool::Stats pool = parallel_pool().stats();
+            if(set.pool_stats) log_pool_stats(pool);
+            stats.report(last, pool, scene);
+            parallel_pool().set_profiling(false);
+        }
 
     } else {
 
-        pathtracer.begin_render(scene, cam);
-        while(pathtracer.in_progress()) {
+        std::string checkpoint = set.output_file + ".ckpt";
+        std::error_code ec;
+        if(set.resume && std::filesystem::exists(checkpoint, ec)) {
+            std::string err = pathtracer.resume(checkpoint);
+            if(!err.empty()) return err;
+            info("Resuming from %s", checkpoint.c_str());
+        }
+
+        // Posters' tiles go straight to the file; rows wait there only for those above
+        Image_Stream poster;
+        if(set.poster) {
+            std::string err = poster.open(set.output_file, set.w, set.h, exr, set.exp);
+            if(!err.empty()) return err;
+            pathtracer.set_tile_sink([&poster](size_t x, size_t y, size_t w, size_t h,
+                                               const std::vector<Spectrum>& pixels) {
+                poster.add(x, y, w, h, pixels);
+            });
+        }
+
+        std::vector<Camera> cams;
+        std::vector<std::string> paths;
+        if(multi_view) view_cameras(cam, set, exr, cams, paths);
+
+        if(profile_pool) parallel_pool().set_profiling(true);
+        if(multi_view) {
+            pathtracer.begin_render(scene, cams);
+        } else {
+            pathtracer.begin_render(scene, cam);
+        }
+        auto saved = std::chrono::steady_clock::now();
+        while(!pathtracer.wait(std::chrono::milliseconds(250))) {
             print_progress(pathtracer.progress());
-            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+            stats.progress(pathtracer.progress());
+            std::chrono::duration<float> since = std::chrono::steady_clock::now() - saved;
+            if(set.checkpoint > 0.0f && since.count() >= set.checkpoint) {
+                std::string err = pathtracer.save_shard(checkpoint);
+                if(!err.empty()) warn("Failed to save checkpoint: %s", err.c_str());
+                saved = std::chrono::steady_clock::now();
+            }
         }
         std::cout << std::endl;
 
-        std::vector<unsigned char> data;
-        pathtracer.get_output().tonemap_to(data, set.exp);
-        if(!stbi_write_png(set.output_file.c_str(), set.w, set.h, 4, data.data(), set.w * 4)) {
-            return "Failed to write output!";
+        if(set.time_limit > 0.0f && !set.deterministic) {
+            info("Achieved %.1f samples per pixel", pathtracer.achieved_samples());
+        }
+        if(set.bvh_stats) {
+            auto [scene_stats, mesh_stats] = pathtracer.bvh_stats();
+            log_bvh_stats("Scene", scene_stats);
+            log_bvh_stats("Mesh", mesh_stats);
+            log_bvh_counters(pathtracer.counters(), pathtracer.completion_time().second);
+        }
+        if(set.memory_stats) log_memory(scene, pathtracer);
+        if(profile_pool) {
+            Thread_Pool::Stats pool = parallel_pool().stats();
+            if(set.pool_stats) log_pool_stats(pool);
+            stats.render(pathtracer);
+            stats.report(pathtracer, pool, scene);
+            parallel_pool().set_profiling(false);
+        }
+
+        if(set.poster) {
+            pathtracer.set_tile_sink({});
+            std::string err = poster.close();
+            if(!err.empty()) return err;
+        } else if(set.shard_count > 1) {
+            std::string err = pathtracer.save_shard(set.output_file);
+            if(!err.empty()) return err;
+        } else if(multi_view) {
+            for(size_t v = 0; v < paths.size(); v++) {
+                std::string err = write_image(pathtracer.get_output(v), paths[v], exr, set);
+                if(!err.empty()) return err;
+            }
+            info("Wrote %zu views", paths.size());
+        } else {
+            Aovs aovs;
+            HDR_Image denoised;
+            const HDR_Image* image = &pathtracer.get_output();
+            if(set.denoise) {
+                std::string err = denoise_render(pathtracer, denoised, aovs);
+                if(!err.empty()) return err;
+                image = &denoised;
+            } else if(set.aovs) {
+                pathtracer.render_aovs(aovs.albedo, aovs.normal, aovs.depth, aov_samples);
+            }
+            std::vector<HDR_Image::Layer> layers;
+            if(set.aovs) layers = aovs.layers();
+            std::string err = write_image(*image, set.output_file, exr, set, layers);
+            if(!err.empty()) return err;
         }
+        // The checkpoint is of this render, so it is stale once the output is written
+        std::filesystem::remove(checkpoint, ec);
     }
 
     return {};
 }
 
-void Widget_Render::render_log(const Mat4& view) const {
-    std::lock_guard<std::mutex> lock(log_mut);
+void Widget_Render::render_log(const Mat4& view) {
+    ray_log.take_shared();
     Renderer::get().lines(ray_log, view);
 }
 
@@ -89,11 +89,14 @@ public:
                          const Launch_Settings& set);
 
     void log_ray(const Ray& ray, float t, Spectrum color = Spectrum{1.0f});
-    void render_log(const Mat4& view) const;
+    void render_log(const Mat4& view);
 
     PT::Pathtracer& tracer() {
         return pathtracer;
     }
+    const PT::Pathtracer& tracer() const {
+        return pathtracer;
+    }
     bool rendered() const {
         return has_rendered;
     }
@@ -101,26 +104,62 @@ public:
         return pathtracer.completion_time();
     }
     bool in_progress() const {
-        return pathtracer.in_progress() || animating;
+        return pending_cam || pathtracer.in_progress() || gpu.in_progress() || animating;
+    }
+    // Seconds between the frames the render needs: none while it is advanced by them
+    // (on the GPU, or an animation), a few a second to show a CPU render's progress,
+    // and infinite once done
+    float redraw_interval() const {
+        if(gpu.in_progress() || animating) return 0.0f;
+        if(pending_cam || pathtracer.in_progress()) return progress_interval;
+        return INFINITY;
     }
+    static constexpr float progress_interval = 0.1f;
     float wh_ar() const {
         return (float)out_w / (float)out_h;
     }
 
 private:
     void begin(Scene& scene, Widget_Camera& cam, Camera& user_cam);
+    std::string headless_raster(Animate& animate, Scene& scene, const Camera& cam,
+                                const Launch_Settings& set);
+    // Rasterizes the depth the next CPU render starts its camera rays from, if enabled
+    void raster_primary(Scene& scene, const Camera& cam);
 
-    mutable std::mutex log_mut;
+    static constexpr size_t max_logged_rays = 1 << 20;
     GL::Lines ray_log;
 
-    int out_w, out_h, out_samples = 32, out_depth = 8;
-    float exposure = 1.0f;
-    bool use_bvh = true;
+    int out_w, out_h, out_samples = 32, out_depth = 8, out_rr_depth = 0, light_samples = 0;
+    int guide_passes = 0, caustic_photons = 0;
+    float caustic_radius = 0.0f;
+    float exposure = 1.0f, adaptive_error = 0.0f, time_limit = 0.0f;
+    bool use_bvh = true, use_wavefront = false, use_preview = true, use_counters = false;
+    bool use_raster_primary = false;
+    bool use_deterministic = false;
+    bool use_compression = false;
+    bool use_materials = true;
+    bool use_denoise = false;
+    // Restart the render whenever the render camera moves, reprojecting the last one
+    bool use_follow = false;
+    Mat4 followed_view, followed_proj;
+    // Path trace on the GPU instead, if supported; on_gpu if the last render was
+    bool use_gpu = false, on_gpu = false;
+    // Pixels x0 y0 to x1 y1 from the bottom left, which alone are traced if use_region
+    bool use_region = false;
+    int region[4] = {}, region_samples = 0;
 
     bool has_rendered = false;
+    // The camera of a render waiting for its scene to build
+    std::optional<Camera> pending_cam;
+    // The finished render, denoised if use_denoise
+    bool denoised = false;
+    HDR_Image denoised_image;
     bool render_window = false, render_window_focus = false;
 
-    int method = 1;
+    int method = 1, bvh_profile = (int)PT::BVH_Profile::balanced;
+    int sampler = (int)RNG::Sequence::independent;
+    int heatmap = (int)PT::Heatmap::none;
+    float heatmap_scale = 0.0f;
     bool animating = false, init = false;
     int next_frame = 0, max_frame = 0;
 
@@ -129,6 +168,8 @@ private:
 
     GL::MSAA msaa;
     PT::Pathtracer pathtracer;
+    PT::GPU_Tracer gpu;
+    HDR_Image gpu_image;
 };
 
 class Widgets {
@@ -0,0 +1,78 @@
+
+#pragma once
+
+#include <ostream>
+
+#include "mat4.h"
+#include "quat.h"
+#include "vec3.h"
+
+/// A rigid transform (rotation then translation) as a unit dual quaternion. Unlike
+/// matrices, weighted sums of these renormalize to a rigid transform, so blending
+/// them (e.g. in skinning) neither shrinks nor shears.
+struct Dual_Quat {
+
+    Dual_Quat() : real(), dual(0.0f, 0.0f, 0.0f, 0.0f) {
+    }
+    explicit Dual_Quat(Quat real, Quat dual) : real(real), dual(dual) {
+    }
+    /// Rotation by the unit quaternion rot, then translation by trans
+    explicit Dual_Quat(Quat rot, Vec3 trans) : real(rot), dual(Quat(trans, 0.0f) * rot * 0.5f) {
+    }
+
+    Dual_Quat(const Dual_Quat&) = default;
+    Dual_Quat& operator=(const Dual_Quat&) = default;
+    ~Dual_Quat() = default;
+
+    /// Create from a matrix with orthonormal upper 3x3
+    static Dual_Quat from_mat(const Mat4& m) {
+        return Dual_Quat(Quat::from_mat(m), m[3].xyz());
+    }
+
+    Dual_Quat operator+(const Dual_Quat& r) const {
+        return Dual_Quat(real + r.real, dual + r.dual);
+    }
+    Dual_Quat& operator+=(const Dual_Quat& r) {
+        real = real + r.real;
+        dual = dual + r.dual;
+        return *this;
+    }
+    Dual_Quat operator*(float s) const {
+        return Dual_Quat(real * s, dual * s);
+    }
+
+    /// Scale so that the real part is a unit quaternion. A blend of unit dual
+    /// quaternions needs only this to be rigid again.
+    Dual_Quat unit() const {
+        float inv = 1.0f / real.norm();
+        return Dual_Quat(real * inv, dual * inv);
+    }
+
+    Vec3 translation() const {
+        Vec3 r = real.complex(), d = dual.complex();
+        return 2.0f * (real.w * d - dual.w * r + cross(r, d));
+    }
+
+    /// Apply rotation only, e.g. to a normal. Assumes unit().
+    Vec3 rotate(Vec3 v) const {
+        Vec3 r = real.complex();
+        return v + 2.0f * cross(r, cross(r, v) + real.w * v);
+    }
+    /// Apply rotation then translation to a point. Assumes unit().
+    Vec3 transform(Vec3 p) const {
+        return rotate(p) + translation();
+    }
+
+    Mat4 to_mat() const {
+        Mat4 m = real.to_mat();
+        m[3] = Vec4(translation(), 1.0f);
+        return m;
+    }
+
+    Quat real, dual;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const Dual_Quat& q) {
+    out << "Dual_Quat{" << q.real << "," << q.dual << "}";
+    return out;
+}
@@ -0,0 +1,37 @@
+
+#pragma once
+
+#include "bbox.h"
+#include "mat4.h"
+#include "vec4.h"
+
+/// The region a view-projection transform maps into clip space, as six planes
+/// (a,b,c,d) with ax + by + cz + d >= 0 inside each
+struct Frustum {
+
+    explicit Frustum(const Mat4& viewproj) {
+        Vec4 rows[4];
+        for(int i = 0; i < 4; i++) {
+            rows[i] = Vec4(viewproj[0][i], viewproj[1][i], viewproj[2][i], viewproj[3][i]);
+        }
+        for(int i = 0; i < 3; i++) {
+            planes[2 * i] = rows[3] + rows[i];
+            planes[2 * i + 1] = rows[3] - rows[i];
+        }
+    }
+
+    /// Whether any of the box may be inside. Conservative: a box beside a corner of
+    /// the frustum, outside no single plane, still counts.
+    bool intersects(const BBox& box) const {
+        if(box.empty()) return false;
+        for(const Vec4& p : planes) {
+            // The corner furthest along the plane's normal
+            Vec3 v(p.x >= 0.0f ? box.max.x : box.min.x, p.y >= 0.0f ? box.max.y : box.min.y,
+                   p.z >= 0.0f ? box.max.z : box.min.z);
+            if(p.x * v.x + p.y * v.y + p.z * v.z + p.w < 0.0f) return false;
+        }
+        return true;
+    }
+
+    Vec4 planes[6];
+};
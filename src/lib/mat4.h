@@ -135,19 +135,20 @@ struct Mat4 {
     }
     Mat4 operator*(const Mat4& m) const {
         Mat4 ret;
-        for(int i = 0; i < 4; i++) {
-            for(int j = 0; j < 4; j++) {
-                ret[i][j] = 0.0f;
-                for(int k = 0; k < 4; k++) {
-                    ret[i][j] += m[i][k] * cols[k][j];
-                }
-            }
-        }
+        for(int i = 0; i < 4; i++) ret.cols[i] = operator*(m.cols[i]);
         return ret;
     }
 
     Vec4 operator*(Vec4 v) const {
+#ifdef SCOTTY3D_SIMD
+        using namespace SIMD;
+        f4 r = mul(splat(v.x), cols[0].simd());
+        r = add(r, mul(splat(v.y), cols[1].simd()));
+        r = add(r, mul(splat(v.z), cols[2].simd()));
+        return Vec4(add(r, mul(splat(v.w), cols[3].simd())));
+#else
         return v[0] * cols[0] + v[1] * cols[1] + v[2] * cols[2] + v[3] * cols[3];
+#endif
     }
 
     /// Expands v to Vec4(v, 1.0), multiplies, and projects back to 3D
@@ -297,6 +298,33 @@ inline Mat4 Mat4::transpose(const Mat4& m) {
 }
 
 inline Mat4 Mat4::inverse(const Mat4& m) {
+#ifdef SCOTTY3D_SIMD
+    // Cross product form of the cofactor expansion: with a, b, c, d the upper three
+    // rows of each column and x, y, z, w the bottom row, each row of the inverse is
+    // a cross product plus a scaled one (Lengyel, Foundations of Game Engine Development).
+    using namespace SIMD;
+    f4 a = m.cols[0].simd(), b = m.cols[1].simd(), c = m.cols[2].simd(), d = m.cols[3].simd();
+    float x = m[0][3], y = m[1][3], z = m[2][3], w = m[3][3];
+
+    f4 s = cross(a, b), t = cross(c, d);
+    f4 u = sub(mul(splat(y), a), mul(splat(x), b));
+    f4 v = sub(mul(splat(w), c), mul(splat(z), d));
+    f4 inv_det = splat(1.0f / (dot3(s, v) + dot3(t, u)));
+    s = mul(s, inv_det);
+    t = mul(t, inv_det);
+    u = mul(u, inv_det);
+    v = mul(v, inv_det);
+
+    Vec4 r0(add(cross(b, v), mul(splat(y), t)));
+    Vec4 r1(sub(cross(v, a), mul(splat(x), t)));
+    Vec4 r2(add(cross(d, u), mul(splat(w), s)));
+    Vec4 r3(sub(cross(u, c), mul(splat(z), s)));
+    r0.w = -dot3(b, t);
+    r1.w = dot3(a, t);
+    r2.w = -dot3(d, s);
+    r3.w = dot3(c, s);
+    return Mat4{r0, r1, r2, r3}.T();
+#else
     Mat4 r;
     r[0][0] = m[1][2] * m[2][3] * m[3][1] - m[1][3] * m[2][2] * m[3][1] +
               m[1][3] * m[2][1] * m[3][2] - m[1][1] * m[2][3] * m[3][2] -
@@ -348,6 +376,7 @@ inline Mat4 Mat4::inverse(const Mat4& m) {
               m[0][1] * m[1][0] * m[2][2] + m[0][0] * m[1][1] * m[2][2];
     r /= m.det();
     return r;
+#endif
 }
 
 inline Mat4 Mat4::rotate_to(Vec3 dir) {
@@ -52,4 +52,6 @@ inline float smoothstep(float e0, float e1, float x) {
 #include "bbox.h"
 #include "mat4.h"
 #include "quat.h"
+#include "dual_quat.h"
+#include "frustum.h"
 #include "ray.h"
@@ -52,6 +52,29 @@ struct Quat {
         return Quat(x, y, z, w).unit();
     }
 
+    /// Create unit quaternion representing the rotation part of the given matrix,
+    /// which must be orthonormal in its upper 3x3
+    static Quat from_mat(const Mat4& m) {
+        // m[c][r] is row r of column c
+        float tr = m[0][0] + m[1][1] + m[2][2];
+        if(tr > 0.0f) {
+            float s = std::sqrt(tr + 1.0f) * 2.0f;
+            return Quat((m[1][2] - m[2][1]) / s, (m[2][0] - m[0][2]) / s,
+                        (m[0][1] - m[1][0]) / s, 0.25f * s);
+        } else if(m[0][0] > m[1][1] && m[0][0] > m[2][2]) {
+            float s = std::sqrt(1.0f + m[0][0] - m[1][1] - m[2][2]) * 2.0f;
+            return Quat(0.25f * s, (m[1][0] + m[0][1]) / s, (m[2][0] + m[0][2]) / s,
+                        (m[1][2] - m[2][1]) / s);
+        } else if(m[1][1] > m[2][2]) {
+            float s = std::sqrt(1.0f + m[1][1] - m[0][0] - m[2][2]) * 2.0f;
+            return Quat((m[1][0] + m[0][1]) / s, 0.25f * s, (m[2][1] + m[1][2]) / s,
+                        (m[2][0] - m[0][2]) / s);
+        }
+        float s = std::sqrt(1.0f + m[2][2] - m[0][0] - m[1][1]) * 2.0f;
+        return Quat((m[2][0] + m[0][2]) / s, (m[2][1] + m[1][2]) / s, 0.25f * s,
+                    (m[0][1] - m[1][0]) / s);
+    }
+
     /// Create unit quaternion representing given euler angles (XYZ)
     static Quat euler(Vec3 angles) {
         if(angles == Vec3{0.0f, 0.0f, 180.0f} || angles == Vec3{180.0f, 0.0f, 0.0f})
@@ -15,7 +15,8 @@ struct Ray {
     /// Create Ray from point and direction
     explicit Ray(Vec3 point, Vec3 dir,
                  Vec2 dist_bounds = Vec2{0.0f, std::numeric_limits<float>::max()}, size_t depth = 0)
-        : point(point), dir(dir.unit()), dist_bounds(dist_bounds), depth(depth) {
+        : point(point), dist_bounds(dist_bounds), depth(depth) {
+        set_dir(dir.unit());
     }
 
     Ray(const Ray&) = default;
@@ -33,17 +34,32 @@ struct Ray {
         dir = trans.rotate(dir);
         float d = dir.norm();
         dist_bounds *= d;
-        dir /= d;
+        set_dir(dir / d);
+    }
+
+    /// Set the direction, updating the reciprocal and signs that bounding box tests use
+    void set_dir(Vec3 d) {
+        dir = d;
+        inv_dir = 1.0f / d;
+        for(int a = 0; a < 3; a++) neg[a] = inv_dir[a] < 0.0f;
     }
 
     /// The origin or starting point of this ray
     Vec3 point;
-    /// The direction the ray travels in
+    /// The direction the ray travels in (change with set_dir)
     Vec3 dir;
+    /// Component-wise reciprocal of dir, and which of its components are negative
+    Vec3 inv_dir;
+    bool neg[3] = {};
     /// Total attenuation new light will be scaled by to get to the source of this ray
     Spectrum throughput = Spectrum(1.0f);
     /// Recursive depth of ray
     size_t depth = 0;
+    /// Solid angle of the cone of directions this ray stands for (0 for just its own)
+    float spread = 0.0f;
+    /// Whether the path has passed only specular surfaces since its last diffuse one,
+    /// so that light this ray finds is a caustic there
+    bool caustic = false;
 
     /// The minimum and maximum distance at which this ray can encounter collisions
     /// note that this field is mutable, meaning it can be changed on const Rays
@@ -0,0 +1,123 @@
+#pragma once
+
+// Optional SIMD backing for Vec4 and Mat4, enabled by building with SCOTTY3D_SIMD_MATH
+// (see CMakeLists.txt). Without it, or on a target with neither SSE nor AArch64 NEON,
+// the math library stays scalar; the API is the same either way.
+
+#ifdef SCOTTY3D_SIMD_MATH
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define SCOTTY3D_SIMD_SSE
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define SCOTTY3D_SIMD_NEON
+#endif
+#endif
+
+#if defined(SCOTTY3D_SIMD_SSE) || defined(SCOTTY3D_SIMD_NEON)
+#define SCOTTY3D_SIMD
+
+namespace SIMD {
+
+#ifdef SCOTTY3D_SIMD_SSE
+
+using f4 = __m128;
+
+inline f4 load(const float* p) {
+    return _mm_loadu_ps(p);
+}
+inline void store(float* p, f4 v) {
+    _mm_storeu_ps(p, v);
+}
+inline f4 splat(float s) {
+    return _mm_set1_ps(s);
+}
+inline f4 add(f4 l, f4 r) {
+    return _mm_add_ps(l, r);
+}
+inline f4 sub(f4 l, f4 r) {
+    return _mm_sub_ps(l, r);
+}
+inline f4 mul(f4 l, f4 r) {
+    return _mm_mul_ps(l, r);
+}
+inline f4 div(f4 l, f4 r) {
+    return _mm_div_ps(l, r);
+}
+// Lane-wise std::min(l, r) and std::max(l, r), including which side is kept for NaNs
+inline f4 min(f4 l, f4 r) {
+    return _mm_min_ps(r, l);
+}
+inline f4 max(f4 l, f4 r) {
+    return _mm_max_ps(r, l);
+}
+template<int i, int j, int k, int l> inline f4 shuffle(f4 v) {
+    return _mm_shuffle_ps(v, v, _MM_SHUFFLE(l, k, j, i));
+}
+inline float first(f4 v) {
+    return _mm_cvtss_f32(v);
+}
+
+#else
+
+using f4 = float32x4_t;
+
+inline f4 load(const float* p) {
+    return vld1q_f32(p);
+}
+inline void store(float* p, f4 v) {
+    vst1q_f32(p, v);
+}
+inline f4 splat(float s) {
+    return vdupq_n_f32(s);
+}
+inline f4 add(f4 l, f4 r) {
+    return vaddq_f32(l, r);
+}
+inline f4 sub(f4 l, f4 r) {
+    return vsubq_f32(l, r);
+}
+inline f4 mul(f4 l, f4 r) {
+    return vmulq_f32(l, r);
+}
+inline f4 div(f4 l, f4 r) {
+    return vdivq_f32(l, r);
+}
+// vminq/vmaxq propagate NaNs, so select as std::min(l, r) and std::max(l, r) would
+inline f4 min(f4 l, f4 r) {
+    return vbslq_f32(vcltq_f32(r, l), r, l);
+}
+inline f4 max(f4 l, f4 r) {
+    return vbslq_f32(vcltq_f32(l, r), r, l);
+}
+template<int i, int j, int k, int l> inline f4 shuffle(f4 v) {
+    f4 ret = vdupq_n_f32(vgetq_lane_f32(v, i));
+    ret = vsetq_lane_f32(vgetq_lane_f32(v, j), ret, 1);
+    ret = vsetq_lane_f32(vgetq_lane_f32(v, k), ret, 2);
+    return vsetq_lane_f32(vgetq_lane_f32(v, l), ret, 3);
+}
+inline float first(f4 v) {
+    return vgetq_lane_f32(v, 0);
+}
+
+#endif
+
+// Summed in the same order as the scalar dot(), so both builds agree exactly
+inline float dot(f4 l, f4 r) {
+    f4 m = mul(l, r);
+    return first(m) + first(shuffle<1, 1, 1, 1>(m)) + first(shuffle<2, 2, 2, 2>(m)) +
+           first(shuffle<3, 3, 3, 3>(m));
+}
+inline float dot3(f4 l, f4 r) {
+    f4 m = mul(l, r);
+    return first(m) + first(shuffle<1, 1, 1, 1>(m)) + first(shuffle<2, 2, 2, 2>(m));
+}
+// Cross product of the first three lanes; the last is zero for finite inputs
+inline f4 cross(f4 l, f4 r) {
+    return sub(mul(shuffle<1, 2, 0, 3>(l), shuffle<2, 0, 1, 3>(r)),
+               mul(shuffle<2, 0, 1, 3>(l), shuffle<1, 2, 0, 3>(r)));
+}
+
+} // namespace SIMD
+
+#endif
@@ -6,6 +6,7 @@
 #include <ostream>
 
 #include "log.h"
+#include "simd.h"
 #include "vec3.h"
 
 struct Vec4 {
@@ -37,6 +38,14 @@ struct Vec4 {
         z = xyz.z;
         w = _w;
     }
+#ifdef SCOTTY3D_SIMD
+    explicit Vec4(SIMD::f4 v) {
+        SIMD::store(data, v);
+    }
+    SIMD::f4 simd() const {
+        return SIMD::load(data);
+    }
+#endif
 
     Vec4(const Vec4&) = default;
     Vec4& operator=(const Vec4&) = default;
@@ -52,87 +61,95 @@ struct Vec4 {
     }
 
     Vec4 operator+=(Vec4 v) {
-        x += v.x;
-        y += v.y;
-        z += v.z;
-        w += v.w;
+        *this = *this + v;
         return *this;
     }
     Vec4 operator-=(Vec4 v) {
-        x -= v.x;
-        y -= v.y;
-        z -= v.z;
-        w -= v.w;
+        *this = *this - v;
         return *this;
     }
     Vec4 operator*=(Vec4 v) {
-        x *= v.x;
-        y *= v.y;
-        z *= v.z;
-        w *= v.w;
+        *this = *this * v;
         return *this;
     }
     Vec4 operator/=(Vec4 v) {
-        x /= v.x;
-        y /= v.y;
-        z /= v.z;
-        w /= v.w;
+        *this = *this / v;
         return *this;
     }
 
     Vec4 operator+=(float s) {
-        x += s;
-        y += s;
-        z += s;
-        w += s;
+        *this = *this + s;
         return *this;
     }
     Vec4 operator-=(float s) {
-        x -= s;
-        y -= s;
-        z -= s;
-        w -= s;
+        *this = *this - s;
         return *this;
     }
     Vec4 operator*=(float s) {
-        x *= s;
-        y *= s;
-        z *= s;
-        w *= s;
+        *this = *this * s;
         return *this;
     }
     Vec4 operator/=(float s) {
-        x /= s;
-        y /= s;
-        z /= s;
-        w /= s;
+        *this = *this / s;
         return *this;
     }
 
     Vec4 operator+(Vec4 v) const {
+#ifdef SCOTTY3D_SIMD
+        return Vec4(SIMD::add(simd(), v.simd()));
+#else
         return Vec4(x + v.x, y + v.y, z + v.z, w + v.w);
+#endif
     }
     Vec4 operator-(Vec4 v) const {
+#ifdef SCOTTY3D_SIMD
+        return Vec4(SIMD::sub(simd(), v.simd()));
+#else
         return Vec4(x - v.x, y - v.y, z - v.z, w - v.w);
+#endif
     }
     Vec4 operator*(Vec4 v) const {
+#ifdef SCOTTY3D_SIMD
+        return Vec4(SIMD::mul(simd(), v.simd()));
+#else
         return Vec4(x * v.x, y * v.y, z * v.z, w * v.w);
+#endif
     }
     Vec4 operator/(Vec4 v) const {
+#ifdef SCOTTY3D_SIMD
+        return Vec4(SIMD::div(simd(), v.simd()));
+#else
         return Vec4(x / v.x, y / v.y, z / v.z, w / v.w);
+#endif
     }
 
     Vec4 operator+(float s) const {
+#ifdef SCOTTY3D_SIMD
+        return Vec4(SIMD::add(simd(), SIMD::splat(s)));
+#else
         return Vec4(x + s, y + s, z + s, w + s);
+#endif
     }
     Vec4 operator-(float s) const {
+#ifdef SCOTTY3D_SIMD
+        return Vec4(SIMD::sub(simd(), SIMD::splat(s)));
+#else
         return Vec4(x - s, y - s, z - s, w - s);
+#endif
     }
     Vec4 operator*(float s) const {
+#ifdef SCOTTY3D_SIMD
+        return Vec4(SIMD::mul(simd(), SIMD::splat(s)));
+#else
         return Vec4(x * s, y * s, z * s, w * s);
+#endif
     }
     Vec4 operator/(float s) const {
+#ifdef SCOTTY3D_SIMD
+        return Vec4(SIMD::div(simd(), SIMD::splat(s)));
+#else
         return Vec4(x / s, y / s, z / s, w / s);
+#endif
     }
 
     bool operator==(Vec4 v) const {
@@ -198,30 +215,58 @@ struct Vec4 {
 };
 
 inline Vec4 operator+(float s, Vec4 v) {
+#ifdef SCOTTY3D_SIMD
+    return Vec4(SIMD::add(v.simd(), SIMD::splat(s)));
+#else
     return Vec4(v.x + s, v.y + s, v.z + s, v.w + s);
+#endif
 }
 inline Vec4 operator-(float s, Vec4 v) {
+#ifdef SCOTTY3D_SIMD
+    return Vec4(SIMD::sub(v.simd(), SIMD::splat(s)));
+#else
     return Vec4(v.x - s, v.y - s, v.z - s, v.w - s);
+#endif
 }
 inline Vec4 operator*(float s, Vec4 v) {
+#ifdef SCOTTY3D_SIMD
+    return Vec4(SIMD::mul(v.simd(), SIMD::splat(s)));
+#else
     return Vec4(v.x * s, v.y * s, v.z * s, v.w * s);
+#endif
 }
 inline Vec4 operator/(float s, Vec4 v) {
+#ifdef SCOTTY3D_SIMD
+    return Vec4(SIMD::div(SIMD::splat(s), v.simd()));
+#else
     return Vec4(s / v.x, s / v.y, s / v.z, s / v.w);
+#endif
 }
 
 /// Take minimum of each component
 inline Vec4 hmin(Vec4 l, Vec4 r) {
+#ifdef SCOTTY3D_SIMD
+    return Vec4(SIMD::min(l.simd(), r.simd()));
+#else
     return Vec4(std::min(l.x, r.x), std::min(l.y, r.y), std::min(l.z, r.z), std::min(l.w, r.w));
+#endif
 }
 /// Take maximum of each component
 inline Vec4 hmax(Vec4 l, Vec4 r) {
+#ifdef SCOTTY3D_SIMD
+    return Vec4(SIMD::max(l.simd(), r.simd()));
+#else
     return Vec4(std::max(l.x, r.x), std::max(l.y, r.y), std::max(l.z, r.z), std::max(l.w, r.w));
+#endif
 }
 
 /// 4D dot product
 inline float dot(Vec4 l, Vec4 r) {
+#ifdef SCOTTY3D_SIMD
+    return SIMD::dot(l.simd(), r.simd());
+#else
     return l.x * r.x + l.y * r.y + l.z * r.z + l.w * r.w;
+#endif
 }
 
 inline std::ostream& operator<<(std::ostream& out, Vec4 v) {
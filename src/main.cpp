@@ -1,37 +1,317 @@
 
 #include "platform/platform.h"
+#include "scene/bench_scenes.h"
+#include "util/line_server.h"
+#include "util/parallel.h"
+#include "util/profiler.h"
 #include "util/rand.h"
+#include <fstream>
 #include <sf_libs/CLI11.hpp>
 
-int main(int argc, char** argv) {
-
-    RNG::seed();
-
-    Launch_Settings set;
-    CLI::App args{"Scotty3D - 15-462"};
+static void add_options(CLI::App& args, Launch_Settings& set) {
 
     args.add_option("-s,--scene", set.scene_file, "Scene file to load");
     args.add_option("--env_map", set.env_map_file, "Override scene environment map");
     args.add_flag("--headless", set.headless, "Path-trace scene without opening the GUI");
+    args.add_option("--batch", set.batch,
+                    "Render each line of this file, a command line of options for one job, "
+                    "reusing scenes, environment maps and BVHs across jobs (implies headless)");
+    args.add_option("--serve", set.serve,
+                    "Take render jobs and scene edits, one per line, over TCP on this port of "
+                    "localhost, keeping the scene loaded between them (implies headless)");
+    args.add_flag("--benchmark", set.benchmark,
+                  "Render the built-in benchmark scenes with fixed seeds, then report build "
+                  "time, render time and Msamples/s for each (implies headless)");
+    args.add_option("--benchmark_scenes", set.benchmark_scenes,
+                    "Only render these benchmark scenes (with --benchmark)")
+        ->check(CLI::IsMember(Bench_Scenes::names()));
+    args.add_option("--camera", set.camera,
+                    "Camera position x y z and look-at point x y z, overriding the scene's "
+                    "(if headless, not animating)")
+        ->expected(6);
+    args.add_option("--fov", set.fov,
+                    "Vertical field of view in degrees, overriding the scene's (if headless)")
+        ->check(CLI::PositiveNumber);
+    args.add_option("--stereo", set.stereo,
+                    "Render left and right eyes this far apart, to the output path with _left "
+                    "and _right before its extension (if headless, not animating)")
+        ->check(CLI::PositiveNumber);
+    args.add_option("--turntable", set.turntable,
+                    "Render this many views orbiting the look-at point, numbered like frames "
+                    "in the output folder (if headless, not animating)")
+        ->check(CLI::PositiveNumber);
+    args.add_flag("--raster", set.raster,
+                  "Rasterize instead of path tracing, with materials previewed (if headless)");
+    args.add_option("--msaa", set.msaa, "Multisample count when rasterizing (if headless)");
     args.add_option("-o,--output", set.output_file, "Image file to write (if headless)");
     args.add_flag("--animate", set.animate, "Output animation frames (if headless)");
+    args.add_flag("--exr", set.exr,
+                  "Write linear EXR images, as for an output ending in .exr (if path tracing)");
+    args.add_flag("--aovs", set.aovs,
+                  "Add albedo, normal and depth layers to EXR output (if path tracing)");
+    args.add_option("--png_compression", set.png_compression,
+                    "PNG compression: none, fast (in parallel) or best (if headless)")
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, int>{{"none", 0}, {"fast", 1}, {"best", 2}}));
+    args.add_flag("--denoise", set.denoise,
+                  "Denoise output with Open Image Denoise, if built with it (if path tracing)");
+    args.add_option("--frame_start", set.frame_start, "First frame to output (if animating)")
+        ->check(CLI::NonNegativeNumber);
+    args.add_option("--frame_end", set.frame_end,
+                    "Last frame to output, -1 for the end of the animation (if animating)");
+    args.add_option("--frame_step", set.frame_step, "Output every Nth frame (if animating)")
+        ->check(CLI::PositiveNumber);
+    args.add_option("--frames", set.frames,
+                    "Comma-separated frames to output, overriding the range (if animating)")
+        ->delimiter(',')
+        ->check(CLI::NonNegativeNumber);
+    args.add_option("--region", set.region,
+                    "Trace only pixels x0 y0 to x1 y1, exclusive, from the bottom left "
+                    "(if headless)")
+        ->expected(4)
+        ->check(CLI::NonNegativeNumber);
+    args.add_option("--region_samples", set.region_samples,
+                    "Pixel samples in the region, if not --samples (if headless)")
+        ->check(CLI::NonNegativeNumber);
+    args.add_option("--shard_index", set.shard_index,
+                    "Which of the shard_count parts of the frame to render (if headless)")
+        ->check(CLI::NonNegativeNumber);
+    args.add_option("--shard_count", set.shard_count,
+                    "Split the frame's tiles into this many parts, rendering one to a shard "
+                    "file at the output path (if headless)")
+        ->check(CLI::PositiveNumber);
+    args.add_option("--merge", set.merge,
+                    "Assemble these shard files into the output image (if headless)");
+    args.add_option("--checkpoint", set.checkpoint,
+                    "Save progress every this many seconds to the output path plus .ckpt "
+                    "(if headless)");
+    args.add_flag("--resume", set.resume,
+                  "Continue from the output's checkpoint, or skip animation frames already "
+                  "written (if headless)");
+    args.add_flag("--poster", set.poster,
+                  "Stream finished tiles to the output file instead of holding the whole "
+                  "image, for outputs too large for memory (if headless)");
     args.add_flag("--no_bvh", set.no_bvh, "Don't use BVH (if headless)");
+    args.add_flag("--wavefront", set.wavefront, "Use the wavefront integrator (if headless)");
+    args.add_flag("--bvh_stats", set.bvh_stats,
+                  "Print BVH statistics, rays traced by type and bounce, and Mrays/s "
+                  "(if headless)");
+    args.add_flag("--memory_stats", set.memory_stats,
+                  "Print memory held by the scene and the render, by structure (if headless)");
+    args.add_flag("--compress_meshes", set.compress_meshes,
+                  "Store meshes quantized to save memory, at some cost in speed (if headless)");
+    args.add_flag("--deterministic", set.deterministic,
+                  "Render identical bytes on every run, ignoring --time_limit (if headless)");
+    args.add_option("--threads", set.threads, "Worker threads, 0 for one per hardware thread");
+    args.add_flag("--pin_threads", set.pin_threads,
+                  "Pin each worker thread to one hardware thread");
+    args.add_flag("--pool_stats", set.pool_stats,
+                  "Print thread pool utilization and queueing statistics (if headless)");
+    args.add_option("--stats_json", set.stats_json,
+                    "Write progress events and a final report to this file as JSON Lines "
+                    "(if headless)");
+    args.add_option("--profile", set.profile,
+                    "Record profiler zones and write them to this file as a Chrome trace on "
+                    "exit (if headless)");
     args.add_option("--width", set.w, "Output image width (if headless)");
     args.add_option("--height", set.h, "Output image height (if headless)");
     args.add_flag("--use_ar", set.w_from_ar,
                   "Compute output image width based on camera AR (if headless)");
     args.add_option("--depth", set.d, "Maximum ray depth (if headless)");
+    args.add_option("--rr_depth", set.rr,
+                    "Bounces before Russian roulette may end a path, 0 to disable (if headless)");
     args.add_option("--samples", set.s, "Pixel samples (if headless)");
+    args.add_option("--light_samples", set.light_samples,
+                    "Light and BSDF sample pairs per hit combined with MIS, 0 for one mixture "
+                    "sample (if headless)");
+    args.add_option("--guide", set.guide,
+                    "Train a path guide for indirect bounces with this many passes, 0 to "
+                    "disable (if headless)");
+    args.add_option("--caustic_photons", set.caustic_photons,
+                    "Photons traced for caustics through mirrors and glass, 0 to disable (if "
+                    "headless)");
+    args.add_option("--caustic_radius", set.caustic_radius,
+                    "Search radius of caustic photons, 0 to fit it to the scene (if headless)");
+    args.add_flag("--balance_heuristic", set.balance_heuristic,
+                  "Weight light samples by the balance rather than power heuristic (if headless)");
+    args.add_option("--tile_size", set.tile, "Render tile size in pixels (if headless)");
+    args.add_option("--adaptive", set.adaptive,
+                    "Adaptive sampling target relative error, 0 to disable (if headless)");
     args.add_option("--exposure", set.exp, "Output exposure (if headless)");
+    args.add_option("--time_limit", set.time_limit,
+                    "Render for this many seconds, with --samples as an upper bound (if headless)");
+    args.add_option("--scene_cache", set.scene_cache,
+                    "Existing directory to keep binary copies of imported scenes in, so that "
+                    "reopening them is fast");
+    args.add_option("--shader_cache", set.shader_cache,
+                    "Existing directory to keep compiled shader programs in, so that later "
+                    "launches start faster");
+    args.add_option("--bvh_cache", set.bvh_cache,
+                    "Existing directory to save built BVHs to and load them from (if headless)");
+    args.add_option("--spatial_splits", set.spatial,
+                    "Spatial split BVH overlap threshold, e.g. 1e-5 (if headless)");
+    args.add_option("--build_memory", set.build_memory,
+                    "Approximate cap in MB on memory used by concurrent BVH builds (if headless)");
+    args.add_flag("--out_of_core", set.out_of_core,
+                  "Page compressed mesh geometry from files in --bvh_cache as rays reach it, "
+                  "for scenes larger than memory (if headless)");
+    args.add_option("--geometry_memory", set.geometry_memory,
+                    "Approximate cap in MB on paged mesh geometry kept in memory (if headless)");
+    args.add_option("--undo_memory", set.undo_memory,
+                    "Approximate cap in MB on memory held by undo history, 0 for no limit");
+    args.add_flag("--undo_spill", set.undo_spill,
+                  "Write the oldest undo history to a temporary file instead of forgetting it");
+    args.add_option("--bvh_profile", set.bvh_profile,
+                    "BVH build profile: fast-build, balanced or best-trace (if headless)")
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, int>{{"fast-build", 0}, {"balanced", 1}, {"best-trace", 2}}));
 
-    CLI11_PARSE(args, argc, argv);
+    args.add_option("--heatmap", set.heatmap,
+                    "Render traversal cost instead of radiance: nodes, primitives or time "
+                    "(if headless)")
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, int>{{"nodes", 1}, {"primitives", 2}, {"time", 3}}));
+    args.add_option("--heatmap_scale", set.heatmap_scale,
+                    "Nodes, primitives or microseconds per sample shown as the hottest color "
+                    "(with --heatmap)");
+
+    args.add_option("--sampler", set.sampler,
+                    "Pixel sample sequence: independent or sobol (if headless)")
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, int>{{"independent", 0}, {"sobol", 1}}));
+}
+
+// Each job starts from the launch settings, so that options common to every job can
+// be given on the command line
+static std::string parse_job(const Launch_Settings& base, const std::string& line,
+                             Launch_Settings& job) {
+    job = base;
+    job.batch.clear();
+    job.serve = 0;
+    CLI::App args;
+    add_options(args, job);
+    try {
+        args.parse(line);
+    } catch(const CLI::ParseError& e) {
+        return e.what();
+    }
+    if(!job.batch.empty()) return "nested batch.";
+    if(job.serve > 0) return "server in a job.";
+    if(job.benchmark) return "benchmark in a job.";
+    job.headless = true;
+    return {};
+}
+
+static std::string read_jobs(const Launch_Settings& base, std::vector<Launch_Settings>& jobs) {
+
+    std::ifstream file(base.batch);
+    if(!file) return "Could not open " + base.batch + ".";
+
+    std::string line;
+    for(size_t n = 1; std::getline(file, line); n++) {
+        if(!line.empty() && line.back() == '\r') line.pop_back();
+        size_t first = line.find_first_not_of(" \t");
+        if(first == std::string::npos || line[first] == '#') continue;
 
-    if(!set.headless) {
+        Launch_Settings job;
+        std::string err = parse_job(base, line, job);
+        if(!err.empty()) return base.batch + ":" + std::to_string(n) + ": " + err;
+        jobs.push_back(std::move(job));
+    }
+    return {};
+}
+
+// Runs whichever mode the settings ask for, returning the exit code
+static int run(Launch_Settings& set) {
+
+    if(!set.batch.empty()) {
+        std::vector<Launch_Settings> jobs;
+        std::string err = read_jobs(set, jobs);
+        if(!err.empty()) {
+            warn("Error reading jobs: %s", err.c_str());
+            return 1;
+        }
+        std::unique_ptr<Headless_GL> gl;
+        if(std::any_of(jobs.begin(), jobs.end(), [](const auto& job) { return job.raster; })) {
+            gl = std::make_unique<Headless_GL>();
+            if(!gl->ok()) return 1;
+        }
+        set.headless = true;
+        App app(set);
+        return app.batch(jobs) ? 0 : 1;
+    } else if(set.serve > 0) {
+        Line_Server server;
+        std::string err = server.listen(set.serve);
+        if(!err.empty()) {
+            warn("Error starting server: %s", err.c_str());
+            return 1;
+        }
+        info("Serving on port %d", set.serve);
+        set.headless = true;
+        // Raster jobs need a GL context, made once the first arrives
+        std::unique_ptr<Headless_GL> gl;
+        App app(set);
+        bool quit = app.serve(set, server, [&](const std::string& line, Launch_Settings& job) {
+            std::string parse_err = parse_job(set, line, job);
+            if(parse_err.empty() && job.raster && !gl) {
+                gl = std::make_unique<Headless_GL>();
+                if(!gl->ok()) {
+                    gl.reset();
+                    parse_err = "Could not create a GL context.";
+                }
+            }
+            return parse_err;
+        });
+        return quit ? 0 : 1;
+    } else if(set.benchmark) {
+        set.headless = true;
+        App app(set);
+        return app.benchmark(set) ? 0 : 1;
+    } else if(!set.headless) {
         Platform plt;
         App app(set, &plt);
         plt.loop(app);
+    } else if(set.raster) {
+        Headless_GL gl;
+        if(!gl.ok()) return 1;
+        App app(set);
     } else {
         App app(set);
     }
     return 0;
 }
+
+int main(int argc, char** argv) {
+
+    RNG::seed();
+    Profiler::set_thread_name("Main");
+
+    Launch_Settings set;
+    CLI::App args{"Scotty3D - 15-462"};
+
+    add_options(args, set);
+
+    CLI11_PARSE(args, argc, argv);
+
+    configure_parallel_pool((size_t)std::max(set.threads, 0), set.pin_threads);
+    GL::set_shader_cache(set.shader_cache);
+
+    // Simulation draws from the main thread's generator
+    if(set.deterministic) RNG::seed(uint64_t(0));
+
+    // In the GUI, the profiler window controls recording instead
+    bool profile = !set.profile.empty() && (set.headless || !set.batch.empty() || set.benchmark);
+    if(profile) Profiler::enable(true);
+
+    int ret = run(set);
+
+    if(profile) {
+        Profiler::enable(false);
+        std::string err = Profiler::write_chrome_trace(set.profile, Profiler::collect());
+        if(!err.empty()) {
+            warn("Error writing profile: %s", err.c_str());
+            return 1;
+        }
+    }
+    return ret;
+}
@@ -1,8 +1,18 @@
 
 #include "gl.h"
 #include "../lib/log.h"
-
+#include "../util/parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
 
 namespace GL {
 
@@ -32,8 +42,11 @@ int MSAA::n_samples() {
 
 static void setup_debug_proc();
 static void check_leaked_handles();
+static void destroy_staging();
 static bool is_gl45 = false;
 static bool is_gl41 = false;
+static bool is_gl43 = false;
+static std::string shader_cache;
 
 void setup() {
     GLint major, minor; 
@@ -41,15 +54,178 @@ void setup() {
     glGetIntegerv(GL_MINOR_VERSION, &minor); 
     is_gl45 = major == 4 && minor == 5;
     is_gl41 = major == 4 && minor == 1;
+    is_gl43 = major > 4 || (major == 4 && minor >= 3);
     setup_debug_proc();
     Effects::init();
 }
 
 void shutdown() {
     Effects::destroy();
+    destroy_staging();
     check_leaked_handles();
 }
 
+// Large buffer and texture uploads go through a persistently mapped staging ring
+// (with GL 4.5; older contexts upload directly). Data is copied into the ring on
+// the worker pool, and the driver copies it from there on the GPU timeline rather
+// than blocking the render thread. Fences mark when each staged range was last read,
+// so it is only overwritten once the GPU is done with it.
+static constexpr size_t staging_size = size_t(64) << 20;
+static constexpr size_t staging_min_upload = size_t(256) << 10;
+static constexpr size_t staging_copy_chunk = size_t(1) << 20;
+
+struct Staged_Range {
+    size_t begin, end;
+    GLsync sync;
+};
+static GLuint staging_buf = 0;
+static unsigned char* staging_mem = nullptr;
+static size_t staging_head = 0;
+static std::deque<Staged_Range> staging_fences;
+
+static void destroy_staging() {
+    for(Staged_Range& range : staging_fences) glDeleteSync(range.sync);
+    staging_fences.clear();
+    if(staging_buf) {
+        glBindBuffer(GL_COPY_READ_BUFFER, staging_buf);
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glDeleteBuffers(1, &staging_buf);
+    }
+    staging_buf = 0;
+    staging_mem = nullptr;
+    staging_head = 0;
+}
+
+// Copies data into the staging ring and returns its offset there, or SIZE_MAX if it
+// should be uploaded directly. Once the commands reading it are issued, fence it
+// with staged().
+static size_t stage(const void* data, size_t bytes) {
+
+    if(!is_gl45 || bytes < staging_min_upload || bytes > staging_size) return SIZE_MAX;
+
+    if(!staging_buf) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &staging_buf);
+        glBindBuffer(GL_COPY_READ_BUFFER, staging_buf);
+        glBufferStorage(GL_COPY_READ_BUFFER, staging_size, nullptr, flags);
+        staging_mem = (unsigned char*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, staging_size, flags);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        if(!staging_mem) {
+            warn("Failed to map staging buffer, uploading directly.");
+            glDeleteBuffers(1, &staging_buf);
+            staging_buf = 0;
+            is_gl45 = false;
+            return SIZE_MAX;
+        }
+    }
+
+    if(staging_head + bytes > staging_size) staging_head = 0;
+    size_t begin = staging_head, end = begin + bytes;
+
+    // The GPU finishes commands in order, so waiting on the newest range overlapping
+    // this one means every older range is free too
+    size_t last = staging_fences.size();
+    for(size_t i = 0; i < staging_fences.size(); i++) {
+        const Staged_Range& range = staging_fences[i];
+        if(range.begin < end && begin < range.end) last = i;
+    }
+    if(last < staging_fences.size()) {
+        glClientWaitSync(staging_fences[last].sync, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+        for(size_t i = 0; i <= last; i++) glDeleteSync(staging_fences[i].sync);
+        staging_fences.erase(staging_fences.begin(), staging_fences.begin() + last + 1);
+    }
+
+    const unsigned char* src = static_cast<const unsigned char*>(data);
+    parallel_for_range(0, bytes, staging_copy_chunk, [&](size_t b, size_t e) {
+        std::memcpy(staging_mem + begin + b, src + b, e - b);
+    });
+    staging_head = end;
+    return begin;
+}
+
+static void staged(size_t offset, size_t bytes) {
+    GLsync sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    staging_fences.push_back({offset, offset + bytes, sync});
+}
+
+// glBufferData for the buffer bound to target
+static void buffer_data(GLenum target, const void* data, size_t bytes) {
+    size_t offset = stage(data, bytes);
+    if(offset == SIZE_MAX) {
+        glBufferData(target, bytes, data, GL_DYNAMIC_DRAW);
+        return;
+    }
+    glBufferData(target, bytes, nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_COPY_READ_BUFFER, staging_buf);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, target, offset, 0, bytes);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    staged(offset, bytes);
+}
+
+// glBufferSubData for the buffer bound to target
+static void buffer_sub_data(GLenum target, size_t at, const void* data, size_t bytes) {
+    size_t offset = stage(data, bytes);
+    if(offset == SIZE_MAX) {
+        glBufferSubData(target, at, bytes, data);
+        return;
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, staging_buf);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, target, offset, at, bytes);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    staged(offset, bytes);
+}
+
+// Upload the dirty elements of data to the buffer bound to target, which must
+// already hold size of them; returns false if it should be re-uploaded whole
+template<typename T>
+static bool buffer_ranges(GLenum target, Dirty_Ranges& dirty, const T* data, size_t size) {
+    if(!dirty.coalesce(size)) return false;
+    for(auto [begin, end] : dirty.get()) {
+        buffer_sub_data(target, begin * sizeof(T), data + begin, (end - begin) * sizeof(T));
+    }
+    dirty.clear();
+    return true;
+}
+
+void Dirty_Ranges::add(size_t begin, size_t end) {
+    if(all || begin >= end) return;
+    if(!ranges.empty() && ranges.back().second >= begin && ranges.back().first <= end) {
+        ranges.back().first = std::min(ranges.back().first, begin);
+        ranges.back().second = std::max(ranges.back().second, end);
+        return;
+    }
+    if(ranges.size() == max_ranges && !coalesce(SIZE_MAX)) return;
+    ranges.push_back({begin, end});
+}
+
+void Dirty_Ranges::clear() {
+    ranges.clear();
+    all = false;
+}
+
+bool Dirty_Ranges::coalesce(size_t size) {
+    if(all) return false;
+    std::sort(ranges.begin(), ranges.end());
+    size_t n = 0, total = 0;
+    for(size_t i = 0; i < ranges.size(); i++) {
+        if(n > 0 && ranges[n - 1].second >= ranges[i].first) {
+            ranges[n - 1].second = std::max(ranges[n - 1].second, ranges[i].second);
+        } else {
+            ranges[n++] = ranges[i];
+        }
+    }
+    ranges.resize(n);
+    for(auto [begin, end] : ranges) total += end - begin;
+    // Past half the buffer, one upload beats many
+    if(ranges.size() >= max_ranges || total > size / 2) {
+        ranges.clear();
+        all = true;
+        return false;
+    }
+    return true;
+}
+
 void color_mask(bool enable) {
     glColorMask(enable, enable, enable, enable);
 }
@@ -118,6 +294,14 @@ void viewport(Vec2 dim) {
     glViewport(0, 0, (GLsizei)dim.x, (GLsizei)dim.y);
 }
 
+bool compute_supported() {
+    return is_gl43;
+}
+
+void set_shader_cache(const std::string& dir) {
+    shader_cache = dir;
+}
+
 int max_msaa() {
     int samples;
     glGetIntegerv(GL_MAX_SAMPLES, &samples);
@@ -130,7 +314,10 @@ Tex2D::Tex2D() {
 
 Tex2D::Tex2D(Tex2D&& src) {
     id = src.id;
+    w = src.w;
+    h = src.h;
     src.id = 0;
+    src.w = src.h = 0;
 }
 
 Tex2D::~Tex2D() {
@@ -141,7 +328,10 @@ Tex2D::~Tex2D() {
 void Tex2D::operator=(Tex2D&& src) {
     if(id) glDeleteTextures(1, &id);
     id = src.id;
+    w = src.w;
+    h = src.h;
     src.id = 0;
+    src.w = src.h = 0;
 }
 
 void Tex2D::bind(int idx) const {
@@ -149,14 +339,77 @@ void Tex2D::bind(int idx) const {
     glBindTexture(GL_TEXTURE_2D, id);
 }
 
-void Tex2D::image(int w, int h, unsigned char* img) {
+void Tex2D::image(int width, int height, unsigned char* img) {
     if(!id) glGenTextures(1, &id);
     glBindTexture(GL_TEXTURE_2D, id);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, img);
+
+    size_t bytes = (size_t)width * height * 4;
+    size_t offset = stage(img, bytes);
+    const void* pixels = img;
+    if(offset != SIZE_MAX) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_buf);
+        pixels = reinterpret_cast<const void*>(offset);
+    }
+
+    // Same-sized images (e.g. render progress) overwrite the existing storage
+    if(width == w && height == h) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    } else {
+        w = width;
+        h = height;
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+
+    if(offset != SIZE_MAX) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        staged(offset, bytes);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void Tex2D::sub_image(const unsigned char* img, int y0, int y1,
+                      const std::vector<std::pair<int, int>>& spans) {
+    if(!id || spans.empty() || y0 >= y1) return;
+    glBindTexture(GL_TEXTURE_2D, id);
+
+    const unsigned char* rows = img + (size_t)y0 * w * 4;
+    size_t bytes = (size_t)(y1 - y0) * w * 4;
+    size_t offset = stage(rows, bytes);
+    if(offset != SIZE_MAX) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_buf);
+        rows = reinterpret_cast<const unsigned char*>(offset);
+    }
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+    for(auto [x0, x1] : spans) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, x1 - x0, y1 - y0, GL_RGBA, GL_UNSIGNED_BYTE,
+                        rows + (size_t)x0 * 4);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+    if(offset != SIZE_MAX) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        staged(offset, bytes);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void Tex2D::image(int width, int height, const float* rgb) {
+    if(!id) glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_2D, id);
+
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, rgb);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // So the next 8-bit image respecifies the storage
+    w = h = 0;
+
     glBindTexture(GL_TEXTURE_2D, 0);
 }
 
@@ -164,7 +417,52 @@ TexID Tex2D::get_id() const {
     return id;
 }
 
-Mesh::Mesh() {
+void Tex2D::storage(int width, int height, bool float_texels) {
+    if(id && width == w && height == h && float_texels == hdr) return;
+    if(!id) glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_2D, id);
+
+    w = width;
+    h = height;
+    hdr = float_texels;
+    glTexImage2D(GL_TEXTURE_2D, 0, hdr ? GL_RGBA32F : GL_RGBA8, w, h, 0, GL_RGBA,
+                 hdr ? GL_FLOAT : GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void Tex2D::bind_image(int unit, GLenum access) const {
+    glBindImageTexture(unit, id, 0, GL_FALSE, 0, access, hdr ? GL_RGBA32F : GL_RGBA8);
+}
+
+void Tex2D::read(std::vector<float>& rgba) const {
+    rgba.resize((size_t)w * h * 4);
+    glBindTexture(GL_TEXTURE_2D, id);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, rgba.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Every empty mesh shares these, so they are never edited in place
+template<typename T> static const std::shared_ptr<std::vector<T>>& empty_buffer() {
+    static const std::shared_ptr<std::vector<T>> empty = std::make_shared<std::vector<T>>();
+    return empty;
+}
+
+static uint64_t next_revision() {
+    static std::atomic<uint64_t> revisions = 0;
+    return ++revisions;
+}
+
+template<typename T> static std::vector<T>& unique_buffer(std::shared_ptr<std::vector<T>>& buf) {
+    if(buf.use_count() > 1) buf = std::make_shared<std::vector<T>>(*buf);
+    return *buf;
+}
+
+Mesh::Mesh() : _verts(empty_buffer<Vert>()), _idxs(empty_buffer<Index>()) {
     create();
 }
 
@@ -173,6 +471,17 @@ Mesh::Mesh(std::vector<Vert>&& vertices, std::vector<Index>&& indices) {
     recreate(std::move(vertices), std::move(indices));
 }
 
+Mesh::Mesh(std::shared_ptr<std::vector<Vert>> vertices,
+           std::shared_ptr<std::vector<Index>> indices)
+    : _verts(std::move(vertices)), _idxs(std::move(indices)) {
+    create();
+    _revision = next_revision();
+    for(auto& v : *_verts) {
+        _bbox.enclose(v.pos);
+    }
+    n_elem = (GLuint)_idxs->size();
+}
+
 Mesh::Mesh(Mesh&& src) {
     vao = src.vao;
     src.vao = 0;
@@ -182,12 +491,23 @@ Mesh::Mesh(Mesh&& src) {
     src.vbo = 0;
     dirty = src.dirty;
     src.dirty = true;
+    dirty_verts = std::move(src.dirty_verts);
+    src.dirty_verts.clear();
     n_elem = src.n_elem;
     src.n_elem = 0;
     _bbox = src._bbox;
     src._bbox.reset();
     _verts = std::move(src._verts);
+    src._verts = empty_buffer<Vert>();
     _idxs = std::move(src._idxs);
+    src._idxs = empty_buffer<Index>();
+    _revision = src._revision;
+    src._revision = 0;
+    skin_vbo = src.skin_vbo;
+    src.skin_vbo = 0;
+    skin_dirty = src.skin_dirty;
+    src.skin_dirty = false;
+    _skin = std::move(src._skin);
 }
 
 void Mesh::operator=(Mesh&& src) {
@@ -200,12 +520,23 @@ void Mesh::operator=(Mesh&& src) {
     src.ebo = 0;
     dirty = src.dirty;
     src.dirty = true;
+    dirty_verts = std::move(src.dirty_verts);
+    src.dirty_verts.clear();
     n_elem = src.n_elem;
     src.n_elem = 0;
     _bbox = src._bbox;
     src._bbox.reset();
     _verts = std::move(src._verts);
+    src._verts = empty_buffer<Vert>();
     _idxs = std::move(src._idxs);
+    src._idxs = empty_buffer<Index>();
+    _revision = src._revision;
+    src._revision = 0;
+    skin_vbo = src.skin_vbo;
+    src.skin_vbo = 0;
+    skin_dirty = src.skin_dirty;
+    src.skin_dirty = false;
+    _skin = std::move(src._skin);
 }
 
 Mesh::~Mesh() {
@@ -243,75 +574,193 @@ void Mesh::destroy() {
 
     glDeleteBuffers(1, &ebo);
     glDeleteBuffers(1, &vbo);
+    if(skin_vbo) glDeleteBuffers(1, &skin_vbo);
     glDeleteVertexArrays(1, &vao);
-    ebo = vao = vbo = 0;
+    ebo = vao = vbo = skin_vbo = 0;
 }
 
 void Mesh::update() {
     glBindVertexArray(vao);
 
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Vert) * _verts.size(), _verts.data(), GL_DYNAMIC_DRAW);
+    buffer_data(GL_ARRAY_BUFFER, _verts->data(), sizeof(Vert) * _verts->size());
 
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Index) * _idxs.size(), _idxs.data(),
-                 GL_DYNAMIC_DRAW);
+    buffer_data(GL_ELEMENT_ARRAY_BUFFER, _idxs->data(), sizeof(Index) * _idxs->size());
 
     glBindVertexArray(0);
 
     dirty = false;
+    dirty_verts.clear();
+}
+
+void Mesh::update_skin() {
+    glBindVertexArray(vao);
+
+    // Joints then weights, each as two vec4s, after the attributes of Vert
+    if(_skin) {
+        if(!skin_vbo) glGenBuffers(1, &skin_vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, skin_vbo);
+        for(GLuint i = 0; i < 2; i++) {
+            glEnableVertexAttribArray(3 + i);
+            glVertexAttribIPointer(3 + i, 4, GL_UNSIGNED_INT, sizeof(Skin),
+                                   (GLvoid*)(offsetof(Skin, joints) + 4 * i * sizeof(GLuint)));
+            glEnableVertexAttribArray(5 + i);
+            glVertexAttribPointer(5 + i, 4, GL_FLOAT, GL_FALSE, sizeof(Skin),
+                                  (GLvoid*)(offsetof(Skin, weights) + 4 * i * sizeof(float)));
+        }
+        buffer_data(GL_ARRAY_BUFFER, _skin->data(), sizeof(Skin) * _skin->size());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    } else {
+        for(GLuint i = 3; i < 7; i++) glDisableVertexAttribArray(i);
+    }
+
+    glBindVertexArray(0);
+    skin_dirty = false;
+}
+
+void Mesh::set_skin(std::vector<Skin>&& skin) {
+    if(skin.empty()) {
+        skin_dirty = skin_dirty || _skin;
+        _skin.reset();
+    } else {
+        _skin = std::make_shared<const std::vector<Skin>>(std::move(skin));
+        skin_dirty = true;
+    }
+}
+
+bool Mesh::has_skin() const {
+    return _skin != nullptr;
 }
 
 void Mesh::recreate(std::vector<Vert>&& vertices, std::vector<Index>&& indices) {
 
     dirty = true;
-    _verts = std::move(vertices);
-    _idxs = std::move(indices);
+    _revision = next_revision();
+    _verts = std::make_shared<std::vector<Vert>>(std::move(vertices));
+    _idxs = std::make_shared<std::vector<Index>>(std::move(indices));
+
+    _bbox.reset();
+    for(auto& v : *_verts) {
+        _bbox.enclose(v.pos);
+    }
+    n_elem = (GLuint)_idxs->size();
+}
+
+void Mesh::recreate(std::vector<Vert>&& vertices, const Mesh& topology) {
+
+    dirty = true;
+    _revision = next_revision();
+    _verts = std::make_shared<std::vector<Vert>>(std::move(vertices));
+    _idxs = topology._idxs;
+
+    _bbox.reset();
+    for(auto& v : *_verts) {
+        _bbox.enclose(v.pos);
+    }
+    n_elem = (GLuint)_idxs->size();
+}
+
+void Mesh::recreate(std::shared_ptr<const std::vector<Vert>> vertices, const Mesh& topology,
+                    uint64_t revision) {
+
+    // Only ever edited after unique_buffer() has made a copy of its own, as long as
+    // whoever shared it still holds on to it
+    dirty = true;
+    _revision = revision;
+    _verts = std::const_pointer_cast<std::vector<Vert>>(std::move(vertices));
+    _idxs = topology._idxs;
 
     _bbox.reset();
-    for(auto& v : _verts) {
+    for(auto& v : *_verts) {
         _bbox.enclose(v.pos);
     }
-    n_elem = (GLuint)_idxs.size();
+    n_elem = (GLuint)_idxs->size();
 }
 
 GLuint Mesh::tris() const {
     return n_elem / 3;
 }
 
+size_t Mesh::bytes(std::unordered_set<const void*>& seen) const {
+    size_t total = 0;
+    if(_verts && seen.insert(_verts.get()).second) total += _verts->capacity() * sizeof(Vert);
+    if(_idxs && seen.insert(_idxs.get()).second) total += _idxs->capacity() * sizeof(Index);
+    if(_skin && seen.insert(_skin.get()).second) total += _skin->capacity() * sizeof(Skin);
+    return total;
+}
+
 Mesh Mesh::copy() const {
-    std::vector<Vert> verts = _verts;
-    std::vector<Index> idxs = _idxs;
-    return Mesh(std::move(verts), std::move(idxs));
+    Mesh ret;
+    ret._verts = _verts;
+    ret._idxs = _idxs;
+    ret._bbox = _bbox;
+    ret.n_elem = n_elem;
+    ret._revision = _revision;
+    ret._skin = _skin;
+    ret.skin_dirty = _skin != nullptr;
+    return ret;
 }
 
 std::vector<Mesh::Vert>& Mesh::edit_verts() {
     dirty = true;
-    return _verts;
+    _revision = next_revision();
+    return unique_buffer(_verts);
+}
+
+std::vector<Mesh::Vert>& Mesh::edit_verts(size_t begin, size_t end) {
+    dirty_verts.add(begin, end);
+    _revision = next_revision();
+    return unique_buffer(_verts);
 }
 
 std::vector<Mesh::Index>& Mesh::edit_indices() {
     dirty = true;
-    return _idxs;
+    _revision = next_revision();
+    return unique_buffer(_idxs);
 }
 
 const std::vector<Mesh::Vert>& Mesh::verts() const {
-    return _verts;
+    return *_verts;
 }
 
 const std::vector<Mesh::Index>& Mesh::indices() const {
+    return *_idxs;
+}
+
+std::shared_ptr<const std::vector<Mesh::Index>> Mesh::share_indices() const {
     return _idxs;
 }
 
+std::shared_ptr<const std::vector<Mesh::Vert>> Mesh::share_verts() const {
+    return _verts;
+}
+
+uint64_t Mesh::revision() const {
+    return _revision;
+}
+
+Mesh::Data Mesh::data() const {
+    return {_verts, _idxs, _revision};
+}
+
 BBox Mesh::bbox() const {
     return _bbox;
 }
 
 void Mesh::render() {
+    if(!dirty && !dirty_verts.empty()) {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        dirty = !buffer_ranges(GL_ARRAY_BUFFER, dirty_verts, _verts->data(), _verts->size());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
     if(dirty) update();
+    if(skin_dirty) update_skin();
     glBindVertexArray(vao);
     glDrawElements(GL_TRIANGLES, n_elem, GL_UNSIGNED_INT, nullptr);
     glBindVertexArray(0);
+    draw_stats.draws++;
+    draw_stats.triangles += n_elem / 3;
 }
 
 Instances::Instances(Mesh&& mesh) : _mesh(std::move(mesh)) {
@@ -325,6 +774,10 @@ Instances::Instances(Instances&& src) {
     src.vbo = 0;
     dirty = src.dirty;
     src.dirty = true;
+    dirty_data = std::move(src.dirty_data);
+    src.dirty_data.clear();
+    capacity = src.capacity;
+    src.capacity = 0;
 }
 
 Instances::~Instances() {
@@ -343,6 +796,10 @@ void Instances::operator=(Instances&& src) {
     src.vbo = 0;
     dirty = src.dirty;
     src.dirty = true;
+    dirty_data = std::move(src.dirty_data);
+    src.dirty_data.clear();
+    capacity = src.capacity;
+    src.capacity = 0;
 }
 
 void Instances::create() {
@@ -370,25 +827,47 @@ void Instances::create() {
 void Instances::render() {
 
     if(_mesh.dirty) _mesh.update();
+    if(!dirty && !dirty_data.empty()) {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        dirty = !buffer_ranges(GL_ARRAY_BUFFER, dirty_data, data.data(), data.size());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
     if(dirty) update();
 
     glBindVertexArray(_mesh.vao);
     glDrawElementsInstanced(GL_TRIANGLES, _mesh.n_elem, GL_UNSIGNED_INT, nullptr,
                             (GLsizei)data.size());
     glBindVertexArray(0);
+    draw_stats.draws++;
+    draw_stats.triangles += (uint64_t)(_mesh.n_elem / 3) * data.size();
 }
 
 Instances::Info& Instances::get(size_t idx) {
-    dirty = true;
+    dirty_data.add(idx, idx + 1);
     return data[idx];
 }
 
 size_t Instances::add(const Mat4& transform, GLuint id) {
     data.emplace_back(Info{id, transform});
-    dirty = true;
+    if(data.size() > capacity) dirty = true;
+    else dirty_data.add(data.size() - 1, data.size());
     return data.size() - 1;
 }
 
+void Instances::set(const std::vector<Info>& infos) {
+    if(infos.size() != data.size()) {
+        data.assign(infos.begin(), infos.end());
+        if(data.size() > capacity) dirty = true;
+        else dirty_data.add(0, data.size());
+        return;
+    }
+    for(size_t i = 0; i < infos.size(); i++) {
+        if(infos[i].id == data[i].id && infos[i].transform == data[i].transform) continue;
+        data[i] = infos[i];
+        dirty_data.add(i, i + 1);
+    }
+}
+
 void Instances::clear(size_t n) {
     data.clear();
     if(n > 0) {
@@ -400,9 +879,15 @@ void Instances::clear(size_t n) {
 void Instances::update() {
     glBindVertexArray(_mesh.vao);
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Info) * data.size(), data.data(), GL_DYNAMIC_DRAW);
+    // Sized to the vector's capacity, as that is how far it grows before reallocating
+    capacity = data.capacity();
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Info) * capacity, nullptr, GL_DYNAMIC_DRAW);
+    if(!data.empty()) {
+        buffer_sub_data(GL_ARRAY_BUFFER, 0, data.data(), sizeof(Info) * data.size());
+    }
     glBindVertexArray(0);
     dirty = false;
+    dirty_data.clear();
 }
 
 void Instances::destroy() {
@@ -414,39 +899,408 @@ void Instances::destroy() {
     _mesh.destroy();
 }
 
-Lines::Lines(std::vector<Vert>&& verts, float thickness)
-    : thickness(thickness), vertices(std::move(verts)) {
+Mesh_Batch::Mesh_Batch() {
+}
+
+Mesh_Batch::~Mesh_Batch() {
+    destroy();
+}
+
+bool Mesh_Batch::supported() {
+    return is_gl45;
+}
+
+void Mesh_Batch::create() {
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &draw_buf);
+    glGenBuffers(1, &cmd_buf);
+}
+
+void Mesh_Batch::destroy() {
+    // Hack to let stuff get destroyed for headless mode
+    if(!glDeleteBuffers || !vao) return;
+
+    for(GLuint* buf : {&vbo, &ebo, &draw_ids, &draw_buf, &cmd_buf}) {
+        glDeleteBuffers(1, buf);
+        *buf = 0;
+    }
+    glDeleteVertexArrays(1, &vao);
+    vao = 0;
+}
+
+// Points the vertex array at the current buffers, after any of them is replaced
+void Mesh_Batch::attach() {
+
+    glBindVertexArray(vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Mesh::Vert), (GLvoid*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Mesh::Vert), (GLvoid*)sizeof(Vec3));
+    glEnableVertexAttribArray(1);
+    glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, sizeof(Mesh::Vert),
+                           (GLvoid*)(2 * sizeof(Vec3)));
+    glEnableVertexAttribArray(2);
+
+    // Each draw's index, which its base instance selects
+    glBindBuffer(GL_ARRAY_BUFFER, draw_ids);
+    glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(GLuint), (GLvoid*)0);
+    glVertexAttribDivisor(3, 1);
+    glEnableVertexAttribArray(3);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Makes buf hold at least need elements of the given size, keeping the first used;
+// returns whether it was replaced
+bool Mesh_Batch::grow(GLuint& buf, size_t& cap, size_t used, size_t need, size_t size) {
+
+    if(need <= cap) return false;
+    size_t next_cap = std::max({need, cap * 2, size_t(1) << 16});
+
+    GLuint next = 0;
+    glGenBuffers(1, &next);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, next);
+    glBufferData(GL_COPY_WRITE_BUFFER, next_cap * size, nullptr, GL_STATIC_DRAW);
+    if(used) {
+        glBindBuffer(GL_COPY_READ_BUFFER, buf);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used * size);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &buf);
+
+    buf = next;
+    cap = next_cap;
+    return true;
+}
+
+const Mesh_Batch::Slot& Mesh_Batch::slot(const Mesh& mesh) {
+
+    auto entry = slots.find(mesh.revision());
+    if(entry == slots.end()) {
+
+        const std::vector<Mesh::Vert>& verts = mesh.verts();
+        const std::vector<Mesh::Index>& idxs = mesh.indices();
+
+        bool moved = grow(vbo, vert_cap, n_verts, n_verts + verts.size(), sizeof(Mesh::Vert));
+        moved = grow(ebo, idx_cap, n_idxs, n_idxs + idxs.size(), sizeof(Mesh::Index)) || moved;
+        if(moved) attach();
+
+        glBindBuffer(GL_COPY_WRITE_BUFFER, vbo);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, n_verts * sizeof(Mesh::Vert),
+                        verts.size() * sizeof(Mesh::Vert), verts.data());
+        glBindBuffer(GL_COPY_WRITE_BUFFER, ebo);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, n_idxs * sizeof(Mesh::Index),
+                        idxs.size() * sizeof(Mesh::Index), idxs.data());
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+        Slot s{(GLuint)n_idxs, (GLuint)idxs.size(), (GLint)n_verts, 0};
+        entry = slots.emplace(mesh.revision(), s).first;
+        n_verts += verts.size();
+        n_idxs += idxs.size();
+    }
+
+    Slot& s = entry->second;
+    if(s.frame != frame) {
+        s.frame = frame;
+        live_verts += mesh.verts().size();
+    }
+    return s;
+}
+
+void Mesh_Batch::add(const Mesh& mesh, const Draw& draw) {
+    if(!vao) create();
+    const Slot& s = slot(mesh);
+    commands.push_back({s.count, 1, s.first, s.base, (GLuint)draws.size()});
+    draws.push_back(draw);
+    meshes.push_back(&mesh);
+}
+
+void Mesh_Batch::render() {
+
+    if(commands.empty()) return;
+
+    // Meshes no longer drawn are only dropped by starting over with those that are
+    if(n_verts > 2 * live_verts + (size_t(1) << 20)) {
+        slots.clear();
+        n_verts = n_idxs = live_verts = 0;
+        for(size_t i = 0; i < meshes.size(); i++) {
+            const Slot& s = slot(*meshes[i]);
+            commands[i].first = s.first;
+            commands[i].base = s.base;
+        }
+    }
+
+    if(draws.size() > id_cap) {
+        id_cap = std::max(draws.size(), id_cap * 2);
+        std::vector<GLuint> ids(id_cap);
+        for(size_t i = 0; i < id_cap; i++) ids[i] = (GLuint)i;
+        if(!draw_ids) glGenBuffers(1, &draw_ids);
+        glBindBuffer(GL_ARRAY_BUFFER, draw_ids);
+        glBufferData(GL_ARRAY_BUFFER, id_cap * sizeof(GLuint), ids.data(), GL_STATIC_DRAW);
+        attach();
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, draw_buf);
+    buffer_data(GL_SHADER_STORAGE_BUFFER, draws.data(), draws.size() * sizeof(Draw));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, draw_buf);
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cmd_buf);
+    buffer_data(GL_DRAW_INDIRECT_BUFFER, commands.data(), commands.size() * sizeof(Command));
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, (GLsizei)commands.size(),
+                                0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindVertexArray(0);
+    draw_stats.draws++;
+    for(const Command& c : commands) draw_stats.triangles += (uint64_t)(c.count / 3) * c.instances;
+
+    meshes.clear();
+    draws.clear();
+    commands.clear();
+    live_verts = 0;
+    frame++;
+}
+
+Point_Instances::Point_Instances(Mesh&& mesh) : _mesh(std::move(mesh)) {
     create();
+}
+
+Point_Instances::Point_Instances(Point_Instances&& src) {
+    *this = std::move(src);
+}
+
+Point_Instances::~Point_Instances() {
+    destroy();
+}
+
+const Mesh& Point_Instances::mesh() const {
+    return _mesh;
+}
+
+void Point_Instances::operator=(Point_Instances&& src) {
+    destroy();
+    _mesh = std::move(src._mesh);
+    data = std::move(src.data);
+    vbo = src.vbo;
+    src.vbo = 0;
+    dirty = src.dirty;
+    src.dirty = false;
+    persistent = src.persistent;
+    count = src.count;
+    capacity = src.capacity;
+    slot = src.slot;
+    mapped = src.mapped;
+    src.count = src.capacity = src.slot = 0;
+    src.mapped = nullptr;
+    for(size_t i = 0; i < ring_size; i++) {
+        fences[i] = src.fences[i];
+        src.fences[i] = nullptr;
+    }
+}
+
+void Point_Instances::create() {
+    // Hack to let stuff get created for headless mode
+    if(!glGenBuffers) return;
+
+    // The mapped ring is (re)created at the size it's first needed
+    persistent = is_gl45;
+    if(persistent) return;
+
+    glGenBuffers(1, &vbo);
+    glBindVertexArray(_mesh.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(Vec4), (void*)0);
+    glVertexAttribDivisor(3, 1);
+    glBindVertexArray(0);
+}
+
+void Point_Instances::reserve(size_t n) {
+
+    for(GLsync& fence : fences) {
+        if(!fence) continue;
+        glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+    if(vbo) {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glDeleteBuffers(1, &vbo);
+        vbo = 0;
+        mapped = nullptr;
+    }
+
+    // Growing geometrically, as emitters ramp up a few particles at a time
+    capacity = std::max({n, capacity * 2, size_t(1024)});
+    size_t bytes = ring_size * capacity * sizeof(Vec4);
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferStorage(GL_ARRAY_BUFFER, bytes, nullptr, flags);
+    mapped = (Vec4*)glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, flags);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    if(!mapped) {
+        warn("Failed to map instance buffer, uploading directly.");
+        glDeleteBuffers(1, &vbo);
+        glGenBuffers(1, &vbo);
+        capacity = 0;
+        persistent = false;
+    }
+
+    glBindVertexArray(_mesh.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(Vec4), (void*)0);
+    glVertexAttribDivisor(3, 1);
+    glBindVertexArray(0);
+}
+
+void Point_Instances::set(const std::vector<Vec3>& points, float scale) {
+
+    count = points.size();
+    if(persistent && count > capacity) reserve(count);
+
+    Vec4* dst;
+    if(mapped) {
+        // Write the slot the GPU read longest ago, once it's done reading it
+        slot = (slot + 1) % ring_size;
+        if(fences[slot]) {
+            glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+            glDeleteSync(fences[slot]);
+            fences[slot] = nullptr;
+        }
+        dst = mapped + slot * capacity;
+    } else {
+        data.resize(count);
+        dst = data.data();
+        dirty = true;
+    }
+    parallel_for_range(0, count, 4096, [&](size_t b, size_t e) {
+        for(size_t i = b; i < e; i++) dst[i] = Vec4{points[i], scale};
+    });
+}
+
+void Point_Instances::clear() {
+    count = 0;
+    data.clear();
     dirty = true;
 }
 
-Lines::Lines(float thickness) : thickness(thickness) {
+void Point_Instances::render() {
+
+    if(_mesh.dirty) _mesh.update();
+    if(dirty) update();
+    if(count == 0) return;
+
+    glBindVertexArray(_mesh.vao);
+    if(mapped) {
+        glDrawElementsInstancedBaseInstance(GL_TRIANGLES, _mesh.n_elem, GL_UNSIGNED_INT,
+                                            nullptr, (GLsizei)count,
+                                            (GLuint)(slot * capacity));
+        if(fences[slot]) glDeleteSync(fences[slot]);
+        fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    } else {
+        glDrawElementsInstanced(GL_TRIANGLES, _mesh.n_elem, GL_UNSIGNED_INT, nullptr,
+                                (GLsizei)count);
+    }
+    glBindVertexArray(0);
+    draw_stats.draws++;
+    draw_stats.triangles += (uint64_t)(_mesh.n_elem / 3) * count;
+}
+
+void Point_Instances::update() {
+    dirty = false;
+    if(mapped) return;
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    buffer_data(GL_ARRAY_BUFFER, data.data(), sizeof(Vec4) * data.size());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Point_Instances::destroy() {
+    // Hack to let stuff get destroyed for headless mode
+    if(!glDeleteBuffers) return;
+
+    for(GLsync& fence : fences) {
+        if(fence) glDeleteSync(fence);
+        fence = nullptr;
+    }
+    if(mapped) {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        mapped = nullptr;
+    }
+    glDeleteBuffers(1, &vbo);
+    vbo = 0;
+    capacity = 0;
+    _mesh.destroy();
+}
+
+// Shared lines are spread over a few locked buffers, picked per thread, so render
+// workers logging rays rarely wait on each other
+static constexpr size_t lines_shards = 16;
+
+struct Lines::Shared {
+    struct Shard {
+        std::mutex mut;
+        std::vector<Vert> verts;
+    };
+    // Vertices held in vertices and the shards, so the cap holds across threads
+    std::atomic<size_t> count = 0;
+    std::atomic<size_t> max_verts = SIZE_MAX;
+    std::atomic<bool> dropped = false;
+    Shard shards[lines_shards];
+};
+
+Lines::Lines(std::vector<Vert>&& verts, float thickness)
+    : thickness(thickness), vertices(std::move(verts)), shared(std::make_unique<Shared>()) {
+    shared->count = vertices.size();
+    create();
+}
+
+Lines::Lines(float thickness) : thickness(thickness), shared(std::make_unique<Shared>()) {
     create();
 }
 
 Lines::Lines(Lines&& src) {
-    dirty = src.dirty;
-    src.dirty = true;
     thickness = src.thickness;
     src.thickness = 0.0f;
     vao = src.vao;
     src.vao = 0;
     vbo = src.vbo;
     src.vbo = 0;
+    uploaded = src.uploaded;
+    src.uploaded = 0;
+    capacity = src.capacity;
+    src.capacity = 0;
     vertices = std::move(src.vertices);
+    shared = std::move(src.shared);
+    src.shared = std::make_unique<Shared>();
 }
 
 void Lines::operator=(Lines&& src) {
     destroy();
-    dirty = src.dirty;
-    src.dirty = true;
     thickness = src.thickness;
     src.thickness = 0.0f;
     vao = src.vao;
     src.vao = 0;
     vbo = src.vbo;
     src.vbo = 0;
+    uploaded = src.uploaded;
+    src.uploaded = 0;
+    capacity = src.capacity;
+    src.capacity = 0;
     vertices = std::move(src.vertices);
+    shared = std::move(src.shared);
+    src.shared = std::make_unique<Shared>();
 }
 
 Lines::~Lines() {
@@ -457,15 +1311,22 @@ void Lines::update() const {
 
     glBindVertexArray(vao);
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Vert) * vertices.size(), vertices.data(), GL_DYNAMIC_DRAW);
+    if(vertices.size() > capacity) {
+        // Sized to the vector's capacity, as that is how far it grows before reallocating
+        capacity = vertices.capacity();
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Vert) * capacity, nullptr, GL_DYNAMIC_DRAW);
+        uploaded = 0;
+    }
+    buffer_sub_data(GL_ARRAY_BUFFER, sizeof(Vert) * uploaded, vertices.data() + uploaded,
+                    sizeof(Vert) * (vertices.size() - uploaded));
     glBindVertexArray(0);
 
-    dirty = false;
+    uploaded = vertices.size();
 }
 
 void Lines::render(bool smooth) const {
 
-    if(dirty) update();
+    if(uploaded < vertices.size()) update();
 
     glLineWidth(thickness);
     if(smooth)
@@ -476,24 +1337,70 @@ void Lines::render(bool smooth) const {
     glBindVertexArray(vao);
     glDrawArrays(GL_LINES, 0, (GLsizei)vertices.size());
     glBindVertexArray(0);
+    draw_stats.draws++;
 }
 
 void Lines::clear() {
     vertices.clear();
-    dirty = true;
+    for(Shared::Shard& shard : shared->shards) {
+        std::lock_guard<std::mutex> lock(shard.mut);
+        shard.verts.clear();
+    }
+    shared->count = 0;
+    shared->dropped = false;
+    uploaded = 0;
 }
 
 void Lines::pop() {
     vertices.pop_back();
     vertices.pop_back();
-    dirty = true;
+    shared->count -= 2;
+    uploaded = std::min(uploaded, vertices.size());
+}
+
+// Claims room for one more line under the cap
+bool Lines::reserve() {
+    size_t n = shared->count.fetch_add(2, std::memory_order_relaxed);
+    if(n + 2 <= shared->max_verts.load(std::memory_order_relaxed)) return true;
+    shared->count.fetch_sub(2, std::memory_order_relaxed);
+    shared->dropped = true;
+    return false;
 }
 
 void Lines::add(Vec3 start, Vec3 end, Vec3 color) {
 
+    if(!reserve()) return;
     vertices.push_back({start, color});
     vertices.push_back({end, color});
-    dirty = true;
+}
+
+void Lines::add_shared(Vec3 start, Vec3 end, Vec3 color) {
+
+    if(!reserve()) return;
+
+    static std::atomic<size_t> next_shard = 0;
+    thread_local size_t shard_idx = next_shard++ % lines_shards;
+
+    Shared::Shard& shard = shared->shards[shard_idx];
+    std::lock_guard<std::mutex> lock(shard.mut);
+    shard.verts.push_back({start, color});
+    shard.verts.push_back({end, color});
+}
+
+void Lines::take_shared() {
+    for(Shared::Shard& shard : shared->shards) {
+        std::lock_guard<std::mutex> lock(shard.mut);
+        vertices.insert(vertices.end(), shard.verts.begin(), shard.verts.end());
+        shard.verts.clear();
+    }
+}
+
+void Lines::cap(size_t max_lines) {
+    shared->max_verts = max_lines > SIZE_MAX / 2 ? SIZE_MAX : max_lines * 2;
+}
+
+bool Lines::capped() const {
+    return shared->dropped;
 }
 
 void Lines::create() {
@@ -523,7 +1430,7 @@ void Lines::destroy() {
     glDeleteVertexArrays(1, &vao);
     vao = vbo = 0;
     vertices.clear();
-    dirty = false;
+    uploaded = capacity = 0;
 }
 
 Shader::Shader() {
@@ -540,26 +1447,140 @@ Shader::Shader(Shader&& src) {
     src.v = 0;
     f = src.f;
     src.f = 0;
+    uniforms = std::move(src.uniforms);
+    src.uniforms.clear();
+}
+
+void Shader::operator=(Shader&& src) {
+    destroy();
+    program = src.program;
+    src.program = 0;
+    v = src.v;
+    src.v = 0;
+    f = src.f;
+    src.f = 0;
+    uniforms = std::move(src.uniforms);
+    src.uniforms.clear();
+}
+
+Shader::~Shader() {
+    destroy();
+}
+
+Uniforms::Uniforms() {
+    create();
+}
+
+Uniforms::Uniforms(Uniforms&& src) {
+    ubo = src.ubo;
+    src.ubo = 0;
+    size = src.size;
+    src.size = 0;
+}
+
+Uniforms::~Uniforms() {
+    destroy();
+}
+
+void Uniforms::operator=(Uniforms&& src) {
+    destroy();
+    ubo = src.ubo;
+    src.ubo = 0;
+    size = src.size;
+    src.size = 0;
+}
+
+void Uniforms::create() {
+    // Hack to let stuff get created for headless mode
+    if(!glGenBuffers) return;
+    glGenBuffers(1, &ubo);
+}
+
+void Uniforms::destroy() {
+    // Hack to let stuff get destroyed for headless mode
+    if(!glDeleteBuffers) return;
+    glDeleteBuffers(1, &ubo);
+    ubo = 0;
+    size = 0;
+}
+
+void Uniforms::set(const void* data, size_t bytes) {
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    if(bytes > size) {
+        glBufferData(GL_UNIFORM_BUFFER, bytes, data, GL_DYNAMIC_DRAW);
+        size = bytes;
+    } else {
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, bytes, data);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void Uniforms::bind(GLuint binding) const {
+    glBindBufferBase(GL_UNIFORM_BUFFER, binding, ubo);
+}
+
+Storage::Storage() {
+    create();
+}
+
+Storage::Storage(Storage&& src) {
+    ssbo = src.ssbo;
+    src.ssbo = 0;
+    size = src.size;
+    src.size = 0;
+}
+
+Storage::~Storage() {
+    destroy();
+}
+
+void Storage::operator=(Storage&& src) {
+    destroy();
+    ssbo = src.ssbo;
+    src.ssbo = 0;
+    size = src.size;
+    src.size = 0;
+}
+
+void Storage::create() {
+    // Hack to let stuff get created for headless mode
+    if(!glGenBuffers) return;
+    glGenBuffers(1, &ssbo);
+}
+
+void Storage::destroy() {
+    // Hack to let stuff get destroyed for headless mode
+    if(!glDeleteBuffers) return;
+    glDeleteBuffers(1, &ssbo);
+    ssbo = 0;
+    size = 0;
 }
 
-void Shader::operator=(Shader&& src) {
-    destroy();
-    program = src.program;
-    src.program = 0;
-    v = src.v;
-    src.v = 0;
-    f = src.f;
-    src.f = 0;
+void Storage::set(const void* data, size_t bytes) {
+    // Empty buffers can't be bound, so they keep at least one element's worth
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    if(bytes > size || !size) {
+        size = std::max(bytes, size_t(16));
+        glBufferData(GL_SHADER_STORAGE_BUFFER, size, nullptr, GL_STATIC_DRAW);
+    }
+    if(bytes) glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bytes, data);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
-Shader::~Shader() {
-    destroy();
+void Storage::bind(GLuint binding) const {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, ssbo);
 }
 
 void Shader::bind() const {
     glUseProgram(program);
 }
 
+void Shader::dispatch(GLuint x, GLuint y, GLuint z) const {
+    glDispatchCompute(x, y, z);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT |
+                    GL_TEXTURE_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
 void Shader::destroy() {
     // Hack to let stuff get destroyed for headless mode
     if(!glUseProgram) return;
@@ -569,6 +1590,7 @@ void Shader::destroy() {
     glDeleteShader(f);
     glDeleteProgram(program);
     v = f = program = 0;
+    uniforms.clear();
 }
 
 void Shader::uniform_block(std::string name, GLuint i) const {
@@ -576,44 +1598,201 @@ void Shader::uniform_block(std::string name, GLuint i) const {
     glUniformBlockBinding(program, idx, i);
 }
 
-void Shader::uniform(std::string name, int count, const Vec2 items[]) const {
-    glUniform2fv(loc(name), count, (GLfloat*)items);
+void Shader::uniform(std::string_view name, int count, const Vec2 items[]) const {
+    GLint l = loc(name);
+    if(l != -1) glUniform2fv(l, count, (GLfloat*)items);
+}
+
+void Shader::uniform(std::string_view name, int count, const Vec3 items[]) const {
+    GLint l = loc(name);
+    if(l != -1) glUniform3fv(l, count, (GLfloat*)items);
+}
+
+void Shader::uniform(std::string_view name, int count, const GLint items[]) const {
+    GLint l = loc(name);
+    if(l != -1) glUniform1iv(l, count, items);
+}
+
+void Shader::uniform(std::string_view name, int count, const GLuint items[]) const {
+    GLint l = loc(name);
+    if(l != -1) glUniform1uiv(l, count, items);
+}
+
+void Shader::uniform(std::string_view name, GLfloat fl) const {
+    GLint l = loc(name, fl);
+    if(l != -1) glUniform1f(l, fl);
+}
+
+void Shader::uniform(std::string_view name, const Mat4& mat) const {
+    GLint l = loc(name, mat);
+    if(l != -1) glUniformMatrix4fv(l, 1, GL_FALSE, mat.data);
 }
 
-void Shader::uniform(std::string name, GLfloat fl) const {
-    glUniform1f(loc(name), fl);
+void Shader::uniform(std::string_view name, Vec3 vec3) const {
+    GLint l = loc(name, vec3);
+    if(l != -1) glUniform3fv(l, 1, vec3.data);
 }
 
-void Shader::uniform(std::string name, const Mat4& mat) const {
-    glUniformMatrix4fv(loc(name), 1, GL_FALSE, mat.data);
+void Shader::uniform(std::string_view name, Vec2 vec2) const {
+    GLint l = loc(name, vec2);
+    if(l != -1) glUniform2fv(l, 1, vec2.data);
 }
 
-void Shader::uniform(std::string name, Vec3 vec3) const {
-    glUniform3fv(loc(name), 1, vec3.data);
+void Shader::uniform(std::string_view name, GLint i) const {
+    GLint l = loc(name, i);
+    if(l != -1) glUniform1i(l, i);
 }
 
-void Shader::uniform(std::string name, Vec2 vec2) const {
-    glUniform2fv(loc(name), 1, vec2.data);
+void Shader::uniform(std::string_view name, GLuint i) const {
+    GLint l = loc(name, i);
+    if(l != -1) glUniform1ui(l, i);
 }
 
-void Shader::uniform(std::string name, GLint i) const {
-    glUniform1i(loc(name), i);
+void Shader::uniform(std::string_view name, bool b) const {
+    GLint i = b;
+    GLint l = loc(name, i);
+    if(l != -1) glUniform1i(l, i);
 }
 
-void Shader::uniform(std::string name, GLuint i) const {
-    glUniform1ui(loc(name), i);
+template<typename T> GLint Shader::loc(std::string_view name, const T& value) const {
+    static_assert(sizeof(T) <= sizeof(Uniform::value));
+    for(Uniform& u : uniforms) {
+        if(u.name != name) continue;
+        if(u.size == sizeof(T) && std::memcmp(u.value, &value, sizeof(T)) == 0) return -1;
+        std::memcpy(u.value, &value, sizeof(T));
+        u.size = sizeof(T);
+        return u.loc;
+    }
+    return -1;
 }
 
-void Shader::uniform(std::string name, bool b) const {
-    glUniform1i(loc(name), b);
+GLint Shader::loc(std::string_view name) const {
+    for(const Uniform& u : uniforms) {
+        if(u.name == name) return u.loc;
+    }
+    return -1;
+}
+
+void Shader::find_uniforms() {
+
+    GLint n = 0, max_len = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &n);
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_len);
+
+    std::vector<GLchar> name(std::max(max_len, 1));
+    uniforms.clear();
+    for(GLint i = 0; i < n; i++) {
+        GLsizei len = 0;
+        GLint size = 0;
+        GLenum type = 0;
+        glGetActiveUniform(program, (GLuint)i, (GLsizei)name.size(), &len, &size, &type,
+                           name.data());
+        Uniform u;
+        u.name.assign(name.data(), len);
+        u.loc = glGetUniformLocation(program, u.name.c_str());
+        // Block members have no location; arrays are named by their first element
+        if(u.loc == -1) continue;
+        if(u.name.size() > 3 && u.name.compare(u.name.size() - 3, 3, "[0]") == 0) {
+            u.name.resize(u.name.size() - 3);
+        }
+        uniforms.push_back(std::move(u));
+    }
 }
 
-GLuint Shader::loc(std::string name) const {
-    return glGetUniformLocation(program, name.c_str());
+// The cache file of a program linked from sources, or empty if there is no cache or
+// the driver can't save programs. A driver update changes the name, and so the
+// programs it would no longer accept are compiled again.
+static std::string program_file(std::initializer_list<const std::string*> sources) {
+
+    if(shader_cache.empty() || !glGetProgramBinary || !glProgramBinary) return {};
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if(formats <= 0) return {};
+
+    // 64-bit FNV-1a, each part ending with a zero byte so that they can't run together
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&](const char* str) {
+        if(!str) str = "";
+        do {
+            hash = (hash ^ (unsigned char)*str) * 1099511628211ull;
+        } while(*str++);
+    };
+    for(GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION}) {
+        add((const char*)glGetString(name));
+    }
+    for(const std::string* source : sources) add(source->c_str());
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.glprog", (unsigned long long)hash);
+    return shader_cache + "/" + name;
+}
+
+// A program made from the binary saved in file, or 0 if there is none the driver takes
+static GLuint load_program(const std::string& file) {
+
+    if(file.empty()) return 0;
+    std::ifstream in(file, std::ios::binary | std::ios::ate);
+    if(!in) return 0;
+    std::streamoff size = in.tellg();
+    if(size <= (std::streamoff)sizeof(GLenum)) return 0;
+
+    GLenum format = 0;
+    std::vector<char> binary((size_t)size - sizeof(GLenum));
+    in.seekg(0);
+    in.read((char*)&format, sizeof(GLenum));
+    in.read(binary.data(), binary.size());
+    if(!in) return 0;
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, format, binary.data(), (GLsizei)binary.size());
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if(linked == GL_FALSE) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+static void save_program(GLuint program, const std::string& file) {
+
+    if(file.empty()) return;
+    GLint linked = GL_FALSE, size = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+    if(linked == GL_FALSE || size <= 0) return;
+
+    GLenum format = 0;
+    std::vector<char> binary((size_t)size);
+    glGetProgramBinary(program, size, &size, &format, binary.data());
+
+    // As for BVH cache files, written under a name of our own and renamed into place, so
+    // that another instance starting at the same time never reads a partial file
+    std::string tmp =
+        file + "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        out.write((const char*)&format, sizeof(GLenum));
+        out.write(binary.data(), size);
+        if(!out) {
+            warn("Failed to write shader cache file %s", tmp.c_str());
+            out.close();
+            std::remove(tmp.c_str());
+            return;
+        }
+    }
+    if(std::rename(tmp.c_str(), file.c_str()) != 0) std::remove(tmp.c_str());
 }
 
 void Shader::load(std::string vertex, std::string fragment) {
 
+    std::string file = program_file({&vertex, &fragment});
+    program = load_program(file);
+    if(program) {
+        find_uniforms();
+        return;
+    }
+
     v = glCreateShader(GL_VERTEX_SHADER);
     f = glCreateShader(GL_FRAGMENT_SHADER);
     const GLchar* vs_c = vertex.c_str();
@@ -633,9 +1812,47 @@ void Shader::load(std::string vertex, std::string fragment) {
     }
 
     program = glCreateProgram();
+    if(!file.empty()) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glAttachShader(program, v);
     glAttachShader(program, f);
     glLinkProgram(program);
+    save_program(program, file);
+    find_uniforms();
+}
+
+void Shader::load_compute(std::string compute) {
+
+    std::string file = program_file({&compute});
+    program = load_program(file);
+    if(program) {
+        find_uniforms();
+        return;
+    }
+
+    v = glCreateShader(GL_COMPUTE_SHADER);
+    const GLchar* cs_c = compute.c_str();
+    glShaderSource(v, 1, &cs_c, NULL);
+    glCompileShader(v);
+
+    if(!validate(v)) {
+        destroy();
+        return;
+    }
+
+    program = glCreateProgram();
+    if(!file.empty()) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glAttachShader(program, v);
+    glLinkProgram(program);
+
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if(linked == GL_FALSE) {
+        warn("Compute program %d failed to link.", program);
+        destroy();
+        return;
+    }
+    save_program(program, file);
+    find_uniforms();
 }
 
 bool Shader::validate(GLuint program) {
@@ -821,14 +2038,21 @@ GLuint Framebuffer::get_depth() const {
 }
 
 bool Framebuffer::can_read_at() const {
-    return is_gl45 && s == 1;
+    return s == 1;
 }
 
 void Framebuffer::read_at(int buf, int x, int y, GLubyte* data) const {
     assert(can_read_at());
     assert(buf >= 0 && buf < (int)output_textures.size());
-    glGetTextureSubImage(output_textures[buf], 0, x, y, 0, 1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, 4,
-                         data);
+    if(is_gl45) {
+        glGetTextureSubImage(output_textures[buf], 0, x, y, 0, 1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE,
+                             4, data);
+        return;
+    }
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    glReadBuffer(GL_COLOR_ATTACHMENT0 + buf);
+    glReadPixels(x, y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
 void Framebuffer::read(int buf, GLubyte* data) const {
@@ -838,6 +2062,18 @@ void Framebuffer::read(int buf, GLubyte* data) const {
     glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
 }
 
+void Framebuffer::read_depth(std::vector<float>& data) const {
+    assert(s == 1 && depth);
+    data.resize((size_t)w * h);
+    glBindTexture(GL_TEXTURE_2D, depth_tex);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_FLOAT, data.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+    // Without clip control, z was mapped from [-1, 1] rather than [0, 1]
+    if(!glClipControl) {
+        for(float& d : data) d = 2.0f * d - 1.0f;
+    }
+}
+
 void Framebuffer::blit_to(int buf, const Framebuffer& fb, bool avg) const {
 
     assert(buf >= 0 && buf < (int)output_textures.size());
@@ -877,6 +2113,189 @@ bool Framebuffer::is_multisampled() const {
     return s > 1;
 }
 
+Readback::Readback() {
+}
+
+Readback::~Readback() {
+    destroy();
+}
+
+void Readback::create() {
+    for(Slot& slot : slots) {
+        glGenBuffers(1, &slot.pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(data), nullptr, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void Readback::destroy() {
+    // Hack to let stuff get destroyed for headless mode
+    if(!glDeleteBuffers || !slots[0].pbo) return;
+
+    for(Slot& slot : slots) {
+        if(slot.fence) glDeleteSync(slot.fence);
+        glDeleteBuffers(1, &slot.pbo);
+        slot = {};
+    }
+}
+
+void Readback::request(const Framebuffer& fb, int buf, int rx, int ry, int rw, int rh) {
+
+    assert(!fb.is_multisampled());
+    assert(buf >= 0 && buf < (int)fb.output_textures.size());
+    rw = std::clamp(rw, 0, max_side);
+    rh = std::clamp(rh, 0, max_side);
+    if(!rw || !rh) return;
+
+    if(!slots[0].pbo) create();
+
+    // The oldest copy is overwritten if it was never taken
+    Slot& slot = slots[next];
+    if(slot.fence) glDeleteSync(slot.fence);
+
+    // With a pack buffer bound, glReadPixels only queues the copy
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fb.framebuffer);
+    glReadBuffer(GL_COLOR_ATTACHMENT0 + buf);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    glReadPixels(rx, ry, rw, rh, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.seq = ++seq;
+    slot.x = rx;
+    slot.y = ry;
+    slot.w = rw;
+    slot.h = rh;
+    next = (next + 1) % ring_size;
+}
+
+bool Readback::poll() {
+
+    Slot* done = nullptr;
+    for(Slot& slot : slots) {
+        if(!slot.fence || (done && done->seq > slot.seq)) continue;
+        GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if(status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) done = &slot;
+    }
+    if(!done) return false;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, done->pbo);
+    glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, done->w * done->h * 4, data);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    x = done->x;
+    y = done->y;
+    w = done->w;
+    h = done->h;
+
+    // Anything queued before it is stale now
+    uint64_t taken = done->seq;
+    for(Slot& slot : slots) {
+        if(slot.fence && slot.seq <= taken) {
+            glDeleteSync(slot.fence);
+            slot.fence = nullptr;
+        }
+    }
+    return true;
+}
+
+const GLubyte* Readback::at(int px, int py) const {
+    if(px < x || py < y || px >= x + w || py >= y + h) return nullptr;
+    return data + ((py - y) * w + (px - x)) * 4;
+}
+
+Timer_Queries::Timer_Queries() {
+}
+
+Timer_Queries::~Timer_Queries() {
+    destroy();
+}
+
+void Timer_Queries::create() {
+    for(Frame& frame : frames) glGenQueries(max_passes, frame.queries);
+}
+
+void Timer_Queries::destroy() {
+    // Hack to let stuff get destroyed for headless mode
+    if(!glDeleteQueries || !frames[0].queries[0]) return;
+
+    if(current) glEndQuery(GL_TIME_ELAPSED);
+    for(Frame& frame : frames) {
+        glDeleteQueries(max_passes, frame.queries);
+        frame = {};
+    }
+}
+
+void Timer_Queries::begin_frame() {
+
+    // Hack to skip timing for headless mode
+    if(!glGenQueries) return;
+    if(!frames[0].queries[0]) create();
+
+    poll();
+    // The oldest frame is dropped if the GPU still hasn't finished it
+    frames[next].n = 0;
+    frames[next].pending = false;
+    in_frame = true;
+    current = nullptr;
+}
+
+void Timer_Queries::pass(const char* name) {
+
+    Frame& frame = frames[next];
+    if(!in_frame || name == current || frame.n == max_passes) return;
+
+    if(current) glEndQuery(GL_TIME_ELAPSED);
+    glBeginQuery(GL_TIME_ELAPSED, frame.queries[frame.n]);
+    frame.names[frame.n++] = name;
+    current = name;
+}
+
+void Timer_Queries::end_frame() {
+
+    if(!in_frame) return;
+    if(current) glEndQuery(GL_TIME_ELAPSED);
+    frames[next].pending = frames[next].n > 0;
+    next = (next + 1) % ring_size;
+    in_frame = false;
+    current = nullptr;
+}
+
+void Timer_Queries::poll() {
+
+    // Frames finish in order, so the newest finished one is found walking back
+    // from the newest pending one
+    for(int i = 1; i <= ring_size; i++) {
+        Frame& frame = frames[(next + ring_size - i) % ring_size];
+        if(!frame.pending) continue;
+
+        GLint available = 0;
+        glGetQueryObjectiv(frame.queries[frame.n - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if(!available) continue;
+
+        times.clear();
+        for(int q = 0; q < frame.n; q++) {
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(frame.queries[q], GL_QUERY_RESULT, &ns);
+            auto entry = std::find_if(times.begin(), times.end(), [&](const auto& t) {
+                return std::string_view(t.first) == frame.names[q];
+            });
+            if(entry == times.end()) {
+                times.push_back({frame.names[q], 0.0f});
+                entry = times.end() - 1;
+            }
+            entry->second += ns / 1e6f;
+        }
+
+        // It and the frames before it are taken
+        for(int j = i; j <= ring_size; j++) {
+            frames[(next + ring_size - j) % ring_size].pending = false;
+        }
+        return;
+    }
+}
+
 void Effects::init() {
     // Hack to let stuff get created for headless mode
     if(!glGenVertexArrays) return;
@@ -1199,6 +2618,88 @@ void main() {
 	f_norm = (normal * vec4(v_norm, 0.0f)).xyz;
 	gl_Position = mvp * vec4(v_pos, 1.0f);
 })";
+const std::string skin_v = R"(
+#version 330 core
+
+layout (location = 0) in vec3 v_pos;
+layout (location = 1) in vec3 v_norm;
+layout (location = 2) in uint v_id;
+
+layout (location = 3) in uvec4 v_joints0;
+layout (location = 4) in uvec4 v_joints1;
+layout (location = 5) in vec4 v_weights0;
+layout (location = 6) in vec4 v_weights1;
+
+layout (std140) uniform Joints {
+	mat4 palette[256];
+};
+
+uniform mat4 mvp, normal;
+
+smooth out vec3 f_norm;
+flat out uint f_id;
+
+void main() {
+	mat4 skin = mat4(0.0f);
+	for(int i = 0; i < 4; i++) {
+		skin += palette[v_joints0[i]] * v_weights0[i];
+		skin += palette[v_joints1[i]] * v_weights1[i];
+	}
+	f_id = v_id;
+	vec3 norm = normalize((skin * vec4(v_norm, 0.0f)).xyz);
+	f_norm = (normal * vec4(norm, 0.0f)).xyz;
+	gl_Position = mvp * skin * vec4(v_pos, 1.0f);
+})";
+const std::string skin_dq_v = R"(
+#version 330 core
+
+layout (location = 0) in vec3 v_pos;
+layout (location = 1) in vec3 v_norm;
+layout (location = 2) in uint v_id;
+
+layout (location = 3) in uvec4 v_joints0;
+layout (location = 4) in uvec4 v_joints1;
+layout (location = 5) in vec4 v_weights0;
+layout (location = 6) in vec4 v_weights1;
+
+layout (std140) uniform Joints {
+	vec4 palette[512];
+};
+
+uniform mat4 mvp, normal;
+
+smooth out vec3 f_norm;
+flat out uint f_id;
+
+vec4 real, dual;
+
+void blend(uint j, float w) {
+	vec4 r = palette[2u * j];
+	w = dot(r, palette[2u * v_joints0[0]]) < 0.0f ? -w : w;
+	real += r * w;
+	dual += palette[2u * j + 1u] * w;
+}
+
+vec3 rotate(vec3 v) {
+	return v + 2.0f * cross(real.xyz, cross(real.xyz, v) + real.w * v);
+}
+
+void main() {
+	real = vec4(0.0f);
+	dual = vec4(0.0f);
+	for(int i = 0; i < 4; i++) {
+		blend(v_joints0[i], v_weights0[i]);
+		blend(v_joints1[i], v_weights1[i]);
+	}
+	float inv = 1.0f / length(real);
+	real *= inv;
+	dual *= inv;
+	vec3 t = 2.0f * (real.w * dual.xyz - dual.w * real.xyz + cross(real.xyz, dual.xyz));
+
+	f_id = v_id;
+	f_norm = (normal * vec4(normalize(rotate(v_norm)), 0.0f)).xyz;
+	gl_Position = mvp * vec4(rotate(v_pos) + t, 1.0f);
+})";
 const std::string inst_v = R"(
 #version 330 core
 
@@ -1222,12 +2723,84 @@ void main() {
 	f_norm = (n * vec4(v_norm, 0.0f)).xyz;
 	gl_Position = proj * mv * vec4(v_pos, 1.0f);
 })";
+const std::string point_inst_v = R"(
+#version 330 core
+
+layout (location = 0) in vec3 v_pos;
+layout (location = 1) in vec3 v_norm;
+layout (location = 2) in uint v_id;
+
+layout (location = 3) in vec4 i_point;
+
+uniform bool use_i_id;
+uniform mat4 proj, modelview;
+
+smooth out vec3 f_norm;
+flat out uint f_id;
+
+void main() {
+	f_id = use_i_id ? 0u : v_id;
+	f_norm = (modelview * vec4(v_norm, 0.0f)).xyz;
+	gl_Position = proj * modelview * vec4(v_pos * i_point.w + i_point.xyz, 1.0f);
+})";
+const std::string batch_v = R"(
+#version 430 core
+
+layout (location = 0) in vec3 v_pos;
+layout (location = 1) in vec3 v_norm;
+layout (location = 2) in uint v_id;
+
+layout (location = 3) in uint i_draw;
+
+struct Draw {
+	mat4 modelview, normal;
+	vec4 color;
+	uint id;
+};
+layout (std430, binding = 0) readonly buffer Draws {
+	Draw draws[];
+};
+
+uniform mat4 proj;
+
+smooth out vec3 f_norm;
+flat out uint f_id;
+flat out vec4 f_color;
+
+void main() {
+	Draw d = draws[i_draw];
+	f_id = d.id;
+	f_color = d.color;
+	f_norm = (d.normal * vec4(v_norm, 0.0f)).xyz;
+	gl_Position = proj * d.modelview * vec4(v_pos, 1.0f);
+})";
+const std::string batch_f = R"(
+#version 430 core
+
+layout (location = 0) out vec4 out_col;
+layout (location = 1) out vec4 out_id;
+
+smooth in vec3 f_norm;
+flat in uint f_id;
+flat in vec4 f_color;
+
+void main() {
+	out_id = vec4((f_id & 0xffu) / 255.0f, ((f_id >> 8) & 0xffu) / 255.0f, ((f_id >> 16) & 0xffu) / 255.0f, 1.0f);
+	if(f_color.w > 0.0f) {
+		out_col = vec4(f_color.rgb, 1.0f);
+	} else {
+		float ndotl = abs(normalize(f_norm).z);
+		out_col = vec4((0.3f + 0.6f * ndotl) * f_color.rgb, 1.0f);
+	}
+})";
 const std::string mesh_f = R"(
 #version 330 core
 
 uniform bool solid, use_v_id;
 uniform float alpha;
 uniform uint id, sel_id, hov_id, err_id;
+uniform uint sel_ids[32];
+uniform int n_sel_ids;
 uniform vec3 color, sel_color, hov_color, err_color;
 
 layout (location = 0) out vec4 out_col;
@@ -1236,12 +2809,20 @@ layout (location = 1) out vec4 out_id;
 smooth in vec3 f_norm;
 flat in uint f_id;
 
+bool selected(uint i) {
+	if(i == sel_id) return true;
+	for(int j = 0; j < n_sel_ids; j++) {
+		if(sel_ids[j] == i) return true;
+	}
+	return false;
+}
+
 void main() {
 
 	vec3 use_color;
 	if(use_v_id) {
 		out_id = vec4((f_id & 0xffu) / 255.0f, ((f_id >> 8) & 0xffu) / 255.0f, ((f_id >> 16) & 0xffu) / 255.0f, 1.0f);
-        if(f_id == sel_id) {
+        if(selected(f_id)) {
             use_color = sel_color;
         } else if(f_id == hov_id) {
             use_color = hov_color;
@@ -1252,7 +2833,7 @@ void main() {
         }
 	} else {
 		out_id = vec4((id & 0xffu) / 255.0f, ((id >> 8) & 0xffu) / 255.0f, ((id >> 16) & 0xffu) / 255.0f, 1.0f);
-        if(id == sel_id) {
+        if(selected(id)) {
             use_color = sel_color;
         } else if(id == hov_id) {
             use_color = hov_color;
@@ -1315,6 +2896,141 @@ void main() {
 	}
 	else discard;
 })";
+const std::string preview_v = R"(
+#version 330 core
+
+layout (location = 0) in vec3 v_pos;
+layout (location = 1) in vec3 v_norm;
+
+uniform mat4 mvp, modelview, normal;
+
+smooth out vec3 f_pos;
+smooth out vec3 f_norm;
+
+void main() {
+	f_pos = (modelview * vec4(v_pos, 1.0f)).xyz;
+	f_norm = (normal * vec4(v_norm, 0.0f)).xyz;
+	gl_Position = mvp * vec4(v_pos, 1.0f);
+})";
+const std::string preview_f = R"(
+#version 330 core
+
+#define PI 3.1415926535f
+#define TAU 6.28318530718f
+#define MAX_LIGHTS 16
+
+uniform uint id, sel_id, hov_id;
+uniform vec3 sel_color, hov_color;
+
+// In the order of Material_Type
+uniform int type;
+uniform vec3 albedo, reflectance, transmittance, emissive;
+uniform float ior;
+
+// In view space. Types: 0 directional (dir points toward it), 1 point, 2 spot (dir
+// is its axis; cone the angles in degrees over which it fades out)
+uniform int n_lights;
+uniform int light_type[MAX_LIGHTS];
+uniform vec3 light_pos[MAX_LIGHTS], light_dir[MAX_LIGHTS], light_rad[MAX_LIGHTS];
+uniform vec2 light_cone[MAX_LIGHTS];
+
+// Types: 0 none, 1 env_color (above the horizon only if env_hemi), 2 env_map. The
+// irradiance it casts is kept as spherical harmonics, pre-scaled by 1/pi.
+uniform int env_type;
+uniform bool env_hemi;
+uniform vec3 env_color;
+uniform sampler2D env_map;
+uniform vec3 env_sh[9];
+uniform mat4 view_to_world;
+uniform float exposure;
+
+layout (location = 0) out vec4 out_col;
+layout (location = 1) out vec4 out_id;
+
+smooth in vec3 f_pos;
+smooth in vec3 f_norm;
+
+vec3 environment(vec3 dir) {
+	vec3 d = normalize((view_to_world * vec4(dir, 0.0f)).xyz);
+	if(env_type == 1) {
+		return env_hemi && d.y <= 0.0f ? vec3(0.0f) : env_color;
+	} else if(env_type == 2) {
+		float phi = atan(d.z, d.x);
+		if(phi < 0.0f) phi += TAU;
+		float theta = acos(clamp(d.y, -1.0f, 1.0f));
+		return texture(env_map, vec2(phi / TAU, 1.0f - theta / PI)).rgb;
+	}
+	return vec3(0.0f);
+}
+
+vec3 env_diffuse(vec3 norm) {
+	vec3 n = normalize((view_to_world * vec4(norm, 0.0f)).xyz);
+	vec3 e = 0.282095f * env_sh[0];
+	e += 0.488603f * (n.y * env_sh[1] + n.z * env_sh[2] + n.x * env_sh[3]);
+	e += 1.092548f * (n.x * n.y * env_sh[4] + n.y * n.z * env_sh[5] + n.x * n.z * env_sh[7]);
+	e += 0.315392f * (3.0f * n.z * n.z - 1.0f) * env_sh[6];
+	e += 0.546274f * (n.x * n.x - n.y * n.y) * env_sh[8];
+	return max(e, vec3(0.0f));
+}
+
+vec3 direct(vec3 pos, vec3 n) {
+	vec3 sum = vec3(0.0f);
+	for(int i = 0; i < n_lights; i++) {
+		vec3 l = light_dir[i], rad = light_rad[i];
+		if(light_type[i] != 0) {
+			l = normalize(light_pos[i] - pos);
+		}
+		if(light_type[i] == 2) {
+			float angle = degrees(acos(clamp(dot(-l, light_dir[i]), -1.0f, 1.0f)));
+			rad *= 1.0f - smoothstep(light_cone[i].x, light_cone[i].y, angle);
+		}
+		sum += rad * max(dot(n, l), 0.0f);
+	}
+	return sum;
+}
+
+vec3 to_srgb(vec3 c) {
+	return mix(12.92f * c, 1.055f * pow(c, vec3(1.0f / 2.4f)) - 0.055f, step(0.0031308f, c));
+}
+
+void main() {
+
+	vec3 n = normalize(f_norm);
+	vec3 v = normalize(-f_pos);
+	if(dot(n, v) < 0.0f) n = -n;
+	vec3 r = reflect(-v, n);
+
+	vec3 radiance;
+	if(type == 0) {
+		radiance = albedo * (direct(f_pos, n) + env_diffuse(n));
+	} else if(type == 1) {
+		radiance = reflectance * environment(r);
+	} else if(type == 2 || type == 3) {
+		// Only the first interface: what's seen through is the environment
+		vec3 t = refract(-v, n, 1.0f / ior);
+		vec3 through = t == vec3(0.0f) ? environment(r) : transmittance * environment(t);
+		if(type == 2) {
+			radiance = through;
+		} else {
+			float r0 = (1.0f - ior) / (1.0f + ior);
+			r0 *= r0;
+			float fresnel = r0 + (1.0f - r0) * pow(1.0f - dot(n, v), 5.0f);
+			radiance = mix(through, reflectance * environment(r), fresnel);
+		}
+	} else {
+		radiance = emissive;
+	}
+
+	vec3 color = to_srgb(clamp(1.0f - exp(-radiance * exposure), 0.0f, 1.0f));
+	if(id == sel_id) {
+		color = mix(color, sel_color, 0.5f);
+	} else if(id == hov_id) {
+		color = mix(color, hov_color, 0.5f);
+	}
+
+	out_id = vec4((id & 0xffu) / 255.0f, ((id >> 8) & 0xffu) / 255.0f, ((id >> 16) & 0xffu) / 255.0f, 1.0f);
+	out_col = vec4(color, 1.0f);
+})";
 
 } // namespace Shaders
 } // namespace GL
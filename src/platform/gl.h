@@ -1,8 +1,11 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "../lib/mathlib.h"
@@ -28,6 +31,12 @@ void global_params();
 void clear_screen(Vec4 col);
 void viewport(Vec2 dim);
 int max_msaa();
+// Whether the context has compute shaders, storage buffers and image load/store (GL 4.3)
+bool compute_supported();
+// Existing directory to keep linked shader programs in, keyed on the driver and their
+// sources, so that later launches skip compiling them; empty (the default) for none.
+// Set before setup(), which compiles the first of them.
+void set_shader_cache(const std::string& dir);
 
 enum class Opt { wireframe, offset, culling, depth_write };
 
@@ -36,6 +45,13 @@ void disable(Opt opt);
 
 void color_mask(bool enable);
 
+// Draw calls and triangles submitted by the classes below, for frame statistics;
+// whoever shows them resets them each frame
+struct Draw_Stats {
+    uint64_t draws = 0, triangles = 0;
+};
+inline Draw_Stats draw_stats;
+
 using TexID = GLuint;
 
 class Tex2D {
@@ -49,11 +65,49 @@ public:
     void operator=(Tex2D&& src);
 
     void image(int w, int h, unsigned char* img);
+    // Linear RGB (e.g. an environment map), kept as half floats
+    void image(int w, int h, const float* rgb);
+    // Rewrites columns [x0, x1) of each span within rows [y0, y1) from img, laid out as
+    // the last image() was. The rows are staged once, for however many spans.
+    void sub_image(const unsigned char* img, int y0, int y1,
+                   const std::vector<std::pair<int, int>>& spans);
     TexID get_id() const;
     void bind(int idx = 0) const;
 
+    // Storage for compute shaders to write, as RGBA32F (hdr) or RGBA8, left undefined
+    void storage(int w, int h, bool hdr);
+    // Binds level 0 to an image unit, e.g. GL_READ_WRITE, in the format storage() gave
+    void bind_image(int unit, GLenum access) const;
+    // Reads back an RGBA32F texture, bottom row first
+    void read(std::vector<float>& rgba) const;
+
 private:
     GLuint id;
+    int w = 0, h = 0;
+    bool hdr = false;
+};
+
+// Element ranges of a buffer written since its last upload, so small edits to large
+// buffers only re-upload what changed. Falls back to the whole buffer once edits
+// are too scattered to be worth tracking.
+class Dirty_Ranges {
+public:
+    void add(size_t begin, size_t end);
+    void clear();
+
+    bool empty() const {
+        return ranges.empty() && !all;
+    }
+    // Sorts and merges the ranges; returns false if everything should be uploaded
+    bool coalesce(size_t size);
+    const std::vector<std::pair<size_t, size_t>>& get() const {
+        return ranges;
+    }
+
+private:
+    static constexpr size_t max_ranges = 64;
+    std::vector<std::pair<size_t, size_t>> ranges;
+    bool all = false;
 };
 
 class Mesh {
@@ -65,8 +119,19 @@ public:
         GLuint id;
     };
 
+    // The joints influencing a vertex, by index into a palette of joint matrices, and
+    // their weights, for skinning in the vertex shader (see Shaders::skin_v). Unused
+    // slots have weight zero.
+    static constexpr size_t max_influences = 8;
+    struct Skin {
+        GLuint joints[max_influences];
+        float weights[max_influences];
+    };
+
     Mesh();
     Mesh(std::vector<Vert>&& vertices, std::vector<Index>&& indices);
+    // Shares buffers held elsewhere, as copies do
+    Mesh(std::shared_ptr<std::vector<Vert>> vertices, std::shared_ptr<std::vector<Index>> indices);
     Mesh(const Mesh& src) = delete;
     Mesh(Mesh&& src);
     ~Mesh();
@@ -78,29 +143,125 @@ public:
     void render();
 
     void recreate(std::vector<Vert>&& vertices, std::vector<Index>&& indices);
+    // New vertices over the same triangles as topology, sharing its indices
+    void recreate(std::vector<Vert>&& vertices, const Mesh& topology);
+    // Vertices held elsewhere (see share_verts) over topology's triangles, for a mesh
+    // that had them at the given revision
+    void recreate(std::shared_ptr<const std::vector<Vert>> vertices, const Mesh& topology,
+                  uint64_t revision);
+
+    // Vertices and indices are shared between copies until one of them is edited,
+    // so copies are cheap snapshots. Editing first makes this mesh's data unique.
     std::vector<Vert>& edit_verts();
     std::vector<Index>& edit_indices();
+    // For changing only the vertices in [begin, end), without resizing
+    std::vector<Vert>& edit_verts(size_t begin, size_t end);
     Mesh copy() const;
 
     BBox bbox() const;
     const std::vector<Vert>& verts() const;
     const std::vector<Index>& indices() const;
+    // For holding on to the indices as they are now, without a copy
+    std::shared_ptr<const std::vector<Index>> share_indices() const;
+    std::shared_ptr<const std::vector<Vert>> share_verts() const;
     GLuint tris() const;
+    // CPU copies of the vertices, indices and skin. Copies share these until edited,
+    // so buffers already in seen are not counted again.
+    size_t bytes(std::unordered_set<const void*>& seen) const;
+
+    // Changes (to a value never used before) whenever the vertices or indices do, so
+    // that whatever was derived from the mesh at one revision is still good at it
+    uint64_t revision() const;
+
+    // The buffers and revision as they are now, without the GL objects, so that other
+    // threads can read them while this mesh is edited (which copies them first)
+    struct Data {
+        std::shared_ptr<const std::vector<Vert>> verts;
+        std::shared_ptr<const std::vector<Index>> indices;
+        uint64_t revision = 0;
+    };
+    Data data() const;
+
+    // Gives each vertex its joint influences, uploaded once as extra attributes;
+    // an empty skin removes them
+    void set_skin(std::vector<Skin>&& skin);
+    bool has_skin() const;
 
 private:
     void update();
+    void update_skin();
     void create();
     void destroy();
 
     BBox _bbox;
-    GLuint vao = 0, vbo = 0, ebo = 0;
+    GLuint vao = 0, vbo = 0, ebo = 0, skin_vbo = 0;
     GLuint n_elem = 0;
-    bool dirty = true;
+    uint64_t _revision = 0;
+    bool dirty = true, skin_dirty = false;
+    Dirty_Ranges dirty_verts;
 
-    std::vector<Vert> _verts;
-    std::vector<Index> _idxs;
+    std::shared_ptr<std::vector<Vert>> _verts;
+    std::shared_ptr<std::vector<Index>> _idxs;
+    std::shared_ptr<const std::vector<Skin>> _skin;
 
     friend class Instances;
+    friend class Point_Instances;
+};
+
+// Many static meshes drawn with one call (GL 4.5). Each mesh's vertices and indices
+// are copied once (per revision) into shared buffers, and each frame's queued draws
+// are issued by glMultiDrawElementsIndirect, with a record per draw (transforms,
+// color, id) that the shader reads from a storage buffer. The shared buffers are
+// repacked once most of what they hold is no longer drawn.
+class Mesh_Batch {
+public:
+    // Laid out as the shader's std430 Draw struct
+    struct Draw {
+        Mat4 modelview, normal;
+        Vec4 color; // w: whether to skip shading
+        GLuint id;
+        GLuint pad[3];
+    };
+
+    Mesh_Batch();
+    Mesh_Batch(const Mesh_Batch& src) = delete;
+    ~Mesh_Batch();
+
+    void operator=(const Mesh_Batch& src) = delete;
+
+    static bool supported();
+    // The mesh must live until render()
+    void add(const Mesh& mesh, const Draw& draw);
+    // Draws everything added since the last call, with the batch shader bound
+    void render();
+
+private:
+    struct Slot {
+        GLuint first, count;
+        GLint base;
+        uint64_t frame;
+    };
+    struct Command {
+        GLuint count, instances, first;
+        GLint base;
+        GLuint base_instance;
+    };
+
+    void create();
+    void destroy();
+    void attach();
+    const Slot& slot(const Mesh& mesh);
+    static bool grow(GLuint& buf, size_t& cap, size_t used, size_t need, size_t size);
+
+    GLuint vao = 0, vbo = 0, ebo = 0, draw_ids = 0, draw_buf = 0, cmd_buf = 0;
+    size_t n_verts = 0, n_idxs = 0, vert_cap = 0, idx_cap = 0, id_cap = 0;
+    size_t live_verts = 0;
+    uint64_t frame = 1;
+
+    std::unordered_map<uint64_t, Slot> slots;
+    std::vector<const Mesh*> meshes;
+    std::vector<Draw> draws;
+    std::vector<Command> commands;
 };
 
 class Instances {
@@ -119,8 +280,12 @@ public:
     };
 
     void render();
+    // Instances added within the room the buffer was last sized to are uploaded
+    // like edits, as ranges
     size_t add(const Mat4& transform, GLuint id = 0);
     Info& get(size_t idx);
+    // Replaces every instance, uploading only those that differ from before
+    void set(const std::vector<Info>& infos);
     void clear(size_t n = 0);
     const Mesh& mesh() const;
 
@@ -131,11 +296,54 @@ private:
 
     GLuint vbo = 0;
     bool dirty = false;
+    Dirty_Ranges dirty_data;
+    size_t capacity = 0;
 
     Mesh _mesh;
     std::vector<Info> data;
 };
 
+// Instances that are only translated and uniformly scaled (e.g. particles): each is
+// a position and scale, 16 bytes, that the vertex shader expands instead of a matrix.
+// With GL 4.5 they are written straight into a persistently mapped ring of buffers,
+// each fenced until the draws reading it finish; older contexts upload a copy.
+class Point_Instances {
+public:
+    Point_Instances(GL::Mesh&& mesh);
+    Point_Instances(const Point_Instances& src) = delete;
+    Point_Instances(Point_Instances&& src);
+    ~Point_Instances();
+
+    void operator=(const Point_Instances& src) = delete;
+    void operator=(Point_Instances&& src);
+
+    void render();
+    // Replaces every instance with one per point
+    void set(const std::vector<Vec3>& points, float scale);
+    void clear();
+    const Mesh& mesh() const;
+
+private:
+    static constexpr size_t ring_size = 3;
+
+    void create();
+    void destroy();
+    void reserve(size_t n);
+    void update();
+
+    GLuint vbo = 0;
+    bool dirty = false, persistent = false;
+    Mesh _mesh;
+
+    size_t count = 0, capacity = 0, slot = 0;
+    Vec4* mapped = nullptr;
+    GLsync fences[ring_size] = {};
+    std::vector<Vec4> data;
+};
+
+// Lines are only ever appended between clears, so each upload copies just the lines
+// added since the last one, into a buffer grown geometrically. A cap bounds how many
+// are kept, as visualizations (BVHs, ray logs) can easily generate millions.
 class Lines {
 public:
     struct Vert {
@@ -158,16 +366,74 @@ public:
     void pop();
     void clear();
 
+    // May be called from any thread (e.g. render workers); the lines are kept aside
+    // until take_shared() moves them in, on the GL thread
+    void add_shared(Vec3 start, Vec3 end, Vec3 color);
+    void take_shared();
+
+    // Lines added past the cap are dropped
+    void cap(size_t max_lines);
+    bool capped() const;
+
 private:
+    struct Shared;
+
     void create();
     void destroy();
     void update() const;
+    bool reserve();
 
-    mutable bool dirty = false;
     float thickness = 0.0f;
     GLuint vao = 0, vbo = 0;
+    mutable size_t uploaded = 0, capacity = 0;
 
     std::vector<Vert> vertices;
+    std::unique_ptr<Shared> shared;
+};
+
+// A uniform buffer, holding the data of a uniform block; bind it to the binding
+// point the block was given with Shader::uniform_block
+class Uniforms {
+public:
+    Uniforms();
+    Uniforms(const Uniforms& src) = delete;
+    Uniforms(Uniforms&& src);
+    ~Uniforms();
+
+    void operator=(const Uniforms& src) = delete;
+    void operator=(Uniforms&& src);
+
+    void set(const void* data, size_t bytes);
+    void bind(GLuint binding) const;
+
+private:
+    void create();
+    void destroy();
+
+    GLuint ubo = 0;
+    size_t size = 0;
+};
+
+// A shader storage buffer, bound to the binding point of a std430 buffer block
+class Storage {
+public:
+    Storage();
+    Storage(const Storage& src) = delete;
+    Storage(Storage&& src);
+    ~Storage();
+
+    void operator=(const Storage& src) = delete;
+    void operator=(Storage&& src);
+
+    void set(const void* data, size_t bytes);
+    void bind(GLuint binding) const;
+
+private:
+    void create();
+    void destroy();
+
+    GLuint ssbo = 0;
+    size_t size = 0;
 };
 
 class Shader {
@@ -183,23 +449,50 @@ public:
 
     void bind() const;
     void load(std::string vertex, std::string fragment);
-
-    void uniform(std::string name, const Mat4& mat) const;
-    void uniform(std::string name, Vec3 vec3) const;
-    void uniform(std::string name, Vec2 vec2) const;
-    void uniform(std::string name, GLint i) const;
-    void uniform(std::string name, GLuint i) const;
-    void uniform(std::string name, GLfloat f) const;
-    void uniform(std::string name, bool b) const;
-    void uniform(std::string name, int count, const Vec2 items[]) const;
+    // A compute program instead (see compute_supported)
+    void load_compute(std::string compute);
+    bool loaded() const {
+        return program != 0;
+    }
+    // Runs a bound compute program over groups, then makes its image and buffer writes
+    // visible to whatever reads them next
+    void dispatch(GLuint x, GLuint y, GLuint z = 1) const;
+
+    // Uniforms are looked up in a table of the program's active uniforms made when
+    // it's linked, and values that are already set aren't sent again, so setting
+    // the same shared values (projection, colors...) for every draw costs little
+    void uniform(std::string_view name, const Mat4& mat) const;
+    void uniform(std::string_view name, Vec3 vec3) const;
+    void uniform(std::string_view name, Vec2 vec2) const;
+    void uniform(std::string_view name, GLint i) const;
+    void uniform(std::string_view name, GLuint i) const;
+    void uniform(std::string_view name, GLfloat f) const;
+    void uniform(std::string_view name, bool b) const;
+    void uniform(std::string_view name, int count, const Vec2 items[]) const;
+    void uniform(std::string_view name, int count, const Vec3 items[]) const;
+    void uniform(std::string_view name, int count, const GLint items[]) const;
+    void uniform(std::string_view name, int count, const GLuint items[]) const;
     void uniform_block(std::string name, GLuint i) const;
 
 private:
-    GLuint loc(std::string name) const;
+    struct Uniform {
+        std::string name;
+        GLint loc = -1;
+        // The last value set, if any (arrays are always sent)
+        size_t size = 0;
+        alignas(16) unsigned char value[sizeof(Mat4)];
+    };
+
+    // The location of name, or -1 if it isn't an active uniform or already holds value
+    template<typename T> GLint loc(std::string_view name, const T& value) const;
+    GLint loc(std::string_view name) const;
+    void find_uniforms();
     static bool validate(GLuint program);
 
     GLuint program = 0;
+    // A compute program keeps its shader in v
     GLuint v = 0, f = 0;
+    mutable std::vector<Uniform> uniforms;
 
     void destroy();
 };
@@ -233,6 +526,8 @@ public:
     bool can_read_at() const;
     void read_at(int buf, int x, int y, GLubyte* data) const;
     void read(int buf, GLubyte* data) const;
+    // Reads the depth of a single-sampled framebuffer as normalized device z
+    void read_depth(std::vector<float>& data) const;
 
     void blit_to_screen(int buf, Vec2 dim) const;
     void blit_to(int buf, const Framebuffer& fb, bool avg = true) const;
@@ -252,6 +547,94 @@ private:
     bool depth = true;
 
     friend class Effects;
+    friend class Readback;
+};
+
+// Copies small regions of a framebuffer output into a ring of pixel buffers, so
+// they can be read back a frame or two later without waiting on the GPU.
+class Readback {
+public:
+    static constexpr int max_side = 16;
+
+    Readback();
+    Readback(const Readback& src) = delete;
+    ~Readback();
+
+    void operator=(const Readback& src) = delete;
+
+    // Queues a copy of the w*h (at most max_side square) region at (x, y) of an
+    // output of fb, which must not be multisampled
+    void request(const Framebuffer& fb, int buf, int x, int y, int w, int h);
+    // Takes the newest queued copy the GPU has finished, if any, without waiting
+    bool poll();
+    // The RGBA pixel at (x, y) of the last region taken, or null if outside it
+    const GLubyte* at(int x, int y) const;
+
+private:
+    static constexpr int ring_size = 3;
+
+    struct Slot {
+        GLuint pbo = 0;
+        GLsync fence = nullptr;
+        uint64_t seq = 0;
+        int x = 0, y = 0, w = 0, h = 0;
+    };
+
+    void create();
+    void destroy();
+
+    Slot slots[ring_size];
+    int next = 0;
+    uint64_t seq = 0;
+
+    int x = 0, y = 0, w = 0, h = 0;
+    GLubyte data[max_side * max_side * 4] = {};
+};
+
+// Times the GPU work of a frame's passes with GL_TIME_ELAPSED queries, reading each
+// frame's results a few frames later, once ready, so timing never stalls. Only one
+// pass is timed at a time: starting a pass ends the last, and passes of the same name
+// within a frame are summed.
+class Timer_Queries {
+public:
+    static constexpr int max_passes = 64;
+
+    Timer_Queries();
+    Timer_Queries(const Timer_Queries& src) = delete;
+    ~Timer_Queries();
+
+    void operator=(const Timer_Queries& src) = delete;
+
+    void begin_frame();
+    // Does nothing outside a frame, or once the frame has max_passes passes (the
+    // rest of its work counts toward the last)
+    void pass(const char* name);
+    void end_frame();
+
+    // Milliseconds per pass of the newest frame the GPU has finished
+    const std::vector<std::pair<const char*, float>>& results() const {
+        return times;
+    }
+
+private:
+    static constexpr int ring_size = 4;
+
+    struct Frame {
+        GLuint queries[max_passes] = {};
+        const char* names[max_passes] = {};
+        int n = 0;
+        bool pending = false;
+    };
+
+    void create();
+    void destroy();
+    void poll();
+
+    Frame frames[ring_size];
+    int next = 0;
+    bool in_frame = false;
+    const char* current = nullptr;
+    std::vector<std::pair<const char*, float>> times;
 };
 
 class Effects {
@@ -283,8 +666,20 @@ private:
 namespace Shaders {
 extern const std::string line_v, line_f;
 extern const std::string mesh_v, mesh_f;
-extern const std::string inst_v;
+extern const std::string inst_v, point_inst_v;
+extern const std::string batch_v, batch_f;
 extern const std::string dome_v, dome_f;
 
+// Approximates the path tracer's materials under its delta lights and environment
+// (see Renderer::begin_preview); takes up to max_preview_lights delta lights
+extern const std::string preview_v, preview_f;
+constexpr int max_preview_lights = 16;
+
+// Takes Mesh::Skin attributes and a Joints uniform block of max_joints matrices
+extern const std::string skin_v;
+// As skin_v, with max_joints dual quaternions (real then dual part) in the block
+extern const std::string skin_dq_v;
+constexpr size_t max_joints = 256;
+
 } // namespace Shaders
 } // namespace GL
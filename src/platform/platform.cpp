@@ -1,5 +1,6 @@
 
 #include "../lib/log.h"
+#include "../util/profiler.h"
 
 #include "font.dat"
 #include "gl.h"
@@ -10,15 +11,24 @@
 #include <imgui/imgui_impl_opengl3.h>
 #include <imgui/imgui_impl_sdl.h>
 
+#include <cmath>
+
 #ifdef _WIN32
 #include <ConsoleApi.h>
 #include <ShellScalingApi.h>
+#include <psapi.h>
 extern "C" {
 __declspec(dllexport) bool NvOptimusEnablement = true;
 __declspec(dllexport) bool AmdPowerXpressRequestHighPerformance = true;
 }
 #else
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#endif
+
+#ifdef SCOTTY3D_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #endif
 
 int Platform::console_width() {
@@ -35,6 +45,22 @@ int Platform::console_width() {
     return cols;
 }
 
+size_t Platform::peak_memory() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+    return pmc.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage)) return 0;
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
 void Platform::remove_console() {
 #ifdef _WIN32
     FreeConsole();
@@ -169,8 +195,12 @@ void Platform::platform_shutdown() {
 void Platform::complete_frame() {
 
     GL::Framebuffer::bind_screen();
-    ImGui::Render();
-    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    {
+        PROFILE_ZONE("Submit UI");
+        ImGui::Render();
+        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    }
+    PROFILE_ZONE("Swap");
     SDL_GL_SwapWindow(window);
 }
 
@@ -192,13 +222,34 @@ void Platform::strcpy(char* dst, const char* src, size_t limit) {
 
 void Platform::loop(App& app) {
 
+    // Frames are only drawn when something may have changed: for a moment after each
+    // event, as the UI takes a few frames to settle (and shows tooltips after a
+    // delay), then as often as the app asks for them. Otherwise the loop sleeps until
+    // the next event, leaving the CPU and GPU to renders running in the background.
+    const double settle = 0.5;
+    double freq = (double)SDL_GetPerformanceFrequency();
+    Uint64 last_event = SDL_GetPerformanceCounter(), last_frame = 0;
+
     bool running = true;
     while(running) {
 
+        Uint64 now = SDL_GetPerformanceCounter();
+        if((double)(now - last_event) / freq >= settle) {
+            double interval = app.redraw_interval();
+            double wait = interval - (double)(now - last_frame) / freq;
+            if(std::isinf(interval)) {
+                SDL_WaitEvent(nullptr);
+            } else if(wait > 0.0) {
+                SDL_WaitEventTimeout(nullptr, (int)std::ceil(wait * 1000.0));
+            }
+        }
+
+        PROFILE_ZONE("Frame");
         set_dpi();
         SDL_Event e;
         while(SDL_PollEvent(&e)) {
 
+            last_event = SDL_GetPerformanceCounter();
             ImGui_ImplSDL2_ProcessEvent(&e);
 
             switch(e.type) {
@@ -213,6 +264,7 @@ void Platform::loop(App& app) {
         begin_frame();
         app.render();
         complete_frame();
+        last_frame = SDL_GetPerformanceCounter();
     }
 }
 
@@ -259,3 +311,137 @@ void Platform::release_mouse() {
 void Platform::set_mouse(Vec2 pos) {
     SDL_WarpMouseInWindow(window, (int)pos.x, (int)pos.y);
 }
+
+Headless_GL::Headless_GL() {
+
+    if(!create_egl() && !create_sdl()) {
+        warn("Failed to create a headless OpenGL context.");
+        return;
+    }
+    GL::setup();
+    info("Rasterizing with OpenGL %s (%s)", GL::version().c_str(), GL::renderer().c_str());
+}
+
+Headless_GL::~Headless_GL() {
+
+    if(ok()) GL::shutdown();
+
+#ifdef SCOTTY3D_EGL
+    if(egl_context) {
+        eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(egl_display, egl_context);
+        eglTerminate(egl_display);
+    }
+#endif
+    if(gl_context) SDL_GL_DeleteContext(gl_context);
+    if(window) {
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+    }
+    egl_display = egl_context = nullptr;
+    gl_context = nullptr;
+    window = nullptr;
+}
+
+bool Headless_GL::ok() const {
+    return egl_context || gl_context;
+}
+
+bool Headless_GL::create_egl() {
+#ifdef SCOTTY3D_EGL
+    // Mesa's surfaceless platform runs on render nodes without a display; other
+    // drivers may still offer their default display
+    EGLDisplay display = EGL_NO_DISPLAY;
+    auto get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if(get_platform_display) {
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    }
+    if(display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if(display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr)) {
+        info("No EGL display, trying a hidden window.");
+        return false;
+    }
+
+    EGLint config_attribs[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    EGLConfig config = nullptr;
+    EGLint n_configs = 0;
+    if(!eglBindAPI(EGL_OPENGL_API) ||
+       !eglChooseConfig(display, config_attribs, &config, 1, &n_configs) || n_configs < 1) {
+        info("No EGL config for desktop OpenGL, trying a hidden window.");
+        eglTerminate(display);
+        return false;
+    }
+
+    EGLContext context = EGL_NO_CONTEXT;
+    for(auto [major, minor] : {std::pair{4, 5}, std::pair{4, 1}, std::pair{3, 3}}) {
+        EGLint context_attribs[] = {EGL_CONTEXT_MAJOR_VERSION,
+                                    major,
+                                    EGL_CONTEXT_MINOR_VERSION,
+                                    minor,
+                                    EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                                    EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                    EGL_NONE};
+        context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+        if(context != EGL_NO_CONTEXT) break;
+    }
+    // Everything is drawn into framebuffer objects, so no surface is needed
+    if(context == EGL_NO_CONTEXT ||
+       !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        info("Failed to create an EGL context, trying a hidden window.");
+        if(context != EGL_NO_CONTEXT) eglDestroyContext(display, context);
+        eglTerminate(display);
+        return false;
+    }
+
+    egl_display = display;
+    egl_context = context;
+    if(!gladLoadGLLoader((GLADloadproc)eglGetProcAddress)) {
+        die("Failed to load OpenGL functions.");
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Headless_GL::create_sdl() {
+
+    if(SDL_Init(SDL_INIT_VIDEO) != 0) {
+        warn("Failed to initialize SDL: %s", SDL_GetError());
+        return false;
+    }
+
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_FORWARD_COMPATIBLE_FLAG);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+
+    window = SDL_CreateWindow("Scotty3D", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1, 1,
+                              SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+    if(!window) {
+        warn("Failed to create window: %s", SDL_GetError());
+        SDL_Quit();
+        return false;
+    }
+
+    auto context = [&](int major, int minor) {
+        if(gl_context) return;
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, major);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, minor);
+        gl_context = SDL_GL_CreateContext(window);
+    };
+#ifndef __APPLE__
+    context(4, 5);
+#endif
+    context(4, 1);
+    context(3, 3);
+    if(!gl_context) {
+        warn("Failed to create OpenGL 3.3 context (%s)", SDL_GetError());
+        return false;
+    }
+
+    SDL_GL_MakeCurrent(window, gl_context);
+    if(!gladLoadGL()) {
+        die("Failed to load OpenGL functions.");
+    }
+    return true;
+}
@@ -27,6 +27,8 @@ public:
 
     static void remove_console();
     static int console_width();
+    // Most physical memory the process has held, in bytes
+    static size_t peak_memory();
     static void strcpy(char* dest, const char* src, size_t limit);
 
 private:
@@ -43,3 +45,26 @@ private:
     SDL_GLContext gl_context = nullptr;
     const Uint8* keybuf = nullptr;
 };
+
+// An OpenGL context with no window, for rasterizing renders without the GUI. Built
+// with SCOTTY3D_EGL, it is a surfaceless EGL context, which needs no display server;
+// otherwise it belongs to a hidden SDL window.
+class Headless_GL {
+public:
+    Headless_GL();
+    ~Headless_GL();
+
+    Headless_GL(const Headless_GL& src) = delete;
+    void operator=(const Headless_GL& src) = delete;
+
+    bool ok() const;
+
+private:
+    bool create_egl();
+    bool create_sdl();
+
+    SDL_Window* window = nullptr;
+    SDL_GLContext gl_context = nullptr;
+    void* egl_display = nullptr;
+    void* egl_context = nullptr;
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "../lib/mathlib.h"
+#include "trace.h"
+
+namespace PT {
+
+// An instance's object-to-world transform, stored as the 3x4 affine part of its Mat4
+// together with the rows of its inverse. Those rows are also the columns of the normal
+// matrix (the inverse transpose), so normals need no matrix of their own. Instances
+// placed without a transform are flagged as identity and should skip it altogether.
+class Affine {
+public:
+    Affine() = default;
+    explicit Affine(const Mat4& T) {
+        set(T);
+    }
+
+    // T must be affine (bottom row 0 0 0 1), so its linear part is inverted directly.
+    void set(const Mat4& T) {
+        id = T == Mat4::I;
+        for(int i = 0; i < 4; i++) cols[i] = T[i].xyz();
+        Vec3 r0 = cross(cols[1], cols[2]), r1 = cross(cols[2], cols[0]);
+        Vec3 r2 = cross(cols[0], cols[1]);
+        float inv_det = 1.0f / dot(cols[0], r0);
+        inv_rows[0] = r0 * inv_det;
+        inv_rows[1] = r1 * inv_det;
+        inv_rows[2] = r2 * inv_det;
+        inv_trans = -inverse_vector(cols[3]);
+    }
+
+    bool identity() const {
+        return id;
+    }
+
+    Mat4 matrix() const {
+        return Mat4{Vec4{cols[0], 0.0f}, Vec4{cols[1], 0.0f}, Vec4{cols[2], 0.0f},
+                    Vec4{cols[3], 1.0f}};
+    }
+    Mat4 inverse() const {
+        Mat4 ret = Mat4::I;
+        for(int i = 0; i < 3; i++) {
+            for(int j = 0; j < 3; j++) ret[j][i] = inv_rows[i][j];
+        }
+        ret[3] = Vec4{inv_trans, 1.0f};
+        return ret;
+    }
+
+    Vec3 point(Vec3 p) const {
+        return vector(p) + cols[3];
+    }
+    Vec3 vector(Vec3 v) const {
+        return cols[0] * v.x + cols[1] * v.y + cols[2] * v.z;
+    }
+    Vec3 normal(Vec3 n) const {
+        return (inv_rows[0] * n.x + inv_rows[1] * n.y + inv_rows[2] * n.z).unit();
+    }
+    Vec3 inverse_point(Vec3 p) const {
+        return inverse_vector(p) + inv_trans;
+    }
+    Vec3 inverse_vector(Vec3 v) const {
+        return Vec3{dot(inv_rows[0], v), dot(inv_rows[1], v), dot(inv_rows[2], v)};
+    }
+
+    // Moves a world-space ray into object space as Ray::transform(inverse()) would,
+    // returning the factor by which distances along it were scaled.
+    float localize(Ray& ray) const {
+        ray.point = inverse_point(ray.point);
+        Vec3 dir = inverse_vector(ray.dir);
+        float d = dir.norm();
+        ray.set_dir(dir / d);
+        ray.dist_bounds *= d;
+        return d;
+    }
+
+    // As Trace::transform(matrix(), inverse().T())
+    void globalize(Trace& trace) const {
+        trace.position = point(trace.position);
+        trace.origin = point(trace.origin);
+        trace.normal = normal(trace.normal);
+        trace.distance = (trace.position - trace.origin).norm();
+    }
+
+    // As BBox::transform(matrix())
+    BBox bbox(BBox box) const {
+        BBox ret(cols[3], cols[3]);
+        for(int i = 0; i < 3; i++) {
+            for(int j = 0; j < 3; j++) {
+                float a = cols[j][i] * box.min[j];
+                float b = cols[j][i] * box.max[j];
+                ret.min[i] += std::min(a, b);
+                ret.max[i] += std::max(a, b);
+            }
+        }
+        return ret;
+    }
+
+private:
+    Vec3 cols[4] = {Vec3{1.0f, 0.0f, 0.0f}, Vec3{0.0f, 1.0f, 0.0f}, Vec3{0.0f, 0.0f, 1.0f}, {}};
+    Vec3 inv_rows[3] = {Vec3{1.0f, 0.0f, 0.0f}, Vec3{0.0f, 1.0f, 0.0f}, Vec3{0.0f, 0.0f, 1.0f}};
+    Vec3 inv_trans;
+    bool id = true;
+};
+
+} // namespace PT
@@ -47,26 +47,30 @@ struct BSDF_Mirror {
 struct BSDF_Refract {
 
     BSDF_Refract(Spectrum transmittance, float ior)
-        : transmittance(transmittance), index_of_refraction(ior) {
+        : transmittance(transmittance), index_of_refraction(ior), inv_ior(1.0f / ior) {
     }
 
     Scatter scatter(Vec3 out_dir) const;
 
     Spectrum transmittance;
-    float index_of_refraction;
+    float index_of_refraction, inv_ior;
 };
 
 struct BSDF_Glass {
 
     BSDF_Glass(Spectrum transmittance, Spectrum reflectance, float ior)
-        : transmittance(transmittance), reflectance(reflectance), index_of_refraction(ior) {
+        : transmittance(transmittance), reflectance(reflectance), index_of_refraction(ior),
+          inv_ior(1.0f / ior), transmit_enter(transmittance / (ior * ior)),
+          transmit_exit(transmittance * ior * ior) {
     }
 
     Scatter scatter(Vec3 out_dir) const;
 
     Spectrum transmittance;
     Spectrum reflectance;
-    float index_of_refraction;
+    float index_of_refraction, inv_ior;
+    // Refracted attenuation scaled by (n2/n1)^2 for either side of the surface
+    Spectrum transmit_enter, transmit_exit;
 };
 
 struct BSDF_Diffuse {
@@ -82,14 +86,19 @@ struct BSDF_Diffuse {
 class BSDF {
 public:
     BSDF(BSDF_Lambertian&& b) : underlying(std::move(b)) {
+        classify();
     }
     BSDF(BSDF_Mirror&& b) : underlying(std::move(b)) {
+        classify();
     }
     BSDF(BSDF_Glass&& b) : underlying(std::move(b)) {
+        classify();
     }
     BSDF(BSDF_Diffuse&& b) : underlying(std::move(b)) {
+        classify();
     }
     BSDF(BSDF_Refract&& b) : underlying(std::move(b)) {
+        classify();
     }
 
     BSDF(const BSDF& src) = delete;
@@ -121,31 +130,62 @@ public:
             underlying);
     }
 
+    // These are queried at every hit, so they are resolved once at construction
     Spectrum emissive() const {
-        return std::visit(overloaded{[](const BSDF_Diffuse& d) { return d.emissive(); },
-                                     [](const auto& b) { return Spectrum{}; }},
-                          underlying);
+        return emission;
     }
-
     bool is_discrete() const {
-        return std::visit(overloaded{[](const BSDF_Lambertian&) { return false; },
-                                     [](const BSDF_Diffuse&) { return false; },
-                                     [](const BSDF_Mirror&) { return true; },
-                                     [](const BSDF_Glass&) { return true; },
-                                     [](const BSDF_Refract&) { return true; }},
-                          underlying);
+        return discrete;
     }
-
     bool is_sided() const {
-        return std::visit(overloaded{[](const BSDF_Lambertian&) { return false; },
-                                     [](const BSDF_Mirror&) { return false; },
-                                     [](const BSDF_Glass&) { return true; },
-                                     [](const BSDF_Diffuse&) { return false; },
-                                     [](const BSDF_Refract&) { return true; }},
-                          underlying);
+        return sided;
+    }
+    bool is_emissive() const {
+        return emitting;
+    }
+    // Fraction of light reflected (or transmitted), as seen by denoisers: white for
+    // emitters, which reflect nothing but shouldn't read as black
+    Spectrum albedo() const {
+        return reflected;
+    }
+    // Index of the underlying BSDF type, used to group hits of the same kind
+    size_t type() const {
+        return underlying.index();
+    }
+    // Calls f with the underlying BSDF, e.g. to translate it for another renderer
+    template<typename F> decltype(auto) visit(F&& f) const {
+        return std::visit(std::forward<F>(f), underlying);
     }
 
 private:
+    void classify() {
+        emission = std::visit(overloaded{[](const BSDF_Diffuse& d) { return d.emissive(); },
+                                         [](const auto& b) { return Spectrum{}; }},
+                              underlying);
+        emitting = emission.luma() > 0.0f;
+        reflected = std::visit(
+            overloaded{[](const BSDF_Lambertian& l) { return l.albedo * PI_F; },
+                       [](const BSDF_Mirror& m) { return m.reflectance; },
+                       [](const BSDF_Glass& g) { return g.transmittance; },
+                       [](const BSDF_Diffuse&) { return Spectrum{1.0f}; },
+                       [](const BSDF_Refract& r) { return r.transmittance; }},
+            underlying);
+        discrete = std::visit(overloaded{[](const BSDF_Lambertian&) { return false; },
+                                         [](const BSDF_Diffuse&) { return false; },
+                                         [](const BSDF_Mirror&) { return true; },
+                                         [](const BSDF_Glass&) { return true; },
+                                         [](const BSDF_Refract&) { return true; }},
+                              underlying);
+        sided = std::visit(overloaded{[](const BSDF_Lambertian&) { return false; },
+                                      [](const BSDF_Mirror&) { return false; },
+                                      [](const BSDF_Glass&) { return true; },
+                                      [](const BSDF_Diffuse&) { return false; },
+                                      [](const BSDF_Refract&) { return true; }},
+                           underlying);
+    }
+
+    Spectrum emission, reflected;
+    bool emitting = false, discrete = false, sided = false;
     std::variant<BSDF_Lambertian, BSDF_Mirror, BSDF_Glass, BSDF_Diffuse, BSDF_Refract> underlying;
 };
 
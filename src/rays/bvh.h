@@ -3,16 +3,199 @@
 
 #include "../lib/mathlib.h"
 #include "../platform/gl.h"
+#include "../util/thread_pool.h"
 
+#include "bvh_wide.h"
 #include "trace.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <type_traits>
+
 namespace PT {
 
+// Named trade-offs between build time and trace speed, see BVH_Options::profile
+enum class BVH_Profile : int { fast_build, balanced, best_trace, count };
+inline const char* BVH_Profile_Names[(int)BVH_Profile::count] = {"Fast Build", "Balanced",
+                                                                 "Best Trace"};
+
+struct BVH_Options {
+    enum class Method : int {
+        // Binned SAH, optionally with spatial splits
+        sah,
+        // Sorts centroids along a Morton curve: builds in O(n), but traces slower
+        lbvh
+    };
+    Method method = Method::sah;
+    size_t max_leaf_size = 4;
+    // A positive alpha enables spatial splits (SAH only, for splittable primitives),
+    // which are tried wherever the best object split's children overlap by more
+    // than this fraction of the root's surface area. ~1e-5 is a good value.
+    float spatial_alpha = 0.0f;
+    // Bins per axis when searching for SAH splits, or 0 to pick 5-20 by node size
+    size_t buckets = 0;
+
+    static BVH_Options profile(BVH_Profile profile) {
+        BVH_Options opt;
+        switch(profile) {
+        case BVH_Profile::fast_build: {
+            opt.method = Method::lbvh;
+            opt.max_leaf_size = 8;
+            opt.buckets = 8;
+        } break;
+        case BVH_Profile::best_trace: {
+            opt.max_leaf_size = 2;
+            opt.buckets = 32;
+            opt.spatial_alpha = 1e-5f;
+        } break;
+        default: break;
+        }
+        return opt;
+    }
+
+    bool operator==(const BVH_Options& o) const {
+        return method == o.method && max_leaf_size == o.max_leaf_size &&
+               spatial_alpha == o.spatial_alpha && buckets == o.buckets;
+    }
+    bool operator!=(const BVH_Options& o) const {
+        return !(*this == o);
+    }
+};
+
+// The shape of a built BVH, for tuning build options and catching asset regressions.
+// Stats of several BVHs can be summed (histograms are added bucket by bucket).
+struct BVH_Stats {
+    size_t nodes = 0, leaves = 0, primitives = 0, bytes = 0, max_depth = 0;
+    float sah_cost = 0.0f;
+    // Number of leaves at each depth, and holding each number of primitives
+    std::vector<size_t> depths, leaf_sizes;
+
+    BVH_Stats& operator+=(const BVH_Stats& s) {
+        nodes += s.nodes;
+        leaves += s.leaves;
+        primitives += s.primitives;
+        bytes += s.bytes;
+        max_depth = std::max(max_depth, s.max_depth);
+        sah_cost += s.sah_cost;
+        auto add = [](std::vector<size_t>& a, const std::vector<size_t>& b) {
+            if(a.size() < b.size()) a.resize(b.size());
+            for(size_t i = 0; i < b.size(); i++) a[i] += b[i];
+        };
+        add(depths, s.depths);
+        add(leaf_sizes, s.leaf_sizes);
+        return *this;
+    }
+};
+
+// Traversal work, counted in thread-local storage while enabled so render threads
+// never contend. A BVH nested in another (e.g. a mesh in the scene BVH) adds to the
+// same counters; rays are counted by whoever traces them.
+struct BVH_Counters {
+    uint64_t nodes = 0, primitives = 0;
+    uint64_t camera_rays = 0, secondary_rays = 0, shadow_rays = 0;
+    // Camera and secondary rays by bounce (0 for camera rays), i.e. how many paths
+    // reached each depth; the last bucket also counts all deeper bounces
+    static constexpr size_t max_bounces = 16;
+    std::array<uint64_t, max_bounces> bounces{};
+
+    BVH_Counters& operator+=(const BVH_Counters& c) {
+        nodes += c.nodes;
+        primitives += c.primitives;
+        camera_rays += c.camera_rays;
+        secondary_rays += c.secondary_rays;
+        shadow_rays += c.shadow_rays;
+        for(size_t i = 0; i < max_bounces; i++) bounces[i] += c.bounces[i];
+        return *this;
+    }
+    uint64_t rays() const {
+        return camera_rays + secondary_rays + shadow_rays;
+    }
+
+    static inline std::atomic<bool> enabled = false;
+    static BVH_Counters& local() {
+        static thread_local BVH_Counters counters;
+        return counters;
+    }
+};
+
+// Primitives that can report the bounds of their parts on either side of an axis
+// aligned plane support spatial splits, in which case they are copied into every
+// leaf they overlap.
+template<typename Primitive, typename = void> struct BVH_Splittable : std::false_type {};
+template<typename Primitive>
+struct BVH_Splittable<Primitive,
+                      std::void_t<decltype(std::declval<const Primitive&>().split(
+                          0, 0.0f, std::declval<BBox&>(), std::declval<BBox&>()))>>
+    : std::is_copy_constructible<Primitive> {};
+
+// Primitives with intersect(ray, tmax, hit), which only finds the distance (stored
+// in tmax) and Hit of a hit closer than tmax, and finish(ray, t, hit), which builds
+// its Trace, have the Trace built once per ray, for the closest hit. A BVH of such
+// primitives is one too.
+template<typename Primitive, typename = void> struct BVH_Deferred : std::false_type {};
+template<typename Primitive>
+struct BVH_Deferred<Primitive,
+                    std::void_t<decltype(std::declval<const Primitive&>().intersect(
+                                    std::declval<const Ray&>(), std::declval<float&>(),
+                                    std::declval<Hit&>())),
+                                decltype(std::declval<const Primitive&>().finish(
+                                    std::declval<const Ray&>(), 0.0f, Hit{}))>>
+    : std::true_type {};
+
+// Deferred primitives may also test a whole leaf at once, with static
+// intersect_n(prims, n, ray, tmax, hit), which returns the index of the closest hit
+// (or -1), and occluded_n(prims, n, ray).
+template<typename Primitive, typename = void> struct BVH_Batched : std::false_type {};
+template<typename Primitive>
+struct BVH_Batched<Primitive,
+                   std::void_t<decltype(Primitive::intersect_n(
+                                   std::declval<const Primitive*>(), size_t(0),
+                                   std::declval<const Ray&>(), std::declval<float&>(),
+                                   std::declval<Hit&>())),
+                               decltype(Primitive::occluded_n(std::declval<const Primitive*>(),
+                                                              size_t(0),
+                                                              std::declval<const Ray&>()))>>
+    : BVH_Deferred<Primitive> {};
+
 template<typename Primitive> class BVH {
 public:
     BVH() = default;
-    BVH(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1);
-    void build(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1);
+    BVH(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1,
+        Thread_Pool* pool = nullptr);
+    BVH(std::vector<Primitive>&& primitives, const BVH_Options& options,
+        Thread_Pool* pool = nullptr);
+
+    void build(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1,
+               Thread_Pool* pool = nullptr);
+    void build(std::vector<Primitive>&& primitives, const BVH_Options& options,
+               Thread_Pool* pool = nullptr);
+
+    // Recompute node bounds after the primitives have moved, keeping the tree's
+    // topology. Rebuilds instead if that degrades the SAH cost past rebuild_ratio
+    // times the cost of the original build.
+    void refit(Thread_Pool* pool = nullptr);
+    float sah_cost() const;
+    BVH_Stats stats() const;
+
+    // In tree order, for primitives that cache data derived from their inputs.
+    // Changes should be followed by refit().
+    std::vector<Primitive>& edit_primitives() {
+        return primitives;
+    }
+    // Calls leaf(first, n) with the primitives of each leaf, in tree order
+    template<typename F> void leaves(F&& leaf) const;
+    // Calls each(prim) on the primitives of every leaf the ray reaches, untested and
+    // in no particular order, e.g. to find all of its hits rather than the closest
+    template<typename F> void reached(const Ray& ray, F&& each) const;
+    // Calls each(prim) on the primitives of every leaf whose bounds overlap box,
+    // untested and in no particular order, e.g. to find those near a point
+    template<typename F> void overlapping(const BBox& box, F&& each) const;
+    // Calls node(min, max, offset, count) on each node in depth-first order, e.g. to
+    // copy the tree elsewhere: an interior node (count 0) is followed by its left child
+    // and offset indexes its right child, while a leaf holds count primitives starting
+    // at offset of edit_primitives()
+    template<typename F> void each_node(F&& node) const;
 
     BVH(BVH&& src) = default;
     BVH& operator=(BVH&& src) = default;
@@ -22,6 +205,11 @@ public:
 
     BBox bbox() const;
     Trace hit(const Ray& ray) const;
+    bool occluded(const Ray& ray) const;
+
+    // Only for deferred primitives (see BVH_Deferred)
+    bool intersect(const Ray& ray, float& tmax, Hit& hit) const;
+    Trace finish(const Ray& ray, float t, Hit hit) const;
 
     BVH copy() const;
     size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, const Mat4& trans) const;
@@ -29,25 +217,97 @@ public:
     std::vector<Primitive> destructure();
     void clear();
 
+    // Save or load a built BVH, for caching it on disk. The owner serializes the
+    // primitives: write_primitive(out, prim) and read_primitive(in, prims), which
+    // appends one primitive and returns false if it could not. Files are only
+    // meant to be read back by the same build on the same platform.
+    template<typename F> void write(std::ostream& out, F&& write_primitive) const;
+    template<typename F>
+    bool read(std::istream& in, const BVH_Options& options, F&& read_primitive);
+
 private:
-    class Node {
+    // Nodes are stored depth first in 32 bytes: an interior node's left child
+    // directly follows it and offset indexes its right child, while a leaf holds
+    // count primitives starting at offset. Interior nodes have count == 0 and
+    // record the axis they were split on.
+    struct Node {
+        Vec3 min;
+        uint32_t offset = 0;
+        Vec3 max;
+        uint32_t count : 30;
+        uint32_t axis : 2;
+
+        Node() : count(0), axis(0) {
+        }
+        bool is_leaf() const;
+        // Whether a ray (origin, reciprocal direction and its signs) enters the box
+        // within [tmin, tmax], and if so at which distance t
+        bool hit(Vec3 o, Vec3 inv_d, const bool neg[3], float tmin, float tmax,
+                 float& t) const;
+        BBox bbox() const;
+    };
+    static_assert(sizeof(Node) == 32);
+
+    // Traversal uses a fixed-size stack, so the build stops splitting at this depth.
+    static constexpr size_t max_depth = 64;
 
+    // Per-primitive data computed once per build. The build constructs an indexed
+    // tree over order, which is then flattened into nodes.
+    struct Build_Node {
         BBox bbox;
-        size_t start, size, l, r;
+        size_t start = 0, size = 0, l = 0, r = 0;
+        int axis = 0;
+    };
+    struct Build_Data {
+        std::vector<BBox> boxes;
+        std::vector<Vec3> centers;
+        std::vector<size_t> order;
+        std::vector<Build_Node> nodes;
+        std::atomic<size_t> n_nodes = 0;
+        size_t max_leaf_size = 1, buckets = 0;
+        Thread_Pool* pool = nullptr;
+    };
+    void partition(Build_Data& data, size_t p, size_t depth);
 
-        // A node is a leaf if l == r, since all interior nodes must have distinct children
-        bool is_leaf() const;
-        friend class BVH<Primitive>;
+    // Spatial split builds are sequential and keep a list of references per node,
+    // since splitting a reference adds one to both children.
+    struct Reference {
+        BBox box;
+        size_t prim;
     };
-    size_t new_node(BBox box = {}, size_t start = 0, size_t size = 0, size_t l = 0, size_t r = 0);
+    void partition_spatial(Build_Data& data, size_t p, std::vector<Reference>& refs,
+                           size_t depth, float min_overlap);
+    std::vector<Primitive> unique_primitives();
 
-    void partition(size_t p, size_t n_buckets, size_t max_leaf_size);
-    Trace hit(size_t n, const Ray& ray) const;
+    // The linear builder emits the tree of Karras 2012 over the Morton-sorted order,
+    // then collapses small subtrees into leaves while computing bounds.
+    void build_lbvh(Build_Data& data);
+    void finish_lbvh(Build_Data& data, size_t p, size_t depth);
+    uint32_t flatten(const Build_Data& data, size_t p);
     void bvh_print(size_t p, size_t lv) const;
 
+    // With SCOTTY3D_BVH_WIDTH > 2, the binary nodes are also collapsed into wide
+    // nodes, which hit() and occluded() traverse instead.
+    static constexpr size_t width = SCOTTY3D_BVH_WIDTH;
+    void build_wide();
+    static void count(uint64_t nodes, uint64_t primitives);
+    uint32_t collapse(uint32_t n);
+    // Visit the leaves a ray reaches before tmax, nearest first, calling
+    // leaf(first, count) on each; the callback may shrink tmax.
+    template<typename F> void traverse(const Ray& ray, float& tmax, F&& leaf) const;
+    template<typename F> void traverse_wide(const Ray& ray, float& tmax, F&& leaf) const;
+    bool occluded_wide(const Ray& ray) const;
+
+    static constexpr float rebuild_ratio = 1.5f;
+    BVH_Options options;
+    float built_cost = 0.0f;
+
+    // The primitive each slot was copied from, if spatial splits duplicated any
+    std::vector<size_t> sources;
+
     std::vector<Node> nodes;
+    std::vector<Wide_Node<width>> wide;
     std::vector<Primitive> primitives;
-    size_t root_idx = 0;
 };
 
 } // namespace PT
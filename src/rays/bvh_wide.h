@@ -0,0 +1,109 @@
+#pragma once
+
+#include "../lib/mathlib.h"
+
+#include <cstdint>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <immintrin.h>
+#define SCOTTY3D_SSE
+#endif
+
+// Layout BVH::hit traverses: 2 keeps the binary nodes, while 4 and 8 collapse them
+// into wide nodes whose child boxes are tested together (with SSE and AVX, if enabled).
+#ifndef SCOTTY3D_BVH_WIDTH
+#define SCOTTY3D_BVH_WIDTH 2
+#endif
+
+namespace PT {
+
+template<size_t W> struct Wide_Node {
+
+    static_assert(W == 2 || W == 4 || W == 8);
+
+    // Child bounds, one lane per child. Unused lanes have inverted bounds, which
+    // no ray can hit.
+    alignas(32) float min[3][W];
+    alignas(32) float max[3][W];
+
+    // Interior children have count == 0 and index the wide node array; leaf
+    // children hold count primitives starting at child.
+    uint32_t child[W];
+    uint32_t count[W];
+
+    Wide_Node() {
+        for(size_t i = 0; i < W; i++) {
+            set(i, BBox(), 0, 0);
+        }
+    }
+
+    void set(size_t i, BBox box, uint32_t c, uint32_t n) {
+        for(int a = 0; a < 3; a++) {
+            min[a][i] = box.min[a];
+            max[a][i] = box.max[a];
+        }
+        child[i] = c;
+        count[i] = n;
+    }
+
+    // Slab test of every child box at once. Returns a mask of the children hit
+    // within [tmin, tmax] and writes their entry distances to t. neg[a] is set if
+    // inv_d[a] is negative, in which case the far plane on that axis is min.
+    uint32_t hit(Vec3 o, Vec3 inv_d, const bool neg[3], float tmin, float tmax, float* t) const {
+        // As in BVH::Node::hit, a NaN slab leaves the interval unchanged and the
+        // far distance is widened slightly to keep grazing hits.
+        uint32_t mask = 0;
+        for(size_t i = 0; i < W; i++) {
+            float t0 = tmin, t1 = tmax;
+            for(int a = 0; a < 3; a++) {
+                float n = ((neg[a] ? max[a][i] : min[a][i]) - o[a]) * inv_d[a];
+                float f = ((neg[a] ? min[a][i] : max[a][i]) - o[a]) * inv_d[a];
+                f *= 1.0f + 4.0f * FLT_EPSILON;
+                t0 = n > t0 ? n : t0;
+                t1 = f < t1 ? f : t1;
+            }
+            t[i] = t0;
+            if(t0 <= t1) mask |= 1u << i;
+        }
+        return mask;
+    }
+};
+
+#ifdef SCOTTY3D_SSE
+template<>
+inline uint32_t Wide_Node<4>::hit(Vec3 o, Vec3 inv_d, const bool neg[3], float tmin, float tmax,
+                                  float* t) const {
+    // max/min return their second operand if either is NaN
+    __m128 t0 = _mm_set1_ps(tmin), t1 = _mm_set1_ps(tmax);
+    __m128 widen = _mm_set1_ps(1.0f + 4.0f * FLT_EPSILON);
+    for(int a = 0; a < 3; a++) {
+        __m128 oa = _mm_set1_ps(o[a]), ia = _mm_set1_ps(inv_d[a]);
+        __m128 n = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(neg[a] ? max[a] : min[a]), oa), ia);
+        __m128 f = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(neg[a] ? min[a] : max[a]), oa), ia);
+        t0 = _mm_max_ps(n, t0);
+        t1 = _mm_min_ps(_mm_mul_ps(f, widen), t1);
+    }
+    _mm_storeu_ps(t, t0);
+    return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t0, t1)));
+}
+#endif
+
+#ifdef __AVX__
+template<>
+inline uint32_t Wide_Node<8>::hit(Vec3 o, Vec3 inv_d, const bool neg[3], float tmin, float tmax,
+                                  float* t) const {
+    __m256 t0 = _mm256_set1_ps(tmin), t1 = _mm256_set1_ps(tmax);
+    __m256 widen = _mm256_set1_ps(1.0f + 4.0f * FLT_EPSILON);
+    for(int a = 0; a < 3; a++) {
+        __m256 oa = _mm256_set1_ps(o[a]), ia = _mm256_set1_ps(inv_d[a]);
+        __m256 n = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(neg[a] ? max[a] : min[a]), oa), ia);
+        __m256 f = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(neg[a] ? min[a] : max[a]), oa), ia);
+        t0 = _mm256_max_ps(n, t0);
+        t1 = _mm256_min_ps(_mm256_mul_ps(f, widen), t1);
+    }
+    _mm256_storeu_ps(t, t0);
+    return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)));
+}
+#endif
+
+} // namespace PT
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <functional>
+#include <type_traits>
+#include <unordered_map>
+
+#include "object.h"
+
+namespace PT {
+
+// An Object's geometry resolved to its concrete type, so that the top level of the
+// scene calls it directly instead of through Object's variant.
+template<typename Primitive> class Instance {
+public:
+    Instance(Primitive&& prim, int material, const Affine& transform, Scene_ID id)
+        : prim(std::move(prim)), transform(transform), material(material), _id(id) {
+    }
+
+    Instance(const Instance& src) = delete;
+    Instance& operator=(const Instance& src) = delete;
+    Instance& operator=(Instance&& src) = default;
+    Instance(Instance&& src) = default;
+
+    BBox bbox() const {
+        BBox box = prim.bbox();
+        if(!transform.identity()) box = transform.bbox(box);
+        return box;
+    }
+
+    // As in Object, tmax is in the caller's space and scaled into the instance's.
+    bool intersect(Ray ray, float& tmax, Hit& hit) const {
+        float scale = 1.0f;
+        if(!transform.identity()) scale = transform.localize(ray);
+        float t = tmax * scale;
+        if(!prim.intersect(ray, t, hit)) return false;
+        tmax = t / scale;
+        return true;
+    }
+
+    Trace finish(Ray ray, float t, Hit hit) const {
+        if(!transform.identity()) t *= transform.localize(ray);
+        Trace ret = prim.finish(ray, t, hit);
+        if(material != -1) ret.material = material;
+        if(!transform.identity()) transform.globalize(ret);
+        return ret;
+    }
+
+    bool occluded(Ray ray) const {
+        if(!transform.identity()) transform.localize(ray);
+        return prim.occluded(ray);
+    }
+
+    size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, Mat4 vtrans) const {
+        if constexpr(std::is_same_v<Primitive, Tri_Mesh> ||
+                     std::is_same_v<Primitive, Sphere_Particles>) {
+            if(!transform.identity()) vtrans = vtrans * transform.matrix();
+            return prim.visualize(lines, active, level, vtrans);
+        }
+        return 0;
+    }
+
+    Scene_ID id() const {
+        return _id;
+    }
+    void set_trans(const Mat4& T) {
+        transform.set(T);
+    }
+
+private:
+    Primitive prim;
+    Affine transform;
+    int material = -1;
+    Scene_ID _id = 0;
+};
+
+// The instances of one type, in a BVH or (with BVHs disabled) a list.
+template<typename Primitive> class Scene_Group {
+public:
+    Scene_Group() = default;
+    Scene_Group(std::vector<Primitive>&& prims, bool use_bvh, const BVH_Options& options,
+                Thread_Pool* pool)
+        : use_bvh(use_bvh), empty(prims.empty()) {
+        if(empty) return;
+        if(use_bvh) {
+            bvh = BVH<Primitive>(std::move(prims), options, pool);
+        } else {
+            list = List<Primitive>(std::move(prims));
+        }
+    }
+
+    BBox bbox() const {
+        if(empty) return {};
+        return use_bvh ? bvh.bbox() : list.bbox();
+    }
+
+    bool intersect(const Ray& ray, float& tmax, Hit& hit) const {
+        if(empty) return false;
+        return use_bvh ? bvh.intersect(ray, tmax, hit) : list.intersect(ray, tmax, hit);
+    }
+
+    Trace finish(const Ray& ray, float t, Hit hit) const {
+        return use_bvh ? bvh.finish(ray, t, hit) : list.finish(ray, t, hit);
+    }
+
+    bool occluded(const Ray& ray) const {
+        if(empty) return false;
+        return use_bvh ? bvh.occluded(ray) : list.occluded(ray);
+    }
+
+    // Calls f on each primitive, then refits the BVH to wherever they moved
+    template<typename F> void edit(F&& f, Thread_Pool* pool) {
+        if(empty) return;
+        if(use_bvh) {
+            for(Primitive& prim : bvh.edit_primitives()) f(prim);
+            bvh.refit(pool);
+        } else {
+            for(Primitive& prim : list.edit_primitives()) f(prim);
+        }
+    }
+
+    size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, const Mat4& trans) const {
+        if(empty || !use_bvh) return 0;
+        return bvh.visualize(lines, active, level, trans);
+    }
+
+    BVH_Stats stats() const {
+        if(empty || !use_bvh) return {};
+        return bvh.stats();
+    }
+
+private:
+    bool use_bvh = true;
+    bool empty = true;
+    BVH<Primitive> bvh;
+    List<Primitive> list;
+};
+
+// The form of the scene that is traced: Objects are sorted by what they contain
+// into meshes, spheres, sphere particle systems, and anything else (nested
+// aggregates), and each kind gets its own top-level BVH over instances of that
+// type. A ray tests every group, narrowing tmax as it goes, and only the group
+// that won builds the Trace.
+class Compiled_Scene {
+public:
+    Compiled_Scene() = default;
+    Compiled_Scene(std::vector<Object>&& objects, bool use_bvh, const BVH_Options& options,
+                   Thread_Pool* pool = nullptr) {
+        std::vector<Instance<Tri_Mesh>> mesh_list;
+        std::vector<Instance<Sphere>> sphere_list;
+        std::vector<Instance<Sphere_Particles>> particle_list;
+        std::vector<Object> other_list;
+
+        for(Object& obj : objects) {
+            if(Tri_Mesh* mesh = std::get_if<Tri_Mesh>(&obj.underlying)) {
+                mesh_list.emplace_back(std::move(*mesh), obj.material, obj.transform, obj.id());
+                continue;
+            }
+            if(Sphere_Particles* p = std::get_if<Sphere_Particles>(&obj.underlying)) {
+                particle_list.emplace_back(std::move(*p), obj.material, obj.transform,
+                                           obj.id());
+                continue;
+            }
+            if(Shape* shape = std::get_if<Shape>(&obj.underlying)) {
+                if(const Sphere* sphere = shape->get_if<Sphere>()) {
+                    Sphere s = *sphere;
+                    sphere_list.emplace_back(std::move(s), obj.material, obj.transform,
+                                             obj.id());
+                    continue;
+                }
+            }
+            // The group's own level and the object's must fit in a Hit's path
+            if(1 + hit_depth(obj) > Hit::max_depth) {
+                warn("Object %u is nested too deeply to trace, so is left out.", obj.id());
+                continue;
+            }
+            other_list.push_back(std::move(obj));
+        }
+        std::vector<Object>().swap(objects);
+
+        // The groups are independent, so with a pool they are built concurrently
+        std::function<void()> builds[] = {
+            [&]() { meshes = Scene_Group(std::move(mesh_list), use_bvh, options, pool); },
+            [&]() { spheres = Scene_Group(std::move(sphere_list), use_bvh, options, pool); },
+            [&]() { particles = Scene_Group(std::move(particle_list), use_bvh, options, pool); },
+            [&]() { others = Scene_Group(std::move(other_list), use_bvh, options, pool); }};
+        if(!pool) {
+            for(auto& build : builds) build();
+            return;
+        }
+        Pool_Future<void> futures[std::size(builds)];
+        for(size_t i = 1; i < std::size(builds); i++) pool->submit(futures[i], builds[i]);
+        builds[0]();
+        for(size_t i = 1; i < std::size(builds); i++) pool->wait_for(futures[i]);
+    }
+
+    Compiled_Scene(const Compiled_Scene& src) = delete;
+    Compiled_Scene& operator=(const Compiled_Scene& src) = delete;
+    Compiled_Scene& operator=(Compiled_Scene&& src) = default;
+    Compiled_Scene(Compiled_Scene&& src) = default;
+
+    BBox bbox() const {
+        BBox box = meshes.bbox();
+        box.enclose(spheres.bbox());
+        box.enclose(particles.bbox());
+        box.enclose(others.bbox());
+        return box;
+    }
+
+    Trace hit(const Ray& ray) const {
+        float t = ray.dist_bounds.y;
+        Hit h;
+        enum class Group { none, mesh, sphere, particle, other } group = Group::none;
+        if(meshes.intersect(ray, t, h)) group = Group::mesh;
+        if(spheres.intersect(ray, t, h)) group = Group::sphere;
+        if(particles.intersect(ray, t, h)) group = Group::particle;
+        if(others.intersect(ray, t, h)) group = Group::other;
+
+        switch(group) {
+        case Group::mesh: return meshes.finish(ray, t, h);
+        case Group::sphere: return spheres.finish(ray, t, h);
+        case Group::particle: return particles.finish(ray, t, h);
+        case Group::other: return others.finish(ray, t, h);
+        default: return {};
+        }
+    }
+
+    bool occluded(const Ray& ray) const {
+        return meshes.occluded(ray) || spheres.occluded(ray) || particles.occluded(ray) ||
+               others.occluded(ray);
+    }
+
+    size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, const Mat4& trans) const {
+        size_t depth = meshes.visualize(lines, active, level, trans);
+        depth = std::max(depth, spheres.visualize(lines, active, level, trans));
+        depth = std::max(depth, particles.visualize(lines, active, level, trans));
+        return std::max(depth, others.visualize(lines, active, level, trans));
+    }
+
+    // Moves the objects with the given IDs, refitting rather than rebuilding the top
+    // levels, whose quality degrades the further they move
+    void move_objects(const std::unordered_map<Scene_ID, Mat4>& moved, Thread_Pool* pool) {
+        auto move = [&moved](auto& obj) {
+            auto entry = moved.find(obj.id());
+            if(entry != moved.end()) obj.set_trans(entry->second);
+        };
+        meshes.edit(move, pool);
+        spheres.edit(move, pool);
+        particles.edit(move, pool);
+        others.edit(move, pool);
+    }
+
+    // Top-level BVHs of all groups combined
+    BVH_Stats stats() const {
+        BVH_Stats ret = meshes.stats();
+        ret += spheres.stats();
+        ret += particles.stats();
+        ret += others.stats();
+        return ret;
+    }
+
+private:
+    // How many indices tracing into obj pushes onto a Hit's path: one per aggregate
+    // level, and a compressed mesh's cluster as well as its triangle
+    static uint32_t hit_depth(Object& obj) {
+        auto nested = [](std::vector<Object>& prims) {
+            uint32_t depth = 0;
+            for(Object& prim : prims) depth = std::max(depth, hit_depth(prim));
+            return 1 + depth;
+        };
+        return std::visit(
+            overloaded{[&](List<Object>& list) { return nested(list.edit_primitives()); },
+                       [&](BVH<Object>& bvh) { return nested(bvh.edit_primitives()); },
+                       [](Tri_Mesh&) { return 2u; }, [](Sphere_Particles&) { return 1u; },
+                       [](Shape&) { return 0u; }},
+            obj.underlying);
+    }
+
+    Scene_Group<Instance<Tri_Mesh>> meshes;
+    Scene_Group<Instance<Sphere>> spheres;
+    Scene_Group<Instance<Sphere_Particles>> particles;
+    Scene_Group<Object> others;
+};
+
+} // namespace PT
@@ -0,0 +1,77 @@
+
+#include "denoise.h"
+
+#ifdef SCOTTY3D_OIDN
+#include <OpenImageDenoise/oidn.hpp>
+#include <mutex>
+#include <vector>
+#endif
+
+namespace PT {
+
+#ifdef SCOTTY3D_OIDN
+
+bool can_denoise() {
+    return true;
+}
+
+std::string denoise(HDR_Image& image, const HDR_Image* albedo, const HDR_Image* normal) {
+
+    static_assert(sizeof(Spectrum) == 3 * sizeof(float), "Images are passed as float3");
+
+    auto [w, h] = image.dimension();
+    if(w == 0 || h == 0) return {};
+    for(const HDR_Image* aux : {albedo, normal}) {
+        if(aux && aux->dimension() != image.dimension()) {
+            return "Denoiser inputs are of different sizes.";
+        }
+    }
+
+    // Creating a device starts its threads and picks kernels, so one is kept for
+    // every call, which take turns with it
+    static std::mutex device_mut;
+    static oidn::DeviceRef device;
+    std::lock_guard<std::mutex> lock(device_mut);
+    if(!device) {
+        device = oidn::newDevice();
+        device.commit();
+    }
+
+    auto input = [](const HDR_Image* img) {
+        return const_cast<void*>(static_cast<const void*>(img->data()));
+    };
+    std::vector<Spectrum> out(w * h);
+
+    oidn::FilterRef filter = device.newFilter("RT");
+    filter.setImage("color", input(&image), oidn::Format::Float3, w, h);
+    // Normals are only used alongside albedo
+    if(albedo) {
+        filter.setImage("albedo", input(albedo), oidn::Format::Float3, w, h);
+        if(normal) filter.setImage("normal", input(normal), oidn::Format::Float3, w, h);
+    }
+    filter.setImage("output", out.data(), oidn::Format::Float3, w, h);
+    filter.set("hdr", true);
+    filter.commit();
+    filter.execute();
+
+    const char* msg = nullptr;
+    if(device.getError(msg) != oidn::Error::None) {
+        return std::string("Denoising failed: ") + (msg ? msg : "unknown error.");
+    }
+    for(size_t i = 0; i < out.size(); i++) image.at(i) = out[i];
+    return {};
+}
+
+#else
+
+bool can_denoise() {
+    return false;
+}
+
+std::string denoise(HDR_Image&, const HDR_Image*, const HDR_Image*) {
+    return "Denoising needs a build with Open Image Denoise (SCOTTY3D_OIDN).";
+}
+
+#endif
+
+} // namespace PT
@@ -0,0 +1,19 @@
+
+#pragma once
+
+#include <string>
+
+#include "../util/hdr_image.h"
+
+namespace PT {
+
+// Whether this build can denoise, which needs Intel Open Image Denoise (see
+// SCOTTY3D_OIDN in CMakeLists.txt)
+bool can_denoise();
+
+// Denoises a path-traced image in place. Albedo and normal images of the same size
+// (see Pathtracer::render_aovs) guide the filter to keep edges and texture detail.
+std::string denoise(HDR_Image& image, const HDR_Image* albedo = nullptr,
+                    const HDR_Image* normal = nullptr);
+
+} // namespace PT
@@ -40,11 +40,18 @@ struct Env_Sphere {
 
 struct Env_Map {
 
-    Env_Map(HDR_Image&& img) : image(std::move(img)), image_sampler(image) {
+    // The image's mip levels are built here (on the pool, if given) unless it has them.
+    // It is then only read, so it is kept as RGB9E5, a third the size of float32.
+    Env_Map(HDR_Image&& img, Thread_Pool* pool = nullptr)
+        : image(std::move(img)), image_sampler(image) {
+        if(image.levels() == 1) image.build_mips(pool);
+        image.set_format(HDR_Image::Format::rgb9e5);
     }
 
     Vec3 sample() const;
-    Spectrum evaluate(Vec3 dir) const;
+    // Radiance averaged over a cone of directions around dir, spread being its
+    // solid angle (0 for a single direction); wider cones read coarser mip levels
+    Spectrum evaluate(Vec3 dir, float spread = 0.0f) const;
     float pdf(Vec3 dir) const;
 
     HDR_Image image;
@@ -74,8 +81,11 @@ public:
         return std::visit([dir](const auto& h) { return h.pdf(dir); }, underlying);
     }
 
-    Spectrum evaluate(Vec3 dir) const {
-        return std::visit([&dir](const auto& h) { return h.evaluate(dir); }, underlying);
+    Spectrum evaluate(Vec3 dir, float spread = 0.0f) const {
+        return std::visit(
+            overloaded{[dir, spread](const Env_Map& map) { return map.evaluate(dir, spread); },
+                       [dir](const auto& h) { return h.evaluate(dir); }},
+            underlying);
     }
 
     bool is_discrete() const {
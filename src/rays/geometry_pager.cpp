@@ -0,0 +1,163 @@
+
+#include "geometry_pager.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <thread>
+
+#include "../lib/log.h"
+
+namespace PT {
+
+// Starts every geometry file, so that one whose name's hash collided, or one left by a
+// build writing another version, is rewritten rather than mapped
+struct Geo_Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    // Of the parts after the header, and a second hash of them, independent of the
+    // one the file is named for
+    uint64_t size;
+    uint64_t check;
+};
+static_assert(sizeof(Geo_Header) == 32, "Geometry_Pager::header_size is out of date");
+static const char geo_magic[8] = {'S', '3', 'D', 'G', 'E', 'O', '\0', '\0'};
+static constexpr uint32_t geo_version = 1;
+
+static bool same_header(const Geo_Header& a, const Geo_Header& b) {
+    return std::memcmp(a.magic, b.magic, sizeof(a.magic)) == 0 && a.version == b.version &&
+           a.size == b.size && a.check == b.check;
+}
+
+void Geometry_Pager::set_dir(const std::string& d) {
+    dir = d;
+}
+
+void Geometry_Pager::set_budget(size_t bytes) {
+    budget = bytes;
+}
+
+std::shared_ptr<const Geometry_Pager::Region>
+Geometry_Pager::map(const std::vector<std::pair<const void*, size_t>>& parts) {
+
+    if(dir.empty()) return nullptr;
+
+    // 64-bit FNV-1a over the contents, so renders of the same scene share files, and a
+    // multiplicative hash for the header to confirm a file with that name matches
+    uint64_t hash = 14695981039346656037ull, check = 0;
+    size_t total = 0;
+    for(const auto& part : parts) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(part.first);
+        for(size_t i = 0; i < part.second; i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+            check = (check + bytes[i] + 1) * 0x9e3779b97f4a7c15ull;
+            check ^= check >> 29;
+        }
+        total += part.second;
+    }
+    if(total == 0) return nullptr;
+
+    Geo_Header header = {};
+    std::memcpy(header.magic, geo_magic, sizeof(geo_magic));
+    header.version = geo_version;
+    header.size = total;
+    header.check = check;
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.geo", static_cast<unsigned long long>(hash));
+    std::string file = dir + "/" + name;
+
+    // As for BVH cache files, write to a file of our own and rename it into place, so
+    // that concurrent renders never map a partial file
+    std::ifstream existing(file, std::ios::binary | std::ios::ate);
+    Geo_Header found = {};
+    bool same = existing && static_cast<size_t>(existing.tellg()) == header_size + total;
+    if(same) {
+        existing.seekg(0);
+        existing.read(reinterpret_cast<char*>(&found), sizeof(found));
+        same = existing && same_header(found, header);
+    }
+    if(!same) {
+        existing.close();
+        std::string tmp =
+            file + "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            for(const auto& part : parts) {
+                out.write(static_cast<const char*>(part.first), part.second);
+            }
+            if(!out) {
+                warn("Failed to write geometry file %s", tmp.c_str());
+                out.close();
+                std::remove(tmp.c_str());
+                return nullptr;
+            }
+        }
+        if(std::rename(tmp.c_str(), file.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return nullptr;
+        }
+    }
+
+    auto region = std::make_shared<Region>();
+    if(!region->file.open(file, false) || region->file.size() != header_size + total) {
+        warn("Failed to map geometry file %s", file.c_str());
+        return nullptr;
+    }
+    region->epoch = epoch;
+
+    std::lock_guard<std::mutex> lock(mut);
+    regions.erase(std::remove_if(regions.begin(), regions.end(),
+                                 [](const std::weak_ptr<Region>& r) { return r.expired(); }),
+                  regions.end());
+    regions.push_back(region);
+    return region;
+}
+
+void Geometry_Pager::trim() {
+
+    if(!budget) return;
+    std::unique_lock<std::mutex> lock(mut, std::try_to_lock);
+    if(!lock.owns_lock()) return;
+
+    // Touches from here on are counted against the new epoch, so that regions traced
+    // while others are evicted still count as resident
+    uint32_t now = epoch->fetch_add(1, std::memory_order_relaxed);
+
+    std::vector<std::shared_ptr<Region>> resident;
+    size_t bytes = 0;
+    for(const auto& weak : regions) {
+        std::shared_ptr<Region> region = weak.lock();
+        if(region && region->touched.load(std::memory_order_relaxed) > region->evicted) {
+            bytes += region->size();
+            resident.push_back(std::move(region));
+        }
+    }
+    if(bytes <= budget) return;
+
+    std::sort(resident.begin(), resident.end(), [](const auto& a, const auto& b) {
+        return a->touched.load(std::memory_order_relaxed) <
+               b->touched.load(std::memory_order_relaxed);
+    });
+    for(const auto& region : resident) {
+        if(bytes <= budget) break;
+        region->file.evict();
+        region->evicted = now;
+        bytes -= region->size();
+    }
+}
+
+size_t Geometry_Pager::mapped_bytes() const {
+    std::lock_guard<std::mutex> lock(mut);
+    size_t bytes = 0;
+    for(const auto& weak : regions) {
+        if(auto region = weak.lock()) bytes += region->size();
+    }
+    return bytes;
+}
+
+} // namespace PT
@@ -0,0 +1,84 @@
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../util/mapped_file.h"
+
+namespace PT {
+
+// Keeps compressed mesh geometry out of core, for scenes larger than memory. Each
+// mesh's cluster vertices and indices are written to a file in a directory (next to
+// the BVH cache) and mapped, so they are read in a page at a time as rays first
+// reach them. Only the BVH nodes and cluster headers, which traversal needs to decide
+// what to read, stay in memory. The OS may drop clean pages again whenever memory is
+// short; with a budget, trim() also evicts the meshes least recently traced until
+// those which may be resident fit in it.
+class Geometry_Pager {
+public:
+    class Region {
+    public:
+        // The parts mapped, after the file's header
+        const unsigned char* data() const {
+            return file.data() + header_size;
+        }
+        size_t size() const {
+            return file.size() - header_size;
+        }
+        // Marks the region as in use. Called on every traversal, so it only writes
+        // once per epoch.
+        void touch() const {
+            uint32_t now = epoch->load(std::memory_order_relaxed);
+            if(touched.load(std::memory_order_relaxed) != now) {
+                touched.store(now, std::memory_order_relaxed);
+            }
+        }
+
+    private:
+        Mapped_File file;
+        std::shared_ptr<const std::atomic<uint32_t>> epoch;
+        mutable std::atomic<uint32_t> touched{0};
+        // The epoch it was last evicted in; it may hold pages if touched since
+        uint32_t evicted = 0;
+        friend class Geometry_Pager;
+    };
+
+    // An empty dir turns paging off
+    void set_dir(const std::string& dir);
+    // Approximate cap on resident geometry, 0 to leave eviction to the OS
+    void set_budget(size_t bytes);
+    bool enabled() const {
+        return !dir.empty();
+    }
+
+    // Writes the parts, in order, to a file named for their contents (unless an
+    // earlier render already has, as its header confirms) and maps it. Returns null if
+    // that fails, in which case the caller keeps its geometry in memory.
+    std::shared_ptr<const Region> map(const std::vector<std::pair<const void*, size_t>>& parts);
+
+    // Starts a new epoch, first evicting regions from least to most recently touched
+    // while those touched since their last eviction exceed the budget. Cheap enough to
+    // call as each tile finishes; calls made while another is running return at once.
+    void trim();
+
+    // Of all live regions, however much of them is resident
+    size_t mapped_bytes() const;
+
+private:
+    // Of the header each file starts with (see geometry_pager.cpp), which keeps the
+    // parts after it 16-byte aligned
+    static constexpr size_t header_size = 32;
+
+    std::string dir;
+    size_t budget = 0;
+    std::shared_ptr<std::atomic<uint32_t>> epoch = std::make_shared<std::atomic<uint32_t>>(1);
+    mutable std::mutex mut;
+    std::vector<std::weak_ptr<Region>> regions;
+};
+
+} // namespace PT
@@ -0,0 +1,553 @@
+
+#include "gpu_tracer.h"
+#include "bvh.h"
+
+#include "../util/parallel.h"
+
+#include <chrono>
+
+namespace PT {
+
+// Laid out as the shader's std430 structs
+struct GPU_Node {
+    Vec3 min;
+    uint32_t offset = 0;
+    Vec3 max;
+    uint32_t count = 0;
+};
+struct GPU_Emitter {
+    uint32_t triangle = 0;
+    // Luma times area summed up to and including this triangle
+    float cdf = 0.0f;
+};
+static_assert(sizeof(GPU_Scene::Triangle) == 96 && sizeof(GPU_Scene::Material) == 32 &&
+              sizeof(GPU_Scene::Light) == 48 && sizeof(GPU_Node) == 32);
+
+bool GPU_Tracer::supported() {
+    return GL::compute_supported();
+}
+
+std::string GPU_Tracer::build(GPU_Scene&& scene) {
+
+    if(!supported()) return "GPU rendering needs OpenGL 4.3.";
+    if(!trace_shader.loaded()) trace_shader.load_compute(trace_source);
+    if(!tonemap_shader.loaded()) tonemap_shader.load_compute(tonemap_source);
+    if(!trace_shader.loaded() || !tonemap_shader.loaded()) {
+        return "Failed to compile the GPU path tracer's shaders.";
+    }
+    cancel();
+
+    // Leaves of a few triangles, which the shader tests in a loop
+    BVH<GPU_Scene::Triangle> bvh(std::move(scene.triangles), 4, &parallel_pool());
+    std::vector<GPU_Node> flat;
+    bvh.each_node([&](Vec3 min, Vec3 max, uint32_t offset, uint32_t count) {
+        flat.push_back({min, offset, max, count});
+    });
+    const std::vector<GPU_Scene::Triangle>& tris = bvh.edit_primitives();
+
+    std::vector<GPU_Emitter> emitting;
+    emitted = 0.0f;
+    for(size_t i = 0; i < tris.size(); i++) {
+        const GPU_Scene::Material& m = scene.materials[tris[i].material];
+        if(m.type != GPU_Scene::emissive) continue;
+        float area = 0.5f * cross(tris[i].v1 - tris[i].v0, tris[i].v2 - tris[i].v0).norm();
+        float power = Spectrum(m.color.x, m.color.y, m.color.z).luma() * area;
+        if(power <= 0.0f) continue;
+        emitted += power;
+        emitting.push_back({(uint32_t)i, emitted});
+    }
+
+    nodes.set(flat.data(), flat.size() * sizeof(GPU_Node));
+    triangles.set(tris.data(), tris.size() * sizeof(GPU_Scene::Triangle));
+    materials.set(scene.materials.data(), scene.materials.size() * sizeof(GPU_Scene::Material));
+    lights.set(scene.lights.data(), scene.lights.size() * sizeof(GPU_Scene::Light));
+    emitters.set(emitting.data(), emitting.size() * sizeof(GPU_Emitter));
+    n_nodes = flat.size();
+    n_lights = scene.lights.size();
+    n_emitters = emitting.size();
+
+    has_env = !scene.env.empty();
+    if(has_env) env.image((int)scene.env_w, (int)scene.env_h, scene.env.data());
+    return {};
+}
+
+void GPU_Tracer::begin_render(const Camera& camera, size_t width, size_t height, size_t samples,
+                              size_t max_depth) {
+
+    // The camera's projection, recovered from the rays it generates (as in
+    // Pathtracer::reproject): its center ray, and the extent of the screen at unit depth
+    Ray center = camera.generate_ray(Vec2(0.5f, 0.5f));
+    auto edge = [&](Vec2 uv) {
+        Vec3 dir = camera.generate_ray(uv).dir;
+        return 2.0f * (dir / dot(dir, center.dir) - center.dir);
+    };
+    eye = center.point;
+    forward = center.dir;
+    right = edge(Vec2(1.0f, 0.5f));
+    up = edge(Vec2(0.5f, 1.0f));
+
+    w = std::max(width, size_t(1));
+    h = std::max(height, size_t(1));
+    depth = max_depth;
+    total_samples = samples;
+    done_samples = 0;
+    batch = 1;
+    accum.storage((int)w, (int)h, true);
+    display.storage((int)w, (int)h, false);
+    shown_samples = SIZE_MAX;
+}
+
+void GPU_Tracer::step(float budget_ms) {
+
+    if(!in_progress()) return;
+
+    // Dispatches are queued, so the batch is timed to its end and resized to fit
+    auto start = std::chrono::steady_clock::now();
+    size_t n = std::min(batch, total_samples - done_samples);
+    dispatch(n);
+    glFinish();
+    std::chrono::duration<float, std::milli> took = std::chrono::steady_clock::now() - start;
+
+    if(took.count() < 0.5f * budget_ms) {
+        batch = std::min(batch * 2, size_t(64));
+    } else if(took.count() > budget_ms && batch > 1) {
+        batch /= 2;
+    }
+}
+
+void GPU_Tracer::dispatch(size_t samples) {
+
+    trace_shader.bind();
+    nodes.bind(0);
+    triangles.bind(1);
+    materials.bind(2);
+    lights.bind(3);
+    emitters.bind(4);
+    accum.bind_image(0, GL_READ_WRITE);
+    env.bind(0);
+
+    trace_shader.uniform("env", 0);
+    trace_shader.uniform("has_env", has_env);
+    trace_shader.uniform("size", Vec2((float)w, (float)h));
+    trace_shader.uniform("depth", (GLint)depth);
+    trace_shader.uniform("n_nodes", (GLint)n_nodes);
+    trace_shader.uniform("n_lights", (GLint)n_lights);
+    trace_shader.uniform("n_emitters", (GLint)n_emitters);
+    trace_shader.uniform("emitted", emitted);
+    trace_shader.uniform("eye", eye);
+    trace_shader.uniform("forward", forward);
+    trace_shader.uniform("right", right);
+    trace_shader.uniform("up", up);
+
+    GLuint groups_x = (GLuint)((w + 7) / 8), groups_y = (GLuint)((h + 7) / 8);
+    for(size_t s = 0; s < samples; s++) {
+        trace_shader.uniform("sample_index", (GLuint)done_samples);
+        trace_shader.dispatch(groups_x, groups_y);
+        done_samples++;
+    }
+    glUseProgram(0);
+}
+
+void GPU_Tracer::cancel() {
+    total_samples = done_samples;
+}
+
+bool GPU_Tracer::in_progress() const {
+    return done_samples < total_samples;
+}
+
+float GPU_Tracer::progress() const {
+    return total_samples ? (float)done_samples / (float)total_samples : 1.0f;
+}
+
+const GL::Tex2D& GPU_Tracer::get_output_texture(float exposure) {
+
+    if(done_samples == shown_samples && exposure == shown_exposure) return display;
+    shown_samples = done_samples;
+    shown_exposure = exposure;
+
+    tonemap_shader.bind();
+    accum.bind_image(0, GL_READ_ONLY);
+    display.bind_image(1, GL_WRITE_ONLY);
+    tonemap_shader.uniform("size", Vec2((float)w, (float)h));
+    tonemap_shader.uniform("exposure", exposure);
+    tonemap_shader.dispatch((GLuint)((w + 7) / 8), (GLuint)((h + 7) / 8));
+    glUseProgram(0);
+    return display;
+}
+
+void GPU_Tracer::read_output(HDR_Image& out) const {
+
+    std::vector<float> rgba;
+    accum.read(rgba);
+    out.resize(w, h);
+    for(size_t p = 0; p < w * h && 4 * p + 2 < rgba.size(); p++) {
+        out.at(p) = Spectrum(rgba[4 * p], rgba[4 * p + 1], rgba[4 * p + 2]);
+    }
+}
+
+const std::string GPU_Tracer::trace_source = R"(
+#version 430 core
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+struct Node {
+	vec3 min_;
+	uint offset;
+	vec3 max_;
+	uint count;
+};
+struct Triangle {
+	vec3 v0;
+	uint material;
+	vec3 v1;
+	float pad0;
+	vec3 v2;
+	float pad1;
+	vec3 n0;
+	float pad2;
+	vec3 n1;
+	float pad3;
+	vec3 n2;
+	float pad4;
+};
+struct Material {
+	vec3 color;
+	uint type;
+	vec3 reflectance;
+	float ior;
+};
+struct Light {
+	vec3 pos;
+	uint type;
+	vec3 dir;
+	float inner;
+	vec3 radiance;
+	float outer;
+};
+struct Emitter {
+	uint triangle;
+	float cdf;
+};
+
+layout(std430, binding = 0) readonly buffer Nodes { Node nodes[]; };
+layout(std430, binding = 1) readonly buffer Triangles { Triangle tris[]; };
+layout(std430, binding = 2) readonly buffer Materials { Material materials[]; };
+layout(std430, binding = 3) readonly buffer Lights { Light lights[]; };
+layout(std430, binding = 4) readonly buffer Emitters { Emitter emitters[]; };
+
+layout(rgba32f, binding = 0) uniform image2D accum;
+uniform sampler2D env;
+uniform bool has_env;
+
+uniform vec2 size;
+uniform uint sample_index;
+uniform int depth, n_nodes, n_lights, n_emitters;
+uniform float emitted;
+uniform vec3 eye, forward, right, up;
+
+const float PI = 3.14159265358979;
+const float EPS = 0.00001;
+const float FAR = 1e30;
+const uint LAMBERTIAN = 0u, MIRROR = 1u, GLASS = 2u, EMISSIVE = 3u, REFRACT = 4u;
+const uint DIRECTIONAL = 0u, POINT = 1u, SPOT = 2u;
+
+uint rng_state;
+uint pcg(uint v) {
+	uint state = v * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+float rand() {
+	rng_state = pcg(rng_state);
+	return float(rng_state >> 8) / 16777216.0;
+}
+
+float luma(vec3 c) {
+	return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+struct Hit {
+	float t;
+	vec3 pos, normal, geometric;
+	uint material;
+};
+
+bool hit_box(Node n, vec3 o, vec3 inv_d, float tmax) {
+	vec3 t0 = (n.min_ - o) * inv_d, t1 = (n.max_ - o) * inv_d;
+	vec3 lo = min(t0, t1), hi = max(t0, t1);
+	float enter = max(max(lo.x, lo.y), max(lo.z, 0.0));
+	float leave = min(min(hi.x, hi.y), min(hi.z, tmax));
+	return enter <= leave;
+}
+
+bool hit_triangle(uint i, vec3 o, vec3 d, inout float tmax, out vec2 bary) {
+	Triangle tri = tris[i];
+	vec3 e1 = tri.v1 - tri.v0, e2 = tri.v2 - tri.v0;
+	vec3 p = cross(d, e2);
+	float det = dot(e1, p);
+	if(abs(det) < 1e-12) return false;
+	float inv = 1.0 / det;
+	vec3 s = o - tri.v0;
+	float u = dot(s, p) * inv;
+	if(u < 0.0 || u > 1.0) return false;
+	vec3 q = cross(s, e1);
+	float v = dot(d, q) * inv;
+	if(v < 0.0 || u + v > 1.0) return false;
+	float t = dot(e2, q) * inv;
+	if(t < EPS || t > tmax) return false;
+	tmax = t;
+	bary = vec2(u, v);
+	return true;
+}
+
+// The closest hit within tmax, or (if any) whether there is one at all
+bool trace(vec3 o, vec3 d, float tmax, bool any_hit, out Hit hit) {
+	hit.t = tmax;
+	if(n_nodes == 0) return false;
+
+	vec3 safe_d = mix(d, vec3(1e-20), equal(d, vec3(0.0)));
+	vec3 inv_d = 1.0 / safe_d;
+	uint stack[64];
+	int top = 0;
+	stack[top++] = 0u;
+	bool found = false;
+	uint best = 0u;
+	vec2 best_bary = vec2(0.0);
+
+	while(top > 0) {
+		uint ni = stack[--top];
+		Node n = nodes[ni];
+		if(!hit_box(n, o, inv_d, tmax)) continue;
+		if(n.count > 0u) {
+			for(uint i = n.offset; i < n.offset + n.count; i++) {
+				vec2 bary;
+				if(hit_triangle(i, o, d, tmax, bary)) {
+					found = true;
+					best = i;
+					best_bary = bary;
+					if(any_hit) return true;
+				}
+			}
+		} else if(top < 62) {
+			stack[top++] = n.offset;
+			stack[top++] = ni + 1u;
+		}
+	}
+	if(!found) return false;
+
+	Triangle tri = tris[best];
+	hit.t = tmax;
+	hit.pos = o + d * tmax;
+	hit.geometric = normalize(cross(tri.v1 - tri.v0, tri.v2 - tri.v0));
+	vec3 n = tri.n0 * (1.0 - best_bary.x - best_bary.y) + tri.n1 * best_bary.x +
+	         tri.n2 * best_bary.y;
+	hit.normal = dot(n, n) > 0.0 ? normalize(n) : hit.geometric;
+	hit.material = tri.material;
+	return true;
+}
+
+bool occluded(vec3 o, vec3 d, float dist) {
+	Hit ignored;
+	return trace(o, d, dist, true, ignored);
+}
+
+vec3 env_radiance(vec3 d) {
+	if(!has_env) return vec3(0.0);
+	vec2 uv = vec2(atan(d.z, d.x) / (2.0 * PI) + 0.5, acos(clamp(d.y, -1.0, 1.0)) / PI);
+	return textureLod(env, uv, 0.0).rgb;
+}
+
+vec3 cosine_sample(vec3 n) {
+	float r = sqrt(rand()), phi = 2.0 * PI * rand();
+	vec3 t = normalize(abs(n.x) > 0.9 ? cross(n, vec3(0.0, 1.0, 0.0)) : cross(n, vec3(1.0, 0.0, 0.0)));
+	vec3 b = cross(n, t);
+	return normalize(t * r * cos(phi) + b * r * sin(phi) + n * sqrt(max(0.0, 1.0 - r * r)));
+}
+
+// As BSDF_Glass and BSDF_Refract do in the normal's frame: out points away from the
+// surface, and the result is false on total internal reflection
+bool refract_dir(vec3 out_dir, vec3 n, float ior, out vec3 in_dir) {
+	float cos_o = dot(out_dir, n);
+	float eta = cos_o > 0.0 ? 1.0 / ior : ior;
+	float sin2_t = eta * eta * max(1.0 - cos_o * cos_o, 0.0);
+	if(sin2_t >= 1.0) return false;
+	float cos_t = sqrt(1.0 - sin2_t);
+	in_dir = -eta * (out_dir - cos_o * n) + (cos_o > 0.0 ? -cos_t : cos_t) * n;
+	return true;
+}
+
+vec3 point_lighting(vec3 pos, vec3 n, vec3 albedo) {
+	vec3 sum = vec3(0.0);
+	for(int i = 0; i < n_lights; i++) {
+		Light l = lights[i];
+		vec3 to_light;
+		float dist = FAR;
+		vec3 radiance = l.radiance;
+		if(l.type == DIRECTIONAL) {
+			to_light = l.dir;
+		} else {
+			vec3 offset = l.pos - pos;
+			dist = length(offset);
+			to_light = offset / dist;
+			if(l.type == SPOT) {
+				float angle = degrees(acos(clamp(dot(-to_light, l.dir), -1.0, 1.0)));
+				radiance *= 1.0 - smoothstep(l.inner, l.outer, angle);
+			}
+		}
+		float cos_i = dot(n, to_light);
+		if(cos_i <= 0.0 || luma(radiance) <= 0.0) continue;
+		if(occluded(pos, to_light, dist - EPS)) continue;
+		sum += albedo / PI * cos_i * radiance;
+	}
+	return sum;
+}
+
+vec3 area_lighting(vec3 pos, vec3 n, vec3 albedo) {
+	if(n_emitters == 0) return vec3(0.0);
+
+	// Pick a triangle by power, then a uniform point on it
+	float x = rand() * emitted;
+	int lo = 0, hi = n_emitters - 1;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(emitters[mid].cdf < x) lo = mid + 1;
+		else hi = mid;
+	}
+	Triangle tri = tris[emitters[lo].triangle];
+	float u = rand(), v = rand();
+	if(u + v > 1.0) {
+		u = 1.0 - u;
+		v = 1.0 - v;
+	}
+	vec3 p = tri.v0 + u * (tri.v1 - tri.v0) + v * (tri.v2 - tri.v0);
+	vec3 offset = p - pos;
+	float dist = length(offset);
+	vec3 to_light = offset / dist;
+	float cos_i = dot(n, to_light);
+	vec3 geometric = normalize(cross(tri.v1 - tri.v0, tri.v2 - tri.v0));
+	float cos_l = abs(dot(geometric, to_light));
+	if(cos_i <= 0.0 || cos_l <= 0.0) return vec3(0.0);
+	if(occluded(pos, to_light, dist * (1.0 - 1e-4))) return vec3(0.0);
+
+	vec3 radiance = materials[tri.material].color;
+	float light_pdf = luma(radiance) / emitted * dist * dist / cos_l;
+	float bsdf_pdf = cos_i / PI;
+	float weight = light_pdf * light_pdf / (light_pdf * light_pdf + bsdf_pdf * bsdf_pdf);
+	return albedo / PI * cos_i * radiance * weight / light_pdf;
+}
+
+void main() {
+
+	ivec2 px = ivec2(gl_GlobalInvocationID.xy);
+	if(px.x >= int(size.x) || px.y >= int(size.y)) return;
+	rng_state = pcg(uint(px.y) * uint(size.x) + uint(px.x)) ^ pcg(sample_index * 9781u + 1u);
+
+	vec2 uv = (vec2(px) + vec2(rand(), rand())) / size;
+	vec3 o = eye;
+	vec3 d = normalize(forward + (uv.x - 0.5) * right + (uv.y - 0.5) * up);
+
+	vec3 radiance = vec3(0.0), throughput = vec3(1.0);
+	// Whether the last bounce could have been found by light sampling, and its pdf
+	bool sampled_lights = false;
+	float bsdf_pdf = 0.0;
+
+	for(int bounce = 0; bounce <= depth; bounce++) {
+
+		Hit hit;
+		if(!trace(o, d, FAR, false, hit)) {
+			radiance += throughput * env_radiance(d);
+			break;
+		}
+
+		Material m = materials[hit.material];
+		if(m.type == EMISSIVE) {
+			float weight = 1.0;
+			if(sampled_lights) {
+				float cos_l = max(abs(dot(hit.geometric, d)), 1e-6);
+				float light_pdf = luma(m.color) / emitted * hit.t * hit.t / cos_l;
+				weight = bsdf_pdf * bsdf_pdf / (bsdf_pdf * bsdf_pdf + light_pdf * light_pdf);
+			}
+			radiance += throughput * m.color * weight;
+			break;
+		}
+		if(bounce == depth) break;
+
+		// Glass and refraction are sided; everything else is seen from the front
+		vec3 n = hit.normal;
+		bool sided = m.type == GLASS || m.type == REFRACT;
+		if(!sided && dot(n, d) > 0.0) n = -n;
+		vec3 out_dir = -d;
+		o = hit.pos;
+		sampled_lights = false;
+
+		if(m.type == LAMBERTIAN) {
+			radiance += throughput * (point_lighting(o, n, m.color) + area_lighting(o, n, m.color));
+			d = cosine_sample(n);
+			bsdf_pdf = max(dot(d, n), 0.0) / PI;
+			if(bsdf_pdf <= 0.0) break;
+			throughput *= m.color;
+			sampled_lights = n_emitters > 0;
+		} else if(m.type == MIRROR) {
+			if(dot(out_dir, n) <= 0.0) break;
+			d = 2.0 * dot(out_dir, n) * n - out_dir;
+			throughput *= m.color;
+		} else if(m.type == GLASS) {
+			float cos_o = dot(out_dir, n);
+			bool entering = cos_o >= 0.0;
+			float eta = entering ? 1.0 / m.ior : m.ior;
+			vec3 in_dir;
+			bool refracting = false;
+			if(refract_dir(out_dir, n, m.ior, in_dir)) {
+				float cos_t = abs(cos_o), cos_i = abs(dot(in_dir, n));
+				float rs = (cos_i - eta * cos_t) / (cos_i + eta * cos_t);
+				float rp = (cos_t - eta * cos_i) / (cos_t + eta * cos_i);
+				refracting = rand() > 0.5 * (rs * rs + rp * rp);
+			}
+			if(refracting) {
+				d = in_dir;
+				throughput *= m.color * (entering ? 1.0 / (m.ior * m.ior) : m.ior * m.ior);
+			} else {
+				d = 2.0 * cos_o * n - out_dir;
+				throughput *= m.reflectance;
+			}
+		} else {
+			vec3 in_dir;
+			if(!refract_dir(out_dir, n, m.ior, in_dir)) break;
+			d = in_dir;
+			throughput *= m.color;
+		}
+		if(luma(throughput) <= 0.0) break;
+	}
+
+	// Samples that went wrong are left out, as on the CPU
+	if(any(isnan(radiance)) || any(isinf(radiance))) return;
+	vec4 last = sample_index == 0u ? vec4(0.0) : imageLoad(accum, px);
+	vec3 mean = last.rgb + (radiance - last.rgb) / (last.a + 1.0);
+	imageStore(accum, px, vec4(mean, last.a + 1.0));
+})";
+
+const std::string GPU_Tracer::tonemap_source = R"(
+#version 430 core
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(rgba32f, binding = 0) readonly uniform image2D accum;
+layout(rgba8, binding = 1) writeonly uniform image2D display;
+uniform vec2 size;
+uniform float exposure;
+
+float to_srgb(float f) {
+	return f <= 0.0031308 ? 12.92 * f : 1.055 * pow(f, 1.0 / 2.4) - 0.055;
+}
+
+// As HDR_Image::tonemap_to, with the rows flipped for display
+void main() {
+	ivec2 px = ivec2(gl_GlobalInvocationID.xy);
+	if(px.x >= int(size.x) || px.y >= int(size.y)) return;
+	vec3 c = clamp(1.0 - exp(-imageLoad(accum, px).rgb * exposure), 0.0, 1.0);
+	vec4 color = vec4(to_srgb(c.r), to_srgb(c.g), to_srgb(c.b), 1.0);
+	imageStore(display, ivec2(px.x, int(size.y) - 1 - px.y), color);
+})";
+
+} // namespace PT
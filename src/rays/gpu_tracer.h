@@ -0,0 +1,116 @@
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../platform/gl.h"
+#include "../util/camera.h"
+#include "../util/hdr_image.h"
+
+namespace PT {
+
+// A scene as GPU_Tracer takes it, made from the path tracer's own description by
+// Pathtracer::gpu_scene: world-space triangles, the materials and point, spot and
+// directional lights the path tracer made, and its environment light baked into an
+// equirectangular image. The structs are laid out as the shader's std430 structs.
+struct GPU_Scene {
+    struct Triangle {
+        Vec3 v0;
+        uint32_t material = 0;
+        Vec3 v1;
+        float pad0 = 0.0f;
+        Vec3 v2;
+        float pad1 = 0.0f;
+        Vec3 n0;
+        float pad2 = 0.0f;
+        Vec3 n1;
+        float pad3 = 0.0f;
+        Vec3 n2;
+        float pad4 = 0.0f;
+
+        BBox bbox() const {
+            BBox box(v0, v0);
+            box.enclose(v1);
+            box.enclose(v2);
+            return box;
+        }
+    };
+    enum Material_Type : uint32_t { lambertian, mirror, glass, emissive, refract };
+    struct Material {
+        // Albedo, reflectance, transmittance or emitted radiance, by type
+        Vec3 color;
+        uint32_t type = lambertian;
+        // Of glass, which also transmits color
+        Vec3 reflectance{};
+        float ior = 1.0f;
+    };
+    enum Light_Type : uint32_t { directional, point, spot };
+    struct Light {
+        Vec3 pos;
+        uint32_t type = point;
+        // Toward a directional light, or along a spot light's axis
+        Vec3 dir;
+        // Of a spot light, where its falloff starts and ends, in degrees from the axis
+        float inner = 0.0f;
+        Vec3 radiance;
+        float outer = 0.0f;
+    };
+
+    std::vector<Triangle> triangles;
+    std::vector<Material> materials;
+    std::vector<Light> lights;
+    // RGB, rows from the +y pole down, columns around y from -x; empty without one
+    std::vector<float> env;
+    size_t env_w = 0, env_h = 0;
+};
+
+// Path traces a GPU_Scene in OpenGL 4.3 compute shaders, for fast interactive
+// previews. Each dispatch adds one sample per pixel to an RGBA32F accumulation
+// texture, which is tonemapped on the GPU for display. It follows the CPU path
+// tracer's conventions (two-sided surfaces, undimmed point lights, the same BSDFs)
+// and samples point lights and emissive triangles at every diffuse hit, the latter
+// combined with BSDF sampling by the power heuristic. All calls must come from the
+// thread owning the GL context.
+class GPU_Tracer {
+public:
+    static bool supported();
+
+    // Builds a BVH over the scene's triangles and uploads it; returns an error if the
+    // shaders could not be compiled
+    std::string build(GPU_Scene&& scene);
+    // Starts accumulating samples of the built scene from scratch
+    void begin_render(const Camera& camera, size_t w, size_t h, size_t samples, size_t depth);
+    // Traces as many samples as fit in about budget milliseconds of GPU time
+    void step(float budget_ms);
+    void cancel();
+    bool in_progress() const;
+    float progress() const;
+
+    const GL::Tex2D& get_output_texture(float exposure);
+    // Reads the accumulated radiance back, e.g. to save it
+    void read_output(HDR_Image& out) const;
+
+private:
+    void dispatch(size_t samples);
+
+    GL::Shader trace_shader, tonemap_shader;
+    GL::Storage nodes, triangles, materials, lights, emitters;
+    GL::Tex2D env, accum, display;
+    size_t n_nodes = 0, n_lights = 0, n_emitters = 0;
+    bool has_env = false;
+    // Luma times area summed over emissive triangles
+    float emitted = 0.0f;
+
+    Vec3 eye, forward, right, up;
+    size_t w = 0, h = 0, depth = 0, total_samples = 0, done_samples = 0;
+    // Samples per step, adjusted to fill the budget
+    size_t batch = 1;
+    float shown_exposure = -1.0f;
+    size_t shown_samples = 0;
+
+    static const std::string trace_source, tonemap_source;
+};
+
+} // namespace PT
@@ -1,5 +1,6 @@
 
 #include "light.h"
+#include "../util/rand.h"
 
 namespace PT {
 
@@ -11,6 +12,11 @@ Light_Sample Directional_Light::sample(Vec3) const {
     return ret;
 }
 
+Vec3 Directional_Light::emit(Spectrum& weight) const {
+    weight = {};
+    return Vec3(0.0f, -1.0f, 0.0f);
+}
+
 Light_Sample Point_Light::sample(Vec3 from) const {
     Light_Sample ret;
     ret.direction = -from.unit();
@@ -19,6 +25,11 @@ Light_Sample Point_Light::sample(Vec3 from) const {
     return ret;
 }
 
+Vec3 Point_Light::emit(Spectrum& weight) const {
+    weight = radiance * (4.0f * PI_F);
+    return Samplers::Sphere::Uniform{}.sample();
+}
+
 Light_Sample Spot_Light::sample(Vec3 from) const {
     Light_Sample ret;
     float angle = std::atan2(Vec2(from.x, from.z).norm(), from.y);
@@ -30,4 +41,16 @@ Light_Sample Spot_Light::sample(Vec3 from) const {
     return ret;
 }
 
+Vec3 Spot_Light::emit(Spectrum& weight) const {
+    // Uniform over the cone about +y the light reaches at all
+    float cos_max = std::cos(Radians(angle_bounds.y / 2.0f));
+    float cos_t = 1.0f - RNG::unit() * (1.0f - cos_max);
+    float sin_t = std::sqrt(std::max(0.0f, 1.0f - cos_t * cos_t));
+    float phi = 2.0f * PI_F * RNG::unit();
+    float angle = Degrees(std::acos(cos_t));
+    weight = (1.0f - smoothstep(angle_bounds.x / 2.0f, angle_bounds.y / 2.0f, angle)) * radiance *
+             (2.0f * PI_F * (1.0f - cos_max));
+    return Vec3(sin_t * std::cos(phi), cos_t, sin_t * std::sin(phi));
+}
+
 } // namespace PT
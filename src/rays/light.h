@@ -29,6 +29,7 @@ struct Directional_Light {
     }
 
     Light_Sample sample(Vec3 from) const;
+    Vec3 emit(Spectrum& weight) const;
     Spectrum radiance;
 };
 
@@ -38,6 +39,7 @@ struct Point_Light {
     }
 
     Light_Sample sample(Vec3 from) const;
+    Vec3 emit(Spectrum& weight) const;
     Spectrum radiance;
 };
 
@@ -47,6 +49,7 @@ struct Spot_Light {
     }
 
     Light_Sample sample(Vec3 from) const;
+    Vec3 emit(Spectrum& weight) const;
     Spectrum radiance;
     Vec2 angle_bounds;
 };
@@ -78,9 +81,25 @@ public:
         return ret;
     }
 
+    // A random direction light leaves the light's origin in, with weight set to the
+    // intensity that way over the pdf of picking it. Directional lights have no origin,
+    // so leave weight black.
+    Vec3 emit(Vec3& origin, Spectrum& weight) const {
+        Vec3 dir = std::visit([&weight](const auto& l) { return l.emit(weight); }, underlying);
+        origin = trans * Vec3{};
+        return has_trans ? trans.rotate(dir).unit() : dir;
+    }
+
     Scene_ID id() const {
         return _id;
     }
+    const Mat4& transform() const {
+        return trans;
+    }
+    // Calls f with the underlying light, e.g. to translate it for another renderer
+    template<typename F> decltype(auto) visit(F&& f) const {
+        return std::visit(std::forward<F>(f), underlying);
+    }
     void set_trans(const Mat4& T) {
         trans = T;
         itrans = T.inverse();
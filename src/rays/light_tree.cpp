@@ -0,0 +1,100 @@
+
+#include "light_tree.h"
+#include "../util/rand.h"
+
+#include <algorithm>
+#include <numeric>
+
+namespace PT {
+
+Light_Tree::Light_Tree(const std::vector<Light>& lights) {
+    if(lights.empty()) return;
+
+    // Leaves are padded so that point lights and flat emitters still have a
+    // volume to test rays against and a nonzero size to clamp distances to
+    std::vector<Light> padded = lights;
+    for(Light& light : padded) {
+        light.bounds.min -= Vec3(EPS_F);
+        light.bounds.max += Vec3(EPS_F);
+    }
+    std::vector<uint32_t> order(lights.size());
+    std::iota(order.begin(), order.end(), 0u);
+    nodes.reserve(2 * lights.size() - 1);
+    build(padded, order, 0, order.size());
+}
+
+uint32_t Light_Tree::build(std::vector<Light>& lights, std::vector<uint32_t>& order, size_t begin,
+                           size_t end) {
+
+    uint32_t idx = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+
+    BBox bounds, centroids;
+    float power = 0.0f;
+    for(size_t i = begin; i < end; i++) {
+        const Light& light = lights[order[i]];
+        bounds.enclose(light.bounds);
+        centroids.enclose(light.bounds.center());
+        power += light.power;
+    }
+    nodes[idx].bounds = bounds;
+    nodes[idx].power = power;
+
+    if(end - begin == 1) {
+        nodes[idx].light = order[begin];
+        return idx;
+    }
+
+    // Median split along the widest axis of the light centers keeps the depth
+    // logarithmic, which bounds the traversal stack
+    Vec3 extent = centroids.max - centroids.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    size_t mid = begin + (end - begin) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                     [&](uint32_t l, uint32_t r) {
+                         return lights[l].bounds.center()[axis] < lights[r].bounds.center()[axis];
+                     });
+
+    build(lights, order, begin, mid);
+    uint32_t right = build(lights, order, mid, end);
+    nodes[idx].right = right;
+    return idx;
+}
+
+float Light_Tree::importance(const Node& node, Vec3 from) const {
+    Vec3 extent = node.bounds.max - node.bounds.min;
+    float d2 = (node.bounds.center() - from).norm_squared();
+    return node.power / std::max(d2, 0.25f * extent.norm_squared());
+}
+
+float Light_Tree::left_probability(uint32_t node, Vec3 from) const {
+    float l = importance(nodes[node + 1], from);
+    float r = importance(nodes[nodes[node].right], from);
+    if(l + r <= 0.0f) return 0.5f;
+    return l / (l + r);
+}
+
+size_t Light_Tree::sample(Vec3 from, float& pmf) const {
+    pmf = 0.0f;
+    if(nodes.empty()) return 0;
+
+    // A single draw is rescaled at each level to choose the next child
+    float u = RNG::unit();
+    pmf = 1.0f;
+    uint32_t n = 0;
+    while(!nodes[n].leaf()) {
+        float p = left_probability(n, from);
+        if(u < p) {
+            u = std::min(u / p, 1.0f - FLT_EPSILON);
+            pmf *= p;
+            n = n + 1;
+        } else {
+            u = std::min((u - p) / (1.0f - p), 1.0f - FLT_EPSILON);
+            pmf *= 1.0f - p;
+            n = nodes[n].right;
+        }
+    }
+    return nodes[n].light;
+}
+
+} // namespace PT
@@ -0,0 +1,79 @@
+
+#pragma once
+
+#include <vector>
+
+#include "../lib/mathlib.h"
+
+namespace PT {
+
+// Binary hierarchy over a set of lights, used to pick one light per shading point
+// with probability proportional to an estimate of its contribution there: the
+// power of a subtree over its squared distance, clamped to the size of its bounds
+// so that nearby clusters are not overweighted. Lights are referred to by their
+// index in the list the tree was built from.
+class Light_Tree {
+public:
+    struct Light {
+        BBox bounds;
+        float power = 0.0f;
+    };
+
+    Light_Tree() = default;
+    explicit Light_Tree(const std::vector<Light>& lights);
+
+    bool empty() const {
+        return nodes.empty();
+    }
+
+    // Pick a light as seen from a point; pmf is its probability (0 if there is none)
+    size_t sample(Vec3 from, float& pmf) const;
+
+    // Call f(light, pmf) for every light the ray passes the bounds of, with the
+    // probability sample() gives it from the ray's origin. Only these lights can
+    // have a nonzero directional pdf along the ray.
+    template<typename F> void for_hit(const Ray& ray, F&& f) const {
+        if(nodes.empty()) return;
+        struct Entry {
+            uint32_t node;
+            float pmf;
+        };
+        Entry stack[64];
+        size_t top = 0;
+        stack[top++] = {0, 1.0f};
+        while(top) {
+            Entry e = stack[--top];
+            const Node& node = nodes[e.node];
+            Vec2 times = ray.dist_bounds;
+            if(!node.bounds.hit(ray, times)) continue;
+            if(node.leaf()) {
+                f(size_t(node.light), e.pmf);
+                continue;
+            }
+            float p = left_probability(e.node, ray.point);
+            if(p < 1.0f) stack[top++] = {node.right, e.pmf * (1.0f - p)};
+            if(p > 0.0f) stack[top++] = {e.node + 1, e.pmf * p};
+        }
+    }
+
+private:
+    // The left child of an interior node directly follows it
+    struct Node {
+        BBox bounds;
+        float power = 0.0f;
+        uint32_t right = 0;
+        uint32_t light = 0;
+        bool leaf() const {
+            return right == 0;
+        }
+    };
+
+    uint32_t build(std::vector<Light>& lights, std::vector<uint32_t>& order, size_t begin,
+                   size_t end);
+    float importance(const Node& node, Vec3 from) const;
+    float left_probability(uint32_t node, Vec3 from) const;
+
+    std::vector<Node> nodes;
+};
+
+} // namespace PT
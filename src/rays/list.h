@@ -23,17 +23,43 @@ public:
     }
 
     Trace hit(const Ray& ray) const {
-        Trace ret;
+        float t = ray.dist_bounds.y;
+        Hit h;
+        if(!intersect(ray, t, h)) return {};
+        return finish(ray, t, h);
+    }
+
+    bool intersect(const Ray& ray, float& tmax, Hit& hit) const {
+        bool found = false;
+        for(size_t i = 0; i < prims.size(); i++) {
+            Hit h;
+            if(prims[i].intersect(ray, tmax, h)) {
+                hit = h;
+                hit.push(static_cast<uint32_t>(i));
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    Trace finish(const Ray& ray, float t, Hit hit) const {
+        uint32_t i = hit.pop();
+        return prims[i].finish(ray, t, hit);
+    }
+
+    bool occluded(const Ray& ray) const {
         for(const auto& p : prims) {
-            Trace test = p.hit(ray);
-            ret = Trace::min(ret, test);
+            if(p.occluded(ray)) return true;
         }
-        return ret;
+        return false;
     }
 
     void append(Primitive&& prim) {
         prims.push_back(std::move(prim));
     }
+    std::vector<Primitive>& edit_primitives() {
+        return prims;
+    }
 
     List<Primitive> copy() const {
         std::vector<Primitive> prim_copy = prims;
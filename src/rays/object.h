@@ -5,9 +5,11 @@
 #include "../scene/object.h"
 #include <variant>
 
+#include "affine.h"
 #include "bvh.h"
 #include "list.h"
 #include "shapes.h"
+#include "sphere_particles.h"
 #include "trace.h"
 #include "tri_mesh.h"
 
@@ -16,31 +18,27 @@ namespace PT {
 class Object {
 public:
     Object(Shape&& shape, Scene_ID id, unsigned int m = 0, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), _id(id), material(m), underlying(std::move(shape)) {
-        has_trans = trans != Mat4::I;
+        : transform(T), material(m), _id(id), underlying(std::move(shape)) {
     }
     Object(Tri_Mesh&& tri_mesh, Scene_ID id, unsigned int m = 0, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), _id(id), material(m), underlying(std::move(tri_mesh)) {
-        has_trans = trans != Mat4::I;
+        : transform(T), material(m), _id(id), underlying(std::move(tri_mesh)) {
+    }
+    Object(Sphere_Particles&& particles, Scene_ID id, unsigned int m = 0, const Mat4& T = Mat4::I)
+        : transform(T), material(m), _id(id), underlying(std::move(particles)) {
     }
     Object(List<Object>&& list, Scene_ID id, unsigned int m = 0, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), _id(id), material(m), underlying(std::move(list)) {
-        has_trans = trans != Mat4::I;
+        : transform(T), material(m), _id(id), underlying(std::move(list)) {
     }
     Object(BVH<Object>&& bvh, Scene_ID id, unsigned int m = 0, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), _id(id), material(m), underlying(std::move(bvh)) {
-        has_trans = trans != Mat4::I;
+        : transform(T), material(m), _id(id), underlying(std::move(bvh)) {
     }
 
     Object() {
     }
     Object(List<Object>&& list, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), underlying(std::move(list)) {
-        has_trans = trans != Mat4::I;
+        : transform(T), underlying(std::move(list)) {
     }
-    Object(BVH<Object>&& bvh, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), underlying(std::move(bvh)) {
-        has_trans = trans != Mat4::I;
+    Object(BVH<Object>&& bvh, const Mat4& T = Mat4::I) : transform(T), underlying(std::move(bvh)) {
     }
 
     Object(const Object& src) = delete;
@@ -50,32 +48,67 @@ public:
 
     BBox bbox() const {
         BBox box = std::visit([](const auto& o) { return o.bbox(); }, underlying);
-        if(has_trans) box.transform(trans);
+        if(!transform.identity()) box = transform.bbox(box);
         return box;
     }
 
-    Trace hit(Ray ray) const {
-        if(has_trans) ray.transform(itrans);
-        Trace ret = std::visit([&ray](const auto& o) { return o.hit(ray); }, underlying);
-        if(ret.hit) {
-            if(material != -1) ret.material = material;
-            if(has_trans) ret.transform(trans, itrans.T());
+    Trace hit(const Ray& ray) const {
+        float t = ray.dist_bounds.y;
+        Hit h;
+        if(!intersect(ray, t, h)) return {};
+        return finish(ray, t, h);
+    }
+
+    // First hit of a segment from `from` to `from + delta`, or up to pad past its end
+    // (e.g. a sphere of radius pad swept along it). Traversal prunes everything
+    // further, so short segments in open space visit only a few nodes.
+    Trace sweep(Vec3 from, Vec3 delta, float pad) const {
+        float len = delta.norm();
+        if(len == 0.0f) return {};
+        return hit(Ray(from, delta, Vec2(EPS_F, len + pad)));
+    }
+
+    // tmax is in the caller's space; the underlying object works in its own, in
+    // which distances are scaled by the length of the transformed direction.
+    bool intersect(Ray ray, float& tmax, Hit& hit) const {
+        float scale = 1.0f;
+        if(!transform.identity()) scale = transform.localize(ray);
+        float t = tmax * scale;
+        if(!std::visit([&](const auto& o) { return o.intersect(ray, t, hit); }, underlying)) {
+            return false;
         }
+        tmax = t / scale;
+        return true;
+    }
+
+    Trace finish(Ray ray, float t, Hit hit) const {
+        if(!transform.identity()) t *= transform.localize(ray);
+        Trace ret = std::visit([&](const auto& o) { return o.finish(ray, t, hit); }, underlying);
+        if(material != -1) ret.material = material;
+        if(!transform.identity()) transform.globalize(ret);
         return ret;
     }
 
+    bool occluded(Ray ray) const {
+        if(!transform.identity()) transform.localize(ray);
+        return std::visit([&ray](const auto& o) { return o.occluded(ray); }, underlying);
+    }
+
     size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, Mat4 vtrans) const {
-        if(has_trans) vtrans = vtrans * trans;
+        if(!transform.identity()) vtrans = vtrans * transform.matrix();
         return std::visit(
             overloaded{
                 [&](const BVH<Object>& bvh) { return bvh.visualize(lines, active, level, vtrans); },
                 [&](const Tri_Mesh& mesh) { return mesh.visualize(lines, active, level, vtrans); },
+                [&](const Sphere_Particles& particles) {
+                    return particles.visualize(lines, active, level, vtrans);
+                },
                 [](const auto&) { return size_t(0); }},
             underlying);
     }
 
     Vec3 sample(Vec3 from) const {
-        if(has_trans) from = itrans * from;
+        if(!transform.identity()) from = transform.inverse_point(from);
         Vec3 dir =
             std::visit(overloaded{[from](const List<Object>& list) { return list.sample(from); },
                                   [from](const Tri_Mesh& mesh) { return mesh.sample(from); },
@@ -83,14 +116,22 @@ public:
                                       die("Sampling implicit objects/BVHs is not yet supported.");
                                   }},
                        underlying);
-        if(has_trans) dir = trans.rotate(dir).unit();
+        if(!transform.identity()) dir = transform.vector(dir).unit();
         return dir;
     }
 
+    // See Tri_Mesh::sample_point; only meshes can be sampled this way
+    void sample_point(Vec3& pos, Vec3& normal, float& pdf) const {
+        Mat4 T = transform.identity() ? Mat4::I : transform.matrix();
+        std::visit(overloaded{[&](const Tri_Mesh& mesh) { mesh.sample_point(T, pos, normal, pdf); },
+                              [](const auto&) { die("Only meshes have points to sample."); }},
+                   underlying);
+    }
+
     float pdf(Ray ray, Mat4 T = Mat4::I, Mat4 iT = Mat4::I) const {
-        if(has_trans) {
-            T = T * trans;
-            iT = itrans * iT;
+        if(!transform.identity()) {
+            T = T * transform.matrix();
+            iT = transform.inverse() * iT;
         }
         return std::visit(
             overloaded{[ray, T, iT](const List<Object>& list) { return list.pdf(ray, T, iT); },
@@ -104,18 +145,34 @@ public:
     Scene_ID id() const {
         return _id;
     }
+    int material_index() const {
+        return material;
+    }
     void set_trans(const Mat4& T) {
-        trans = T;
-        itrans = T.inverse();
-        has_trans = trans != Mat4::I;
+        transform.set(T);
+    }
+
+    // For an object made of others (a BVH or list of them): calls f on each, then
+    // refits the BVH to wherever they moved
+    template<typename F> void edit_objects(F&& f, Thread_Pool* pool = nullptr) {
+        std::visit(overloaded{[&](BVH<Object>& bvh) {
+                                  for(Object& o : bvh.edit_primitives()) f(o);
+                                  bvh.refit(pool);
+                              },
+                              [&](List<Object>& list) {
+                                  for(Object& o : list.edit_primitives()) f(o);
+                              },
+                              [](auto&) {}},
+                   underlying);
     }
 
 private:
-    bool has_trans = false;
-    Mat4 trans, itrans;
+    friend class Compiled_Scene;
+
+    Affine transform;
     int material = -1;
     Scene_ID _id = 0;
-    std::variant<Tri_Mesh, Shape, BVH<Object>, List<Object>> underlying;
+    std::variant<Tri_Mesh, Shape, Sphere_Particles, BVH<Object>, List<Object>> underlying;
 };
 
 } // namespace PT
@@ -0,0 +1,113 @@
+
+#include "path_guide.h"
+#include "../util/rand.h"
+
+#include <algorithm>
+
+namespace PT {
+
+// Every bin is guided at least this fraction of uniform, so that directions the
+// training missed are still sampled now and then
+static constexpr float uniform_floor = 0.01f;
+
+// Records are summed in fixed point, since integer addition gives the same total in
+// whatever order the training threads add them (float addition doesn't). One record
+// counts for at most max_record, so that a cell's sum can't overflow.
+static constexpr float fixed_scale = 65536.0f;
+static constexpr float max_record = 1048576.0f;
+
+static uint64_t to_fixed(float v) {
+    return uint64_t(std::clamp(v, 0.0f, max_record) * fixed_scale + 0.5f);
+}
+
+void Path_Guide::reset(BBox box) {
+
+    bounds = box;
+    Vec3 extent = hmax(box.max - box.min, Vec3(EPS_F));
+    float longest = std::max(extent.x, std::max(extent.y, extent.z));
+    for(int a = 0; a < 3; a++) {
+        dim[a] = std::clamp(size_t(std::ceil(max_cells * extent[a] / longest)), size_t(1),
+                            max_cells);
+        cell_scale[a] = dim[a] / extent[a];
+    }
+
+    size_t cells = dim[0] * dim[1] * dim[2];
+    sums = std::vector<std::atomic<uint64_t>>(cells * bins);
+    counts = std::vector<std::atomic<uint32_t>>(cells);
+    cdfs.assign(cells * bins, 0.0f);
+}
+
+size_t Path_Guide::cell(Vec3 pos) const {
+    size_t idx[3];
+    for(int a = 0; a < 3; a++) {
+        float f = std::floor((pos[a] - bounds.min[a]) * cell_scale[a]);
+        idx[a] = size_t(std::clamp(f, 0.0f, float(dim[a] - 1)));
+    }
+    return (idx[2] * dim[1] + idx[1]) * dim[0] + idx[0];
+}
+
+size_t Path_Guide::bin(Vec3 dir) {
+    float u = (dir.y + 1.0f) * 0.5f;
+    float v = (std::atan2(dir.z, dir.x) + PI_F) / (2.0f * PI_F);
+    size_t t = std::min(size_t(std::max(u, 0.0f) * bins_theta), bins_theta - 1);
+    size_t p = std::min(size_t(std::max(v, 0.0f) * bins_phi), bins_phi - 1);
+    return t * bins_phi + p;
+}
+
+void Path_Guide::record(Vec3 pos, Vec3 dir, float radiance, float pdf) {
+    if(counts.empty() || pdf <= 0.0f || !std::isfinite(radiance)) return;
+    size_t c = cell(pos);
+    sums[c * bins + bin(dir)].fetch_add(to_fixed(radiance / pdf), std::memory_order_relaxed);
+    counts[c].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Path_Guide::update() {
+
+    for(size_t c = 0; c < counts.size(); c++) {
+        float* cdf = &cdfs[c * bins];
+        uint64_t total = 0;
+        for(size_t b = 0; b < bins; b++) total += sums[c * bins + b].load();
+        if(counts[c].load() < min_records || total == 0) {
+            std::fill(cdf, cdf + bins, 0.0f);
+            continue;
+        }
+        float sum = 0.0f;
+        for(size_t b = 0; b < bins; b++) {
+            float p = float(double(sums[c * bins + b].load()) / double(total));
+            sum += (1.0f - uniform_floor) * p + uniform_floor / bins;
+            cdf[b] = sum;
+        }
+        cdf[bins - 1] = 1.0f;
+    }
+}
+
+bool Path_Guide::guides(Vec3 pos) const {
+    return !cdfs.empty() && cdfs[cell(pos) * bins + bins - 1] > 0.0f;
+}
+
+Vec3 Path_Guide::sample(Vec3 pos) const {
+
+    const float* cdf = &cdfs[cell(pos) * bins];
+    size_t b = std::upper_bound(cdf, cdf + bins, RNG::unit()) - cdf;
+    b = std::min(b, bins - 1);
+
+    // Uniform within the bin, which is uniform over its solid angle
+    float z = (b / bins_phi + RNG::unit()) / bins_theta * 2.0f - 1.0f;
+    float phi = (b % bins_phi + RNG::unit()) / bins_phi * 2.0f * PI_F - PI_F;
+    float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    return Vec3{r * std::cos(phi), z, r * std::sin(phi)};
+}
+
+float Path_Guide::pdf(Vec3 pos, Vec3 dir) const {
+    const float* cdf = &cdfs[cell(pos) * bins];
+    size_t b = bin(dir);
+    float mass = cdf[b] - (b ? cdf[b - 1] : 0.0f);
+    return mass * bins / (4.0f * PI_F);
+}
+
+size_t Path_Guide::bytes() const {
+    return sums.size() * sizeof(std::atomic<uint64_t>) +
+           counts.size() * sizeof(std::atomic<uint32_t>) + cdfs.size() * sizeof(float);
+}
+
+} // namespace PT
@@ -0,0 +1,59 @@
+
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "../lib/mathlib.h"
+
+namespace PT {
+
+// Learns where light arrives from across the scene, so that indirect bounces can be
+// sampled toward it: a simplified form of Muller et al. 2017, "Practical Path
+// Guiding". The scene's bounds are divided into a grid of cells, each keeping a
+// histogram of the radiance arriving at it over directions. Bins cover equal solid
+// angles (uniform in cos theta and phi), so a bin's density is flat within it.
+// Training paths record radiance, which update() turns into the distributions
+// sampled from; these stay fixed while the guide is only read.
+class Path_Guide {
+public:
+    static constexpr size_t max_cells = 16, bins_theta = 8, bins_phi = 16;
+    static constexpr size_t bins = bins_theta * bins_phi;
+    // Cells with fewer records than this are left to BSDF sampling
+    static constexpr uint32_t min_records = 16;
+
+    // Forgets everything learned and covers box with cells, at most max_cells along
+    // its longest axis
+    void reset(BBox box);
+
+    // Adds an estimate of the radiance arriving at pos from (world-space) dir, which
+    // was sampled with this pdf. Safe to call from many threads, in any order: the
+    // distributions learned are the same.
+    void record(Vec3 pos, Vec3 dir, float radiance, float pdf);
+    // Rebuilds the distributions from everything recorded since reset()
+    void update();
+
+    // Whether pos is in a cell with a distribution
+    bool guides(Vec3 pos) const;
+    // A world-space direction from the distribution at pos, which must guide
+    Vec3 sample(Vec3 pos) const;
+    float pdf(Vec3 pos, Vec3 dir) const;
+
+    size_t bytes() const;
+
+private:
+    size_t cell(Vec3 pos) const;
+    static size_t bin(Vec3 dir);
+
+    BBox bounds;
+    size_t dim[3] = {};
+    Vec3 cell_scale;
+
+    // Radiance over pdf summed per cell and bin (in fixed point), and records per cell
+    std::vector<std::atomic<uint64_t>> sums;
+    std::vector<std::atomic<uint32_t>> counts;
+    // Per cell, a running sum over bins ending in 1, or empty (all zero) if unguided
+    std::vector<float> cdfs;
+};
+
+} // namespace PT
@@ -2,236 +2,1252 @@
 #include "pathtracer.h"
 #include "../geometry/util.h"
 #include "../gui/render.h"
+#include "../util/profiler.h"
+#include "../util/rand.h"
 
 #include <SDL2/SDL.h>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <optional>
 #include <thread>
 
 namespace PT {
 
 Pathtracer::Pathtracer(Gui::Widget_Render& gui, Vec2 screen_dim)
-    : thread_pool(std::thread::hardware_concurrency()), gui(gui), camera(screen_dim),
-      scene(List<Object>()) {
-    accumulator_samples = 0;
-    total_epochs = 0;
-    completed_epochs = 0;
+    : thread_pool(parallel_pool()), render_tasks(thread_pool), build_tasks(thread_pool), gui(gui),
+      surfaces_camera(screen_dim) {
+    views.push_back({Camera(screen_dim), 0.0f});
+    total_tiles = 0;
+    completed_tiles = 0;
     out_w = out_h = 0;
     n_samples = 0;
 }
 
 Pathtracer::~Pathtracer() {
     cancel();
-    thread_pool.stop();
 }
 
-void Pathtracer::build_lights(Scene& layout_scene) {
+void Pathtracer::build_lights(Scene_Snapshot& snap) {
 
     point_lights.clear();
     env_light.reset();
+    portals.clear();
+
+    for(const Scene_Snapshot::Object& obj : snap.objects) {
+        if(!obj.portal) continue;
+        const auto& verts = *obj.mesh.verts;
+        const auto& idxs = *obj.mesh.indices;
+        for(size_t i = 0; i + 2 < idxs.size(); i += 3) {
+            portals.add(obj.T * verts[idxs[i]].pos, obj.T * verts[idxs[i + 1]].pos,
+                        obj.T * verts[idxs[i + 2]].pos);
+        }
+    }
 
-    layout_scene.for_items([&, this](const Scene_Item& item) {
-        if(item.is<Scene_Light>()) {
+    std::vector<Delta_Light> positional;
+    std::vector<Light_Tree::Light> tree_lights;
+    auto add_positional = [&](Delta_Light&& light, const Mat4& T, Spectrum r) {
+        Vec3 pos = T * Vec3{};
+        tree_lights.push_back({BBox(pos, pos), r.luma()});
+        positional.push_back(std::move(light));
+    };
+
+    for(Scene_Snapshot::Light& light : snap.lights) {
+
+        Spectrum r = light.radiance;
+        const Mat4& T = light.T;
+
+        switch(light.type) {
+        case Light_Type::directional: {
+            point_lights.push_back(Delta_Light(Directional_Light(r), light.id, T));
+        } break;
+        case Light_Type::sphere: {
+            if(light.env_map) {
+                env_light = Env_Light(Env_Map(std::move(*light.env_map), &thread_pool));
+            } else {
+                env_light = Env_Light(Env_Sphere(r));
+            }
+        } break;
+        case Light_Type::hemisphere: {
+            env_light = Env_Light(Env_Hemisphere(r));
+        } break;
+        case Light_Type::point: {
+            add_positional(Delta_Light(Point_Light(r), light.id, T), T, r);
+        } break;
+        case Light_Type::spot: {
+            add_positional(Delta_Light(Spot_Light(r, light.angle_bounds), light.id, T), T, r);
+        } break;
+        default: break;
+        }
+    }
 
-            const Scene_Light& light = item.get<Scene_Light>();
-            Spectrum r = light.radiance();
+    n_directional = point_lights.size();
+    std::move(positional.begin(), positional.end(), std::back_inserter(point_lights));
+    point_light_tree = Light_Tree(tree_lights);
 
-            switch(light.opt.type) {
-            case Light_Type::directional: {
-                point_lights.push_back(
-                    Delta_Light(Directional_Light(r), light.id(), light.pose.transform()));
-            } break;
-            case Light_Type::sphere: {
-                if(light.opt.has_emissive_map) {
-                    env_light = Env_Light(Env_Map(light.emissive_copy()));
-                } else {
-                    env_light = Env_Light(Env_Sphere(r));
-                }
-            } break;
-            case Light_Type::hemisphere: {
-                env_light = Env_Light(Env_Hemisphere(r));
-            } break;
-            case Light_Type::point: {
-                point_lights.push_back(
-                    Delta_Light(Point_Light(r), light.id(), light.pose.transform()));
-            } break;
-            case Light_Type::spot: {
-                point_lights.push_back(Delta_Light(Spot_Light(r, light.opt.angle_bounds),
-                                                   light.id(), light.pose.transform()));
-            } break;
-            default: return;
-            }
+    light_kinds = (env_light.has_value() ? Light_Kinds::env : 0) |
+                  (!area_lights.empty() ? Light_Kinds::area : 0) |
+                  (!point_lights.empty() ? Light_Kinds::point : 0);
+}
+
+// Surface area of a mesh under a transform, which weights emitters in the light tree
+static float mesh_area(const GL::Mesh::Data& mesh, const Mat4& T) {
+    const auto& verts = *mesh.verts;
+    const auto& idxs = *mesh.indices;
+    float area = 0.0f;
+    for(size_t i = 0; i + 2 < idxs.size(); i += 3) {
+        Vec3 v0 = T * verts[idxs[i]].pos, v1 = T * verts[idxs[i + 1]].pos,
+             v2 = T * verts[idxs[i + 2]].pos;
+        area += 0.5f * cross(v1 - v0, v2 - v0).norm();
+    }
+    return area;
+}
+
+// What an object renders with, if the path tracer supports its material
+static std::optional<BSDF> material_bsdf(const Material::Options& opt, Spectrum emissive) {
+    switch(opt.type) {
+    case Material_Type::lambertian: return BSDF(BSDF_Lambertian(opt.albedo.to_linear()));
+    case Material_Type::mirror: return BSDF(BSDF_Mirror(opt.reflectance));
+    case Material_Type::refract: return BSDF(BSDF_Refract(opt.transmittance, opt.ior));
+    case Material_Type::glass:
+        return BSDF(BSDF_Glass(opt.transmittance, opt.reflectance, opt.ior));
+    case Material_Type::diffuse_light: return BSDF(BSDF_Diffuse(emissive));
+    default: return std::nullopt;
+    }
+}
+
+// Whether a particle mesh is a sphere, so that its particles can be traced as
+// Particle_Spheres: its vertices lie at one distance from their center, with normals
+// pointing away from it (the corners of a cube are equidistant too).
+static bool sphere_mesh(const GL::Mesh::Data& mesh, Vec3& center, float& radius) {
+
+    const auto& verts = *mesh.verts;
+    if(verts.size() < 12) return false;
+
+    BBox box;
+    for(const GL::Mesh::Vert& v : verts) box.enclose(v.pos);
+    center = box.center();
+    radius = 0.0f;
+    for(const GL::Mesh::Vert& v : verts) radius += (v.pos - center).norm();
+    radius /= verts.size();
+    if(radius <= 0.0f) return false;
+
+    for(const GL::Mesh::Vert& v : verts) {
+        Vec3 r = v.pos - center;
+        float d = r.norm();
+        if(std::abs(d - radius) > 1e-3f * radius || dot(r / d, v.norm.unit()) < 0.99f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Pathtracer::Scene_Snapshot Pathtracer::capture(Scene& layout_scene) {
+
+    PROFILE_ZONE("Capture Scene");
+    Scene_Snapshot snap;
+    snap.objects.reserve(layout_scene.count<Scene_Object>());
+    snap.particles.reserve(layout_scene.count<Scene_Particles>());
+    snap.lights.reserve(layout_scene.count<Scene_Light>());
+    // Meshes are synced here on this thread, since posing regenerates them
+    layout_scene.for_each<Scene_Object>([&snap](Scene_Object& obj) {
+        Scene_Snapshot::Object& o = snap.objects.emplace_back();
+        o.id = obj.id();
+        o.T = obj.pose.transform();
+        o.material = obj.material.opt;
+        o.emissive = obj.material.emissive();
+        o.is_shape = obj.is_shape();
+        o.portal = obj.opt.portal && !o.is_shape;
+        o.render = obj.opt.render && !o.portal && material_bsdf(o.material, o.emissive);
+        o.light = o.render && o.material.type == Material_Type::diffuse_light;
+        o.shape = obj.opt.shape;
+        // NOTE(max): we use an approximate triangle mesh for shape objects
+        // because PT::Object only supports sampling triangles
+        if(!o.is_shape) {
+            o.mesh = obj.posed_mesh().data();
+        } else if(o.light) {
+            o.mesh = obj.opt.shape.mesh().data();
         }
+        o.custom_bvh = obj.opt.custom_bvh;
+        o.profile = obj.opt.bvh_profile;
     });
+    layout_scene.for_each<Scene_Particles>([&snap](Scene_Particles& particles) {
+        Scene_Snapshot::Particles& p = snap.particles.emplace_back();
+        p.id = particles.id();
+        p.color = particles.opt.color.to_linear();
+        p.scale = particles.opt.scale;
+        p.positions = particles.get_particles().positions();
+        p.mesh = particles.mesh().data();
+    });
+    layout_scene.for_each<Scene_Light>([&snap](Scene_Light& light) {
+        Scene_Snapshot::Light& l = snap.lights.emplace_back();
+        l.id = light.id();
+        l.type = light.opt.type;
+        l.radiance = light.radiance();
+        l.T = light.pose.transform();
+        l.angle_bounds = light.opt.angle_bounds;
+        if(l.type == Light_Type::sphere && light.opt.has_emissive_map) {
+            l.env_map = light.emissive_copy();
+        }
+    });
+    return snap;
 }
 
-void Pathtracer::build_scene(Scene& layout_scene) {
+std::vector<Object> Pathtracer::run_build_jobs(std::vector<Build_Job>& jobs) {
+
+    // Jobs start largest first, so that the big mesh builds (which split into
+    // subtasks on the pool themselves) are not left for last. With a build_memory
+    // limit, a job only starts once those in flight leave room for its estimate,
+    // waiting on them in the order they started; one job always runs regardless.
+    std::vector<size_t> order(jobs.size());
+    std::iota(order.begin(), order.end(), size_t(0));
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t l, size_t r) { return jobs[l].cost > jobs[r].cost; });
+
+    std::vector<Pool_Future<std::vector<Object>>> futures(jobs.size());
+    std::vector<std::vector<Object>> results(jobs.size());
+    size_t in_flight = 0, waited = 0;
+    auto wait_next = [&]() {
+        size_t j = order[waited++];
+        results[j] = thread_pool.wait_for(futures[j]);
+        in_flight -= jobs[j].cost;
+    };
+
+    for(size_t i = 0; i < order.size(); i++) {
+        Build_Job& job = jobs[order[i]];
+        while(build_memory && waited < i && in_flight + job.cost > build_memory) wait_next();
+        in_flight += job.cost;
+        thread_pool.submit(futures[order[i]], std::move(job.run));
+    }
+    while(waited < order.size()) wait_next();
+
+    // Gathered in scene order, so the scene compiles the same however jobs finished
+    size_t total = 0;
+    for(const auto& result : results) total += result.size();
+    std::vector<Object> objs;
+    objs.reserve(total);
+    for(auto& result : results) {
+        std::move(result.begin(), result.end(), std::back_inserter(objs));
+        std::vector<Object>().swap(result);
+    }
+    return objs;
+}
 
-    // It would be nice to let the interface be usable here (as with
-    // the path-tracing part), but this would cause too much hassle with
-    // editing the scene while building BVHs from it.
-    // This could be worked around by first copying all the mesh data
-    // and then building the BVHs, but I don't think it's that big
-    // of a deal, as BVH building should take at most a few seconds
-    // even with many big meshes.
+std::vector<Pathtracer::Build_Key> Pathtracer::build_keys(const Scene_Snapshot& snap) const {
+
+    std::vector<Build_Key> keys;
+    for(const Scene_Snapshot::Object& obj : snap.objects) {
+        Build_Key key;
+        key.id = obj.id;
+        if(obj.is_shape) {
+            key.shape = obj.shape;
+        } else {
+            key.revision = obj.mesh.revision;
+            key.rebuild = key.revision == 0;
+        }
+        key.custom_bvh = obj.custom_bvh;
+        key.profile = obj.profile;
+        if(obj.render) key.kind = obj.light ? 2 : 1;
+        key.T = obj.T;
+        keys.push_back(std::move(key));
+    }
+    for(const Scene_Snapshot::Particles& particles : snap.particles) {
+        Build_Key key;
+        key.id = particles.id;
+        key.rebuild = true;
+        keys.push_back(std::move(key));
+    }
+    return keys;
+}
 
-    // We could also do instancing instead of duplicating the bvh
-    // for big meshes, but that's something to add in the future
+bool Pathtracer::reuse_build(Scene_Snapshot& snap, std::vector<Build_Key>& keys) {
 
+    if(built_keys.size() != keys.size() || built_use_bvh != scene_use_bvh ||
+       built_options != mesh_options || built_compressed != compress_meshes ||
+       built_out_of_core != out_of_core) {
+        return false;
+    }
+    for(size_t i = 0; i < keys.size(); i++) {
+        const Build_Key &a = keys[i], &b = built_keys[i];
+        if(a.rebuild || b.rebuild || a.id != b.id || a.revision != b.revision ||
+           a.shape != b.shape || a.custom_bvh != b.custom_bvh || a.profile != b.profile ||
+           a.kind != b.kind) {
+            return false;
+        }
+    }
+
+    std::unordered_map<Scene_ID, Mat4> moved;
+    for(size_t i = 0; i < keys.size(); i++) {
+        if(keys[i].T != built_keys[i].T) moved[keys[i].id] = keys[i].T;
+    }
+
+    // Materials and area lights are remade in the order the full build made them,
+    // which the objects' material indices refer to
     materials.clear();
+    std::vector<Light_Tree::Light> area_light_power;
+    for(const Scene_Snapshot::Object& obj : snap.objects) {
+        if(!obj.render) continue;
+        materials.push_back(*material_bsdf(obj.material, obj.emissive));
+        if(!obj.light) continue;
+
+        Object& light = area_lights[area_light_power.size()];
+        if(moved.count(obj.id)) light.set_trans(obj.T);
+        float area = mesh_area(obj.mesh, obj.T);
+        area_light_power.push_back({light.bbox(), obj.emissive.luma() * area});
+    }
 
-    std::vector<std::future<std::vector<Object>>> futures;
-    std::vector<Object> area_light_list;
+    if(!moved.empty()) {
+        scene.move_objects(moved, &thread_pool);
+        scene_stats = scene.stats();
+    }
+    area_light_tree = Light_Tree(area_light_power);
+    build_lights(snap);
+    built_keys = std::move(keys);
+    return true;
+}
 
-    layout_scene.for_items([&, this](Scene_Item& item) {
-        if(item.is<Scene_Object>()) {
+void Pathtracer::build_scene(Scene_Snapshot& snap) {
 
-            Scene_Object& obj = item.get<Scene_Object>();
-            unsigned int idx = (unsigned int)materials.size();
-            const Material::Options& opt = obj.material.opt;
+    PROFILE_ZONE("Build Scene");
+    std::vector<Build_Key> keys = build_keys(snap);
+    if(reuse_build(snap, keys)) return;
 
-            if(!obj.opt.render) return;
+    // Building only reads the snapshot, which the scene's own meshes don't change,
+    // so the scene can be edited meanwhile (see build_async).
 
-            switch(opt.type) {
-            case Material_Type::lambertian: {
-                materials.push_back(BSDF(BSDF_Lambertian(opt.albedo.to_linear())));
-            } break;
-            case Material_Type::mirror: {
-                materials.push_back(BSDF(BSDF_Mirror(opt.reflectance)));
-            } break;
-            case Material_Type::refract: {
-                materials.push_back(BSDF(BSDF_Refract(opt.transmittance, opt.ior)));
-            } break;
-            case Material_Type::glass: {
-                materials.push_back(BSDF(BSDF_Glass(opt.transmittance, opt.reflectance, opt.ior)));
-            } break;
-            case Material_Type::diffuse_light: {
-                materials.push_back(BSDF(BSDF_Diffuse(obj.material.emissive())));
-                // NOTE(max): we use an approximate triangle mesh for shape objects
-                // because PT::Object only supports sampling triangles
-                if(obj.is_shape()) {
-                    area_light_list.push_back(Object(Tri_Mesh(obj.opt.shape.mesh(), false),
-                                                     obj.id(), idx, obj.pose.transform()));
-                } else {
-                    area_light_list.push_back(Object(Tri_Mesh(obj.posed_mesh(), false), obj.id(),
-                                                     idx, obj.pose.transform()));
+    // Particles are instanced: every particle Object shares one Tri_Mesh
+    // (and thus one BVH) and only carries its own transform.
+
+    materials.clear();
+    pager.set_dir(out_of_core && compress_meshes ? bvh_cache : std::string());
+
+    // Each snapshot item becomes a job returning its Objects, run on the pool once
+    // every item has been visited (see run_build_jobs).
+    std::vector<Build_Job> jobs;
+    std::vector<Object> area_light_list;
+    std::vector<Light_Tree::Light> area_light_power;
+
+    // Entries are moved over from the old cache on this thread, so tasks only ever
+    // touch their own entry; meshes no longer in the scene are dropped with the old one.
+    std::unordered_map<Scene_ID, Tri_Mesh> cache;
+
+    // Objects showing the same GL mesh buffers (e.g. instances of one imported mesh)
+    // are added by the job building the first one's Tri_Mesh, sharing its BVH. Keyed
+    // by vertex buffer; jobs hold on to their entries, which rehashing doesn't move.
+    struct Mesh_Instance {
+        Scene_ID id;
+        unsigned int material;
+        Mat4 T;
+    };
+    std::unordered_map<const void*, std::vector<Mesh_Instance>> instances;
+
+    for(const Scene_Snapshot::Object& obj : snap.objects) {
+
+        unsigned int idx = (unsigned int)materials.size();
+        if(!obj.render) continue;
+        materials.push_back(*material_bsdf(obj.material, obj.emissive));
+
+        if(obj.light) {
+            // Light meshes get their own BVH, without spatial splits (see
+            // Tri_Mesh::enable_sampling), so light pdfs don't test every triangle
+            BVH_Options light_options = mesh_options;
+            light_options.spatial_alpha = 0.0f;
+            Tri_Mesh light_mesh(obj.mesh, scene_use_bvh, &thread_pool, light_options);
+            light_mesh.enable_sampling();
+            float area = mesh_area(obj.mesh, obj.T);
+            area_light_list.push_back(Object(std::move(light_mesh), obj.id, idx, obj.T));
+            area_light_power.push_back({area_light_list.back().bbox(), obj.emissive.luma() * area});
+        }
+
+        bool use_bvh = scene_use_bvh;
+        const GL::Mesh::Data* posed = obj.is_shape ? nullptr : &obj.mesh;
+
+        std::vector<Mesh_Instance>* shared = nullptr;
+        if(posed && !obj.custom_bvh) {
+            auto [entry, first] = instances.try_emplace(posed->verts.get());
+            if(!first) {
+                entry->second.push_back({obj.id, idx, obj.T});
+                continue;
+            }
+            shared = &entry->second;
+        }
+
+        Tri_Mesh* mesh = nullptr;
+        if(posed) {
+            mesh = &(cache[obj.id] = std::move(mesh_cache[obj.id]));
+        }
+        BVH_Options options = obj.custom_bvh ? BVH_Options::profile(obj.profile) : mesh_options;
+        size_t cost = posed ? posed->indices->size() / 3 * build_bytes_per_triangle : 0;
+        jobs.push_back({cost, [this, &obj, mesh, posed, use_bvh, options, idx, shared]() {
+            PROFILE_ZONE("Mesh BVH");
+            std::vector<Object> objs;
+            if(!mesh) {
+                Shape shape(obj.shape);
+                objs.emplace_back(std::move(shape), obj.id, idx, obj.T);
+            } else {
+                mesh->refit(*posed, use_bvh, &thread_pool, options, bvh_cache);
+                if(compress_meshes) mesh->compress(&thread_pool, &pager);
+                objs.emplace_back(mesh->copy(), obj.id, idx, obj.T);
+                if(shared) {
+                    for(const Mesh_Instance& inst : *shared) {
+                        objs.emplace_back(mesh->copy(), inst.id, inst.material, inst.T);
+                    }
                 }
-            } break;
-            default: return;
             }
+            return objs;
+        }});
+    }
 
-            bool use_bvh = scene_use_bvh;
-            futures.push_back(thread_pool.enqueue([&obj, use_bvh, idx]() {
-                std::vector<Object> objs;
-                if(obj.is_shape()) {
-                    Shape shape(obj.opt.shape);
-                    objs.emplace_back(std::move(shape), obj.id(), idx, obj.pose.transform());
-                } else {
-                    Tri_Mesh mesh(obj.posed_mesh(), use_bvh);
-                    objs.emplace_back(std::move(mesh), obj.id(), idx, obj.pose.transform());
+    for(const Scene_Snapshot::Particles& particles : snap.particles) {
+
+        unsigned int idx = (unsigned int)materials.size();
+        materials.push_back(BSDF(BSDF_Lambertian(particles.color)));
+
+        bool use_bvh = scene_use_bvh;
+        size_t n_particles = particles.positions.size();
+        Vec3 center;
+        float radius = 0.0f;
+        if(sphere_mesh(particles.mesh, center, radius)) {
+            size_t cost = n_particles * build_bytes_per_sphere;
+            jobs.push_back({cost, [this, &particles, center, radius, use_bvh, idx]() {
+                PROFILE_ZONE("Particle BVH");
+                float scale = particles.scale;
+                std::vector<Particle_Sphere> spheres;
+                for(Vec3 pos : particles.positions) {
+                    spheres.push_back({pos + center * scale, radius * std::abs(scale)});
+                }
+                std::vector<Object> particle_objs;
+                if(!spheres.empty()) {
+                    Sphere_Particles system(std::move(spheres), use_bvh, mesh_options,
+                                            &thread_pool);
+                    particle_objs.emplace_back(std::move(system), particles.id, idx);
                 }
-                return objs;
-            }));
+                return particle_objs;
+            }});
+            continue;
+        }
 
-        } else if(item.is<Scene_Particles>()) {
+        Tri_Mesh* mesh = &(cache[particles.id] = std::move(mesh_cache[particles.id]));
+        size_t cost = particles.mesh.indices->size() / 3 * build_bytes_per_triangle +
+                      n_particles * sizeof(Object);
+        jobs.push_back({cost, [this, &particles, mesh, use_bvh, idx]() {
+            PROFILE_ZONE("Particle BVH");
+            mesh->refit(particles.mesh, use_bvh, &thread_pool, mesh_options, bvh_cache);
+            if(compress_meshes) mesh->compress(&thread_pool, &pager);
+
+            std::vector<Object> particle_objs;
+            for(Vec3 pos : particles.positions) {
+                Mat4 T = Mat4::translate(pos) * Mat4::scale(Vec3{particles.scale});
+                particle_objs.emplace_back(mesh->copy(), particles.id, idx, T);
+            }
 
-            Scene_Particles& particles = item.get<Scene_Particles>();
-            unsigned int idx = (unsigned int)materials.size();
-            materials.push_back(BSDF(BSDF_Lambertian(particles.opt.color.to_linear())));
+            return particle_objs;
+        }});
+    }
 
-            bool use_bvh = scene_use_bvh;
-            futures.push_back(thread_pool.enqueue([&particles, use_bvh, idx]() {
-                Tri_Mesh mesh(particles.mesh(), use_bvh);
+    std::vector<Object> obj_list = run_build_jobs(jobs);
+    mesh_cache = std::move(cache);
 
-                const auto& parts = particles.get_particles();
-                std::vector<Object> particle_objs;
+    mesh_stats = {};
+    for(const auto& entry : mesh_cache) mesh_stats += entry.second.stats();
+
+    area_lights = std::move(area_light_list);
+    area_light_tree = Light_Tree(area_light_power);
+    build_lights(snap);
+
+    // Instances are expensive to test, so the top level keeps one per leaf
+    BVH_Options scene_options = mesh_options;
+    scene_options.max_leaf_size = 1;
+    PROFILE_ZONE("Scene BVH");
+    scene = Compiled_Scene(std::move(obj_list), scene_use_bvh, scene_options, &thread_pool);
+    scene_stats = scene.stats();
+
+    built_keys = std::move(keys);
+    built_use_bvh = scene_use_bvh;
+    built_options = mesh_options;
+    built_compressed = compress_meshes;
+    built_out_of_core = out_of_core;
+}
+
+void Pathtracer::gpu_scene(Scene& layout_scene, GPU_Scene& out) {
+
+    cancel();
+    out = {};
+
+    layout_scene.for_items([&](Scene_Item& item) {
+        if(!item.is<Scene_Object>()) return;
+        Scene_Object& obj = item.get<Scene_Object>();
+        if(!obj.opt.render || obj.opt.portal) return;
+        std::optional<BSDF> bsdf = material_bsdf(obj.material.opt, obj.material.emissive());
+        if(!bsdf) return;
+
+        GPU_Scene::Material mat = bsdf->visit(overloaded{
+            [](const BSDF_Lambertian& l) {
+                return GPU_Scene::Material{(l.albedo * PI_F).to_vec(), GPU_Scene::lambertian};
+            },
+            [](const BSDF_Mirror& m) {
+                return GPU_Scene::Material{m.reflectance.to_vec(), GPU_Scene::mirror};
+            },
+            [](const BSDF_Glass& g) {
+                return GPU_Scene::Material{g.transmittance.to_vec(), GPU_Scene::glass,
+                                           g.reflectance.to_vec(),
+                                           g.index_of_refraction};
+            },
+            [](const BSDF_Diffuse& d) {
+                return GPU_Scene::Material{d.emissive().to_vec(), GPU_Scene::emissive};
+            },
+            [](const BSDF_Refract& r) {
+                return GPU_Scene::Material{r.transmittance.to_vec(), GPU_Scene::refract, Vec3{},
+                                           r.index_of_refraction};
+            }});
+        uint32_t idx = (uint32_t)out.materials.size();
+        out.materials.push_back(mat);
+
+        Mat4 T = obj.pose.transform();
+        Mat4 N = T.inverse().T();
+        GL::Mesh shape_mesh;
+        if(obj.is_shape()) shape_mesh = obj.opt.shape.mesh();
+        const GL::Mesh& mesh = obj.is_shape() ? shape_mesh : obj.posed_mesh();
+        const auto& verts = mesh.verts();
+        const auto& idxs = mesh.indices();
+        for(size_t i = 0; i + 2 < idxs.size(); i += 3) {
+            const GL::Mesh::Vert &a = verts[idxs[i]], &b = verts[idxs[i + 1]],
+                                 &c = verts[idxs[i + 2]];
+            GPU_Scene::Triangle tri;
+            tri.v0 = T * a.pos;
+            tri.v1 = T * b.pos;
+            tri.v2 = T * c.pos;
+            tri.n0 = N.rotate(a.norm).unit();
+            tri.n1 = N.rotate(b.norm).unit();
+            tri.n2 = N.rotate(c.norm).unit();
+            tri.material = idx;
+            out.triangles.push_back(tri);
+        }
+    });
+
+    Scene_Snapshot snap = capture(layout_scene);
+    build_lights(snap);
+    for(const Delta_Light& light : point_lights) {
+        const Mat4& T = light.transform();
+        GPU_Scene::Light l;
+        light.visit(overloaded{
+            [&](const Directional_Light& d) {
+                l.type = GPU_Scene::directional;
+                l.dir = T.rotate(Vec3{0.0f, -1.0f, 0.0f}).unit();
+                l.radiance = d.radiance.to_vec();
+            },
+            [&](const Point_Light& p) {
+                l.type = GPU_Scene::point;
+                l.radiance = p.radiance.to_vec();
+            },
+            [&](const Spot_Light& s) {
+                l.type = GPU_Scene::spot;
+                l.dir = T.rotate(Vec3{0.0f, 1.0f, 0.0f}).unit();
+                l.inner = s.angle_bounds.x / 2.0f;
+                l.outer = s.angle_bounds.y / 2.0f;
+                l.radiance = s.radiance.to_vec();
+            }});
+        l.pos = T * Vec3{};
+        out.lights.push_back(l);
+    }
+
+    // The environment is baked at a fixed resolution, which the GPU interpolates
+    if(env_light) {
+        out.env_w = 512;
+        out.env_h = 256;
+        out.env.resize(out.env_w * out.env_h * 3);
+        parallel_for(0, out.env_h, 1, [&](size_t j) {
+            float theta = (j + 0.5f) / out.env_h * PI_F;
+            for(size_t i = 0; i < out.env_w; i++) {
+                float phi = ((i + 0.5f) / out.env_w - 0.5f) * 2.0f * PI_F;
+                Vec3 dir(std::sin(theta) * std::cos(phi), std::cos(theta),
+                         std::sin(theta) * std::sin(phi));
+                Spectrum r = env_light->evaluate(dir);
+                float* px = &out.env[3 * (j * out.env_w + i)];
+                px[0] = r.r;
+                px[1] = r.g;
+                px[2] = r.b;
+            }
+        });
+    }
+}
+
+void Pathtracer::set_samples(size_t samples) {
+    n_samples = samples;
+}
+
+void Pathtracer::set_tile_size(size_t size) {
+    tile_size = std::max(size_t(1), size);
+}
+
+void Pathtracer::set_time_limit(float seconds) {
+    time_limit = std::max(seconds, 0.0f);
+}
+
+void Pathtracer::set_wavefront(bool wavefront) {
+    use_wavefront = wavefront;
+}
+
+void Pathtracer::set_deterministic(bool det) {
+    deterministic = det;
+}
+
+void Pathtracer::set_light_samples(size_t samples, bool power) {
+    light_samples = samples;
+    power_heuristic = power;
+}
+
+void Pathtracer::set_guiding(size_t training_passes) {
+    guide_passes = training_passes;
+}
+
+void Pathtracer::set_caustics(size_t photons, float radius) {
+    caustic_photons = photons;
+    caustic_radius = radius;
+}
+
+void Pathtracer::set_reprojection(bool reproject) {
+    use_reprojection = reproject;
+}
+
+void Pathtracer::set_preview(bool preview) {
+    use_preview = preview;
+}
+
+void Pathtracer::set_primary_depth(std::vector<float> depth) {
+    primary_depth = std::move(depth);
+}
 
-                for(const Scene_Particles::Particle& p : parts) {
-                    Tri_Mesh copy = mesh.copy();
-                    Mat4 T = Mat4::translate(p.pos) * Mat4::scale(Vec3{particles.opt.scale});
-                    particle_objs.emplace_back(std::move(copy), particles.id(), idx, T);
+void Pathtracer::bound_primary() {
+
+    primary_bounds.clear();
+    if(primary_depth.size() != out_w * out_h) return;
+
+    // Samples land anywhere in their pixel, which may show what its neighbors do, and
+    // the rasterized depth is a little short of exact
+    primary_bounds.resize(out_w * out_h);
+    parallel_for(0, out_h, 16, [&](size_t y) {
+        size_t y0 = y > 0 ? y - 1 : y, y1 = std::min(y + 1, out_h - 1);
+        for(size_t x = 0; x < out_w; x++) {
+            size_t x0 = x > 0 ? x - 1 : x, x1 = std::min(x + 1, out_w - 1);
+            float bound = 0.0f;
+            for(size_t j = y0; j <= y1; j++) {
+                for(size_t i = x0; i <= x1; i++) {
+                    bound = std::max(bound, primary_depth[j * out_w + i]);
                 }
+            }
+            primary_bounds[y * out_w + x] = bound * 1.01f;
+        }
+    });
+}
 
-                return particle_objs;
-            }));
+void Pathtracer::set_spatial_splits(float alpha) {
+    mesh_options.spatial_alpha = std::max(alpha, 0.0f);
+}
+
+void Pathtracer::set_bvh_cache(const std::string& dir) {
+    bvh_cache = dir;
+}
+
+void Pathtracer::set_build_memory(size_t bytes) {
+    build_memory = bytes;
+}
+
+void Pathtracer::set_compress_meshes(bool compress) {
+    compress_meshes = compress;
+}
+
+void Pathtracer::set_out_of_core(bool enable, size_t budget) {
+    out_of_core = enable;
+    pager.set_budget(budget);
+}
+
+void Pathtracer::set_counters(bool enable) {
+    count_traversal = enable;
+    BVH_Counters::enabled = enable;
+}
+
+void Pathtracer::set_heatmap(Heatmap mode, float scale) {
+    heatmap = mode;
+    if(scale <= 0.0f) {
+        switch(mode) {
+        case Heatmap::nodes: scale = 256.0f; break;
+        case Heatmap::primitives: scale = 64.0f; break;
+        case Heatmap::time: scale = 100.0f; break;
+        default: break;
         }
+    }
+    heatmap_scale = scale;
+}
+
+void Pathtracer::set_shard(size_t index, size_t count) {
+    shard_count = std::max(count, size_t(1));
+    shard_index = std::min(index, shard_count - 1);
+}
+
+// Bump when the shard file layout changes
+static const uint32_t shard_magic = 0x44524853, shard_version = 1;
+
+// Reads a shard's header, then calls f(x, y, w, h, samples, rgb) for each of its tiles
+// until f returns false. The frame's size is checked against w and h, unless w is 0,
+// in which case they are set to it.
+template<typename F>
+static std::string read_shard(const std::string& file, uint64_t& w, uint64_t& h, F&& f) {
+
+    std::ifstream in(file, std::ios::binary);
+    if(!in) return "Failed to open shard file " + file;
+
+    uint32_t header[2] = {};
+    uint64_t dim[3] = {};
+    in.read(reinterpret_cast<char*>(header), sizeof(header));
+    in.read(reinterpret_cast<char*>(dim), sizeof(dim));
+    if(!in || header[0] != shard_magic || header[1] != shard_version) {
+        return "Not a render shard: " + file;
+    }
+    if(w == 0) {
+        w = dim[0];
+        h = dim[1];
+    } else if(dim[0] != w || dim[1] != h) {
+        return "Shard " + file + " is of a differently sized frame";
+    }
+
+    std::vector<float> rgb;
+    for(uint64_t t = 0; t < dim[2]; t++) {
+        uint64_t info[5] = {};
+        in.read(reinterpret_cast<char*>(info), sizeof(info));
+        auto [x, y, tw, th, n] = info;
+        if(!in || x > w || y > h || tw > w - x || th > h - y) {
+            return "Corrupt render shard: " + file;
+        }
+        rgb.resize(tw * th * 3);
+        in.read(reinterpret_cast<char*>(rgb.data()), rgb.size() * sizeof(float));
+        if(!in) return "Corrupt render shard: " + file;
+        if(!f(x, y, tw, th, n, rgb)) return "Shard " + file + " doesn't match this render";
+    }
+    return {};
+}
+
+std::string Pathtracer::save_shard(const std::string& file) const {
+
+    if(views.size() > 1) return "Multi-view renders can't be saved as shards";
+
+    // Header: magic, version, then the frame's width, height and number of tiles.
+    // Each tile is its x, y, w, h and samples, followed by its rgb pixels.
+    struct Saved {
+        uint64_t info[5];
+        std::vector<float> rgb;
+    };
+    std::vector<Saved> saved;
+
+    // The render may still be going (when checkpointing), so each tile is copied
+    // between two reads of the same even version, as in snapshot()
+    for(const Tile& tile : tiles) {
+        Saved s;
+        size_t version;
+        do {
+            version = tile.version.load(std::memory_order_acquire);
+            if(version & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            s = {{tile.x, tile.y, tile.w, tile.h, tile.samples}, {}};
+            if(tile.samples == 0) break;
+            for(Spectrum p : tile.pixels) s.rgb.insert(s.rgb.end(), {p.r, p.g, p.b});
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while((version & 1) || tile.version.load(std::memory_order_relaxed) != version);
+        if(s.info[4] > 0) saved.push_back(std::move(s));
+    }
+
+    // Written to a file of our own and renamed into place, so that a process killed
+    // mid-write leaves the previous checkpoint intact
+    std::string tmp = file + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        if(!out) return "Failed to open shard file " + tmp;
+
+        uint32_t header[2] = {shard_magic, shard_version};
+        uint64_t dim[3] = {out_w, out_h, saved.size()};
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(dim), sizeof(dim));
+        for(const Saved& s : saved) {
+            out.write(reinterpret_cast<const char*>(s.info), sizeof(s.info));
+            out.write(reinterpret_cast<const char*>(s.rgb.data()), s.rgb.size() * sizeof(float));
+        }
+        if(!out) {
+            out.close();
+            std::remove(tmp.c_str());
+            return "Failed to write shard file " + tmp;
+        }
+    }
+    std::remove(file.c_str());
+    if(std::rename(tmp.c_str(), file.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        return "Failed to write shard file " + file;
+    }
+    return {};
+}
+
+std::string Pathtracer::resume(const std::string& file) {
+
+    cancel();
+    output.clear({});
+    views.erase(views.begin() + 1, views.end());
+    build_tiles();
+
+    uint64_t w = out_w, h = out_h;
+    Region r = bounds();
+    size_t tiles_x = (r.x1 - r.x0 + tile_size - 1) / tile_size;
+    std::string err = read_shard(file, w, h, [&](uint64_t x, uint64_t y, uint64_t tw,
+                                                 uint64_t th, uint64_t n,
+                                                 const std::vector<float>& rgb) {
+        if(x < r.x0 || y < r.y0) return false;
+        size_t idx = ((y - r.y0) / tile_size) * tiles_x + (x - r.x0) / tile_size;
+        if(idx >= tiles.size()) return false;
+        Tile& tile = tiles[idx];
+        if(tile.x != x || tile.y != y || tile.w != tw || tile.h != th) return false;
+        tile.pixels.resize(tw * th);
+        for(size_t p = 0; p < tile.pixels.size(); p++) {
+            tile.pixels[p] = Spectrum(rgb[p * 3], rgb[p * 3 + 1], rgb[p * 3 + 2]);
+        }
+        tile.samples = n;
+        tile.shared_samples.store(n, std::memory_order_relaxed);
+        // Past snapshot's, so the next one shows it
+        tile.version = 2;
+        return true;
     });
+    if(!err.empty()) {
+        tiles.clear();
+        return err;
+    }
+    resumed = true;
+    return {};
+}
+
+std::string Pathtracer::merge_shards(const std::vector<std::string>& files, HDR_Image& out) {
+
+    uint64_t w = 0, h = 0;
+    std::vector<Spectrum> sum;
+    std::vector<uint64_t> samples;
+
+    for(const std::string& file : files) {
+        std::string err = read_shard(file, w, h, [&](uint64_t x, uint64_t y, uint64_t tw,
+                                                     uint64_t th, uint64_t n,
+                                                     const std::vector<float>& rgb) {
+            if(sum.empty()) {
+                sum.assign(w * h, Spectrum{});
+                samples.assign(w * h, 0);
+            }
+            for(uint64_t j = 0; j < th; j++) {
+                for(uint64_t i = 0; i < tw; i++) {
+                    const float* p = &rgb[(j * tw + i) * 3];
+                    size_t idx = (y + j) * w + x + i;
+                    sum[idx] += Spectrum(p[0], p[1], p[2]) * (float)n;
+                    samples[idx] += n;
+                }
+            }
+            return true;
+        });
+        if(!err.empty()) return err;
+    }
+
+    size_t missing = 0;
+    out = HDR_Image(w, h);
+    for(size_t i = 0; i < w * h; i++) {
+        if(i < samples.size() && samples[i]) {
+            out.at(i) = sum[i] / (float)samples[i];
+        } else {
+            missing++;
+        }
+    }
+    if(missing) warn("%zu pixels were in none of the shards.", missing);
+    return {};
+}
 
-    std::vector<Object> obj_list;
+std::pair<BVH_Stats, BVH_Stats> Pathtracer::bvh_stats() const {
+    if(building()) return {};
+    return {scene_stats, mesh_stats};
+}
 
-    for(auto& f : futures) {
-        std::vector<Object> result = f.get();
-        obj_list.reserve(obj_list.size() + result.size());
-        std::move(std::begin(result), std::end(result), std::back_inserter(obj_list));
+Pathtracer::Memory Pathtracer::memory() const {
+    Memory m;
+    // An async build writes the stats as it goes, so they count once it is done
+    if(!building()) {
+        m.scene = scene_stats.bytes;
+        m.meshes = mesh_stats.bytes;
+    }
+    m.paged = pager.mapped_bytes();
+    m.images = output.bytes();
+    for(const HDR_Image& out : view_outputs) m.images += out.bytes();
+    // Tiles allocate their pixels as a render thread first reaches them, so this counts
+    // them at full size rather than reading their vectors mid-render. Streamed tiles
+    // only hold them while they render, one per worker.
+    if(tile_sink) {
+        m.images += thread_pool.size() * tile_size * tile_size * sizeof(Spectrum);
+    } else {
+        for(const Tile& tile : tiles) m.images += tile.w * tile.h * sizeof(Spectrum);
     }
+    for(const Preview_Level& level : preview_levels) {
+        m.images += level.pixels.size() * sizeof(Pixel_Formats::Half_RGB);
+    }
+    m.images += surfaces.size() * sizeof(Trace) + history.size() * sizeof(Spectrum) +
+                history_weight.size() * sizeof(float);
+    return m;
+}
 
-    area_lights = List(std::move(area_light_list));
-    build_lights(layout_scene);
+BVH_Counters Pathtracer::counters() const {
+    std::lock_guard<std::mutex> lock(counters_mut);
+    return render_counters;
+}
 
-    if(scene_use_bvh) {
-        BVH<Object> scene_bvh(std::move(obj_list));
-        scene = Object(std::move(scene_bvh));
+void Pathtracer::count_ray(const Ray& ray, bool shadow) const {
+    if(!BVH_Counters::enabled.load(std::memory_order_relaxed)) return;
+    BVH_Counters& counters = BVH_Counters::local();
+    if(shadow) {
+        counters.shadow_rays++;
+        return;
+    }
+    if(ray.depth == max_depth) {
+        counters.camera_rays++;
     } else {
-        List<Object> scene_list(std::move(obj_list));
-        scene = Object(std::move(scene_list));
+        counters.secondary_rays++;
     }
+    size_t bounce = ray.depth < max_depth ? max_depth - ray.depth : 0;
+    counters.bounces[std::min(bounce, BVH_Counters::max_bounces - 1)]++;
 }
 
-void Pathtracer::set_samples(size_t samples) {
-    n_samples = samples;
+void Pathtracer::merge_counters() {
+    if(!BVH_Counters::enabled.load(std::memory_order_relaxed)) return;
+    BVH_Counters& counters = BVH_Counters::local();
+    std::lock_guard<std::mutex> lock(counters_mut);
+    render_counters += counters;
+    counters = {};
 }
 
-void Pathtracer::set_params(size_t w, size_t h, size_t samples, size_t depth, bool use_bvh) {
+void Pathtracer::set_params(size_t w, size_t h, size_t samples, size_t depth, bool use_bvh,
+                            float adaptive, size_t roulette_depth, BVH_Profile profile,
+                            RNG::Sequence sequence) {
     out_w = w;
     out_h = h;
     n_samples = samples;
     max_depth = depth;
     scene_use_bvh = use_bvh;
-    accumulator.resize(out_w, out_h);
+    adaptive_error = std::max(adaptive, 0.0f);
+    rr_depth = roulette_depth;
+    mesh_options = BVH_Options::profile(profile);
+    RNG::set_sequence(sequence);
+    // Kept at the same size, so that a region can be re-rendered into it
+    if(!tile_sink && output.dimension() != std::pair{out_w, out_h}) {
+        output.resize(out_w, out_h);
+    }
+    tiles.clear();
+}
+
+void Pathtracer::set_region(size_t x0, size_t y0, size_t x1, size_t y1, size_t samples) {
+    region = {x0, y0, x1, y1, samples};
+    tiles.clear();
+}
+
+void Pathtracer::set_tile_sink(Tile_Sink sink) {
+    cancel();
+    tile_sink = std::move(sink);
+    tiles.clear();
+    // Reallocated by the next render that keeps the image
+    if(tile_sink) output = HDR_Image();
+}
+
+Pathtracer::Region Pathtracer::bounds() const {
+    Region r = region;
+    r.x1 = std::min(r.x1, out_w);
+    r.y1 = std::min(r.y1, out_h);
+    if(r.x0 >= r.x1 || r.y0 >= r.y1) return {0, 0, out_w, out_h, region.samples};
+    return r;
+}
+
+bool Pathtracer::cropped() const {
+    Region r = bounds();
+    return r.x0 > 0 || r.y0 > 0 || r.x1 < out_w || r.y1 < out_h;
 }
 
 void Pathtracer::log_ray(const Ray& ray, float t, Spectrum color) {
     gui.log_ray(ray, t, color);
 }
 
-void Pathtracer::accumulate(const HDR_Image& sample) {
+void Pathtracer::build_tiles() {
+
+    Region r = bounds();
+    size_t tiles_x = (r.x1 - r.x0 + tile_size - 1) / tile_size;
+    size_t tiles_y = (r.y1 - r.y0 + tile_size - 1) / tile_size;
+
+    // Tiles hold atomics, so they are constructed in place rather than appended
+    // Streamed tiles go from the top row down, the order image files store rows in
+    // Each view has the same tiles, which come after those of the view before
+    size_t per_view = tiles_x * tiles_y;
+    tiles = std::vector<Tile>(per_view * views.size());
+    for(size_t v = 0; v < views.size(); v++) {
+        for(size_t ty = 0; ty < tiles_y; ty++) {
+            for(size_t tx = 0; tx < tiles_x; tx++) {
+                Tile& tile = tiles[v * per_view + ty * tiles_x + tx];
+                tile.view = v;
+                tile.x = r.x0 + tx * tile_size;
+                tile.y = r.y0 + (tile_sink ? tiles_y - 1 - ty : ty) * tile_size;
+                tile.w = std::min(tile_size, r.x1 - tile.x);
+                tile.h = std::min(tile_size, r.y1 - tile.y);
+            }
+        }
+    }
+}
+
+Pathtracer::Scratch& Pathtracer::scratch() {
+    static thread_local Scratch data;
+    return data;
+}
 
-    std::lock_guard<std::mutex> lock(accumulator_mut);
+void Pathtracer::accumulate(Tile& tile, const std::vector<Spectrum>& sample, size_t samples) {
+
+    // Only the task rendering this tile writes to its pixels, so no lock is needed.
+    // Bracketing the write with an odd version lets snapshot() detect (and retry
+    // later) a tile it copied mid-update.
+    size_t version = tile.version.load(std::memory_order_relaxed);
+    tile.version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // The buffer never moves once allocated, so snapshot() only reads it after
+    // seeing a version past this first write
+    // Reprojected pixels start from their history, which counts as prior samples
+    bool seeded = !history_weight.empty();
+    auto pixel = [&](size_t p) { return (tile.y + p / tile.w) * out_w + tile.x + p % tile.w; };
+    if(tile.pixels.empty()) {
+        tile.pixels.assign(tile.w * tile.h, Spectrum{});
+        if(seeded) {
+            for(size_t p = 0; p < tile.w * tile.h; p++) tile.pixels[p] = history[pixel(p)];
+        }
+    }
 
-    accumulator_samples++;
-    for(size_t j = 0; j < out_h; j++) {
-        for(size_t i = 0; i < out_w; i++) {
-            Spectrum& s = accumulator.at(i, j);
-            const Spectrum& n = sample.at(i, j);
-            s += (n - s) * (1.0f / accumulator_samples);
+    float weight = (float)samples / (float)(tile.samples + samples);
+    for(size_t p = 0; p < tile.w * tile.h; p++) {
+        Spectrum& s = tile.pixels[p];
+        if(seeded) {
+            float prior = history_weight[pixel(p)];
+            weight = (float)samples / ((float)(tile.samples + samples) + prior);
         }
+        s += (sample[p] - s) * weight;
     }
+    tile.samples += samples;
+    tile.shared_samples.store(tile.samples, std::memory_order_relaxed);
+
+    tile.version.store(version + 2, std::memory_order_release);
 }
 
-void Pathtracer::do_trace(size_t samples) {
+void Pathtracer::snapshot() {
+
+    if(tile_sink) return;
+
+    // Until a tile has received any accumulated samples, show it at the resolution
+    // of the finest preview level that has finished rendering.
+    size_t finest = 0;
+    for(size_t l = 0; l < preview_levels.size(); l++) {
+        if(preview_levels[l].remaining.load(std::memory_order_acquire) == 0) finest = l + 1;
+    }
+    if(finest > shown_preview) {
+        const Preview_Level& level = preview_levels[finest - 1];
+        for(Tile& tile : tiles) {
+            if(tile.snapshot != 0) continue;
+            for(size_t j = 0; j < tile.h; j++) {
+                for(size_t i = 0; i < tile.w; i++) {
+                    size_t x = tile.x + i, y = tile.y + j;
+                    // Reprojected pixels are already closer than any preview
+                    if(!history_weight.empty() && history_weight[y * out_w + x] > 0.0f) {
+                        continue;
+                    }
+                    size_t idx = (y / level.scale) * level.w + x / level.scale;
+                    output.at(x, y) = level.pixels[idx].spectrum();
+                }
+            }
+        }
+        shown_preview = finest;
+    }
+
+    // Copy every tile that changed since the last snapshot into its view's image.
+    // Tiles that are currently being written are skipped and picked up next time.
+    for(Tile& tile : tiles) {
+
+        size_t version = tile.version.load(std::memory_order_acquire);
+        if(version == tile.snapshot || (version & 1)) continue;
+
+        HDR_Image& out = image(tile.view);
+        for(size_t j = 0; j < tile.h; j++) {
+            for(size_t i = 0; i < tile.w; i++) {
+                out.at(tile.x + i, tile.y + j) = tile.pixels[j * tile.w + i];
+            }
+        }
 
-    HDR_Image sample(out_w, out_h);
-    for(size_t j = 0; j < out_h; j++) {
-        for(size_t i = 0; i < out_w; i++) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(tile.version.load(std::memory_order_relaxed) == version) tile.snapshot = version;
+    }
+}
 
+bool Pathtracer::do_trace_adaptive(Tile& tile, size_t samples, std::vector<Spectrum>& out) {
+
+    // Every pixel first takes enough samples to estimate its variance. Pixels are then
+    // refined in small batches until the standard error of their mean luma drops below
+    // adaptive_error (relative to the mean). Samples saved on converged pixels are spent
+    // on the noisy ones instead, up to the tile's budget of samples per pixel on average.
+    size_t n_pixels = tile.w * tile.h;
+    size_t min_samples = std::min(samples, size_t(16));
+    size_t max_samples = samples * 4;
+    size_t batch = std::max(size_t(1), min_samples / 2);
+    size_t budget = samples * n_pixels;
+
+    Scratch& mem = scratch();
+    std::vector<float>& sum_sq = mem.sum_sq;
+    std::vector<size_t>& taken = mem.taken;
+    std::vector<size_t>& sampled = mem.sampled;
+    std::vector<size_t>& active = mem.active;
+    sum_sq.assign(n_pixels, 0.0f);
+    taken.assign(n_pixels, 0);
+    sampled.assign(n_pixels, 0);
+    active.resize(n_pixels);
+    std::iota(active.begin(), active.end(), size_t(0));
+
+    auto sample_pixel = [&, this](size_t p, size_t n) {
+        size_t x = tile.x + p % tile.w, y = tile.y + p / tile.w;
+        for(size_t s = 0; s < n && budget > 0; s++) {
+            // A pass takes at most max_samples per pixel, so its streams never repeat
+            RNG::stream(y * out_w + x, tile.samples * 4 + taken[p]);
+            Spectrum sample = trace_pixel(views[tile.view], x, y);
+            if(sample.valid()) {
+                float l = sample.luma();
+                out[p] += sample;
+                sum_sq[p] += l * l;
+                sampled[p]++;
+            }
+            taken[p]++;
+            budget--;
+        }
+    };
+
+    auto converged = [&, this](size_t p) {
+        if(taken[p] >= max_samples) return true;
+        if(sampled[p] < 2) return false;
+        float n = (float)sampled[p];
+        float mean = out[p].luma() / n;
+        float var = std::max(sum_sq[p] / n - mean * mean, 0.0f) * n / (n - 1.0f);
+        return std::sqrt(var / n) <= adaptive_error * std::max(mean, 1e-3f);
+    };
+
+    for(size_t p = 0; p < n_pixels; p++) {
+        sample_pixel(p, min_samples);
+        if(cancel_flag) return false;
+    }
+
+    while(budget > 0 && !active.empty()) {
+        active.erase(std::remove_if(active.begin(), active.end(), converged), active.end());
+        for(size_t p : active) {
+            sample_pixel(p, batch);
+            if(cancel_flag) return false;
+        }
+    }
+
+    for(size_t p = 0; p < n_pixels; p++) {
+        if(sampled[p] > 0) out[p] *= (1.0f / sampled[p]);
+    }
+    return true;
+}
+
+// Blue through cyan, green and yellow to red over t in [0, 1]
+static Spectrum heat(float t) {
+    static const Vec3 stops[] = {Vec3{0.0f, 0.0f, 1.0f}, Vec3{0.0f, 1.0f, 1.0f},
+                                 Vec3{0.0f, 1.0f, 0.0f}, Vec3{1.0f, 1.0f, 0.0f},
+                                 Vec3{1.0f, 0.0f, 0.0f}};
+    float x = std::clamp(t, 0.0f, 1.0f) * 4.0f;
+    size_t i = std::min(size_t(x), size_t(3));
+    Vec3 c = lerp(stops[i], stops[i + 1], x - (float)i);
+    return Spectrum(c.x, c.y, c.z).to_linear();
+}
+
+bool Pathtracer::do_trace_heatmap(Tile& tile, size_t samples, std::vector<Spectrum>& out) {
+
+    // Counters only grow while a tile is traced (they are merged once it is done), so
+    // each pixel's cost is the difference across its samples
+    BVH_Counters& counters = BVH_Counters::local();
+    float scale = std::log2(1.0f + heatmap_scale);
+    for(size_t j = 0; j < tile.h; j++) {
+        for(size_t i = 0; i < tile.w; i++) {
+
+            size_t x = tile.x + i, y = tile.y + j;
+            uint64_t nodes = counters.nodes, primitives = counters.primitives;
+            auto start = std::chrono::steady_clock::now();
+            for(size_t s = 0; s < samples; s++) {
+                RNG::stream(y * out_w + x, tile.samples + s);
+                trace_pixel(views[tile.view], x, y);
+                if(cancel_flag) return false;
+            }
+
+            float cost = 0.0f;
+            switch(heatmap) {
+            case Heatmap::nodes: cost = (float)(counters.nodes - nodes); break;
+            case Heatmap::primitives: cost = (float)(counters.primitives - primitives); break;
+            default: {
+                std::chrono::duration<float, std::micro> t =
+                    std::chrono::steady_clock::now() - start;
+                cost = t.count();
+            } break;
+            }
+            cost /= (float)samples;
+            out[j * tile.w + i] = heat(std::log2(1.0f + cost) / scale);
+        }
+    }
+    return true;
+}
+
+void Pathtracer::do_trace(Tile& tile, size_t samples) {
+
+    std::vector<Spectrum>& sample = scratch().sample;
+    sample.assign(tile.w * tile.h, Spectrum{});
+    if(heatmap != Heatmap::none) {
+        if(do_trace_heatmap(tile, samples, sample)) accumulate(tile, sample, samples);
+        return;
+    }
+    if(adaptive_error > 0.0f) {
+        if(do_trace_adaptive(tile, samples, sample)) accumulate(tile, sample, samples);
+        return;
+    }
+    if(use_wavefront) {
+        if(do_trace_wavefront(tile, samples, sample)) accumulate(tile, sample, samples);
+        return;
+    }
+
+    for(size_t j = 0; j < tile.h; j++) {
+        for(size_t i = 0; i < tile.w; i++) {
+
+            Spectrum& out = sample[j * tile.w + i];
             size_t sampled = 0;
+            size_t x = tile.x + i, y = tile.y + j;
             for(size_t s = 0; s < samples; s++) {
 
-                Spectrum p = trace_pixel(i, j);
+                RNG::stream(y * out_w + x, tile.samples + s);
+                Spectrum p = trace_pixel(views[tile.view], x, y);
                 if(p.valid()) {
-                    sample.at(i, j) += p;
+                    out += p;
                     sampled++;
                 }
 
                 if(cancel_flag) return;
             }
 
-            if(sampled > 0) sample.at(i, j) *= (1.0f / sampled);
+            if(sampled > 0) out *= (1.0f / sampled);
         }
     }
-    accumulate(sample);
+    accumulate(tile, sample, samples);
 }
 
 bool Pathtracer::in_progress() const {
-    return completed_epochs.load() < total_epochs;
+    return completed_tiles.load() < total_tiles;
+}
+
+bool Pathtracer::wait(std::chrono::milliseconds timeout) {
+    return render_tasks.wait_for(timeout);
 }
 
 std::pair<float, float> Pathtracer::completion_time() const {
@@ -240,109 +1256,718 @@ std::pair<float, float> Pathtracer::completion_time() const {
 }
 
 float Pathtracer::progress() const {
-    return (float)completed_epochs.load() / (float)total_epochs;
+    float tiles_done = (float)completed_tiles.load() / (float)total_tiles;
+    if(time_limit > 0.0f && !deterministic && in_progress()) {
+        double freq = (double)SDL_GetPerformanceFrequency();
+        float elapsed = (float)((SDL_GetPerformanceCounter() - render_time) / freq);
+        return std::max(tiles_done, std::min(elapsed / time_limit, 1.0f));
+    }
+    return tiles_done;
+}
+
+float Pathtracer::achieved_samples() const {
+    if(tiles.empty()) return 0.0f;
+    double samples = 0.0, pixels = 0.0;
+    for(const Tile& tile : tiles) {
+        size_t n = tile.shared_samples.load(std::memory_order_relaxed);
+        samples += (double)n * tile.w * tile.h;
+        pixels += (double)tile.w * tile.h;
+    }
+    return (float)(samples / pixels);
 }
 
 size_t Pathtracer::visualize_bvh(GL::Lines& lines, GL::Lines& active, size_t depth) {
+    if(building()) return 0;
     return scene.visualize(lines, active, depth, Mat4::I);
 }
 
 void Pathtracer::begin_render(Scene& layout_scene, const Camera& cam, bool add_samples) {
+    start_render(layout_scene, {cam}, add_samples);
+}
 
-    size_t n_threads = std::thread::hardware_concurrency();
-    size_t samples_per_epoch = std::max(size_t(1), n_samples / (n_threads * 10));
+void Pathtracer::begin_render(Scene& layout_scene, const std::vector<Camera>& cameras) {
+    assert(!cameras.empty());
+    start_render(layout_scene, cameras, false);
+}
 
+size_t Pathtracer::n_views() const {
+    return views.size();
+}
+
+void Pathtracer::start_render(Scene& layout_scene, const std::vector<Camera>& cameras,
+                              bool add_samples) {
+
+    PROFILE_ZONE("Begin Render");
     cancel();
-    total_epochs = n_samples / samples_per_epoch + !!(n_samples % samples_per_epoch);
 
+    // Tiles are remade if the number of views changes, and only single views reproject
+    bool multi = cameras.size() > 1, same_views = cameras.size() == views.size();
+
+    // Gathered before the tiles are remade, along with the surfaces seen last time
+    bool reprojecting = use_reprojection && !multi && same_views && !add_samples && !resumed &&
+                        !cropped() && heatmap == Heatmap::none && !tile_sink;
+    std::vector<Spectrum> last_frame;
+    std::vector<float> last_weight;
+    if(reprojecting) frame_history(last_frame, last_weight);
+
+    views.clear();
+    for(const Camera& cam : cameras) {
+        float pixel = 2.0f * std::tan(Radians(cam.get_fov()) / 2.0f) / (float)out_h;
+        views.push_back({cam, pixel * pixel});
+    }
+    view_outputs.resize(views.size() - 1);
+
+    if(!tile_sink && output.dimension() != std::pair{out_w, out_h}) {
+        output.resize(out_w, out_h);
+    }
+    for(HDR_Image& out : view_outputs) {
+        if(out.dimension() != std::pair{out_w, out_h}) out.resize(out_w, out_h);
+    }
+    if((!add_samples && !resumed) || tiles.empty() || !same_views) {
+        if(!cropped()) {
+            output.clear({});
+            for(HDR_Image& out : view_outputs) out.clear({});
+        }
+        build_tiles();
+    }
+    if(!add_samples) {
+        render_counters = {};
+        if(!prebuilt) {
+            build_time = SDL_GetPerformanceCounter();
+            Scene_Snapshot snap = capture(layout_scene);
+            build_scene(snap);
+            build_time = SDL_GetPerformanceCounter() - build_time;
+        }
+    }
+    prebuilt = false;
+
+    if(multi) {
+        primary_bounds.clear();
+    } else if(!add_samples) {
+        bound_primary();
+    }
+
+    // Training rays and photons aren't part of the render's counts, and guiding a
+    // heatmap would only change what it measures. Photons come first, as training
+    // paths see their caustics.
+    BVH_Counters::enabled = false;
     if(!add_samples) {
-        accumulator.clear({});
-        accumulator_samples = 0;
-        build_time = SDL_GetPerformanceCounter();
-        build_scene(layout_scene);
-        build_time = SDL_GetPerformanceCounter() - build_time;
+        history.clear();
+        history_weight.clear();
+        if(reprojecting) {
+            reproject(last_frame, last_weight);
+        } else {
+            surfaces.clear();
+        }
+        for(size_t p = 0; p < history_weight.size(); p++) {
+            if(history_weight[p] > 0.0f) output.at(p) = history[p];
+        }
+        caustics.clear();
+        if(caustic_photons > 0 && heatmap == Heatmap::none) trace_photons();
     }
+    if(!add_samples && guide_passes > 0 && heatmap == Heatmap::none) train_guide();
+
+    BVH_Counters::enabled = count_traversal || heatmap != Heatmap::none;
     render_time = SDL_GetPerformanceCounter();
+    deadline = render_time + (Uint64)(time_limit * SDL_GetPerformanceFrequency());
+    size_t per_view = tiles.size() / views.size();
+    total_tiles = per_view > shard_index
+                      ? (per_view - shard_index + shard_count - 1) / shard_count * views.size()
+                      : 0;
+
+    preview_levels.clear();
+    shown_preview = 0;
+    // The preview covers the whole frame, which would hide what is outside a region.
+    // It shows radiance, so heatmaps go without.
+    if(use_preview && !multi && !add_samples && !cropped() && heatmap == Heatmap::none &&
+       !tile_sink) {
+        enqueue_preview();
+    }
+
+    // Resumed tiles only take the samples they are missing. The tiles at one place in
+    // each view are queued one after another, since nearby cameras (as of a stereo
+    // pair) see much the same geometry through them.
+    bool queued = false;
+    size_t frame_samples = region.samples ? region.samples : n_samples;
+    for(size_t i = shard_index; i < per_view; i += shard_count) {
+        for(size_t v = 0; v < views.size(); v++) {
+            Tile& tile = tiles[v * per_view + i];
+            size_t done = resumed ? std::min(tile.samples, frame_samples) : 0;
+            size_t samples = frame_samples - done;
+            if(samples) {
+                enqueue_tile(tile, samples, generation);
+                queued = true;
+            } else {
+                completed_tiles++;
+            }
+        }
+    }
+    if(!queued) render_time = 0;
+    resumed = false;
+}
+
+void Pathtracer::build(Scene& layout_scene) {
+
+    cancel();
+    build_time = SDL_GetPerformanceCounter();
+    Scene_Snapshot snap = capture(layout_scene);
+    build_scene(snap);
+    build_time = SDL_GetPerformanceCounter() - build_time;
+    prebuilt = true;
+}
+
+void Pathtracer::build_async(Scene& layout_scene) {
+
+    cancel();
+    build_time = SDL_GetPerformanceCounter();
+    auto snap = std::make_shared<Scene_Snapshot>(capture(layout_scene));
+    // Builds are mostly waited on by a render about to begin, so they share its priority
+    build_tasks.run(Thread_Pool::Priority::render, [this, snap]() {
+        build_scene(*snap);
+        build_time = SDL_GetPerformanceCounter() - build_time;
+        prebuilt = true;
+    });
+}
 
-    camera = cam;
+bool Pathtracer::building() const {
+    return !build_tasks.done();
+}
 
-    for(size_t s = 0; s < n_samples; s += samples_per_epoch) {
-        size_t samples = (s + samples_per_epoch) > n_samples ? n_samples - s : samples_per_epoch;
-        thread_pool.enqueue([samples, this]() {
-            do_trace(samples);
-            size_t completed = completed_epochs++;
-            if(completed + 1 == total_epochs) {
-                Uint64 done = SDL_GetPerformanceCounter();
-                render_time = done - render_time;
+void Pathtracer::render_aovs(HDR_Image& albedo, HDR_Image& normal, HDR_Image& depth,
+                             size_t samples) {
+
+    // Pixels are gathered here and copied over after, since writing an image marks
+    // its tiles dirty, which isn't safe to do from many threads
+    size_t n = out_w * out_h;
+    std::vector<Spectrum> albedos(n), normals(n), depths(n);
+    samples = std::max(samples, size_t(1));
+    Vec2 wh((float)out_w, (float)out_h);
+
+    parallel_for(0, out_h, 1, [&](size_t y) {
+        for(size_t x = 0; x < out_w; x++) {
+            Spectrum a, N;
+            float d = 0.0f;
+            size_t hits = 0;
+            for(size_t s = 0; s < samples; s++) {
+                // Sample numbers from the top of the range, past the preview levels'
+                RNG::stream(y * out_w + x, ~uint64_t(16 + s));
+                Samplers::Rect sampler;
+                Vec2 xy = Vec2((float)x, (float)y) + sampler.sample();
+                Ray ray = views[0].camera.generate_ray(xy / wh);
+                Trace hit = scene.hit(ray);
+                if(!hit.hit) continue;
+                const BSDF& bsdf = materials[hit.material];
+                Vec3 norm = hit.normal;
+                if(!bsdf.is_sided() && dot(norm, ray.dir) > 0.0f) norm = -norm;
+                a += bsdf.albedo();
+                N += Spectrum(norm.x, norm.y, norm.z);
+                d += hit.distance;
+                hits++;
             }
-        });
+            // Misses count towards albedo and normal as zero, so edges blend into the
+            // background, but depth only averages what was hit
+            size_t p = y * out_w + x;
+            albedos[p] = a * (1.0f / samples);
+            normals[p] = N * (1.0f / samples);
+            depths[p] = Spectrum(hits ? d / hits : 0.0f);
+        }
+    });
+
+    auto fill = [this](HDR_Image& image, const std::vector<Spectrum>& pixels) {
+        image.resize(out_w, out_h);
+        for(size_t p = 0; p < pixels.size(); p++) image.at(p) = pixels[p];
+    };
+    fill(albedo, albedos);
+    fill(normal, normals);
+    fill(depth, depths);
+}
+
+void Pathtracer::enqueue_preview() {
+
+    // Levels are queued coarse to fine ahead of the tiles, so a full-frame image at
+    // 1/8 resolution is available after only a small fraction of a sample per pixel.
+    static const size_t scales[] = {8, 4, 2};
+
+    preview_levels = std::vector<Preview_Level>(sizeof(scales) / sizeof(scales[0]));
+    for(size_t l = 0; l < preview_levels.size(); l++) {
+
+        Preview_Level& level = preview_levels[l];
+        level.scale = scales[l];
+        level.w = (out_w + level.scale - 1) / level.scale;
+        level.h = (out_h + level.scale - 1) / level.scale;
+        level.pixels.assign(level.w * level.h, {});
+
+        size_t band = std::max(size_t(1), tile_size / level.scale);
+        level.remaining = (level.h + band - 1) / band;
+
+        // Preview bands are what the user is waiting to see, so they run ahead of
+        // tiles (and of any background work sharing the pool)
+        size_t gen = generation.load();
+        for(size_t y0 = 0; y0 < level.h; y0 += band) {
+            auto render_band = [&level, y0, band, gen, this]() {
+                if(gen != generation) return;
+                PROFILE_ZONE("Preview Band");
+                size_t y1 = std::min(y0 + band, level.h);
+                for(size_t j = y0; j < y1 && !cancel_flag; j++) {
+                    for(size_t i = 0; i < level.w; i++) {
+                        size_t x = std::min(i * level.scale + level.scale / 2, out_w - 1);
+                        size_t y = std::min(j * level.scale + level.scale / 2, out_h - 1);
+                        RNG::stream(y * out_w + x, ~uint64_t(level.scale));
+                        Spectrum p = trace_pixel(views[0], x, y);
+                        level.pixels[j * level.w + i] =
+                            Pixel_Formats::Half_RGB(p.valid() ? p : Spectrum{});
+                    }
+                }
+                merge_counters();
+                level.remaining.fetch_sub(1, std::memory_order_release);
+            };
+            render_tasks.run(Thread_Pool::Priority::interactive, std::move(render_band));
+        }
     }
 }
 
+void Pathtracer::enqueue_tile(Tile& tile, size_t samples, size_t gen) {
+
+    render_tasks.run(Thread_Pool::Priority::render, [&tile, samples, gen, this]() {
+        // The tile may already be gone if this task outlived its render
+        if(gen != generation) return;
+        PROFILE_ZONE("Render Tile");
+
+        bool timed = time_limit > 0.0f && !deterministic;
+        size_t pass = timed ? std::min(samples, time_pass_samples) : samples;
+        do_trace(tile, pass);
+        merge_counters();
+
+        // The tile is only re-queued once this pass is done, so it stays owned by
+        // a single task.
+        if(pass < samples && SDL_GetPerformanceCounter() < deadline && gen == generation) {
+            enqueue_tile(tile, samples - pass, gen);
+            return;
+        }
+
+        if(tile_sink && gen == generation && !cancel_flag && !tile.pixels.empty()) {
+            tile_sink(tile.x, tile.y, tile.w, tile.h, tile.pixels);
+            std::vector<Spectrum>().swap(tile.pixels);
+        }
+        pager.trim();
+
+        size_t completed = completed_tiles++;
+        if(completed + 1 == total_tiles) {
+            Uint64 done = SDL_GetPerformanceCounter();
+            render_time = done - render_time;
+        }
+    });
+}
+
 void Pathtracer::cancel() {
+    // Queued tasks of the old generation return as soon as they start and running
+    // ones stop at their next sample, so waiting for the render's tasks is quick.
+    // The worker threads (along with their RNG state and scratch buffers) stay alive.
+    // An async build can't be stopped partway, so this waits for it to finish as well.
+    build_tasks.wait();
+    generation++;
     cancel_flag = true;
-    thread_pool.clear();
-    completed_epochs = 0;
-    total_epochs = 0;
+    render_tasks.wait();
+    completed_tiles = 0;
+    total_tiles = 0;
     cancel_flag = false;
-    if(completed_epochs < total_epochs) 
+    if(completed_tiles < total_tiles) 
         render_time = SDL_GetPerformanceCounter() - render_time;
 }
 
-const HDR_Image& Pathtracer::get_output() {
-    return accumulator;
+const HDR_Image& Pathtracer::get_output(size_t view) {
+    snapshot();
+    return image(view);
 }
 
 const GL::Tex2D& Pathtracer::get_output_texture(float exposure) {
-    std::lock_guard<std::mutex> lock(accumulator_mut);
-    return accumulator.get_texture(exposure);
+    snapshot();
+    return output.get_texture(exposure);
+}
+
+float Pathtracer::mis_weight(float pdf, float other) const {
+    if(power_heuristic) {
+        pdf *= pdf;
+        other *= other;
+    }
+    return pdf / (pdf + other);
+}
+
+void Pathtracer::queue_light_samples(const Shading_Info& hit, Spectrum throughput,
+                                     unsigned int path, Ray_Queue& queue) {
+
+    // Every round draws one direction from the lights and one from the BSDF, each
+    // weighted against the other strategy's pdf (Veach's multi-sample MIS). The
+    // rays only gather emission, so they are queued for the caller to trace together.
+    float scale = 1.0f / (float)light_samples;
+    auto add = [&](Vec3 in_dir, bool from_light) {
+        Vec3 local = hit.world_to_object.rotate(in_dir);
+        float light_pdf = area_lights_pdf(hit.pos, in_dir);
+        float bsdf_pdf = hit.bsdf.pdf(hit.out_dir, local);
+        float pdf = from_light ? light_pdf : bsdf_pdf;
+        if(pdf <= 0.0f) return;
+        Spectrum attenuation = hit.bsdf.evaluate(hit.out_dir, local);
+        if(attenuation == Spectrum()) return;
+        float weight =
+            from_light ? mis_weight(light_pdf, bsdf_pdf) : mis_weight(bsdf_pdf, light_pdf);
+        Ray ray(hit.pos, in_dir, Vec2(EPS_F, std::numeric_limits<float>::max()), 0);
+        ray.spread = 1.0f / pdf;
+        queue.push(ray, throughput * attenuation * (weight * scale / pdf), path);
+    };
+
+    bool has_lights = !area_lights.empty() || env_light.has_value();
+    for(size_t i = 0; i < light_samples; i++) {
+        if(has_lights) add(sample_area_lights(hit.pos), true);
+        add(hit.object_to_world.rotate(hit.bsdf.scatter(hit.out_dir).direction), false);
+    }
+}
+
+Spectrum Pathtracer::sample_lights_mis(const Shading_Info& hit) {
+    Ray_Queue& batch = scratch().lights;
+    batch.clear();
+    queue_light_samples(hit, Spectrum(1.0f), 0, batch);
+
+    Spectrum radiance;
+    for(size_t i = 0; i < batch.size(); i++) {
+        radiance += batch.throughput[i] * trace(batch.ray(i)).first;
+    }
+    return radiance;
+}
+
+float Pathtracer::sample_guided(const Shading_Info& hit, Scatter& sctr) const {
+
+    // One sample from the mixture of both, weighted by the mixture's pdf (the balance
+    // heuristic), as for direct lighting
+    if(!guide.guides(hit.pos)) {
+        sctr = hit.bsdf.scatter(hit.out_dir);
+        return hit.bsdf.pdf(hit.out_dir, sctr.direction);
+    }
+    if(RNG::unit() < guide_fraction) {
+        sctr.direction = hit.world_to_object.rotate(guide.sample(hit.pos));
+    } else {
+        sctr.direction = hit.bsdf.scatter(hit.out_dir).direction;
+    }
+    sctr.attenuation = hit.bsdf.evaluate(hit.out_dir, sctr.direction);
+    Vec3 in_dir = hit.object_to_world.rotate(sctr.direction);
+    return guide_fraction * guide.pdf(hit.pos, in_dir) +
+           (1.0f - guide_fraction) * hit.bsdf.pdf(hit.out_dir, sctr.direction);
+}
+
+Spectrum Pathtracer::sample_guided_indirect(const Shading_Info& hit) {
+
+    Scatter sctr;
+    float pdf = sample_guided(hit, sctr);
+    if(sctr.attenuation == Spectrum() || pdf <= 0.0f) return {};
+
+    // Training records radiance regardless of roulette, which only decides whether
+    // this path continues
+    Spectrum weight = sctr.attenuation / pdf;
+    if(!guide_recording && !roulette(hit.depth, hit.throughput, weight)) return {};
+    sctr.transform(hit.object_to_world);
+
+    Ray ray(hit.pos, sctr.direction, Vec2(EPS_F, std::numeric_limits<float>::max()), hit.depth - 1);
+    ray.throughput = hit.throughput * weight;
+    ray.spread = 1.0f / pdf;
+    ray.caustic = true;
+
+    auto [emissive, reflected] = trace(ray);
+    if(guide_recording) guide.record(hit.pos, sctr.direction, (emissive + reflected).luma(), pdf);
+    return reflected * weight;
+}
+
+void Pathtracer::train_guide() {
+
+    PROFILE_ZONE("Train Guide");
+    guide.reset(scene.bbox());
+    guide_recording = true;
+
+    // Each pass traces a path through a random point of every 4x4 block of pixels,
+    // guided by what the passes before it learned
+    constexpr size_t block = 4;
+    size_t w = (out_w + block - 1) / block, h = (out_h + block - 1) / block;
+    Vec2 wh((float)out_w, (float)out_h);
+    for(size_t pass = 0; pass < guide_passes; pass++) {
+        parallel_for(0, h, 1, [&](size_t j) {
+            for(size_t i = 0; i < w && !cancel_flag; i++) {
+                // Sample numbers from the top of the range, past those of AOVs
+                RNG::stream(j * w + i, ~uint64_t((1 << 20) + pass));
+                Samplers::Rect sampler;
+                Vec2 xy = (Vec2((float)i, (float)j) + sampler.sample()) * (float)block;
+                Ray ray = views[0].camera.generate_ray(xy / wh);
+                ray.depth = max_depth;
+                ray.spread = views[0].pixel_spread;
+                trace(ray);
+            }
+        });
+        guide.update();
+    }
+    guide_recording = false;
+}
+
+void Pathtracer::trace_photons() {
+
+    PROFILE_ZONE("Trace Photons");
+
+    // Every emitter is picked in proportion to a rough estimate of its power: for area
+    // lights, their luma times their area (one over the pdf of a uniform point on them)
+    // times the 2 pi of cosine-weighted emission from both sides
+    struct Emitter {
+        const Object* area = nullptr;
+        const Delta_Light* delta = nullptr;
+        Spectrum intensity;
+    };
+    std::vector<Emitter> emitters;
+    std::vector<float> cdf;
+    float total = 0.0f;
+    RNG::stream(0, ~uint64_t(2 << 20));
+    for(const Object& light : area_lights) {
+        Vec3 pos, normal;
+        float pdf = 0.0f;
+        light.sample_point(pos, normal, pdf);
+        if(pdf <= 0.0f) continue;
+        Spectrum emissive = materials[light.material_index()].emissive();
+        emitters.push_back({&light, nullptr, emissive});
+        cdf.push_back(total += emissive.luma() * 2.0f * PI_F / pdf);
+    }
+    for(size_t i = n_directional; i < point_lights.size(); i++) {
+        Vec3 origin;
+        Spectrum weight;
+        point_lights[i].emit(origin, weight);
+        emitters.push_back({nullptr, &point_lights[i], {}});
+        cdf.push_back(total += std::max(weight.luma(), EPS_F));
+    }
+    if(total <= 0.0f) return;
+
+    size_t batches = (caustic_photons + photon_batch - 1) / photon_batch;
+    std::vector<std::vector<Photon_Map::Photon>> landed(batches);
+    parallel_for(0, batches, 1, [&](size_t b) {
+        RNG::stream(b, ~uint64_t((2 << 20) + 1));
+        size_t count = std::min(photon_batch, caustic_photons - b * photon_batch);
+        for(size_t p = 0; p < count && !cancel_flag; p++) {
+
+            size_t e = std::upper_bound(cdf.begin(), cdf.end(), RNG::unit() * total) - cdf.begin();
+            e = std::min(e, emitters.size() - 1);
+            float pmf = (cdf[e] - (e ? cdf[e - 1] : 0.0f)) / total;
+            const Emitter& emitter = emitters[e];
+
+            Vec3 origin, dir;
+            Spectrum power;
+            if(emitter.area) {
+                // A uniform point, a side and a cosine-weighted direction leaving it
+                Vec3 normal;
+                float pdf = 0.0f;
+                emitter.area->sample_point(origin, normal, pdf);
+                if(RNG::coin_flip(0.5f)) normal = -normal;
+                dir = Mat4::rotate_to(normal).rotate(Samplers::Hemisphere::Cosine{}.sample());
+                power = emitter.intensity * (2.0f * PI_F / pdf);
+            } else {
+                dir = emitter.delta->emit(origin, power);
+            }
+            power *= 1.0f / (pmf * (float)caustic_photons);
+            if(power.luma() <= 0.0f) continue;
+
+            // Photons are kept only where they land on a non-discrete surface after
+            // passing at least one mirror or glass surface
+            Ray ray(origin, dir, Vec2(EPS_F, std::numeric_limits<float>::max()));
+            for(size_t bounce = 0; bounce < max_depth; bounce++) {
+                Trace hit = scene.hit(ray);
+                if(!hit.hit) break;
+                // Point and spot lights don't fall off with distance (see
+                // point_lighting), so neither do their photons
+                if(bounce == 0 && emitter.delta) power *= hit.distance * hit.distance;
+
+                const BSDF& bsdf = materials[hit.material];
+                if(bsdf.is_emissive()) break;
+                if(!bsdf.is_discrete()) {
+                    if(bounce > 0) landed[b].push_back({hit.position, -ray.dir, power});
+                    break;
+                }
+
+                Vec3 normal = hit.normal;
+                if(!bsdf.is_sided() && dot(normal, ray.dir) > 0.0f) normal = -normal;
+                Mat4 object_to_world = Mat4::rotate_to(normal);
+                Scatter sctr = bsdf.scatter(object_to_world.T().rotate(-ray.dir));
+                if(sctr.attenuation == Spectrum()) break;
+                power *= sctr.attenuation;
+                ray = Ray(hit.position, object_to_world.rotate(sctr.direction),
+                          Vec2(EPS_F, std::numeric_limits<float>::max()));
+            }
+        }
+    });
+
+    std::vector<Photon_Map::Photon> photons;
+    for(auto& batch : landed) photons.insert(photons.end(), batch.begin(), batch.end());
+    if(photons.empty()) return;
+
+    float radius = caustic_radius;
+    if(radius <= 0.0f) {
+        BBox box;
+        for(const Photon_Map::Photon& p : photons) box.enclose(p.pos);
+        radius = 0.01f * (box.max - box.min).norm();
+    }
+    caustics.build(std::move(photons), std::max(radius, EPS_F));
+}
+
+void Pathtracer::frame_history(std::vector<Spectrum>& frame, std::vector<float>& weight) const {
+
+    frame.assign(out_w * out_h, Spectrum{});
+    weight.assign(out_w * out_h, 0.0f);
+    for(const Tile& tile : tiles) {
+        if(tile.view) continue;
+        for(size_t j = 0; j < tile.h; j++) {
+            for(size_t i = 0; i < tile.w; i++) {
+                // Tile pixels already blend in any history they started from
+                size_t p = (tile.y + j) * out_w + tile.x + i;
+                float samples = tile.pixels.empty() ? 0.0f : (float)tile.samples;
+                float prior = history_weight.empty() ? 0.0f : history_weight[p];
+                if(samples + prior <= 0.0f) continue;
+                frame[p] = samples > 0.0f ? tile.pixels[j * tile.w + i] : history[p];
+                weight[p] = samples + prior;
+            }
+        }
+    }
+}
+
+void Pathtracer::reproject(const std::vector<Spectrum>& frame, const std::vector<float>& weight) {
+
+    PROFILE_ZONE("Reproject");
+    std::vector<Trace> last = std::move(surfaces);
+    bool valid = last.size() == out_w * out_h;
+    surfaces.assign(out_w * out_h, Trace{});
+    if(valid) {
+        history.assign(out_w * out_h, Spectrum{});
+        history_weight.assign(out_w * out_h, 0.0f);
+    }
+
+    // The last camera's projection, recovered from the rays it generates: its center
+    // ray, and the offsets at unit depth from there to the right and top edges
+    Ray center = surfaces_camera.generate_ray(Vec2(0.5f, 0.5f));
+    auto edge = [&](Vec2 uv) {
+        Vec3 dir = surfaces_camera.generate_ray(uv).dir;
+        Vec3 offset = 2.0f * (dir / dot(dir, center.dir) - center.dir);
+        return offset / offset.norm_squared();
+    };
+    Vec3 right = edge(Vec2(1.0f, 0.5f)), up = edge(Vec2(0.5f, 1.0f));
+    const Camera& camera = views[0].camera;
+    float pixel = std::sqrt(views[0].pixel_spread);
+
+    Vec2 wh((float)out_w, (float)out_h);
+    parallel_for(0, out_h, 1, [&](size_t y) {
+        for(size_t x = 0; x < out_w; x++) {
+            Ray ray = camera.generate_ray((Vec2((float)x, (float)y) + Vec2(0.5f)) / wh);
+            Trace hit = scene.hit(ray);
+            if(!hit.hit) continue;
+            if(!materials[hit.material].is_sided() && dot(hit.normal, ray.dir) > 0.0f) {
+                hit.normal = -hit.normal;
+            }
+            size_t p = y * out_w + x;
+            surfaces[p] = hit;
+            if(!valid) continue;
+
+            Vec3 v = hit.position - center.point;
+            float depth = dot(v, center.dir);
+            if(depth <= 0.0f) continue;
+            Vec3 q = v / depth - center.dir;
+            float u = dot(q, right) + 0.5f, t = dot(q, up) + 0.5f;
+            if(u < 0.0f || u >= 1.0f || t < 0.0f || t >= 1.0f) continue;
+            size_t lx = std::min((size_t)(u * out_w), out_w - 1);
+            size_t ly = std::min((size_t)(t * out_h), out_h - 1);
+            size_t l = ly * out_w + lx;
+
+            // The same surface must have been in front there, within a few pixels
+            const Trace& was = last[l];
+            if(!was.hit || weight[l] <= 0.0f || was.material != hit.material) continue;
+            if((was.position - hit.position).norm() > 4.0f * pixel * depth) continue;
+            if(dot(was.normal, hit.normal) < 0.9f) continue;
+            history[p] = frame[l];
+            history_weight[p] = std::min(weight[l], max_history_samples);
+        }
+    });
+    surfaces_camera = camera;
+}
+
+Spectrum Pathtracer::caustic_lighting(const Shading_Info& hit) const {
+
+    if(caustics.empty() || hit.bsdf.is_discrete()) return {};
+
+    // Density estimation with a uniform kernel over the disk of the search radius.
+    // Photon powers carry the cosine at which they arrived, which evaluate() applies
+    // again, so it is divided out.
+    Spectrum sum;
+    caustics.for_near(hit.pos, [&](const Photon_Map::Photon& photon) {
+        Vec3 in_dir = hit.world_to_object.rotate(photon.dir);
+        if(in_dir.y <= EPS_F) return;
+        sum += hit.bsdf.evaluate(hit.out_dir, in_dir) * photon.power * (1.0f / in_dir.y);
+    });
+    float r = caustics.radius();
+    return sum * (1.0f / (PI_F * r * r));
 }
 
 Vec3 Pathtracer::sample_area_lights(Vec3 from) {
+    auto sample_env = [&]() {
+        return portals.empty() ? env_light.value().sample() : portals.sample(from);
+    };
     if(!area_lights.empty() && env_light.has_value()) {
-        if(RNG::coin_flip(0.5f)) return env_light.value().sample();
-        return area_lights.sample(from);
-    }
-    if(env_light.has_value()) {
-        return env_light.value().sample();
+        if(RNG::coin_flip(0.5f)) return sample_env();
+    } else if(env_light.has_value()) {
+        return sample_env();
     }
-    return area_lights.sample(from);
+    float pmf = 0.0f;
+    size_t i = area_light_tree.sample(from, pmf);
+    if(pmf == 0.0f) return {};
+    return area_lights[i].sample(from);
 }
 
 float Pathtracer::area_lights_pdf(Vec3 from, Vec3 dir) {
     int n = 0;
     float pdf = 0.0f;
     if(!area_lights.empty()) {
-        pdf += area_lights.pdf(Ray(from, dir));
+        Ray ray(from, dir);
+        area_light_tree.for_hit(
+            ray, [&](size_t i, float pmf) { pdf += pmf * area_lights[i].pdf(ray); });
         n++;
     }
     if(env_light.has_value()) {
-        pdf += env_light.value().pdf(dir);
+        pdf += portals.empty() ? env_light.value().pdf(dir) : portals.pdf(from, dir);
         n++;
     }
     if(n) pdf /= n;
     return pdf;
 }
 
+bool Pathtracer::roulette(size_t depth, Spectrum throughput, Spectrum& weight) const {
+
+    // Once a path has bounced rr_depth times, it only continues with a probability
+    // given by its throughput. Survivors are re-weighted to keep the estimate unbiased.
+    if(rr_depth == 0 || max_depth - depth + 1 <= rr_depth) return true;
+
+    Spectrum next = throughput * weight;
+    float p = std::clamp(std::max(next.r, std::max(next.g, next.b)), 0.05f, 1.0f);
+    if(!RNG::coin_flip(p)) return false;
+
+    weight *= 1.0f / p;
+    return true;
+}
+
 Spectrum Pathtracer::point_lighting(const Shading_Info& hit) {
 
     if(hit.bsdf.is_discrete()) return {};
 
     Spectrum radiance;
-    for(auto& light : point_lights) {
+    for_point_lights(hit.pos, [&](const Delta_Light& light, float weight) {
         Light_Sample sample = light.sample(hit.pos);
         Vec3 in_dir = hit.world_to_object.rotate(sample.direction);
 
-        Spectrum attenuation = hit.bsdf.evaluate(hit.out_dir, in_dir);
-        if(attenuation.luma() == 0.0f) continue;
+        Spectrum attenuation = hit.bsdf.evaluate(hit.out_dir, in_dir) * weight;
+        if(attenuation.luma() == 0.0f) return;
 
         Ray shadow_ray(hit.pos, sample.direction, Vec2{EPS_F, sample.distance - EPS_F});
 
-        Trace shadow = scene.hit(shadow_ray);
-        if(!shadow.hit) {
+        count_ray(shadow_ray, true);
+        if(!scene.occluded(shadow_ray)) {
             radiance += attenuation * sample.radiance;
         }
-    }
+    });
 
     return radiance;
 }
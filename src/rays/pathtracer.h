@@ -2,18 +2,30 @@
 #pragma once
 
 #include <atomic>
+#include <functional>
+#include <limits>
 #include <mutex>
+#include <optional>
+#include <type_traits>
 #include <unordered_map>
 
 #include "../lib/mathlib.h"
 #include "../scene/scene.h"
 #include "../util/hdr_image.h"
-#include "../util/thread_pool.h"
+#include "../util/rand.h"
+#include "../util/parallel.h"
 
 #include "bsdf.h"
 #include "env_light.h"
+#include "compiled_scene.h"
+#include "gpu_tracer.h"
 #include "light.h"
+#include "light_tree.h"
 #include "object.h"
+#include "path_guide.h"
+#include "photon_map.h"
+#include "portals.h"
+#include "wavefront.h"
 
 namespace Gui {
 class Widget_Render;
@@ -21,23 +33,147 @@ class Widget_Render;
 
 namespace PT {
 
+// What a heatmap render shows in place of radiance: the BVH nodes visited, primitives
+// tested or microseconds spent per sample of each pixel
+enum class Heatmap : int { none, nodes, primitives, time, count };
+inline const char* Heatmap_Names[(int)Heatmap::count] = {"None", "Nodes Visited",
+                                                         "Primitives Tested", "Time"};
+
 class Pathtracer {
 public:
     Pathtracer(Gui::Widget_Render& gui, Vec2 screen_dim);
     ~Pathtracer();
 
-    void set_params(size_t w, size_t h, size_t pixel_samples, size_t depth, bool use_bvh);
+    // Meshes are built with the given profile unless their object chooses its own.
+    // Pixel samples draw from the given sequence (see RNG::Sequence).
+    void set_params(size_t w, size_t h, size_t pixel_samples, size_t depth, bool use_bvh,
+                    float adaptive_error = 0.0f, size_t rr_depth = 0,
+                    BVH_Profile profile = BVH_Profile::balanced,
+                    RNG::Sequence sequence = RNG::Sequence::independent);
     void set_samples(size_t samples);
+    void set_tile_size(size_t size);
+    void set_time_limit(float seconds);
+    void set_wavefront(bool wavefront);
+    // Ignore the time limit, so that identical inputs render to identical bytes
+    void set_deterministic(bool deterministic);
+    // Direct lighting at non-discrete hits takes this many pairs of light and BSDF
+    // samples combined with MIS, or a single mixture sample if 0
+    void set_light_samples(size_t samples, bool power_heuristic = true);
+    // Before each new render, trains a Path_Guide with this many passes of paths at
+    // a quarter of the resolution, then samples indirect bounces at non-discrete hits
+    // from it mixed with the BSDF. 0 disables guiding.
+    void set_guiding(size_t training_passes);
+    // Before each new render, traces this many photons from area, point and spot lights
+    // through mirrors and glass, keeping them where they land on other surfaces. Their
+    // density within radius (or one fitted to where they landed, if 0) then lights
+    // those surfaces in place of the caustic paths they would rarely find. 0 disables
+    // the photon map.
+    void set_caustics(size_t photons, float radius = 0.0f);
+    // Starts each new full-frame render from the last one, wherever a pixel's surface
+    // was also seen from the last camera, worth up to max_history_samples samples. The
+    // image then stays recognizable while the camera moves, instead of restarting from
+    // noise, and new samples take over as they arrive.
+    void set_reprojection(bool reproject);
+    void set_preview(bool preview);
+    // Depth rasterized from the next render's camera at the output size, as distances
+    // along the view axis with the bottom row first (none if empty). Camera rays first
+    // look for a hit no further than the depths around their pixel, which prunes most
+    // of their traversal, and search beyond only if they find none, so the image is
+    // the same either way.
+    void set_primary_depth(std::vector<float> depth);
+    void set_spatial_splits(float alpha);
+    void set_bvh_cache(const std::string& dir);
+    void set_compress_meshes(bool compress);
+    // Pages compressed meshes' geometry from files in the BVH cache directory rather
+    // than holding it in memory (see Geometry_Pager), keeping about budget bytes of it
+    // resident, or as much as the OS allows if 0. Needs both a cache and compression.
+    void set_out_of_core(bool enable, size_t budget = 0);
+    // Approximate cap on the memory of scene builds in flight at once, 0 for none
+    void set_build_memory(size_t bytes);
+    void set_counters(bool enable);
+    // Colors each pixel by its traversal cost instead, from blue (none) to red (scale
+    // or more) on a log scale; a scale of 0 picks one suited to the mode
+    void set_heatmap(Heatmap mode, float scale = 0.0f);
+    // Renders only every count-th tile starting from index, so that count processes
+    // (e.g. on the machines of a farm) can each take a part of one frame
+    void set_shard(size_t index, size_t count);
+    // Traces only the pixels in [x0, x1) x [y0, y1), with this many samples (or the
+    // usual count, if 0), keeping the rest of the image from the last render of the
+    // same size. An empty region is the whole frame.
+    void set_region(size_t x0, size_t y0, size_t x1, size_t y1, size_t samples = 0);
+    // Hands each tile's pixels (rows bottom first) to sink as soon as the tile is done,
+    // then drops them, so that images too large to hold (e.g. posters) render in memory
+    // for the tiles in flight. Tiles are queued from the top of the frame down. The
+    // output image is left empty meanwhile, and there is no preview or reprojection.
+    // An empty sink goes back to keeping the image.
+    using Tile_Sink = std::function<void(size_t x, size_t y, size_t w, size_t h,
+                                         const std::vector<Spectrum>& pixels)>;
+    void set_tile_sink(Tile_Sink sink);
 
-    const HDR_Image& get_output();
+    // The image of the given view of a multi-view render, or of the only one
+    const HDR_Image& get_output(size_t view = 0);
+    // Features of the first surface seen through each pixel of the last render, for
+    // denoising and compositing: albedo, world-space normal (facing the camera) and
+    // distance (zero where nothing is hit), averaged over samples jittered in the pixel
+    void render_aovs(HDR_Image& albedo, HDR_Image& normal, HDR_Image& depth, size_t samples);
+    // Writes the finished render's tiles along with their sample counts
+    std::string save_shard(const std::string& file) const;
+    // Assembles shard files into one image; pixels found in several shards are
+    // averaged, weighted by their samples
+    // Loads a shard saved from a render with the same settings (e.g. as a checkpoint),
+    // which the next begin_render continues, taking only the samples each tile lacks
+    std::string resume(const std::string& file);
+    static std::string merge_shards(const std::vector<std::string>& files, HDR_Image& out);
     const GL::Tex2D& get_output_texture(float exposure);
     size_t visualize_bvh(GL::Lines& lines, GL::Lines& active, size_t level);
 
+    // The scene is copied before this returns, so it may be changed during the render
     void begin_render(Scene& scene, const Camera& camera, bool add_samples = false);
+    // Renders the scene from several cameras at once (e.g. the eyes of a stereo pair,
+    // or the steps of a turntable): it is built once, and the tiles of every view are
+    // queued together, one of each in turn, so the pool stays busy until the last view
+    // is done. Each view accumulates into its own image, the same as rendering it alone
+    // would make. There is no preview, reprojection or primary depth, and the render
+    // can't be saved as a shard or streamed to a tile sink.
+    void begin_render(Scene& scene, const std::vector<Camera>& cameras);
+    size_t n_views() const;
+    // Builds the scene ahead of the next begin_render, which then renders it as built
+    // here. Lets one Pathtracer build the next animation frame while another renders.
+    void build(Scene& scene);
+    // As build, but on the pool: only a snapshot of the scene is taken before this
+    // returns, so that it may be edited while the build runs. Calls that read the
+    // built scene (begin_render, cancel, gpu_scene) first wait for it to finish.
+    void build_async(Scene& scene);
+    bool building() const;
+    // Describes the scene for GPU_Tracer, with the materials and lights this would
+    // render it with. Shapes become their meshes; particles are left out. Cancels any
+    // render in progress, since the lights are rebuilt.
+    void gpu_scene(Scene& scene, GPU_Scene& out);
     void cancel();
     bool in_progress() const;
+    // Block until the render finishes or the timeout passes; returns whether it finished
+    bool wait(std::chrono::milliseconds timeout);
     float progress() const;
     std::pair<float, float> completion_time() const;
+    float achieved_samples() const;
+
+    // Shape of the last built scene's top-level BVHs, and of all its mesh BVHs combined
+    std::pair<BVH_Stats, BVH_Stats> bvh_stats() const;
+    // Traversal work of the current render, if counting was enabled when it started
+    BVH_Counters counters() const;
+
+    // Memory held by the last built scene and the current render
+    struct Memory {
+        // The top-level BVH and its instances
+        size_t scene = 0;
+        // Mesh BVHs and their vertices
+        size_t meshes = 0;
+        // Mesh geometry mapped from files, of which only some is resident
+        size_t paged = 0;
+        // The output image, tiles and preview levels
+        size_t images = 0;
+    };
+    Memory memory() const;
 
 private:
     struct Shading_Info {
@@ -45,45 +181,345 @@ private:
         Mat4 world_to_object, object_to_world;
         Vec3 pos, out_dir, normal;
         size_t depth = 0;
+        Spectrum throughput = Spectrum(1.0f);
+        // See Ray::caustic
+        bool caustic = false;
     };
 
-    void build_scene(Scene& scene);
-    void build_lights(Scene& scene);
-    void do_trace(size_t samples);
-    void accumulate(const HDR_Image& sample);
+    // A screen-space block of the output image. Each tile is rendered by exactly
+    // one task at a time, which accumulates directly into the tile's pixels. These
+    // are allocated by the first pass, so their pages are first touched (and, on
+    // NUMA machines, placed) by a thread rendering the tile rather than the UI thread.
+    // The version is odd while the tile is being written and is used by the GUI
+    // thread to copy out finished tiles without ever blocking the render threads.
+    struct Tile {
+        size_t view = 0;
+        size_t x = 0, y = 0, w = 0, h = 0;
+        size_t samples = 0;
+        // A copy of samples for other threads to read while the tile renders
+        std::atomic<size_t> shared_samples = 0;
+        std::vector<Spectrum> pixels;
+        std::atomic<size_t> version = 0;
+        size_t snapshot = 0;
+    };
+
+    // Per-thread buffers reused for every tile a render thread traces, so that
+    // steady-state rendering performs no heap allocations.
+    struct Scratch {
+        std::vector<Spectrum> sample;
+        std::vector<float> sum_sq;
+        std::vector<size_t> taken, sampled, active, order, buckets;
+        std::vector<Trace> hits;
+        std::vector<uint64_t> keys;
+        std::vector<Vec2> coords;
+        std::vector<Vec3> dirs;
+        std::vector<Spectrum> radiance;
+        Ray_Queue paths, next, shadows, emitters, lights;
+    };
+    static Scratch& scratch();
+
+    // A low-resolution pass rendered before the full-resolution tiles, holding one
+    // sample per scale x scale block. Bands of rows are rendered by separate tasks;
+    // the level is complete once remaining reaches zero. Previews are shown once and
+    // then covered by tiles, so half precision does.
+    struct Preview_Level {
+        size_t scale = 1, w = 0, h = 0;
+        std::vector<Pixel_Formats::Half_RGB> pixels;
+        std::atomic<size_t> remaining = 0;
+    };
+
+    // What building reads of a Scene, taken on the UI thread. Meshes share their
+    // buffers with the scene's (see GL::Mesh::Data), so this costs a few copies per
+    // item, but for particle positions and environment maps, which are copied.
+    struct Scene_Snapshot {
+        struct Object {
+            Scene_ID id = 0;
+            Mat4 T;
+            // False if not rendered, or if its material isn't supported
+            bool render = false;
+            Material::Options material;
+            Spectrum emissive;
+            bool light = false;
+            // Marks a light portal instead, which is never rendered (see Portals)
+            bool portal = false;
+            bool is_shape = false;
+            Shape shape;
+            // The posed mesh, or for area light shapes the mesh approximating them
+            GL::Mesh::Data mesh;
+            bool custom_bvh = false;
+            BVH_Profile profile = BVH_Profile::balanced;
+        };
+        struct Particles {
+            Scene_ID id = 0;
+            Spectrum color;
+            float scale = 1.0f;
+            std::vector<Vec3> positions;
+            GL::Mesh::Data mesh;
+        };
+        struct Light {
+            Scene_ID id = 0;
+            Light_Type type = Light_Type::point;
+            Spectrum radiance;
+            Mat4 T;
+            Vec2 angle_bounds;
+            std::optional<HDR_Image> env_map;
+        };
+        std::vector<Object> objects;
+        std::vector<Particles> particles;
+        std::vector<Light> lights;
+    };
+    static Scene_Snapshot capture(Scene& scene);
+
+    // A camera of the current render. There is one unless it is multi-view, in which
+    // case the first renders to output and the rest to view_outputs.
+    struct View {
+        Camera camera;
+        // Solid angle of one pixel at the center of the image, see Ray::spread
+        float pixel_spread = 0.0f;
+    };
+    std::vector<View> views;
+    std::vector<HDR_Image> view_outputs;
+    HDR_Image& image(size_t view) {
+        return view ? view_outputs[view - 1] : output;
+    }
+    void start_render(Scene& scene, const std::vector<Camera>& cameras, bool add_samples);
+
+    void build_scene(Scene_Snapshot& snap);
+    void build_lights(Scene_Snapshot& snap);
+    void build_tiles();
+    void enqueue_tile(Tile& tile, size_t samples, size_t gen);
+    void enqueue_preview();
+    void do_trace(Tile& tile, size_t samples);
+    bool do_trace_adaptive(Tile& tile, size_t samples, std::vector<Spectrum>& out);
+    bool do_trace_wavefront(Tile& tile, size_t samples, std::vector<Spectrum>& out);
+    void accumulate(Tile& tile, const std::vector<Spectrum>& sample, size_t samples);
+    void snapshot();
     bool tonemap();
+    void count_ray(const Ray& ray, bool shadow = false) const;
+    void merge_counters();
 
     Gui::Widget_Render& gui;
     unsigned long long render_time, build_time;
-    Thread_Pool thread_pool;
-    bool cancel_flag = false;
+    bool prebuilt = false, resumed = false;
+    // The pool shared with the rest of the application (see parallel_pool)
+    Thread_Pool& thread_pool;
+    // Preview and tile tasks of the current render, which cancel() waits for
+    Task_Group render_tasks;
+    // An async build, which cancel() also waits for (see build_async)
+    Task_Group build_tasks;
+    // Every render gets a new generation; tasks from an older generation that are still
+    // queued return immediately, and running ones stop at their next sample.
+    std::atomic<size_t> generation = 0;
+    std::atomic<bool> cancel_flag = false;
+
+    // In time-limited mode, tiles are rendered in passes of a few samples and
+    // re-queued until the deadline (or n_samples) is reached.
+    float time_limit = 0.0f;
+    unsigned long long deadline = 0;
+    // Samples already draw from per-(pixel, sample) streams and each tile accumulates
+    // its passes in order, so only the deadline makes the pass schedule vary by run.
+    bool deterministic = false;
+    static constexpr size_t time_pass_samples = 4;
 
-    HDR_Image accumulator;
-    std::mutex accumulator_mut;
-    size_t total_epochs, accumulator_samples;
-    std::atomic<size_t> completed_epochs;
+    HDR_Image output;
+    std::vector<Tile> tiles;
+    size_t tile_size = 32;
+    size_t shard_index = 0, shard_count = 1;
+    Tile_Sink tile_sink;
+    struct Region {
+        size_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+        size_t samples = 0;
+    };
+    Region region;
+    // The region clamped to the frame, or the whole frame
+    Region bounds() const;
+    bool cropped() const;
+    size_t total_tiles;
+    std::atomic<size_t> completed_tiles;
 
-    Spectrum trace_pixel(size_t x, size_t y);
-    Spectrum sample_direct_lighting(const Shading_Info& hit);
-    Spectrum sample_indirect_lighting(const Shading_Info& hit);
+    // Kinds of light in the scene. The integrator is compiled for each combination,
+    // so that a bounce never tests for (or samples) lights the scene does not have.
+    struct Light_Kinds {
+        static constexpr unsigned int env = 1, area = 2, point = 4;
+    };
+    unsigned int light_kinds = 0;
+    // Calls f with light_kinds as a std::integral_constant
+    template<typename F> decltype(auto) with_light_kinds(F&& f) {
+        switch(light_kinds & 7) {
+        case 0: return f(std::integral_constant<unsigned int, 0>{});
+        case 1: return f(std::integral_constant<unsigned int, 1>{});
+        case 2: return f(std::integral_constant<unsigned int, 2>{});
+        case 3: return f(std::integral_constant<unsigned int, 3>{});
+        case 4: return f(std::integral_constant<unsigned int, 4>{});
+        case 5: return f(std::integral_constant<unsigned int, 5>{});
+        case 6: return f(std::integral_constant<unsigned int, 6>{});
+        default: return f(std::integral_constant<unsigned int, 7>{});
+        }
+    }
 
+    Spectrum trace_pixel(const View& view, size_t x, size_t y);
+    template<unsigned int Lights> Spectrum trace_pixel(const View& view, size_t x, size_t y);
+    template<unsigned int Lights> Spectrum sample_direct_lighting(const Shading_Info& hit);
+    template<unsigned int Lights> Spectrum sample_indirect_lighting(const Shading_Info& hit);
+
+    // Dispatches to the variant for the scene's lights, for callers outside the
+    // integrator (which pay one switch per ray rather than a test per kind of light)
     std::pair<Spectrum, Spectrum> trace(const Ray& ray);
+    // A hit no further than first_bound is looked for first (see set_primary_depth)
+    template<unsigned int Lights>
+    std::pair<Spectrum, Spectrum>
+    trace(const Ray& ray, float first_bound = std::numeric_limits<float>::infinity());
     Spectrum point_lighting(const Shading_Info& hit);
+    void queue_light_samples(const Shading_Info& hit, Spectrum throughput, unsigned int path,
+                             Ray_Queue& queue);
+    Spectrum sample_lights_mis(const Shading_Info& hit);
+    // An indirect bounce at a non-discrete hit, from the guide mixed with the BSDF.
+    // Sets sctr's (object-space) direction and attenuation and returns its pdf.
+    float sample_guided(const Shading_Info& hit, Scatter& sctr) const;
+    Spectrum sample_guided_indirect(const Shading_Info& hit);
+    void train_guide();
+    void trace_photons();
+    // Caustics reflected toward out_dir at a non-discrete hit, from the photon map
+    Spectrum caustic_lighting(const Shading_Info& hit) const;
+    // The radiance each pixel of the current tiles has reached and its weight in samples
+    void frame_history(std::vector<Spectrum>& frame, std::vector<float>& weight) const;
+    // Finds the surfaces through the new camera's pixels and where they were seen
+    // before, filling history from the last frame where they match
+    void reproject(const std::vector<Spectrum>& frame, const std::vector<float>& weight);
+    float mis_weight(float pdf, float other) const;
+    bool roulette(size_t depth, Spectrum throughput, Spectrum& weight) const;
     Vec3 sample_area_lights(Vec3 from);
     float area_lights_pdf(Vec3 from, Vec3 dir);
 
     void log_ray(const Ray& ray, float t, Spectrum color = Spectrum{1.0f});
 
-    Object scene;
-    List<Object> area_lights;
+    Compiled_Scene scene;
+    std::vector<Object> area_lights;
+
+    Path_Guide guide;
+    size_t guide_passes = 0;
+    // Only while training, when indirect bounces record what they find
+    bool guide_recording = false;
+    // Of guided bounces, the fraction sampled from the guide rather than the BSDF
+    static constexpr float guide_fraction = 0.5f;
+
+    Photon_Map caustics;
+    size_t caustic_photons = 0;
+    float caustic_radius = 0.0f;
+    // Photons are traced in batches of this many, each batch from its own RNG stream
+    static constexpr size_t photon_batch = 4096;
+
+    // Reprojection (see set_reprojection): the first surface through the center of each
+    // pixel of the last render, as seen from surfaces_camera, and per pixel the radiance
+    // the render starts from and its weight in samples (empty if none)
+    bool use_reprojection = false;
+    std::vector<Trace> surfaces;
+    Camera surfaces_camera;
+    std::vector<Spectrum> history;
+    std::vector<float> history_weight;
+    static constexpr float max_history_samples = 8.0f;
+    Light_Tree area_light_tree;
+
+    // Meshes from the previous build_scene, by scene object, which are refit
+    // rather than rebuilt when only their vertices have moved
+    std::unordered_map<Scene_ID, Tri_Mesh> mesh_cache;
+
+    // What each scene item was compiled from, in scene order. If a build finds every
+    // item as it was but for transforms and materials, it keeps the compiled scene,
+    // moving and refitting its top level, and only remakes materials and lights.
+    struct Build_Key {
+        Scene_ID id = 0;
+        // Of the posed mesh, and the shape of shape objects
+        uint64_t revision = 0;
+        Shape shape;
+        // Particles, which move every step, and meshes of unknown revision never match
+        bool rebuild = false;
+        bool custom_bvh = false;
+        BVH_Profile profile = BVH_Profile::balanced;
+        // None, surface or area light
+        int kind = 0;
+        Mat4 T;
+    };
+    std::vector<Build_Key> build_keys(const Scene_Snapshot& snap) const;
+    bool reuse_build(Scene_Snapshot& snap, std::vector<Build_Key>& keys);
+    std::vector<Build_Key> built_keys;
+    bool built_use_bvh = false, built_compressed = false, built_out_of_core = false;
+    BVH_Options built_options;
+
     bool scene_use_bvh = true;
+    BVH_Options mesh_options;
+    std::string bvh_cache;
+    bool compress_meshes = false;
+    size_t build_memory = 0;
+    bool out_of_core = false;
+    Geometry_Pager pager;
+
+    // Building the scene runs one job per scene item, with an estimate of the
+    // memory its build needs at its peak.
+    struct Build_Job {
+        size_t cost = 0;
+        std::function<std::vector<Object>()> run;
+    };
+    std::vector<Object> run_build_jobs(std::vector<Build_Job>& jobs);
+    // Primitives, their sorted copy, per-primitive build data and build nodes
+    static constexpr size_t build_bytes_per_triangle = 256, build_bytes_per_sphere = 128;
+    BVH_Stats scene_stats, mesh_stats;
+
+    // Each render task starts from zeroed thread-local counters and merges them here
+    mutable std::mutex counters_mut;
+    BVH_Counters render_counters;
 
     std::vector<BSDF> materials;
+    // Directional lights come first; the rest are positional and also in the tree
     std::vector<Delta_Light> point_lights;
+    size_t n_directional = 0;
+    Light_Tree point_light_tree;
+    // With more positional lights than this, one is sampled per shading point
+    static constexpr size_t many_lights = 8;
+
+    // Calls f(light, weight) for each point light to shade with, weight being the
+    // reciprocal of the probability it was chosen with
+    template<typename F> void for_point_lights(Vec3 pos, F&& f) const {
+        if(point_lights.size() - n_directional <= many_lights) {
+            for(const Delta_Light& light : point_lights) f(light, 1.0f);
+            return;
+        }
+        for(size_t i = 0; i < n_directional; i++) f(point_lights[i], 1.0f);
+        float pmf = 0.0f;
+        size_t i = point_light_tree.sample(pos, pmf);
+        if(pmf > 0.0f) f(point_lights[n_directional + i], 1.0f / pmf);
+    }
     std::optional<Env_Light> env_light;
+    // When not empty, env_light is sampled through these instead of over the sphere
+    Portals portals;
 
-    Camera camera;
     size_t out_w, out_h, n_samples, max_depth;
+    float adaptive_error = 0.0f;
+    // Number of bounces traced before Russian roulette may end a path (0 disables it)
+    size_t rr_depth = 0;
+    size_t light_samples = 0;
+    bool power_heuristic = true;
+
+    // Use the breadth-first integrator in wavefront.cpp instead of trace()
+    bool use_wavefront = false;
+    static constexpr size_t wave_size = 4096;
+    // Smaller wavefront queues are traced as they are, not worth sorting
+    static constexpr size_t min_sorted_rays = 256;
+
+    bool count_traversal = false;
+    Heatmap heatmap = Heatmap::none;
+    float heatmap_scale = 0.0f;
+    bool do_trace_heatmap(Tile& tile, size_t samples, std::vector<Spectrum>& out);
+
+    // Coarse-to-fine preview levels shown until tiles accumulate real samples
+    bool use_preview = false;
+    std::vector<Preview_Level> preview_levels;
+    size_t shown_preview = 0;
+
+    // The last depth set, and per pixel the farthest of it around the pixel (or none,
+    // if its size is not the output's) for the current render
+    std::vector<float> primary_depth, primary_bounds;
+    void bound_primary();
 };
 
 } // namespace PT
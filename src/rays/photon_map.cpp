@@ -0,0 +1,53 @@
+
+#include "photon_map.h"
+
+#include <cmath>
+
+namespace PT {
+
+void Photon_Map::cell(Vec3 pos, int (&c)[3]) const {
+    for(int a = 0; a < 3; a++) c[a] = (int)std::floor(pos[a] / r);
+}
+
+size_t Photon_Map::hash(int x, int y, int z) const {
+    uint32_t h = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u;
+    return h & (starts.size() - 2);
+}
+
+void Photon_Map::build(std::vector<Photon>&& in, float radius) {
+
+    clear();
+    if(in.empty() || !(radius > 0.0f)) return;
+    r = radius;
+
+    // A power of two slots, at least as many as photons, plus the end of the last
+    size_t slots = 1;
+    while(slots < in.size()) slots *= 2;
+    starts.assign(slots + 1, 0);
+
+    // Counting sort by slot
+    std::vector<size_t> keys(in.size());
+    for(size_t i = 0; i < in.size(); i++) {
+        int c[3];
+        cell(in[i].pos, c);
+        keys[i] = hash(c[0], c[1], c[2]);
+        starts[keys[i] + 1]++;
+    }
+    for(size_t s = 1; s <= slots; s++) starts[s] += starts[s - 1];
+
+    photons.resize(in.size());
+    std::vector<uint32_t> next(starts.begin(), starts.end() - 1);
+    for(size_t i = 0; i < in.size(); i++) photons[next[keys[i]]++] = in[i];
+}
+
+void Photon_Map::clear() {
+    r = 0.0f;
+    starts.clear();
+    photons.clear();
+}
+
+size_t Photon_Map::bytes() const {
+    return starts.capacity() * sizeof(uint32_t) + photons.capacity() * sizeof(Photon);
+}
+
+} // namespace PT
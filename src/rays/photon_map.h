@@ -0,0 +1,71 @@
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../lib/spectrum.h"
+
+namespace PT {
+
+// Photons stored on diffuse surfaces, found by position with a hashed grid whose
+// cells are as wide as the search radius, so a lookup only opens the 27 cells
+// around it. Photons are sorted by cell, each cell's being contiguous.
+class Photon_Map {
+public:
+    struct Photon {
+        Vec3 pos;
+        // Toward where the photon came from
+        Vec3 dir;
+        Spectrum power;
+    };
+
+    void build(std::vector<Photon>&& photons, float radius);
+    void clear();
+
+    bool empty() const {
+        return photons.empty();
+    }
+    size_t size() const {
+        return photons.size();
+    }
+    float radius() const {
+        return r;
+    }
+    size_t bytes() const;
+
+    // Calls f(photon) on each photon within the radius of pos
+    template<typename F> void for_near(Vec3 pos, F&& f) const {
+        if(photons.empty()) return;
+        int c[3];
+        cell(pos, c);
+        float r2 = r * r;
+        // Cells can share a slot, which must then be searched only once
+        size_t opened[27];
+        size_t n = 0;
+        for(int dz = -1; dz <= 1; dz++) {
+            for(int dy = -1; dy <= 1; dy++) {
+                for(int dx = -1; dx <= 1; dx++) {
+                    size_t h = hash(c[0] + dx, c[1] + dy, c[2] + dz);
+                    if(std::find(opened, opened + n, h) != opened + n) continue;
+                    opened[n++] = h;
+                    for(uint32_t i = starts[h]; i < starts[h + 1]; i++) {
+                        if((photons[i].pos - pos).norm_squared() <= r2) f(photons[i]);
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    void cell(Vec3 pos, int (&c)[3]) const;
+    size_t hash(int x, int y, int z) const;
+
+    float r = 0.0f;
+    // Photons of cells hashing to slot h are [starts[h], starts[h + 1])
+    std::vector<uint32_t> starts;
+    std::vector<Photon> photons;
+};
+
+} // namespace PT
@@ -0,0 +1,65 @@
+
+#include "portals.h"
+#include "../util/rand.h"
+
+#include <algorithm>
+
+namespace PT {
+
+void Portals::clear() {
+    tris.clear();
+    cdf.clear();
+}
+
+void Portals::add(Vec3 a, Vec3 b, Vec3 c) {
+    Tri tri{a, b - a, c - a};
+    float area = 0.5f * cross(tri.e1, tri.e2).norm();
+    if(!(area > 0.0f)) return;
+    tris.push_back(tri);
+    cdf.push_back((cdf.empty() ? 0.0f : cdf.back()) + area);
+}
+
+Vec3 Portals::sample(Vec3 from) const {
+    if(tris.empty()) return {};
+
+    float x = RNG::unit() * cdf.back();
+    size_t i = std::upper_bound(cdf.begin(), cdf.end(), x) - cdf.begin();
+    const Tri& tri = tris[std::min(i, tris.size() - 1)];
+
+    // Uniform over the triangle by folding the unit square along its diagonal
+    float u = RNG::unit(), v = RNG::unit();
+    if(u + v > 1.0f) {
+        u = 1.0f - u;
+        v = 1.0f - v;
+    }
+    Vec3 d = tri.v0 + tri.e1 * u + tri.e2 * v - from;
+    float dist = d.norm();
+    return dist > 0.0f ? d / dist : Vec3{};
+}
+
+float Portals::pdf(Vec3 from, Vec3 dir) const {
+    if(tris.empty()) return 0.0f;
+
+    // Uniform by area is 1 / total area; converted to solid angle by each crossing's
+    // squared distance over the cosine there (Moller-Trumbore, from either side)
+    float pdf = 0.0f;
+    for(const Tri& tri : tris) {
+        Vec3 p = cross(dir, tri.e2);
+        float det = dot(tri.e1, p);
+        if(std::abs(det) < 1e-12f) continue;
+        Vec3 s = (from - tri.v0) / det;
+        float u = dot(s, p);
+        if(u < 0.0f || u > 1.0f) continue;
+        Vec3 q = cross(s, tri.e1);
+        float v = dot(dir, q);
+        if(v < 0.0f || u + v > 1.0f) continue;
+        float t = dot(tri.e2, q);
+        if(t <= 0.0f) continue;
+        Vec3 n = cross(tri.e1, tri.e2);
+        float cos = std::abs(dot(n, dir)) / n.norm();
+        if(cos > 0.0f) pdf += t * t / cos;
+    }
+    return pdf / cdf.back();
+}
+
+} // namespace PT
@@ -0,0 +1,42 @@
+
+#pragma once
+
+#include <vector>
+
+#include "../lib/mathlib.h"
+
+namespace PT {
+
+// Openings, such as windows, through which the environment lights an interior. When
+// there are any, environment samples are drawn uniformly by area over their triangles,
+// so none are wasted on the walls around them. Directions passing through no portal
+// have no light pdf, and are found by BSDF sampling alone.
+class Portals {
+public:
+    Portals() = default;
+
+    bool empty() const {
+        return tris.empty();
+    }
+    void clear();
+
+    // Triangles are in world space; degenerate ones are skipped
+    void add(Vec3 a, Vec3 b, Vec3 c);
+
+    // Unit direction from a point towards a uniformly chosen point on a portal
+    Vec3 sample(Vec3 from) const;
+
+    // Solid angle density of sample() picking the unit direction dir from a point,
+    // summed over every portal the ray passes through
+    float pdf(Vec3 from, Vec3 dir) const;
+
+private:
+    struct Tri {
+        Vec3 v0, e1, e2;
+    };
+    std::vector<Tri> tris;
+    // Running total of the triangles' areas
+    std::vector<float> cdf;
+};
+
+} // namespace PT
@@ -57,8 +57,18 @@ struct Image {
     float pdf(Vec3 dir) const;
 
     size_t w = 0, h = 0;
-    std::vector<float> _pdf, _cdf;
+    std::vector<float> _pdf;
     float total = 0.0f;
+
+    // Walker alias table over the texels: each slot keeps itself with
+    // probability prob and otherwise defers to its alias, so sampling is O(1)
+    struct Alias {
+        float prob = 1.0f;
+        uint32_t alias = 0;
+    };
+    std::vector<Alias> _alias;
+    // sin(theta) at the center of each row
+    std::vector<float> _sin;
 };
 
 } // namespace Sphere
@@ -21,6 +21,13 @@ public:
 
     BBox bbox() const;
     Trace hit(const Ray& ray) const;
+    bool occluded(const Ray& ray) const;
+    bool intersect(const Ray& ray, float& tmax, Hit& hit) const;
+    Trace finish(const Ray& ray, float t, Hit hit) const;
+
+    // The same tests for a ray from o along unit direction d, relative to the center
+    static bool intersect(Vec3 o, Vec3 d, float radius, float tmin, float& tmax);
+    static bool occluded(Vec3 o, Vec3 d, float radius, Vec2 bounds);
 
     float radius = 1.0f;
 
@@ -48,6 +55,18 @@ public:
         return std::visit(overloaded{[&ray](const auto& o) { return o.hit(ray); }}, underlying);
     }
 
+    bool occluded(const Ray& ray) const {
+        return std::visit([&ray](const auto& o) { return o.occluded(ray); }, underlying);
+    }
+
+    bool intersect(const Ray& ray, float& tmax, Hit& hit) const {
+        return std::visit([&](const auto& o) { return o.intersect(ray, tmax, hit); }, underlying);
+    }
+
+    Trace finish(const Ray& ray, float t, Hit hit) const {
+        return std::visit([&](const auto& o) { return o.finish(ray, t, hit); }, underlying);
+    }
+
     template<typename T> T& get() {
         return std::get<T>(underlying);
     }
@@ -56,6 +75,10 @@ public:
         return std::get<T>(underlying);
     }
 
+    template<typename T> const T* get_if() const {
+        return std::get_if<T>(&underlying);
+    }
+
     bool operator!=(const Shape& c) const {
         return underlying != c.underlying;
     }
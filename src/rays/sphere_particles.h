@@ -0,0 +1,100 @@
+#pragma once
+
+#include "../lib/mathlib.h"
+#include "../platform/gl.h"
+
+#include "bvh.h"
+#include "list.h"
+#include "shapes.h"
+#include "trace.h"
+
+namespace PT {
+
+// One particle of a system whose mesh is a sphere, placed by its center: 16 bytes
+// where a Tri_Mesh instance costs an Object and a transform.
+struct Particle_Sphere {
+    Vec3 center;
+    float radius = 1.0f;
+
+    BBox bbox() const {
+        return BBox(center - Vec3(radius), center + Vec3(radius));
+    }
+
+    bool intersect(const Ray& ray, float& tmax, Hit&) const {
+        return Sphere::intersect(ray.point - center, ray.dir, radius, ray.dist_bounds.x, tmax);
+    }
+
+    Trace finish(const Ray& ray, float t, Hit) const {
+        Trace ret;
+        ret.hit = true;
+        ret.origin = ray.point;
+        ret.distance = t;
+        ret.position = ray.point + t * ray.dir;
+        ret.normal = (ret.position - center).unit();
+        ray.dist_bounds.y = t;
+        return ret;
+    }
+
+    bool occluded(const Ray& ray) const {
+        return Sphere::occluded(ray.point - center, ray.dir, radius, ray.dist_bounds);
+    }
+
+    size_t visualize(GL::Lines&, GL::Lines&, size_t, const Mat4&) const {
+        return size_t(0);
+    }
+};
+static_assert(sizeof(Particle_Sphere) == 16);
+
+// The particles of one system, intersected analytically, in their own BVH or (with
+// BVHs disabled) a list.
+class Sphere_Particles {
+public:
+    Sphere_Particles() = default;
+    Sphere_Particles(std::vector<Particle_Sphere>&& spheres, bool use_bvh,
+                     const BVH_Options& options = {}, Thread_Pool* pool = nullptr)
+        : use_bvh(use_bvh) {
+        if(use_bvh) {
+            bvh = BVH<Particle_Sphere>(std::move(spheres), options, pool);
+        } else {
+            list = List<Particle_Sphere>(std::move(spheres));
+        }
+    }
+
+    Sphere_Particles(const Sphere_Particles& src) = delete;
+    Sphere_Particles& operator=(const Sphere_Particles& src) = delete;
+    Sphere_Particles& operator=(Sphere_Particles&& src) = default;
+    Sphere_Particles(Sphere_Particles&& src) = default;
+
+    BBox bbox() const {
+        return use_bvh ? bvh.bbox() : list.bbox();
+    }
+
+    bool intersect(const Ray& ray, float& tmax, Hit& hit) const {
+        return use_bvh ? bvh.intersect(ray, tmax, hit) : list.intersect(ray, tmax, hit);
+    }
+
+    Trace finish(const Ray& ray, float t, Hit hit) const {
+        return use_bvh ? bvh.finish(ray, t, hit) : list.finish(ray, t, hit);
+    }
+
+    bool occluded(const Ray& ray) const {
+        return use_bvh ? bvh.occluded(ray) : list.occluded(ray);
+    }
+
+    size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, const Mat4& trans) const {
+        if(!use_bvh) return 0;
+        return bvh.visualize(lines, active, level, trans);
+    }
+
+    BVH_Stats stats() const {
+        if(!use_bvh) return {};
+        return bvh.stats();
+    }
+
+private:
+    bool use_bvh = true;
+    BVH<Particle_Sphere> bvh;
+    List<Particle_Sphere> list;
+};
+
+} // namespace PT
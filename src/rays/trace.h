@@ -3,8 +3,33 @@
 
 #include "../lib/mathlib.h"
 
+#include <cassert>
+#include <cstdint>
+
 namespace PT {
 
+// What traversal keeps of the closest hit so far: intersect() finds it and finish()
+// builds its Trace, once, for the hit that wins. Each aggregate on the way down
+// pushes the index of the primitive that was hit, so finish() can go straight
+// back to it.
+struct Hit {
+    // Compiled_Scene leaves out objects nested deeper than this
+    static constexpr uint32_t max_depth = 4;
+
+    Vec2 uv;
+    uint32_t depth = 0;
+    uint32_t path[max_depth];
+
+    void push(uint32_t i) {
+        assert(depth < max_depth);
+        path[depth++] = i;
+    }
+    uint32_t pop() {
+        assert(depth > 0);
+        return path[--depth];
+    }
+};
+
 struct Trace {
 
     bool hit = false;
@@ -5,9 +5,12 @@
 #include "../platform/gl.h"
 
 #include "bvh.h"
+#include "geometry_pager.h"
 #include "list.h"
 #include "trace.h"
 
+#include <memory>
+
 namespace PT {
 
 struct Tri_Mesh_Vert {
@@ -19,6 +22,18 @@ class Triangle {
 public:
     BBox bbox() const;
     Trace hit(const Ray& ray) const;
+    bool occluded(const Ray& ray) const;
+    void split(int axis, float plane, BBox& left, BBox& right) const;
+
+    // hit() in two steps, so that the BVH only interpolates the closest hit's normal
+    bool intersect(const Ray& ray, float& tmax, Hit& hit) const;
+    Trace finish(const Ray& ray, float t, Hit hit) const;
+
+    // Test a leaf of n triangles, several at a time with SSE or AVX if enabled.
+    // intersect_n returns the index of the closest hit (as intersect() would find
+    // testing them in order), or -1.
+    static int intersect_n(const Triangle* tris, size_t n, const Ray& ray, float& tmax, Hit& hit);
+    static bool occluded_n(const Triangle* tris, size_t n, const Ray& ray);
 
     size_t visualize(GL::Lines&, GL::Lines&, size_t, const Mat4&) const {
         return size_t(0);
@@ -29,39 +44,167 @@ public:
 
 private:
     Triangle(Tri_Mesh_Vert* verts, unsigned int v0, unsigned int v1, unsigned int v2);
+    void update();
+    template<size_t L> static void gather(const Triangle* tris, size_t n, float (&c)[9][L]);
 
+    // The first vertex and the edges leaving it, cached from the vertex list so
+    // intersection tests make no indirect loads; normals are only read by finish().
+    Vec3 p0, e1, e2;
     unsigned int v0, v1, v2;
     Tri_Mesh_Vert* vertex_list;
     friend class Tri_Mesh;
 };
 
+// Up to max_tris triangles from one BVH leaf, in the compact form made by
+// Tri_Mesh::compress(). Positions are snapped to a grid over the whole mesh and
+// stored as 16-bit offsets from the cluster's lowest grid point, so a vertex shared
+// by two clusters decodes to the same point in both; normals are octahedral, and
+// triangles index the cluster's own vertices with 16 bits. Triangles are decoded
+// as they are tested.
+class Tri_Cluster {
+public:
+    static constexpr size_t max_tris = 64;
+    static constexpr uint32_t grid_max = (1u << 21) - 1;
+
+    struct Vert {
+        uint16_t pos[3];
+        int16_t normal[2];
+    };
+    // Storage shared by all clusters of a mesh. Clusters spanning more than 16 bits
+    // of the grid keep absolute grid positions in wide instead. The arrays are held
+    // in memory, or in a file mapped by a Geometry_Pager.
+    struct Data {
+        Vec3 origin;
+        float cell = 1.0f;
+        const Vert* verts = nullptr;
+        const uint16_t* indices = nullptr;
+        const uint32_t* wide = nullptr;
+        size_t n_verts = 0, n_indices = 0, n_wide = 0;
+
+        std::vector<Vert> owned_verts;
+        std::vector<uint16_t> owned_indices;
+        std::vector<uint32_t> owned_wide;
+        std::shared_ptr<const Geometry_Pager::Region> region;
+    };
+
+    BBox bbox() const;
+    bool occluded(const Ray& ray) const;
+    bool intersect(const Ray& ray, float& tmax, Hit& hit) const;
+    Trace finish(const Ray& ray, float t, Hit hit) const;
+
+    size_t visualize(GL::Lines&, GL::Lines&, size_t, const Mat4&) const {
+        return size_t(0);
+    }
+
+private:
+    Vec3 position(uint32_t v) const;
+    void triangle(size_t i, Vec3& p0, Vec3& e1, Vec3& e2) const;
+    // Triangles i to i + n by component, as in Triangle::gather
+    template<size_t L> void gather(size_t i, size_t n, float (&c)[9][L]) const;
+
+    static constexpr uint32_t not_wide = ~0u;
+
+    const Data* data = nullptr;
+    uint32_t base[3] = {};
+    uint32_t first_vert = 0, first_index = 0, first_wide = not_wide;
+    uint16_t n_verts = 0, n_tris = 0;
+    friend class Tri_Mesh;
+};
+
 class Tri_Mesh {
 public:
     Tri_Mesh() = default;
-    Tri_Mesh(const GL::Mesh& mesh, bool use_bvh = true);
+    Tri_Mesh(const GL::Mesh& mesh, bool use_bvh = true, Thread_Pool* pool = nullptr,
+             const BVH_Options& options = {});
+    // Each also takes a mesh's Data (see GL::Mesh::data), which can be read on any
+    // thread while the GL::Mesh itself is edited
+    Tri_Mesh(const GL::Mesh::Data& mesh, bool use_bvh = true, Thread_Pool* pool = nullptr,
+             const BVH_Options& options = {});
 
     Tri_Mesh(Tri_Mesh&& src) = default;
     Tri_Mesh& operator=(Tri_Mesh&& src) = default;
     Tri_Mesh(const Tri_Mesh& src) = delete;
     Tri_Mesh& operator=(const Tri_Mesh& src) = delete;
 
+    // Copies share this mesh's vertices and BVH, so any number of instances
+    // (each placed by its own Object transform) cost a single build.
     Tri_Mesh copy() const;
 
     BBox bbox() const;
     Trace hit(const Ray& ray) const;
+    bool occluded(const Ray& ray) const;
+    bool intersect(const Ray& ray, float& tmax, Hit& hit) const;
+    Trace finish(const Ray& ray, float t, Hit hit) const;
 
     size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, const Mat4& trans) const;
-
-    void build(const GL::Mesh& mesh, bool use_bvh = true);
+    // Includes the memory of the vertices and indices it traces
+    BVH_Stats stats() const;
+
+    // With a cache_dir, a BVH saved there by an earlier build of the same mesh with
+    // the same options is loaded instead of built, and new builds are saved there.
+    void build(const GL::Mesh& mesh, bool use_bvh = true, Thread_Pool* pool = nullptr,
+               const BVH_Options& options = {}, const std::string& cache_dir = {});
+    void build(const GL::Mesh::Data& mesh, bool use_bvh = true, Thread_Pool* pool = nullptr,
+               const BVH_Options& options = {}, const std::string& cache_dir = {});
+
+    // Update to a new pose of the same mesh (e.g. the next frame of a skinned
+    // animation). If the topology is unchanged, the vertices are updated in place,
+    // including for every instance, and the BVH is refit; otherwise it is rebuilt.
+    // Nothing is done if the mesh is at the revision it was last built or refit from.
+    void refit(const GL::Mesh& mesh, bool use_bvh = true, Thread_Pool* pool = nullptr,
+               const BVH_Options& options = {}, const std::string& cache_dir = {});
+    void refit(const GL::Mesh::Data& mesh, bool use_bvh = true, Thread_Pool* pool = nullptr,
+               const BVH_Options& options = {}, const std::string& cache_dir = {});
+
+    // Re-encode a BVH mesh as Tri_Clusters, one or more per leaf, dropping the full
+    // precision vertices and triangles. This nearly halves its memory; positions are
+    // kept to 2^-21 of the mesh's extent. Copies made before keep the uncompressed
+    // geometry, and refit() rebuilds a compressed mesh rather than refitting it.
+    // With an enabled pager, the clusters' vertices and indices are then paged from a
+    // file it maps rather than held in memory.
+    void compress(Thread_Pool* pool = nullptr, Geometry_Pager* pager = nullptr);
+
+    // Makes a mesh samplable, e.g. as an area light: with a BVH, sample() picks
+    // triangles in proportion to their area, and pdf() finds the triangles a ray
+    // crosses with one traversal rather than testing each. The mesh (and any copies)
+    // stay samplable through refit(). Spatial splits are not supported, since they
+    // can reach a triangle more than once.
+    void enable_sampling();
 
     Vec3 sample(Vec3 from) const;
     float pdf(Ray ray, const Mat4& T, const Mat4& iT) const;
+    // A point uniform over the surface of a samplable mesh placed by T, with its
+    // normal and its density per unit of area (after T)
+    void sample_point(const Mat4& T, Vec3& pos, Vec3& normal, float& pdf) const;
 
 private:
-    bool use_bvh = true;
-    std::vector<Tri_Mesh_Vert> verts;
-    BVH<Triangle> triangle_bvh;
-    List<Triangle> triangle_list;
+    struct Geometry {
+        bool use_bvh = true;
+        BVH_Options options;
+        // Of the GL::Mesh it was built or refit from
+        uint64_t revision = 0;
+        std::vector<Tri_Mesh_Vert> verts;
+        // Shared with the GL::Mesh it was built from
+        std::shared_ptr<const std::vector<GL::Mesh::Index>> indices =
+            std::make_shared<std::vector<GL::Mesh::Index>>();
+        BVH<Triangle> triangle_bvh;
+        List<Triangle> triangle_list;
+        bool compressed = false;
+        Tri_Cluster::Data packed;
+        BVH<Tri_Cluster> cluster_bvh;
+        // Running sums of the triangles' areas, in index order (see enable_sampling)
+        std::vector<float> area_cdf;
+    };
+    std::shared_ptr<Geometry> geometry = std::make_shared<Geometry>();
+
+    static std::string cache_file(const std::string& dir, const GL::Mesh::Data& mesh,
+                                  const BVH_Options& options);
+    static void build_area_cdf(Geometry& geom);
+    void touch() const {
+        if(geometry->packed.region) geometry->packed.region->touch();
+    }
+    bool load(const std::string& file, Geometry& geom);
+    void save(const std::string& file, const Geometry& geom);
 };
 
 } // namespace PT
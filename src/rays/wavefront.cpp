@@ -0,0 +1,291 @@
+
+#include "wavefront.h"
+#include "pathtracer.h"
+#include "samplers.h"
+
+#include "../util/rand.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace PT {
+
+// Spreads the low 9 bits of v out to every third bit
+static uint32_t morton_bits(uint32_t v) {
+    v &= 0x1ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+void Ray_Queue::coherent_order(std::vector<uint64_t>& keys) const {
+
+    BBox box;
+    for(const Vec3& o : origin) box.enclose(o);
+    Vec3 scale;
+    for(int axis = 0; axis < 3; axis++) {
+        float extent = box.max[axis] - box.min[axis];
+        scale[axis] = extent > 0.0f ? 511.0f / extent : 0.0f;
+    }
+
+    // Octant above 27 bits of Morton code above the index
+    keys.resize(size());
+    for(size_t i = 0; i < size(); i++) {
+        Vec3 q = (origin[i] - box.min) * scale;
+        uint32_t octant = (dir[i].x < 0.0f) | (dir[i].y < 0.0f) << 1 | (dir[i].z < 0.0f) << 2;
+        uint32_t code = octant << 27 | morton_bits(uint32_t(q.x)) << 2 |
+                        morton_bits(uint32_t(q.y)) << 1 | morton_bits(uint32_t(q.z));
+        keys[i] = uint64_t(code) << 32 | uint64_t(i);
+    }
+    std::sort(keys.begin(), keys.end());
+}
+
+bool Pathtracer::do_trace_wavefront(Tile& tile, size_t samples, std::vector<Spectrum>& out) {
+
+    // Breadth-first version of trace(): instead of following one path at a time, all
+    // paths of a wave are advanced one bounce per iteration, stage by stage:
+    //  generate  - one camera ray per pixel sample
+    //  intersect - closest hits for the whole wave, in a coherent order
+    //  shade     - emission, then queue shadow rays, light samples and scattered rays
+    //  shadow    - resolve point light visibility and sampled emission
+    //  compact   - scattered rays become the next wave; terminated paths drop out
+    // The estimator is the same as the recursive integrator: emission is only counted
+    // directly by camera rays and by light-sampling rays, never by indirect bounces.
+
+    size_t n_pixels = tile.w * tile.h;
+    size_t per_wave = std::max(size_t(1), wave_size / n_pixels);
+
+    Scratch& mem = scratch();
+    Ray_Queue& paths = mem.paths;
+    Ray_Queue& next = mem.next;
+    Ray_Queue& shadows = mem.shadows;
+    Ray_Queue& emitters = mem.emitters;
+    std::vector<Trace>& hits = mem.hits;
+    std::vector<uint64_t>& keys = mem.keys;
+    std::vector<size_t>& order = mem.order;
+    std::vector<size_t>& buckets = mem.buckets;
+    std::vector<Spectrum>& radiance = mem.radiance;
+    std::vector<size_t>& sampled = mem.sampled;
+    sampled.assign(n_pixels, 0);
+
+    const View& view = views[tile.view];
+    Vec2 wh((float)out_w, (float)out_h);
+    Samplers::Rect pixel_sampler;
+    auto pixel = [&](size_t p) { return (tile.y + p / tile.w) * out_w + tile.x + p % tile.w; };
+
+    for(size_t s = 0; s < samples; s += per_wave) {
+
+        size_t wave = std::min(per_wave, samples - s);
+        size_t n_paths = n_pixels * wave;
+
+        // Generate: the sample points first, then every camera ray at once
+        paths.clear();
+        radiance.assign(n_paths, Spectrum{});
+        mem.coords.resize(n_paths);
+        for(size_t p = 0; p < n_pixels; p++) {
+            Vec2 xy((float)(tile.x + p % tile.w), (float)(tile.y + p / tile.w));
+            for(size_t k = 0; k < wave; k++) {
+                RNG::stream(pixel(p), tile.samples + s + k);
+                mem.coords[p * wave + k] = (xy + pixel_sampler.sample()) / wh;
+            }
+        }
+        mem.dirs.resize(n_paths);
+        view.camera.generate_dirs(mem.coords.data(), n_paths, mem.dirs.data());
+        paths.push_camera(view.camera.pos(), mem.dirs, max_depth, view.pixel_spread, 0);
+
+        while(!paths.empty()) {
+
+            // Intersect. Camera rays are coherent in pixel order already, but bounced
+            // rays scatter everywhere, so are traced sorted by where they go: neighbors
+            // then visit mostly the same BVH nodes, which stay in cache.
+            hits.resize(paths.size());
+            auto intersect = [&](size_t i) {
+                count_ray(paths.ray(i));
+                hits[i] = scene.hit(paths.ray(i));
+            };
+            if(paths.depth[0] == max_depth || paths.size() < min_sorted_rays) {
+                for(size_t i = 0; i < paths.size(); i++) intersect(i);
+            } else {
+                paths.coherent_order(keys);
+                for(uint64_t key : keys) intersect(size_t(uint32_t(key)));
+            }
+            if(cancel_flag) return false;
+
+            // Group the wave by material (misses first) with a counting sort, so each
+            // material's BSDF is shaded in one run instead of jumping between them
+            auto key = [&](size_t i) { return hits[i].hit ? size_t(hits[i].material) + 1 : 0; };
+            buckets.assign(materials.size() + 2, 0);
+            for(size_t i = 0; i < paths.size(); i++) buckets[key(i) + 1]++;
+            for(size_t b = 1; b < buckets.size(); b++) buckets[b] += buckets[b - 1];
+            order.resize(paths.size());
+            for(size_t i = 0; i < paths.size(); i++) order[buckets[key(i)]++] = i;
+
+            // Shade
+            next.clear();
+            shadows.clear();
+            emitters.clear();
+            for(size_t i : order) {
+
+                Ray ray = paths.ray(i);
+                Trace& result = hits[i];
+                Spectrum throughput = paths.throughput[i];
+                unsigned int path = paths.path[i];
+                bool camera_ray = ray.depth == max_depth;
+
+                // Paths are shaded interleaved, so each bounce resumes its own stream
+                uint32_t bounce = uint32_t(max_depth - ray.depth) + 1;
+                RNG::stream(pixel(path / wave), tile.samples + s + path % wave, bounce << 16);
+
+                if(!result.hit) {
+                    if(camera_ray && env_light.has_value()) {
+                        radiance[path] +=
+                            throughput * env_light.value().evaluate(ray.dir, ray.spread);
+                    }
+                    continue;
+                }
+
+                const BSDF& bsdf = materials[result.material];
+                if(!bsdf.is_sided() && dot(result.normal, ray.dir) > 0.0f) {
+                    result.normal = -result.normal;
+                }
+
+                if(bsdf.is_emissive()) {
+                    if(camera_ray) radiance[path] += throughput * bsdf.emissive();
+                    continue;
+                }
+                if(ray.depth == 0) continue;
+
+                Mat4 object_to_world = Mat4::rotate_to(result.normal);
+                Mat4 world_to_object = object_to_world.T();
+                Vec3 out_dir = world_to_object.rotate(ray.point - result.position).unit();
+                Vec3 pos = result.position;
+
+                // Point lights
+                if(!bsdf.is_discrete()) {
+                    for_point_lights(pos, [&](const Delta_Light& light, float weight) {
+                        Light_Sample sample = light.sample(pos);
+                        Vec3 in_dir = world_to_object.rotate(sample.direction);
+                        Spectrum attenuation = bsdf.evaluate(out_dir, in_dir) * weight;
+                        if(attenuation.luma() == 0.0f) return;
+                        Ray shadow(pos, sample.direction, Vec2{EPS_F, sample.distance - EPS_F});
+                        shadows.push(shadow, throughput * attenuation * sample.radiance, path);
+                    });
+
+                    // Caustics, from the photon map
+                    if(!caustics.empty()) {
+                        Shading_Info hit = {bsdf,    world_to_object, object_to_world, pos,
+                                            out_dir, result.normal,   ray.depth,       throughput};
+                        radiance[path] += throughput * caustic_lighting(hit);
+                    }
+                }
+
+                // Area and environment lights, mixed with BSDF sampling
+                if(light_samples > 0 && !bsdf.is_discrete()) {
+                    Shading_Info hit = {bsdf,    world_to_object, object_to_world, pos,
+                                        out_dir, result.normal,   ray.depth,       throughput};
+                    queue_light_samples(hit, throughput, path, emitters);
+                } else {
+                    float pdf = 1.0f;
+                    Spectrum attenuation;
+                    Vec3 in_dir;
+                    if(bsdf.is_discrete()) {
+                        Scatter sctr = bsdf.scatter(out_dir);
+                        attenuation = sctr.attenuation;
+                        in_dir = object_to_world.rotate(sctr.direction);
+                    } else {
+                        if(RNG::unit() < 0.5f) {
+                            in_dir = object_to_world.rotate(bsdf.scatter(out_dir).direction);
+                        } else {
+                            in_dir = sample_area_lights(pos);
+                        }
+                        Vec3 local = world_to_object.rotate(in_dir);
+                        attenuation = bsdf.evaluate(out_dir, local);
+                        pdf = 0.5f * bsdf.pdf(out_dir, local) + 0.5f * area_lights_pdf(pos, in_dir);
+                    }
+                    // As in sample_direct_lighting, the photon map has lit caustics
+                    bool caustic = bsdf.is_discrete() && ray.caustic && !caustics.empty();
+                    if(attenuation != Spectrum() && pdf > 0.0f && !caustic) {
+                        Ray light(pos, in_dir, Vec2(EPS_F, std::numeric_limits<float>::max()), 0);
+                        if(!bsdf.is_discrete()) light.spread = 1.0f / pdf;
+                        emitters.push(light, throughput * attenuation / pdf, path);
+                    }
+                }
+
+                // Indirect bounce, guided if a guide was trained (see set_guiding)
+                {
+                    Scatter sctr;
+                    float pdf = 1.0f;
+                    if(guide_passes > 0 && !bsdf.is_discrete()) {
+                        Shading_Info hit = {bsdf,    world_to_object, object_to_world, pos,
+                                            out_dir, result.normal,   ray.depth,       throughput};
+                        pdf = sample_guided(hit, sctr);
+                    } else {
+                        sctr = bsdf.scatter(out_dir);
+                        if(!bsdf.is_discrete()) pdf = bsdf.pdf(out_dir, sctr.direction);
+                    }
+                    if(sctr.attenuation != Spectrum() && pdf > 0.0f) {
+                        Spectrum weight = sctr.attenuation / pdf;
+                        if(roulette(ray.depth, throughput, weight)) {
+                            sctr.transform(object_to_world);
+                            Ray bounce(pos, sctr.direction,
+                                       Vec2(EPS_F, std::numeric_limits<float>::max()),
+                                       ray.depth - 1);
+                            if(!bsdf.is_discrete()) bounce.spread = 1.0f / pdf;
+                            bounce.caustic = !bsdf.is_discrete() || ray.caustic;
+                            next.push(bounce, throughput * weight, path);
+                        }
+                    }
+                }
+            }
+
+            // Shadow
+            for(size_t i = 0; i < shadows.size(); i++) {
+                count_ray(shadows.ray(i), true);
+                if(!scene.occluded(shadows.ray(i))) {
+                    radiance[shadows.path[i]] += shadows.throughput[i];
+                }
+            }
+            // Light sampling rays leave in all directions too
+            if(emitters.size() >= min_sorted_rays) {
+                emitters.coherent_order(keys);
+            } else {
+                keys.resize(emitters.size());
+                for(size_t i = 0; i < emitters.size(); i++) keys[i] = i;
+            }
+            for(uint64_t key : keys) {
+                size_t i = size_t(uint32_t(key));
+                Ray ray = emitters.ray(i);
+                count_ray(ray);
+                Trace result = scene.hit(ray);
+                Spectrum emitted;
+                if(result.hit) {
+                    emitted = materials[result.material].emissive();
+                } else if(env_light.has_value()) {
+                    emitted = env_light.value().evaluate(ray.dir, ray.spread);
+                }
+                radiance[emitters.path[i]] += emitters.throughput[i] * emitted;
+            }
+            if(cancel_flag) return false;
+
+            // Compact
+            std::swap(paths, next);
+        }
+
+        for(size_t i = 0; i < n_paths; i++) {
+            size_t p = i / wave;
+            if(radiance[i].valid()) {
+                out[p] += radiance[i];
+                sampled[p]++;
+            }
+        }
+    }
+
+    for(size_t p = 0; p < n_pixels; p++) {
+        if(sampled[p] > 0) out[p] *= (1.0f / sampled[p]);
+    }
+    return true;
+}
+
+} // namespace PT
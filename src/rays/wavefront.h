@@ -0,0 +1,84 @@
+#pragma once
+
+#include <limits>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../lib/spectrum.h"
+
+namespace PT {
+
+// Structure-of-arrays batch of rays used by the wavefront integrator. Each entry
+// carries the throughput it will be scaled by and the index of the path it belongs to.
+struct Ray_Queue {
+
+    size_t size() const {
+        return origin.size();
+    }
+    bool empty() const {
+        return origin.empty();
+    }
+
+    void clear() {
+        origin.clear();
+        dir.clear();
+        dist_bounds.clear();
+        depth.clear();
+        spread.clear();
+        caustic.clear();
+        throughput.clear();
+        path.clear();
+    }
+
+    // Camera rays from origin along each of dirs (unit), for paths first_path onward
+    void push_camera(Vec3 from, const std::vector<Vec3>& dirs, size_t ray_depth,
+                     float ray_spread, unsigned int first_path) {
+        for(size_t i = 0; i < dirs.size(); i++) {
+            origin.push_back(from);
+            dir.push_back(dirs[i]);
+            dist_bounds.push_back(Vec2(0.0f, std::numeric_limits<float>::max()));
+            depth.push_back((unsigned int)ray_depth);
+            spread.push_back(ray_spread);
+            caustic.push_back(false);
+            throughput.push_back(Spectrum(1.0f));
+            path.push_back(first_path + (unsigned int)i);
+        }
+    }
+
+    void push(const Ray& ray, Spectrum weight, unsigned int path_idx) {
+        origin.push_back(ray.point);
+        dir.push_back(ray.dir);
+        dist_bounds.push_back(ray.dist_bounds);
+        depth.push_back((unsigned int)ray.depth);
+        spread.push_back(ray.spread);
+        caustic.push_back(ray.caustic);
+        throughput.push_back(weight);
+        path.push_back(path_idx);
+    }
+
+    // Fills keys with one entry per ray, which sorted lists the rays in an order that
+    // traces coherently: grouped by direction octant, then along a Morton curve through
+    // their origins. The low 32 bits of each key are the ray's index.
+    void coherent_order(std::vector<uint64_t>& keys) const;
+
+    Ray ray(size_t i) const {
+        Ray ret;
+        ret.point = origin[i];
+        ret.set_dir(dir[i]);
+        ret.dist_bounds = dist_bounds[i];
+        ret.depth = depth[i];
+        ret.spread = spread[i];
+        ret.caustic = caustic[i];
+        return ret;
+    }
+
+    std::vector<Vec3> origin, dir;
+    std::vector<Vec2> dist_bounds;
+    std::vector<unsigned int> depth;
+    std::vector<float> spread;
+    std::vector<uint8_t> caustic;
+    std::vector<Spectrum> throughput;
+    std::vector<unsigned int> path;
+};
+
+} // namespace PT
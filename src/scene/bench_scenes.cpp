@@ -0,0 +1,244 @@
+
+#include "bench_scenes.h"
+#include "scene.h"
+
+#include "../geometry/util.h"
+#include "../rays/object.h"
+#include "../rays/tri_mesh.h"
+#include "../util/rand.h"
+
+namespace Bench_Scenes {
+
+static Scene_Object& add_object(Scene& scene, const std::string& name, GL::Mesh&& mesh,
+                                Pose pose, Material_Type type = Material_Type::lambertian,
+                                Spectrum color = Spectrum(0.8f)) {
+    Scene_ID id = scene.add(pose, std::move(mesh), name);
+    Scene_Object& obj = scene.get<Scene_Object>(id);
+    obj.material.opt.type = type;
+    obj.material.opt.albedo = color;
+    obj.material.opt.reflectance = color;
+    obj.material.opt.transmittance = color;
+    obj.material.opt.emissive = color;
+    obj.material.opt.ior = 1.5f;
+    return obj;
+}
+
+static Scene_Object& add_sphere(Scene& scene, const std::string& name, float radius, Vec3 at,
+                                Material_Type type = Material_Type::lambertian,
+                                Spectrum color = Spectrum(0.8f)) {
+    Scene_Object& obj =
+        add_object(scene, name, Util::sphere_mesh(radius, 2), Pose::moved(at), type, color);
+    obj.opt.shape_type = PT::Shape_Type::sphere;
+    obj.opt.shape = PT::Shape(PT::Sphere(radius));
+    return obj;
+}
+
+static Scene_Light& add_light(Scene& scene, Light_Type type, Pose pose, Spectrum color,
+                              float intensity) {
+    Scene_Light light(type, scene.reserve_id(), pose);
+    light.opt.spectrum = color;
+    light.opt.intensity = intensity;
+    Scene_ID id = light.id();
+    scene.add(std::move(light));
+    return scene.get<Scene_Light>(id);
+}
+
+static Pose placed(Vec3 pos, Vec3 euler, Vec3 scale = Vec3{1.0f}) {
+    return Pose{pos, euler, scale};
+}
+
+// Fully saturated colors around the hue circle
+static Spectrum hue(float t) {
+    auto channel = [t](float offset) {
+        return 0.5f + 0.5f * std::cos(2.0f * PI_F * (t + offset));
+    };
+    return Spectrum(channel(0.0f), channel(2.0f / 3.0f), channel(1.0f / 3.0f));
+}
+
+// A sky that brightens toward the horizon over dim ground, and a small, very bright
+// sun, which only importance sampling the map finds reliably
+static HDR_Image sky(size_t w, size_t h) {
+    HDR_Image image(w, h);
+    float sun_elevation = Radians(35.0f), sun_azimuth = Radians(60.0f);
+    Vec3 sun{std::cos(sun_elevation) * std::cos(sun_azimuth), std::sin(sun_elevation),
+             std::cos(sun_elevation) * std::sin(sun_azimuth)};
+    float sun_cos = std::cos(Radians(1.5f));
+    for(size_t y = 0; y < h; y++) {
+        float elevation = ((y + 0.5f) / h - 0.5f) * PI_F;
+        float theta = PI_F / 2.0f - elevation;
+        for(size_t x = 0; x < w; x++) {
+            float phi = (x + 0.5f) / w * 2.0f * PI_F;
+            Vec3 dir{std::sin(theta) * std::cos(phi), std::cos(theta),
+                     std::sin(theta) * std::sin(phi)};
+            Spectrum color = Spectrum(0.15f, 0.12f, 0.1f);
+            if(elevation > 0.0f) {
+                float up = std::sin(elevation);
+                color = Spectrum(0.9f, 0.9f, 1.0f) * (1.0f - up) +
+                        Spectrum(0.25f, 0.45f, 0.9f) * up;
+            }
+            if(dot(dir, sun) > sun_cos) color = Spectrum(2000.0f, 1800.0f, 1500.0f);
+            image.at(x, y) = color;
+        }
+    }
+    return image;
+}
+
+// The classic box: colored walls, two blocks, and a small area light in the ceiling
+static void cornell_box(Scene& scene, View& view) {
+    Spectrum white(0.73f), red(0.63f, 0.065f, 0.05f), green(0.14f, 0.45f, 0.091f);
+    auto wall = [&scene](const std::string& name, Pose pose, Spectrum color) {
+        add_object(scene, name, Util::square_mesh(1.0f), pose, Material_Type::lambertian, color);
+    };
+    wall("Floor", Pose::id(), white);
+    wall("Ceiling", placed(Vec3{0.0f, 2.0f, 0.0f}, Vec3{180.0f, 0.0f, 0.0f}), white);
+    wall("Back", placed(Vec3{0.0f, 1.0f, -1.0f}, Vec3{90.0f, 0.0f, 0.0f}), white);
+    wall("Left", placed(Vec3{-1.0f, 1.0f, 0.0f}, Vec3{0.0f, 0.0f, -90.0f}), red);
+    wall("Right", placed(Vec3{1.0f, 1.0f, 0.0f}, Vec3{0.0f, 0.0f, 90.0f}), green);
+    add_object(scene, "Tall Block", Util::cube_mesh(1.0f),
+               placed(Vec3{-0.35f, 0.6f, -0.3f}, Vec3{0.0f, 15.0f, 0.0f}, Vec3{0.3f, 0.6f, 0.3f}),
+               Material_Type::lambertian, white);
+    add_object(scene, "Short Block", Util::cube_mesh(1.0f),
+               placed(Vec3{0.35f, 0.3f, 0.3f}, Vec3{0.0f, -18.0f, 0.0f}, Vec3{0.3f}),
+               Material_Type::lambertian, white);
+    Scene_Object& light = add_object(scene, "Light", Util::square_mesh(0.25f),
+                                     placed(Vec3{0.0f, 1.99f, 0.0f}, Vec3{180.0f, 0.0f, 0.0f}),
+                                     Material_Type::diffuse_light, Spectrum(1.0f, 0.85f, 0.6f));
+    light.material.opt.intensity = 15.0f;
+    view = {Vec3{0.0f, 1.0f, 3.9f}, Vec3{0.0f, 1.0f, 0.0f}, 40.0f};
+}
+
+// Rows of glass spheres and a glass torus, which keep paths bouncing to full depth
+static void glass(Scene& scene, View& view) {
+    add_object(scene, "Floor", Util::square_mesh(8.0f), Pose::id(), Material_Type::lambertian,
+               Spectrum(0.5f));
+    for(int i = 0; i < 5; i++) {
+        for(int j = 0; j < 3; j++) {
+            Vec3 at{(i - 2) * 0.9f, 0.35f, (j - 1) * 0.9f - 0.5f};
+            add_sphere(scene, "Glass " + std::to_string(i * 3 + j), 0.35f, at,
+                       Material_Type::glass, Spectrum(1.0f) - hue(0.2f * i) * 0.1f);
+        }
+    }
+    add_object(scene, "Torus", Util::torus_mesh(0.15f, 0.6f, 96, 48),
+               placed(Vec3{0.0f, 0.75f, 1.0f}, Vec3{70.0f, 0.0f, 0.0f}), Material_Type::glass,
+               Spectrum(1.0f));
+    add_sphere(scene, "Mirror", 0.5f, Vec3{2.6f, 0.5f, 0.8f}, Material_Type::mirror,
+               Spectrum(0.9f));
+    add_light(scene, Light_Type::sphere, Pose::id(), Spectrum(0.6f, 0.7f, 1.0f), 0.5f);
+    add_light(scene, Light_Type::directional, placed(Vec3{}, Vec3{30.0f, 0.0f, 20.0f}),
+              Spectrum(1.0f, 0.95f, 0.85f), 3.0f);
+    view = {Vec3{0.0f, 2.2f, 6.0f}, Vec3{0.0f, 0.4f, 0.0f}, 45.0f};
+}
+
+// Hundreds of small emissive spheres and point lights over a few shapes to light
+static void many_lights(Scene& scene, View& view) {
+    RNG::seed(uint64_t(0));
+    add_object(scene, "Floor", Util::square_mesh(12.0f), Pose::id(), Material_Type::lambertian,
+               Spectrum(0.6f));
+    for(int i = 0; i < 9; i++) {
+        Vec3 at{(i % 3 - 1) * 2.5f, 0.5f, (i / 3 - 1) * 2.5f};
+        add_object(scene, "Torus " + std::to_string(i), Util::torus_mesh(0.2f, 0.6f),
+                   placed(at, Vec3{90.0f * RNG::unit(), 360.0f * RNG::unit(), 0.0f}),
+                   Material_Type::lambertian, Spectrum(0.8f));
+    }
+    for(int i = 0; i < 256; i++) {
+        Vec3 at{(i % 16 - 7.5f) * 0.6f, 0.6f + 0.6f * RNG::unit(), (i / 16 - 7.5f) * 0.6f};
+        Scene_Object& light = add_sphere(scene, "Emitter " + std::to_string(i), 0.08f, at,
+                                         Material_Type::diffuse_light, hue(i / 256.0f));
+        light.material.opt.intensity = 20.0f;
+    }
+    for(int i = 0; i < 64; i++) {
+        Vec3 at{10.0f * RNG::unit() - 5.0f, 2.0f + RNG::unit(), 10.0f * RNG::unit() - 5.0f};
+        add_light(scene, Light_Type::point, Pose::moved(at), hue(RNG::unit()), 0.5f);
+    }
+    view = {Vec3{0.0f, 4.0f, 9.0f}, Vec3{0.0f, 0.5f, 0.0f}, 45.0f};
+}
+
+// A few materials lit only by an environment map with a sharp sun
+static void env_map(Scene& scene, View& view) {
+    add_object(scene, "Floor", Util::square_mesh(8.0f), Pose::id(), Material_Type::lambertian,
+               Spectrum(0.6f));
+    add_sphere(scene, "Mirror", 0.6f, Vec3{-1.5f, 0.6f, 0.0f}, Material_Type::mirror,
+               Spectrum(0.9f));
+    add_sphere(scene, "Diffuse", 0.6f, Vec3{0.0f, 0.6f, -0.5f}, Material_Type::lambertian,
+               Spectrum(0.8f, 0.3f, 0.2f));
+    add_sphere(scene, "Glass", 0.6f, Vec3{1.5f, 0.6f, 0.0f}, Material_Type::glass, Spectrum(1.0f));
+    add_object(scene, "Torus", Util::torus_mesh(0.2f, 0.5f, 96, 48),
+               Pose::moved(Vec3{0.0f, 0.2f, 1.2f}), Material_Type::lambertian,
+               Spectrum(0.3f, 0.6f, 0.8f));
+    Scene_Light& light = add_light(scene, Light_Type::sphere, Pose::id(), Spectrum(1.0f), 1.0f);
+    light.emissive_set(sky(1024, 512));
+    view = {Vec3{0.0f, 1.5f, 6.0f}, Vec3{0.0f, 0.6f, 0.0f}, 40.0f};
+}
+
+// Tens of thousands of particles, simulated to a fixed time, heaped on a floor
+static void particles(Scene& scene, View& view) {
+    Scene_Object& floor = add_object(scene, "Floor", Util::square_mesh(10.0f), Pose::id(),
+                                     Material_Type::lambertian, Spectrum(0.6f));
+    PT::Object collider(PT::Tri_Mesh(floor.mesh()), floor.id());
+
+    Scene_Particles emitter(scene.reserve_id(), Pose::moved(Vec3{0.0f, 0.1f, 0.0f}), "Emitter");
+    emitter.opt.enabled = true;
+    emitter.opt.color = Spectrum(0.9f, 0.5f, 0.2f);
+    emitter.opt.velocity = 5.0f;
+    emitter.opt.angle = 45.0f;
+    emitter.opt.scale = 0.04f;
+    emitter.opt.pps = 20000.0f;
+    emitter.step(Scene_Particles::Colliders(collider), 2.0f);
+    scene.add(std::move(emitter));
+
+    add_light(scene, Light_Type::sphere, Pose::id(), Spectrum(0.8f, 0.85f, 1.0f), 0.5f);
+    add_light(scene, Light_Type::directional, placed(Vec3{}, Vec3{30.0f, 0.0f, 20.0f}),
+              Spectrum(1.0f, 0.95f, 0.85f), 3.0f);
+    view = {Vec3{0.0f, 3.0f, 8.0f}, Vec3{0.0f, 1.0f, 0.0f}, 45.0f};
+}
+
+// A ring of tubes, each skinned to a bent chain of joints, so the path tracer builds
+// every mesh from its posed vertices
+static void skinned(Scene& scene, View& view) {
+    add_object(scene, "Floor", Util::square_mesh(6.0f), Pose::id(), Material_Type::lambertian,
+               Spectrum(0.6f));
+    for(int i = 0; i < 8; i++) {
+        float angle = 2.0f * PI_F * i / 8;
+        Vec3 at{2.0f * std::cos(angle), 0.0f, 2.0f * std::sin(angle)};
+        Util::Gen::Data tube = Util::Gen::tube(0.15f, 2.0f, 128, 48);
+        Scene_Object& obj = add_object(scene, "Character " + std::to_string(i),
+                                       GL::Mesh(std::move(tube.verts), std::move(tube.elems)),
+                                       Pose::moved(at), Material_Type::lambertian,
+                                       hue(i / 8.0f) * 0.8f);
+        Joint* joint = obj.armature.add_root(Vec3{0.0f, 0.25f, 0.0f});
+        for(int j = 1; j < 8; j++) {
+            joint->pose = Vec3{4.0f * i, 0.0f, 12.0f * std::sin(0.7f * (i + j))};
+            joint = obj.armature.add_child(joint, Vec3{0.0f, 0.25f, 0.0f});
+        }
+        obj.set_skel_dirty();
+        obj.set_pose_dirty();
+    }
+    add_light(scene, Light_Type::hemisphere, Pose::id(), Spectrum(0.7f, 0.8f, 1.0f), 0.6f);
+    add_light(scene, Light_Type::point, Pose::moved(Vec3{1.0f, 4.0f, 2.0f}), Spectrum(1.0f), 12.0f);
+    view = {Vec3{0.0f, 2.5f, 6.0f}, Vec3{0.0f, 0.8f, 0.0f}, 45.0f};
+}
+
+using Builder = void (*)(Scene&, View&);
+static const std::vector<std::pair<std::string, Builder>> scenes = {
+    {"cornell_box", cornell_box}, {"glass", glass},         {"many_lights", many_lights},
+    {"env_map", env_map},         {"particles", particles}, {"skinned", skinned}};
+
+const std::vector<std::string>& names() {
+    static const std::vector<std::string> list = []() {
+        std::vector<std::string> ret;
+        for(const auto& entry : scenes) ret.push_back(entry.first);
+        return ret;
+    }();
+    return list;
+}
+
+std::string build(const std::string& name, Scene& scene, View& view) {
+    for(const auto& [scene_name, builder] : scenes) {
+        if(scene_name != name) continue;
+        builder(scene, view);
+        return {};
+    }
+    return "No benchmark scene named " + name + ".";
+}
+
+} // namespace Bench_Scenes
@@ -0,0 +1,29 @@
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "../lib/mathlib.h"
+
+class Scene;
+
+// Scenes made in code for --benchmark, each weighted toward one part of rendering
+// (area lights, deep glass paths, light selection, environment sampling, instanced
+// spheres, skinning). Being generated rather than loaded, and the same on every
+// run, they give timings that compare across releases and machines.
+namespace Bench_Scenes {
+
+// Where to render a scene from
+struct View {
+    Vec3 pos, target;
+    float fov = 45.0f;
+};
+
+// In the order --benchmark renders them
+const std::vector<std::string>& names();
+
+// Adds the named scene to scene, which should be empty
+std::string build(const std::string& name, Scene& scene, View& view);
+
+} // namespace Bench_Scenes
@@ -2,10 +2,26 @@
 #include "light.h"
 
 #include "../geometry/util.h"
+#include "../util/parallel.h"
+#include "../util/thread_pool.h"
 #include "renderer.h"
 
+#include <filesystem>
+#include <map>
+#include <mutex>
 #include <sstream>
 
+// Widest environment map level uploaded for display; the path tracer uses them all
+static constexpr size_t skydome_width = 2048;
+
+// Loaded maps by file, with the modification time they were loaded at
+struct Emissive_Cache {
+    std::mutex mut;
+    bool enabled = false;
+    std::map<std::string, std::pair<std::filesystem::file_time_type, HDR_Image>> images;
+};
+static Emissive_Cache emissive_cache;
+
 const char* Light_Type_Names[(int)Light_Type::count] = {"Directional", "Sphere", "Hemisphere",
                                                         "Point", "Spot"};
 
@@ -27,7 +43,13 @@ Scene_ID Scene_Light::id() const {
     return _id;
 }
 
-void Scene_Light::set_time(float time) {
+void Scene_Light::set_time(float time, bool force) {
+    if(force) anim_cursor.reset();
+    if(anim_cursor.skip(time, spline_version(lanim.splines.version(), anim.splines.version()),
+                        [this](float t0, float t1) {
+                            return lanim.splines.constant(t0, t1) && anim.splines.constant(t0, t1);
+                        }))
+        return;
     if(lanim.splines.any()) {
         lanim.at(time, opt);
     }
@@ -37,6 +59,11 @@ void Scene_Light::set_time(float time) {
     dirty();
 }
 
+void Scene_Light::bake_frames(size_t n) {
+    lanim.splines.bake_frames(n);
+    anim.splines.bake_frames(n);
+}
+
 void Scene_Light::emissive_clear() {
     opt.has_emissive_map = false;
 }
@@ -45,20 +72,96 @@ HDR_Image Scene_Light::emissive_copy() const {
     return _emissive.copy();
 }
 
+void Scene_Light::cache_emissive(bool enable) {
+    std::lock_guard<std::mutex> lock(emissive_cache.mut);
+    emissive_cache.enabled = enable;
+    if(!enable) emissive_cache.images.clear();
+}
+
+// Decodes a map into image, or copies it from the cache, on any thread
+static std::string load_emissive(const std::string& file, HDR_Image& image) {
+
+    std::error_code ec;
+    auto modified = std::filesystem::last_write_time(file, ec);
+    {
+        std::lock_guard<std::mutex> lock(emissive_cache.mut);
+        auto entry = emissive_cache.images.find(file);
+        if(emissive_cache.enabled && !ec && entry != emissive_cache.images.end() &&
+           entry->second.first == modified) {
+            image = entry->second.second.copy();
+            return {};
+        }
+    }
+
+    std::string err = image.load_from(file);
+    if(err.empty()) {
+        // Built once here, so that the viewport can show a smaller level and the
+        // copies handed to the path tracer come with their levels. Loading shares
+        // the pool with rendering, so it stays out of the way of any render.
+        Thread_Pool::Scoped_Priority background(Thread_Pool::Priority::background);
+        image.build_mips(&parallel_pool());
+
+        std::lock_guard<std::mutex> lock(emissive_cache.mut);
+        if(emissive_cache.enabled && !ec) {
+            emissive_cache.images[file] = {modified, image.copy()};
+        }
+    }
+    return err;
+}
+
 std::string Scene_Light::emissive_load(std::string file) {
-    std::string err = _emissive.load_from(file);
+    pending.reset();
+    std::string err = load_emissive(file, _emissive);
+    if(err.empty()) opt.has_emissive_map = true;
+    return err;
+}
+
+struct Scene_Light::Pending_Emissive {
+    std::string error;
+    HDR_Image image;
+
+    // Last, so that it is destroyed first, waiting for the work to stop
+    Task_Group task{parallel_pool()};
+};
+
+void Scene_Light::emissive_load_async(std::string file) {
+    pending = std::make_shared<Pending_Emissive>();
+    Pending_Emissive& load = *pending;
+    load.task.run(Thread_Pool::Priority::background,
+                  [&load, file]() { load.error = load_emissive(file, load.image); });
+}
+
+bool Scene_Light::emissive_poll(std::string& err) {
+    if(!pending || !pending->task.done()) return false;
+    std::shared_ptr<Pending_Emissive> load = std::move(pending);
+    err = load->error;
     if(err.empty()) {
+        _emissive = std::move(load->image);
         opt.has_emissive_map = true;
     }
-    return err;
+    return true;
+}
+
+bool Scene_Light::emissive_loading() const {
+    return pending != nullptr;
+}
+
+void Scene_Light::emissive_set(HDR_Image&& image) {
+    _emissive = std::move(image);
+    _emissive.build_mips(&parallel_pool());
+    opt.has_emissive_map = true;
 }
 
 std::string Scene_Light::emissive_loaded() const {
     return _emissive.loaded_from();
 }
 
+size_t Scene_Light::emissive_bytes() const {
+    return _emissive.bytes();
+}
+
 const GL::Tex2D& Scene_Light::emissive_texture() const {
-    return _emissive.get_texture();
+    return _emissive.get_texture(0.0f, skydome_width);
 }
 
 BBox Scene_Light::bbox() const {
@@ -116,7 +219,7 @@ void Scene_Light::render(const Mat4& view, bool depth_only, bool posed) {
         renderer.skydome(rot, col, 0.0f);
     } else if(opt.type == Light_Type::sphere) {
         if(opt.has_emissive_map)
-            renderer.skydome(rot, col, -1.1f, _emissive.get_texture());
+            renderer.skydome(rot, col, -1.1f, _emissive.get_texture(0.0f, skydome_width));
         else
             renderer.skydome(rot, col, -1.1f);
     } else {
@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 
 #include "../lib/spectrum.h"
@@ -31,13 +32,27 @@ public:
     void dirty();
 
     Spectrum radiance() const;
-    void set_time(float time);
+    void set_time(float time, bool force = false);
+    void bake_frames(size_t n);
 
     std::string emissive_load(std::string file);
+    // As emissive_load, but decoded on the thread pool, behind the UI. Until
+    // emissive_poll() swaps it in, the current map (if any) stays in use.
+    void emissive_load_async(std::string file);
+    // Whether an asynchronous load finished since the last call, in which case err is
+    // set to its error, if any
+    bool emissive_poll(std::string& err);
+    bool emissive_loading() const;
+    // While enabled, loaded maps are kept, and loading an unmodified file again copies
+    // the kept image rather than decoding it
+    static void cache_emissive(bool enable);
+    // Uses an image made in code as the map, as if it had been loaded
+    void emissive_set(HDR_Image&& image);
     std::string emissive_loaded() const;
     HDR_Image emissive_copy() const;
 
     const GL::Tex2D& emissive_texture() const;
+    size_t emissive_bytes() const;
     void emissive_clear();
     bool is_env() const;
 
@@ -66,12 +81,16 @@ public:
 
 private:
     void regen_mesh();
+    Spline_Cursor anim_cursor;
 
     bool _dirty = true;
     Scene_ID _id = 0;
     GL::Mesh _mesh;
     GL::Lines _lines;
     HDR_Image _emissive;
+
+    struct Pending_Emissive;
+    std::shared_ptr<Pending_Emissive> pending;
 };
 
 bool operator!=(const Scene_Light::Options& l, const Scene_Light::Options& r);
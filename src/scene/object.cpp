@@ -4,6 +4,8 @@
 
 #include "../geometry/util.h"
 #include "../gui/render.h"
+#include "../util/parallel.h"
+#include "../util/profiler.h"
 
 Scene_Object::Scene_Object(Scene_ID id, Pose p, GL::Mesh&& m, std::string n)
     : pose(p), _id(id), armature(id), _mesh(std::move(m)) {
@@ -32,6 +34,112 @@ Scene_Object::Scene_Object(Scene_ID id, Pose p, Halfedge_Mesh&& m, std::string n
     sync_anim_mesh();
 }
 
+Scene_Object::Scene_Object(Scene_ID id, Pose p, Halfedge_Mesh&& m, GL::Mesh&& built,
+                           std::string n)
+    : pose(p), _id(id), armature(id), halfedge(std::move(m)), _mesh(std::move(built)) {
+
+    set_mesh_dirty();
+    mesh_dirty = false;
+
+    if(n.size()) {
+        snprintf(opt.name, MAX_NAME_LEN, "%s", n.c_str());
+    } else {
+        snprintf(opt.name, MAX_NAME_LEN, "Object %d", id);
+    }
+}
+
+Scene_Object::Scene_Object(Scene_ID id, Pose p, std::shared_ptr<const Polygons> polygons,
+                           GL::Mesh&& built, std::string n)
+    : pose(p), _id(id), armature(id), polys(std::move(polygons)), _mesh(std::move(built)) {
+
+    set_mesh_dirty();
+    mesh_dirty = false;
+
+    if(n.size()) {
+        snprintf(opt.name, MAX_NAME_LEN, "%s", n.c_str());
+    } else {
+        snprintf(opt.name, MAX_NAME_LEN, "Object %d", id);
+    }
+}
+
+void Scene_Object::Polygons::to_mesh(GL::Mesh& mesh, bool split_faces) const {
+    std::vector<GL::Mesh::Vert> out_verts;
+    std::vector<GL::Mesh::Index> idxs;
+    to_mesh(out_verts, idxs, split_faces);
+    mesh.recreate(std::move(out_verts), std::move(idxs));
+}
+
+void Scene_Object::Polygons::to_mesh(std::vector<GL::Mesh::Vert>& out_verts,
+                                     std::vector<GL::Mesh::Index>& idxs, bool split_faces) const {
+
+    size_t n_faces = face_start.empty() ? 0 : face_start.size() - 1;
+    std::vector<size_t> offsets(n_faces + 1, 0);
+    for(size_t f = 0; f < n_faces; f++) {
+        size_t degree = face_start[f + 1] - face_start[f];
+        offsets[f + 1] = offsets[f] + (degree >= 3 ? degree - 2 : 0);
+    }
+    size_t n_tris = offsets.back();
+
+    out_verts.clear();
+    idxs.assign(n_tris * 3, 0);
+
+    if(split_faces) {
+
+        out_verts.resize(n_tris * 3);
+        parallel_for(0, n_faces, 256, [&](size_t f) {
+            const Halfedge_Mesh::Index* c = corners.data() + face_start[f];
+            size_t degree = face_start[f + 1] - face_start[f];
+            size_t out = offsets[f] * 3;
+            for(size_t k = 2; k < degree; k++) {
+                Vec3 v0 = verts[c[0]], v1 = verts[c[k - 1]], v2 = verts[c[k]];
+                Vec3 n = cross(v1 - v0, v2 - v0).unit();
+                if(flip) n = -n;
+                out_verts[out] = {v0, n, 0};
+                out_verts[out + 1] = {v1, n, 0};
+                out_verts[out + 2] = {v2, n, 0};
+                idxs[out] = (GL::Mesh::Index)out;
+                idxs[out + 1] = (GL::Mesh::Index)(out + 1);
+                idxs[out + 2] = (GL::Mesh::Index)(out + 2);
+                out += 3;
+            }
+        });
+
+    } else {
+
+        // Like Vertex::normal, each corner adds the cross product of the edges to the
+        // next two corners of its face
+        std::vector<Vec3> normals(verts.size());
+        for(size_t f = 0; f < n_faces; f++) {
+            const Halfedge_Mesh::Index* c = corners.data() + face_start[f];
+            size_t degree = face_start[f + 1] - face_start[f];
+            for(size_t k = 0; k < degree; k++) {
+                Vec3 pi = verts[c[k]];
+                Vec3 pj = verts[c[(k + 1) % degree]];
+                Vec3 pk = verts[c[(k + 2) % degree]];
+                normals[c[k]] += cross(pj - pi, pk - pi);
+            }
+        }
+
+        out_verts.resize(verts.size());
+        parallel_for(0, verts.size(), 1024, [&](size_t i) {
+            Vec3 n = normals[i].unit();
+            if(flip) n = -n;
+            out_verts[i] = {verts[i], n, 0};
+        });
+
+        parallel_for(0, n_faces, 256, [&](size_t f) {
+            const Halfedge_Mesh::Index* c = corners.data() + face_start[f];
+            size_t degree = face_start[f + 1] - face_start[f];
+            size_t out = offsets[f] * 3;
+            for(size_t k = 2; k < degree; k++) {
+                idxs[out++] = (GL::Mesh::Index)c[0];
+                idxs[out++] = (GL::Mesh::Index)c[k - 1];
+                idxs[out++] = (GL::Mesh::Index)c[k];
+            }
+        });
+    }
+}
+
 const GL::Mesh& Scene_Object::posed_mesh() {
     sync_anim_mesh();
     if(armature.has_bones()) return _anim_mesh;
@@ -42,6 +150,47 @@ Scene_ID Scene_Object::id() const {
     return _id;
 }
 
+// Levels of detail stop short of this many triangles
+static constexpr size_t lod_floor = 1024;
+
+GL::Mesh& Scene_Object::lod_mesh(const Mat4& modelview) {
+
+    Renderer& renderer = Renderer::get();
+    size_t tris = _mesh.indices().size() / 3;
+    if(!renderer.mesh_lod || tris <= lod_min_tris) return _mesh;
+
+    // Levels are built from a snapshot of the mesh, and only used while it is current
+    if(lod_build.valid() &&
+       lod_build.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        std::vector<Util::Gen::Data> levels = lod_build.get();
+        if(lod_build_revision == _mesh.revision()) {
+            lods.clear();
+            for(Util::Gen::Data& level : levels) {
+                lods.emplace_back(std::move(level.verts), std::move(level.elems));
+            }
+            lod_revision = lod_build_revision;
+        }
+    }
+    if(lod_revision != _mesh.revision() && !lod_build.valid()) {
+        lod_build_revision = _mesh.revision();
+        lod_build = parallel_pool().enqueue(
+            Thread_Pool::Priority::background,
+            [verts = _mesh.share_verts(), idxs = _mesh.share_indices()]() {
+                return Util::Gen::lods(*verts, *idxs, lod_floor);
+            });
+    }
+    if(lod_revision != _mesh.revision()) return _mesh;
+
+    // About a triangle per four pixels of the square the object's bounds cover
+    float pixels = renderer.screen_size(_mesh.bbox(), modelview);
+    float budget = pixels * pixels / 4.0f;
+    if((float)tris <= budget) return _mesh;
+    for(GL::Mesh& level : lods) {
+        if((float)level.indices().size() / 3.0f <= budget) return level;
+    }
+    return lods.empty() ? _mesh : lods.back();
+}
+
 const GL::Mesh& Scene_Object::mesh() {
     sync_mesh();
     return _mesh;
@@ -51,6 +200,7 @@ void Scene_Object::try_make_editable(PT::Shape_Type prev) {
 
     _mesh = opt.shape.mesh();
 
+    polys.reset();
     std::string err = halfedge.from_mesh(_mesh);
     if(err.empty()) {
         editable = true;
@@ -65,37 +215,62 @@ bool Scene_Object::is_shape() const {
     return opt.shape_type != PT::Shape_Type::none;
 }
 
-void Scene_Object::set_time(float time) {
+void Scene_Object::set_time(float time, bool force) {
+    uint64_t version = spline_version(anim.splines.version(), armature.anim_version());
+    version = spline_version(version, material.anim.splines.version());
+    if(force) anim_cursor.reset();
+    if(anim_cursor.skip(time, version, [this](float t0, float t1) {
+           return anim.splines.constant(t0, t1) && armature.anim_constant(t0, t1) &&
+                  material.anim.splines.constant(t0, t1);
+       }))
+        return;
+
     if(anim.splines.any()) pose = anim.at(time);
     if(armature.set_time(time)) set_pose_dirty();
     if(material.anim.splines.any()) material.anim.at(time, material.opt);
 }
 
+void Scene_Object::bake_frames(size_t n) {
+    anim.splines.bake_frames(n);
+    armature.bake_frames(n);
+    material.anim.splines.bake_frames(n);
+}
+
 bool Scene_Object::is_editable() const {
     return editable && opt.shape_type == PT::Shape_Type::none;
 }
 
 void Scene_Object::copy_mesh(Halfedge_Mesh& out) {
-    halfedge.copy_to(out);
+    get_mesh().copy_to(out);
 }
 
 void Scene_Object::set_mesh(Halfedge_Mesh& in) {
+    polys.reset();
     in.copy_to(halfedge);
     set_mesh_dirty();
 }
 
 Halfedge_Mesh::ElementRef Scene_Object::set_mesh(Halfedge_Mesh& in, unsigned int eid) {
+    polys.reset();
     auto e = in.copy_to(halfedge, eid);
     set_mesh_dirty();
     return e;
 }
 
 void Scene_Object::take_mesh(Halfedge_Mesh&& in) {
+    polys.reset();
     halfedge = std::move(in);
     set_mesh_dirty();
 }
 
+void Scene_Object::swap_mesh(Halfedge_Mesh& other) {
+    sync_halfedge();
+    std::swap(halfedge, other);
+    set_mesh_dirty();
+}
+
 Halfedge_Mesh& Scene_Object::get_mesh() {
+    sync_halfedge();
     return halfedge;
 }
 
@@ -103,17 +278,184 @@ const Halfedge_Mesh& Scene_Object::get_mesh() const {
     return halfedge;
 }
 
+std::string Scene_Object::sync_halfedge() {
+
+    if(!polys) return {};
+    std::shared_ptr<const Polygons> p = std::move(polys);
+
+    // The GL mesh made from the polygons is kept if they can't be edited
+    std::string err = halfedge.from_flat(p->face_start, p->corners, p->verts);
+    if(!err.empty()) {
+        halfedge = Halfedge_Mesh();
+        editable = false;
+        return err;
+    }
+
+    if(p->flip) halfedge.flip();
+    set_mesh_dirty();
+    return {};
+}
+
+// Each vertex's influences as mesh attributes, if there are few enough of them
+static bool gpu_skin(const Skeleton::Skin_Weights& map, std::vector<GL::Mesh::Skin>& skin) {
+
+    if(map.joints.size() > GL::Shaders::max_joints || map.offsets.empty()) return false;
+
+    skin.assign(map.offsets.size() - 1, GL::Mesh::Skin{});
+    for(size_t i = 0; i < skin.size(); i++) {
+        size_t b = map.offsets[i], e = map.offsets[i + 1];
+        if(b == e || e - b > GL::Mesh::max_influences) return false;
+        for(size_t k = b; k < e; k++) {
+            skin[i].joints[k - b] = map.influences[k];
+            skin[i].weights[k - b] = map.weights[k];
+        }
+    }
+    return true;
+}
+
+bool Scene_Object::sync_skin_mesh() {
+
+    // The CPU-skinned mesh is only made when something else asks for it, so the
+    // pose stays dirty
+    sync_mesh();
+    if(skel_dirty) {
+        vertex_joints.clear();
+        armature.find_joints(_mesh, vertex_joints);
+        skel_dirty = false;
+        skin_dirty = true;
+    }
+    if(skin_dirty) {
+        std::vector<GL::Mesh::Skin> skin;
+        skin_fits = gpu_skin(vertex_joints, skin);
+        if(skin_fits) {
+            if(!_skin_mesh) _skin_mesh = std::make_unique<GL::Mesh>();
+            *_skin_mesh = _mesh.copy();
+            _skin_mesh->set_skin(std::move(skin));
+        } else {
+            _skin_mesh.reset();
+        }
+        skin_dirty = false;
+    }
+    return skin_fits;
+}
+
+const Scene_Object::Polygons* Scene_Object::polygons() const {
+    return polys.get();
+}
+
+uint64_t Scene_Object::Skin_Cache::hash(const std::vector<float>& key) {
+    uint64_t h = 14695981039346656037ull;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(key.data());
+    for(size_t i = 0; i < key.size() * sizeof(float); i++) {
+        h = (h ^ bytes[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+bool Scene_Object::Skin_Cache::find(const std::vector<float>& key, GL::Mesh& out,
+                                    const GL::Mesh& topology) {
+    uint64_t h = hash(key);
+    for(auto e = entries.begin(); e != entries.end(); e++) {
+        if(e->hash != h || e->key != key) continue;
+        entries.splice(entries.begin(), entries, e);
+        // Keeping the revision lets a BVH refit from these vertices skip refitting
+        out.recreate(e->verts, topology, e->revision);
+        return true;
+    }
+    return false;
+}
+
+void Scene_Object::Skin_Cache::insert(std::vector<float>&& key, const GL::Mesh& skinned) {
+    size_t size = key.size() * sizeof(float) + skinned.verts().size() * sizeof(GL::Mesh::Vert);
+    if(size > skin_cache_budget) {
+        clear();
+        return;
+    }
+    while(!entries.empty() && bytes + size > skin_cache_budget) {
+        const Entry& e = entries.back();
+        bytes -= e.key.size() * sizeof(float) + e.verts->size() * sizeof(GL::Mesh::Vert);
+        entries.pop_back();
+    }
+    uint64_t h = hash(key);
+    entries.push_front({std::move(key), h, skinned.share_verts(), skinned.revision()});
+    bytes += size;
+}
+
+void Scene_Object::Skin_Cache::clear() {
+    entries.clear();
+    bytes = 0;
+}
+
+size_t Scene_Object::Skin_Cache::held(std::unordered_set<const void*>& seen) const {
+    size_t total = 0;
+    for(const Entry& e : entries) {
+        total += e.key.capacity() * sizeof(float);
+        if(seen.insert(e.verts.get()).second) {
+            total += e.verts->capacity() * sizeof(GL::Mesh::Vert);
+        }
+    }
+    return total;
+}
+
+size_t Scene_Object::halfedge_bytes(std::unordered_set<const void*>& seen) const {
+    size_t total = halfedge.bytes();
+    if(polys && seen.insert(polys.get()).second) {
+        total += polys->verts.capacity() * sizeof(Vec3) +
+                 (polys->face_start.capacity() + polys->corners.capacity()) *
+                     sizeof(Halfedge_Mesh::Index);
+    }
+    return total;
+}
+
+size_t Scene_Object::mesh_bytes(std::unordered_set<const void*>& seen) const {
+    size_t total = _mesh.bytes(seen) + _anim_mesh.bytes(seen);
+    if(_skin_mesh) total += _skin_mesh->bytes(seen);
+    for(const GL::Mesh& level : lods) total += level.bytes(seen);
+    return total;
+}
+
+size_t Scene_Object::skin_bytes(std::unordered_set<const void*>& seen) const {
+    const Skeleton::Skin_Weights& w = vertex_joints;
+    size_t total = w.joints.capacity() * sizeof(const Joint*) +
+                   w.offsets.capacity() * sizeof(size_t) +
+                   w.influences.capacity() * sizeof(unsigned int) +
+                   w.weights.capacity() * sizeof(float);
+    return total + skin_cache.held(seen);
+}
+
 void Scene_Object::sync_anim_mesh() {
     sync_mesh();
     if(skel_dirty && armature.has_bones()) {
         vertex_joints.clear();
         armature.find_joints(_mesh, vertex_joints);
+        skin_dirty = true;
+        skin_cache.clear();
     }
     if(pose_dirty && armature.has_bones()) {
+
+        // The skinned vertices depend on nothing else, given the same joint weights
+        std::vector<float> key;
+        if(skin_cache_budget) {
+            armature.skin_palette(vertex_joints, skin_palette);
+            key.reserve(skin_palette.size() * 16 + 2);
+            for(const Mat4& m : skin_palette) {
+                for(int i = 0; i < 16; i++) key.push_back(m.data[i]);
+            }
+            key.push_back(opt.smooth_normals ? 1.0f : 0.0f);
+            key.push_back(static_cast<float>(armature.skin_mode));
+            if(skin_cache.find(key, _anim_mesh, _mesh)) {
+                skel_dirty = pose_dirty = false;
+                return;
+            }
+        } else {
+            skin_cache.clear();
+        }
+
+        PROFILE_ZONE("Skin");
         armature.skin(_mesh, _anim_mesh, vertex_joints);
         if(!opt.smooth_normals) {
             auto& verts = _anim_mesh.edit_verts();
-            auto& idxs = _anim_mesh.edit_indices();
+            const auto& idxs = _anim_mesh.indices();
             for(size_t i = 0; i < idxs.size(); i += 3) {
                 Vec3 v0 = verts[idxs[i]].pos;
                 Vec3 v1 = verts[idxs[i + 1]].pos;
@@ -124,19 +466,30 @@ void Scene_Object::sync_anim_mesh() {
                 verts[idxs[i + 2]].norm = n;
             }
         }
+        if(skin_cache_budget) skin_cache.insert(std::move(key), _anim_mesh);
     }
     skel_dirty = pose_dirty = false;
 }
 
 void Scene_Object::flip_normals() {
-    halfedge.flip();
+    if(polys) {
+        // Other objects may share these
+        auto flipped = std::make_shared<Polygons>(*polys);
+        flipped->flip = !flipped->flip;
+        polys = std::move(flipped);
+    } else {
+        halfedge.flip();
+    }
     mesh_dirty = true;
 }
 
 void Scene_Object::sync_mesh() {
 
     if(editable && mesh_dirty) {
-        halfedge.to_mesh(_mesh, !opt.smooth_normals);
+        if(polys)
+            polys->to_mesh(_mesh, !opt.smooth_normals);
+        else
+            halfedge.to_mesh(_mesh, !opt.smooth_normals);
         mesh_dirty = false;
     } else if(mesh_dirty && is_shape()) {
         mesh_dirty = false;
@@ -176,36 +529,53 @@ BBox Scene_Object::bbox() {
     return box;
 }
 
+static Renderer::MeshOpt mesh_opt(const Scene_Object& obj, const Mat4& modelview, bool solid) {
+    Renderer::MeshOpt opts;
+    opts.id = obj.id();
+    opts.solid_color = solid || obj.material.opt.type == Material_Type::diffuse_light;
+    opts.color = obj.material.layout_color();
+    opts.sel_color = obj.material.layout_color();
+    opts.modelview = modelview;
+    if(!solid) opts.material = &obj.material.opt;
+    return opts;
+}
+
 void Scene_Object::render(const Mat4& view, bool solid, bool depth_only, bool posed, bool do_anim) {
 
     if(!opt.render) return;
 
-    if(do_anim)
+    bool gpu_skin = do_anim && opt.shape_type == PT::Shape_Type::none && armature.has_bones() &&
+                    opt.smooth_normals && Renderer::get().gpu_skinning && sync_skin_mesh();
+    if(do_anim && !gpu_skin)
         sync_anim_mesh();
     else
         sync_mesh();
 
-    Renderer::MeshOpt opts;
-    opts.id = _id;
-    opts.solid_color = solid || material.opt.type == Material_Type::diffuse_light;
+    Renderer::MeshOpt opts = mesh_opt(*this, posed ? view * pose.transform() : view, solid);
+    const Mat4& view_normal = Renderer::get().view_normal(view);
+    opts.normal = posed ? view_normal * pose.normal() : view_normal;
     opts.depth_only = depth_only;
-    opts.color = material.layout_color();
-    opts.sel_color = material.layout_color();
-    opts.modelview = posed ? view * pose.transform() : view;
 
     switch(opt.shape_type) {
     case PT::Shape_Type::sphere: {
         opts.wireframe = false;
+        // A uniform scale only lengthens normals, which the shaders normalize
         opts.modelview = opts.modelview * Mat4::scale(Vec3{opt.shape.get<PT::Sphere>().radius});
         Renderer::get().sphere(opts);
     } break;
     case PT::Shape_Type::none: {
         opts.wireframe = opt.wireframe;
 
-        if(do_anim && armature.has_bones()) {
+        if(gpu_skin && armature.skin_mode == Skeleton::Skin_Mode::dual_quaternion) {
+            armature.skin_palette(vertex_joints, skin_dual_palette);
+            Renderer::get().skinned_mesh(*_skin_mesh, skin_dual_palette, opts);
+        } else if(gpu_skin) {
+            armature.skin_palette(vertex_joints, skin_palette);
+            Renderer::get().skinned_mesh(*_skin_mesh, skin_palette, opts);
+        } else if(do_anim && armature.has_bones()) {
             Renderer::get().mesh(_anim_mesh, opts);
         } else {
-            Renderer::get().mesh(_mesh, opts);
+            Renderer::get().mesh(opt.wireframe ? _mesh : lod_mesh(opts.modelview), opts);
         }
     } break;
 
@@ -213,8 +583,26 @@ void Scene_Object::render(const Mat4& view, bool solid, bool depth_only, bool po
     }
 }
 
+bool Scene_Object::batch(const Mat4& view) {
+
+    if(!opt.render) return true;
+    if(armature.has_bones() || opt.wireframe) return false;
+    sync_mesh();
+
+    Renderer::MeshOpt opts = mesh_opt(*this, view * pose.transform(), false);
+    opts.normal = Renderer::get().view_normal(view) * pose.normal();
+    switch(opt.shape_type) {
+    case PT::Shape_Type::sphere: {
+        opts.modelview = opts.modelview * Mat4::scale(Vec3{opt.shape.get<PT::Sphere>().radius});
+        return Renderer::get().batch_sphere(opts);
+    }
+    case PT::Shape_Type::none: return Renderer::get().batch(lod_mesh(opts.modelview), opts);
+    default: return false;
+    }
+}
+
 bool operator!=(const Scene_Object::Options& l, const Scene_Object::Options& r) {
     return std::string(l.name) != std::string(r.name) || l.shape_type != r.shape_type ||
            l.smooth_normals != r.smooth_normals || l.wireframe != r.wireframe ||
-           l.shape != r.shape || l.render != r.render;
+           l.shape != r.shape || l.render != r.render || l.portal != r.portal;
 }
@@ -1,8 +1,13 @@
 
 #pragma once
 
+#include <future>
+#include <list>
+
 #include "../geometry/halfedge.h"
+#include "../geometry/util.h"
 #include "../platform/gl.h"
+#include "../rays/bvh.h"
 #include "../rays/shapes.h"
 
 #include "material.h"
@@ -19,9 +24,29 @@ class Object;
 
 class Scene_Object {
 public:
+    // Polygons as loaded (see Halfedge_Mesh::from_flat), which an object may keep
+    // instead of a halfedge mesh until it is edited
+    struct Polygons {
+        std::vector<Vec3> verts;
+        std::vector<Halfedge_Mesh::Index> face_start, corners;
+        bool flip = false;
+
+        // Same as Halfedge_Mesh::to_mesh would make, but without element ids
+        void to_mesh(GL::Mesh& mesh, bool split_faces) const;
+        void to_mesh(std::vector<GL::Mesh::Vert>& out_verts, std::vector<GL::Mesh::Index>& idxs,
+                     bool split_faces) const;
+    };
+
     Scene_Object() = default;
     Scene_Object(Scene_ID id, Pose pose, GL::Mesh&& mesh, std::string n = {});
     Scene_Object(Scene_ID id, Pose pose, Halfedge_Mesh&& mesh, std::string n = {});
+    // Given the GL mesh already made from the halfedge mesh, e.g. on another thread
+    Scene_Object(Scene_ID id, Pose pose, Halfedge_Mesh&& mesh, GL::Mesh&& built,
+                 std::string n = {});
+    // The polygons may be shared with other objects (e.g. instances of one imported
+    // mesh) until each is edited
+    Scene_Object(Scene_ID id, Pose pose, std::shared_ptr<const Polygons> polygons,
+                 GL::Mesh&& built, std::string n = {});
     Scene_Object(const Scene_Object& src) = delete;
     Scene_Object(Scene_Object&& src) = default;
     ~Scene_Object() = default;
@@ -32,18 +57,30 @@ public:
     Scene_ID id() const;
     void sync_mesh();
     void sync_anim_mesh();
-    void set_time(float time);
+    void set_time(float time, bool force = false);
+    void bake_frames(size_t n);
 
     const GL::Mesh& mesh();
     const GL::Mesh& posed_mesh();
 
     void render(const Mat4& view, bool solid = false, bool depth_only = false, bool posed = true,
                 bool anim = true);
+    // Queues this object in the renderer's batch (see Renderer::batch), if it's drawn
+    // as is: unanimated and not in wireframe. Returns false if it must be rendered.
+    bool batch(const Mat4& view);
 
+    // Builds the halfedge mesh first if the object still only has its polygons
     Halfedge_Mesh& get_mesh();
     const Halfedge_Mesh& get_mesh() const;
+    // Builds the halfedge mesh from the polygons, if not done yet. If they do not
+    // make a valid one, returns why, and the object stops being editable.
+    std::string sync_halfedge();
+    // Non-null until the halfedge mesh is built
+    const Polygons* polygons() const;
     void copy_mesh(Halfedge_Mesh& out);
     void take_mesh(Halfedge_Mesh&& in);
+    // Exchanges meshes without copying either
+    void swap_mesh(Halfedge_Mesh& other);
     void set_mesh(Halfedge_Mesh& in);
     Halfedge_Mesh::ElementRef set_mesh(Halfedge_Mesh& in, unsigned int eid);
 
@@ -57,6 +94,13 @@ public:
     void set_skel_dirty();
     void set_pose_dirty();
 
+    // Memory held for the halfedge mesh (or polygons), the CPU copies of its GL meshes
+    // (posed and simplified ones too), and skinning (joint weights and cached poses).
+    // Buffers shared with other objects or meshes count once, when first added to seen.
+    size_t halfedge_bytes(std::unordered_set<const void*>& seen) const;
+    size_t mesh_bytes(std::unordered_set<const void*>& seen) const;
+    size_t skin_bytes(std::unordered_set<const void*>& seen) const;
+
     void step(const PT::Object& scene, float dt) {
     }
 
@@ -65,10 +109,22 @@ public:
         bool wireframe = false;
         bool smooth_normals = false;
         bool render = true;
+        // Not rendered, but environment light is sampled through it (see PT::Portals)
+        bool portal = false;
         PT::Shape_Type shape_type = PT::Shape_Type::none;
         PT::Shape shape;
+        // Build this object's BVH with its own profile instead of the render's
+        bool custom_bvh = false;
+        PT::BVH_Profile bvh_profile = PT::BVH_Profile::balanced;
     };
 
+    // Bytes of skinned vertices each object keeps for poses it may return to (e.g.
+    // scrubbing back and forth, or rendering a loop); 0 turns this off
+    static inline size_t skin_cache_budget = size_t(256) << 20;
+    // Meshes with more triangles than this get coarser levels of detail, built in the
+    // background, which are drawn instead while the object is small on screen
+    static inline size_t lod_min_tris = 50000;
+
     Options opt;
     Pose pose;
     Anim_Pose anim;
@@ -78,11 +134,53 @@ public:
     mutable bool rig_dirty = false;
 
 private:
+    // Skinned vertices by what they were skinned with (the joint palette and normal
+    // mode), least recently used evicted first. All entries share _mesh's topology.
+    class Skin_Cache {
+    public:
+        // On a hit, out is set to the cached vertices over topology's triangles
+        bool find(const std::vector<float>& key, GL::Mesh& out, const GL::Mesh& topology);
+        void insert(std::vector<float>&& key, const GL::Mesh& skinned);
+        void clear();
+        size_t held(std::unordered_set<const void*>& seen) const;
+
+    private:
+        struct Entry {
+            std::vector<float> key;
+            uint64_t hash = 0;
+            std::shared_ptr<const std::vector<GL::Mesh::Vert>> verts;
+            uint64_t revision = 0;
+        };
+        static uint64_t hash(const std::vector<float>& key);
+        // Most recently used first
+        std::list<Entry> entries;
+        size_t bytes = 0;
+    };
+
+    // Readies _skin_mesh for skinning in the vertex shader; false if the rig doesn't
+    // fit its limits (see GL::Mesh::Skin), leaving it to sync_anim_mesh()
+    bool sync_skin_mesh();
+    // _mesh, or the coarsest of its levels of detail that still has about a triangle
+    // for every few pixels the object covers at modelview
+    GL::Mesh& lod_mesh(const Mat4& modelview);
+
     Scene_ID _id = 0;
     Halfedge_Mesh halfedge;
+    std::shared_ptr<const Polygons> polys;
 
     mutable GL::Mesh _mesh, _anim_mesh;
-    mutable std::vector<std::vector<Joint*>> vertex_joints;
+    mutable Skeleton::Skin_Weights vertex_joints;
+    // _mesh with each vertex's joint influences, made on first use
+    std::unique_ptr<GL::Mesh> _skin_mesh;
+    std::vector<Mat4> skin_palette;
+    std::vector<Dual_Quat> skin_dual_palette;
+    Spline_Cursor anim_cursor;
+    Skin_Cache skin_cache;
+    // Finest first, for _mesh at lod_revision
+    std::vector<GL::Mesh> lods;
+    uint64_t lod_revision = 0, lod_build_revision = 0;
+    std::future<std::vector<Util::Gen::Data>> lod_build;
+    bool skin_dirty = true, skin_fits = false;
     mutable bool editable = true;
     mutable bool mesh_dirty = false;
     mutable bool skel_dirty = false, pose_dirty = false;
@@ -1,8 +1,12 @@
 
 #include "../geometry/util.h"
 #include "../rays/pathtracer.h"
+#include "../util/lz4.h"
+#include "../util/parallel.h"
 #include "../util/rand.h"
 
+#include <cstring>
+
 #include "particles.h"
 #include "renderer.h"
 
@@ -43,7 +47,7 @@ BBox Scene_Particles::bbox() const {
 }
 
 void Scene_Particles::take_mesh(GL::Mesh&& mesh) {
-    particle_instances = GL::Instances(std::move(mesh));
+    particle_instances = GL::Point_Instances(std::move(mesh));
 }
 
 const GL::Mesh& Scene_Particles::mesh() const {
@@ -68,6 +72,8 @@ void Scene_Particles::render(const Mat4& view, bool depth_only, bool posed, bool
     }
 
     if(opt.enabled && !depth_only) {
+        if(instances_dirty) gen_instances();
+        instances_dirty = false;
         opts.modelview = view;
         opts.id = _id;
         opts.solid_color = false;
@@ -82,9 +88,16 @@ Scene_ID Scene_Particles::id() const {
 void Scene_Particles::clear() {
     particles.clear();
     particle_instances.clear();
+    instances_dirty = false;
 }
 
-void Scene_Particles::set_time(float time) {
+void Scene_Particles::set_time(float time, bool force) {
+    if(force) anim_cursor.reset();
+    if(anim_cursor.skip(time, spline_version(panim.splines.version(), anim.splines.version()),
+                        [this](float t0, float t1) {
+                            return panim.splines.constant(t0, t1) && anim.splines.constant(t0, t1);
+                        }))
+        return;
     if(panim.splines.any()) {
         panim.at(time, opt);
         if(!opt.enabled) clear();
@@ -94,71 +107,203 @@ void Scene_Particles::set_time(float time) {
     }
 }
 
-const std::vector<Scene_Particles::Particle>& Scene_Particles::get_particles() const {
+void Scene_Particles::bake_frames(size_t n) {
+    panim.splines.bake_frames(n);
+    anim.splines.bake_frames(n);
+}
+
+const Scene_Particles::Particle_Store& Scene_Particles::get_particles() const {
     return particles;
 }
 
-void Scene_Particles::step(const PT::Object& scene, float dt) {
+size_t Scene_Particles::particle_bytes() const {
+    return particles.bytes() + alive.capacity() + sort_codes.capacity() * sizeof(uint64_t) +
+           sort_order.capacity() * sizeof(uint32_t) + impulses.capacity() * sizeof(Vec3);
+}
+
+bool Scene_Particles::step(const Colliders& colliders, float dt, Clock::time_point deadline) {
 
     if(!opt.enabled) {
         clear();
-        return;
+        return true;
     }
-    if(opt.dt < EPS_F) return;
+    if(opt.dt < EPS_F) return true;
 
     last_update += dt;
+    bool timed = deadline != Clock::time_point::max();
+    if(timed) last_update = std::min(last_update, std::max(max_backlog, opt.dt));
 
     while(last_update > opt.dt) {
-        step2(scene, opt.dt);
+        if(timed && Clock::now() >= deadline) return false;
+        step2(colliders, opt.dt);
         last_update -= opt.dt;
+        instances_dirty = true;
     }
-
-    gen_instances();
+    return true;
 }
 
 void Scene_Particles::gen_instances() {
-    particle_instances.clear(particles.size());
-
-    for(Particle& p : particles) {
-        Mat4 T = Mat4{Vec4{opt.scale, 0.0f, 0.0f, 0.0f}, Vec4{0.0f, opt.scale, 0.0f, 0.0f},
-                      Vec4{0.0f, 0.0f, opt.scale, 0.0f}, Vec4{p.pos, 1.0f}};
-        particle_instances.add(T);
-    }
+    particle_instances.set(particles.positions(), opt.scale);
 }
 
-void Scene_Particles::step2(const PT::Object& scene, float dt) {
+void Scene_Particles::step2(const Colliders& colliders, float dt) {
 
-    std::vector<Particle> next;
-    next.reserve(particles.size());
+    // Particles drift apart from the order they were emitted in
+    if(particles.size() >= 4096 && n_steps % 32 == 0) sort_particles();
+    if(opt.collide) collide_particles();
 
-    for(Particle& p : particles) {
-        if(p.update(scene, dt, radius * opt.scale)) {
-            next.emplace_back(p);
-        }
-    }
+    // Particles only read the scene, so are updated independently, then the dead
+    // compacted out
+    float r = radius * opt.scale;
+    alive.resize(particles.size());
+    parallel_for(0, particles.size(), 256, [&](size_t i) {
+        Particle p = particles.get(i);
+        alive[i] = p.update(colliders, dt, r);
+        particles.set(i, p);
+    });
+    particles.compact(alive);
 
     particle_cooldown -= dt;
     float cos = std::cos(Radians(opt.angle) / 2.0f);
 
+    size_t n_emit = 0;
     if(opt.pps > 0.0f) {
         double cooldown = 1.0 / opt.pps;
-        while(particle_cooldown <= 0.0f) {
+        for(; particle_cooldown <= 0.0f; n_emit++) particle_cooldown += cooldown;
+    }
 
-            float z = lerp(cos, 1.0f, RNG::unit());
-            float t = 2 * PI_F * RNG::unit();
-            float r = std::sqrt(1 - z * z);
-            Vec3 dir = opt.velocity * Vec3(r * std::cos(t), z, r * std::sin(t));
+    // Each new particle draws from its own stream, keyed by emitter, step and index,
+    // so the simulation is the same however emitters and particles are scheduled
+    uint64_t key = (uint64_t(_id) << 32) ^ n_steps++;
+    size_t base = particles.size();
+    Mat4 rotation = pose.rotation_mat();
+    particles.resize(base + n_emit);
+    parallel_for(0, n_emit, 1024, [&](size_t i) {
+        RNG::seed(key, i);
+        float z = lerp(cos, 1.0f, RNG::unit());
+        float t = 2 * PI_F * RNG::unit();
+        float r = std::sqrt(1 - z * z);
+        Vec3 dir = opt.velocity * Vec3(r * std::cos(t), z, r * std::sin(t));
+
+        Particle p;
+        p.pos = pose.pos;
+        p.velocity = rotation.rotate(dir);
+        p.age = opt.lifetime;
+        particles.set(base + i, p);
+    });
+}
 
-            Particle p;
-            p.pos = pose.pos;
-            p.velocity = pose.rotation_mat().rotate(dir);
-            p.age = opt.lifetime;
-            next.push_back(p);
+// Header of a snapshot, followed by the byte planes of the particles' floats (all
+// first bytes, then all second bytes...), LZ4-compressed. Nearby particles have
+// similar exponents and high bytes, so the planes compress far better than the
+// floats themselves.
+struct Particle_Snapshot {
+    uint64_t n_particles;
+    uint64_t n_steps;
+    double particle_cooldown;
+    float last_update;
+    uint32_t compressed;
+};
+
+std::vector<unsigned char> Scene_Particles::snapshot() const {
+
+    std::vector<float> fields;
+    particles.save(fields);
+    size_t n = fields.size();
+    std::vector<unsigned char> planes(n * sizeof(float));
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(fields.data());
+    for(size_t i = 0; i < n; i++) {
+        for(size_t b = 0; b < sizeof(float); b++) planes[b * n + i] = bytes[i * sizeof(float) + b];
+    }
+    std::vector<unsigned char> packed = LZ4::compress(planes.data(), planes.size());
+
+    Particle_Snapshot header{particles.size(), n_steps, particle_cooldown, last_update,
+                             static_cast<uint32_t>(packed.size())};
+    std::vector<unsigned char> out(sizeof(header) + packed.size());
+    std::memcpy(out.data(), &header, sizeof(header));
+    std::memcpy(out.data() + sizeof(header), packed.data(), packed.size());
+    return out;
+}
+
+bool Scene_Particles::restore(const std::vector<unsigned char>& data) {
 
-            particle_cooldown += cooldown;
-        }
+    Particle_Snapshot header;
+    if(data.size() < sizeof(header)) return false;
+    std::memcpy(&header, data.data(), sizeof(header));
+    if(data.size() != sizeof(header) + header.compressed) return false;
+
+    size_t n = header.n_particles * 7;
+    std::vector<unsigned char> planes(n * sizeof(float));
+    if(!LZ4::decompress(data.data() + sizeof(header), header.compressed, planes.data(),
+                        planes.size())) {
+        return false;
+    }
+    std::vector<float> fields(n);
+    unsigned char* bytes = reinterpret_cast<unsigned char*>(fields.data());
+    for(size_t i = 0; i < n; i++) {
+        for(size_t b = 0; b < sizeof(float); b++) bytes[i * sizeof(float) + b] = planes[b * n + i];
     }
-    particles = std::move(next);
+
+    particles.load(fields.data(), header.n_particles);
+    n_steps = header.n_steps;
+    particle_cooldown = header.particle_cooldown;
+    last_update = header.last_update;
+    instances_dirty = true;
+    return true;
+}
+
+void Scene_Particles::sort_particles() {
+
+    const std::vector<Vec3>& pos = particles.positions();
+    size_t n = pos.size();
+
+    BBox box;
+    for(Vec3 p : pos) box.enclose(p);
+    Vec3 scale;
+    for(int axis = 0; axis < 3; axis++) {
+        float extent = box.max[axis] - box.min[axis];
+        scale[axis] = extent > 0.0f ? 2097151.0f / extent : 0.0f;
+    }
+
+    sort_codes.resize(n);
+    sort_order.resize(n);
+    parallel_for(0, n, 4096, [&](size_t i) {
+        Vec3 q = (pos[i] - box.min) * scale;
+        sort_codes[i] = PT::bvh_expand_bits(static_cast<uint64_t>(q.x)) << 2 |
+                        PT::bvh_expand_bits(static_cast<uint64_t>(q.y)) << 1 |
+                        PT::bvh_expand_bits(static_cast<uint64_t>(q.z));
+        sort_order[i] = static_cast<uint32_t>(i);
+    });
+    parallel_sort(sort_order.begin(), sort_order.end(),
+                  [this](uint32_t a, uint32_t b) { return sort_codes[a] < sort_codes[b]; });
+    particles.reorder(sort_order);
+}
+
+void Scene_Particles::collide_particles() {
+
+    float diameter = 2.0f * radius * std::abs(opt.scale);
+    if(particles.size() < 2 || diameter <= 0.0f) return;
+
+    const std::vector<Vec3>& pos = particles.positions();
+    const std::vector<Vec3>& vel = particles.velocities();
+    neighbors.build(pos, diameter);
+
+    // Every particle sums its own response from the velocities before any change,
+    // which is symmetric, so momentum is conserved
+    impulses.resize(pos.size());
+    parallel_for(0, pos.size(), 256, [&](size_t i) {
+        Vec3 dv;
+        neighbors.for_neighbors(pos[i], diameter, [&](uint32_t j) {
+            Vec3 n = pos[i] - pos[j];
+            float d = n.norm();
+            if(j == i || d <= 0.0f) return;
+            n /= d;
+            float closing = dot(vel[i] - vel[j], n);
+            if(closing < 0.0f) dv -= closing * n;
+        });
+        impulses[i] = dv;
+    });
+    particles.add_velocities(impulses);
 }
 
 void Scene_Particles::Anim_Particles::at(float t, Scene_Particles::Options& o) const {
@@ -179,5 +324,5 @@ void Scene_Particles::Anim_Particles::set(float t, Scene_Particles::Options o) {
 bool operator!=(const Scene_Particles::Options& l, const Scene_Particles::Options& r) {
     return l.color != r.color || l.velocity != r.velocity || l.angle != r.angle ||
            l.scale != r.scale || l.lifetime != r.lifetime || l.pps != r.pps ||
-           l.enabled != r.enabled || l.dt != r.dt;
+           l.enabled != r.enabled || l.dt != r.dt || l.collide != r.collide;
 }
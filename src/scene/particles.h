@@ -1,8 +1,10 @@
 
 #pragma once
 
+#include <chrono>
 #include <vector>
 
+#include "../geometry/neighbor_grid.h"
 #include "../lib/mathlib.h"
 #include "../platform/gl.h"
 
@@ -16,6 +18,21 @@ class Object;
 
 class Scene_Particles {
 public:
+    // What particles bounce off. Spheres (pulled out of the scene by
+    // Gui::Simulate::build_scene) are swept exactly, as spheres grown by the
+    // particle's radius; everything else is traced through scene.
+    struct Colliders {
+        struct Sphere {
+            Vec3 center;
+            float radius = 0.0f;
+        };
+        Colliders(const PT::Object& scene, std::vector<Sphere> spheres = {})
+            : scene(scene), spheres(std::move(spheres)) {
+        }
+        const PT::Object& scene;
+        std::vector<Sphere> spheres;
+    };
+
     struct Particle {
 
         Vec3 pos;
@@ -24,7 +41,104 @@ public:
 
         static const inline Vec3 acceleration = Vec3{0.0f, -9.8f, 0.0f};
 
-        bool update(const PT::Object& scene, float dt, float radius);
+        bool update(const Colliders& colliders, float dt, float radius);
+    };
+
+    // Particles as an array per field, which are read alone when rendering and
+    // tracing. Cleared or removed space is reused, so steady-state stepping doesn't
+    // allocate.
+    class Particle_Store {
+    public:
+        size_t size() const {
+            return age.size();
+        }
+        Particle get(size_t i) const {
+            return Particle{pos[i], velocity[i], age[i]};
+        }
+        void set(size_t i, const Particle& p) {
+            pos[i] = p.pos;
+            velocity[i] = p.velocity;
+            age[i] = p.age;
+        }
+        void push_back(const Particle& p) {
+            pos.push_back(p.pos);
+            velocity.push_back(p.velocity);
+            age.push_back(p.age);
+        }
+        void resize(size_t n) {
+            pos.resize(n);
+            velocity.resize(n);
+            age.resize(n);
+        }
+        // Removes, in place and keeping order, each particle i with !keep[i]
+        void compact(const std::vector<unsigned char>& keep) {
+            size_t n = 0;
+            for(size_t i = 0; i < keep.size(); i++) {
+                if(!keep[i]) continue;
+                pos[n] = pos[i];
+                velocity[n] = velocity[i];
+                age[n] = age[i];
+                n++;
+            }
+            pos.resize(n);
+            velocity.resize(n);
+            age.resize(n);
+        }
+        void clear() {
+            pos.clear();
+            velocity.clear();
+            age.clear();
+        }
+        // Moves particle order[i] to i, for a permutation order
+        void reorder(const std::vector<uint32_t>& order) {
+            auto permute = [&order](auto& field, auto& scratch) {
+                scratch.resize(order.size());
+                for(size_t i = 0; i < order.size(); i++) scratch[i] = field[order[i]];
+                std::swap(field, scratch);
+            };
+            permute(pos, scratch_vec);
+            permute(velocity, scratch_vec);
+            permute(age, scratch_float);
+        }
+        // Appends every field of every particle to out, or reads size() of them
+        // back from in
+        void save(std::vector<float>& out) const {
+            for(const std::vector<Vec3>* field : {&pos, &velocity}) {
+                for(Vec3 v : *field) out.insert(out.end(), {v.x, v.y, v.z});
+            }
+            out.insert(out.end(), age.begin(), age.end());
+        }
+        void load(const float* in, size_t n) {
+            pos.resize(n);
+            velocity.resize(n);
+            age.resize(n);
+            for(std::vector<Vec3>* field : {&pos, &velocity}) {
+                for(Vec3& v : *field) {
+                    v = Vec3(in[0], in[1], in[2]);
+                    in += 3;
+                }
+            }
+            std::copy(in, in + n, age.begin());
+        }
+        const std::vector<Vec3>& positions() const {
+            return pos;
+        }
+        size_t bytes() const {
+            return (pos.capacity() + velocity.capacity() + scratch_vec.capacity()) * sizeof(Vec3) +
+                   (age.capacity() + scratch_float.capacity()) * sizeof(float);
+        }
+        const std::vector<Vec3>& velocities() const {
+            return velocity;
+        }
+        void add_velocities(const std::vector<Vec3>& dv) {
+            for(size_t i = 0; i < dv.size(); i++) velocity[i] += dv[i];
+        }
+
+    private:
+        std::vector<Vec3> pos, velocity;
+        std::vector<float> age;
+        std::vector<Vec3> scratch_vec;
+        std::vector<float> scratch_float;
     };
 
     Scene_Particles(Scene_ID id);
@@ -37,18 +151,42 @@ public:
     void operator=(const Scene_Particles& src) = delete;
     Scene_Particles& operator=(Scene_Particles&& src) = default;
 
+    using Clock = std::chrono::steady_clock;
+
     void clear();
-    void step(const PT::Object& scene, float dt);
-    void step2(const PT::Object& scene, float dt);
+    // Simulates dt more seconds, in substeps of opt.dt. With a deadline, stops between
+    // substeps once it has passed and carries the rest over to later calls, up to
+    // max_backlog seconds: past that, the simulation slows down rather than falling
+    // ever further behind. Returns whether it caught up.
+    bool step(const Colliders& colliders, float dt,
+              Clock::time_point deadline = Clock::time_point::max());
+    static inline float max_backlog = 0.25f;
+    // Past this many bounces in one substep, a particle (e.g. wedged in a corner)
+    // rests for the remainder of it
+    static inline int max_bounces = 8;
+    void step2(const Colliders& colliders, float dt);
     void gen_instances();
+    // Sorts the particles along a Morton curve, so that each chunk of step2() traces
+    // segments through nearby parts of the scene
+    void sort_particles();
+    // Bounces apart particles that overlap (as spheres of equal mass) and are closing
+    void collide_particles();
 
-    const std::vector<Particle>& get_particles() const;
+    const Particle_Store& get_particles() const;
+    // Memory held for the particles and stepping them, excluding the mesh
+    size_t particle_bytes() const;
 
     BBox bbox() const;
     void render(const Mat4& view, bool depth_only = false, bool posed = true,
                 bool particles_only = false);
+
+    // The simulation state (particles and emission timing), compressed, for
+    // restoring later. Restoring fails if the data is damaged.
+    std::vector<unsigned char> snapshot() const;
+    bool restore(const std::vector<unsigned char>& data);
     Scene_ID id() const;
-    void set_time(float time);
+    void set_time(float time, bool force = false);
+    void bake_frames(size_t n);
 
     const GL::Mesh& mesh() const;
     void take_mesh(GL::Mesh&& mesh);
@@ -63,6 +201,8 @@ public:
         float pps = 5.0f;
         float dt = 0.01f;
         bool enabled = false;
+        // Particles bounce off each other as well as the scene
+        bool collide = false;
     };
 
     struct Anim_Particles {
@@ -79,12 +219,23 @@ public:
 private:
     void get_r();
     Scene_ID _id;
-    std::vector<Particle> particles;
-    GL::Instances particle_instances;
+    Particle_Store particles;
+    // Per particle, whether it survived the last step2()
+    std::vector<unsigned char> alive;
+    std::vector<uint64_t> sort_codes;
+    std::vector<uint32_t> sort_order;
+    Neighbor_Grid neighbors;
+    std::vector<Vec3> impulses;
+    uint64_t n_steps = 0;
+    GL::Point_Instances particle_instances;
     GL::Mesh arrow;
 
+    Spline_Cursor anim_cursor;
+
     float radius = 0.0f;
     float last_update = 0.0f;
+    // Instances are regenerated at most once per render, however many steps ran
+    bool instances_dirty = false;
     double particle_cooldown = 0.0f;
 };
 
@@ -1,8 +1,28 @@
 
 #include "pose.h"
 
+const Pose::Cache& Pose::update() const {
+    if(!cache.valid || cache.pos != pos || cache.euler != euler || cache.scale != scale) {
+        cache.pos = pos;
+        cache.euler = euler;
+        cache.scale = scale;
+        cache.T = Mat4::translate(pos) * rotation_mat() * Mat4::scale(scale);
+        cache.iT = Mat4::inverse(cache.T);
+        cache.valid = true;
+    }
+    return cache;
+}
+
 Mat4 Pose::transform() const {
-    return Mat4::translate(pos) * rotation_mat() * Mat4::scale(scale);
+    return update().T;
+}
+
+Mat4 Pose::inverse() const {
+    return update().iT;
+}
+
+Mat4 Pose::normal() const {
+    return Mat4::transpose(update().iT);
 }
 
 Mat4 Pose::rotation_mat() const {
@@ -56,6 +76,15 @@ Pose Anim_Pose::at(float t) const {
     return Pose{p, r.to_euler(), s};
 }
 
+void Anim_Pose::at(const float* times, size_t n, Pose* out) const {
+    std::vector<std::tuple<Vec3, Quat, Vec3>> values(n);
+    splines.at(times, n, values.data());
+    for(size_t i = 0; i < n; i++) {
+        auto& [p, r, s] = values[i];
+        out[i] = Pose{p, r.to_euler(), s};
+    }
+}
+
 void Anim_Pose::set(float t, Pose p) {
     splines.set(t, p.pos, Quat::euler(p.euler), p.scale);
 }
@@ -11,6 +11,9 @@ struct Pose {
     Vec3 scale = Vec3{1.0f};
 
     Mat4 transform() const;
+    // The inverse of transform(), and its inverse transpose, which transforms normals
+    Mat4 inverse() const;
+    Mat4 normal() const;
     Mat4 rotation_mat() const;
     Quat rotation_quat() const;
 
@@ -21,6 +24,20 @@ struct Pose {
     static Pose moved(Vec3 t);
     static Pose scaled(Vec3 s);
     static Pose id();
+
+    // The matrices above as of the pos, euler and scale they were made from. Those are
+    // edited in place (by the UI, animation and so on), so rather than each edit
+    // marking the cache dirty, it is remade on use if they no longer match. Like the
+    // rest of a scene item, a Pose is read from one thread at a time.
+    struct Cache {
+        Vec3 pos, euler, scale;
+        Mat4 T, iT;
+        bool valid = false;
+    };
+    mutable Cache cache{};
+
+private:
+    const Cache& update() const;
 };
 
 bool operator==(const Pose& l, const Pose& r);
@@ -28,6 +45,7 @@ bool operator!=(const Pose& l, const Pose& r);
 
 struct Anim_Pose {
     Pose at(float t) const;
+    void at(const float* times, size_t n, Pose* out) const;
     void set(float t, Pose p);
     Splines<Vec3, Quat, Vec3> splines;
 };
@@ -1,30 +1,77 @@
 
 #include <imgui/imgui.h>
+#include <limits>
 
 #include "../geometry/util.h"
 #include "../gui/manager.h"
 #include "../lib/mathlib.h"
+#include "../util/profiler.h"
 
 #include "renderer.h"
 #include "scene.h"
 
 static const int DEFAULT_SAMPLES = 4;
 
+static unsigned int decode_id(const GLubyte* rgba) {
+    return (int)rgba[0] | (int)rgba[1] << 8 | (int)rgba[2] << 16;
+}
+
+// Projects the radiance arriving from each direction (given with its uv in the
+// environment map layout) onto the first 9 spherical harmonics, convolved with the
+// cosine lobe and scaled by 1/pi: evaluated at a normal, they give the radiance a
+// white Lambertian surface facing it reflects (Ramamoorthi and Hanrahan, 2001)
+template<typename F> static void irradiance_sh(F&& radiance, Vec3 sh[9]) {
+
+    constexpr int w = 64, h = 32;
+    for(int k = 0; k < 9; k++) sh[k] = Vec3{};
+
+    for(int y = 0; y < h; y++) {
+        float v = (y + 0.5f) / h, theta = PI_F * (1.0f - v);
+        float solid_angle = (2.0f * PI_F / w) * (PI_F / h) * std::sin(theta);
+        for(int x = 0; x < w; x++) {
+            float u = (x + 0.5f) / w, phi = 2.0f * PI_F * u;
+            float s = std::sin(theta);
+            Vec3 d(s * std::cos(phi), std::cos(theta), s * std::sin(phi));
+            Vec3 L = radiance(Vec2(u, v), d) * solid_angle;
+            float basis[9] = {0.282095f,
+                              0.488603f * d.y,
+                              0.488603f * d.z,
+                              0.488603f * d.x,
+                              1.092548f * d.x * d.y,
+                              1.092548f * d.y * d.z,
+                              0.315392f * (3.0f * d.z * d.z - 1.0f),
+                              1.092548f * d.x * d.z,
+                              0.546274f * (d.x * d.x - d.y * d.y)};
+            for(int k = 0; k < 9; k++) sh[k] += L * basis[k];
+        }
+    }
+
+    // The cosine lobe's coefficients per band, over pi
+    for(int k = 0; k < 9; k++) sh[k] *= k == 0 ? 1.0f : k < 4 ? 2.0f / 3.0f : 0.25f;
+}
+
 Renderer::Renderer(Vec2 dim)
     : framebuffer(2, dim, DEFAULT_SAMPLES, true), id_resolve(1, dim, 1, false),
       save_buffer(1, dim, DEFAULT_SAMPLES, true), save_output(1, dim, 1, false),
       mesh_shader(GL::Shaders::mesh_v, GL::Shaders::mesh_f),
       line_shader(GL::Shaders::line_v, GL::Shaders::line_f),
       inst_shader(GL::Shaders::inst_v, GL::Shaders::mesh_f),
-      dome_shader(GL::Shaders::dome_v, GL::Shaders::dome_f), _sphere(Util::sphere_mesh(1.0f, 3)),
+      point_inst_shader(GL::Shaders::point_inst_v, GL::Shaders::mesh_f),
+      dome_shader(GL::Shaders::dome_v, GL::Shaders::dome_f),
+      skin_shader(GL::Shaders::skin_v, GL::Shaders::mesh_f),
+      skin_dq_shader(GL::Shaders::skin_dq_v, GL::Shaders::mesh_f),
+      preview_shader(GL::Shaders::preview_v, GL::Shaders::preview_f),
+      _sphere(Util::sphere_mesh(1.0f, 3)),
       _cyl(Util::cyl_mesh(1.0f, 1.0f, 64, false)), _hemi(Util::hemi_mesh(1.0f)),
-      samples(DEFAULT_SAMPLES), window_dim(dim),
-      id_buffer(new GLubyte[(int)dim.x * (int)dim.y * 4]) {
+      bone_cyls(Util::cyl_mesh(1.0f, 1.0f, 64, false)), bone_hemis(Util::hemi_mesh(1.0f)),
+      joint_spheres(Util::sphere_mesh(1.0f, 3)), handle_spheres(Util::sphere_mesh(1.0f, 3)),
+      samples(DEFAULT_SAMPLES), window_dim(dim) {
+    skin_shader.uniform_block("Joints", 0);
+    skin_dq_shader.uniform_block("Joints", 0);
+    if(GL::Mesh_Batch::supported()) batch_shader.load(GL::Shaders::batch_v, GL::Shaders::batch_f);
 }
 
 Renderer::~Renderer() {
-    delete[] id_buffer;
-    id_buffer = nullptr;
 }
 
 Renderer& Renderer::get() {
@@ -39,8 +86,7 @@ void Renderer::setup(Vec2 dim) {
 void Renderer::update_dim(Vec2 dim) {
 
     window_dim = dim;
-    delete[] id_buffer;
-    id_buffer = new GLubyte[(int)dim.x * (int)dim.y * 4]();
+    ids_resolved = false;
     framebuffer.resize(dim, samples);
     save_buffer.resize(dim, save_buffer.samples());
     id_resolve.resize(dim);
@@ -58,23 +104,64 @@ void Renderer::proj(const Mat4& proj) {
 
 void Renderer::complete() {
 
-    framebuffer.blit_to(1, id_resolve, false);
+    PROFILE_ZONE("Complete Frame");
+    gpu_pass("Complete");
 
-    if(!id_resolve.can_read_at()) id_resolve.read(0, id_buffer);
+    // Ids are only resolved out of the multisampled framebuffer once something reads
+    // them: here to follow the hovered position, or by read_id before the next frame
+    ids_resolved = false;
+    if(hovering) {
+        resolve_ids();
+        if(id_readback.poll()) {
+            if(const GLubyte* read = id_readback.at(hover_x, hover_y)) hovered = decode_id(read);
+        }
+        int w = std::min(hover_side, (int)window_dim.x);
+        int h = std::min(hover_side, (int)window_dim.y);
+        int x = std::clamp(hover_x - w / 2, 0, (int)window_dim.x - w);
+        int y = std::clamp(hover_y - h / 2, 0, (int)window_dim.y - h);
+        id_readback.request(id_resolve, 0, x, y, w, h);
+    }
 
     framebuffer.blit_to_screen(0, window_dim);
+    gpu_timer.end_frame();
+
+    auto now = std::chrono::steady_clock::now();
+    stats.cpu_ms = std::chrono::duration<float, std::milli>(now - frame_begin).count();
+    stats.draws = GL::draw_stats.draws;
+    stats.triangles = GL::draw_stats.triangles;
+    stats.gpu = gpu_timer.results();
 }
 
 void Renderer::begin() {
 
+    auto now = std::chrono::steady_clock::now();
+    if(frame_begin.time_since_epoch().count()) {
+        stats.frame_ms = std::chrono::duration<float, std::milli>(now - frame_begin).count();
+    }
+    frame_begin = now;
+    GL::draw_stats = {};
+    outlining = false;
+
+    gpu_timer.begin_frame();
+    gpu_pass("Begin");
     framebuffer.clear(0, Vec4(Gui::Color::background, 1.0f));
     framebuffer.clear(1, Vec4{0.0f, 0.0f, 0.0f, 1.0f});
     framebuffer.clear_d();
     framebuffer.bind();
     GL::viewport(window_dim);
+    gpu_pass("Other");
 }
 
-void Renderer::save(Scene& scene, const Camera& cam, int w, int h, int s) {
+const Renderer::Frame_Stats& Renderer::frame_stats() const {
+    return stats;
+}
+
+void Renderer::gpu_pass(const char* name) {
+    if(!outlining) gpu_timer.pass(name);
+}
+
+void Renderer::save(Scene& scene, const Camera& cam, int w, int h, int s, bool preview,
+                    float exposure) {
 
     Vec2 dim((float)w, (float)h);
 
@@ -87,12 +174,15 @@ void Renderer::save(Scene& scene, const Camera& cam, int w, int h, int s) {
     Mat4 old_proj = _proj;
     _proj = cam.get_proj();
     Mat4 view = cam.get_view();
+    if(preview) begin_preview(scene, view, exposure);
 
     scene.for_items([&](Scene_Item& item) {
         if(item.is<Scene_Light>()) {
             Scene_Light& light = item.get<Scene_Light>();
             if(!light.is_env()) return;
         }
+        // Portals only guide the path tracer
+        if(item.is<Scene_Object>() && item.get<Scene_Object>().opt.portal) return;
 
         if(item.is<Scene_Particles>()) {
             item.get<Scene_Particles>().render(view, false, true, true);
@@ -101,6 +191,7 @@ void Renderer::save(Scene& scene, const Camera& cam, int w, int h, int s) {
         }
     });
 
+    if(preview) end_preview();
     save_buffer.blit_to(0, save_output, true);
 
     framebuffer.bind();
@@ -115,6 +206,15 @@ void Renderer::saved(std::vector<unsigned char>& out) const {
     save_output.read(0, out.data());
 }
 
+void Renderer::save_depth(Scene& scene, const Camera& cam, int w, int h,
+                          std::vector<float>& depth) {
+    save(scene, cam, w, h, 1);
+    save_buffer.read_depth(depth);
+    // Normalized device z is near over distance (see Mat4::project)
+    float near = cam.get_proj()[3][2];
+    for(float& d : depth) d = d > 0.0f ? near / d : std::numeric_limits<float>::infinity();
+}
+
 GLuint Renderer::saved() const {
     save_output.flush();
     return save_output.get_output(0);
@@ -122,6 +222,7 @@ GLuint Renderer::saved() const {
 
 void Renderer::lines(const GL::Lines& lines, const Mat4& view, const Mat4& model, float alpha) {
 
+    gpu_pass("Other");
     Mat4 mvp = _proj * view * model;
     line_shader.bind();
     line_shader.uniform("mvp", mvp);
@@ -131,6 +232,7 @@ void Renderer::lines(const GL::Lines& lines, const Mat4& view, const Mat4& model
 
 void Renderer::skydome(const Mat4& rotation, Vec3 color, float cosine, const GL::Tex2D& tex) {
 
+    gpu_pass("Other");
     tex.bind();
     dome_shader.bind();
     dome_shader.uniform("tex", 0);
@@ -143,6 +245,7 @@ void Renderer::skydome(const Mat4& rotation, Vec3 color, float cosine, const GL:
 
 void Renderer::skydome(const Mat4& rotation, Vec3 color, float cosine) {
 
+    gpu_pass("Other");
     dome_shader.bind();
     dome_shader.uniform("use_texture", false);
     dome_shader.uniform("color", color);
@@ -155,13 +258,55 @@ void Renderer::sphere(MeshOpt opt) {
     mesh(_sphere, opt);
 }
 
+static Mat4 normal_of(const Renderer::MeshOpt& opt) {
+    return opt.normal ? *opt.normal : Mat4::transpose(Mat4::inverse(opt.modelview));
+}
+
+bool Renderer::batch(const GL::Mesh& mesh, const MeshOpt& opt) {
+
+    if(!GL::Mesh_Batch::supported() || opt.wireframe || opt.depth_only || opt.per_vert_id ||
+       opt.alpha != 1.0f || opt.sel_id == opt.id || opt.hov_id == opt.id || opt.n_sel_ids ||
+       (previewing && opt.material)) {
+        return false;
+    }
+
+    GL::Mesh_Batch::Draw draw = {};
+    draw.modelview = opt.modelview;
+    draw.normal = normal_of(opt);
+    draw.color = Vec4{opt.color, opt.solid_color ? 1.0f : 0.0f};
+    draw.id = opt.id;
+    mesh_batch.add(mesh, draw);
+    return true;
+}
+
+bool Renderer::batch_sphere(const MeshOpt& opt) {
+    return batch(_sphere, opt);
+}
+
+void Renderer::end_batch() {
+    if(!GL::Mesh_Batch::supported()) return;
+    PROFILE_ZONE("Mesh Batch");
+    gpu_pass("Meshes");
+    batch_shader.bind();
+    batch_shader.uniform("proj", _proj);
+    mesh_batch.render();
+}
+
+// Transforms of a capsule's cylinder and its bottom and top hemispheres
+static void capsule_parts(const Mat4& mdl, float height, float rad, Mat4& cyl, Mat4& bot,
+                          Mat4& top) {
+    cyl = mdl * Mat4::scale(Vec3{rad, height, rad});
+    bot = mdl * Mat4::scale(Vec3{rad});
+    top = mdl * Mat4::translate(Vec3{0.0f, height, 0.0f}) * Mat4::euler(Vec3{180.0f, 0.0f, 0.0f}) *
+          Mat4::scale(Vec3{rad});
+}
+
 void Renderer::capsule(MeshOpt opt, const Mat4& mdl, float height, float rad, BBox& box) {
 
     Mat4 T = opt.modelview;
-    Mat4 cyl = mdl * Mat4::scale(Vec3{rad, height, rad});
-    Mat4 bot = mdl * Mat4::scale(Vec3{rad});
-    Mat4 top = mdl * Mat4::translate(Vec3{0.0f, height, 0.0f}) *
-               Mat4::euler(Vec3{180.0f, 0.0f, 0.0f}) * Mat4::scale(Vec3{rad});
+    opt.normal.reset();
+    Mat4 cyl, bot, top;
+    capsule_parts(mdl, height, rad, cyl, bot, top);
 
     opt.modelview = T * cyl;
     mesh(_cyl, opt);
@@ -186,64 +331,298 @@ void Renderer::capsule(MeshOpt opt, float height, float rad) {
     capsule(opt, Mat4::I, height, rad, box);
 }
 
+void Renderer::bones(const MeshOpt& opt, const std::vector<Bone>& bones) {
+
+    cyl_infos.clear();
+    hemi_infos.clear();
+    for(const Bone& bone : bones) {
+        Mat4 cyl, bot, top;
+        capsule_parts(bone.model, bone.height, bone.radius, cyl, bot, top);
+        cyl_infos.push_back({bone.id, cyl});
+        hemi_infos.push_back({bone.id, bot});
+        hemi_infos.push_back({bone.id, top});
+    }
+    bone_cyls.set(cyl_infos);
+    bone_hemis.set(hemi_infos);
+    if(bones.empty()) return;
+    instances(opt, bone_cyls);
+    instances(opt, bone_hemis);
+}
+
+void Renderer::joints(const MeshOpt& opt, const std::vector<GL::Instances::Info>& spheres) {
+    joint_spheres.set(spheres);
+    if(!spheres.empty()) instances(opt, joint_spheres);
+}
+
+void Renderer::handles(const MeshOpt& opt, const std::vector<GL::Instances::Info>& spheres) {
+    handle_spheres.set(spheres);
+    if(!spheres.empty()) instances(opt, handle_spheres);
+}
+
 void Renderer::mesh(GL::Mesh& mesh, Renderer::MeshOpt opt) {
+    this->mesh(mesh_shader, mesh, opt);
+}
+
+void Renderer::skinned_mesh(GL::Mesh& mesh, const std::vector<Mat4>& palette,
+                            Renderer::MeshOpt opt) {
+    assert(palette.size() <= GL::Shaders::max_joints);
+    joint_palette.set(palette.data(), sizeof(Mat4) * palette.size());
+    joint_palette.bind(0);
+    this->mesh(skin_shader, mesh, opt);
+}
+
+void Renderer::skinned_mesh(GL::Mesh& mesh, const std::vector<Dual_Quat>& palette,
+                            Renderer::MeshOpt opt) {
+    static_assert(sizeof(Dual_Quat) == 8 * sizeof(float));
+    assert(palette.size() <= GL::Shaders::max_joints);
+    joint_palette.set(palette.data(), sizeof(Dual_Quat) * palette.size());
+    joint_palette.bind(0);
+    this->mesh(skin_dq_shader, mesh, opt);
+}
+
+void Renderer::mesh(const GL::Shader& shader, GL::Mesh& mesh, const Renderer::MeshOpt& opt) {
+
+    gpu_pass("Meshes");
+    if(previewing && opt.material && &shader == &mesh_shader && !opt.depth_only &&
+       !opt.wireframe) {
+        preview(mesh, opt);
+        return;
+    }
 
-    mesh_shader.bind();
-    mesh_shader.uniform("use_v_id", opt.per_vert_id);
-    mesh_shader.uniform("id", opt.id);
-    mesh_shader.uniform("alpha", opt.alpha);
-    mesh_shader.uniform("mvp", _proj * opt.modelview);
-    mesh_shader.uniform("normal", Mat4::transpose(Mat4::inverse(opt.modelview)));
-    mesh_shader.uniform("solid", opt.solid_color);
-    mesh_shader.uniform("sel_color", opt.sel_color);
-    mesh_shader.uniform("sel_id", opt.sel_id);
-    mesh_shader.uniform("hov_color", opt.hov_color);
-    mesh_shader.uniform("hov_id", opt.hov_id);
-    mesh_shader.uniform("err_color", Vec3{1.0f});
-    mesh_shader.uniform("err_id", 0u);
+    shader.bind();
+    shader.uniform("use_v_id", opt.per_vert_id);
+    shader.uniform("id", opt.id);
+    shader.uniform("alpha", opt.alpha);
+    shader.uniform("mvp", _proj * opt.modelview);
+    shader.uniform("normal", normal_of(opt));
+    shader.uniform("solid", opt.solid_color);
+    shader.uniform("sel_color", opt.sel_color);
+    shader.uniform("sel_id", opt.sel_id);
+    shader.uniform("n_sel_ids", opt.n_sel_ids);
+    if(opt.n_sel_ids) shader.uniform("sel_ids", opt.n_sel_ids, opt.sel_ids);
+    shader.uniform("hov_color", opt.hov_color);
+    shader.uniform("hov_id", opt.hov_id);
+    shader.uniform("err_color", Vec3{1.0f});
+    shader.uniform("err_id", 0u);
 
     if(opt.depth_only) GL::color_mask(false);
 
     if(opt.wireframe) {
-        mesh_shader.uniform("color", Vec3());
+        shader.uniform("color", Vec3());
         GL::enable(GL::Opt::wireframe);
         mesh.render();
         GL::disable(GL::Opt::wireframe);
     }
 
-    mesh_shader.uniform("color", opt.color);
+    shader.uniform("color", opt.color);
     mesh.render();
 
     if(opt.depth_only) GL::color_mask(true);
 }
 
+void Renderer::preview(GL::Mesh& mesh, const Renderer::MeshOpt& opt) {
+
+    const Material::Options& mat = *opt.material;
+
+    preview_shader.bind();
+    if(preview_env.type == Light_Type::sphere && !preview_env.map.empty()) preview_env.tex.bind(1);
+    preview_shader.uniform("mvp", _proj * opt.modelview);
+    preview_shader.uniform("modelview", opt.modelview);
+    preview_shader.uniform("normal", normal_of(opt));
+    preview_shader.uniform("id", opt.id);
+    preview_shader.uniform("sel_id", opt.sel_id);
+    preview_shader.uniform("sel_color", opt.sel_color);
+    preview_shader.uniform("hov_id", opt.hov_id);
+    preview_shader.uniform("hov_color", opt.hov_color);
+    preview_shader.uniform("type", (GLint)mat.type);
+    preview_shader.uniform("albedo", mat.albedo.to_vec());
+    preview_shader.uniform("reflectance", mat.reflectance.to_vec());
+    preview_shader.uniform("transmittance", mat.transmittance.to_vec());
+    preview_shader.uniform("emissive", (mat.emissive * mat.intensity).to_vec());
+    preview_shader.uniform("ior", mat.ior);
+    mesh.render();
+}
+
+void Renderer::preview_environment(const Scene_Light* light) {
+
+    Light_Type type = light ? light->opt.type : Light_Type::count;
+    Spectrum radiance = light ? light->radiance() : Spectrum{};
+    bool has_map = type == Light_Type::sphere && light->opt.has_emissive_map;
+    std::string map = has_map ? light->emissive_loaded() : std::string{};
+    Scene_ID id = light ? light->id() : 0;
+
+    Preview_Env& env = preview_env;
+    if(env.valid && env.light == id && env.type == type && env.radiance == radiance &&
+       env.map == map) {
+        return;
+    }
+    env.valid = true;
+    env.light = id;
+    env.type = type;
+    env.radiance = radiance;
+    env.map = map;
+
+    if(!has_map) {
+        float above = type == Light_Type::hemisphere ? 0.0f : -2.0f;
+        irradiance_sh(
+            [&](Vec2, Vec3 dir) { return dir.y > above ? radiance.to_vec() : Vec3{}; }, env.sh);
+        return;
+    }
+
+    // Reflections sample a copy at most preview_env_width wide, and the irradiance
+    // is projected from a level about as coarse as its sampling
+    HDR_Image image = light->emissive_copy();
+    image.build_mips();
+    auto [w, h] = image.dimension();
+    if(w == 0 || h == 0) {
+        env.map.clear();
+        irradiance_sh([](Vec2, Vec3) { return Vec3{}; }, env.sh);
+        return;
+    }
+    size_t tw = std::min(w, preview_env_width), th = std::max(h * tw / w, size_t(1));
+    float lod = std::log2((float)w / tw);
+
+    std::vector<float> rgb(tw * th * 3);
+    for(size_t y = 0; y < th; y++) {
+        for(size_t x = 0; x < tw; x++) {
+            Vec2 uv((x + 0.5f) / tw, (y + 0.5f) / th);
+            Spectrum s = image.lookup(uv, lod);
+            float* texel = &rgb[(y * tw + x) * 3];
+            texel[0] = s.r;
+            texel[1] = s.g;
+            texel[2] = s.b;
+        }
+    }
+    env.tex.image((int)tw, (int)th, rgb.data());
+
+    float sh_lod = std::max(std::log2((float)w / 64.0f), 0.0f);
+    irradiance_sh([&](Vec2 uv, Vec3) { return image.lookup(uv, sh_lod).to_vec(); }, env.sh);
+}
+
+void Renderer::begin_preview(Scene& scene, const Mat4& view, float exposure) {
+
+    constexpr int max_lights = GL::Shaders::max_preview_lights;
+    GLint types[max_lights] = {};
+    Vec3 pos[max_lights], dir[max_lights], rad[max_lights];
+    Vec2 cone[max_lights];
+    int n = 0;
+
+    // The path tracer uses the last environment light it comes across, too
+    const Scene_Light* env = nullptr;
+    scene.for_each<Scene_Light>([&](const Scene_Light& light) {
+        if(light.is_env()) {
+            env = &light;
+            return;
+        }
+        if(n == max_lights) return;
+
+        Mat4 T = view * light.pose.transform();
+        switch(light.opt.type) {
+        case Light_Type::directional: {
+            types[n] = 0;
+            dir[n] = T.rotate(Vec3{0.0f, -1.0f, 0.0f}).unit();
+        } break;
+        case Light_Type::point: {
+            types[n] = 1;
+        } break;
+        case Light_Type::spot: {
+            types[n] = 2;
+            dir[n] = T.rotate(Vec3{0.0f, 1.0f, 0.0f}).unit();
+        } break;
+        default: return;
+        }
+        pos[n] = T * Vec3{};
+        rad[n] = light.radiance().to_vec();
+        cone[n] = light.opt.angle_bounds / 2.0f;
+        n++;
+    });
+
+    preview_environment(env);
+
+    GLint env_type = 0;
+    if(preview_env.type == Light_Type::hemisphere || preview_env.type == Light_Type::sphere) {
+        env_type = preview_env.map.empty() ? 1 : 2;
+    }
+
+    preview_shader.bind();
+    preview_shader.uniform("n_lights", n);
+    if(n) {
+        preview_shader.uniform("light_type", n, types);
+        preview_shader.uniform("light_pos", n, pos);
+        preview_shader.uniform("light_dir", n, dir);
+        preview_shader.uniform("light_rad", n, rad);
+        preview_shader.uniform("light_cone", n, cone);
+    }
+    preview_shader.uniform("env_type", env_type);
+    preview_shader.uniform("env_hemi", preview_env.type == Light_Type::hemisphere);
+    preview_shader.uniform("env_color", preview_env.radiance.to_vec());
+    preview_shader.uniform("env_map", 1);
+    preview_shader.uniform("env_sh", 9, preview_env.sh);
+    preview_shader.uniform("view_to_world", Mat4::inverse(view));
+    preview_shader.uniform("exposure", exposure);
+    previewing = true;
+}
+
+void Renderer::end_preview() {
+    previewing = false;
+}
+
 void Renderer::set_samples(int s) {
     samples = s;
     framebuffer.resize(window_dim, samples);
 }
 
+const Mat4& Renderer::view_normal(const Mat4& view) {
+    if(!(view == last_view)) {
+        last_view = view;
+        last_view_normal = Mat4::transpose(Mat4::inverse(view));
+    }
+    return last_view_normal;
+}
+
+float Renderer::screen_size(const BBox& box, const Mat4& modelview) const {
+
+    float scale = 0.0f;
+    for(int i = 0; i < 3; i++) scale = std::max(scale, modelview[i].xyz().norm());
+    float radius = 0.5f * (box.max - box.min).norm() * scale;
+    float dist = -(modelview * box.center()).z;
+    if(dist <= radius) return std::numeric_limits<float>::infinity();
+
+    // Projected, a length at distance dist spans length / dist * proj[1][1] half heights
+    return radius / dist * _proj[1][1] * window_dim.y;
+}
+
 Scene_ID Renderer::read_id(Vec2 pos) {
 
-    int x = (int)pos.x;
-    int y = (int)(window_dim.y - pos.y - 1);
+    int x = std::clamp((int)pos.x, 0, (int)window_dim.x - 1);
+    int y = std::clamp((int)(window_dim.y - pos.y - 1), 0, (int)window_dim.y - 1);
 
-    if(id_resolve.can_read_at()) {
+    // The framebuffer still holds the last frame drawn until the next begins
+    resolve_ids();
+    GLubyte read[4] = {};
+    id_resolve.read_at(0, x, y, read);
+    return decode_id(read);
+}
 
-        GLubyte read[4] = {};
-        id_resolve.read_at(0, x, y, read);
-        return (int)read[0] | (int)read[1] << 8 | (int)read[2] << 16;
+void Renderer::resolve_ids() {
+    if(ids_resolved) return;
+    framebuffer.blit_to(1, id_resolve, false);
+    ids_resolved = true;
+}
 
-    } else {
+void Renderer::hover(Vec2 pos) {
 
-        int idx = y * (int)window_dim.x * 4 + x * 4;
-        assert(id_buffer && idx > 0 && idx <= window_dim.x * window_dim.y * 4);
+    hovering = true;
+    hover_x = (int)pos.x;
+    hover_y = (int)(window_dim.y - pos.y - 1);
 
-        int a = id_buffer[idx];
-        int b = id_buffer[idx + 1];
-        int c = id_buffer[idx + 2];
+    // The last region read may already cover the new position; if not, the last id
+    // read stands until complete() takes a copy that does
+    if(const GLubyte* read = id_readback.at(hover_x, hover_y)) hovered = decode_id(read);
+}
 
-        return a | b << 8 | c << 16;
-    }
+unsigned int Renderer::hover_id() const {
+    return hovered;
 }
 
 void Renderer::reset_depth() {
@@ -251,6 +630,8 @@ void Renderer::reset_depth() {
 }
 
 void Renderer::begin_outline() {
+    gpu_pass("Outline");
+    outlining = true;
     framebuffer.clear_d();
 }
 
@@ -263,13 +644,14 @@ void Renderer::end_outline(const Mat4& view, BBox box) {
     Vec2 thickness = Vec2(3.0f / window_dim.x, 3.0f / window_dim.y);
     GL::Effects::outline(framebuffer, framebuffer, Gui::Color::outline, min - thickness,
                          max + thickness);
+    outlining = false;
 }
 
 void Renderer::outline(const Mat4& view, Scene_Item& obj) {
 
     Mat4 viewproj = _proj * view;
 
-    framebuffer.clear_d();
+    begin_outline();
     obj.render(view, false, true);
 
     Vec2 min, max;
@@ -278,40 +660,53 @@ void Renderer::outline(const Mat4& view, Scene_Item& obj) {
     Vec2 thickness = Vec2(3.0f / window_dim.x, 3.0f / window_dim.y);
     GL::Effects::outline(framebuffer, framebuffer, Gui::Color::outline, min - thickness,
                          max + thickness);
+    outlining = false;
 }
 
-void Renderer::instances(Renderer::MeshOpt opt, GL::Instances& inst) {
-
-    inst_shader.bind();
-    inst_shader.uniform("use_v_id", opt.per_vert_id);
-    inst_shader.uniform("use_i_id", true);
-    inst_shader.uniform("id", opt.id);
-    inst_shader.uniform("alpha", opt.alpha);
-    inst_shader.uniform("proj", _proj);
-    inst_shader.uniform("modelview", opt.modelview);
-    inst_shader.uniform("solid", opt.solid_color);
-    inst_shader.uniform("sel_color", opt.sel_color);
-    inst_shader.uniform("sel_id", opt.sel_id);
-    inst_shader.uniform("hov_color", opt.hov_color);
-    inst_shader.uniform("hov_id", opt.hov_id);
-    inst_shader.uniform("err_color", Vec3{1.0f});
-    inst_shader.uniform("err_id", 0u);
+template<typename I>
+void Renderer::instances(const GL::Shader& shader, const Renderer::MeshOpt& opt, I& inst) {
+
+    gpu_pass("Instances");
+    shader.bind();
+    shader.uniform("use_v_id", opt.per_vert_id);
+    shader.uniform("use_i_id", true);
+    shader.uniform("id", opt.id);
+    shader.uniform("alpha", opt.alpha);
+    shader.uniform("proj", _proj);
+    shader.uniform("modelview", opt.modelview);
+    shader.uniform("solid", opt.solid_color);
+    shader.uniform("sel_color", opt.sel_color);
+    shader.uniform("sel_id", opt.sel_id);
+    shader.uniform("n_sel_ids", opt.n_sel_ids);
+    if(opt.n_sel_ids) shader.uniform("sel_ids", opt.n_sel_ids, opt.sel_ids);
+    shader.uniform("hov_color", opt.hov_color);
+    shader.uniform("hov_id", opt.hov_id);
+    shader.uniform("err_color", Vec3{1.0f});
+    shader.uniform("err_id", 0u);
 
     if(opt.depth_only) GL::color_mask(false);
 
     if(opt.wireframe) {
-        inst_shader.uniform("color", Vec3());
+        shader.uniform("color", Vec3());
         GL::enable(GL::Opt::wireframe);
         inst.render();
         GL::disable(GL::Opt::wireframe);
     }
 
-    inst_shader.uniform("color", opt.color);
+    shader.uniform("color", opt.color);
     inst.render();
 
     if(opt.depth_only) GL::color_mask(true);
 }
 
+void Renderer::instances(Renderer::MeshOpt opt, GL::Instances& inst) {
+    instances(inst_shader, opt, inst);
+}
+
+void Renderer::instances(Renderer::MeshOpt opt, GL::Point_Instances& inst) {
+    instances(point_inst_shader, opt, inst);
+}
+
 void Renderer::halfedge_editor(Renderer::HalfedgeOpt opt) {
 
     auto [faces, spheres, cylinders, arrows] = opt.editor.shapes();
@@ -322,6 +717,9 @@ void Renderer::halfedge_editor(Renderer::HalfedgeOpt opt) {
     fopt.per_vert_id = true;
     fopt.sel_color = Gui::Color::outline;
     fopt.sel_id = opt.editor.select_id();
+    const std::vector<unsigned int>& extra = opt.editor.multi_select_ids();
+    fopt.sel_ids = extra.data();
+    fopt.n_sel_ids = (int)std::min(extra.size(), (size_t)MeshOpt::max_sel_ids);
     fopt.hov_color = Gui::Color::hover;
     fopt.hov_id = opt.editor.hover_id();
     Renderer::mesh(faces, fopt);
@@ -336,6 +734,8 @@ void Renderer::halfedge_editor(Renderer::HalfedgeOpt opt) {
     inst_shader.uniform("sel_color", Gui::Color::outline);
     inst_shader.uniform("hov_color", Gui::Color::hover);
     inst_shader.uniform("sel_id", fopt.sel_id);
+    inst_shader.uniform("n_sel_ids", fopt.n_sel_ids);
+    if(fopt.n_sel_ids) inst_shader.uniform("sel_ids", fopt.n_sel_ids, fopt.sel_ids);
     inst_shader.uniform("hov_id", fopt.hov_id);
 
     inst_shader.uniform("err_color", opt.err_color);
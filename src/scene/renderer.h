@@ -1,6 +1,8 @@
 
 #pragma once
 
+#include <chrono>
+#include <optional>
 #include <variant>
 
 #include "../lib/bbox.h"
@@ -26,18 +28,48 @@ public:
     void update_dim(Vec2 dim);
     void settings_gui(bool* open);
     void set_samples(int samples);
+    // Roughly how many pixels across a box seen at modelview covers; infinite once
+    // the camera is (nearly) inside it
+    float screen_size(const BBox& box, const Mat4& modelview) const;
+    // The inverse transpose of view, kept from call to call as the view changes
+    // at most once a frame
+    const Mat4& view_normal(const Mat4& view);
+    // Reads the id drawn at pos, waiting for the frame to finish
     unsigned int read_id(Vec2 pos);
+    // Reads the id drawn at the last hovered position without waiting: each frame
+    // copies a small region around it, and hover_id() is a frame or two behind
+    void hover(Vec2 pos);
+    unsigned int hover_id() const;
+
+    // Timings and counts of the last frame drawn from begin() to complete()
+    struct Frame_Stats {
+        // Since the previous frame began, and spent on the CPU drawing this one
+        float frame_ms = 0.0f, cpu_ms = 0.0f;
+        uint64_t draws = 0, triangles = 0;
+        // GPU milliseconds per pass (see GL::Timer_Queries), a few frames behind
+        std::vector<std::pair<const char*, float>> gpu;
+    };
+    const Frame_Stats& frame_stats() const;
 
     struct MeshOpt {
         unsigned int id;
         Mat4 modelview;
+        // The inverse transpose of modelview, if known; otherwise it is computed
+        // per draw. Must be reset by anything that changes modelview.
+        std::optional<Mat4> normal;
         Vec3 color, sel_color, hov_color;
         unsigned int sel_id = 0, hov_id = 0;
+        // Also drawn as selected; the shaders take up to max_sel_ids of them
+        static constexpr int max_sel_ids = 32;
+        const unsigned int* sel_ids = nullptr;
+        int n_sel_ids = 0;
         float alpha = 1.0f;
         bool wireframe = false;
         bool solid_color = false;
         bool depth_only = false;
         bool per_vert_id = false;
+        // Shaded as this material while previewing (see begin_preview)
+        const Material::Options* material = nullptr;
     };
 
     struct HalfedgeOpt {
@@ -56,9 +88,15 @@ public:
     // NOTE(max): updates & uses the indices in mesh for selection/traversal
     void halfedge_editor(HalfedgeOpt opt);
     void mesh(GL::Mesh& mesh, MeshOpt opt);
+    // Draws a mesh with a skin (see GL::Mesh::set_skin), blending the joint matrices
+    // in palette (at most GL::Shaders::max_joints) per vertex
+    void skinned_mesh(GL::Mesh& mesh, const std::vector<Mat4>& palette, MeshOpt opt);
+    // The same, blending dual quaternions (see Skeleton::Skin_Mode)
+    void skinned_mesh(GL::Mesh& mesh, const std::vector<Dual_Quat>& palette, MeshOpt opt);
     void lines(const GL::Lines& lines, const Mat4& view, const Mat4& model = Mat4::I,
                float alpha = 1.0f);
     void instances(Renderer::MeshOpt opt, GL::Instances& inst);
+    void instances(Renderer::MeshOpt opt, GL::Point_Instances& inst);
 
     void outline(const Mat4& view, Scene_Item& obj);
     void begin_outline();
@@ -68,12 +106,50 @@ public:
     void skydome(const Mat4& rotation, Vec3 color, float cosine, const GL::Tex2D& tex);
 
     void sphere(MeshOpt opt);
+    // Queues a mesh to be drawn by end_batch() in one call with the rest of the batch
+    // (see GL::Mesh_Batch), returning false if it must be drawn on its own instead:
+    // without GL 4.5, or when opt asks for more than a plain opaque surface
+    bool batch(const GL::Mesh& mesh, const MeshOpt& opt);
+    bool batch_sphere(const MeshOpt& opt);
+    void end_batch();
     void capsule(MeshOpt opt, float height, float rad);
     void capsule(MeshOpt opt, const Mat4& mdl, float height, float rad, BBox& box);
 
+    // The shapes of a skeleton, drawn as instances with one call per mesh. Transforms
+    // are in world space, so the instances are only uploaded again when they change.
+    struct Bone {
+        Mat4 model;
+        float height = 0.0f, radius = 0.0f;
+        unsigned int id = 0;
+    };
+    // As capsule() for each bone
+    void bones(const MeshOpt& opt, const std::vector<Bone>& bones);
+    void joints(const MeshOpt& opt, const std::vector<GL::Instances::Info>& spheres);
+    void handles(const MeshOpt& opt, const std::vector<GL::Instances::Info>& spheres);
+
+    // Until end_preview(), meshes given a material are shaded to approximate what the
+    // path tracer shows: lit by the scene's delta lights (unshadowed) and by its
+    // environment, image-based, which is also all that mirrors and glass show
+    void begin_preview(Scene& scene, const Mat4& view, float exposure = 1.0f);
+    void end_preview();
+
     GLuint saved() const;
     void saved(std::vector<unsigned char>& data) const;
-    void save(Scene& scene, const Camera& cam, int w, int h, int samples);
+    void save(Scene& scene, const Camera& cam, int w, int h, int samples, bool preview = false,
+              float exposure = 1.0f);
+    // Rasterizes the scene as save() does, without multisampling, and reads back each
+    // pixel's distance along the view axis (infinite where nothing was drawn), bottom
+    // row first
+    void save_depth(Scene& scene, const Camera& cam, int w, int h, std::vector<float>& depth);
+
+    // Whether the viewport skins meshes in the vertex shader, rather than uploading
+    // meshes skinned on the CPU at every pose
+    bool gpu_skinning = true;
+    // Whether heavy meshes are drawn at coarser levels of detail when small on screen
+    // (see Scene_Object::lod_min_tris)
+    bool mesh_lod = true;
+    // Whether the viewport previews materials (see begin_preview)
+    bool material_preview = false;
 
 private:
     Renderer(Vec2 dim);
@@ -81,12 +157,53 @@ private:
     static inline Renderer* data = nullptr;
 
     GL::Framebuffer framebuffer, id_resolve, save_buffer, save_output;
-    GL::Shader mesh_shader, line_shader, inst_shader, dome_shader;
+    void mesh(const GL::Shader& shader, GL::Mesh& mesh, const MeshOpt& opt);
+    void preview(GL::Mesh& mesh, const MeshOpt& opt);
+    void preview_environment(const Scene_Light* light);
+    // Times the following GPU work as the named pass, unless drawing an outline
+    void gpu_pass(const char* name);
+    template<typename I> void instances(const GL::Shader& shader, const MeshOpt& opt, I& inst);
+
+    GL::Shader mesh_shader, line_shader, inst_shader, point_inst_shader, dome_shader, skin_shader,
+        skin_dq_shader, batch_shader, preview_shader;
+    GL::Mesh_Batch mesh_batch;
+    GL::Uniforms joint_palette;
     GL::Mesh _sphere, _cyl, _hemi;
+    GL::Instances bone_cyls, bone_hemis, joint_spheres, handle_spheres;
+    std::vector<GL::Instances::Info> cyl_infos, hemi_infos;
 
     int samples;
     Vec2 window_dim;
-    GLubyte* id_buffer;
+
+    // Copies the ids of the last frame into id_resolve, unless already done
+    void resolve_ids();
+    bool ids_resolved = false;
+
+    static constexpr int hover_side = 9;
+    GL::Readback id_readback;
+    bool hovering = false;
+    int hover_x = 0, hover_y = 0;
+    unsigned int hovered = 0;
+
+    GL::Timer_Queries gpu_timer;
+    Frame_Stats stats;
+    std::chrono::steady_clock::time_point frame_begin;
+    bool outlining = false;
+    Mat4 last_view, last_view_normal = Mat4::I;
+
+    // The environment as last uploaded for previews
+    struct Preview_Env {
+        bool valid = false;
+        Scene_ID light = 0;
+        Light_Type type = Light_Type::count;
+        Spectrum radiance;
+        std::string map;
+        Vec3 sh[9];
+        GL::Tex2D tex;
+    };
+    static constexpr size_t preview_env_width = 512;
+    Preview_Env preview_env;
+    bool previewing = false;
 
     Mat4 _proj;
 };
@@ -1,13 +1,21 @@
 
 #include <assimp/Exporter.hpp>
 #include <assimp/Importer.hpp>
+#include <assimp/ProgressHandler.hpp>
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
+#include <cstdio>
+#include <filesystem>
 #include <sstream>
+#include <thread>
+#include <tuple>
 
 #include "../gui/manager.h"
 #include "../gui/render.h"
 #include "../lib/log.h"
+#include "../util/mapped_file.h"
+#include "../util/parallel.h"
+#include "../util/profiler.h"
 
 #include "renderer.h"
 #include "scene.h"
@@ -28,8 +36,12 @@ Scene_Item& Scene_Item::operator=(Scene_Item&& src) {
     return *this;
 }
 
-void Scene_Item::set_time(float time) {
-    return std::visit([time](auto& obj) { obj.set_time(time); }, data);
+void Scene_Item::set_time(float time, bool force) {
+    return std::visit([time, force](auto& obj) { obj.set_time(time, force); }, data);
+}
+
+void Scene_Item::bake_frames(size_t n) {
+    std::visit([n](auto& obj) { obj.bake_frames(n); }, data);
 }
 
 BBox Scene_Item::bbox() {
@@ -99,22 +111,20 @@ Scene_ID Scene::reserve_id() {
 
 Scene_ID Scene::add(Pose pose, Halfedge_Mesh&& mesh, std::string n, Scene_ID id) {
     if(!id) id = next_id++;
-    assert(objs.find(id) == objs.end());
-    objs.emplace(std::make_pair(id, Scene_Object(id, pose, std::move(mesh), n)));
+    insert(std::make_unique<Scene_Item>(Scene_Object(id, pose, std::move(mesh), n)));
     return id;
 }
 
 Scene_ID Scene::add(Pose pose, GL::Mesh&& mesh, std::string n, Scene_ID id) {
     if(!id) id = next_id++;
-    assert(objs.find(id) == objs.end());
-    objs.emplace(std::make_pair(id, Scene_Object(id, pose, std::move(mesh), n)));
+    insert(std::make_unique<Scene_Item>(Scene_Object(id, pose, std::move(mesh), n)));
     return id;
 }
 
 std::string Scene::set_env_map(std::string file) {
     Scene_ID id = 0;
-    for_items([&id](const Scene_Item& item) {
-        if(item.is<Scene_Light>() && item.get<Scene_Light>().is_env()) id = item.id();
+    for_each<Scene_Light>([&id](const Scene_Light& light) {
+        if(light.is_env()) id = light.id();
     });
     Scene_Light l(Light_Type::sphere, reserve_id(), {}, "env_map");
     std::string err = l.emissive_load(file);
@@ -127,68 +137,97 @@ std::string Scene::set_env_map(std::string file) {
 
 bool Scene::has_env_light() const {
     bool ret = false;
-    for_items([&ret](const Scene_Item& item) {
-        ret = ret || (item.is<Scene_Light>() && item.get<Scene_Light>().is_env());
-    });
+    for_each<Scene_Light>([&ret](const Scene_Light& light) { ret = ret || light.is_env(); });
     return ret;
 }
 
 bool Scene::has_obj() const {
-    bool ret = false;
-    for_items([&ret](const Scene_Item& item) { ret = ret || item.is<Scene_Object>(); });
-    return ret;
+    return count<Scene_Object>() > 0;
 }
 
 bool Scene::has_sim() const {
-    bool ret = false;
-    for_items([&ret](const Scene_Item& item) { ret = ret || item.is<Scene_Particles>(); });
-    return ret;
+    return count<Scene_Particles>() > 0;
 }
 
-void Scene::restore(Scene_ID id) {
-    if(objs.find(id) != objs.end()) return;
-    assert(erased.find(id) != erased.end());
-    objs.insert({id, std::move(erased[id])});
-    erased.erase(id);
+Scene::Memory Scene::memory() const {
+    Memory m;
+    std::unordered_set<const void*> seen;
+    for_items([&](const Scene_Item& item) {
+        if(item.is<Scene_Object>()) {
+            const Scene_Object& obj = item.get<Scene_Object>();
+            m.halfedge += obj.halfedge_bytes(seen);
+            m.meshes += obj.mesh_bytes(seen);
+            m.skinning += obj.skin_bytes(seen);
+        } else if(item.is<Scene_Particles>()) {
+            const Scene_Particles& particles = item.get<Scene_Particles>();
+            m.meshes += particles.mesh().bytes(seen);
+            m.particles += particles.particle_bytes();
+        } else if(item.is<Scene_Light>()) {
+            m.images += item.get<Scene_Light>().emissive_bytes();
+        }
+    });
+    return m;
 }
 
-void Scene::erase(Scene_ID id) {
-    assert(erased.find(id) == erased.end());
-    assert(objs.find(id) != objs.end());
+// Where an item with this id goes in an id-ordered list
+static std::vector<Scene_Item*>::iterator list_slot(std::vector<Scene_Item*>& list, Scene_ID id) {
+    // New items nearly always have the largest id yet
+    if(list.empty() || list.back()->id() < id) return list.end();
+    return std::lower_bound(list.begin(), list.end(), id,
+                            [](const Scene_Item* item, Scene_ID i) { return item->id() < i; });
+}
 
-    erased.insert({id, std::move(objs[id])});
-    objs.erase(id);
+void Scene::insert(std::unique_ptr<Scene_Item> item) {
+    Scene_ID id = item->id();
+    assert(index.find(id) == index.end());
+    Scene_Item* ptr = item.get();
+    items.insert(list_slot(items, id), ptr);
+    auto& list = typed[ptr->type()];
+    list.insert(list_slot(list, id), ptr);
+    index.emplace(id, std::move(item));
 }
 
-void Scene::for_items(std::function<void(const Scene_Item&)> func) const {
-    for(const auto& obj : objs) {
-        func(obj.second);
-    }
+void Scene::restore(Scene_ID id) {
+    if(index.find(id) != index.end()) return;
+    auto entry = erased.find(id);
+    assert(entry != erased.end());
+    std::unique_ptr<Scene_Item> item = std::move(entry->second);
+    erased.erase(entry);
+    insert(std::move(item));
 }
 
-void Scene::for_items(std::function<void(Scene_Item&)> func) {
-    for(auto& obj : objs) {
-        func(obj.second);
-    }
+void Scene::erase(Scene_ID id) {
+    assert(erased.find(id) == erased.end());
+    auto entry = index.find(id);
+    assert(entry != index.end());
+
+    Scene_Item* ptr = entry->second.get();
+    items.erase(list_slot(items, id));
+    auto& list = typed[ptr->type()];
+    list.erase(list_slot(list, id));
+    erased.emplace(id, std::move(entry->second));
+    index.erase(entry);
 }
 
 size_t Scene::size() {
-    return objs.size();
+    return items.size();
 }
 
 bool Scene::empty() {
-    return objs.size() == 0;
+    return items.empty();
 }
 
 Scene_Maybe Scene::get(Scene_ID id) {
-    auto entry = objs.find(id);
-    if(entry == objs.end()) return std::nullopt;
-    return entry->second;
+    auto entry = index.find(id);
+    if(entry == index.end()) return std::nullopt;
+    return *entry->second;
 }
 
 void Scene::clear(Undo& undo) {
     next_id = first_id;
-    objs.clear();
+    items.clear();
+    for(auto& list : typed) list.clear();
+    index.clear();
     erased.clear();
     undo.reset();
 }
@@ -206,6 +245,7 @@ static const std::string ANIM_NAME = "S3D-ANIMATION";
 
 static const std::string FLIPPED_TAG = "FLIPPED";
 static const std::string SMOOTHED_TAG = "SMOOTHED";
+static const std::string PORTAL_TAG = "PORTAL";
 static const std::string SPHERESHAPE_TAG = "SPHERESHAPE";
 static const std::string EMITTER_TAG = "EMITTER";
 static const std::string EMITTER_ANIM = "EMITTER_ANIM_NODE";
@@ -256,10 +296,8 @@ static aiMatrix4x4 node_transform(const aiNode* node) {
     return T;
 }
 
-static GL::Mesh mesh_from(const aiMesh* mesh, bool n_flip) {
-
-    std::vector<GL::Mesh::Vert> mesh_verts;
-    std::vector<GL::Mesh::Index> mesh_inds;
+static void mesh_data(const aiMesh* mesh, bool n_flip, std::vector<GL::Mesh::Vert>& mesh_verts,
+                      std::vector<GL::Mesh::Index>& mesh_inds) {
 
     for(unsigned int j = 0; j < mesh->mNumVertices; j++) {
         const aiVector3D& vpos = mesh->mVertices[j];
@@ -300,31 +338,37 @@ static GL::Mesh mesh_from(const aiMesh* mesh, bool n_flip) {
             mesh_verts[i].norm = n_flip ? -vert_n : vert_n;
         }
     }
+}
 
+static GL::Mesh mesh_from(const aiMesh* mesh, bool n_flip) {
+    std::vector<GL::Mesh::Vert> mesh_verts;
+    std::vector<GL::Mesh::Index> mesh_inds;
+    mesh_data(mesh, n_flip, mesh_verts, mesh_inds);
     return GL::Mesh(std::move(mesh_verts), std::move(mesh_inds));
 }
 
-using vp_pair = std::pair<std::vector<Vec3>, std::vector<std::vector<Halfedge_Mesh::Index>>>;
-static vp_pair load_mesh(const aiMesh* mesh) {
-
-    std::vector<Vec3> verts;
+// Vertex positions, and polygons as a flat list (see Halfedge_Mesh::from_flat)
+using flat_mesh = std::tuple<std::vector<Vec3>, std::vector<Halfedge_Mesh::Index>,
+                             std::vector<Halfedge_Mesh::Index>>;
+static flat_mesh load_mesh(const aiMesh* mesh) {
 
+    std::vector<Vec3> verts(mesh->mNumVertices);
     for(unsigned int j = 0; j < mesh->mNumVertices; j++) {
         const aiVector3D& pos = mesh->mVertices[j];
-        verts.push_back(Vec3(pos.x, pos.y, pos.z));
+        verts[j] = Vec3(pos.x, pos.y, pos.z);
     }
 
-    std::vector<std::vector<Halfedge_Mesh::Index>> polys;
+    std::vector<Halfedge_Mesh::Index> face_start, corners;
+    face_start.reserve(mesh->mNumFaces + 1);
+    corners.reserve(3 * (size_t)mesh->mNumFaces);
+    face_start.push_back(0);
     for(unsigned int j = 0; j < mesh->mNumFaces; j++) {
         const aiFace& face = mesh->mFaces[j];
         if(face.mNumIndices < 3) continue;
-        std::vector<Halfedge_Mesh::Index> poly;
-        for(unsigned int k = 0; k < face.mNumIndices; k++) {
-            poly.push_back(face.mIndices[k]);
-        }
-        polys.push_back(poly);
+        corners.insert(corners.end(), face.mIndices, face.mIndices + face.mNumIndices);
+        face_start.push_back(corners.size());
     }
-    return {verts, polys};
+    return {verts, face_start, corners};
 }
 
 static Scene_Particles::Options load_particles(aiLight* ai_light, aiNode* anim_node) {
@@ -339,6 +383,7 @@ static Scene_Particles::Options load_particles(aiLight* ai_light, aiNode* anim_n
     opt.angle = std::abs(ai_light->mAttenuationQuadratic);
     opt.pps = ai_light->mColorDiffuse.r;
     opt.dt = ai_light->mColorDiffuse.g;
+    opt.collide = ai_light->mColorDiffuse.b > 0.0f;
 
     if(anim_node) {
         aiVector3D ascale, arot, apos;
@@ -441,154 +486,246 @@ static Material::Options load_material(aiMaterial* ai_mat, float& was_sphere) {
     return mat;
 }
 
-static void load_node(Scene& scobj, std::vector<std::string>& errors,
-                      std::unordered_map<aiNode*, Scene_ID>& node_to_obj,
-                      std::unordered_map<aiNode*, Joint*>& node_to_bone,
-                      std::unordered_map<aiNode*, Skeleton::IK_Handle*>& node_to_ik,
-                      const aiScene* scene, aiNode* node, aiMatrix4x4 transform) {
+// One mesh placed by a node. Meshes are found first, then converted in parallel, and
+// only then added to the scene, in the order they were found.
+struct Node_Mesh {
+    aiNode* node = nullptr;
+    const aiMesh* mesh = nullptr;
+    Pose pose;
+    std::string name;
+    bool flip = false, smooth = false, portal = false;
+    float was_sphere = -1.0f;
+    Material::Options material;
+
+    // Index of the first Node_Mesh placing the same aiMesh, if this isn't it; only
+    // that one is converted, and the rest are added as instances sharing its data
+    size_t source = SIZE_MAX;
+    bool has_instances = false;
+
+    Halfedge_Mesh hemesh;
+    std::shared_ptr<const Scene_Object::Polygons> polys;
+    bool deferred = false;
+    // Made into a GL::Mesh only when added to the scene, since GL objects must be
+    // created on the main thread
+    std::vector<GL::Mesh::Vert> gverts;
+    std::vector<GL::Mesh::Index> gidxs;
+    std::string err;
+
+    GL::Mesh built() {
+        return GL::Mesh(std::move(gverts), std::move(gidxs));
+    }
+};
+
+static void find_meshes(const aiScene* scene, aiNode* node, aiMatrix4x4 transform,
+                        std::vector<Node_Mesh>& found) {
 
     transform = transform * node->mTransformation;
 
     for(unsigned int i = 0; i < node->mNumMeshes; i++) {
 
-        const aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-
-        std::string name;
-        bool do_flip = false, do_smooth = false;
+        Node_Mesh m;
+        m.node = node;
+        m.mesh = scene->mMeshes[node->mMeshes[i]];
 
-        if(mesh->mName.length) {
-            name = std::string(mesh->mName.C_Str());
+        if(m.mesh->mName.length) {
+            m.name = std::string(m.mesh->mName.C_Str());
 
-            if(name.find(FAKE_NAME) != std::string::npos) continue;
+            if(m.name.find(FAKE_NAME) != std::string::npos) continue;
 
-            size_t special = name.find("-S3D-");
+            size_t special = m.name.find("-S3D-");
             if(special != std::string::npos) {
-                if(name.find(FLIPPED_TAG) != std::string::npos) do_flip = true;
-                if(name.find(SMOOTHED_TAG) != std::string::npos) do_smooth = true;
-                if(name.find(EMITTER_TAG) != std::string::npos) continue;
-                name = name.substr(0, special);
-                std::replace(name.begin(), name.end(), '_', ' ');
+                if(m.name.find(FLIPPED_TAG) != std::string::npos) m.flip = true;
+                if(m.name.find(SMOOTHED_TAG) != std::string::npos) m.smooth = true;
+                if(m.name.find(PORTAL_TAG) != std::string::npos) m.portal = true;
+                if(m.name.find(EMITTER_TAG) != std::string::npos) continue;
+                m.name = m.name.substr(0, special);
+                std::replace(m.name.begin(), m.name.end(), '_', ' ');
             }
         }
 
-        auto [verts, polys] = load_mesh(mesh);
-
         aiVector3D ascale, arot, apos;
         transform.Decompose(ascale, arot, apos);
         Vec3 pos = aiVec(apos);
         Vec3 rot = aiVec(arot);
         Vec3 scale = aiVec(ascale);
-        Pose p = {pos, Degrees(rot).range(0.0f, 360.0f), scale};
+        m.pose = {pos, Degrees(rot).range(0.0f, 360.0f), scale};
 
-        float was_sphere = -1.0f;
-        Material::Options mat_opt =
-            load_material(scene->mMaterials[mesh->mMaterialIndex], was_sphere);
+        m.material = load_material(scene->mMaterials[m.mesh->mMaterialIndex], m.was_sphere);
+        found.push_back(std::move(m));
+    }
 
-        Scene_Object new_obj;
+    for(unsigned int i = 0; i < node->mNumChildren; i++) {
+        find_meshes(scene, node->mChildren[i], transform, found);
+    }
+}
 
-        if(was_sphere > 0.0f) {
+// Links meshes placed by more than one node to the first node placing them. Identical
+// meshes were already merged into one by aiProcess_FindInstances.
+static void find_instances(std::vector<Node_Mesh>& meshes) {
+    std::unordered_map<const aiMesh*, size_t> first;
+    for(size_t i = 0; i < meshes.size(); i++) {
+        if(meshes[i].was_sphere > 0.0f) continue;
+        auto [entry, added] = first.emplace(meshes[i].mesh, i);
+        if(!added) {
+            meshes[i].source = entry->second;
+            meshes[entry->second].has_instances = true;
+        }
+    }
+}
 
-            Scene_Object obj(scobj.reserve_id(), p, GL::Mesh(), name);
-            obj.opt.shape_type = PT::Shape_Type::sphere;
-            obj.opt.shape = PT::Shape(PT::Sphere(was_sphere));
-            new_obj = std::move(obj);
+// Touches nothing but m, so any number may run at once
+static void convert_mesh(Node_Mesh& m, bool defer_halfedge) {
 
-        } else {
+    if(m.was_sphere > 0.0f || m.source != SIZE_MAX) return;
 
-            Halfedge_Mesh hemesh;
-            std::string err = hemesh.from_poly(polys, verts);
-            if(!err.empty()) {
+    auto [verts, face_start, corners] = load_mesh(m.mesh);
+    auto polys = std::make_shared<const Scene_Object::Polygons>(Scene_Object::Polygons{
+        std::move(verts), std::move(face_start), std::move(corners), m.flip});
 
-                GL::Mesh gmesh = mesh_from(mesh, do_flip);
-                errors.push_back(err);
-                Scene_Object obj(scobj.reserve_id(), p, std::move(gmesh), name);
-                new_obj = std::move(obj);
+    // Instances keep the polygons until edited, so the source holds on to them too
+    if(defer_halfedge || m.has_instances) m.polys = polys;
 
-            } else {
+    if(defer_halfedge) {
+        m.deferred = true;
+        polys->to_mesh(m.gverts, m.gidxs, !m.smooth);
+        return;
+    }
 
-                if(do_flip) hemesh.flip();
-                Scene_Object obj(scobj.reserve_id(), p, std::move(hemesh), name);
-                obj.opt.smooth_normals = do_smooth;
-                obj.set_mesh_dirty();
-                new_obj = std::move(obj);
-            }
+    m.err = m.hemesh.from_flat(polys->face_start, polys->corners, polys->verts);
+
+    if(!m.err.empty()) {
+        mesh_data(m.mesh, m.flip, m.gverts, m.gidxs);
+    } else {
+        if(m.flip) m.hemesh.flip();
+        m.hemesh.to_mesh(m.gverts, m.gidxs, !m.smooth);
+    }
+}
+
+// Instances are given the object made for their source, whose polygons and GL mesh
+// buffers they share
+static Scene_ID load_node(Scene& scobj, std::vector<std::string>& errors,
+                      std::unordered_map<aiNode*, Scene_ID>& node_to_obj,
+                      std::unordered_map<aiNode*, Joint*>& node_to_bone,
+                      std::unordered_map<aiNode*, Skeleton::IK_Handle*>& node_to_ik,
+                      const aiScene* scene, Node_Mesh& m, Scene_Object* instance_of) {
+
+    aiNode* node = m.node;
+    const aiMesh* mesh = m.mesh;
+    const Pose& p = m.pose;
+    const std::string& name = m.name;
+
+    Scene_Object new_obj;
+
+    if(m.was_sphere > 0.0f) {
+
+        Scene_Object obj(scobj.reserve_id(), p, m.built(), name);
+        obj.opt.shape_type = PT::Shape_Type::sphere;
+        obj.opt.shape = PT::Shape(PT::Sphere(m.was_sphere));
+        new_obj = std::move(obj);
+
+    } else if(instance_of) {
+
+        // Its source reported any error already
+        GL::Mesh shared = instance_of->mesh().copy();
+        if(m.polys && m.err.empty()) {
+            Scene_Object obj(scobj.reserve_id(), p, m.polys, std::move(shared), name);
+            obj.opt.smooth_normals = m.smooth;
+            new_obj = std::move(obj);
+        } else {
+            Scene_Object obj(scobj.reserve_id(), p, std::move(shared), name);
+            new_obj = std::move(obj);
         }
 
-        new_obj.material.opt = mat_opt;
+    } else if(m.deferred) {
 
-        if(mesh->mNumBones) {
+        // Not moved from, since instances still need them
+        Scene_Object obj(scobj.reserve_id(), p, m.polys, m.built(), name);
+        obj.opt.smooth_normals = m.smooth;
+        new_obj = std::move(obj);
 
-            Skeleton& skeleton = new_obj.armature;
-            aiNode* arm_node = mesh->mBones[0]->mArmature;
-            if(arm_node) {
-                {
-                    aiVector3D t, r, s;
-                    arm_node->mTransformation.Decompose(s, r, t);
-                    skeleton.base() = aiVec(t);
-                }
+    } else if(!m.err.empty()) {
 
-                std::unordered_map<aiNode*, aiBone*> node_to_aibone;
-                for(unsigned int j = 0; j < mesh->mNumBones; j++) {
-                    node_to_aibone[mesh->mBones[j]->mNode] = mesh->mBones[j];
-                }
+        errors.push_back(m.err);
+        Scene_Object obj(scobj.reserve_id(), p, m.built(), name);
+        new_obj = std::move(obj);
 
-                std::function<void(Joint*, aiNode*)> build_tree;
-                build_tree = [&](Joint* p, aiNode* node) {
-                    aiBone* bone = node_to_aibone[node];
-                    aiVector3D t, r, s;
-                    bone->mOffsetMatrix.Decompose(s, r, t);
-
-                    std::string name(bone->mName.C_Str());
-                    if(name.find(IK_TAG) != std::string::npos) {
-                        Skeleton::IK_Handle* h = skeleton.add_handle(aiVec(t), p);
-                        h->enabled = bone->mWeights[0].mWeight > 1.0f;
-                        node_to_ik[node] = h;
-                    } else {
-                        Joint* c = skeleton.add_child(p, aiVec(t));
-                        node_to_bone[node] = c;
-                        c->pose = aiVec(r);
-                        c->radius = bone->mWeights[0].mWeight;
-                        for(unsigned int j = 0; j < node->mNumChildren; j++)
-                            build_tree(c, node->mChildren[j]);
-                    }
-                };
-                for(unsigned int j = 0; j < arm_node->mNumChildren; j++) {
-                    aiNode* root_node = arm_node->mChildren[j];
-                    aiBone* root_bone = node_to_aibone[root_node];
-                    aiVector3D t, r, s;
-                    root_bone->mOffsetMatrix.Decompose(s, r, t);
-                    Joint* root = skeleton.add_root(aiVec(t));
-                    node_to_bone[root_node] = root;
-                    root->pose = aiVec(r);
-                    root->radius = root_bone->mWeights[0].mWeight;
-                    for(unsigned int k = 0; k < root_node->mNumChildren; k++)
-                        build_tree(root, root_node->mChildren[k]);
-                }
+    } else {
 
-                new_obj.set_skel_dirty();
+        Scene_Object obj(scobj.reserve_id(), p, std::move(m.hemesh), m.built(), name);
+        obj.opt.smooth_normals = m.smooth;
+        new_obj = std::move(obj);
+    }
+
+    new_obj.material.opt = m.material;
+    new_obj.opt.portal = m.portal;
+
+    if(mesh->mNumBones) {
+
+        Skeleton& skeleton = new_obj.armature;
+        aiNode* arm_node = mesh->mBones[0]->mArmature;
+        if(arm_node) {
+            {
+                aiVector3D t, r, s;
+                arm_node->mTransformation.Decompose(s, r, t);
+                skeleton.base() = aiVec(t);
             }
-        }
 
-        std::string m0 = std::string(node->mName.C_Str()) + "-" + MAT_ANIM0;
-        aiNode* m0_node = scene->mRootNode->FindNode(aiString(m0));
-        if(m0_node) {
-            node_to_obj[m0_node] = new_obj.id();
-        }
+            std::unordered_map<aiNode*, aiBone*> node_to_aibone;
+            for(unsigned int j = 0; j < mesh->mNumBones; j++) {
+                node_to_aibone[mesh->mBones[j]->mNode] = mesh->mBones[j];
+            }
+
+            std::function<void(Joint*, aiNode*)> build_tree;
+            build_tree = [&](Joint* p, aiNode* node) {
+                aiBone* bone = node_to_aibone[node];
+                aiVector3D t, r, s;
+                bone->mOffsetMatrix.Decompose(s, r, t);
+
+                std::string name(bone->mName.C_Str());
+                if(name.find(IK_TAG) != std::string::npos) {
+                    Skeleton::IK_Handle* h = skeleton.add_handle(aiVec(t), p);
+                    h->enabled = bone->mWeights[0].mWeight > 1.0f;
+                    node_to_ik[node] = h;
+                } else {
+                    Joint* c = skeleton.add_child(p, aiVec(t));
+                    node_to_bone[node] = c;
+                    c->pose = aiVec(r);
+                    c->radius = bone->mWeights[0].mWeight;
+                    for(unsigned int j = 0; j < node->mNumChildren; j++)
+                        build_tree(c, node->mChildren[j]);
+                }
+            };
+            for(unsigned int j = 0; j < arm_node->mNumChildren; j++) {
+                aiNode* root_node = arm_node->mChildren[j];
+                aiBone* root_bone = node_to_aibone[root_node];
+                aiVector3D t, r, s;
+                root_bone->mOffsetMatrix.Decompose(s, r, t);
+                Joint* root = skeleton.add_root(aiVec(t));
+                node_to_bone[root_node] = root;
+                root->pose = aiVec(r);
+                root->radius = root_bone->mWeights[0].mWeight;
+                for(unsigned int k = 0; k < root_node->mNumChildren; k++)
+                    build_tree(root, root_node->mChildren[k]);
+            }
 
-        std::string m1 = std::string(node->mName.C_Str()) + "-" + MAT_ANIM1;
-        aiNode* m1_node = scene->mRootNode->FindNode(aiString(m1));
-        if(m1_node) {
-            node_to_obj[m1_node] = new_obj.id();
+            new_obj.set_skel_dirty();
         }
+    }
 
-        node_to_obj[node] = new_obj.id();
-        scobj.add(std::move(new_obj));
+    std::string m0 = std::string(node->mName.C_Str()) + "-" + MAT_ANIM0;
+    aiNode* m0_node = scene->mRootNode->FindNode(aiString(m0));
+    if(m0_node) {
+        node_to_obj[m0_node] = new_obj.id();
     }
 
-    for(unsigned int i = 0; i < node->mNumChildren; i++) {
-        load_node(scobj, errors, node_to_obj, node_to_bone, node_to_ik, scene, node->mChildren[i],
-                  transform);
+    std::string m1 = std::string(node->mName.C_Str()) + "-" + MAT_ANIM1;
+    aiNode* m1_node = scene->mRootNode->FindNode(aiString(m1));
+    if(m1_node) {
+        node_to_obj[m1_node] = new_obj.id();
     }
+
+    node_to_obj[node] = new_obj.id();
+    return scobj.add(std::move(new_obj));
 }
 
 static unsigned int load_flags(Scene::Load_Opts opt) {
@@ -622,7 +759,181 @@ static unsigned int load_flags(Scene::Load_Opts opt) {
     return flags;
 }
 
+// Bump when what the loader expects of a cached import changes
+static const uint32_t scene_cache_version = 1;
+
+// Empty if the file can't be found
+static std::string scene_cache_file(const std::string& dir, const std::string& file,
+                                    unsigned int flags) {
+
+    std::error_code ec;
+    std::filesystem::path path = std::filesystem::absolute(file, ec);
+    if(ec) return {};
+    int64_t time = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+    if(ec) return {};
+    uint64_t length = std::filesystem::file_size(path, ec);
+    if(ec) return {};
+
+    // 64-bit FNV-1a over everything the imported scene depends on
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for(size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    };
+    add(&scene_cache_version, sizeof(scene_cache_version));
+    std::string name = path.lexically_normal().string();
+    add(name.data(), name.size());
+    add(&time, sizeof(time));
+    add(&length, sizeof(length));
+    add(&flags, sizeof(flags));
+
+    char cache[32];
+    std::snprintf(cache, sizeof(cache), "%016llx.assbin", static_cast<unsigned long long>(hash));
+    return dir + "/" + cache;
+}
+
+static void write_scene_cache(const std::string& file, const aiScene* scene) {
+
+    // Write to a file of our own and rename it into place, so that other instances
+    // sharing the cache never read a partial file.
+    std::string tmp =
+        file + "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    Assimp::Exporter exporter;
+    if(exporter.Export(scene, "assbin", tmp.c_str()) != AI_SUCCESS) {
+        warn("Failed to write scene cache file %s: %s", tmp.c_str(), exporter.GetErrorString());
+        std::remove(tmp.c_str());
+        return;
+    }
+    if(std::rename(tmp.c_str(), file.c_str()) != 0) std::remove(tmp.c_str());
+}
+
+// Passes on assimp's parsing progress, and stops parsing once the load is cancelled
+class Load_Progress : public Assimp::ProgressHandler {
+public:
+    Load_Progress(std::atomic<float>& parsed, const std::atomic<bool>& cancel)
+        : parsed(parsed), cancel(cancel) {
+    }
+    bool Update(float percentage) override {
+        if(percentage >= 0.0f) parsed = std::min(percentage, 1.0f);
+        return !cancel;
+    }
+
+private:
+    std::atomic<float>& parsed;
+    const std::atomic<bool>& cancel;
+};
+
+// A load in progress. Parsing and converting meshes touch nothing but this, so the
+// scene stays in use until finish_load adds the results.
+struct Scene::Pending_Load {
+    Load_Opts opts;
+    std::string file, error;
+
+    Mapped_File cached;
+    Assimp::Importer importer;
+    const aiScene* scene = nullptr;
+    std::vector<Node_Mesh> meshes;
+
+    std::atomic<float> parsed = 0.0f;
+    std::atomic<size_t> n_meshes = 0, converted = 0;
+    std::atomic<bool> cancel = false;
+
+    // Last, so that it is destroyed first, waiting for the work to stop
+    Task_Group task{parallel_pool()};
+};
+
+Scene::~Scene() = default;
+
+void Scene::begin_load(Load_Opts loader, std::string file) {
+
+    assert(!pending);
+    pending = std::make_unique<Pending_Load>();
+    Pending_Load& load = *pending;
+    load.opts = loader;
+    load.file = file;
+
+    load.task.run([&load]() {
+        PROFILE_ZONE("Import Scene");
+        unsigned int flags = load_flags(load.opts);
+        std::string cache = load.opts.cache_dir.empty()
+                                ? std::string()
+                                : scene_cache_file(load.opts.cache_dir, load.file, flags);
+
+        Assimp::Importer& importer = load.importer;
+        importer.SetProgressHandler(new Load_Progress(load.parsed, load.cancel));
+
+        // A cached import was already post-processed, except for linking bones to
+        // their nodes, which the binary form does not keep
+        if(!cache.empty() && load.cached.open(cache)) {
+            load.scene = importer.ReadFileFromMemory(load.cached.data(), load.cached.size(),
+                                                     flags & aiProcess_PopulateArmatureData,
+                                                     "assbin");
+            if(!load.scene && !load.cancel) {
+                warn("Ignoring unreadable scene cache file %s", cache.c_str());
+            }
+        }
+
+        if(!load.scene && !load.cancel) {
+            load.scene = importer.ReadFile(load.file.c_str(), flags);
+            if(load.scene && !cache.empty()) write_scene_cache(cache, load.scene);
+        }
+        if(!load.scene) {
+            load.error = load.cancel ? "Loading " + load.file + " was cancelled."
+                                     : "Parsing scene " + load.file + ": " +
+                                           std::string(importer.GetErrorString());
+            return;
+        }
+        load.parsed = 1.0f;
+
+        find_meshes(load.scene, load.scene->mRootNode, aiMatrix4x4(), load.meshes);
+        find_instances(load.meshes);
+        load.n_meshes = load.meshes.size();
+        parallel_for(0, load.meshes.size(), 1, [&load](size_t i) {
+            if(load.cancel) return;
+            convert_mesh(load.meshes[i], load.opts.defer_halfedge);
+            load.converted++;
+        });
+        if(load.cancel) load.error = "Loading " + load.file + " was cancelled.";
+    });
+}
+
+bool Scene::loading() const {
+    return pending != nullptr;
+}
+
+bool Scene::load_ready() const {
+    return pending && pending->task.done();
+}
+
+float Scene::load_progress() const {
+    if(!pending) return 0.0f;
+    // Parsing takes most of the time, even with a cache to read from
+    size_t n = pending->n_meshes;
+    float converted = n ? (float)pending->converted / n : 0.0f;
+    return 0.8f * pending->parsed + 0.2f * converted;
+}
+
+void Scene::cancel_load() {
+    if(!pending) return;
+    pending->cancel = true;
+    pending.reset();
+}
+
 std::string Scene::load(Scene::Load_Opts loader, Undo& undo, Gui::Manager& gui, std::string file) {
+    begin_load(std::move(loader), std::move(file));
+    return finish_load(undo, gui);
+}
+
+std::string Scene::finish_load(Undo& undo, Gui::Manager& gui) {
+
+    assert(pending);
+    PROFILE_ZONE("Load Scene");
+    std::unique_ptr<Pending_Load> load = std::move(pending);
+    load->task.wait();
+    if(!load->error.empty()) return load->error;
+
+    const Load_Opts& loader = load->opts;
+    const aiScene* scene = load->scene;
 
     if(loader.new_scene) {
         clear(undo);
@@ -630,13 +941,6 @@ std::string Scene::load(Scene::Load_Opts loader, Undo& undo, Gui::Manager& gui,
         gui.get_rig().clear();
     }
 
-    Assimp::Importer importer;
-    const aiScene* scene = importer.ReadFile(file.c_str(), load_flags(loader));
-
-    if(!scene) {
-        return "Parsing scene " + file + ": " + std::string(importer.GetErrorString());
-    }
-
     std::vector<std::string> errors;
     std::unordered_map<aiNode*, Scene_ID> node_to_obj;
     std::unordered_map<aiNode*, Joint*> node_to_bone;
@@ -644,8 +948,19 @@ std::string Scene::load(Scene::Load_Opts loader, Undo& undo, Gui::Manager& gui,
     scene->mRootNode->mTransformation = aiMatrix4x4();
 
     // Load objects
-    load_node(*this, errors, node_to_obj, node_to_bone, node_to_ik, scene, scene->mRootNode,
-              aiMatrix4x4());
+    std::vector<Scene_ID> mesh_objs(load->meshes.size());
+    for(size_t i = 0; i < load->meshes.size(); i++) {
+        Node_Mesh& m = load->meshes[i];
+        Scene_Object* instance_of = nullptr;
+        if(m.source != SIZE_MAX) {
+            const Node_Mesh& source = load->meshes[m.source];
+            m.polys = source.polys;
+            m.err = source.err;
+            instance_of = &get<Scene_Object>(mesh_objs[m.source]);
+        }
+        mesh_objs[i] =
+            load_node(*this, errors, node_to_obj, node_to_bone, node_to_ik, scene, m, instance_of);
+    }
 
     // Load cameras
     if(loader.new_scene && scene->mNumCameras > 0) {
@@ -916,7 +1231,7 @@ static void write_particles(aiLight* ai_light, const Scene_Particles::Options& o
     ai_light->mDirection = aiVector3D(0.0f, 1.0f, 0.0f);
     ai_light->mUp = aiVector3D(0.0f, 1.0f, 0.0f);
     ai_light->mColorAmbient = aiColor3D(r.r, r.g, r.b);
-    ai_light->mColorDiffuse = aiColor3D(opt.pps, opt.dt, 0.0f);
+    ai_light->mColorDiffuse = aiColor3D(opt.pps, opt.dt, opt.collide ? 1.0f : 0.0f);
     ai_light->mAttenuationConstant = opt.scale;
     ai_light->mAttenuationLinear = opt.velocity;
     ai_light->mAttenuationQuadratic = opt.enabled ? opt.angle : -opt.angle;
@@ -1025,6 +1340,7 @@ static void write_hemesh(aiMesh* ai_mesh, const Halfedge_Mesh& mesh) {
     ai_mesh->mNumFaces = (unsigned int)n_faces;
 
     std::unordered_map<size_t, size_t> id_to_idx;
+    id_to_idx.reserve(n_verts);
 
     size_t vert_idx = 0;
     for(auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) {
@@ -1054,6 +1370,28 @@ static void write_hemesh(aiMesh* ai_mesh, const Halfedge_Mesh& mesh) {
     }
 }
 
+static void write_polygons(aiMesh* ai_mesh, const Scene_Object::Polygons& polys) {
+
+    size_t n_faces = polys.face_start.empty() ? 0 : polys.face_start.size() - 1;
+
+    ai_mesh->mVertices = new aiVector3D[polys.verts.size()];
+    ai_mesh->mNumVertices = (unsigned int)polys.verts.size();
+    for(size_t i = 0; i < polys.verts.size(); i++) {
+        ai_mesh->mVertices[i] = vecVec(polys.verts[i]);
+    }
+
+    ai_mesh->mFaces = new aiFace[n_faces];
+    ai_mesh->mNumFaces = (unsigned int)n_faces;
+    for(size_t f = 0; f < n_faces; f++) {
+        aiFace& face = ai_mesh->mFaces[f];
+        face.mNumIndices = (unsigned int)(polys.face_start[f + 1] - polys.face_start[f]);
+        face.mIndices = new unsigned int[face.mNumIndices];
+        for(unsigned int k = 0; k < face.mNumIndices; k++) {
+            face.mIndices[k] = (unsigned int)polys.corners[polys.face_start[f] + k];
+        }
+    }
+}
+
 static void write_mesh(aiMesh* ai_mesh, const GL::Mesh& mesh) {
     const auto& verts = mesh.verts();
     const auto& elems = mesh.indices();
@@ -1082,6 +1420,194 @@ static void write_mesh(aiMesh* ai_mesh, const GL::Mesh& mesh) {
     }
 }
 
+static bool has_ext(const std::string& file, const std::string& ext) {
+    return file.size() >= ext.size() &&
+           file.compare(file.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+// An object's mesh in whichever form the object keeps it, to be written in world space
+struct Export_Mesh {
+    std::string name;
+    Mat4 T;
+    bool flip = false;
+    const Scene_Object::Polygons* polys = nullptr;
+    const Halfedge_Mesh* hemesh = nullptr;
+    const GL::Mesh* mesh = nullptr;
+    size_t n_verts = 0, n_faces = 0;
+};
+
+// Calls f(p) on each vertex position
+template<typename F> static void export_verts(const Export_Mesh& m, F&& f) {
+    if(m.polys) {
+        for(Vec3 v : m.polys->verts) f(m.T * v);
+    } else if(m.hemesh) {
+        for(auto v = m.hemesh->vertices_begin(); v != m.hemesh->vertices_end(); v++) {
+            f(m.T * v->pos);
+        }
+    } else {
+        for(const GL::Mesh::Vert& v : m.mesh->verts()) f(m.T * v.pos);
+    }
+}
+
+// Calls f(corners, n) on each face, with corners indexing vertices in the order
+// export_verts visits them. Flipped meshes have their winding reversed.
+template<typename F> static void export_faces(const Export_Mesh& m, F&& f) {
+
+    std::vector<unsigned int> face;
+    auto emit = [&]() {
+        if(m.flip) std::reverse(face.begin(), face.end());
+        f(face.data(), face.size());
+        face.clear();
+    };
+
+    if(m.polys) {
+        const Scene_Object::Polygons& p = *m.polys;
+        for(size_t i = 0; i + 1 < p.face_start.size(); i++) {
+            for(size_t c = p.face_start[i]; c < p.face_start[i + 1]; c++) {
+                face.push_back((unsigned int)p.corners[c]);
+            }
+            emit();
+        }
+    } else if(m.hemesh) {
+        std::unordered_map<unsigned int, unsigned int> id_to_idx;
+        id_to_idx.reserve(m.n_verts);
+        unsigned int idx = 0;
+        for(auto v = m.hemesh->vertices_begin(); v != m.hemesh->vertices_end(); v++) {
+            id_to_idx[v->id()] = idx++;
+        }
+        for(auto f = m.hemesh->faces_begin(); f != m.hemesh->faces_end(); f++) {
+            if(f->is_boundary()) continue;
+            auto h = f->halfedge();
+            do {
+                face.push_back(id_to_idx[h->vertex()->id()]);
+                h = h->next();
+            } while(h != f->halfedge());
+            emit();
+        }
+    } else {
+        const auto& idxs = m.mesh->indices();
+        for(size_t i = 0; i + 2 < idxs.size(); i += 3) {
+            face.assign(idxs.begin() + i, idxs.begin() + i + 3);
+            emit();
+        }
+    }
+}
+
+// Formats blocks [0, n) in parallel, a pool's worth at a time, writing each wave in
+// order before starting the next, so that only that many are ever held at once
+static bool write_blocks(std::FILE* out, size_t n,
+                         const std::function<void(size_t, std::string&)>& format) {
+    size_t wave = std::max<size_t>(parallel_pool().size(), 1);
+    std::vector<std::string> bufs(std::min(wave, n));
+    for(size_t b = 0; b < n; b += wave) {
+        size_t e = std::min(b + wave, n);
+        parallel_for(b, e, 1, [&](size_t i) {
+            bufs[i - b].clear();
+            format(i, bufs[i - b]);
+        });
+        for(size_t i = b; i < e; i++) {
+            const std::string& buf = bufs[i - b];
+            if(std::fwrite(buf.data(), 1, buf.size(), out) != buf.size()) return false;
+        }
+    }
+    return true;
+}
+
+std::string Scene::write_meshes(std::string file) {
+
+    std::vector<Export_Mesh> meshes;
+    for(Scene_Item* item : typed[Scene_Item::type_of<Scene_Object>()]) {
+
+        Scene_Object& obj = item->get<Scene_Object>();
+
+        if(obj.is_shape()) {
+            obj.try_make_editable(obj.opt.shape_type);
+        }
+
+        Export_Mesh m;
+        m.name = std::string(obj.opt.name);
+        std::replace(m.name.begin(), m.name.end(), ' ', '_');
+        m.T = obj.pose.transform();
+
+        if((m.polys = obj.polygons())) {
+            m.flip = m.polys->flip;
+            m.n_verts = m.polys->verts.size();
+            m.n_faces = m.polys->face_start.empty() ? 0 : m.polys->face_start.size() - 1;
+        } else if(obj.is_editable()) {
+            m.hemesh = &std::as_const(obj).get_mesh();
+            m.flip = m.hemesh->flipped();
+            m.n_verts = m.hemesh->n_vertices();
+            m.n_faces = m.hemesh->n_faces() - m.hemesh->n_boundaries();
+        } else {
+            m.mesh = &obj.mesh();
+            m.n_verts = m.mesh->verts().size();
+            m.n_faces = m.mesh->indices().size() / 3;
+        }
+        meshes.push_back(std::move(m));
+    }
+
+    // Objects share one vertex list, so each one's indices start after the last's
+    std::vector<size_t> base(meshes.size() + 1, 0);
+    for(size_t i = 0; i < meshes.size(); i++) base[i + 1] = base[i] + meshes[i].n_verts;
+    size_t n_faces = 0;
+    for(const Export_Mesh& m : meshes) n_faces += m.n_faces;
+
+    std::FILE* out = std::fopen(file.c_str(), "wb");
+    if(!out) return "Failed to open " + file + " for writing.";
+
+    bool ok = true;
+    if(has_ext(file, ".ply")) {
+
+        std::string header = "ply\nformat binary_little_endian 1.0\n";
+        header += "element vertex " + std::to_string(base.back()) + "\n";
+        header += "property float x\nproperty float y\nproperty float z\n";
+        header += "element face " + std::to_string(n_faces) + "\n";
+        header += "property list uint int vertex_indices\nend_header\n";
+        ok = std::fwrite(header.data(), 1, header.size(), out) == header.size();
+
+        auto put = [](std::string& buf, const void* data, size_t size) {
+            buf.append((const char*)data, size);
+        };
+        ok = ok && write_blocks(out, meshes.size(), [&](size_t i, std::string& buf) {
+            buf.reserve(meshes[i].n_verts * sizeof(Vec3));
+            export_verts(meshes[i], [&](Vec3 p) { put(buf, p.data, sizeof(Vec3)); });
+        });
+        ok = ok && write_blocks(out, meshes.size(), [&](size_t i, std::string& buf) {
+            export_faces(meshes[i], [&](const unsigned int* corners, size_t n) {
+                uint32_t count = (uint32_t)n;
+                put(buf, &count, sizeof(count));
+                for(size_t k = 0; k < n; k++) {
+                    int32_t idx = (int32_t)(base[i] + corners[k]);
+                    put(buf, &idx, sizeof(idx));
+                }
+            });
+        });
+
+    } else {
+
+        ok = write_blocks(out, meshes.size(), [&](size_t i, std::string& buf) {
+            char line[128];
+            buf += "o " + meshes[i].name + "\n";
+            export_verts(meshes[i], [&](Vec3 p) {
+                int n = std::snprintf(line, sizeof(line), "v %.9g %.9g %.9g\n", p.x, p.y, p.z);
+                buf.append(line, (size_t)n);
+            });
+            export_faces(meshes[i], [&](const unsigned int* corners, size_t n) {
+                buf += 'f';
+                for(size_t k = 0; k < n; k++) {
+                    int l = std::snprintf(line, sizeof(line), " %zu", base[i] + corners[k] + 1);
+                    buf.append(line, (size_t)l);
+                }
+                buf += '\n';
+            });
+        });
+    }
+
+    if(std::fclose(out) != 0) ok = false;
+    if(!ok) return "Failed to write " + file + ".";
+    return {};
+}
+
 static void write_cam(aiCamera* ai_cam, const Camera& cam, std::string name) {
     ai_cam->mAspect = cam.get_ar();
     ai_cam->mClipPlaneNear = cam.get_ap();
@@ -1195,6 +1721,9 @@ Scene::Stats Scene::get_stats(const Gui::Animate& animation) {
 std::string Scene::write(std::string file, const Camera& render_cam,
                          const Gui::Animate& animation) {
 
+    // These formats hold geometry alone, which needs no aiScene
+    if(has_ext(file, ".obj") || has_ext(file, ".ply")) return write_meshes(file);
+
     size_t mesh_idx = 0, light_idx = 0, node_idx = 0, anim_idx = 0;
     Stats N = get_stats(animation);
 
@@ -1277,11 +1806,15 @@ std::string Scene::write(std::string file, const Camera& render_cam,
     std::unordered_map<Scene_ID, aiNode*> item_nodes;
     std::unordered_map<std::pair<Scene_ID, Scene_ID>, aiNode*> bone_nodes;
 
-    for(auto& entry : objs) { // Scene Objects
+    // Copying mesh data touches only its own aiMesh, so it runs once the nodes are set
+    // up, for all meshes at once
+    std::vector<std::function<void()>> mesh_copies;
+
+    for(Scene_Item* entry : items) { // Scene Objects
 
-        if(entry.second.is<Scene_Object>()) {
+        if(entry->is<Scene_Object>()) {
 
-            Scene_Object& obj = entry.second.get<Scene_Object>();
+            Scene_Object& obj = entry->get<Scene_Object>();
 
             if(obj.is_shape()) {
                 obj.try_make_editable(obj.opt.shape_type);
@@ -1301,8 +1834,10 @@ std::string Scene::write(std::string file, const Camera& render_cam,
                 std::replace(name.begin(), name.end(), ' ', '_');
                 name += "-S3D-" + std::to_string(obj.id());
 
-                if(obj.get_mesh().flipped()) name += "-" + FLIPPED_TAG;
+                const Scene_Object::Polygons* polys = obj.polygons();
+                if(polys ? polys->flip : obj.get_mesh().flipped()) name += "-" + FLIPPED_TAG;
                 if(obj.opt.smooth_normals) name += "-" + SMOOTHED_TAG;
+                if(obj.opt.portal) name += "-" + PORTAL_TAG;
             }
 
             ai_mesh->mName = aiString(name);
@@ -1315,10 +1850,14 @@ std::string Scene::write(std::string file, const Camera& render_cam,
             ai_node->mTransformation = matMat(trans);
             item_nodes[obj.id()] = ai_node;
 
-            if(obj.is_editable()) {
-                write_hemesh(ai_mesh, obj.get_mesh());
+            if(const Scene_Object::Polygons* polys = obj.polygons()) {
+                mesh_copies.push_back([ai_mesh, polys]() { write_polygons(ai_mesh, *polys); });
+            } else if(obj.is_editable()) {
+                const Halfedge_Mesh* hemesh = &std::as_const(obj).get_mesh();
+                mesh_copies.push_back([ai_mesh, hemesh]() { write_hemesh(ai_mesh, *hemesh); });
             } else {
-                write_mesh(ai_mesh, obj.mesh());
+                const GL::Mesh* mesh = &obj.mesh();
+                mesh_copies.push_back([ai_mesh, mesh]() { write_mesh(ai_mesh, *mesh); });
             }
 
             float r = -1.0f;
@@ -1424,9 +1963,9 @@ std::string Scene::write(std::string file, const Camera& render_cam,
                 add_node(name + "-" + MAT_ANIM1);
             }
 
-        } else if(entry.second.is<Scene_Particles>()) {
+        } else if(entry->is<Scene_Particles>()) {
 
-            const Scene_Particles& particles = entry.second.get<Scene_Particles>();
+            const Scene_Particles& particles = entry->get<Scene_Particles>();
 
             std::string name(particles.opt.name);
             {
@@ -1462,7 +2001,8 @@ std::string Scene::write(std::string file, const Camera& render_cam,
             ai_mesh->mBones = nullptr;
             ai_mesh->mName = aiString(name + "-MESH");
 
-            write_mesh(ai_mesh, particles.mesh());
+            const GL::Mesh* mesh = &particles.mesh();
+            mesh_copies.push_back([ai_mesh, mesh]() { write_mesh(ai_mesh, *mesh); });
 
             ai_mesh_node->mName = aiString(name + "-" + EMITTER_ANIM);
             ai_mesh_node->mNumMeshes = 1;
@@ -1470,9 +2010,9 @@ std::string Scene::write(std::string file, const Camera& render_cam,
             ai_mesh_node->mTransformation =
                 matMat(Mat4::translate(Vec3{particles.opt.lifetime, 0.0f, 0.0f}));
 
-        } else if(entry.second.is<Scene_Light>()) {
+        } else if(entry->is<Scene_Light>()) {
 
-            const Scene_Light& light = entry.second.get<Scene_Light>();
+            const Scene_Light& light = entry->get<Scene_Light>();
 
             std::string name(light.opt.name);
             std::replace(name.begin(), name.end(), ' ', '_');
@@ -1503,6 +2043,8 @@ std::string Scene::write(std::string file, const Camera& render_cam,
         }
     }
 
+    parallel_for(0, mesh_copies.size(), 1, [&mesh_copies](size_t i) { mesh_copies[i](); });
+
     { // Animation data
         auto write_anim = [ai_anim = scene.mAnimations[0], &anim_idx](std::string name,
                                                                       auto splines, auto get_info) {
@@ -1540,9 +2082,9 @@ std::string Scene::write(std::string file, const Camera& render_cam,
                        return {p, r, Vec3{fov, ap + 1.0f, d}};
                    });
 
-        for(auto& entry : objs) {
+        for(Scene_Item* entry : items) {
 
-            Scene_Item& item = entry.second;
+            Scene_Item& item = *entry;
             const Anim_Pose& pose = item.animation();
             aiNode* node = item_nodes[item.id()];
 
@@ -1629,9 +2171,11 @@ std::string Scene::write(std::string file, const Camera& render_cam,
         }
     }
 
-    // Note: exporter/scene destructor will free everything
+    // Note: exporter/scene destructor will free everything. Files named .assbin get
+    // assimp's binary form, which reloads without any text parsing.
+    bool binary = has_ext(file, ".assbin");
     Assimp::Exporter exporter;
-    if(exporter.Export(&scene, "collada", file.c_str())) {
+    if(exporter.Export(&scene, binary ? "assbin" : "collada", file.c_str())) {
         return std::string(exporter.GetErrorString());
     }
     return {};
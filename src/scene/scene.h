@@ -1,9 +1,12 @@
 
 #pragma once
 
+#include <array>
 #include <functional>
-#include <map>
+#include <memory>
 #include <optional>
+#include <unordered_map>
+#include <vector>
 
 #include "../geometry/halfedge.h"
 #include "../lib/mathlib.h"
@@ -43,7 +46,10 @@ public:
     const Pose& pose() const;
     Anim_Pose& animation();
     const Anim_Pose& animation() const;
-    void set_time(float time);
+    // Unless forced, items whose animation can't have changed value since the last
+    // call skip evaluating it (see Spline_Cursor)
+    void set_time(float time, bool force = false);
+    void bake_frames(size_t n);
     void step(const PT::Object& scene, float dt);
 
     std::string name() const;
@@ -59,6 +65,22 @@ public:
         return std::get<T>(data);
     }
 
+    // Which of the types an item can be it is, as an index (see Scene::for_each)
+    static constexpr size_t n_types = 3;
+    size_t type() const {
+        return data.index();
+    }
+    template<typename T> static constexpr size_t type_of() {
+        if constexpr(std::is_same_v<T, Scene_Object>) {
+            return 0;
+        } else if constexpr(std::is_same_v<T, Scene_Light>) {
+            return 1;
+        } else {
+            static_assert(std::is_same_v<T, Scene_Particles>);
+            return 2;
+        }
+    }
+
 private:
     std::variant<Scene_Object, Scene_Light, Scene_Particles> data;
 };
@@ -68,7 +90,7 @@ using Scene_Maybe = std::optional<std::reference_wrapper<Scene_Item>>;
 class Scene {
 public:
     Scene(Scene_ID start);
-    ~Scene() = default;
+    ~Scene();
 
     struct Load_Opts {
         bool new_scene = false;
@@ -79,19 +101,39 @@ public:
         bool gen_smooth_normals = false;
         bool fix_infacing_normals = false;
         bool debone = false;
+        // Keep meshes as loaded, building halfedge connectivity only once edited
+        bool defer_halfedge = false;
+        // Existing directory in which to keep imported scenes in assimp's binary form,
+        // keyed by file, modification time and the options above, so that reopening
+        // them skips parsing and post-processing
+        std::string cache_dir;
     };
 
     std::string write(std::string file, const Camera& cam, const Gui::Animate& animation);
     std::string load(Load_Opts opt, Undo& undo, Gui::Manager& gui, std::string file);
+
+    // Loads in two steps, so that the slow part can run behind the UI: begin_load
+    // parses the file and converts its meshes on the thread pool, without touching
+    // the scene, and finish_load adds the results (clearing the scene first for a
+    // new one). Only one load may be pending at a time.
+    void begin_load(Load_Opts opt, std::string file);
+    // Waits for the pending load if it is not ready, then adds it to the scene
+    std::string finish_load(Undo& undo, Gui::Manager& gui);
+    // Drops the pending load, waiting only for work already under way to stop
+    void cancel_load();
+    bool loading() const;
+    bool load_ready() const;
+    // Roughly the fraction of the pending load done so far
+    float load_progress() const;
     void clear(Undo& undo);
 
     bool empty();
     size_t size();
 
     template<typename T> Scene_ID add(T&& obj) {
-        assert(objs.find(obj.id()) == objs.end());
-        objs.emplace(std::make_pair(obj.id(), std::move(obj)));
-        return obj.id();
+        Scene_ID id = obj.id();
+        insert(std::make_unique<Scene_Item>(std::move(obj)));
+        return id;
     }
 
     Scene_ID add(Pose pose, GL::Mesh&& mesh, std::string n = {}, Scene_ID id = 0);
@@ -102,16 +144,35 @@ public:
     void erase(Scene_ID id);
     void restore(Scene_ID id);
 
-    void for_items(std::function<void(Scene_Item&)> func);
-    void for_items(std::function<void(const Scene_Item&)> func) const;
+    // Calls f on every item, in id order. Items f adds are visited too; f must not
+    // erase any.
+    template<typename F> void for_items(F&& f) {
+        for(size_t i = 0; i < items.size(); i++) f(*items[i]);
+    }
+    template<typename F> void for_items(F&& f) const {
+        for(size_t i = 0; i < items.size(); i++) f(static_cast<const Scene_Item&>(*items[i]));
+    }
+    // As for_items, but only over items of type T (a Scene_Object, Scene_Light or
+    // Scene_Particles), without visiting the rest
+    template<typename T, typename F> void for_each(F&& f) {
+        const std::vector<Scene_Item*>& list = typed[Scene_Item::type_of<T>()];
+        for(size_t i = 0; i < list.size(); i++) f(list[i]->get<T>());
+    }
+    template<typename T, typename F> void for_each(F&& f) const {
+        const std::vector<Scene_Item*>& list = typed[Scene_Item::type_of<T>()];
+        for(size_t i = 0; i < list.size(); i++) f(static_cast<const T&>(list[i]->get<T>()));
+    }
+    template<typename T> size_t count() const {
+        return typed[Scene_Item::type_of<T>()].size();
+    }
 
     Scene_Maybe get(Scene_ID id);
 
     template<typename T> T& get(Scene_ID id) {
-        auto entry = objs.find(id);
-        assert(entry != objs.end());
-        assert(entry->second.is<T>());
-        return entry->second.get<T>();
+        auto entry = index.find(id);
+        assert(entry != index.end());
+        assert(entry->second->is<T>());
+        return entry->second->get<T>();
     }
 
     std::string set_env_map(std::string file);
@@ -120,6 +181,24 @@ public:
     bool has_obj() const;
     bool has_sim() const;
 
+    // Memory the scene's items hold on the CPU, by what holds it
+    struct Memory {
+        // Halfedge meshes, and polygons kept until a halfedge mesh is built
+        size_t halfedge = 0;
+        // GL mesh copies, including posed and simplified ones
+        size_t meshes = 0;
+        // Joint weights and cached skinned poses
+        size_t skinning = 0;
+        size_t particles = 0;
+        // Light emissive maps
+        size_t images = 0;
+
+        size_t total() const {
+            return halfedge + meshes + skinning + particles + images;
+        }
+    };
+    Memory memory() const;
+
 private:
     struct Stats {
         unsigned int meshes = 0;
@@ -131,8 +210,21 @@ private:
         unsigned int nodes = 0;
     };
     Stats get_stats(const Gui::Animate& animation);
-
-    std::map<Scene_ID, Scene_Item> objs;
-    std::map<Scene_ID, Scene_Item> erased;
+    // Writes object meshes alone to an OBJ or PLY file, straight from how each is kept
+    std::string write_meshes(std::string file);
+
+    struct Pending_Load;
+    std::unique_ptr<Pending_Load> pending;
+
+    // Lists the item (which must have a new id) and takes ownership of it
+    void insert(std::unique_ptr<Scene_Item> item);
+
+    // Items are allocated one at a time, so references to them stay valid as others
+    // come and go, and found by id through the index. They are iterated through dense
+    // lists of pointers, of them all and of each type, kept in id order (which files
+    // are written in). Erased items are kept for undo.
+    std::unordered_map<Scene_ID, std::unique_ptr<Scene_Item>> index, erased;
+    std::vector<Scene_Item*> items;
+    std::array<std::vector<Scene_Item*>, Scene_Item::n_types> typed;
     Scene_ID next_id, first_id;
 };
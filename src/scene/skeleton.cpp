@@ -22,9 +22,20 @@ bool Joint::is_root() const {
     return !parent;
 }
 
-void Joint::for_joints(std::function<void(Joint*)> func) {
-    func(this);
-    for(Joint* j : children) j->for_joints(func);
+Quat Joint::rotation() const {
+    if(!rotation_valid || rotation_pose != pose) {
+        cached_rotation = Quat::euler(pose);
+        rotation_pose = pose;
+        rotation_valid = true;
+    }
+    return cached_rotation;
+}
+
+void Joint::set_rotation(Quat q) {
+    cached_rotation = q.unit();
+    pose = cached_rotation.to_euler();
+    rotation_pose = pose;
+    rotation_valid = true;
 }
 
 Skeleton::Skeleton() {
@@ -44,12 +55,107 @@ Skeleton::~Skeleton() {
     for(IK_Handle* h : erased_handles) delete h;
 }
 
+const std::vector<Joint*>& Skeleton::joint_order() const {
+
+    Joint_Transforms& xf = cached_transforms;
+    if(!reorder) return xf.joints;
+
+    // Popping a joint before pushing its children puts every parent first
+    xf.joints.clear();
+    xf.parents.clear();
+    std::vector<Joint*> stack(roots.begin(), roots.end());
+    while(!stack.empty()) {
+        Joint* j = stack.back();
+        stack.pop_back();
+        j->index = xf.joints.size();
+        xf.joints.push_back(j);
+        xf.parents.push_back(j->parent ? (int)j->parent->index : -1);
+        stack.insert(stack.end(), j->children.begin(), j->children.end());
+    }
+
+    size_t n = xf.joints.size();
+    xf.pose.resize(n);
+    xf.extent.resize(n);
+    xf.bind.resize(n);
+    xf.bind_inv.resize(n);
+    xf.posed.resize(n);
+    xf.rotation.resize(n);
+    xf.rebuilt.assign(n, false);
+    xf.valid = false;
+    reorder = false;
+    return xf.joints;
+}
+
+const Joint_Transforms& Skeleton::transforms() const {
+
+    joint_order();
+    Joint_Transforms& xf = cached_transforms;
+
+    // A joint is rebuilt if it changed or its parent was rebuilt; parents come first,
+    // so one pass finds them all
+    for(size_t i = 0; i < xf.joints.size(); i++) {
+        const Joint* j = xf.joints[i];
+        int p = xf.parents[i];
+        bool stale = !xf.valid || (p >= 0 && xf.rebuilt[p]) || j->pose != xf.pose[i] ||
+                     j->extent != xf.extent[i];
+        xf.rebuilt[i] = stale;
+        if(!stale) continue;
+
+        // posed is the parent's, then a step along its extent, then this rotation:
+        // rotations compose as quaternions, and the joint's base is the parent's end
+        xf.pose[i] = j->pose;
+        xf.extent[i] = j->extent;
+        Vec3 origin;
+        if(p < 0) {
+            xf.bind[i] = Mat4::I;
+            xf.rotation[i] = j->rotation();
+        } else {
+            xf.bind[i] = xf.bind[p] * Mat4::translate(xf.extent[p]);
+            xf.rotation[i] = (xf.rotation[p] * j->rotation()).unit();
+            origin = xf.posed[p] * xf.extent[p];
+        }
+        xf.posed[i] = xf.rotation[i].to_mat();
+        xf.posed[i][3] = Vec4{origin, 1.0f};
+        // Bind transforms are only the translations of the extents up the chain
+        xf.bind_inv[i] = Mat4::translate(-xf.bind[i][3].xyz());
+    }
+    xf.valid = true;
+    return xf;
+}
+
+void Skeleton::skin_palette(const Skin_Weights& map, std::vector<Mat4>& palette) {
+
+    // Joints erased since find_joints() aren't in the cache, so are rebuilt
+    const Joint_Transforms& xf = transforms();
+    Mat4 base = Mat4::translate(base_pos), base_inv = Mat4::translate(-base_pos);
+    palette.resize(map.joints.size());
+    for(size_t k = 0; k < map.joints.size(); k++) {
+        const Joint* j = map.joints[k];
+        if(xf.has(j)) {
+            size_t i = xf.index(j);
+            palette[k] = base * xf.posed[i] * xf.bind_inv[i] * base_inv;
+        } else {
+            palette[k] = joint_to_posed(j) * joint_to_bind(j).inverse();
+        }
+    }
+}
+
+void Skeleton::skin_palette(const Skin_Weights& map, std::vector<Dual_Quat>& palette) {
+
+    // Joints only rotate and translate, so every bind-to-posed transform is rigid
+    std::vector<Mat4> mats;
+    skin_palette(map, mats);
+    palette.resize(mats.size());
+    for(size_t k = 0; k < mats.size(); k++) palette[k] = Dual_Quat::from_mat(mats[k]);
+}
+
 bool Skeleton::set_time(float time) {
     bool ret = false;
     for_joints([&ret, time](Joint* j) {
         if(j->anim.any()) {
-            j->pose = j->anim.at(time).to_euler();
-            ret = true;
+            Vec3 prev = j->pose;
+            j->set_rotation(j->anim.at(time));
+            ret |= prev != j->pose;
         }
     });
     for(IK_Handle* h : handles) {
@@ -62,8 +168,23 @@ bool Skeleton::set_time(float time) {
     return ret;
 }
 
-void Skeleton::for_joints(std::function<void(Joint*)> func) {
-    for(Joint* r : roots) r->for_joints(func);
+void Skeleton::bake_frames(size_t n) {
+    for_joints([n](Joint* j) { j->anim.bake_frames(n); });
+    for(IK_Handle* h : handles) h->anim.bake_frames(n);
+}
+
+uint64_t Skeleton::anim_version() {
+    uint64_t version = 0;
+    for_joints([&version](Joint* j) { version = spline_version(version, j->anim.version()); });
+    for(IK_Handle* h : handles) version = spline_version(version, h->anim.version());
+    return version;
+}
+
+bool Skeleton::anim_constant(float t0, float t1) {
+    bool ret = true;
+    for_joints([&ret, t0, t1](Joint* j) { ret = ret && j->anim.constant(t0, t1); });
+    for(IK_Handle* h : handles) ret = ret && h->anim.constant(t0, t1);
+    return ret;
 }
 
 void Skeleton::for_handles(std::function<void(Skeleton::IK_Handle*)> func) {
@@ -76,6 +197,7 @@ Joint* Skeleton::add_root(Vec3 extent) {
         j->anim.set(f, Quat{});
     }
     roots.insert(j);
+    reorder = true;
     return j;
 }
 
@@ -107,22 +229,34 @@ void Skeleton::render(const Mat4& view, Joint* jselect, IK_Handle* hselect, bool
 
     Renderer& R = Renderer::get();
 
-    Mat4 V = view * Mat4::translate(base_pos);
-    for_joints([&](Joint* j) {
+    const Joint_Transforms& xf = transforms();
+    const std::vector<Mat4>& to_skeleton = posed ? xf.posed : xf.bind;
+
+    Mat4 base = Mat4::translate(base_pos);
+    Mat4 V = view * base;
+
+    // Each kind of shape is one instanced draw. Instances are placed in the space view
+    // looks from, so moving the camera uploads nothing; posing uploads what moved.
+    std::vector<Renderer::Bone> bones;
+    bones.reserve(xf.joints.size());
+    for(size_t i = 0; i < xf.joints.size(); i++) {
+        const Joint* j = xf.joints[i];
+        bones.push_back({base * to_skeleton[i] * Mat4::rotate_to(j->extent), j->extent.norm(),
+                         j->radius, j->_id + offset});
+    }
+    {
         Renderer::MeshOpt opt;
-        opt.modelview =
-            V * (posed ? j->joint_to_posed() : j->joint_to_bind()) * Mat4::rotate_to(j->extent);
-        opt.id = j->_id + offset;
+        opt.modelview = view;
+        opt.id = 0;
         opt.alpha = 0.8f;
         opt.color = Gui::Color::hover;
-        R.capsule(opt, j->extent.norm(), j->radius);
-    });
+        R.bones(opt, bones);
+    }
 
     if(jselect) {
         R.begin_outline();
 
-        Mat4 model = Mat4::translate(base_pos) *
-                     (posed ? jselect->joint_to_posed() : jselect->joint_to_bind()) *
+        Mat4 model = Mat4::translate(base_pos) * to_skeleton[xf.index(jselect)] *
                      Mat4::rotate_to(jselect->extent);
 
         Renderer::MeshOpt opt;
@@ -137,32 +271,45 @@ void Skeleton::render(const Mat4& view, Joint* jselect, IK_Handle* hselect, bool
     R.reset_depth();
 
     {
-        Renderer::MeshOpt opt;
-        opt.id = root_id + offset;
-        opt.modelview = V * Mat4::scale(Vec3{0.1f});
-        opt.color = root ? Gui::Color::outline : Gui::Color::hover;
-        R.sphere(opt);
-    }
+        std::vector<GL::Instances::Info> spheres;
+        spheres.reserve(xf.joints.size() + 1);
+        spheres.push_back({root_id + offset, base * Mat4::scale(Vec3{0.1f})});
+        for(size_t i = 0; i < xf.joints.size(); i++) {
+            const Joint* j = xf.joints[i];
+            Mat4 T = base * to_skeleton[i] * Mat4::translate(j->extent) *
+                     Mat4::scale(Vec3{j->radius * 0.25f});
+            spheres.push_back({j->_id + offset, T});
+        }
 
-    for_joints([&](Joint* j) {
+        unsigned int root_sel = root_id + offset;
         Renderer::MeshOpt opt;
-        opt.modelview = V * (posed ? j->joint_to_posed() : j->joint_to_bind()) *
-                        Mat4::translate(j->extent) * Mat4::scale(Vec3{j->radius * 0.25f});
-        opt.id = j->_id + offset;
-        opt.color = jselect == j ? Gui::Color::outline : Gui::Color::hover;
-        R.sphere(opt);
-    });
+        opt.modelview = view;
+        opt.id = 0;
+        opt.color = Gui::Color::hover;
+        opt.sel_color = Gui::Color::outline;
+        opt.sel_id = jselect ? jselect->_id + offset : 0;
+        opt.sel_ids = &root_sel;
+        opt.n_sel_ids = root ? 1 : 0;
+        R.joints(opt, spheres);
+    }
 
     GL::Lines ik_lines;
+    std::vector<GL::Instances::Info> targets;
+    targets.reserve(handles.size());
     for(IK_Handle* h : handles) {
-        Renderer::MeshOpt opt;
-        opt.modelview = V * Mat4::translate(h->target) * Mat4::scale(Vec3{h->joint->radius * 0.3f});
-        opt.id = h->_id + offset;
-        opt.color = hselect == h ? Gui::Color::outline : Gui::Color::hoverg;
-        Vec3 j_world = posed ? posed_end_of(h->joint) : end_of(h->joint);
-        ik_lines.add(h->target, j_world - base_pos,
+        Mat4 T = base * Mat4::translate(h->target) * Mat4::scale(Vec3{h->joint->radius * 0.3f});
+        targets.push_back({h->_id + offset, T});
+        ik_lines.add(h->target, to_skeleton[xf.index(h->joint)] * h->joint->extent,
                      h->enabled ? Vec3(1.0f, 0.0f, 0.0f) : Vec3(0.0f));
-        R.sphere(opt);
+    }
+    {
+        Renderer::MeshOpt opt;
+        opt.modelview = view;
+        opt.id = 0;
+        opt.color = Gui::Color::hoverg;
+        opt.sel_color = Gui::Color::outline;
+        opt.sel_id = hselect ? hselect->_id + offset : 0;
+        R.handles(opt, targets);
     }
     R.lines(ik_lines, V);
 }
@@ -172,17 +319,20 @@ void Skeleton::outline(const Mat4& view, const Mat4& model, bool root, bool pose
 
     Renderer& R = Renderer::get();
     Mat4 base_t = Mat4::translate(base_pos);
+    const Joint_Transforms& xf = transforms();
 
-    for_joints([&](Joint* j) {
-        Mat4 M = model * base_t * (posed ? j->joint_to_posed() : j->joint_to_bind()) *
-                 Mat4::rotate_to(j->extent);
+    const std::vector<Mat4>& to_skeleton = posed ? xf.posed : xf.bind;
+
+    for(size_t i = 0; i < xf.joints.size(); i++) {
+        const Joint* j = xf.joints[i];
+        Mat4 M = model * base_t * to_skeleton[i] * Mat4::rotate_to(j->extent);
         Renderer::MeshOpt opt;
         opt.modelview = view;
         opt.id = j->_id + offset;
         opt.depth_only = true;
 
         R.capsule(opt, M, j->extent.norm(), j->radius, box);
-    });
+    }
 }
 
 bool Skeleton::is_root_id(unsigned int id) {
@@ -198,9 +348,7 @@ bool Skeleton::has_bones() const {
 }
 
 unsigned int Skeleton::n_bones() {
-    unsigned int n = 0;
-    for_joints([&n](Joint*) { n++; });
-    return n;
+    return (unsigned int)joint_order().size();
 }
 
 unsigned int Skeleton::n_handles() {
@@ -217,6 +365,7 @@ Joint* Skeleton::add_child(Joint* j, Vec3 e) {
         c->anim.set(f, Quat{});
     }
     j->children.insert(c);
+    reorder = true;
     return c;
 }
 
@@ -226,6 +375,7 @@ void Skeleton::restore(Joint* j) {
     } else {
         roots.insert(j);
     }
+    reorder = true;
 
     auto entry = erased.find(j);
     assert(entry != erased.end());
@@ -242,6 +392,7 @@ void Skeleton::erase(Joint* j) {
     } else {
         roots.erase(j);
     }
+    reorder = true;
     std::vector<IK_Handle*> herase;
     for(IK_Handle* h : handles) {
         if(h->joint == j) {
@@ -375,6 +526,131 @@ bool Skeleton::do_ik() {
         }
     }
     if(enabled.empty()) return false;
-    step_ik(std::move(enabled));
+    if(ik.solver == IK_Solver::damped_least_squares) {
+        solve_ik(enabled);
+    } else {
+        step_ik(std::move(enabled));
+    }
     return true;
 }
+
+void Skeleton::solve_ik(const std::vector<IK_Handle*>& active_handles) {
+
+    // The joints that move are those on the way from each handle's joint to its root;
+    // each has three angles, which the Jacobian takes in radians. column holds where
+    // each (by its index in transforms()) is in joints, if it is.
+    const Joint_Transforms& order = transforms();
+    std::vector<Joint*> joints;
+    std::vector<int> column(order.joints.size(), -1);
+    for(IK_Handle* h : active_handles) {
+        for(int i = (int)order.index(h->joint); i >= 0; i = order.parents[i]) {
+            if(column[i] >= 0) break;
+            column[i] = (int)joints.size();
+            joints.push_back(order.joints[i]);
+        }
+    }
+    size_t m = 3 * active_handles.size(), n = 3 * joints.size();
+
+    // Offsets of each handle's joint end from its target, as e; returns the sum of
+    // their squares, and the largest in worst
+    std::vector<float> e(m);
+    auto residual = [&](const Joint_Transforms& xf, float& worst) {
+        float sum = 0.0f;
+        worst = 0.0f;
+        for(size_t h = 0; h < active_handles.size(); h++) {
+            const Joint* j = active_handles[h]->joint;
+            Vec3 d = active_handles[h]->target - xf.posed[xf.index(j)] * j->extent;
+            for(int a = 0; a < 3; a++) e[3 * h + a] = d[a];
+            sum += d.norm_squared();
+            worst = std::max(worst, d.norm());
+        }
+        return sum;
+    };
+
+    float worst;
+    float err = residual(transforms(), worst);
+    float damping = ik.damping;
+    std::vector<float> J(m * n), A(m * m), y(m), saved_e;
+    std::vector<Vec3> saved_poses(joints.size());
+
+    for(int iter = 0; iter < ik.max_iters && worst > ik.tolerance; iter++) {
+
+        // Each angle turns the joint's end about an axis through the joint's base: z
+        // in the parent's frame, then y after z, then x after both (Mat4::euler)
+        const Joint_Transforms& xf = transforms();
+        std::fill(J.begin(), J.end(), 0.0f);
+        for(size_t h = 0; h < active_handles.size(); h++) {
+            const Joint* end_joint = active_handles[h]->joint;
+            Vec3 end = xf.posed[xf.index(end_joint)] * end_joint->extent;
+            for(int i = (int)xf.index(end_joint); i >= 0; i = xf.parents[i]) {
+                const Joint* j = xf.joints[i];
+                int p = xf.parents[i];
+                Quat frame = p >= 0 ? xf.rotation[p] : Quat{};
+                float cz = std::cos(Radians(j->pose.z)), sz = std::sin(Radians(j->pose.z));
+                float cy = std::cos(Radians(j->pose.y)), sy = std::sin(Radians(j->pose.y));
+                Vec3 axes[3] = {frame.rotate(Vec3{cz * cy, sz * cy, -sy}),
+                                frame.rotate(Vec3{-sz, cz, 0.0f}),
+                                frame.rotate(Vec3{0.0f, 0.0f, 1.0f})};
+                Vec3 arm = end - xf.posed[i] * Vec3{};
+                size_t col = 3 * column[i];
+                for(int a = 0; a < 3; a++) {
+                    Vec3 d = cross(axes[a], arm);
+                    for(int r = 0; r < 3; r++) J[(3 * h + r) * n + col + a] = d[r];
+                }
+            }
+        }
+
+        // Solve (J J^T + damping^2 I) y = e by Cholesky, then step the angles by J^T y
+        for(size_t r = 0; r < m; r++) {
+            for(size_t c = 0; c <= r; c++) {
+                float dot = 0.0f;
+                for(size_t k = 0; k < n; k++) dot += J[r * n + k] * J[c * n + k];
+                A[r * m + c] = dot + (r == c ? damping * damping : 0.0f);
+            }
+        }
+        for(size_t c = 0; c < m; c++) {
+            float d = A[c * m + c];
+            for(size_t k = 0; k < c; k++) d -= A[c * m + k] * A[c * m + k];
+            A[c * m + c] = std::sqrt(std::max(d, EPS_F));
+            for(size_t r = c + 1; r < m; r++) {
+                float v = A[r * m + c];
+                for(size_t k = 0; k < c; k++) v -= A[r * m + k] * A[c * m + k];
+                A[r * m + c] = v / A[c * m + c];
+            }
+        }
+        for(size_t r = 0; r < m; r++) {
+            float v = e[r];
+            for(size_t k = 0; k < r; k++) v -= A[r * m + k] * y[k];
+            y[r] = v / A[r * m + r];
+        }
+        for(size_t r = m; r-- > 0;) {
+            float v = y[r];
+            for(size_t k = r + 1; k < m; k++) v -= A[k * m + r] * y[k];
+            y[r] = v / A[r * m + r];
+        }
+
+        for(size_t i = 0; i < joints.size(); i++) {
+            saved_poses[i] = joints[i]->pose;
+            Vec3 step;
+            for(int a = 0; a < 3; a++) {
+                for(size_t r = 0; r < m; r++) step[a] += J[r * n + 3 * i + a] * y[r];
+            }
+            joints[i]->pose += Degrees(step);
+        }
+
+        // Steps that make things worse are undone and retried with more damping (so
+        // shorter, and closer to the gradient); good ones let the damping relax
+        saved_e = e;
+        float prev_worst = worst;
+        float next = residual(transforms(), worst);
+        if(next < err) {
+            err = next;
+            damping = std::max(damping * 0.5f, ik.damping * 0.01f);
+        } else {
+            for(size_t i = 0; i < joints.size(); i++) joints[i]->pose = saved_poses[i];
+            e = saved_e;
+            worst = prev_worst;
+            damping *= 4.0f;
+        }
+    }
+}
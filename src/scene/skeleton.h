@@ -12,6 +12,32 @@
 #include "../lib/mathlib.h"
 #include "../platform/gl.h"
 
+class Joint;
+
+// A skeleton's joints flattened into arrays in topological order (each after its
+// parent), one array per field, so that passes over the hierarchy run front to back
+// without chasing pointers. Alongside each joint are its transforms from its space to
+// skeleton space (not including base_pos), and the pose and extent they were built from.
+struct Joint_Transforms {
+    std::vector<Joint*> joints;
+    // Index of each joint's parent, or -1 for roots
+    std::vector<int> parents;
+    std::vector<Vec3> pose, extent;
+    std::vector<Mat4> bind, bind_inv, posed;
+    // The rotation part of posed, composed down the chain as quaternions
+    std::vector<Quat> rotation;
+
+    // Whether j is one of joints (it isn't once erased), and if so where
+    bool has(const Joint* j) const;
+    size_t index(const Joint* j) const;
+
+private:
+    // Which joints the last refresh rebuilt, and whether any came before this order
+    std::vector<bool> rebuilt;
+    bool valid = false;
+    friend class Skeleton;
+};
+
 class Joint {
 public:
     Joint(unsigned int id);
@@ -61,18 +87,36 @@ private:
     Vec3 angle_gradient;
 
     // Call this function recursively on your parent. At each call, compute the angle gradient for
-    // the joint corresponding to that call.
-    void compute_gradient(Vec3 target, Vec3 current);
+    // the joint corresponding to that call. xf holds the posed transform of every joint.
+    void compute_gradient(Vec3 target, Vec3 current, const Joint_Transforms& xf);
+
+    // pose as a quaternion, kept until pose changes. Animated joints get theirs
+    // straight from the spline, rather than back from the Euler angles.
+    Quat rotation() const;
+    void set_rotation(Quat q);
+    mutable Quat cached_rotation;
+    mutable Vec3 rotation_pose;
+    mutable bool rotation_valid = false;
 
-    void for_joints(std::function<void(Joint*)> func);
+    // Position in its skeleton's Joint_Transforms, as of the last time it was built
+    size_t index = 0;
 
     unsigned int _id = 0;
     Spline<Quat> anim;
 
     friend class Skeleton;
     friend class Scene;
+    friend struct Joint_Transforms;
 };
 
+inline bool Joint_Transforms::has(const Joint* j) const {
+    return j->index < joints.size() && joints[j->index] == j;
+}
+
+inline size_t Joint_Transforms::index(const Joint* j) const {
+    return j->index;
+}
+
 class Skeleton {
 public:
     struct IK_Handle {
@@ -88,6 +132,28 @@ public:
         unsigned int _id = 0;
     };
 
+    // How do_ik() solves: step_ik()'s Jacobian transpose descent, or damped least
+    // squares, which adapts its damping to the progress made. Both stop once every
+    // enabled handle's joint ends within tolerance of it.
+    enum class IK_Solver : int { jacobian_transpose, damped_least_squares, count };
+    static inline const char* IK_Solver_Names[] = {"Jacobian Transpose",
+                                                   "Damped Least Squares"};
+    struct IK_Options {
+        IK_Solver solver = IK_Solver::damped_least_squares;
+        int max_iters = 100;
+        float tolerance = 1e-3f;
+        float damping = 0.1f;
+    };
+    IK_Options ik;
+
+    // How skin() blends each vertex's joints: a weighted sum of their matrices, or of
+    // their dual quaternions, renormalized per vertex. The latter keeps volume where
+    // joints twist or bend far (no "candy wrapper"), and blends 8 floats per joint
+    // rather than 16.
+    enum class Skin_Mode : int { linear_blend, dual_quaternion, count };
+    static inline const char* Skin_Mode_Names[] = {"Linear Blend", "Dual Quaternion"};
+    Skin_Mode skin_mode = Skin_Mode::linear_blend;
+
     Skeleton();
     Skeleton(unsigned int obj_id);
     ~Skeleton();
@@ -109,8 +175,31 @@ public:
     Mat4 joint_to_bind(const Joint* j) const;
     Mat4 joint_to_posed(const Joint* j) const;
 
-    void find_joints(const GL::Mesh& src, std::vector<std::vector<Joint*>>& map);
-    void skin(const GL::Mesh& input, GL::Mesh& output, const std::vector<std::vector<Joint*>>& map);
+    // Which joints effect each vertex of a mesh and by how much (normalized), found in
+    // bind position by find_joints. Vertex i's influences are [offsets[i], offsets[i + 1])
+    // of influences (indices into joints) and weights.
+    struct Skin_Weights {
+        std::vector<const Joint*> joints;
+        std::vector<size_t> offsets;
+        std::vector<unsigned int> influences;
+        std::vector<float> weights;
+
+        void clear() {
+            joints.clear();
+            offsets.clear();
+            influences.clear();
+            weights.clear();
+        }
+    };
+
+    void find_joints(const GL::Mesh& src, Skin_Weights& map);
+    void skin(const GL::Mesh& input, GL::Mesh& output, const Skin_Weights& map);
+
+    // The bind-to-posed transform (in object space) of each of map's joints, which
+    // skinning blends by the weights
+    void skin_palette(const Skin_Weights& map, std::vector<Mat4>& palette);
+    // The same, as dual quaternions
+    void skin_palette(const Skin_Weights& map, std::vector<Dual_Quat>& palette);
 
     ////////////////////////////////////////////
 
@@ -126,7 +215,10 @@ public:
     Vec3 base_of(Joint* j);
     Vec3 posed_base_of(Joint* j);
 
-    void for_joints(std::function<void(Joint*)> func);
+    // Visits every joint, each after its parent
+    template<typename F> void for_joints(F&& func) {
+        for(Joint* j : joint_order()) func(j);
+    }
     void for_handles(std::function<void(IK_Handle*)> func);
 
     void erase(IK_Handle* handle);
@@ -134,12 +226,24 @@ public:
     IK_Handle* get_handle(unsigned int id);
     IK_Handle* add_handle(Vec3 pos, Joint* j);
     bool do_ik();
+    void solve_ik(const std::vector<IK_Handle*>& active_handles);
 
     Joint* add_root(Vec3 extent);
     Joint* add_child(Joint* j, Vec3 extent);
     bool is_root_id(unsigned int id);
 
+    // Transforms of every joint, built in one pass from the roots down. Each call
+    // rebuilds those of joints whose pose or extent changed since (and their
+    // descendants'), so fetch them once before looking up many. The joint order is
+    // only rebuilt when joints are added or erased.
+    const Joint_Transforms& transforms() const;
+
+    // Returns whether any joint's pose changed
     bool set_time(float time);
+    void bake_frames(size_t n);
+    // Of every joint and handle spline, as Spline::version() and constant()
+    uint64_t anim_version();
+    bool anim_constant(float t0, float t1);
     void render(const Mat4& view, Joint* jselect, IK_Handle* hselect, bool root, bool posed,
                 unsigned int offset = 0);
     void outline(const Mat4& view, const Mat4& model, bool root, bool posed, BBox& box,
@@ -169,5 +273,9 @@ private:
     std::unordered_set<Joint*> roots;
     std::unordered_map<Joint*, std::vector<IK_Handle*>> erased;
     std::unordered_set<IK_Handle*> handles, erased_handles;
+    mutable Joint_Transforms cached_transforms;
+    // Whether joints were added or erased since cached_transforms was ordered
+    mutable bool reorder = true;
+    const std::vector<Joint*>& joint_order() const;
     friend class Scene;
 };
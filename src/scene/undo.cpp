@@ -3,13 +3,15 @@
 #include "../gui/animate.h"
 #include "../gui/manager.h"
 #include "../gui/rig.h"
+#include "../util/lz4.h"
 
 Undo::Undo(Scene& sc, Gui::Manager& man) : scene(sc), gui(man) {
 }
 
 void Undo::reset() {
-    undos = {};
-    redos = {};
+    undos.clear();
+    redos.clear();
+    spill.reset();
 }
 
 Scene_Object& Undo::add_obj(Halfedge_Mesh&& mesh, std::string name) {
@@ -25,19 +27,7 @@ Scene_Object& Undo::add_obj(Halfedge_Mesh&& mesh, std::string name) {
 
 void Undo::update_mesh_full(Scene_ID id, Halfedge_Mesh&& old_mesh) {
 
-    Scene_Object& obj = scene.get<Scene_Object>(id);
-    Halfedge_Mesh new_mesh;
-    obj.copy_mesh(new_mesh);
-
-    action(
-        [id, this, nm = std::move(new_mesh)]() mutable {
-            Scene_Object& obj = scene.get<Scene_Object>(id);
-            obj.set_mesh(nm);
-        },
-        [id, this, om = std::move(old_mesh)]() mutable {
-            Scene_Object& obj = scene.get<Scene_Object>(id);
-            obj.set_mesh(om);
-        });
+    action(std::make_unique<MeshFullOp>(scene, id, std::move(old_mesh)));
 }
 
 void Undo::move_root(Scene_ID id, Vec3 old) {
@@ -274,16 +264,18 @@ void Undo::update_object(Scene_ID id, Scene_Object::Options old) {
         Halfedge_Mesh old_mesh;
         obj.copy_mesh(old_mesh);
 
+        // The mesh is kept aside while the object is a shape, and swapped back on undo
+        auto kept = std::make_shared<Halfedge_Mesh>(std::move(old_mesh));
         action(
-            [id, this, no = obj.opt]() {
+            [id, this, no = obj.opt, kept]() {
                 Scene_Object& obj = scene.get<Scene_Object>(id);
                 obj.opt = no;
-                obj.set_mesh_dirty();
+                obj.swap_mesh(*kept);
             },
-            [id, this, oo = old, om = std::move(old_mesh)]() mutable {
+            [id, this, oo = old, kept]() {
                 Scene_Object& obj = scene.get<Scene_Object>(id);
                 obj.opt = oo;
-                obj.set_mesh(om);
+                obj.swap_mesh(*kept);
             });
 
         return;
@@ -680,35 +672,166 @@ void Undo::set_max_frame(Gui::Animate& anim, unsigned int fnew, unsigned int fol
 }
 
 void Undo::action(std::unique_ptr<Action_Base>&& action) {
-    redos = {};
-    undos.push(std::move(action));
+    redos.clear();
+    undos.push_back(std::move(action));
     total_actions++;
+    enforce_budget();
 }
 
 void Undo::undo() {
     if(undos.empty()) return;
-    undos.top()->undo();
-    redos.push(std::move(undos.top()));
-    undos.pop();
+    undos.back()->undo();
+    redos.push_back(std::move(undos.back()));
+    undos.pop_back();
     total_actions++;
 }
 
 void Undo::redo() {
     if(redos.empty()) return;
-    redos.top()->redo();
-    undos.push(std::move(redos.top()));
-    redos.pop();
+    redos.back()->redo();
+    undos.push_back(std::move(redos.back()));
+    redos.pop_back();
     total_actions++;
 }
 
 void Undo::bundle_last(size_t n) {
 
+    // Some of them may have been forgotten to stay within budget
+    n = std::min(n, undos.size());
+
     std::vector<std::unique_ptr<Action_Base>> undo_pack;
     for(size_t i = 0; i < n; i++) {
-        undo_pack.push_back(std::move(undos.top()));
-        undos.pop();
+        undo_pack.push_back(std::move(undos.back()));
+        undos.pop_back();
+    }
+    undos.push_back(std::make_unique<Action_Bundle>(std::move(undo_pack)));
+}
+
+void Undo::set_budget(size_t budget, bool spill_to_disk) {
+    memory_budget = budget;
+    spill_old = spill_to_disk;
+    enforce_budget();
+}
+
+size_t Undo::memory() const {
+    size_t total = 0;
+    for(auto& a : undos) total += a->bytes();
+    for(auto& a : redos) total += a->bytes();
+    return total;
+}
+
+void Undo::enforce_budget() {
+
+    if(memory_budget == 0) return;
+    size_t used = memory();
+    if(used <= memory_budget) return;
+
+    // Pack the oldest records first, then spill them, leaving the newest alone so
+    // that undoing it stays instant
+    for(bool to_disk : {false, true}) {
+        if(to_disk && !spill_old) break;
+        if(to_disk && !spill) spill = std::make_unique<Undo_Spill>();
+        for(size_t i = 0; i + 1 < undos.size() && used > memory_budget; i++) {
+            size_t before = undos[i]->bytes();
+            undos[i]->pack(to_disk ? spill.get() : nullptr);
+            used = used - before + undos[i]->bytes();
+        }
+    }
+
+    // Forget the oldest records if that was not enough
+    while(used > memory_budget && undos.size() > 1) {
+        used -= undos.front()->bytes();
+        undos.pop_front();
+    }
+}
+
+Undo_Spill::~Undo_Spill() {
+    if(file) std::fclose(file);
+}
+
+static bool seek(std::FILE* file, long long offset) {
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+long long Undo_Spill::write(const std::vector<unsigned char>& data) {
+    if(!file) file = std::tmpfile();
+    if(!file || !seek(file, end)) return -1;
+    if(std::fwrite(data.data(), 1, data.size(), file) != data.size()) return -1;
+    long long at = end;
+    end += (long long)data.size();
+    return at;
+}
+
+bool Undo_Spill::read(long long offset, std::vector<unsigned char>& data) {
+    return file && seek(file, offset) &&
+           std::fread(data.data(), 1, data.size(), file) == data.size();
+}
+
+size_t Undo_Mesh::bytes() const {
+    switch(state) {
+    case State::live:
+        return mesh.n_vertices() * sizeof(Halfedge_Mesh::Vertex) +
+               mesh.n_edges() * sizeof(Halfedge_Mesh::Edge) +
+               mesh.n_faces() * sizeof(Halfedge_Mesh::Face) +
+               mesh.n_halfedges() * sizeof(Halfedge_Mesh::Halfedge);
+    case State::packed: return packed.capacity();
+    default: return 0;
+    }
+}
+
+void Undo_Mesh::pack() {
+    if(state != State::live) return;
+    std::vector<unsigned char> raw;
+    mesh.serialize(raw);
+    packed = LZ4::compress(raw.data(), raw.size());
+    packed.shrink_to_fit();
+    raw_size = raw.size();
+    mesh.clear();
+    state = State::packed;
+}
+
+void Undo_Mesh::spill(Undo_Spill& file) {
+    if(state != State::packed) return;
+    long long at = file.write(packed);
+    // If it could not be written, it stays in memory
+    if(at < 0) return;
+    offset = at;
+    packed_size = packed.size();
+    spilled_to = &file;
+    std::vector<unsigned char>().swap(packed);
+    state = State::spilled;
+}
+
+void Undo_Mesh::swap(Scene_Object& obj) {
+
+    if(state == State::live) {
+        obj.swap_mesh(mesh);
+        return;
+    }
+
+    std::vector<unsigned char> read;
+    if(state == State::spilled) {
+        read.resize(packed_size);
+        if(!spilled_to->read(offset, read)) {
+            warn("Failed to read undo history back from disk!");
+            return;
+        }
+    }
+    const std::vector<unsigned char>& src = state == State::packed ? packed : read;
+
+    std::vector<unsigned char> raw(raw_size);
+    if(!LZ4::decompress(src.data(), src.size(), raw.data(), raw.size()) ||
+       !mesh.deserialize(raw)) {
+        warn("Failed to unpack undo history!");
+        return;
     }
-    undos.push(std::make_unique<Action_Bundle>(std::move(undo_pack)));
+    std::vector<unsigned char>().swap(packed);
+    state = State::live;
+    obj.swap_mesh(mesh);
 }
 
 size_t Undo::n_actions() {
@@ -1,17 +1,27 @@
 
 #pragma once
 
+#include <cstdio>
+#include <deque>
 #include <memory>
-#include <stack>
 
 #include "../gui/animate.h"
 #include "../gui/manager.h"
 #include "../gui/widgets.h"
 #include "scene.h"
 
+class Undo_Spill;
+
 class Action_Base {
     virtual void undo() = 0;
     virtual void redo() = 0;
+    // Memory the action holds, and shrinking it once the action is old: packing what
+    // it holds, and given a spill file, moving it there
+    virtual size_t bytes() const {
+        return 0;
+    }
+    virtual void pack(Undo_Spill*) {
+    }
     friend class Undo;
     friend class Action_Bundle;
 
@@ -43,6 +53,14 @@ class Action_Bundle : public Action_Base {
     void redo() {
         for(auto i = list.rbegin(); i != list.rend(); i++) (*i)->redo();
     }
+    size_t bytes() const {
+        size_t total = 0;
+        for(auto& a : list) total += a->bytes();
+        return total;
+    }
+    void pack(Undo_Spill* spill) {
+        for(auto& a : list) a->pack(spill);
+    }
 
     std::vector<std::unique_ptr<Action_Base>> list;
 
@@ -51,26 +69,99 @@ public:
     ~Action_Bundle() = default;
 };
 
-template<typename T> class MeshOp : public Action_Base {
+// Where old undo records go once memory runs short: an anonymous temporary file,
+// deleted when closed
+class Undo_Spill {
+public:
+    Undo_Spill() = default;
+    ~Undo_Spill();
+
+    Undo_Spill(const Undo_Spill&) = delete;
+    Undo_Spill& operator=(const Undo_Spill&) = delete;
+
+    // Returns where data was written, or -1 if it could not be
+    long long write(const std::vector<unsigned char>& data);
+    // Reads back data.size() bytes written at offset
+    bool read(long long offset, std::vector<unsigned char>& data);
+
+private:
+    std::FILE* file = nullptr;
+    long long end = 0;
+};
+
+// A whole mesh kept by an undo record. Once the record is old the mesh may be packed
+// (serialized and compressed) and then spilled to disk; either way it is unpacked
+// when the record is undone or redone.
+class Undo_Mesh {
+public:
+    Undo_Mesh(Halfedge_Mesh&& mesh) : mesh(std::move(mesh)) {
+    }
+
+    size_t bytes() const;
+    void pack();
+    void spill(Undo_Spill& spill);
+    // Exchanges this mesh with the object's, which is then kept instead
+    void swap(Scene_Object& obj);
+
+private:
+    enum class State { live, packed, spilled };
+    State state = State::live;
+    Halfedge_Mesh mesh;
+    std::vector<unsigned char> packed;
+    size_t raw_size = 0, packed_size = 0;
+    Undo_Spill* spilled_to = nullptr;
+    long long offset = -1;
+};
+
+// A global operation. Only the mesh the object does not have is kept: the one from
+// before the operation, or after it once undone. As with MeshOp, the object's mesh
+// must not have changed since, so undo and redo just swap the two.
+class MeshFullOp : public Action_Base {
+    void undo() {
+        other.swap(scene.get<Scene_Object>(id));
+    }
+    void redo() {
+        other.swap(scene.get<Scene_Object>(id));
+    }
+    size_t bytes() const {
+        return other.bytes();
+    }
+    void pack(Undo_Spill* spill) {
+        other.pack();
+        if(spill) other.spill(*spill);
+    }
+    Scene& scene;
+    Scene_ID id;
+    Undo_Mesh other;
+
+public:
+    MeshFullOp(Scene& s, Scene_ID i, Halfedge_Mesh&& before)
+        : scene(s), id(i), other(std::move(before)) {
+    }
+    ~MeshFullOp() = default;
+};
+
+// A local operation, kept as the elements it changed rather than a copy of the mesh
+class MeshOp : public Action_Base {
     void undo() {
         Scene_Object& obj = scene.get<Scene_Object>(id);
-        obj.set_mesh(mesh);
+        obj.get_mesh().undo(delta);
+        obj.set_mesh_dirty();
     }
     void redo() {
         Scene_Object& obj = scene.get<Scene_Object>(id);
-        auto sel = obj.set_mesh(mesh, eid);
-        op(obj.get_mesh(), sel);
-        obj.get_mesh().do_erase();
+        obj.get_mesh().redo(delta);
+        obj.set_mesh_dirty();
+    }
+    size_t bytes() const {
+        return delta.bytes();
     }
     Scene& scene;
     Scene_ID id;
-    unsigned int eid;
-    T op;
-    Halfedge_Mesh mesh;
+    Halfedge_Mesh::Delta delta;
 
 public:
-    MeshOp(Scene& s, Scene_ID i, unsigned int e, Halfedge_Mesh&& m, T&& t)
-        : scene(s), id(i), eid(e), op(std::move(t)), mesh(std::move(m)) {
+    MeshOp(Scene& s, Scene_ID i, Halfedge_Mesh::Delta&& d) : scene(s), id(i), delta(std::move(d)) {
     }
     ~MeshOp() = default;
 };
@@ -113,12 +204,8 @@ public:
     void update_object(Scene_ID id, Scene_Object::Options old);
     void update_particles(Scene_ID id, Scene_Particles::Options old);
 
-    template<typename T>
-    void update_mesh(Scene_ID id, Halfedge_Mesh&& old, unsigned int e_id, T&& op) {
-        std::stack<std::unique_ptr<Action_Base>> empty;
-        redos.swap(empty);
-        undos.push(std::make_unique<MeshOp<T>>(scene, id, e_id, std::move(old), std::move(op)));
-        total_actions++;
+    void update_mesh(Scene_ID id, Halfedge_Mesh::Delta&& delta) {
+        action(std::make_unique<MeshOp>(scene, id, std::move(delta)));
     }
     void update_mesh_full(Scene_ID id, Halfedge_Mesh&& old_mesh);
 
@@ -144,6 +231,19 @@ public:
     void inc_actions();
     void bundle_last(size_t n);
 
+    // Once records hold more than budget bytes (0 for no limit), the oldest are
+    // packed, then spilled to disk if spill is set, or else forgotten. The newest
+    // record is always kept as it is.
+    void set_budget(size_t budget, bool spill);
+    size_t budget() const {
+        return memory_budget;
+    }
+    bool spills() const {
+        return spill_old;
+    }
+    // Bytes of memory held by records
+    size_t memory() const;
+
 private:
     Scene& scene;
     Gui::Manager& gui;
@@ -154,8 +254,14 @@ private:
 
     void action(std::unique_ptr<Action_Base>&& action);
     void invalidate_obj(Scene_ID id);
+    void enforce_budget();
 
-    std::stack<std::unique_ptr<Action_Base>> undos;
-    std::stack<std::unique_ptr<Action_Base>> redos;
+    // Oldest first
+    std::deque<std::unique_ptr<Action_Base>> undos;
+    std::deque<std::unique_ptr<Action_Base>> redos;
     size_t total_actions = 0;
+
+    size_t memory_budget = 0;
+    bool spill_old = false;
+    std::unique_ptr<Undo_Spill> spill;
 };
@@ -9,9 +9,6 @@ static std::optional<Vec2> intersection(Vec2 a, Vec2 b) {
     if(c.x > c.y) return std::nullopt;
     return c;
 }
-static bool within_range(float a, Vec2 b) {
-    return a >= b.x && a <= b.y;
-}
 static bool within_range(Vec2 a, Vec2 b) {
     return a.x >= b.x && a.y <= b.y;
 }
@@ -25,29 +22,16 @@ bool BBox::hit(const Ray& ray, Vec2& times) const {
 
     if(empty()) return false;
 
-    Vec2 t;
-    std::vector<Vec2> ts(3);
-    Vec3 o = ray.point, d = ray.dir;
-    for(int axis = 0; axis < 3; axis++) {
-        // If ray parallel to axis plane
-        if(std::abs(d[axis]) < EPS_F) {
-            // If origin within bounds along axis
-            if(within_range(o[axis], Vec2(min[axis], max[axis]))) {
-                ts[axis].x = -FLT_MAX;
-                ts[axis].y = FLT_MAX;
-            } else {
-                return false;
-            }
-        } else {
-            ts[axis].x = (min[axis] - o[axis]) / d[axis];
-            ts[axis].y = (max[axis] - o[axis]) / d[axis];
-            if(ts[axis].x > ts[axis].y) {
-                std::swap(ts[axis].x, ts[axis].y);
-            }
-        }
-    }
-    t.x = std::max(std::max(ts[0].x, ts[1].x), ts[2].x);
-    t.y = std::min(std::min(ts[0].y, ts[1].y), ts[2].y);
+    // Slab test against the ray's cached reciprocal direction, so there is no
+    // division or per-axis branch. For an axis-parallel ray the reciprocal is
+    // infinite, which gives (-inf, inf) for that slab if the origin lies within it
+    // and an empty interval otherwise.
+    Vec3 t0 = (min - ray.point) * ray.inv_dir;
+    Vec3 t1 = (max - ray.point) * ray.inv_dir;
+    Vec3 t_near = hmin(t0, t1), t_far = hmax(t0, t1);
+
+    Vec2 t(std::max(std::max(t_near.x, t_near.y), t_near.z),
+           std::min(std::min(t_far.x, t_far.y), t_far.z));
     if(t.x > t.y) {
         return false;
     }
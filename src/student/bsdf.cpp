@@ -11,7 +11,7 @@ static Vec3 reflect(Vec3 dir) {
     return Vec3(-dir.x, dir.y, -dir.z);
 }
 
-static Vec3 refract(Vec3 out_dir, float index_of_refraction, bool& was_internal) {
+static Vec3 refract(Vec3 out_dir, float ior, float inv_ior, bool& was_internal) {
 
     // TODO (PathTracer): Task 5
     // Use Snell's Law to refract out_dir through the surface.
@@ -26,28 +26,20 @@ static Vec3 refract(Vec3 out_dir, float index_of_refraction, bool& was_internal)
     // and to do so you can simply find the direction that out_dir would refract
     // _to_, as refraction is symmetric.
 
-    Vec3 n(0.f, 1.f, 0.f);
-    // Treat out_dir as incoming dir
-    float cos_ti = dot(out_dir, n);
-    float sin_ti = std::sqrt(1.f - cos_ti * cos_ti);
-    float sin_tt = sin_ti;
-    if(cos_ti > 0) {
-        sin_tt /= index_of_refraction;
-    } else {
-        sin_tt *= index_of_refraction;
-    }
-    if(sin_tt >= 1.f) {
+    // The tangential part of the direction scales by the ratio of indices, so there
+    // is no need to split it into sin/phi terms and renormalize
+    float cos_ti = out_dir.y;
+    float eta = cos_ti > 0 ? inv_ior : ior;
+    float sin2_tt = eta * eta * std::max(1.f - cos_ti * cos_ti, 0.f);
+    if(sin2_tt >= 1.f) {
         was_internal = true;
         return Vec3{};
     }
-    float cos_tt = std::sqrt(1.f - sin_tt * sin_tt);
+    float cos_tt = std::sqrt(1.f - sin2_tt);
     cos_tt = cos_ti > 0 ? -cos_tt : cos_tt;
-    Vec3 phi_i = Vec3(out_dir.x, 0.f, out_dir.z).unit();
-    Vec3 phi_t = -phi_i * sin_tt;
-    Vec3 in_dir = phi_t + n * cos_tt;
 
     was_internal = false;
-    return in_dir.unit();
+    return Vec3(-out_dir.x * eta, cos_tt, -out_dir.z * eta);
 }
 
 Scatter BSDF_Lambertian::scatter(Vec3 out_dir) const {
@@ -119,22 +111,17 @@ Scatter BSDF_Glass::scatter(Vec3 out_dir) const {
     ret.direction = Vec3();
     ret.attenuation = Spectrum{};
 
-    Vec3 n(0.f, 1.f, 0.f);
-    float cos_tt = dot(out_dir, n);
-    float n1 = index_of_refraction, n2 = 1.f;
-    if(cos_tt < 0.f) {
-        std::swap(n1, n2);
-    }
-    cos_tt = std::abs(cos_tt);
+    // Fresnel terms divided through by n1, so only the ratio n2/n1 is needed
+    bool entering = out_dir.y >= 0.f;
+    float eta = entering ? inv_ior : index_of_refraction;
+    float cos_tt = std::abs(out_dir.y);
     bool was_internal = false, refracting = false;
-    Vec3 in_dir = refract(out_dir, index_of_refraction, was_internal);
+    Vec3 in_dir = refract(out_dir, index_of_refraction, inv_ior, was_internal);
     if(!was_internal) {
-        float cos_ti = std::abs(dot(in_dir, n));
-        float rs = (n1 * cos_ti - n2 * cos_tt) / (n1 * cos_ti + n2 * cos_tt);
-        rs = rs * rs;
-        float rp = (n1 * cos_tt - n2 * cos_ti) / (n1 * cos_tt + n2 * cos_ti);
-        rp = rp * rp;
-        float F = 0.5f * (rs + rp);
+        float cos_ti = std::abs(in_dir.y);
+        float rs = (cos_ti - eta * cos_tt) / (cos_ti + eta * cos_tt);
+        float rp = (cos_tt - eta * cos_ti) / (cos_tt + eta * cos_ti);
+        float F = 0.5f * (rs * rs + rp * rp);
 
         if(RNG::unit() > F) {
             refracting = true;
@@ -143,7 +130,7 @@ Scatter BSDF_Glass::scatter(Vec3 out_dir) const {
 
     if(refracting) {
         ret.direction = in_dir;
-        ret.attenuation = transmittance * n2 * n2 / n1 / n1;
+        ret.attenuation = entering ? transmit_enter : transmit_exit;
     } else {
         ret.direction = reflect(out_dir);
         ret.attenuation = reflectance;
@@ -162,7 +149,7 @@ Scatter BSDF_Refract::scatter(Vec3 out_dir) const {
     ret.direction = Vec3();
     ret.attenuation = Spectrum{};
     bool was_internal = false;
-    ret.direction = refract(out_dir, index_of_refraction, was_internal);
+    ret.direction = refract(out_dir, index_of_refraction, inv_ior, was_internal);
     if(!was_internal) {
         ret.attenuation = transmittance;
     }
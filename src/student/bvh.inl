@@ -3,8 +3,9 @@
 #include "debug.h"
 #include <stack>
 
+#include <istream>
+#include <ostream>
 #include <sstream>
-#include <optional>
 
 namespace PT {
 
@@ -13,8 +14,97 @@ struct Bucket {
     size_t n_prims = 0;
 };
 
+struct Spatial_Bin {
+    BBox bbox;
+    size_t enter = 0, exit = 0;
+};
+
+// What choosing a split needs besides the node itself. Each thread keeps one, so
+// building allocates nothing per node once the first few have grown it.
+struct BVH_Scratch {
+    std::vector<Bucket> buckets;
+    std::vector<Spatial_Bin> bins;
+    std::vector<BBox> right_box;
+    std::vector<size_t> right_n;
+    bool busy = false;
+};
+
+// Borrows this thread's scratch until released. A thread waiting on the pool may run
+// another node's partition meanwhile, which then gets an empty scratch of its own.
+class BVH_Scratch_Lease {
+public:
+    BVH_Scratch_Lease() {
+        static thread_local BVH_Scratch shared;
+        scratch = shared.busy ? &own : &shared;
+        scratch->busy = true;
+    }
+    BVH_Scratch_Lease(const BVH_Scratch_Lease&) = delete;
+    ~BVH_Scratch_Lease() {
+        release();
+    }
+
+    void operator=(const BVH_Scratch_Lease&) = delete;
+
+    BVH_Scratch* operator->() {
+        return scratch;
+    }
+    void release() {
+        if(scratch) scratch->busy = false;
+        scratch = nullptr;
+    }
+
+private:
+    BVH_Scratch own;
+    BVH_Scratch* scratch = nullptr;
+};
+
+inline size_t bvh_buckets(size_t fixed, size_t size, size_t max_leaf_size) {
+    if(fixed > 0) return std::max(fixed, size_t(2));
+    return std::clamp(size / max_leaf_size / 10, (size_t)5, (size_t)20);
+}
+
+// Nodes with at least this many primitives build their two subtrees in parallel.
+constexpr size_t bvh_parallel_split = 4096;
+// Loops over at least this many primitives are split into tasks of bvh_chunk_size.
+constexpr size_t bvh_parallel_loop = 65536;
+constexpr size_t bvh_chunk_size = 16384;
+
+inline size_t bvh_chunks(const Thread_Pool* pool, size_t n) {
+    if(!pool || n < bvh_parallel_loop) return 1;
+    return (n + bvh_chunk_size - 1) / bvh_chunk_size;
+}
+
+// Calls f(chunk, begin, end) for each of the bvh_chunks() pieces of [begin, end).
+template<typename F> void bvh_for_chunks(Thread_Pool* pool, size_t begin, size_t end, F&& f) {
+    size_t chunks = bvh_chunks(pool, end - begin);
+    if(chunks == 1) {
+        f(size_t(0), begin, end);
+        return;
+    }
+    std::vector<Pool_Future<void>> futures(chunks);
+    for(size_t i = 0; i < chunks; i++) {
+        size_t b = begin + i * bvh_chunk_size;
+        size_t e = std::min(b + bvh_chunk_size, end);
+        pool->submit(futures[i], [&f, i, b, e]() { f(i, b, e); });
+    }
+    for(auto& future : futures) pool->wait_for(future);
+}
+
+inline BBox bvh_overlap(const BBox& a, const BBox& b) {
+    return BBox(hmax(a.min, b.min), hmin(a.max, b.max));
+}
+
 template<typename Primitive>
-void BVH<Primitive>::build(std::vector<Primitive>&& prims, size_t max_leaf_size) {
+void BVH<Primitive>::build(std::vector<Primitive>&& prims, size_t max_leaf_size,
+                           Thread_Pool* pool) {
+    BVH_Options opt;
+    opt.max_leaf_size = max_leaf_size;
+    build(std::move(prims), opt, pool);
+}
+
+template<typename Primitive>
+void BVH<Primitive>::build(std::vector<Primitive>&& prims, const BVH_Options& opt,
+                           Thread_Pool* pool) {
 
     // NOTE (PathTracer):
     // This BVH is parameterized on the type of the primitive it contains. This allows
@@ -22,42 +112,175 @@ void BVH<Primitive>::build(std::vector<Primitive>&& prims, size_t max_leaf_size)
     // we use this to both build a BVH over triangles within each Tri_Mesh, and over
     // a variety of Objects (which might be Tri_Meshes, Spheres, etc.) in Pathtracer.
     //
-    // The Primitive interface must implement these two functions:
+    // The Primitive interface must implement these functions:
     //      BBox bbox() const;
     //      Trace hit(const Ray& ray) const;
-    // Hence, you may call bbox() and hit() on any value of type Primitive.
+    //      bool occluded(const Ray& ray) const;
+    // Hence, you may call bbox(), hit() and occluded() on any value of type Primitive.
     //
     // Finally, also note that while a BVH is a tree structure, our BVH nodes don't
     // contain pointers to children, but rather indicies. This is because instead
     // of allocating each node individually, the BVH class contains a vector that
     // holds all of the nodes. Hence, to get the child of a node, you have to
-    // look up the child index in this vector (e.g. nodes[node.l]). Similarly,
-    // to create a new node, don't allocate one yourself - use BVH::new_node, which
-    // returns the index of a newly added node.
+    // look up the child index in this vector (e.g. nodes[node.l]). Once built,
+    // the tree is flattened into the compact depth-first layout that hit() uses.
 
     // Keep these
     nodes.clear();
+    wide.clear();
+    sources.clear();
     primitives = std::move(prims);
+    options = opt;
+    options.max_leaf_size = std::max(options.max_leaf_size, size_t(1));
+    built_cost = 0.0f;
+    if(primitives.empty()) return;
 
-    // TODO (PathTracer): Task 3
-    // Construct a BVH from the given vector of primitives and maximum leaf
-    // size configuration. The starter code builds a BVH with a
-    // single leaf node (which is also the root) that encloses all the
-    // primitives.
+    size_t n = primitives.size();
+    Build_Data data;
+    data.max_leaf_size = options.max_leaf_size;
+    data.buckets = options.buckets;
+    data.pool = pool;
+    data.boxes.resize(n);
+    data.centers.resize(n);
+    data.order.resize(n);
+
+    // Every level of the build looks at the same bounds, so compute them only once.
+    bvh_for_chunks(pool, 0, n, [&](size_t, size_t b, size_t e) {
+        for(size_t i = b; i < e; i++) {
+            data.boxes[i] = primitives[i].bbox();
+            data.centers[i] = data.boxes[i].center();
+            data.order[i] = i;
+        }
+    });
 
     BBox box;
-    for(const Primitive& prim : primitives) box.enclose(prim.bbox());
-    root_idx = new_node(box, 0, primitives.size(), 0, 0);
+    for(const BBox& b : data.boxes) box.enclose(b);
+
+    // A binary tree with at most one leaf per primitive has at most 2n - 1 nodes.
+    // Allocating them up front lets subtrees be built concurrently: each split
+    // claims its two children from n_nodes.
+    data.nodes.resize(2 * n - 1);
+    data.n_nodes = 1;
+    data.nodes[0].bbox = box;
+    data.nodes[0].size = n;
 
     //info("build() called with %i primitives and max leaf size %i", primitives.size(),
     //     max_leaf_size);
 
-    if(nodes[root_idx].size > max_leaf_size) {
-        size_t n_buckets = std::clamp(nodes[root_idx].size / max_leaf_size / 10, (size_t)5, (size_t)20);
-        partition(root_idx, n_buckets, max_leaf_size);
+    bool lbvh = options.method == BVH_Options::Method::lbvh;
+    bool spatial = false;
+    if constexpr(BVH_Splittable<Primitive>::value) {
+        spatial = !lbvh && options.spatial_alpha > 0.0f;
+    }
+
+    std::vector<Primitive> sorted;
+    if(lbvh) {
+        build_lbvh(data);
+        sorted.reserve(n);
+        for(size_t i : data.order) sorted.push_back(std::move(primitives[i]));
+    } else if(spatial) {
+        if constexpr(BVH_Splittable<Primitive>::value) {
+            std::vector<Reference> refs(n);
+            for(size_t i = 0; i < n; i++) refs[i] = {data.boxes[i], i};
+            data.nodes.resize(1);
+            data.order.clear();
+            partition_spatial(data, 0, refs, 0, options.spatial_alpha * box.surface_area());
+            data.n_nodes = data.nodes.size();
+
+            sorted.reserve(data.order.size());
+            for(size_t i : data.order) sorted.push_back(primitives[i]);
+            sources = std::move(data.order);
+        }
+    } else {
+        partition(data, 0, 0);
+        sorted.reserve(n);
+        for(size_t i : data.order) sorted.push_back(std::move(primitives[i]));
     }
 
-    //bvh_print(root_idx, 0);
+    nodes.reserve(data.n_nodes);
+    flatten(data, 0);
+    primitives = std::move(sorted);
+
+    built_cost = sah_cost();
+    if constexpr(width > 2) build_wide();
+
+    //bvh_print(0, 0);
+}
+
+template<typename Primitive> BVH_Stats BVH<Primitive>::stats() const {
+
+    BVH_Stats s;
+    if(nodes.empty()) return s;
+
+    s.nodes = nodes.size();
+    s.primitives = primitives.size();
+    s.bytes = nodes.size() * sizeof(Node) + wide.size() * sizeof(Wide_Node<width>) +
+              primitives.size() * sizeof(Primitive) + sources.size() * sizeof(size_t);
+    s.sah_cost = sah_cost();
+
+    std::pair<uint32_t, size_t> stack[max_depth + 1];
+    size_t top = 0;
+    stack[top++] = {0, 0};
+    while(top > 0) {
+        auto [n, depth] = stack[--top];
+        const Node& node = nodes[n];
+        if(node.is_leaf()) {
+            s.leaves++;
+            s.max_depth = std::max(s.max_depth, depth);
+            if(s.depths.size() <= depth) s.depths.resize(depth + 1);
+            if(s.leaf_sizes.size() <= node.count) s.leaf_sizes.resize(node.count + 1);
+            s.depths[depth]++;
+            s.leaf_sizes[node.count]++;
+        } else {
+            stack[top++] = {node.offset, depth + 1};
+            stack[top++] = {n + 1, depth + 1};
+        }
+    }
+    return s;
+}
+
+template<typename Primitive> void BVH<Primitive>::refit(Thread_Pool* pool) {
+
+    if(nodes.empty()) return;
+
+    // Both children follow their parent in the depth-first layout, so sweeping
+    // backwards updates them before it reaches the parent.
+    for(size_t i = nodes.size(); i-- > 0;) {
+        Node& node = nodes[i];
+        BBox box;
+        if(node.is_leaf()) {
+            for(uint32_t p = node.offset; p < node.offset + node.count; p++) {
+                box.enclose(primitives[p].bbox());
+            }
+        } else {
+            box.enclose(nodes[i + 1].bbox());
+            box.enclose(nodes[node.offset].bbox());
+        }
+        node.min = box.min;
+        node.max = box.max;
+    }
+
+    if(sah_cost() > rebuild_ratio * built_cost) {
+        build(unique_primitives(), options, pool);
+        return;
+    }
+    if constexpr(width > 2) build_wide();
+}
+
+template<typename Primitive> float BVH<Primitive>::sah_cost() const {
+
+    // Expected cost of a random ray through the root, in units of primitive tests,
+    // counting a box test as one eighth of a primitive test.
+    if(nodes.empty()) return 0.0f;
+    float root = nodes[0].bbox().surface_area();
+    if(root <= 0.0f) return 0.0f;
+
+    float cost = 0.0f;
+    for(const Node& node : nodes) {
+        float area = node.bbox().surface_area();
+        cost += node.is_leaf() ? area * node.count : area * 0.125f;
+    }
+    return cost / root;
 }
 
 template<typename Primitive> void BVH<Primitive>::bvh_print(size_t p, size_t lv) const {
@@ -66,96 +289,535 @@ template<typename Primitive> void BVH<Primitive>::bvh_print(size_t p, size_t lv)
         return;
     }
 
-    info("node: %i. level %i. l: %i. r: %i", p, lv, nodes[p].l, nodes[p].r);
-    bvh_print(nodes[p].l, lv + 1);
-    bvh_print(nodes[p].r, lv + 1);
+    info("node: %i. level %i. l: %i. r: %i", p, lv, p + 1, nodes[p].offset);
+    bvh_print(p + 1, lv + 1);
+    bvh_print(nodes[p].offset, lv + 1);
 }
 
 template<typename Primitive>
-void BVH<Primitive>::partition(size_t p, size_t n_buckets, size_t max_leaf_size) {
-
-    //info("partition() called");
-    size_t l = new_node();
-    size_t r = new_node();
-    nodes[p].l = l;
-    nodes[p].r = r;
-    BBox pbox = nodes[p].bbox;
-    std::vector<Bucket> buckets(3 * n_buckets);
-    float lowest_cost = FLT_MAX;
-    std::pair<size_t, size_t> lowest;
-
-    // Fill buckets
-    for(size_t i = nodes[p].start; i < nodes[p].start + nodes[p].size; i++) {
-        BBox box = primitives[i].bbox();
-        Vec3 c = box.center();
-        // Assuming pbox is not flat
-        c = (c - pbox.min) / (pbox.max - pbox.min) * static_cast<float>(n_buckets);
-        for(int axis = 0; axis < 3; axis++) {
-            size_t b = static_cast<size_t>(clamp(c[axis], 0.f, static_cast<float>(n_buckets - 1)));
-            assert(b >= 0 && b < n_buckets);
-            buckets[axis * n_buckets + b].bbox.enclose(box);
-            buckets[axis * n_buckets + b].n_prims++;
+uint32_t BVH<Primitive>::flatten(const Build_Data& data, size_t p) {
+
+    const Build_Node& build = data.nodes[p];
+    uint32_t idx = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+    nodes[idx].min = build.bbox.min;
+    nodes[idx].max = build.bbox.max;
+
+    if(build.l == build.r) {
+        nodes[idx].offset = static_cast<uint32_t>(build.start);
+        nodes[idx].count = static_cast<uint32_t>(build.size);
+    } else {
+        nodes[idx].axis = static_cast<uint32_t>(build.axis);
+        flatten(data, build.l);
+        uint32_t r = flatten(data, build.r);
+        nodes[idx].offset = r;
+    }
+    return idx;
+}
+
+template<typename Primitive>
+void BVH<Primitive>::partition(Build_Data& data, size_t p, size_t depth) {
+
+    std::vector<Build_Node>& tree = data.nodes;
+    size_t start = tree[p].start, size = tree[p].size;
+    if(size <= data.max_leaf_size || depth + 1 >= max_depth) return;
+
+    // Bin over the bounds of the centroids rather than of the node, so that no
+    // bucket covers space no centroid can fall into.
+    BBox cbox;
+    for(size_t i = start; i < start + size; i++) cbox.enclose(data.centers[data.order[i]]);
+
+    size_t n_buckets = bvh_buckets(data.buckets, size, data.max_leaf_size);
+    Vec3 extent = cbox.max - cbox.min;
+    Vec3 scale;
+    for(int axis = 0; axis < 3; axis++) {
+        scale[axis] = extent[axis] > 0.0f ? n_buckets / extent[axis] : 0.0f;
+    }
+
+    auto bucket_of = [&](size_t prim, int axis) {
+        float c = (data.centers[prim][axis] - cbox.min[axis]) * scale[axis];
+        return std::min(static_cast<size_t>(std::max(c, 0.0f)), n_buckets - 1);
+    };
+
+    // Fill buckets; large nodes fill one set per chunk in parallel and merge them.
+    size_t stride = 3 * n_buckets;
+    BVH_Scratch_Lease scratch;
+    std::vector<Bucket>& buckets = scratch->buckets;
+    buckets.assign(bvh_chunks(data.pool, size) * stride, Bucket{});
+    bvh_for_chunks(data.pool, start, start + size, [&](size_t chunk, size_t b, size_t e) {
+        Bucket* local = &buckets[chunk * stride];
+        for(size_t i = b; i < e; i++) {
+            size_t prim = data.order[i];
+            for(int axis = 0; axis < 3; axis++) {
+                Bucket& bucket = local[axis * n_buckets + bucket_of(prim, axis)];
+                bucket.bbox.enclose(data.boxes[prim]);
+                bucket.n_prims++;
+            }
         }
+    });
+    for(size_t i = stride; i < buckets.size(); i++) {
+        buckets[i % stride].bbox.enclose(buckets[i].bbox);
+        buckets[i % stride].n_prims += buckets[i].n_prims;
     }
-    // Find lowest-cost partition
-    for(size_t axis = 0; axis < 3; axis++) {
+
+    // Find lowest-cost partition, sweeping each axis from both ends
+    float lowest_cost = FLT_MAX;
+    int best_axis = -1;
+    size_t best_split = 0, best_ln = 0;
+    BBox best_l, best_r;
+    std::vector<BBox>& right_box = scratch->right_box;
+    std::vector<size_t>& right_n = scratch->right_n;
+    right_box.resize(n_buckets);
+    right_n.resize(n_buckets);
+
+    for(int axis = 0; axis < 3; axis++) {
+        if(scale[axis] == 0.0f) continue;
+        const Bucket* b = &buckets[axis * n_buckets];
+
+        BBox rbox;
+        size_t rn = 0;
+        for(size_t i = n_buckets - 1; i > 0; i--) {
+            rbox.enclose(b[i].bbox);
+            rn += b[i].n_prims;
+            right_box[i] = rbox;
+            right_n[i] = rn;
+        }
+
+        BBox lbox;
+        size_t ln = 0;
         for(size_t i = 0; i < n_buckets - 1; i++) {
-            BBox lbox, rbox;
-            size_t ln = 0, rn = 0;
-            for(size_t j = 0; j < n_buckets; j++) {
-                const Bucket& b = buckets[axis * n_buckets + j];
-                if(j <= i) {
-                    lbox.enclose(b.bbox);
-                    ln += b.n_prims;
-                } else {
-                    rbox.enclose(b.bbox);
-                    rn += b.n_prims;
-                }
+            lbox.enclose(b[i].bbox);
+            ln += b[i].n_prims;
+            if(ln == 0 || right_n[i + 1] == 0) continue;
+            float cost = lbox.surface_area() * ln + right_box[i + 1].surface_area() * right_n[i + 1];
+            if(cost < lowest_cost) {
+                lowest_cost = cost;
+                best_axis = axis;
+                best_split = i;
+                best_ln = ln;
+                best_l = lbox;
+                best_r = right_box[i + 1];
             }
-            if(ln == 0 || rn == 0) continue;
-            float cost = lbox.surface_area() * ln + rbox.surface_area() * rn;
+        }
+    }
+
+    // All centroids coincide, so no split can separate them
+    if(best_axis < 0) return;
+    // Free for the children, which may be partitioned on this thread
+    scratch.release();
+
+    std::partition(data.order.begin() + start, data.order.begin() + start + size,
+                   [&](size_t prim) { return bucket_of(prim, best_axis) <= best_split; });
+
+    size_t l = data.n_nodes.fetch_add(2);
+    size_t r = l + 1;
+    tree[l].bbox = best_l;
+    tree[l].start = start;
+    tree[l].size = best_ln;
+    tree[l].l = tree[l].r = 0;
+    tree[r].bbox = best_r;
+    tree[r].start = start + best_ln;
+    tree[r].size = size - best_ln;
+    tree[r].l = tree[r].r = 0;
+    tree[p].l = l;
+    tree[p].r = r;
+    tree[p].axis = best_axis;
+
+    //info("l.size: %i. r.size: %i", tree[l].size, tree[r].size);
+
+    if(data.pool && size >= bvh_parallel_split) {
+        Pool_Future<void> left;
+        data.pool->submit(left, [this, &data, l, depth]() { partition(data, l, depth + 1); });
+        partition(data, r, depth + 1);
+        data.pool->wait_for(left);
+    } else {
+        partition(data, l, depth + 1);
+        partition(data, r, depth + 1);
+    }
+}
+
+template<typename Primitive>
+void BVH<Primitive>::partition_spatial(Build_Data& data, size_t p, std::vector<Reference>& refs,
+                                       size_t depth, float min_overlap) {
+
+    // Spatial split BVH (Stich et al. 2009): as well as binning references by
+    // centroid, bin the node's box itself and split references straddling the best
+    // plane, so long or large primitives no longer force overlapping children.
+    std::vector<Build_Node>& tree = data.nodes;
+    size_t size = refs.size();
+
+    if(size <= data.max_leaf_size || depth + 1 >= max_depth) {
+        tree[p].start = data.order.size();
+        tree[p].size = size;
+        for(const Reference& ref : refs) data.order.push_back(ref.prim);
+        return;
+    }
+
+    size_t n_buckets = bvh_buckets(data.buckets, size, data.max_leaf_size);
+    BBox box = tree[p].bbox;
+
+    BBox cbox;
+    for(const Reference& ref : refs) cbox.enclose(ref.box.center());
+
+    float lowest_cost = FLT_MAX;
+    int best_axis = -1, object_axis = -1;
+    bool best_spatial = false;
+    size_t best_split = 0;
+    float best_plane = 0.0f;
+    BBox object_l, object_r;
+
+    BVH_Scratch_Lease scratch;
+    std::vector<Bucket>& buckets = scratch->buckets;
+    std::vector<BBox>& right_box = scratch->right_box;
+    std::vector<size_t>& right_n = scratch->right_n;
+    buckets.resize(n_buckets);
+    right_box.resize(n_buckets);
+    right_n.resize(n_buckets);
+
+    auto bucket_of = [&](const Reference& ref, int axis) {
+        float extent = cbox.max[axis] - cbox.min[axis];
+        float c = (ref.box.center()[axis] - cbox.min[axis]) * n_buckets / extent;
+        return std::min(static_cast<size_t>(std::max(c, 0.0f)), n_buckets - 1);
+    };
+
+    // Object splits, as in partition()
+    for(int axis = 0; axis < 3; axis++) {
+        if(cbox.max[axis] <= cbox.min[axis]) continue;
+        std::fill(buckets.begin(), buckets.end(), Bucket{});
+        for(const Reference& ref : refs) {
+            Bucket& bucket = buckets[bucket_of(ref, axis)];
+            bucket.bbox.enclose(ref.box);
+            bucket.n_prims++;
+        }
+
+        BBox rbox;
+        size_t rn = 0;
+        for(size_t i = n_buckets - 1; i > 0; i--) {
+            rbox.enclose(buckets[i].bbox);
+            rn += buckets[i].n_prims;
+            right_box[i] = rbox;
+            right_n[i] = rn;
+        }
+        BBox lbox;
+        size_t ln = 0;
+        for(size_t i = 0; i < n_buckets - 1; i++) {
+            lbox.enclose(buckets[i].bbox);
+            ln += buckets[i].n_prims;
+            if(ln == 0 || right_n[i + 1] == 0) continue;
+            float cost = lbox.surface_area() * ln + right_box[i + 1].surface_area() * right_n[i + 1];
             if(cost < lowest_cost) {
                 lowest_cost = cost;
-                lowest = {axis, i};
-                nodes[l].bbox = lbox;
-                nodes[l].size = ln;
-                nodes[r].bbox = rbox;
-                nodes[r].size = rn;
+                best_axis = object_axis = axis;
+                best_split = i;
+                object_l = lbox;
+                object_r = right_box[i + 1];
+            }
+        }
+    }
+
+    // Clip a reference to either side of a plane
+    auto split = [&](const Reference& ref, int axis, float plane, BBox& l, BBox& r) {
+        primitives[ref.prim].split(axis, plane, l, r);
+        l = bvh_overlap(l, ref.box);
+        r = bvh_overlap(r, ref.box);
+    };
+
+    // Spatial splits, only where the object split leaves too much overlap
+    if(best_axis < 0 || bvh_overlap(object_l, object_r).surface_area() > min_overlap) {
+
+        std::vector<Spatial_Bin>& bins = scratch->bins;
+        bins.resize(n_buckets);
+
+        for(int axis = 0; axis < 3; axis++) {
+            float origin = box.min[axis];
+            float width = (box.max[axis] - origin) / n_buckets;
+            if(width <= 0.0f) continue;
+
+            auto bin_of = [&](float x) {
+                float b = (x - origin) / width;
+                return std::min(static_cast<size_t>(std::max(b, 0.0f)), n_buckets - 1);
+            };
+
+            std::fill(bins.begin(), bins.end(), Spatial_Bin{});
+            for(const Reference& ref : refs) {
+                size_t first = bin_of(ref.box.min[axis]), last = bin_of(ref.box.max[axis]);
+                Reference rest = ref;
+                for(size_t b = first; b < last; b++) {
+                    BBox l, r;
+                    split(rest, axis, origin + (b + 1) * width, l, r);
+                    bins[b].bbox.enclose(l);
+                    rest.box = r;
+                }
+                bins[last].bbox.enclose(rest.box);
+                bins[first].enter++;
+                bins[last].exit++;
+            }
+
+            BBox rbox;
+            size_t rn = 0;
+            for(size_t i = n_buckets - 1; i > 0; i--) {
+                rbox.enclose(bins[i].bbox);
+                rn += bins[i].exit;
+                right_box[i] = rbox;
+                right_n[i] = rn;
+            }
+            BBox lbox;
+            size_t ln = 0;
+            for(size_t i = 0; i < n_buckets - 1; i++) {
+                lbox.enclose(bins[i].bbox);
+                ln += bins[i].enter;
+                if(ln == 0 || right_n[i + 1] == 0) continue;
+                float cost =
+                    lbox.surface_area() * ln + right_box[i + 1].surface_area() * right_n[i + 1];
+                if(cost < lowest_cost) {
+                    lowest_cost = cost;
+                    best_axis = axis;
+                    best_spatial = true;
+                    best_plane = origin + (i + 1) * width;
+                }
+            }
+        }
+    }
+
+    scratch.release();
+
+    std::vector<Reference> left, right;
+    if(best_spatial) {
+        for(const Reference& ref : refs) {
+            if(ref.box.max[best_axis] <= best_plane) {
+                left.push_back(ref);
+            } else if(ref.box.min[best_axis] >= best_plane) {
+                right.push_back(ref);
+            } else {
+                BBox l, r;
+                split(ref, best_axis, best_plane, l, r);
+                if(!l.empty()) left.push_back({l, ref.prim});
+                if(!r.empty()) right.push_back({r, ref.prim});
+            }
+        }
+        // A split that leaves a child empty or duplicates every reference makes no
+        // progress, so fall back to the object split
+        if(left.empty() || right.empty() || (left.size() == size && right.size() == size)) {
+            left.clear();
+            right.clear();
+            best_spatial = false;
+            best_axis = object_axis;
+        }
+    }
+    if(!best_spatial && best_axis >= 0) {
+        for(const Reference& ref : refs) {
+            (bucket_of(ref, best_axis) <= best_split ? left : right).push_back(ref);
+        }
+    }
+
+    if(left.empty() || right.empty()) {
+        tree[p].start = data.order.size();
+        tree[p].size = size;
+        for(const Reference& ref : refs) data.order.push_back(ref.prim);
+        return;
+    }
+    std::vector<Reference>().swap(refs);
+
+    size_t l = tree.size();
+    size_t r = l + 1;
+    tree.resize(tree.size() + 2);
+    for(const Reference& ref : left) tree[l].bbox.enclose(ref.box);
+    for(const Reference& ref : right) tree[r].bbox.enclose(ref.box);
+    tree[l].bbox = bvh_overlap(tree[l].bbox, box);
+    tree[r].bbox = bvh_overlap(tree[r].bbox, box);
+    tree[p].l = l;
+    tree[p].r = r;
+    tree[p].axis = best_axis;
+
+    partition_spatial(data, l, left, depth + 1, min_overlap);
+    partition_spatial(data, r, right, depth + 1, min_overlap);
+}
+
+// Spreads the low 21 bits of v out to every third bit
+inline uint64_t bvh_expand_bits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+inline int bvh_clz(uint64_t v) {
+#ifdef _MSC_VER
+    unsigned long bit;
+    _BitScanReverse64(&bit, v);
+    return 63 - static_cast<int>(bit);
+#else
+    return __builtin_clzll(v);
+#endif
+}
+
+// Stable LSD radix sort of values by keys, eight bits at a time. Each pass counts
+// digits per chunk in parallel, then scatters each chunk to its own offsets.
+inline void bvh_radix_sort(Thread_Pool* pool, std::vector<uint64_t>& keys,
+                           std::vector<size_t>& values) {
+
+    size_t n = keys.size();
+    size_t chunks = bvh_chunks(pool, n);
+    std::vector<uint64_t> keys_out(n);
+    std::vector<size_t> values_out(n);
+    std::vector<size_t> offsets(chunks * 256);
+
+    for(int shift = 0; shift < 64; shift += 8) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        bvh_for_chunks(pool, 0, n, [&](size_t chunk, size_t b, size_t e) {
+            size_t* count = &offsets[chunk * 256];
+            for(size_t i = b; i < e; i++) count[(keys[i] >> shift) & 0xff]++;
+        });
+
+        size_t sum = 0;
+        for(size_t digit = 0; digit < 256; digit++) {
+            for(size_t chunk = 0; chunk < chunks; chunk++) {
+                size_t count = offsets[chunk * 256 + digit];
+                offsets[chunk * 256 + digit] = sum;
+                sum += count;
+            }
+        }
+
+        bvh_for_chunks(pool, 0, n, [&](size_t chunk, size_t b, size_t e) {
+            size_t* offset = &offsets[chunk * 256];
+            for(size_t i = b; i < e; i++) {
+                size_t j = offset[(keys[i] >> shift) & 0xff]++;
+                keys_out[j] = keys[i];
+                values_out[j] = values[i];
+            }
+        });
+        std::swap(keys, keys_out);
+        std::swap(values, values_out);
+    }
+}
+
+template<typename Primitive> void BVH<Primitive>::build_lbvh(Build_Data& data) {
+
+    size_t n = data.order.size();
+    std::vector<Build_Node>& tree = data.nodes;
+
+    // 63-bit Morton codes of the centroids, quantized to 21 bits per axis
+    BBox cbox;
+    for(const Vec3& c : data.centers) cbox.enclose(c);
+    Vec3 scale;
+    for(int axis = 0; axis < 3; axis++) {
+        float extent = cbox.max[axis] - cbox.min[axis];
+        scale[axis] = extent > 0.0f ? 2097151.0f / extent : 0.0f;
+    }
+
+    std::vector<uint64_t> codes(n);
+    bvh_for_chunks(data.pool, 0, n, [&](size_t, size_t b, size_t e) {
+        for(size_t i = b; i < e; i++) {
+            Vec3 q = (data.centers[i] - cbox.min) * scale;
+            codes[i] = bvh_expand_bits(static_cast<uint64_t>(q.x)) << 2 |
+                       bvh_expand_bits(static_cast<uint64_t>(q.y)) << 1 |
+                       bvh_expand_bits(static_cast<uint64_t>(q.z));
+        }
+    });
+    bvh_radix_sort(data.pool, codes, data.order);
+
+    if(n == 1) {
+        tree[0].bbox = data.boxes[data.order[0]];
+        return;
+    }
+
+    // Internal node i is tree[i] and leaf k is tree[n - 1 + k]. Every internal node
+    // finds its range and split independently from the sorted codes alone.
+    // Equal codes are told apart by their indices, as if appended to the codes.
+    auto delta = [&](int64_t i, int64_t j) {
+        if(j < 0 || j >= static_cast<int64_t>(n)) return -1;
+        if(codes[i] == codes[j]) return 64 + bvh_clz(static_cast<uint64_t>(i ^ j));
+        return bvh_clz(codes[i] ^ codes[j]);
+    };
+
+    bvh_for_chunks(data.pool, 0, n - 1, [&](size_t, size_t b, size_t e) {
+        for(size_t node = b; node < e; node++) {
+            int64_t i = static_cast<int64_t>(node);
+
+            // Direction of the range, and an upper bound on its length
+            int64_t d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+            int min_delta = delta(i, i - d);
+            int64_t l_max = 2;
+            while(delta(i, i + l_max * d) > min_delta) l_max *= 2;
+
+            // Binary search for the other end
+            int64_t l = 0;
+            for(int64_t t = l_max / 2; t >= 1; t /= 2) {
+                if(delta(i, i + (l + t) * d) > min_delta) l += t;
             }
+            int64_t j = i + l * d;
+
+            // Binary search for the split: the last key sharing the node's prefix
+            int node_delta = delta(i, j);
+            int64_t s = 0;
+            for(int64_t div = 2, t = l; t > 1; div *= 2) {
+                t = (l + div - 1) / div;
+                if(delta(i, i + (s + t) * d) > node_delta) s += t;
+            }
+            int64_t split = i + s * d + std::min<int64_t>(d, 0);
+
+            size_t first = static_cast<size_t>(std::min(i, j));
+            size_t last = static_cast<size_t>(std::max(i, j));
+            tree[node].start = first;
+            tree[node].size = last - first + 1;
+            tree[node].l = first == static_cast<size_t>(split) ? n - 1 + split : split;
+            tree[node].r = last == static_cast<size_t>(split + 1) ? n + split : split + 1;
+
+            // Split on the axis of the highest differing bit
+            tree[node].axis = node_delta < 64 ? 2 - (63 - node_delta) % 3 : 0;
         }
+    });
+    for(size_t k = 0; k < n; k++) {
+        tree[n - 1 + k].start = k;
+        tree[n - 1 + k].size = 1;
     }
-    assert(nodes[l].size > 0 && nodes[r].size > 0);
-    std::vector<Bucket>().swap(buckets);
 
-    nodes[l].start = nodes[p].start;
-    nodes[r].start = nodes[l].start + nodes[l].size;
-    std::partition(primitives.begin() + nodes[p].start,
-                   primitives.begin() + nodes[p].start + nodes[p].size, [&](const Primitive& p) {
-                       Vec3 c = p.bbox().center();
-                       c = (c - pbox.min) / (pbox.max - pbox.min) * static_cast<float>(n_buckets);
-                       size_t b = static_cast<size_t>(clamp(c[static_cast<int>(lowest.first)], 0.f,
-                                                            static_cast<float>(n_buckets - 1)));
-                       assert(b >= 0 && b < n_buckets);
-                       return b <= lowest.second;
-                   });
+    data.n_nodes = tree.size();
+    finish_lbvh(data, 0, 0);
+}
 
-    //info("l.size: %i. r.size: %i", nodes[l].size, nodes[r].size);
-    //std::stringstream ss;
-    //ss << nodes[l].bbox;
-    //std::string s = ss.str();
-    //std::stringstream().swap(ss);
-    //ss << nodes[r].bbox;
-    //info("l.bbox: %s", s.c_str());
-    //info("r.bbox: %s", ss.str().c_str());
+template<typename Primitive>
+void BVH<Primitive>::finish_lbvh(Build_Data& data, size_t p, size_t depth) {
 
-    if(nodes[l].size > max_leaf_size) {
-        n_buckets = std::clamp(nodes[l].size / max_leaf_size / 10, (size_t)5, (size_t)20);
-        partition(l, n_buckets, max_leaf_size);
+    Build_Node& node = data.nodes[p];
+    if(node.l == node.r) {
+        node.bbox = data.boxes[data.order[node.start]];
+        return;
+    }
+    if(node.size <= data.max_leaf_size || depth + 1 >= max_depth) {
+        node.bbox = BBox();
+        for(size_t i = node.start; i < node.start + node.size; i++) {
+            node.bbox.enclose(data.boxes[data.order[i]]);
+        }
+        node.l = node.r = 0;
+        return;
     }
-    if(nodes[r].size > max_leaf_size) {
-        n_buckets = std::clamp(nodes[r].size / max_leaf_size / 10, (size_t)5, (size_t)20);
-        partition(r, n_buckets, max_leaf_size);
+    finish_lbvh(data, node.l, depth + 1);
+    finish_lbvh(data, node.r, depth + 1);
+    node.bbox = data.nodes[node.l].bbox;
+    node.bbox.enclose(data.nodes[node.r].bbox);
+}
+
+template<typename Primitive> std::vector<Primitive> BVH<Primitive>::unique_primitives() {
+
+    std::vector<Primitive> ret;
+    if(sources.empty()) {
+        ret = std::move(primitives);
+    } else if constexpr(BVH_Splittable<Primitive>::value) {
+        std::vector<bool> seen;
+        for(size_t i = 0; i < primitives.size(); i++) {
+            if(sources[i] >= seen.size()) seen.resize(sources[i] + 1);
+            if(seen[sources[i]]) continue;
+            seen[sources[i]] = true;
+            ret.push_back(std::move(primitives[i]));
+        }
     }
+    primitives.clear();
+    sources.clear();
+    return ret;
 }
 
 template<typename Primitive> Trace BVH<Primitive>::hit(const Ray& ray) const {
@@ -165,136 +827,506 @@ template<typename Primitive> Trace BVH<Primitive>::hit(const Ray& ray) const {
     // with a BVH aggregate if and only if it intersects a primitive in
     // the BVH that is not an aggregate.
 
-    // The starter code simply iterates through all the primitives.
-    // Again, remember you can use hit() on any Primitive value.
+    if constexpr(BVH_Deferred<Primitive>::value) {
+        float t = ray.dist_bounds.y;
+        Hit h;
+        if(!intersect(ray, t, h)) return {};
+        return finish(ray, t, h);
+    } else {
+        Trace ret;
+        float tmax = ray.dist_bounds.y;
+        traverse(ray, tmax, [&](uint32_t first, uint32_t n) {
+            for(uint32_t i = first; i < first + n; i++) {
+                Trace hit = primitives[i].hit(ray);
+                ret = Trace::min(ret, hit);
+                if(ret.hit) tmax = std::min(tmax, ret.distance);
+            }
+        });
+        return ret;
+    }
+}
+
+template<typename Primitive>
+template<typename F>
+void BVH<Primitive>::leaves(F&& leaf) const {
+    for(const Node& node : nodes) {
+        if(node.is_leaf()) leaf(&primitives[node.offset], size_t(node.count));
+    }
+}
 
-     //Trace ret;
-     //for(const Primitive& prim : primitives) {
-     //    Trace hit = prim.hit(ray);
-     //    ret = Trace::min(ret, hit);
-     //}
-     //return ret;
+template<typename Primitive>
+template<typename F>
+void BVH<Primitive>::reached(const Ray& ray, F&& each) const {
+    float tmax = ray.dist_bounds.y;
+    traverse(ray, tmax, [&](uint32_t first, uint32_t n) {
+        for(uint32_t i = first; i < first + n; i++) each(primitives[i]);
+    });
+}
 
-    return hit(root_idx, ray);
+template<typename Primitive>
+template<typename F>
+void BVH<Primitive>::overlapping(const BBox& box, F&& each) const {
+    if(nodes.empty() || box.empty()) return;
+    uint32_t stack[max_depth + 1];
+    size_t top = 0;
+    stack[top++] = 0;
+    while(top > 0) {
+        const Node& node = nodes[stack[--top]];
+        if(node.min.x > box.max.x || node.min.y > box.max.y || node.min.z > box.max.z ||
+           node.max.x < box.min.x || node.max.y < box.min.y || node.max.z < box.min.z) {
+            continue;
+        }
+        if(node.is_leaf()) {
+            for(uint32_t i = node.offset; i < node.offset + node.count; i++) each(primitives[i]);
+        } else {
+            uint32_t left = uint32_t(&node - nodes.data()) + 1;
+            stack[top++] = node.offset;
+            stack[top++] = left;
+        }
+    }
+}
 
+template<typename Primitive>
+template<typename F>
+void BVH<Primitive>::each_node(F&& node) const {
+    for(const Node& n : nodes) node(n.min, n.max, n.offset, uint32_t(n.count));
 }
 
-template<typename Primitive> Trace BVH<Primitive>::hit(size_t n, const Ray& ray) const {
+template<typename Primitive>
+bool BVH<Primitive>::intersect(const Ray& ray, float& tmax, Hit& hit) const {
 
-    auto intersection = [](Vec2 a, Vec2 b) -> std::optional<Vec2> {
-        Vec2 i(std::max(a.x, b.x), std::min(a.y, b.y));
-        if(i.x > i.y) {
-            return std::nullopt;
+    bool found = false;
+    traverse(ray, tmax, [&](uint32_t first, uint32_t n) {
+        if constexpr(BVH_Batched<Primitive>::value) {
+            Hit h;
+            int k = Primitive::intersect_n(&primitives[first], n, ray, tmax, h);
+            if(k >= 0) {
+                hit = h;
+                hit.push(first + k);
+                found = true;
+            }
         } else {
-            return i;
+            for(uint32_t i = first; i < first + n; i++) {
+                Hit h;
+                if(primitives[i].intersect(ray, tmax, h)) {
+                    hit = h;
+                    hit.push(i);
+                    found = true;
+                }
+            }
         }
+    });
+    return found;
+}
+
+template<typename Primitive>
+Trace BVH<Primitive>::finish(const Ray& ray, float t, Hit hit) const {
+    uint32_t i = hit.pop();
+    return primitives[i].finish(ray, t, hit);
+}
+
+template<typename Primitive>
+template<typename F>
+void BVH<Primitive>::traverse(const Ray& ray, float& tmax, F&& leaf) const {
+
+    if constexpr(width > 2) {
+        traverse_wide(ray, tmax, leaf);
+        return;
+    }
+
+    // Both children of an interior node are tested together and the nearer one is
+    // visited first. The other is pushed with its entry distance, so it is dropped
+    // without being opened if leaf() has since shrunk tmax past it.
+    if(nodes.empty()) return;
+
+    struct Entry {
+        uint32_t node;
+        float t;
     };
+    Entry stack[max_depth];
+    size_t top = 0;
+    uint32_t n = 0;
+    uint64_t visited = 1, tested = 0;
 
-    Trace ret;
-    ret.hit = false;
+    // Copied out of the ray, which leaf() could otherwise be assumed to modify
+    Vec3 o = ray.point, inv_d = ray.inv_dir;
+    bool neg[3] = {ray.neg[0], ray.neg[1], ray.neg[2]};
+    float t_root;
+    if(!nodes[0].hit(o, inv_d, neg, ray.dist_bounds.x, tmax, t_root)) {
+        count(visited, tested);
+        return;
+    }
 
-    Vec2 t, l_t, r_t;
-    t = l_t = r_t = Vec2(-FLT_MAX, FLT_MAX);
+    for(;;) {
+        const Node& node = nodes[n];
+        if(node.is_leaf()) {
+            tested += node.count;
+            leaf(node.offset, static_cast<uint32_t>(node.count));
+        } else {
+            uint32_t l = n + 1, r = node.offset;
+            float tl, tr;
+            bool hit_l = nodes[l].hit(o, inv_d, neg, ray.dist_bounds.x, tmax, tl);
+            bool hit_r = nodes[r].hit(o, inv_d, neg, ray.dist_bounds.x, tmax, tr);
+            visited += 2;
+            if(hit_l && hit_r) {
+                if(tr < tl) {
+                    std::swap(l, r);
+                    std::swap(tl, tr);
+                }
+                stack[top++] = {r, tr};
+                n = l;
+                continue;
+            }
+            if(hit_l || hit_r) {
+                n = hit_l ? l : r;
+                continue;
+            }
+        }
 
-    bool h = nodes[n].bbox.hit(ray, t);
-    if(!(h && intersection(t, ray.dist_bounds))) {
-        return ret;
+        while(top > 0 && stack[top - 1].t > tmax) top--;
+        if(top == 0) break;
+        n = stack[--top].node;
     }
+    count(visited, tested);
+}
+
+template<typename Primitive> bool BVH<Primitive>::occluded(const Ray& ray) const {
+
+    // Unlike hit(), any intersection within the ray's bounds will do, so there is
+    // no need to order the children or to keep searching after the first hit.
+    if constexpr(width > 2) return occluded_wide(ray);
+    if(nodes.empty()) return false;
 
-    //std::stringstream ss;
-    //ss << ray;
-    //std::string ray_s = ss.str();
-    //std::stringstream().swap(ss);
-    //ss << nodes[n].bbox;
-    //info("%s hit node %i's %s", ray_s.c_str(), n, ss.str().c_str());
+    Vec3 o = ray.point, inv_d = ray.inv_dir;
+    bool neg[3] = {ray.neg[0], ray.neg[1], ray.neg[2]};
+    uint32_t stack[max_depth];
+    size_t top = 0;
+    uint32_t n = 0;
+    uint64_t visited = 0, tested = 0;
 
-    if(nodes[n].is_leaf()) {
-        //info("Leaf node %i is hit", n);
-        for(size_t i = nodes[n].start; i < nodes[n].start + nodes[n].size; i++) {
-            Trace hit = primitives[i].hit(ray);
-            ret = Trace::min(ret, hit);
+    for(;;) {
+        const Node& node = nodes[n];
+        visited++;
+        float t;
+        if(node.hit(o, inv_d, neg, ray.dist_bounds.x, ray.dist_bounds.y, t)) {
+            if(node.is_leaf()) {
+                if constexpr(BVH_Batched<Primitive>::value) {
+                    tested += node.count;
+                    if(Primitive::occluded_n(&primitives[node.offset], node.count, ray)) {
+                        count(visited, tested);
+                        return true;
+                    }
+                } else {
+                    for(uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                        tested++;
+                        if(primitives[i].occluded(ray)) {
+                            count(visited, tested);
+                            return true;
+                        }
+                    }
+                }
+            } else {
+                stack[top++] = node.offset;
+                n = n + 1;
+                continue;
+            }
         }
-        return ret;
+        if(top == 0) break;
+        n = stack[--top];
     }
-    bool l_h = nodes[nodes[n].l].bbox.hit(ray, l_t);
-    bool r_h = nodes[nodes[n].r].bbox.hit(ray, r_t);
-    if(!(l_h && intersection(l_t, ray.dist_bounds)) && !(r_h && intersection(r_t, ray.dist_bounds))) {
-        return ret;
+    count(visited, tested);
+    return false;
+}
+
+template<typename Primitive> void BVH<Primitive>::build_wide() {
+
+    wide.clear();
+    if(nodes.empty()) return;
+
+    if(nodes[0].is_leaf()) {
+        wide.emplace_back();
+        wide[0].set(0, nodes[0].bbox(), nodes[0].offset, nodes[0].count);
+    } else {
+        collapse(0);
     }
-    if(!(l_h && intersection(l_t, ray.dist_bounds))) {
-        return hit(nodes[n].r, ray);
+}
+
+template<typename Primitive> uint32_t BVH<Primitive>::collapse(uint32_t n) {
+
+    // Gather up to width descendants of interior node n by repeatedly opening the
+    // interior child with the largest surface area, which is the one most likely hit.
+    uint32_t kids[width];
+    size_t n_kids = 0;
+    kids[n_kids++] = n + 1;
+    kids[n_kids++] = nodes[n].offset;
+
+    while(n_kids < width) {
+        size_t open = n_kids;
+        float area = -1.0f;
+        for(size_t i = 0; i < n_kids; i++) {
+            const Node& kid = nodes[kids[i]];
+            if(!kid.is_leaf() && kid.bbox().surface_area() > area) {
+                area = kid.bbox().surface_area();
+                open = i;
+            }
+        }
+        if(open == n_kids) break;
+        uint32_t c = kids[open];
+        kids[open] = c + 1;
+        kids[n_kids++] = nodes[c].offset;
     }
-    if(!(r_h && intersection(r_t, ray.dist_bounds))) {
-        return hit(nodes[n].l, ray);
+
+    uint32_t idx = static_cast<uint32_t>(wide.size());
+    wide.emplace_back();
+    for(size_t i = 0; i < n_kids; i++) {
+        const Node& kid = nodes[kids[i]];
+        uint32_t child = kid.is_leaf() ? kid.offset : collapse(kids[i]);
+        wide[idx].set(i, kid.bbox(), child, kid.count);
     }
-    if(l_t.x < r_t.x) {
-        Trace l_ret = hit(nodes[n].l, ray);
-        if(l_ret.hit && l_ret.distance + EPS_F < r_t.x) {
-            return l_ret;
-        } else {
-            return Trace::min(l_ret, hit(nodes[n].r, ray));
+    return idx;
+}
+
+template<typename Primitive>
+template<typename F>
+void BVH<Primitive>::traverse_wide(const Ray& ray, float& tmax, F&& leaf) const {
+
+    if(wide.empty()) return;
+
+    Vec3 o = ray.point, inv_d = ray.inv_dir;
+    bool neg[3] = {ray.neg[0], ray.neg[1], ray.neg[2]};
+
+    // Each wide node pushes at most width entries and pops one.
+    struct Entry {
+        uint32_t child, count;
+        float t;
+    };
+    Entry stack[max_depth * width];
+    size_t top = 0;
+    stack[top++] = {0, 0, ray.dist_bounds.x};
+    uint64_t visited = 0, tested = 0;
+
+    while(top > 0) {
+        Entry e = stack[--top];
+        if(e.t > tmax) continue;
+
+        if(e.count > 0) {
+            tested += e.count;
+            leaf(e.child, e.count);
+            continue;
         }
-    } else {
-        Trace r_ret = hit(nodes[n].r, ray);
-        if(r_ret.hit && r_ret.distance + EPS_F < l_t.x) {
-            return r_ret;
-        } else {
-            return Trace::min(hit(nodes[n].l, ray), r_ret);
+
+        const Wide_Node<width>& node = wide[e.child];
+        visited++;
+        float t[width];
+        uint32_t mask = node.hit(o, inv_d, neg, ray.dist_bounds.x, tmax, t);
+
+        // Push the children that were hit from far to near, so the nearest pops first
+        size_t first = top;
+        for(size_t i = 0; i < width; i++) {
+            if(!(mask & (1u << i))) continue;
+            size_t j = top++;
+            for(; j > first && stack[j - 1].t < t[i]; j--) stack[j] = stack[j - 1];
+            stack[j] = {node.child[i], node.count[i], t[i]};
         }
     }
+    count(visited, tested);
+}
+
+template<typename Primitive> bool BVH<Primitive>::occluded_wide(const Ray& ray) const {
+
+    if(wide.empty()) return false;
+
+    Vec3 o = ray.point, inv_d = ray.inv_dir;
+    bool neg[3] = {ray.neg[0], ray.neg[1], ray.neg[2]};
+
+    uint32_t stack[max_depth * width];
+    size_t top = 0;
+    stack[top++] = 0;
+    uint64_t visited = 0, tested = 0;
+
+    while(top > 0) {
+        const Wide_Node<width>& node = wide[stack[--top]];
+        visited++;
+        float t[width];
+        uint32_t mask =
+            node.hit(o, inv_d, neg, ray.dist_bounds.x, ray.dist_bounds.y, t);
+
+        for(size_t i = 0; i < width; i++) {
+            if(!(mask & (1u << i))) continue;
+            if(node.count[i] == 0) {
+                stack[top++] = node.child[i];
+                continue;
+            }
+            if constexpr(BVH_Batched<Primitive>::value) {
+                tested += node.count[i];
+                if(Primitive::occluded_n(&primitives[node.child[i]], node.count[i], ray)) {
+                    count(visited, tested);
+                    return true;
+                }
+                continue;
+            }
+            for(uint32_t p = node.child[i]; p < node.child[i] + node.count[i]; p++) {
+                tested++;
+                if(primitives[p].occluded(ray)) {
+                    count(visited, tested);
+                    return true;
+                }
+            }
+        }
+    }
+    count(visited, tested);
+    return false;
+}
+
+template<typename Primitive>
+void BVH<Primitive>::count(uint64_t nodes, uint64_t primitives) {
+    if(!BVH_Counters::enabled.load(std::memory_order_relaxed)) return;
+    BVH_Counters& counters = BVH_Counters::local();
+    counters.nodes += nodes;
+    counters.primitives += primitives;
 }
 
 template<typename Primitive>
-BVH<Primitive>::BVH(std::vector<Primitive>&& prims, size_t max_leaf_size) {
-    build(std::move(prims), max_leaf_size);
+BVH<Primitive>::BVH(std::vector<Primitive>&& prims, size_t max_leaf_size, Thread_Pool* pool) {
+    build(std::move(prims), max_leaf_size, pool);
+}
+
+template<typename Primitive>
+BVH<Primitive>::BVH(std::vector<Primitive>&& prims, const BVH_Options& opt, Thread_Pool* pool) {
+    build(std::move(prims), opt, pool);
 }
 
 template<typename Primitive> BVH<Primitive> BVH<Primitive>::copy() const {
     BVH<Primitive> ret;
     ret.nodes = nodes;
+    ret.wide = wide;
     ret.primitives = primitives;
-    ret.root_idx = root_idx;
+    ret.options = options;
+    ret.built_cost = built_cost;
+    ret.sources = sources;
     return ret;
 }
 
 template<typename Primitive> bool BVH<Primitive>::Node::is_leaf() const {
-
-    // A node is a leaf if l == r, since all interior nodes must have distinct children
-    return l == r;
+    return count > 0;
 }
 
 template<typename Primitive>
-size_t BVH<Primitive>::new_node(BBox box, size_t start, size_t size, size_t l, size_t r) {
-    Node n;
-    n.bbox = box;
-    n.start = start;
-    n.size = size;
-    n.l = l;
-    n.r = r;
-    nodes.push_back(n);
-    return nodes.size() - 1;
+bool BVH<Primitive>::Node::hit(Vec3 o, Vec3 inv_d, const bool neg[3], float tmin, float tmax,
+                               float& t) const {
+
+    // Slab test against the ray's reciprocal direction, taking each axis' near and
+    // far planes by the sign of the ray rather than comparing, so it compiles to
+    // min/max without branches. An axis-parallel ray makes a slab NaN, which fails
+    // both comparisons and leaves the interval unchanged; the far distance is
+    // widened slightly so rounding cannot miss grazing hits.
+    for(int a = 0; a < 3; a++) {
+        float n = ((neg[a] ? max[a] : min[a]) - o[a]) * inv_d[a];
+        float f = ((neg[a] ? min[a] : max[a]) - o[a]) * inv_d[a];
+        f *= 1.0f + 4.0f * FLT_EPSILON;
+        tmin = n > tmin ? n : tmin;
+        tmax = f < tmax ? f : tmax;
+    }
+    t = tmin;
+    return tmin <= tmax;
+}
+
+template<typename Primitive> BBox BVH<Primitive>::Node::bbox() const {
+    return BBox(min, max);
 }
 
 template<typename Primitive> BBox BVH<Primitive>::bbox() const {
-    return nodes[root_idx].bbox;
+    if(nodes.empty()) return {};
+    return nodes[0].bbox();
 }
 
 template<typename Primitive> std::vector<Primitive> BVH<Primitive>::destructure() {
     nodes.clear();
-    return std::move(primitives);
+    wide.clear();
+    return unique_primitives();
 }
 
 template<typename Primitive> void BVH<Primitive>::clear() {
     nodes.clear();
+    wide.clear();
+    sources.clear();
     primitives.clear();
 }
 
+template<typename Primitive>
+template<typename F>
+void BVH<Primitive>::write(std::ostream& out, F&& write_primitive) const {
+
+    auto put = [&](uint64_t v) { out.write(reinterpret_cast<const char*>(&v), sizeof(v)); };
+    put(sizeof(Node));
+    put(nodes.size());
+    put(primitives.size());
+    put(sources.size());
+    out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(Node));
+    for(const Primitive& prim : primitives) write_primitive(out, prim);
+    for(size_t source : sources) put(source);
+}
+
+template<typename Primitive>
+template<typename F>
+bool BVH<Primitive>::read(std::istream& in, const BVH_Options& opt, F&& read_primitive) {
+
+    clear();
+    options = opt;
+    built_cost = 0.0f;
+
+    auto get = [&]() {
+        uint64_t v = 0;
+        in.read(reinterpret_cast<char*>(&v), sizeof(v));
+        return v;
+    };
+    auto fail = [&]() {
+        clear();
+        return false;
+    };
+
+    uint64_t node_size = get(), n_nodes = get(), n_prims = get(), n_sources = get();
+    if(!in || node_size != sizeof(Node) || n_nodes > 2 * n_prims ||
+       (n_sources != 0 && n_sources != n_prims)) {
+        return fail();
+    }
+
+    nodes.resize(n_nodes);
+    in.read(reinterpret_cast<char*>(nodes.data()), n_nodes * sizeof(Node));
+    primitives.reserve(n_prims);
+    for(uint64_t i = 0; i < n_prims && in; i++) {
+        if(!read_primitive(in, primitives)) return fail();
+    }
+    sources.resize(n_sources);
+    for(size_t& source : sources) source = get();
+    if(!in || primitives.size() != n_prims) return fail();
+
+    // Check the file describes a depth-first tree no deeper than the traversal stacks,
+    // since traversal trusts it. Children come after their parents, so one pass finds
+    // the depth of each node.
+    std::vector<uint32_t> depths(nodes.size(), 0);
+    for(size_t i = 0; i < nodes.size(); i++) {
+        const Node& node = nodes[i];
+        bool ok = node.is_leaf() ? uint64_t(node.offset) + node.count <= n_prims
+                                 : node.offset > i + 1 && node.offset < n_nodes;
+        if(!ok || depths[i] >= max_depth) return fail();
+        if(!node.is_leaf()) {
+            depths[i + 1] = std::max(depths[i + 1], depths[i] + 1);
+            depths[node.offset] = std::max(depths[node.offset], depths[i] + 1);
+        }
+    }
+
+    built_cost = sah_cost();
+    if constexpr(width > 2) build_wide();
+    return true;
+}
+
 template<typename Primitive>
 size_t BVH<Primitive>::visualize(GL::Lines& lines, GL::Lines& active, size_t level,
                                  const Mat4& trans) const {
 
     std::stack<std::pair<size_t, size_t>> tstack;
-    tstack.push({root_idx, 0});
+    tstack.push({0, 0});
     size_t max_level = 0;
 
     if(nodes.empty()) return max_level;
@@ -309,7 +1341,7 @@ size_t BVH<Primitive>::visualize(GL::Lines& lines, GL::Lines& active, size_t lev
         Vec3 color = lvl == level ? Vec3(1.0f, 0.0f, 0.0f) : Vec3(1.0f);
         GL::Lines& add = lvl == level ? active : lines;
 
-        BBox box = node.bbox;
+        BBox box = node.bbox();
         box.transform(trans);
         Vec3 min = box.min, max = box.max;
 
@@ -329,10 +1361,10 @@ size_t BVH<Primitive>::visualize(GL::Lines& lines, GL::Lines& active, size_t lev
         edge(Vec3{max.x, min.y, min.z}, Vec3{max.x, min.y, max.z});
 
         if(!node.is_leaf()) {
-            tstack.push({node.l, lvl + 1});
-            tstack.push({node.r, lvl + 1});
+            tstack.push({idx + 1, lvl + 1});
+            tstack.push({node.offset, lvl + 1});
         } else {
-            for(size_t i = node.start; i < node.start + node.size; i++) {
+            for(size_t i = node.offset; i < node.offset + node.count; i++) {
                 size_t c = primitives[i].visualize(lines, active, level - lvl, trans);
                 max_level = std::max(c + lvl, max_level);
             }
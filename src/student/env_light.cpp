@@ -54,7 +54,7 @@ float Env_Map::pdf(Vec3 dir) const {
     return image_sampler.pdf(dir);
 }
 
-Spectrum Env_Map::evaluate(Vec3 dir) const {
+Spectrum Env_Map::evaluate(Vec3 dir, float spread) const {
 
     // TODO (PathTracer): Task 7
 
@@ -70,42 +70,17 @@ Spectrum Env_Map::evaluate(Vec3 dir) const {
     theta = clamp(theta, 0.f, PI_F);
     Vec2 xy(phi / (2.f * PI_F), theta / PI_F);
     assert(within_range(xy.x, 0.f, 1.f) && within_range(xy.y, 0.f, 1.f));
-    //auto v0 = xy;
-    //xy = clamp(xy, Vec2(0.f), Vec2(1.f));
-
-    //xy.x = 1.f - xy.x;
     xy.y = 1.f - xy.y;
-    auto v1 = xy;
-    auto wh = image.dimension();
-    Vec2 wh_f(static_cast<float>(wh.first), static_cast<float>(wh.second));
-    xy *= wh_f;
-    //auto v2 = xy;
-    //assert(xy.x >= 0.f && xy.x <= wh_f.x);
-    //assert(xy.y >= 0.f && xy.y <= wh_f.y);
-    xy -= Vec2(0.5f, 0.5f);
-    //auto v3 = xy;
-    //assert(xy.x >= -0.5f && xy.x < wh_f.x);
-    //assert(xy.y >= -0.5f && xy.y < wh_f.y);
-    //xy.x = xy.x < 0.f ? wh_f.x - 0.5f : xy.x;
-    //auto v4 = xy;
-    //xy.y = xy.y < 0.f ? wh_f.y - 0.5f : xy.y;
-    //auto v5 = xy;
-    //assert(xy.x >= 0.f && xy.x < wh_f.x);
-    //assert(xy.y >= 0.f && xy.y < wh_f.y);
-    int x0 = static_cast<int>(std::floor(xy.x));
-    int y0 = static_cast<int>(std::floor(xy.y));
-    float w_x = xy.x - static_cast<float>(x0);
-    float w_y = xy.y - static_cast<float>(y0);
-    x0 = static_cast<int>((x0 + wh.first) % wh.first);
-    int x1 = (x0 + 1) % wh.first;
-    int y1 = y0 + 1;
-    y0 = std::max(y0, 0);
-    y1 = std::min(y1, static_cast<int>(wh.second - 1));
-    auto p0 = lerp(image.at(x0, y0), image.at(x0, y1), w_y);
-    auto p1 = lerp(image.at(x1, y0), image.at(x1, y1), w_y);
-    auto p = lerp(p0, p1, w_x);
-
-    return p;
+
+    // Each level up doubles the side of a texel, so the level whose texels cover the
+    // cone is half the log2 of the ratio of their solid angles (taken at the equator)
+    float lod = 0.0f;
+    if(spread > 0.0f) {
+        auto [w, h] = image.dimension();
+        float texel = 2.f * PI_F * PI_F / static_cast<float>(w * h);
+        lod = std::max(0.5f * std::log2(spread / texel), 0.0f);
+    }
+    return image.lookup(xy, lod);
 }
 
 Vec3 Env_Hemisphere::sample() const {
@@ -7,6 +7,7 @@
 #include <functional>
 
 #include "../geometry/halfedge.h"
+#include "../util/parallel.h"
 #include "debug.h"
 #include "../lib/log.h"
 
@@ -1035,98 +1036,146 @@ void Halfedge_Mesh::extrude_vertex_position(const Vec3& start_positions, Halfedg
 *********************** Global Operations *************************
 ******************************************************************/
 
-/*
-    Splits all non-triangular faces into triangles.
-*/
-void Halfedge_Mesh::triangulate() {
+// Twice the signed area of the triangle (a, b, c): positive if it turns left
+static float turn(Vec2 a, Vec2 b, Vec2 c) {
+    return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+}
 
-    // For each face...
-    for(auto f = faces.begin(); f != faces.end(); f++) {
-        auto bdry_halfedges = get_boundary_halfedges(f->halfedge());
-        auto verts = get_vertices(f);
-        auto n_verts = bdry_halfedges.size();
-        if(n_verts == 3) {
-            continue;
-        }
-        
-        if(n_verts == 4) {
-            auto v0 = verts[0];
-            auto v1 = verts[1];
-            auto v2 = verts[2];
-            auto v3 = verts[3];
-            auto e0 = new_edge();
-            auto f0 = new_face();
-            auto h0 = bdry_halfedges[0];
-            auto h1 = bdry_halfedges[1];
-            auto h2 = new_halfedge();
-            auto h3 = new_halfedge();
-            auto h4 = bdry_halfedges[2];
-            auto h5 = bdry_halfedges[3];
-
-            v0->halfedge() = h0;
-            v1->halfedge() = h1;
-            v2->halfedge() = h4;
-            v3->halfedge() = h5;
-            e0->halfedge() = h2;
-            f->halfedge() = h3;
-            f0->halfedge() = h2;
-            h0->face() = f0;
-            h1->set_neighbors(h2, h1->twin(), v1, h1->edge(), f0);
-            h2->set_neighbors(h0, h3, v2, e0, f0);
-            h3->set_neighbors(h4, h2, v0, e0, f);
-            h5->next() = h3;
+// Cuts non-boundary face f, of degree n, into triangles with the n - 3 new edges and
+// faces and 2(n - 3) new halfedges given. Only f's own halfedges and the given elements
+// are written, so different faces may be split at once.
+static void split_face(Halfedge_Mesh::FaceRef f, size_t n, const Halfedge_Mesh::EdgeRef* edges,
+                       const Halfedge_Mesh::FaceRef* faces,
+                       const Halfedge_Mesh::HalfedgeRef* halfedges) {
+
+    // The corners left to cut off, in the plane of the face. Each has the halfedge
+    // leaving it along what is left of the polygon.
+    struct Corner {
+        Halfedge_Mesh::HalfedgeRef out;
+        Vec2 pos;
+        size_t prev, next;
+    };
+    thread_local std::vector<Corner> corners;
+    corners.resize(n);
 
-            continue;
-        }
+    Vec3 N = f->normal();
+    Vec3 u = cross(N, std::abs(N.x) < 0.9f ? Vec3(1.0f, 0.0f, 0.0f) : Vec3(0.0f, 1.0f, 0.0f));
+    u.normalize();
+    Vec3 v = cross(N, u);
 
-        for(size_t i = 0; i < n_verts / 2; i++) {
-            auto v0 = verts[i * 2];
-            auto v1 = verts[(i * 2 + 1) % n_verts];
-            auto v2 = verts[(i * 2 + 2) % n_verts];
-            auto e0 = new_edge();
-            auto f0 = new_face();
-            auto h0 = bdry_halfedges[i * 2];
-            auto h1 = bdry_halfedges[(i * 2 + 1) % n_verts];
-            auto h2 = new_halfedge();
-            auto h3 = new_halfedge();
-
-            v0->halfedge() = h0;
-            v1->halfedge() = h1;
-            e0->halfedge() = h2;
-            f->halfedge() = h3;
-            f0->halfedge() = h2;
-            h0->set_neighbors(h1, h0->twin(), v0, h0->edge(), f0);
-            h1->set_neighbors(h2, h1->twin(), v1, h1->edge(), f0);
-            h2->set_neighbors(h0, h3, v2, e0, f0);
-            h3->set_neighbors(h3, h2, v0, e0, f);
-        }
-        if(n_verts % 2 != 0) {
-            for(size_t i = 0; i < n_verts / 2 - 1; i++) {
-                // set h3's next
-
-                auto v0 = verts[i * 2];
-                auto v1 = verts[(i * 2 + 2) % n_verts];
-                auto h3 = get_last_halfedge(v0->halfedge())->twin();
-                auto h4 = get_last_halfedge(v1->halfedge())->twin();
-                h3->next() = h4;
+    auto h = f->halfedge();
+    for(size_t c = 0; c < n; c++) {
+        Vec3 p = h->vertex()->pos;
+        corners[c] = {h, Vec2(dot(p, u), dot(p, v)), (c + n - 1) % n, (c + 1) % n};
+        h = h->next();
+    }
+
+    bool convex = true;
+    for(size_t c = 0; c < n && convex; c++) {
+        const Corner& C = corners[c];
+        convex = turn(corners[C.prev].pos, C.pos, corners[C.next].pos) >= 0.0f;
+    }
+
+    // Whether no other corner is within the triangle cut off at c
+    auto is_ear = [&](size_t c) {
+        size_t p = corners[c].prev, q = corners[c].next;
+        Vec2 a = corners[p].pos, b = corners[c].pos, d = corners[q].pos;
+        if(turn(a, b, d) <= 0.0f) return false;
+        for(size_t r = corners[q].next; r != p; r = corners[r].next) {
+            Vec2 x = corners[r].pos;
+            if(turn(a, b, x) >= 0.0f && turn(b, d, x) >= 0.0f && turn(d, a, x) >= 0.0f) {
+                return false;
             }
-            auto v0 = verts[n_verts - 3];
-            auto h3 = get_last_halfedge(v0->halfedge())->twin();
-            auto h4 = bdry_halfedges[n_verts - 1];
-            h3->next() = h4;
-            h4->next() = get_last_halfedge(verts[0]->halfedge())->twin();
+        }
+        return true;
+    };
+
+    // Cuts off the triangle at corner c with the next new edge, which runs from the
+    // corner after c to the one before it; returns the corner after c
+    size_t made = 0;
+    auto clip = [&](size_t c) {
+        size_t p = corners[c].prev, q = corners[c].next;
+        auto a = corners[p].out, b = corners[c].out, q_out = corners[q].out;
+        auto inside = halfedges[2 * made], outside = halfedges[2 * made + 1];
+        auto e = edges[made];
+        auto tri = faces[made];
+        made++;
+
+        a->next() = b;
+        a->face() = tri;
+        b->next() = inside;
+        b->face() = tri;
+        inside->set_neighbors(a, outside, q_out->vertex(), e, tri);
+        outside->set_neighbors(q_out, inside, a->vertex(), e, f);
+        e->halfedge() = inside;
+        tri->halfedge() = inside;
+
+        corners[p].out = outside;
+        corners[p].next = q;
+        corners[q].prev = p;
+        return q;
+    };
+
+    // Convex faces become a fan from their first corner. Otherwise ears are found by
+    // walking the polygon; if a whole lap finds none (the face overlaps itself in the
+    // plane), the next corner is cut off anyway.
+    size_t c = 1, left = n, missed = 0;
+    while(left > 3) {
+        if(convex || missed == left || is_ear(c)) {
+            c = clip(c);
+            left--;
+            missed = 0;
         } else {
-            for(size_t i = 0; i < n_verts / 2; i++) {
-                // set h3's next
-
-                auto v0 = verts[i * 2];
-                auto v1 = verts[(i * 2 + 2) % n_verts];
-                auto h3 = get_last_halfedge(v0->halfedge())->twin();
-                auto h4 = get_last_halfedge(v1->halfedge())->twin();
-                h3->next() = h4;
-            }
+            c = corners[c].next;
+            missed++;
         }
     }
+
+    // The last triangle keeps f
+    auto a = corners[c].out, b = corners[corners[c].next].out, d = corners[corners[c].prev].out;
+    a->next() = b;
+    b->next() = d;
+    d->next() = a;
+    a->face() = b->face() = d->face() = f;
+    f->halfedge() = a;
+}
+
+/*
+    Splits all non-triangular faces into triangles.
+
+    Every new element is made up front, then the faces are split in parallel, each
+    with its own share of the new elements.
+*/
+void Halfedge_Mesh::triangulate() {
+
+    // Face i of polys has the degree corner_start[i + 1] - corner_start[i], and takes
+    // the new edges and faces from corner_start[i] - 3i on
+    std::vector<FaceRef> polys;
+    std::vector<Index> corner_start{0};
+    for(FaceRef f = faces_begin(); f != faces_end(); f++) {
+        if(f->is_boundary()) continue;
+        unsigned int n = f->degree();
+        if(n <= 3) continue;
+        polys.push_back(f);
+        corner_start.push_back(corner_start.back() + n);
+    }
+    if(polys.empty()) return;
+
+    size_t P = polys.size(), D = corner_start.back() - 3 * P;
+    if(next_id + 4 * D > by_id.size()) by_id.resize(next_id + 4 * D);
+
+    std::vector<EdgeRef> new_edges(D);
+    std::vector<FaceRef> new_faces(D);
+    std::vector<HalfedgeRef> new_halfedges(2 * D);
+    for(auto& e : new_edges) e = new_edge();
+    for(auto& f : new_faces) f = new_face();
+    for(auto& h : new_halfedges) h = new_halfedge();
+
+    parallel_for(0, P, 256, [&](size_t i) {
+        size_t d = corner_start[i] - 3 * i;
+        split_face(polys[i], corner_start[i + 1] - corner_start[i], &new_edges[d], &new_faces[d],
+                   &new_halfedges[2 * d]);
+    });
 }
 
 /* Note on the quad subdivision process:
@@ -1420,15 +1469,31 @@ bool Halfedge_Mesh::isotropic_remesh() {
     }
     L /= static_cast<float>(n_edges());
 
+    float long_edge = 4.f * L / 3.f, short_edge = 4.f * L / 5.f;
+
+    // Splitting and collapsing work through queues of the edges out of range rather
+    // than over every edge, and queue the edges they make that are still out of range
+    std::vector<EdgeRef> queue;
+
     info("Step 1: splitting");
-    auto e = edges.begin();
-    for(size_t i = 0, num_edges = n_edges(); i < num_edges; i++) {
-        auto next = e;
-        next++;
-        if(e->length() - EPSLON > 4.f * L / 3.f) {
-            split_edge(e);
-        }
-        e = next;
+    for(auto e = edges.begin(); e != edges.end(); e++) {
+        if(e->length() - EPSLON > long_edge) queue.push_back(e);
+    }
+    while(!queue.empty()) {
+        EdgeRef e = queue.back();
+        queue.pop_back();
+        VertexRef a = e->halfedge()->vertex(), b = e->halfedge()->twin()->vertex();
+        auto v = split_edge(e);
+        if(!v) continue;
+        // The two halves of e
+        HalfedgeRef h = (*v)->halfedge();
+        do {
+            VertexRef u = h->twin()->vertex();
+            if((u == a || u == b) && h->edge()->length() - EPSLON > long_edge) {
+                queue.push_back(h->edge());
+            }
+            h = h->twin()->next();
+        } while(h != (*v)->halfedge());
     }
     info("Step 1 finised. Validating...");
     auto err = validate();
@@ -1446,31 +1511,40 @@ bool Halfedge_Mesh::isotropic_remesh() {
     info("Validation finished");
 
     info("Step 2: collapsing");
-    e = edges.begin();
-    for(size_t i = 0, num_edges = n_edges(); i < num_edges; i++) {
-        auto next = e;
-        next++;
-
-        if(e->length() + EPSLON < 4.f * L / 5.f) {
-            auto incident_faces = get_incident_faces(e);
-
-            while(std::find_if(incident_faces.begin(), incident_faces.end(), [&](FaceRef f) {
-                      return f == next->halfedge()->face() || f == next->halfedge()->twin()->face();
-                  }) != incident_faces.end()) {
-                next++;
-            }
-            i += 2;
-
-            auto v = collapse_edge_erase(e);
-            if(v == std::nullopt) {
-                info("Skipping edge %i", e->id());
-                next = e;
-                next++;
-                i -= 2;
-            }
+    // Collapsed elements are erased all at once by the validation after the pass, so
+    // queued edges may have been erased in the meantime. Edges whose ends share
+    // neighbors other than the two across them would pinch the surface.
+    auto pinches = [](EdgeRef e) {
+        VertexRef a = e->halfedge()->vertex(), b = e->halfedge()->twin()->vertex();
+        unsigned int shared = 0;
+        HalfedgeRef h = a->halfedge();
+        do {
+            HalfedgeRef g = b->halfedge();
+            do {
+                if(g->twin()->vertex() == h->twin()->vertex()) shared++;
+                g = g->twin()->next();
+            } while(g != b->halfedge());
+            h = h->twin()->next();
+        } while(h != a->halfedge());
+        return shared != 2;
+    };
+    for(auto e = edges.begin(); e != edges.end(); e++) {
+        if(e->length() + EPSLON < short_edge) queue.push_back(e);
+    }
+    while(!queue.empty()) {
+        EdgeRef e = queue.back();
+        queue.pop_back();
+        if(eerased.count(e) || e->length() + EPSLON >= short_edge || pinches(e)) continue;
+        auto v = collapse_edge(e);
+        if(v == std::nullopt) {
+            info("Skipping edge %i", e->id());
+            continue;
         }
-
-        e = next;
+        HalfedgeRef h = (*v)->halfedge();
+        do {
+            if(h->edge()->length() + EPSLON < short_edge) queue.push_back(h->edge());
+            h = h->twin()->next();
+        } while(h != (*v)->halfedge());
     }
     info("Step 2 finished. Validating...");
     err = validate();
@@ -1499,13 +1573,15 @@ bool Halfedge_Mesh::isotropic_remesh() {
     info("Validation finished");
 
     info("Step 3: flipping");
-    for(e = edges.begin(); e != edges.end(); e++) {
+    for(auto e = edges.begin(); e != edges.end(); e++) {
         auto h0 = e->halfedge();
         auto h1 = h0->twin();
         auto v0 = h0->vertex();
         auto v1 = h1->vertex();
         auto v2 = h0->next()->next()->vertex();
         auto v3 = h1->next()->next()->vertex();
+        // A vertex left with two faces would fold them onto each other
+        if(v0->degree() <= 3 || v1->degree() <= 3) continue;
         auto deviation = dev(v0) + dev(v1) + dev(v2) + dev(v3);
         if(deviation > dev(v0, -1) + dev(v1, -1) + dev(v2, 1) + dev(v3, 1)) {
             flip_edge(e);
@@ -1528,36 +1604,51 @@ bool Halfedge_Mesh::isotropic_remesh() {
 
     info("Step 4: smoothing");
     info("Number of vertices: %i", n_vertices());
+
+    // Smoothing only moves vertices, so it runs on a flat copy of the positions and of
+    // each vertex's neighbors (in order around it), computing every vertex of an
+    // iteration in parallel from the positions of the last
+    std::vector<VertexRef> verts;
+    std::unordered_map<unsigned int, Index> index(n_vertices());
+    verts.reserve(n_vertices());
+    for(auto v = vertices.begin(); v != vertices.end(); v++) {
+        index[v->id()] = verts.size();
+        verts.push_back(v);
+    }
+    std::vector<Vec3> pos(verts.size()), smoothed(verts.size());
+    std::vector<Index> ring_start(1, 0), ring;
+    ring.reserve(2 * n_edges());
+    for(size_t i = 0; i < verts.size(); i++) {
+        pos[i] = verts[i]->pos;
+        HalfedgeRef h = verts[i]->halfedge();
+        do {
+            ring.push_back(index[h->twin()->vertex()->id()]);
+            h = h->twin()->next();
+        } while(h != verts[i]->halfedge());
+        ring_start.push_back(ring.size());
+    }
+
     for(int i = 0; i < 15; i++) {
-        for(auto v = vertices.begin(); v != vertices.end(); v++) {
-            //info("Processing vertex %i", v->id());
-            auto c = v->neighborhood_center();
-            auto p = v->pos;
-            auto d = c - p;
-            if(!(std::isfinite(d.x) && std::isfinite(d.y) && std::isfinite(d.z))) {
-                info("d = (%f, %f, %f) is infinite (before substracting)", d.x, d.y, d.z);
-            }
-            auto N = v->normal();
-            d = d - dot(d, N) * N;
-            if (!(std::isfinite(c.x) && std::isfinite(c.y) && std::isfinite(c.z))) {
-                info("c = (%f, %f, %f) is infinite", c.x, c.y, c.z);
+        parallel_for(0, verts.size(), 1024, [&](size_t v) {
+            // As Vertex::neighborhood_center and Vertex::normal; each face around v
+            // lies between a neighbor and the one before it
+            Index begin = ring_start[v], d = ring_start[v + 1] - begin;
+            Vec3 p = pos[v], c, N;
+            for(Index j = 0; j < d; j++) {
+                Vec3 pj = pos[ring[begin + j]];
+                Vec3 pk = pos[ring[begin + (j + d - 1) % d]];
+                c += pj;
+                N += cross(pj - p, pk - p);
             }
-            if(!(std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z))) {
-                info("p = (%f, %f, %f) is infinite", p.x, p.y, p.z);
-            }
-            if(!(std::isfinite(N.x) && std::isfinite(N.y) && std::isfinite(N.z))) {
-                info("N = (%f, %f, %f) is infinite", N.x, N.y, N.z);
-            }
-            if(!(std::isfinite(d.x) && std::isfinite(d.y) && std::isfinite(d.z))) {
-                info("d = (%f, %f, %f) is infinite", d.x, d.y, d.z);
-                info("d dot N = %f", dot(d, N));
-            }
-            v->new_pos = p + d * (1.f / 5.f);
-        }
-        for(auto v = vertices.begin(); v != vertices.end(); v++) {
-            v->pos = v->new_pos;
-        }
-    }
+            c /= (float)d;
+            N = N.unit();
+            Vec3 t = c - p;
+            t -= dot(t, N) * N;
+            smoothed[v] = p + t * (1.f / 5.f);
+        });
+        std::swap(pos, smoothed);
+    }
+    parallel_for(0, verts.size(), 1024, [&](size_t v) { verts[v]->pos = pos[v]; });
     info("Step 4 finished");
 
     return true;
@@ -1678,32 +1769,7 @@ template<class T> struct PQueue {
 */
 bool Halfedge_Mesh::simplify() {
 
-    std::unordered_map<VertexRef, Mat4> vertex_quadrics;
-    std::unordered_map<FaceRef, Mat4> face_quadrics;
-    std::unordered_map<EdgeRef, Edge_Record> edge_records;
-    PQueue<Edge_Record> edge_queue;
-
-    // Compute initial quadrics for each face by simply writing the plane equation
-    // for the face in homogeneous coordinates. These quadrics should be stored
-    // in face_quadrics
-    // -> Compute an initial quadric for each vertex as the sum of the quadrics
-    //    associated with the incident faces, storing it in vertex_quadrics
-    // -> Build a priority queue of edges according to their quadric error cost,
-    //    i.e., by building an Edge_Record for each edge and sticking it in the
-    //    queue. You may want to use the above PQueue<Edge_Record> for this.
-    // -> Until we reach the target edge budget, collapse the best edge. Remember
-    //    to remove from the queue any edge that touches the collapsing edge
-    //    BEFORE it gets collapsed, and add back into the queue any edge touching
-    //    the collapsed vertex AFTER it's been collapsed. Also remember to assign
-    //    a quadric to the collapsed vertex, and to pop the collapsed edge off the
-    //    top of the queue.
-
-    // Note: if you erase elements in a local operation, they will not be actually deleted
-    // until do_erase or validate are called. This is to facilitate checking
-    // for dangling references to elements that will be erased.
-    // The rest of the codebase will automatically call validate() after each op,
-    // but here simply calling collapse_edge() will not erase the elements.
-    // You should use collapse_edge_erase() instead for the desired behavior.
-
-    return false;
+    // Quadric error simplification (geometry/simplify.cpp) runs on an indexed copy of
+    // the mesh, with a binary heap in place of PQueue; aim for a quarter of the faces.
+    return simplify((n_faces() - n_boundaries()) / 4);
 }
@@ -2,13 +2,26 @@
 #include "../scene/particles.h"
 #include "../rays/pathtracer.h"
 
-static Vec3 reflect(Vec3 dir) {
+static Vec3 reflect(Vec3 dir, Vec3 normal) {
 
-    // Return reflection of dir about the surface normal (0,1,0).
-    return Vec3(-dir.x, dir.y, -dir.z);
+    // Return reflection of dir about the unit surface normal.
+    return dir - 2.0f * dot(dir, normal) * normal;
 }
 
-bool Scene_Particles::Particle::update(const PT::Object& scene, float dt, float radius) {
+// Time until a particle at o (relative to the sphere's center) moving along unit
+// direction d first touches a sphere of the given radius, or -1 if it doesn't
+static float sphere_contact(Vec3 o, Vec3 d, float radius) {
+    float OdotD = dot(o, d);
+    float c = o.norm_squared() - radius * radius;
+    // Already touching: bounce now if moving inwards
+    if(c <= 0.0f) return OdotD < 0.0f ? 0.0f : -1.0f;
+    if(OdotD >= 0.0f) return -1.0f;
+    float discrim = OdotD * OdotD - c;
+    if(discrim < 0.0f) return -1.0f;
+    return -OdotD - std::sqrt(discrim);
+}
+
+bool Scene_Particles::Particle::update(const Colliders& colliders, float dt, float radius) {
 
     // TODO(Animation): Task 4
 
@@ -25,51 +38,54 @@ bool Scene_Particles::Particle::update(const PT::Object& scene, float dt, float
 
     // (5) Decrease the particle's age and return whether it should die.
 
-    //info("dt: %f", dt);
     float remaining_time = dt;
-    //size_t ctr = 0;
+    int bounces = 0;
     while(remaining_time > EPS_F) {
-        Ray r(pos, velocity, Vec2(EPS_F, std::numeric_limits<float>::max()));
-        auto hit = scene.hit(r);
-        if(!hit.hit) {
-            break;
-        }
 
-        float VdotN = dot(velocity.unit(), hit.normal.unit());
-        //if(VdotN > 0.f) {
-        //    hit.normal = -hit.normal;
-        //}
-        float t = (hit.distance - radius / std::abs(VdotN)) / velocity.norm();
-        if(t > remaining_time) {
-            break;
+        float speed = velocity.norm();
+        if(speed == 0.0f) break;
+        Vec3 dir = velocity / speed;
+
+        // The earliest contact within this step, if any
+        float t = remaining_time;
+        Vec3 normal;
+        bool hit = false;
+
+        for(const Colliders::Sphere& sphere : colliders.spheres) {
+            Vec3 o = pos - sphere.center;
+            float d = sphere_contact(o, dir, sphere.radius + radius);
+            if(d >= 0.0f && d / speed <= t) {
+                t = d / speed;
+                normal = o + dir * d;
+                hit = true;
+            }
         }
-        if(t < 0.f) {
-            //info("t = %f", t);
-            t = 0.f;
+
+        // Only surfaces within reach of this step matter
+        auto trace = colliders.scene.sweep(pos, velocity * t, radius);
+        if(trace.hit) {
+            // Back off along the path until the particle's surface, not its center,
+            // meets the hit surface
+            float VdotN = dot(dir, trace.normal.unit());
+            float s = std::max((trace.distance - radius / std::abs(VdotN)) / speed, 0.0f);
+            if(s <= t) {
+                t = s;
+                normal = trace.normal;
+                hit = true;
+            }
         }
 
+        if(!hit) break;
+
         pos += velocity * t;
-        auto local_to_world = Mat4::rotate_to(hit.normal);
-        auto world_to_local = local_to_world.inverse();
-        auto v = local_to_world.rotate(reflect(-world_to_local.rotate(velocity)));
-        //if(std::abs(v.norm() - velocity.norm()) > EPS_F) {
-        //    die("reflected velocity not equal to original velocity in magnitude");
-        //}
-        //if(t == 0.f) {
-        //    info("pos: (%f, %f, %f)", pos.x, pos.y, pos.z);
-        //    info("hit pos: (%f, %f, %f)", hit.position.x, hit.position.y, hit.position.z);
-        //    info("radius: %f", radius);
-        //    info("vel: (%f, %f, %f)", velocity.x, velocity.y, velocity.z);
-        //    info("reflected: (%f, %f, %f)", v.x, v.y, v.z);
-        //    info("normal: (%f, %f, %f)", hit.normal.x, hit.normal.y, hit.normal.z);
-        //}
-        velocity = v;
+        velocity = reflect(velocity, normal.unit());
         velocity += acceleration * t;
-
         remaining_time -= t;
-        //info("remaining time: %f", remaining_time);
-        //ctr++;
-        //if(ctr > 20) break;
+
+        if(++bounces == max_bounces) {
+            remaining_time = 0.0f;
+            break;
+        }
     }
     pos += velocity * remaining_time;
     velocity += acceleration * remaining_time;
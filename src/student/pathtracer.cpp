@@ -8,7 +8,17 @@
 
 namespace PT {
 
-Spectrum Pathtracer::trace_pixel(size_t x, size_t y) {
+Spectrum Pathtracer::trace_pixel(const View& view, size_t x, size_t y) {
+    return with_light_kinds(
+        [&](auto lights) { return trace_pixel<decltype(lights)::value>(view, x, y); });
+}
+
+std::pair<Spectrum, Spectrum> Pathtracer::trace(const Ray& ray) {
+    return with_light_kinds([&](auto lights) { return trace<decltype(lights)::value>(ray); });
+}
+
+template<unsigned int Lights>
+Spectrum Pathtracer::trace_pixel(const View& view, size_t x, size_t y) {
 
     // TODO (PathTracer): Task 1
 
@@ -33,16 +43,24 @@ Spectrum Pathtracer::trace_pixel(size_t x, size_t y) {
     xy += sampler.sample();
     //if(is_logging) info("Coordinates of sample: (%f, %f)", xy.x, xy.y);
 
-    Ray ray = camera.generate_ray(xy / wh);
+    Ray ray = view.camera.generate_ray(xy / wh);
     ray.depth = max_depth;
+    ray.spread = view.pixel_spread;
 
     //if(is_logging) log_ray(ray, 10.f);
 
     // Pathtracer::trace() returns the incoming light split into emissive and reflected components.
-    auto [emissive, reflected] = trace(ray);
+    // A rasterized depth pass bounds where the first hit can be (see set_primary_depth)
+    float first_bound = std::numeric_limits<float>::infinity();
+    if(!primary_bounds.empty()) {
+        first_bound = primary_bounds[y * out_w + x] / dot(ray.dir, view.camera.front());
+    }
+
+    auto [emissive, reflected] = trace<Lights>(ray, first_bound);
     return emissive + reflected;
 }
 
+template<unsigned int Lights>
 Spectrum Pathtracer::sample_indirect_lighting(const Shading_Info& hit) {
 
     // TODO (PathTrace): Task 4
@@ -64,6 +82,10 @@ Spectrum Pathtracer::sample_indirect_lighting(const Shading_Info& hit) {
     // by Pathtracer::trace()), as the direct component will be computed in
     // Pathtracer::sample_direct_lighting().
 
+    if(guide_passes > 0 && !hit.bsdf.is_discrete()) {
+        return sample_guided_indirect(hit);
+    }
+
     auto sctr = hit.bsdf.scatter(hit.out_dir);
     if(sctr.attenuation == Spectrum()) {
         return {};
@@ -75,14 +97,22 @@ Spectrum Pathtracer::sample_indirect_lighting(const Shading_Info& hit) {
     if(pdf == 0.f) {
         return {};
     }
+    Spectrum weight = sctr.attenuation / pdf;
+    if(!roulette(hit.depth, hit.throughput, weight)) {
+        return {};
+    }
     sctr.transform(hit.object_to_world);
 
     Ray ray(hit.pos, sctr.direction, Vec2(EPS_F, std::numeric_limits<float>::max()), hit.depth - 1);
+    ray.throughput = hit.throughput * weight;
+    if(!hit.bsdf.is_discrete()) ray.spread = 1.0f / pdf;
+    ray.caustic = !hit.bsdf.is_discrete() || hit.caustic;
 
-    auto [emissive, reflected] = trace(ray);
-    return reflected * sctr.attenuation / pdf;
+    auto [emissive, reflected] = trace<Lights>(ray);
+    return reflected * weight;
 }
 
+template<unsigned int Lights>
 Spectrum Pathtracer::sample_direct_lighting(const Shading_Info& hit) {
 
     // This function computes a Monte Carlo estimate of the _direct_ lighting at our ray
@@ -90,7 +120,11 @@ Spectrum Pathtracer::sample_direct_lighting(const Shading_Info& hit) {
 
     // Point lights are handled separately, as they cannot be intersected by tracing rays
     // into the scene.
-    Spectrum radiance = point_lighting(hit);
+    Spectrum radiance;
+    if constexpr((Lights & Light_Kinds::point) != 0) radiance = point_lighting(hit);
+
+    // Without area or environment lights there are none to sample, so only the BSDF is
+    constexpr bool sample_lights = (Lights & (Light_Kinds::env | Light_Kinds::area)) != 0;
 
     // TODO (PathTrace): Task 4
 
@@ -121,6 +155,10 @@ Spectrum Pathtracer::sample_direct_lighting(const Shading_Info& hit) {
     // BSDF::pdf(), and Pathtracer::area_lights_pdf() to compute the proper weighting.
     // What is the PDF of our sample, given it could have been produced from either source?
 
+    if(sample_lights && light_samples > 0 && !hit.bsdf.is_discrete()) {
+        return sample_lights_mis(hit) + radiance;
+    }
+
     float pdf = 1.f;
     Spectrum attenuation(1.f);
     Vec3 in_dir;
@@ -132,6 +170,14 @@ Spectrum Pathtracer::sample_direct_lighting(const Shading_Info& hit) {
         attenuation = sctr.attenuation;
         sctr.transform(hit.object_to_world);
         in_dir = sctr.direction;
+    } else if constexpr(!sample_lights) {
+        Scatter sctr = hit.bsdf.scatter(hit.out_dir);
+        in_dir = hit.object_to_world.rotate(sctr.direction);
+        attenuation = hit.bsdf.evaluate(hit.out_dir, sctr.direction);
+        pdf = hit.bsdf.pdf(hit.out_dir, sctr.direction);
+        if(attenuation == Spectrum() || pdf <= 0.0f) {
+            return radiance;
+        }
     } else {
         if(RNG::unit() < 0.5f) {
             Scatter sctr = hit.bsdf.scatter(hit.out_dir);
@@ -148,26 +194,39 @@ Spectrum Pathtracer::sample_direct_lighting(const Shading_Info& hit) {
     }
 
     Ray ray(hit.pos, in_dir, Vec2(EPS_F, std::numeric_limits<float>::max()), 0);
+    if(!hit.bsdf.is_discrete()) ray.spread = 1.0f / pdf;
     if(RNG::coin_flip(0.0005f)) {
         log_ray(ray, debug_data.ray_length);
     }
-    auto [emissive, reflected] = trace(ray);
+    auto [emissive, reflected] = trace<Lights>(ray);
+    // Lights seen through mirrors and glass from a diffuse surface are caustics there,
+    // which the photon map already lit
+    if(hit.caustic && hit.bsdf.is_discrete() && !caustics.empty()) return radiance;
     return emissive * attenuation / pdf + radiance;
 }
 
-std::pair<Spectrum, Spectrum> Pathtracer::trace(const Ray& ray) {
+template<unsigned int Lights>
+std::pair<Spectrum, Spectrum> Pathtracer::trace(const Ray& ray, float first_bound) {
 
     // This function orchestrates the path tracing process. For convenience, it
     // returns the incoming light along a ray in two components: emitted from the
     // surface the ray hits, and reflected through that point from other sources.
 
     // Trace ray into scene.
-    Trace result = scene.hit(ray);
+    count_ray(ray);
+    Trace result;
+    if(first_bound < ray.dist_bounds.y) {
+        // Any hit this near is the closest there is
+        Ray near = ray;
+        near.dist_bounds.y = first_bound;
+        result = scene.hit(near);
+    }
+    if(!result.hit) result = scene.hit(ray);
     if(!result.hit) {
 
         // If no surfaces were hit, sample the environemnt map.
-        if(env_light.has_value()) {
-            return {env_light.value().evaluate(ray.dir), {}};
+        if constexpr((Lights & Light_Kinds::env) != 0) {
+            return {env_light->evaluate(ray.dir, ray.spread), {}};
         }
         return {};
     }
@@ -195,10 +254,12 @@ std::pair<Spectrum, Spectrum> Pathtracer::trace(const Ray& ray) {
     Vec3 out_dir = world_to_object.rotate(ray.point - result.position).unit();
 
     Shading_Info hit = {bsdf,    world_to_object, object_to_world, result.position,
-                        out_dir, result.normal,   ray.depth};
+                        out_dir, result.normal,   ray.depth,       ray.throughput};
+    hit.caustic = ray.caustic;
 
     // Sample and return light reflected through the intersection
-    return {{}, sample_direct_lighting(hit) + sample_indirect_lighting(hit)};
+    return {{}, sample_direct_lighting<Lights>(hit) + sample_indirect_lighting<Lights>(hit) +
+                    caustic_lighting(hit)};
 }
 
 } // namespace PT
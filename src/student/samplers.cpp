@@ -1,5 +1,6 @@
 
 #include "../rays/samplers.h"
+#include "../util/parallel.h"
 #include "../util/rand.h"
 
 namespace Samplers {
@@ -74,16 +75,47 @@ Sphere::Image::Image(const HDR_Image& image) {
     const auto [_w, _h] = image.dimension();
     w = _w;
     h = _h;
-    _pdf.reserve(w * h);
-    _cdf.reserve(w * h);
-
-    for(size_t i = 0; i < h; i++) {
+    size_t n = w * h;
+    _pdf.resize(n);
+    _sin.resize(h);
+
+    // Rows are weighed in parallel, then summed in order so the total is the same
+    // however they were split
+    std::vector<float> row_total(h);
+    parallel_for(0, h, 16, [&](size_t i) {
+        float theta = (h - i - 0.5f) / static_cast<float>(h) * PI_F;
+        _sin[i] = std::sin(theta);
+        float sum = 0.0f;
         for(size_t j = 0; j < w; j++) {
-            float theta = (h - i - 0.5f) / static_cast<float>(h) * PI_F;
-            float p = std::sin(theta) * image.at(j, i).luma();
-            _pdf.push_back(p);
-            total += p;
-            _cdf.push_back(total);
+            float p = _sin[i] * image.at(j, i).luma();
+            _pdf[i * w + j] = p;
+            sum += p;
+        }
+        row_total[i] = sum;
+    });
+    for(float t : row_total) total += t;
+    if(n == 0) return;
+
+    // Vose's construction: texels scaled to a mean weight of one are split into
+    // under- and overfull slots, and each underfull slot is topped up by an
+    // overfull one. Whatever remains (including rounding error) is full.
+    _alias.assign(n, Alias{});
+    if(total <= 0.0f) return;
+    std::vector<float> scaled(n);
+    parallel_for(0, n, 65536,
+                 [&](size_t i) { scaled[i] = _pdf[i] * (static_cast<float>(n) / total); });
+    std::vector<uint32_t> small, large;
+    for(size_t i = 0; i < n; i++) {
+        (scaled[i] < 1.0f ? small : large).push_back(static_cast<uint32_t>(i));
+    }
+    while(!small.empty() && !large.empty()) {
+        uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+        _alias[s] = {scaled[s], l};
+        scaled[l] -= 1.0f - scaled[s];
+        if(scaled[l] < 1.0f) {
+            large.pop_back();
+            small.push_back(l);
         }
     }
 }
@@ -94,8 +126,10 @@ Vec3 Sphere::Image::sample() const {
 
     // Use your importance sampling data structure to generate a sample direction.
     // Tip: std::upper_bound
-    auto i = std::upper_bound(_cdf.begin(), _cdf.end(), RNG::unit() * total) - _cdf.begin();
-    assert(i > 0 && static_cast<size_t>(i) < _cdf.size());
+
+    // A float draw cannot resolve the slots of large maps, so the slot is an integer draw
+    size_t i = static_cast<size_t>(RNG::integer(0, static_cast<int>(_alias.size())));
+    if(!RNG::coin_flip(_alias[i].prob)) i = _alias[i].alias;
     auto x = i % w;
     auto y = i / w;
     Vec2 xy((x + 0.5f) / static_cast<float>(w), (h - y - 0.5f) / static_cast<float>(h));
@@ -117,7 +151,7 @@ float Sphere::Image::pdf(Vec3 dir) const {
     // Nearest neighbor
     size_t x = std::min(static_cast<size_t>(xy.x), w - 1);
     size_t y = std::min(static_cast<size_t>(xy.y), h - 1);
-    float j = w * h / 2.f / PI_F / PI_F / std::sin(pt.y);
+    float j = w * h / 2.f / PI_F / PI_F / _sin[y];
 
     return _pdf[y * w + x] * j / total;
 }
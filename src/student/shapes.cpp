@@ -32,33 +32,74 @@ Trace Sphere::hit(const Ray& ray) const {
     // but only the _later_ one is within ray.dist_bounds, you should
     // return that one!
 
-    Trace ret;
-    ret.hit = false;
+    float t = ray.dist_bounds.y;
+    Hit h;
+    if(!intersect(ray, t, h)) return {};
+    return finish(ray, t, h);
+}
+
+bool Sphere::intersect(const Ray& ray, float& tmax, Hit&) const {
+    return intersect(ray.point, ray.dir, radius, ray.dist_bounds.x, tmax);
+}
+
+bool Sphere::intersect(Vec3 o, Vec3 d, float radius, float tmin, float& tmax) {
 
-    Vec3 o = ray.point, d = ray.dir;
     float OdotD = dot(o, d);
     Vec2 t(-OdotD);
-    float discrim = OdotD * OdotD - o.norm_squared() + radius * radius;
+    // r^2 minus the squared distance of closest approach; the same as
+    // (o.d)^2 - o.o + r^2, without cancellation for a small sphere seen from afar
+    float discrim = radius * radius - (o - OdotD * d).norm_squared();
     if(discrim < 0) {
-        return ret;
+        return false;
     }
     discrim = std::sqrt(discrim);
     if(discrim < EPS_F) {
-        return ret;
+        return false;
     }
     t += Vec2(-discrim, discrim);
-    Vec2 a = intersection(t, ray.dist_bounds);
+    Vec2 a = intersection(t, Vec2(tmin, tmax));
     if(a.x > a.y) {
-        return ret;
+        return false;
     }
+    // The far root is only used if the near one is before the bounds, and can
+    // still be past them
+    float dist = a.x > t.x ? t.y : t.x; // at what distance did the intersection occur?
+    if(dist > tmax) {
+        return false;
+    }
+    tmax = dist;
+    return true;
+}
 
+Trace Sphere::finish(const Ray& ray, float t, Hit) const {
+    Trace ret;
     ret.hit = true;
     ret.origin = ray.point;
-    ret.distance = a.x > t.x ? t.y : t.x;   // at what distance did the intersection occur?
-    ret.position = o + ret.distance * d; // where was the intersection?
+    ret.distance = t;
+    ret.position = ray.point + t * ray.dir; // where was the intersection?
     ret.normal = ret.position.unit();       // what was the surface normal at the intersection?
-    ray.dist_bounds.y = ret.distance;
+    ray.dist_bounds.y = t;
     return ret;
 }
 
+bool Sphere::occluded(const Ray& ray) const {
+    return occluded(ray.point, ray.dir, radius, ray.dist_bounds);
+}
+
+bool Sphere::occluded(Vec3 o, Vec3 d, float radius, Vec2 bounds) {
+
+    // Same test as Sphere::hit, but either root within the ray's bounds is enough
+    float OdotD = dot(o, d);
+    float discrim = radius * radius - (o - OdotD * d).norm_squared();
+    if(discrim < 0) {
+        return false;
+    }
+    discrim = std::sqrt(discrim);
+    if(discrim < EPS_F) {
+        return false;
+    }
+    return within_range(-OdotD - discrim, bounds.x, bounds.y) ||
+           within_range(-OdotD + discrim, bounds.x, bounds.y);
+}
+
 } // namespace PT
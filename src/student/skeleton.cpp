@@ -1,5 +1,6 @@
 
 #include "../scene/skeleton.h"
+#include "../util/parallel.h"
 
 Vec3 closest_on_line_segment(Vec3 start, Vec3 end, Vec3 point) {
 
@@ -49,10 +50,10 @@ Mat4 Joint::joint_to_posed() const {
     // not take into account Skeleton::base_pos
 
     if(is_root()) {
-        return Mat4::euler(pose);
+        return rotation().to_mat();
     }
 
-    return parent->joint_to_posed() * Mat4::translate(parent->extent) * Mat4::euler(pose);
+    return parent->joint_to_posed() * Mat4::translate(parent->extent) * rotation().to_mat();
 }
 
 Vec3 Skeleton::end_of(Joint* j) {
@@ -95,7 +96,71 @@ Mat4 Skeleton::joint_to_posed(const Joint* j) const {
     return Mat4::translate(base_pos) * j->joint_to_posed();
 }
 
-void Skeleton::find_joints(const GL::Mesh& mesh, std::vector<std::vector<Joint*>>& map) {
+// Vertices bucketed by a uniform grid over their bounds, for visiting just those in a box
+class Vertex_Grid {
+public:
+    Vertex_Grid(const std::vector<GL::Mesh::Vert>& verts) {
+
+        for(auto& v : verts) bounds.enclose(v.pos);
+        if(verts.empty()) return;
+
+        // Around 16 vertices per cell, with cells about cubic; flat bounds get one
+        // layer of cells along their thin side
+        Vec3 size = bounds.max - bounds.min;
+        float longest = std::max(std::max(size.x, size.y), std::max(size.z, EPS_F));
+        Vec3 clamped = hmax(size, Vec3{longest * 1e-3f});
+        float cells = std::max(verts.size() / 16.f, 1.f);
+        float cell = std::cbrt(clamped.x * clamped.y * clamped.z / cells);
+        for(int a = 0; a < 3; a++) {
+            dim[a] = std::clamp((size_t)(size[a] / cell) + 1, size_t(1), size_t(1024));
+            scale[a] = dim[a] / std::max(size[a], EPS_F);
+        }
+
+        std::vector<size_t> cell_of(verts.size());
+        parallel_for(0, verts.size(), 4096, [&](size_t i) {
+            size_t c[3];
+            cell_at(verts[i].pos, c);
+            cell_of[i] = (c[2] * dim[1] + c[1]) * dim[0] + c[0];
+        });
+
+        start.assign(dim[0] * dim[1] * dim[2] + 1, 0);
+        for(size_t c : cell_of) start[c + 1]++;
+        for(size_t c = 1; c < start.size(); c++) start[c] += start[c - 1];
+        order.resize(verts.size());
+        std::vector<size_t> next(start.begin(), start.end() - 1);
+        for(size_t i = 0; i < verts.size(); i++) order[next[cell_of[i]]++] = (unsigned int)i;
+    }
+
+    // Calls f(i) for the index of every vertex in a cell overlapping box
+    template<typename F> void visit(const BBox& box, F&& f) const {
+        if(order.empty() || box.empty()) return;
+        size_t lo[3], hi[3];
+        cell_at(box.min, lo);
+        cell_at(box.max, hi);
+        for(size_t z = lo[2]; z <= hi[2]; z++) {
+            for(size_t y = lo[1]; y <= hi[1]; y++) {
+                size_t row = (z * dim[1] + y) * dim[0];
+                for(size_t i = start[row + lo[0]]; i < start[row + hi[0] + 1]; i++) f(order[i]);
+            }
+        }
+    }
+
+private:
+    void cell_at(Vec3 p, size_t c[3]) const {
+        for(int a = 0; a < 3; a++) {
+            float f = (p[a] - bounds.min[a]) * scale[a];
+            c[a] = f <= 0.f ? 0 : std::min((size_t)f, dim[a] - 1);
+        }
+    }
+
+    BBox bounds;
+    size_t dim[3] = {1, 1, 1};
+    float scale[3] = {};
+    std::vector<size_t> start;
+    std::vector<unsigned int> order;
+};
+
+void Skeleton::find_joints(const GL::Mesh& mesh, Skin_Weights& map) {
 
     // TODO(Animation): Task 3
 
@@ -105,68 +170,139 @@ void Skeleton::find_joints(const GL::Mesh& mesh, std::vector<std::vector<Joint*>
 
     info("find_joints() called");
     const std::vector<GL::Mesh::Vert>& verts = mesh.verts();
-    map.resize(verts.size());
-
-    // For each i in [0, verts.size()), map[i] should contain the list of joints that
-    // effect vertex i. Note that i is NOT Vert::id! i is the index in verts.
-
-    for_joints([&](Joint* j) {
-        // What vertices does joint j effect?
-        Vec3 start = Vec3(), end = j->extent;
-        auto b_to_j = joint_to_bind(j).inverse();
-        for(size_t i = 0; i < verts.size(); i++) {
-            auto p0 = b_to_j * verts[i].pos;
-            auto p1 = closest_on_line_segment(start, end, p0);
-            if((p0 - p1).norm() <= j->radius) {
-                map[i].push_back(j);
-            }
+
+    // For each i in [0, verts.size()), map should list the joints that effect vertex i,
+    // with their weights. Note that i is NOT Vert::id! i is the index in verts.
+    // The weights only depend on the bind position, so they're found once here rather
+    // than on every skin().
+
+    const Joint_Transforms& xf = transforms();
+    Mat4 base = Mat4::translate(base_pos), base_inv = Mat4::translate(-base_pos);
+
+    map.clear();
+    std::vector<Mat4> b_to_j, j_to_b;
+    for(size_t i = 0; i < xf.joints.size(); i++) {
+        map.joints.push_back(xf.joints[i]);
+        b_to_j.push_back(xf.bind_inv[i] * base_inv);
+        j_to_b.push_back(base * xf.bind[i]);
+    }
+
+    // Each bone only visits the vertices in grid cells overlapping the box around its
+    // capsule, and the bones are searched in parallel
+    Vertex_Grid grid(verts);
+    struct Hit {
+        unsigned int vert;
+        float weight;
+    };
+    std::vector<std::vector<Hit>> hits(map.joints.size());
+
+    parallel_for(0, map.joints.size(), 1, [&](size_t k) {
+        const Joint* j = map.joints[k];
+        Vec3 r{j->radius};
+        Vec3 lo = hmin(Vec3(), j->extent) - r, hi = hmax(Vec3(), j->extent) + r;
+        BBox box;
+        for(int c = 0; c < 8; c++) {
+            Vec3 corner{c & 1 ? hi.x : lo.x, c & 2 ? hi.y : lo.y, c & 4 ? hi.z : lo.z};
+            box.enclose(j_to_b[k] * corner);
+        }
+        grid.visit(box, [&](unsigned int i) {
+            auto p0 = b_to_j[k] * verts[i].pos;
+            auto p1 = closest_on_line_segment(Vec3(), j->extent, p0);
+            float d = (p0 - p1).norm();
+            if(d <= j->radius) hits[k].push_back(Hit{i, 1.f / d});
+        });
+    });
+
+    // Gather the hits by vertex, keeping each vertex's joints in order
+    map.offsets.assign(verts.size() + 1, 0);
+    for(auto& list : hits) {
+        for(Hit h : list) map.offsets[h.vert + 1]++;
+    }
+    for(size_t i = 0; i < verts.size(); i++) map.offsets[i + 1] += map.offsets[i];
+    map.influences.resize(map.offsets.back());
+    map.weights.resize(map.offsets.back());
+
+    std::vector<size_t> next(map.offsets.begin(), map.offsets.end() - 1);
+    for(unsigned int k = 0; k < hits.size(); k++) {
+        for(Hit h : hits[k]) {
+            size_t at = next[h.vert]++;
+            map.influences[at] = k;
+            map.weights[at] = h.weight;
         }
+    }
+
+    parallel_for(0, verts.size(), 4096, [&](size_t i) {
+        float total_weight = 0.f;
+        for(size_t w = map.offsets[i]; w < map.offsets[i + 1]; w++) total_weight += map.weights[w];
+        for(size_t w = map.offsets[i]; w < map.offsets[i + 1]; w++) map.weights[w] /= total_weight;
     });
 }
 
-void Skeleton::skin(const GL::Mesh& input, GL::Mesh& output,
-                    const std::vector<std::vector<Joint*>>& map) {
+void Skeleton::skin(const GL::Mesh& input, GL::Mesh& output, const Skin_Weights& map) {
 
     // TODO(Animation): Task 3
 
     // Apply bone poses & weights to the vertices of the input (bind position) mesh
     // and store the result in the output mesh. See the task description for details.
     // map was computed by find_joints, hence gives a mapping from vertex index to
-    // the list of bones the vertex should be effected by.
+    // the bones the vertex should be effected by, and how much.
 
-    // Currently, this just copies the input to the output without modification.
     info("skin() called");
 
     std::vector<GL::Mesh::Vert> verts = input.verts();
 
-    for(size_t i = 0; i < verts.size(); i++) {
+    if(skin_mode == Skin_Mode::dual_quaternion) {
+        std::vector<Dual_Quat> b_to_p;
+        skin_palette(map, b_to_p);
+
+        parallel_for(0, verts.size(), 256, [&](size_t i) {
+            size_t b = map.offsets[i], e = map.offsets[i + 1];
+            if(b == e) {
+                die("A vertex has no associated joints");
+            }
+            // q and -q are the same rotation; blend all on the side of the first so
+            // that they don't cancel out
+            const Quat& pivot = b_to_p[map.influences[b]].real;
+            Dual_Quat blend(Quat(0.0f, 0.0f, 0.0f, 0.0f), Quat(0.0f, 0.0f, 0.0f, 0.0f));
+            for(size_t k = b; k < e; k++) {
+                const Dual_Quat& q = b_to_p[map.influences[k]];
+                float w = map.weights[k];
+                blend += q * (dot(q.real, pivot) < 0.0f ? -w : w);
+            }
+            blend = blend.unit();
+            verts[i].pos = blend.transform(verts[i].pos);
+            verts[i].norm = blend.rotate(verts[i].norm).unit();
+        });
+
+        output.recreate(std::move(verts), input);
+        return;
+    }
+
+    // Each joint's bind-to-posed transform, made once per skin()
+    std::vector<Mat4> b_to_p;
+    skin_palette(map, b_to_p);
+
+    parallel_for(0, verts.size(), 256, [&](size_t i) {
 
         // Skin vertex i. Note that its position is given in object bind space.
-        const auto& joints = map[i];
-        float total_weight = 0.f;
-        Mat4 transform = Mat4::Zero;
-        if(joints.size() == 0) {
+        size_t b = map.offsets[i], e = map.offsets[i + 1];
+        if(b == e) {
             die("A vertex has no associated joints");
         }
-        for(const auto j : joints) {
-            auto b_to_j = joint_to_bind(j).inverse();
-            auto j_to_p = joint_to_posed(j);
-            auto p0 = b_to_j * verts[i].pos; 
-            auto p1 = closest_on_line_segment(Vec3(), j->extent, p0);
-            float w = 1.f / (p0 - p1).norm();
-            total_weight += w;
-            transform += j_to_p * b_to_j * w;
+        Mat4 transform = Mat4::Zero;
+        for(size_t k = b; k < e; k++) {
+            const Mat4& M = b_to_p[map.influences[k]];
+            float w = map.weights[k];
+            for(int c = 0; c < 4; c++) transform[c] += M[c] * w;
         }
-        transform /= total_weight;
         verts[i].pos = transform * verts[i].pos;
         verts[i].norm = transform.rotate(verts[i].norm).unit();
-    }
+    });
 
-    std::vector<GL::Mesh::Index> idxs = input.indices();
-    output.recreate(std::move(verts), std::move(idxs));
+    output.recreate(std::move(verts), input);
 }
 
-void Joint::compute_gradient(Vec3 target, Vec3 current) {
+void Joint::compute_gradient(Vec3 target, Vec3 current, const Joint_Transforms& xf) {
 
     // TODO(Animation): Task 2
 
@@ -177,7 +313,7 @@ void Joint::compute_gradient(Vec3 target, Vec3 current) {
     // Target is the position of the IK handle in skeleton space.
     // Current is the end position of the IK'd joint in skeleton space.
 
-    auto j_to_p = joint_to_posed();
+    const Mat4& j_to_p = xf.posed[xf.index(this)];
     auto p = current - j_to_p * Vec3();
     auto j_x = cross(j_to_p.rotate(Vec3(1.f, 0.f, 0.f)), p);
     auto j_y = cross(j_to_p.rotate(Vec3(0.f, 1.f, 0.f)), p);
@@ -185,7 +321,7 @@ void Joint::compute_gradient(Vec3 target, Vec3 current) {
     auto j = Mat4(Vec4(j_x, 0.f), Vec4(j_y, 0.f), Vec4(j_z, 0.f), Vec4(Vec3(), 1.f));
     angle_gradient += Mat4::transpose(j) * (current - target);
     if(!is_root()) {
-        parent->compute_gradient(target, current);
+        parent->compute_gradient(target, current, xf);
     }
 }
 
@@ -193,11 +329,24 @@ void Skeleton::step_ik(std::vector<IK_Handle*> active_handles) {
 
     // TODO(Animation): Task 2
 
-    // Do several iterations of Jacobian Transpose gradient descent for IK
+    // Do several iterations of Jacobian Transpose gradient descent for IK, until
+    // every handle is reached or ik.max_iters are done
     float tau = 0.001f;
-    for(size_t i = 0; i < 100; i++) {
-        for(auto h : active_handles) {
-            h->joint->compute_gradient(h->target, h->joint->joint_to_posed() * h->joint->extent);
+    std::vector<Vec3> ends(active_handles.size());
+    for(int i = 0; i < ik.max_iters; i++) {
+        // Poses change every iteration, so the transforms are rebuilt once per
+        // iteration rather than along each handle's chain
+        const Joint_Transforms& xf = transforms();
+        bool reached = true;
+        for(size_t h = 0; h < active_handles.size(); h++) {
+            const Joint* j = active_handles[h]->joint;
+            ends[h] = xf.posed[xf.index(j)] * j->extent;
+            reached = reached && (ends[h] - active_handles[h]->target).norm() <= ik.tolerance;
+        }
+        if(reached) break;
+
+        for(size_t h = 0; h < active_handles.size(); h++) {
+            active_handles[h]->joint->compute_gradient(active_handles[h]->target, ends[h], xf);
         }
         for(auto h : active_handles) {
             auto j = h->joint;
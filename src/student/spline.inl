@@ -24,65 +24,51 @@ T Spline<T>::cubic_unit_spline(float time, const T& position0, const T& position
     return position0 * h00 + tangent0 * h10 + position1 * h01 + tangent1 * h11;
 }
 
-template<typename T> T Spline<T>::at(float time) const {
+template<typename T> std::shared_ptr<const typename Spline<T>::Baked> Spline<T>::make_baked() const {
+
+    auto b = std::make_shared<Baked>();
+    for(auto& [t, p] : control_points) {
+        b->knots.push_back(t);
+        b->values.push_back(p);
+    }
+
+    // Catmull-Rom tangents; the ends act as if the first and last segments were
+    // mirrored past them, which makes their tangent that segment's slope
+    size_t n = b->knots.size();
+    const std::vector<float>& t = b->knots;
+    const std::vector<T>& p = b->values;
+    b->tangents.resize(n);
+    for(size_t i = 0; n > 1 && i < n; i++) {
+        size_t prev = i > 0 ? i - 1 : 0;
+        size_t next = i + 1 < n ? i + 1 : n - 1;
+        b->tangents[i] = (p[next] - p[prev]) / (t[next] - t[prev]);
+    }
+    return b;
+}
+
+template<typename T> T Spline<T>::evaluate(const Baked& b, float time) const {
 
     // TODO (Animation): Task 1b
 
     // Given a time, find the nearest positions & tangent values
-    // defined by the control point map.
+    // defined by the (baked, non-empty) control points.
 
     // Transform them for use with cubic_unit_spline
 
     // Be wary of edge cases! What if time is before the first knot,
     // before the second knot, etc...
-    
-    if(control_points.empty()) {
-        return T();
-    }
-    if(control_points.size() == 1) {
-        return control_points.begin()->second;
-    }
-    auto first = control_points.begin();
-    if(time <= first->first) {
-        return first->second;
-    }
-    auto last = --control_points.end();
-    if(time >= last->first) {
-        return last->second;
-    }
 
-    auto itr2 = control_points.upper_bound(time);
-    auto itr1 = itr2;
-    --itr1;
-    auto itr3 = itr2;
-    if(itr3 != last) {
-        ++itr3;
+    const std::vector<float>& knots = b.knots;
+    if(knots.size() == 1 || time <= knots.front()) {
+        return b.values.front();
     }
-    auto itr0 = itr1;
-    if(itr0 != first) {
-        --itr0;
+    if(time >= knots.back()) {
+        return b.values.back();
     }
-    float t0, t1, t2, t3;
-    T p0, p1, p2, p3;
-    t0 = itr0->first;
-    p0 = itr0->second;
-    t1 = itr1->first;
-    p1 = itr1->second;
-    t2 = itr2->first;
-    p2 = itr2->second;
-    t3 = itr3->first;
-    p3 = itr3->second;
-    if(itr0 == itr1) {
-        t0 = t1 - (t2 - t1);
-        p0 = p1 - (p2 - p1);
-    }
-    if(itr2 == itr3) {
-        t3 = t2 + (t2 - t1);
-        p3 = p2 + (p2 - p1);
-    }
-    T tangent1 = (p2 - p0) / (t2 - t0);
-    T tangent2 = (p3 - p1) / (t3 - t1);
 
-    return cubic_unit_spline((time - t1) / (t2 - t1), p1, p2, tangent1 * (t2 - t1),
-                             tangent2 * (t2 - t1));
+    size_t i = spline_segment(knots, b.segment, time);
+    float t1 = knots[i], t2 = knots[i + 1];
+
+    return cubic_unit_spline((time - t1) / (t2 - t1), b.values[i], b.values[i + 1],
+                             b.tangents[i] * (t2 - t1), b.tangents[i + 1] * (t2 - t1));
 }
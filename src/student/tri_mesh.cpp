@@ -2,6 +2,12 @@
 #include "../rays/tri_mesh.h"
 #include "../rays/samplers.h"
 
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+
 namespace PT {
 
 BBox Triangle::bbox() const {
@@ -31,52 +37,263 @@ static bool inside_triangle(Vec3 b) {
 
 Trace Triangle::hit(const Ray& ray) const {
 
-    // Each vertex contains a postion and surface normal
-    Tri_Mesh_Vert v_0 = vertex_list[v0];
-    Tri_Mesh_Vert v_1 = vertex_list[v1];
-    Tri_Mesh_Vert v_2 = vertex_list[v2];
-
     // TODO (PathTracer): Task 2
     // Intersect the ray with the triangle defined by the three vertices.
 
-    Trace ret;
-    ret.hit = false;
-    Vec3 e1, e2, s, h;
-    e1 = v_1.position - v_0.position;
-    e2 = v_2.position - v_0.position;
-    float denom = dot(cross(e1, ray.dir), e2);
-    if(std::abs(denom) < EPS_F) {
-        return ret;
-    }
-    s = ray.point - v_0.position;
-    h.x = -dot(cross(s, e2), ray.dir);
-    h.y = dot(cross(e1, ray.dir), s);
-    h.z = -dot(cross(s, e2), e1);
-    h /= denom;
-    Vec3 b(h.x, h.y, 1.f - h.x - h.y);
+    float t = ray.dist_bounds.y;
+    Hit h;
+    if(!intersect(ray, t, h)) return {};
+    return finish(ray, t, h);
+}
 
-    if(h.z < 0) {
-        return ret;
+// The test of Triangle::intersect, on a triangle given by a vertex and its edges
+static bool intersect_tri(Vec3 p0, Vec3 e1, Vec3 e2, const Ray& ray, float& tmax, Vec2& uv) {
+
+    Vec3 d_e1 = cross(e1, ray.dir);
+    float denom = dot(d_e1, e2);
+    if(std::abs(denom) < EPS_F) {
+        return false;
     }
-    if(!inside_triangle(b)) {
-        return ret;
+    float inv = 1.0f / denom;
+    Vec3 s = ray.point - p0;
+    Vec3 s_e2 = cross(s, e2);
+    float t = -dot(s_e2, e1) * inv;
+    if(t < 0 || !within_range(t, ray.dist_bounds.x, tmax)) {
+        return false;
     }
-    if(!within_range(h.z, ray.dist_bounds.x, ray.dist_bounds.y)) {
-        return ret;
+    float u = -dot(s_e2, ray.dir) * inv;
+    float v = dot(d_e1, s) * inv;
+    if(!inside_triangle(Vec3(u, v, 1.f - u - v))) {
+        return false;
     }
-    ray.dist_bounds.y = h.z;
+    tmax = t;
+    uv = Vec2(u, v);
+    return true;
+}
+
+bool Triangle::intersect(const Ray& ray, float& tmax, Hit& hit) const {
+    return intersect_tri(p0, e1, e2, ray, tmax, hit.uv);
+}
+
+Trace Triangle::finish(const Ray& ray, float t, Hit hit) const {
+
+    Vec2 uv = hit.uv;
+
+    ray.dist_bounds.y = t;
+    Trace ret;
     ret.hit = true;
     ret.origin = ray.point;
-    ret.distance = h.z;   // at what distance did the intersection occur?
-    ret.position = ray.point + ray.dir * h.z; // where was the intersection?
-    ret.normal = (v_0.normal * b.x + v_1.normal * b.y + v_2.normal * b.z)
-                     .unit(); // what was the surface normal at the intersection?
-                           // (this should be interpolated between the three vertex normals)
+    ret.distance = t;                       // at what distance did the intersection occur?
+    ret.position = ray.point + ray.dir * t; // where was the intersection?
+    // what was the surface normal at the intersection?
+    // (this should be interpolated between the three vertex normals)
+    ret.normal = (vertex_list[v0].normal * uv.x + vertex_list[v1].normal * uv.y +
+                  vertex_list[v2].normal * (1.f - uv.x - uv.y))
+                     .unit();
     return ret;
 }
 
+bool Triangle::occluded(const Ray& ray) const {
+    // Same test as Triangle::hit, without computing the hit record
+    float t = ray.dist_bounds.y;
+    Hit h;
+    return intersect(ray, t, h);
+}
+
+#if defined(__AVX__)
+static constexpr size_t tri_lanes = 8;
+#elif defined(SCOTTY3D_SSE)
+static constexpr size_t tri_lanes = 4;
+#else
+static constexpr size_t tri_lanes = 1;
+#endif
+
+#ifdef SCOTTY3D_SSE
+
+// Triangle::intersect for one triangle per lane, with the same operations in the
+// same order so each lane agrees with the scalar test. c holds p0, e1 and e2 by
+// component; all-zero lanes have a zero denominator and never hit. Returns the
+// mask of lanes hit within [tmin, tmax], with their t, u and v.
+template<typename F, typename Ops>
+static uint32_t tri_test(const float* c, size_t L, Vec3 o, Vec3 d, float tmin, float tmax,
+                         float* t_out, float* u_out, float* v_out, Ops ops) {
+
+    F p0x = ops.load(c), p0y = ops.load(c + L), p0z = ops.load(c + 2 * L);
+    F e1x = ops.load(c + 3 * L), e1y = ops.load(c + 4 * L), e1z = ops.load(c + 5 * L);
+    F e2x = ops.load(c + 6 * L), e2y = ops.load(c + 7 * L), e2z = ops.load(c + 8 * L);
+    F dx = ops.set(d.x), dy = ops.set(d.y), dz = ops.set(d.z);
+
+    auto dot = [&](F ax, F ay, F az, F bx, F by, F bz) {
+        return ops.add(ops.add(ops.mul(ax, bx), ops.mul(ay, by)), ops.mul(az, bz));
+    };
+
+    // d_e1 = cross(e1, d), s_e2 = cross(s, e2)
+    F dex = ops.sub(ops.mul(e1y, dz), ops.mul(e1z, dy));
+    F dey = ops.sub(ops.mul(e1z, dx), ops.mul(e1x, dz));
+    F dez = ops.sub(ops.mul(e1x, dy), ops.mul(e1y, dx));
+    F denom = dot(dex, dey, dez, e2x, e2y, e2z);
+    F inv = ops.div(ops.set(1.0f), denom);
+
+    F sx = ops.sub(ops.set(o.x), p0x), sy = ops.sub(ops.set(o.y), p0y),
+      sz = ops.sub(ops.set(o.z), p0z);
+    F sex = ops.sub(ops.mul(sy, e2z), ops.mul(sz, e2y));
+    F sey = ops.sub(ops.mul(sz, e2x), ops.mul(sx, e2z));
+    F sez = ops.sub(ops.mul(sx, e2y), ops.mul(sy, e2x));
+
+    F t = ops.mul(ops.neg(dot(sex, sey, sez, e1x, e1y, e1z)), inv);
+    F u = ops.mul(ops.neg(dot(sex, sey, sez, dx, dy, dz)), inv);
+    F v = ops.mul(dot(dex, dey, dez, sx, sy, sz), inv);
+    F w = ops.sub(ops.sub(ops.set(1.0f), u), v);
+
+    F zero = ops.set(0.0f), one = ops.set(1.0f);
+    F hit = ops.ge(ops.abs(denom), ops.set(EPS_F));
+    hit = ops.bit_and(hit, ops.bit_and(ops.ge(t, zero), ops.ge(t, ops.set(tmin))));
+    hit = ops.bit_and(hit, ops.le(t, ops.set(tmax)));
+    hit = ops.bit_and(hit, ops.bit_and(ops.ge(u, zero), ops.le(u, one)));
+    hit = ops.bit_and(hit, ops.bit_and(ops.ge(v, zero), ops.le(v, one)));
+    hit = ops.bit_and(hit, ops.bit_and(ops.ge(w, zero), ops.le(w, one)));
+
+    ops.store(t_out, t);
+    ops.store(u_out, u);
+    ops.store(v_out, v);
+    return ops.mask(hit);
+}
+
+struct Tri_SSE {
+    __m128 load(const float* p) const { return _mm_load_ps(p); }
+    __m128 set(float f) const { return _mm_set1_ps(f); }
+    void store(float* p, __m128 v) const { _mm_store_ps(p, v); }
+    __m128 add(__m128 a, __m128 b) const { return _mm_add_ps(a, b); }
+    __m128 sub(__m128 a, __m128 b) const { return _mm_sub_ps(a, b); }
+    __m128 mul(__m128 a, __m128 b) const { return _mm_mul_ps(a, b); }
+    __m128 div(__m128 a, __m128 b) const { return _mm_div_ps(a, b); }
+    __m128 neg(__m128 a) const { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+    __m128 abs(__m128 a) const { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+    __m128 ge(__m128 a, __m128 b) const { return _mm_cmpge_ps(a, b); }
+    __m128 le(__m128 a, __m128 b) const { return _mm_cmple_ps(a, b); }
+    __m128 bit_and(__m128 a, __m128 b) const { return _mm_and_ps(a, b); }
+    uint32_t mask(__m128 a) const { return static_cast<uint32_t>(_mm_movemask_ps(a)); }
+};
+
+#ifdef __AVX__
+struct Tri_AVX {
+    __m256 load(const float* p) const { return _mm256_load_ps(p); }
+    __m256 set(float f) const { return _mm256_set1_ps(f); }
+    void store(float* p, __m256 v) const { _mm256_store_ps(p, v); }
+    __m256 add(__m256 a, __m256 b) const { return _mm256_add_ps(a, b); }
+    __m256 sub(__m256 a, __m256 b) const { return _mm256_sub_ps(a, b); }
+    __m256 mul(__m256 a, __m256 b) const { return _mm256_mul_ps(a, b); }
+    __m256 div(__m256 a, __m256 b) const { return _mm256_div_ps(a, b); }
+    __m256 neg(__m256 a) const { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+    __m256 abs(__m256 a) const { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+    __m256 ge(__m256 a, __m256 b) const { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    __m256 le(__m256 a, __m256 b) const { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    __m256 bit_and(__m256 a, __m256 b) const { return _mm256_and_ps(a, b); }
+    uint32_t mask(__m256 a) const { return static_cast<uint32_t>(_mm256_movemask_ps(a)); }
+};
+#endif
+
+static uint32_t tri_test(const float (&c)[9][tri_lanes], Vec3 o, Vec3 d, float tmin, float tmax,
+                         float* t, float* u, float* v) {
+#ifdef __AVX__
+    return tri_test<__m256>(&c[0][0], tri_lanes, o, d, tmin, tmax, t, u, v, Tri_AVX{});
+#else
+    return tri_test<__m128>(&c[0][0], tri_lanes, o, d, tmin, tmax, t, u, v, Tri_SSE{});
+#endif
+}
+
+#endif
+
+template<size_t L>
+void Triangle::gather(const Triangle* tris, size_t n, float (&c)[9][L]) {
+    for(size_t i = 0; i < n; i++) {
+        for(int a = 0; a < 3; a++) {
+            c[a][i] = tris[i].p0[a];
+            c[3 + a][i] = tris[i].e1[a];
+            c[6 + a][i] = tris[i].e2[a];
+        }
+    }
+}
+
+int Triangle::intersect_n(const Triangle* tris, size_t n, const Ray& ray, float& tmax, Hit& hit) {
+
+    int closest = -1;
+    size_t i = 0;
+#ifdef SCOTTY3D_SSE
+    // Lanes are checked in order, so ties resolve as they would one by one
+    while(i + 1 < n) {
+        size_t m = std::min(n - i, tri_lanes);
+        alignas(32) float c[9][tri_lanes] = {};
+        alignas(32) float t[tri_lanes], u[tri_lanes], v[tri_lanes];
+        gather(tris + i, m, c);
+        uint32_t mask = tri_test(c, ray.point, ray.dir, ray.dist_bounds.x, tmax, t, u, v);
+        for(size_t k = 0; k < m; k++) {
+            if((mask & (1u << k)) && t[k] <= tmax) {
+                tmax = t[k];
+                hit.uv = Vec2(u[k], v[k]);
+                closest = static_cast<int>(i + k);
+            }
+        }
+        i += m;
+    }
+#endif
+    for(; i < n; i++) {
+        if(tris[i].intersect(ray, tmax, hit)) closest = static_cast<int>(i);
+    }
+    return closest;
+}
+
+bool Triangle::occluded_n(const Triangle* tris, size_t n, const Ray& ray) {
+
+    size_t i = 0;
+#ifdef SCOTTY3D_SSE
+    while(i + 1 < n) {
+        size_t m = std::min(n - i, tri_lanes);
+        alignas(32) float c[9][tri_lanes] = {};
+        alignas(32) float t[tri_lanes], u[tri_lanes], v[tri_lanes];
+        gather(tris + i, m, c);
+        if(tri_test(c, ray.point, ray.dir, ray.dist_bounds.x, ray.dist_bounds.y, t, u, v)) {
+            return true;
+        }
+        i += m;
+    }
+#endif
+    for(; i < n; i++) {
+        if(tris[i].occluded(ray)) return true;
+    }
+    return false;
+}
+
+void Triangle::split(int axis, float plane, BBox& left, BBox& right) const {
+
+    // Bound the parts of the triangle on either side of the plane: each vertex
+    // goes to its own side, and each edge crossing the plane adds the crossing
+    // point to both.
+    Vec3 p[3] = {vertex_list[v0].position, vertex_list[v1].position, vertex_list[v2].position};
+    left.reset();
+    right.reset();
+    for(int i = 0; i < 3; i++) {
+        Vec3 a = p[i], b = p[(i + 1) % 3];
+        if(a[axis] <= plane) left.enclose(a);
+        if(a[axis] >= plane) right.enclose(a);
+        if((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+            Vec3 x = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+            x[axis] = plane;
+            left.enclose(x);
+            right.enclose(x);
+        }
+    }
+}
+
 Triangle::Triangle(Tri_Mesh_Vert* verts, unsigned int v0, unsigned int v1, unsigned int v2)
-    : vertex_list(verts), v0(v0), v1(v1), v2(v2) {
+    : v0(v0), v1(v1), v2(v2), vertex_list(verts) {
+    update();
+}
+
+void Triangle::update() {
+    p0 = vertex_list[v0].position;
+    e1 = vertex_list[v1].position - p0;
+    e2 = vertex_list[v2].position - p0;
 }
 
 Vec3 Triangle::sample(Vec3 from) const {
@@ -107,72 +324,567 @@ float Triangle::pdf(Ray wray, const Mat4& T, const Mat4& iT) const {
     return 0.0f;
 }
 
-void Tri_Mesh::build(const GL::Mesh& mesh, bool bvh) {
+// Octahedral normals (Meyer et al. 2010): the unit sphere is projected onto the
+// octahedron |x| + |y| + |z| = 1, whose lower half is folded out over the corners of
+// the upper half, so that directions map onto the square [-1, 1]^2.
+static float sign_not_zero(float f) {
+    return f >= 0.0f ? 1.0f : -1.0f;
+}
+
+static void oct_encode(Vec3 n, int16_t (&out)[2]) {
+    float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    Vec2 p = l1 > 0.0f ? Vec2(n.x / l1, n.y / l1) : Vec2(0.0f);
+    if(n.z < 0.0f) {
+        p = Vec2((1.0f - std::abs(p.y)) * sign_not_zero(p.x),
+                 (1.0f - std::abs(p.x)) * sign_not_zero(p.y));
+    }
+    for(int i = 0; i < 2; i++) {
+        out[i] = static_cast<int16_t>(std::round(clamp(p[i], -1.0f, 1.0f) * 32767.0f));
+    }
+}
+
+static Vec3 oct_decode(const int16_t (&in)[2]) {
+    Vec3 n(in[0] / 32767.0f, in[1] / 32767.0f, 0.0f);
+    n.z = 1.0f - std::abs(n.x) - std::abs(n.y);
+    if(n.z < 0.0f) {
+        float x = n.x;
+        n.x = (1.0f - std::abs(n.y)) * sign_not_zero(x);
+        n.y = (1.0f - std::abs(x)) * sign_not_zero(n.y);
+    }
+    return n.unit();
+}
+
+Vec3 Tri_Cluster::position(uint32_t v) const {
+    uint32_t g[3];
+    if(first_wide == not_wide) {
+        const Vert& vert = data->verts[first_vert + v];
+        for(int a = 0; a < 3; a++) g[a] = base[a] + vert.pos[a];
+    } else {
+        for(int a = 0; a < 3; a++) g[a] = data->wide[first_wide + 3 * v + a];
+    }
+    // Exact up to the multiply-add, so shared vertices agree across clusters
+    Vec3 grid(static_cast<float>(g[0]), static_cast<float>(g[1]), static_cast<float>(g[2]));
+    return data->origin + grid * data->cell;
+}
+
+void Tri_Cluster::triangle(size_t i, Vec3& p0, Vec3& e1, Vec3& e2) const {
+    const uint16_t* idx = &data->indices[first_index + 3 * i];
+    p0 = position(idx[0]);
+    e1 = position(idx[1]) - p0;
+    e2 = position(idx[2]) - p0;
+}
+
+template<size_t L> void Tri_Cluster::gather(size_t i, size_t n, float (&c)[9][L]) const {
+    for(size_t k = 0; k < n; k++) {
+        Vec3 p0, e1, e2;
+        triangle(i + k, p0, e1, e2);
+        for(int a = 0; a < 3; a++) {
+            c[a][k] = p0[a];
+            c[3 + a][k] = e1[a];
+            c[6 + a][k] = e2[a];
+        }
+    }
+}
+
+BBox Tri_Cluster::bbox() const {
+    BBox box;
+    for(uint32_t v = 0; v < n_verts; v++) box.enclose(position(v));
+    return box;
+}
+
+bool Tri_Cluster::intersect(const Ray& ray, float& tmax, Hit& hit) const {
+
+    // As Triangle::intersect_n, on decoded triangles
+    int closest = -1;
+    size_t i = 0;
+#ifdef SCOTTY3D_SSE
+    while(i + 1 < n_tris) {
+        size_t m = std::min(n_tris - i, tri_lanes);
+        alignas(32) float c[9][tri_lanes] = {};
+        alignas(32) float t[tri_lanes], u[tri_lanes], v[tri_lanes];
+        gather(i, m, c);
+        uint32_t mask = tri_test(c, ray.point, ray.dir, ray.dist_bounds.x, tmax, t, u, v);
+        for(size_t k = 0; k < m; k++) {
+            if((mask & (1u << k)) && t[k] <= tmax) {
+                tmax = t[k];
+                hit.uv = Vec2(u[k], v[k]);
+                closest = static_cast<int>(i + k);
+            }
+        }
+        i += m;
+    }
+#endif
+    for(; i < n_tris; i++) {
+        Vec3 p0, e1, e2;
+        triangle(i, p0, e1, e2);
+        if(intersect_tri(p0, e1, e2, ray, tmax, hit.uv)) closest = static_cast<int>(i);
+    }
+    if(closest < 0) return false;
+    hit.push(static_cast<uint32_t>(closest));
+    return true;
+}
+
+bool Tri_Cluster::occluded(const Ray& ray) const {
+    float t = ray.dist_bounds.y;
+    Hit h;
+    return intersect(ray, t, h);
+}
+
+Trace Tri_Cluster::finish(const Ray& ray, float t, Hit hit) const {
+
+    const uint16_t* idx = &data->indices[first_index + 3 * hit.pop()];
+    Vec3 n0 = oct_decode(data->verts[first_vert + idx[0]].normal);
+    Vec3 n1 = oct_decode(data->verts[first_vert + idx[1]].normal);
+    Vec3 n2 = oct_decode(data->verts[first_vert + idx[2]].normal);
+
+    ray.dist_bounds.y = t;
+    Trace ret;
+    ret.hit = true;
+    ret.origin = ray.point;
+    ret.distance = t;
+    ret.position = ray.point + ray.dir * t;
+    ret.normal = (n0 * hit.uv.x + n1 * hit.uv.y + n2 * (1.f - hit.uv.x - hit.uv.y)).unit();
+    return ret;
+}
+
+void Tri_Mesh::build(const GL::Mesh& mesh, bool bvh, Thread_Pool* pool,
+                     const BVH_Options& options, const std::string& cache_dir) {
+    build(mesh.data(), bvh, pool, options, cache_dir);
+}
+
+void Tri_Mesh::build(const GL::Mesh::Data& mesh, bool bvh, Thread_Pool* pool,
+                     const BVH_Options& options, const std::string& cache_dir) {
 
-    use_bvh = bvh;
-    verts.clear();
-    triangle_bvh.clear();
-    triangle_list.clear();
+    // Instances made by copy() keep their own reference to the old geometry
+    auto geom = std::make_shared<Geometry>();
+    geom->use_bvh = bvh;
+    geom->options = options;
+    geom->revision = mesh.revision;
 
-    for(const auto& v : mesh.verts()) {
-        verts.push_back({v.pos, v.norm});
+    for(const auto& v : *mesh.verts) {
+        geom->verts.push_back({v.pos, v.norm});
     }
 
-    const auto& idxs = mesh.indices();
+    geom->indices = mesh.indices;
+    const auto& idxs = *geom->indices;
 
     std::vector<Triangle> tris;
     for(size_t i = 0; i < idxs.size(); i += 3) {
-        tris.push_back(Triangle(verts.data(), idxs[i], idxs[i + 1], idxs[i + 2]));
+        tris.push_back(Triangle(geom->verts.data(), idxs[i], idxs[i + 1], idxs[i + 2]));
     }
 
-    if(use_bvh) {
-        triangle_bvh.build(std::move(tris), 4);
+    if(geom->use_bvh) {
+        std::string file = cache_dir.empty() ? std::string() : cache_file(cache_dir, mesh, options);
+        if(file.empty() || !load(file, *geom)) {
+            geom->triangle_bvh.build(std::move(tris), options, pool);
+            if(!file.empty()) save(file, *geom);
+        }
     } else {
-        triangle_list = List<Triangle>(std::move(tris));
+        geom->triangle_list = List<Triangle>(std::move(tris));
+    }
+    if(geom->use_bvh && !geometry->area_cdf.empty()) build_area_cdf(*geom);
+    geometry = std::move(geom);
+}
+
+void Tri_Mesh::refit(const GL::Mesh& mesh, bool bvh, Thread_Pool* pool,
+                     const BVH_Options& options, const std::string& cache_dir) {
+    refit(mesh.data(), bvh, pool, options, cache_dir);
+}
+
+void Tri_Mesh::refit(const GL::Mesh::Data& mesh, bool bvh, Thread_Pool* pool,
+                     const BVH_Options& options, const std::string& cache_dir) {
+
+    const auto& mesh_verts = *mesh.verts;
+    if(!bvh || !geometry->use_bvh || geometry->compressed || geometry->options != options ||
+       geometry->verts.size() != mesh_verts.size() ||
+       (geometry->indices != mesh.indices && *geometry->indices != *mesh.indices)) {
+        build(mesh, bvh, pool, options, cache_dir);
+        return;
+    }
+
+    // E.g. a skinned mesh whose pose didn't change between frames
+    if(mesh.revision && mesh.revision == geometry->revision) return;
+    geometry->revision = mesh.revision;
+
+    // The triangles point into verts, so it must be updated in place, and then
+    // their cached edges recomputed
+    for(size_t i = 0; i < mesh_verts.size(); i++) {
+        geometry->verts[i] = {mesh_verts[i].pos, mesh_verts[i].norm};
     }
+    for(Triangle& tri : geometry->triangle_bvh.edit_primitives()) tri.update();
+    geometry->triangle_bvh.refit(pool);
+    if(!geometry->area_cdf.empty()) build_area_cdf(*geometry);
 }
 
-Tri_Mesh::Tri_Mesh(const GL::Mesh& mesh, bool use_bvh) {
-    build(mesh, use_bvh);
+// Bump when the cache file layout or anything that shapes the tree changes
+static const uint32_t cache_magic = 0x48564233, cache_version = 2;
+
+std::string Tri_Mesh::cache_file(const std::string& dir, const GL::Mesh::Data& mesh,
+                                 const BVH_Options& options) {
+
+    // 64-bit FNV-1a over everything the built tree depends on
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for(size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    };
+    add(&cache_version, sizeof(cache_version));
+    add(&options.method, sizeof(options.method));
+    uint64_t leaf = options.max_leaf_size;
+    add(&leaf, sizeof(leaf));
+    add(&options.spatial_alpha, sizeof(options.spatial_alpha));
+    uint64_t buckets = options.buckets;
+    add(&buckets, sizeof(buckets));
+    for(const GL::Mesh::Vert& v : *mesh.verts) add(&v.pos, sizeof(v.pos));
+    add(mesh.indices->data(), mesh.indices->size() * sizeof(GL::Mesh::Index));
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(hash));
+    return dir + "/" + name;
+}
+
+bool Tri_Mesh::load(const std::string& file, Geometry& geom) {
+
+    std::ifstream in(file, std::ios::binary);
+    if(!in) return false;
+
+    uint32_t header[2] = {};
+    in.read(reinterpret_cast<char*>(header), sizeof(header));
+    if(!in || header[0] != cache_magic || header[1] != cache_version) return false;
+
+    unsigned int n_verts = static_cast<unsigned int>(geom.verts.size());
+    return geom.triangle_bvh.read(
+        in, geom.options, [&](std::istream& in, std::vector<Triangle>& tris) {
+            unsigned int v[3];
+            in.read(reinterpret_cast<char*>(v), sizeof(v));
+            if(!in || v[0] >= n_verts || v[1] >= n_verts || v[2] >= n_verts) return false;
+            tris.push_back(Triangle(geom.verts.data(), v[0], v[1], v[2]));
+            return true;
+        });
+}
+
+void Tri_Mesh::save(const std::string& file, const Geometry& geom) {
+
+    // Write to a file of our own and rename it into place, so that concurrent
+    // renders sharing the cache never read a partial file.
+    std::string tmp =
+        file + "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        if(!out) {
+            warn("Failed to write BVH cache file %s", tmp.c_str());
+            return;
+        }
+        uint32_t header[2] = {cache_magic, cache_version};
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        geom.triangle_bvh.write(out, [](std::ostream& out, const Triangle& tri) {
+            unsigned int v[3] = {tri.v0, tri.v1, tri.v2};
+            out.write(reinterpret_cast<const char*>(v), sizeof(v));
+        });
+        if(!out) {
+            out.close();
+            std::remove(tmp.c_str());
+            return;
+        }
+    }
+    if(std::rename(tmp.c_str(), file.c_str()) != 0) std::remove(tmp.c_str());
+}
+
+Tri_Mesh::Tri_Mesh(const GL::Mesh& mesh, bool use_bvh, Thread_Pool* pool,
+                   const BVH_Options& options) {
+    build(mesh.data(), use_bvh, pool, options);
+}
+
+Tri_Mesh::Tri_Mesh(const GL::Mesh::Data& mesh, bool use_bvh, Thread_Pool* pool,
+                   const BVH_Options& options) {
+    build(mesh, use_bvh, pool, options);
 }
 
 Tri_Mesh Tri_Mesh::copy() const {
     Tri_Mesh ret;
-    ret.verts = verts;
-    ret.triangle_bvh = triangle_bvh.copy();
-    ret.triangle_list = triangle_list.copy();
-    ret.use_bvh = use_bvh;
+    ret.geometry = geometry;
     return ret;
 }
 
+void Tri_Mesh::compress(Thread_Pool* pool, Geometry_Pager* pager) {
+
+    const Geometry& src = *geometry;
+    if(!src.use_bvh || src.compressed) return;
+
+    auto geom = std::make_shared<Geometry>();
+    geom->use_bvh = true;
+    geom->compressed = true;
+    geom->options = src.options;
+    Tri_Cluster::Data& data = geom->packed;
+
+    BBox box;
+    for(const Tri_Mesh_Vert& v : src.verts) box.enclose(v.position);
+    Vec3 extent = box.empty() ? Vec3() : box.max - box.min;
+    float size = std::max(std::max(extent.x, extent.y), extent.z);
+    data.origin = box.empty() ? Vec3() : box.min;
+    data.cell = size > 0.0f ? size / Tri_Cluster::grid_max : 1.0f;
+
+    std::vector<std::array<uint32_t, 3>> grid(src.verts.size());
+    for(size_t i = 0; i < src.verts.size(); i++) {
+        for(int a = 0; a < 3; a++) {
+            float g = std::round((src.verts[i].position[a] - data.origin[a]) / data.cell);
+            grid[i][a] = static_cast<uint32_t>(clamp(g, 0.0f, float(Tri_Cluster::grid_max)));
+        }
+    }
+
+    // Each leaf is cut into clusters of at most max_tris, whose vertices are
+    // numbered in the order their triangles first use them
+    constexpr uint32_t unused = ~0u;
+    std::vector<uint32_t> local(src.verts.size(), unused);
+    std::vector<uint32_t> used;
+    std::vector<Tri_Cluster> clusters;
+    std::vector<Tri_Cluster::Vert>& verts = data.owned_verts;
+    std::vector<uint16_t>& indices = data.owned_indices;
+    std::vector<uint32_t>& wide_grid = data.owned_wide;
+
+    src.triangle_bvh.leaves([&](const Triangle* tris, size_t n) {
+        for(size_t first = 0; first < n; first += Tri_Cluster::max_tris) {
+            size_t m = std::min(n - first, Tri_Cluster::max_tris);
+
+            Tri_Cluster cluster;
+            cluster.data = &data;
+            cluster.first_index = static_cast<uint32_t>(indices.size());
+            cluster.n_tris = static_cast<uint16_t>(m);
+            used.clear();
+            for(size_t i = first; i < first + m; i++) {
+                for(unsigned int v : {tris[i].v0, tris[i].v1, tris[i].v2}) {
+                    if(local[v] == unused) {
+                        local[v] = static_cast<uint32_t>(used.size());
+                        used.push_back(v);
+                    }
+                    indices.push_back(static_cast<uint16_t>(local[v]));
+                }
+            }
+
+            uint32_t lo[3] = {unused, unused, unused}, hi[3] = {};
+            for(uint32_t v : used) {
+                for(int a = 0; a < 3; a++) {
+                    lo[a] = std::min(lo[a], grid[v][a]);
+                    hi[a] = std::max(hi[a], grid[v][a]);
+                }
+            }
+            bool wide = false;
+            for(int a = 0; a < 3; a++) wide = wide || hi[a] - lo[a] > 0xffff;
+
+            cluster.first_vert = static_cast<uint32_t>(verts.size());
+            cluster.n_verts = static_cast<uint16_t>(used.size());
+            if(wide) cluster.first_wide = static_cast<uint32_t>(wide_grid.size());
+            for(uint32_t v : used) {
+                Tri_Cluster::Vert vert = {};
+                for(int a = 0; a < 3; a++) {
+                    if(wide) {
+                        wide_grid.push_back(grid[v][a]);
+                    } else {
+                        vert.pos[a] = static_cast<uint16_t>(grid[v][a] - lo[a]);
+                    }
+                }
+                oct_encode(src.verts[v].normal, vert.normal);
+                verts.push_back(vert);
+                local[v] = unused;
+            }
+            if(!wide) std::copy(lo, lo + 3, cluster.base);
+            clusters.push_back(cluster);
+        }
+    });
+
+    // Clusters are already leaf sized
+    BVH_Options options = src.options;
+    options.max_leaf_size = 1;
+    geom->cluster_bvh.build(std::move(clusters), options, pool);
+
+    // The wide positions go first, as the only 4-byte aligned array
+    size_t wide_bytes = wide_grid.size() * sizeof(uint32_t);
+    size_t vert_bytes = verts.size() * sizeof(Tri_Cluster::Vert);
+    if(pager && pager->enabled()) {
+        data.region = pager->map({{wide_grid.data(), wide_bytes},
+                                  {verts.data(), vert_bytes},
+                                  {indices.data(), indices.size() * sizeof(uint16_t)}});
+    }
+    data.n_verts = verts.size();
+    data.n_indices = indices.size();
+    data.n_wide = wide_grid.size();
+    if(data.region) {
+        const unsigned char* base = data.region->data();
+        data.wide = reinterpret_cast<const uint32_t*>(base);
+        data.verts = reinterpret_cast<const Tri_Cluster::Vert*>(base + wide_bytes);
+        data.indices = reinterpret_cast<const uint16_t*>(base + wide_bytes + vert_bytes);
+        std::vector<Tri_Cluster::Vert>().swap(verts);
+        std::vector<uint16_t>().swap(indices);
+        std::vector<uint32_t>().swap(wide_grid);
+    } else {
+        data.wide = wide_grid.data();
+        data.verts = verts.data();
+        data.indices = indices.data();
+    }
+    geometry = std::move(geom);
+}
+
+BVH_Stats Tri_Mesh::stats() const {
+
+    const Geometry& geom = *geometry;
+    if(!geom.use_bvh) return {};
+    if(geom.compressed) {
+        BVH_Stats s = geom.cluster_bvh.stats();
+        // Paged geometry is counted by its Geometry_Pager instead
+        if(!geom.packed.region) {
+            s.bytes += geom.packed.n_verts * sizeof(Tri_Cluster::Vert) +
+                       geom.packed.n_indices * sizeof(uint16_t) +
+                       geom.packed.n_wide * sizeof(uint32_t);
+        }
+        return s;
+    }
+    BVH_Stats s = geom.triangle_bvh.stats();
+    s.bytes += geom.verts.size() * sizeof(Tri_Mesh_Vert) +
+               geom.indices->size() * sizeof(GL::Mesh::Index);
+    return s;
+}
+
 BBox Tri_Mesh::bbox() const {
-    if(use_bvh) return triangle_bvh.bbox();
-    return triangle_list.bbox();
+    if(geometry->compressed) return geometry->cluster_bvh.bbox();
+    if(geometry->use_bvh) return geometry->triangle_bvh.bbox();
+    return geometry->triangle_list.bbox();
 }
 
 Trace Tri_Mesh::hit(const Ray& ray) const {
-    if(use_bvh) return triangle_bvh.hit(ray);
-    return triangle_list.hit(ray);
+    touch();
+    if(geometry->compressed) return geometry->cluster_bvh.hit(ray);
+    if(geometry->use_bvh) return geometry->triangle_bvh.hit(ray);
+    return geometry->triangle_list.hit(ray);
+}
+
+bool Tri_Mesh::intersect(const Ray& ray, float& tmax, Hit& hit) const {
+    touch();
+    if(geometry->compressed) return geometry->cluster_bvh.intersect(ray, tmax, hit);
+    if(geometry->use_bvh) return geometry->triangle_bvh.intersect(ray, tmax, hit);
+    return geometry->triangle_list.intersect(ray, tmax, hit);
+}
+
+Trace Tri_Mesh::finish(const Ray& ray, float t, Hit hit) const {
+    if(geometry->compressed) return geometry->cluster_bvh.finish(ray, t, hit);
+    if(geometry->use_bvh) return geometry->triangle_bvh.finish(ray, t, hit);
+    return geometry->triangle_list.finish(ray, t, hit);
+}
+
+bool Tri_Mesh::occluded(const Ray& ray) const {
+    touch();
+    if(geometry->compressed) return geometry->cluster_bvh.occluded(ray);
+    if(geometry->use_bvh) return geometry->triangle_bvh.occluded(ray);
+    return geometry->triangle_list.occluded(ray);
 }
 
 size_t Tri_Mesh::visualize(GL::Lines& lines, GL::Lines& active, size_t level,
                            const Mat4& trans) const {
-    if(use_bvh) return triangle_bvh.visualize(lines, active, level, trans);
+    if(geometry->compressed) return geometry->cluster_bvh.visualize(lines, active, level, trans);
+    if(geometry->use_bvh) return geometry->triangle_bvh.visualize(lines, active, level, trans);
     return 0;
 }
 
+void Tri_Mesh::build_area_cdf(Geometry& geom) {
+
+    const auto& idxs = *geom.indices;
+    geom.area_cdf.clear();
+    geom.area_cdf.reserve(idxs.size() / 3);
+
+    double sum = 0.0;
+    for(size_t i = 0; i < idxs.size(); i += 3) {
+        Vec3 p0 = geom.verts[idxs[i]].position;
+        Vec3 p1 = geom.verts[idxs[i + 1]].position;
+        Vec3 p2 = geom.verts[idxs[i + 2]].position;
+        sum += 0.5 * cross(p1 - p0, p2 - p0).norm();
+        geom.area_cdf.push_back(static_cast<float>(sum));
+    }
+}
+
+void Tri_Mesh::enable_sampling() {
+    if(geometry->compressed || (geometry->use_bvh && geometry->options.spatial_alpha > 0.0f)) {
+        die("Sampling needs an uncompressed mesh built without spatial splits.");
+    }
+    build_area_cdf(*geometry);
+}
+
+void Tri_Mesh::sample_point(const Mat4& T, Vec3& pos, Vec3& normal, float& pdf) const {
+
+    const std::vector<float>& cdf = geometry->area_cdf;
+    if(cdf.empty() || cdf.back() <= 0.0f) {
+        die("Sampling points of triangle meshes needs Tri_Mesh::enable_sampling().");
+    }
+    float u = RNG::unit() * cdf.back();
+    size_t tri = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    tri = std::min(tri, cdf.size() - 1);
+
+    const auto& idxs = *geometry->indices;
+    const auto& verts = geometry->verts;
+    Vec3 p0 = verts[idxs[3 * tri]].position, p1 = verts[idxs[3 * tri + 1]].position,
+         p2 = verts[idxs[3 * tri + 2]].position;
+    Vec3 w0 = T * p0, w1 = T * p1, w2 = T * p2;
+
+    // Uniform within the triangle before T is uniform after it, as T is affine
+    pos = Samplers::Triangle(w0, w1, w2).sample();
+    Vec3 n = cross(w1 - w0, w2 - w0);
+    float world_area2 = n.norm();
+    normal = world_area2 > 0.0f ? n / world_area2 : Vec3{0.0f, 1.0f, 0.0f};
+    pdf = world_area2 > 0.0f ? cross(p1 - p0, p2 - p0).norm() / (cdf.back() * world_area2) : 0.0f;
+}
+
 Vec3 Tri_Mesh::sample(Vec3 from) const {
-    if(use_bvh) {
-        die("Sampling BVH-based triangle meshes is not yet supported.");
+    if(!geometry->use_bvh) return geometry->triangle_list.sample(from);
+
+    const std::vector<float>& cdf = geometry->area_cdf;
+    if(cdf.empty() || cdf.back() <= 0.0f) {
+        die("Sampling BVH-based triangle meshes needs Tri_Mesh::enable_sampling().");
     }
-    return triangle_list.sample(from);
+
+    // Triangles are picked in proportion to their area, so points are uniform over
+    // the whole surface
+    float u = RNG::unit() * cdf.back();
+    size_t tri = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    tri = std::min(tri, cdf.size() - 1);
+
+    const auto& idxs = *geometry->indices;
+    const auto& verts = geometry->verts;
+    Samplers::Triangle sampler(verts[idxs[3 * tri]].position, verts[idxs[3 * tri + 1]].position,
+                               verts[idxs[3 * tri + 2]].position);
+    return (sampler.sample() - from).unit();
 }
 
 float Tri_Mesh::pdf(Ray ray, const Mat4& T, const Mat4& iT) const {
-    if(use_bvh) {
-        die("Sampling BVH-based triangle meshes is not yet supported.");
+    if(!geometry->use_bvh) return geometry->triangle_list.pdf(ray, T, iT);
+
+    const std::vector<float>& cdf = geometry->area_cdf;
+    if(cdf.empty() || cdf.back() <= 0.0f) {
+        die("Sampling BVH-based triangle meshes needs Tri_Mesh::enable_sampling().");
     }
-    return triangle_list.pdf(ray, T, iT);
+
+    Ray tray = ray;
+    tray.transform(iT);
+
+    // Every triangle the ray crosses could have been sampled. Points are uniform over
+    // the surface in object space, a density of 1 / area, which T scales by each
+    // triangle's change in area before it is converted to solid angle.
+    float ret = 0.0f, area = cdf.back();
+    geometry->triangle_bvh.reached(tray, [&](const Triangle& tri) {
+        float t = tray.dist_bounds.y;
+        Hit hit;
+        if(!tri.intersect(tray, t, hit)) return;
+
+        // Twice the triangle's area, before and after T
+        float obj_area2 = cross(tri.e1, tri.e2).norm();
+        Vec3 n = cross(T.rotate(tri.e1), T.rotate(tri.e2));
+        float world_area2 = n.norm();
+        float cos = std::abs(dot(n, ray.dir));
+        if(world_area2 <= 0.0f || cos <= 0.0f) return;
+        cos /= world_area2;
+
+        Vec3 pos = T * (tray.point + tray.dir * t);
+        float g = (pos - ray.point).norm_squared() / cos;
+        ret += obj_area2 / (area * world_area2) * g;
+    });
+    return ret;
 }
 
 } // namespace PT
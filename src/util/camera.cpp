@@ -87,6 +87,7 @@ void Camera::mouse_radius(float off) {
 
 void Camera::set_fov(float f) {
     vert_fov = f;
+    update_frame();
 }
 
 float Camera::get_h_fov() const {
@@ -113,10 +114,12 @@ Vec3 Camera::center() const {
 
 void Camera::set_ar(float a) {
     aspect_ratio = a;
+    update_frame();
 }
 
 void Camera::set_ar(Vec2 dim) {
     aspect_ratio = dim.x / dim.y;
+    update_frame();
 }
 
 void Camera::set_ap(float ap) {
@@ -129,6 +132,7 @@ float Camera::get_ap() const {
 
 void Camera::set_dist(float dist) {
     focal_dist = dist;
+    update_frame();
 }
 
 float Camera::get_dist() const {
@@ -140,4 +144,13 @@ void Camera::update_pos() {
     position = looking_at + radius * position.unit();
     iview = Mat4::translate(position) * rot.to_mat();
     view = iview.inverse();
+    update_frame();
+}
+
+void Camera::update_frame() {
+    float h = std::tan(Radians(vert_fov / 2.f)) * focal_dist * 2.f;
+    float w = aspect_ratio * h;
+    ray_du = iview.rotate(Vec3{1.0f, 0.0f, 0.0f}) * w;
+    ray_dv = iview.rotate(Vec3{0.0f, 1.0f, 0.0f}) * h;
+    ray_corner = -iview.rotate(Vec3{0.0f, 0.0f, 1.0f}) - 0.5f * ray_du - 0.5f * ray_dv;
 }
@@ -16,6 +16,11 @@ public:
     */
     Ray generate_ray(Vec2 screen_coord) const;
 
+    /// Directions of the rays generate_ray would make through n screen coordinates,
+    /// all of which start at pos(): a tile's camera rays at once, in the form a
+    /// structure-of-arrays ray queue stores them
+    void generate_dirs(const Vec2* screen_coords, size_t n, Vec3* dirs) const;
+
     /// View transformation matrix
     Mat4 get_view() const;
     /// Perspective projection transformation matrix
@@ -62,6 +67,7 @@ public:
 
 private:
     void update_pos();
+    void update_frame();
 
     /// Camera parameters
     Vec3 position, looking_at;
@@ -79,4 +85,7 @@ private:
 
     /// Cached view matrices
     Mat4 view, iview;
+    /// World-space sensor plane one unit in front of the pinhole: the direction to
+    /// its (0, 0) corner, and its extents along screen x and y
+    Vec3 ray_corner, ray_du, ray_dv;
 };
@@ -1,10 +1,17 @@
 
 #include "hdr_image.h"
 #include "../lib/log.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "thread_pool.h"
 
 #include <sf_libs/stb_image.h>
 #include <sf_libs/tinyexr.h>
 
+#include <algorithm>
+#include <array>
+#include <cstring>
+
 HDR_Image::HDR_Image() : w(0), h(0) {
 }
 
@@ -16,7 +23,11 @@ HDR_Image::HDR_Image(size_t w, size_t h) : w(w), h(h) {
 HDR_Image HDR_Image::copy() const {
     HDR_Image ret;
     ret.resize(w, h);
-    ret.pixels.insert(ret.pixels.begin(), pixels.begin(), pixels.end());
+    ret.pixels = pixels;
+    ret.mips = mips;
+    ret.fmt = fmt;
+    ret.packed = packed;
+    ret.packed_scale = packed_scale;
     ret.last_path = last_path;
     ret.dirty = true;
     ret.exposure = exposure;
@@ -32,79 +43,239 @@ void HDR_Image::resize(size_t _w, size_t _h) {
     h = _h;
     pixels.clear();
     pixels.resize(w * h);
-    dirty = true;
+    mips.clear();
+    fmt = Format::float32;
+    packed = {};
+    packed_scale = 1.0f;
+    dirty = all_dirty = true;
 }
 
 void HDR_Image::clear(Spectrum color) {
+    unpack();
     for(auto& s : pixels) s = color;
+    mips.clear();
+    dirty = all_dirty = true;
+}
+
+void HDR_Image::touch(size_t x, size_t y) {
+    mips.clear();
     dirty = true;
+    if(!all_dirty) dirty_tiles[(y / tile_size) * tiles_x() + x / tile_size] = 1;
+}
+
+size_t HDR_Image::tiles_x() const {
+    return (w + tile_size - 1) / tile_size;
 }
 
 Spectrum& HDR_Image::at(size_t i) {
     assert(i < w * h);
-    dirty = true;
+    unpack();
+    touch(i % w, i / w);
     return pixels[i];
 }
 
 Spectrum HDR_Image::at(size_t i) const {
     assert(i < w * h);
-    return pixels[i];
+    return view(0)[i];
+}
+
+const Spectrum* HDR_Image::data() const {
+    return fmt == Format::float32 ? pixels.data() : nullptr;
 }
 
 Spectrum& HDR_Image::at(size_t x, size_t y) {
     assert(x < w && y < h);
     size_t idx = y * w + x;
-    dirty = true;
+    unpack();
+    touch(x, y);
     return pixels[idx];
 }
 
 Spectrum HDR_Image::at(size_t x, size_t y) const {
     assert(x < w && y < h);
     size_t idx = y * w + x;
-    return pixels[idx];
+    return view(0)[idx];
 }
 
-std::string HDR_Image::load_from(std::string file) {
+Spectrum HDR_Image::View::operator[](size_t i) const {
+    switch(format) {
+    case Format::half: return packed.half[i].spectrum() * scale;
+    case Format::rgb9e5: return Pixel_Formats::from_rgb9e5(packed.shared[i]) * scale;
+    default: return pixels[i];
+    }
+}
 
-    if(IsEXR(file.c_str()) == TINYEXR_SUCCESS) {
+HDR_Image::View HDR_Image::view(size_t level) const {
+    if(level == 0) return View{pixels, packed, fmt, packed_scale};
+    const Level& l = mips[level - 1];
+    return View{l.pixels, l.packed, fmt, packed_scale};
+}
 
-        int n_w, n_h;
-        float* data;
-        const char* err = nullptr;
+size_t HDR_Image::Packed::bytes() const {
+    return half.capacity() * sizeof(Pixel_Formats::Half_RGB) +
+           shared.capacity() * sizeof(uint32_t);
+}
 
-        int ret = LoadEXR(&data, &n_w, &n_h, file.c_str(), &err);
+HDR_Image::Format HDR_Image::format() const {
+    return fmt;
+}
 
-        if(ret != TINYEXR_SUCCESS) {
+void HDR_Image::set_format(Format f) {
 
-            if(err) {
-                std::string err_s(err);
-                FreeEXRErrorMessage(err);
-                return err_s;
-            } else
-                return "Unknown failure.";
+    if(f == fmt) return;
+    unpack();
+    if(f == Format::float32) return;
 
-        } else {
+    float brightest = 0.0f;
+    for(const Spectrum& p : pixels) {
+        brightest = std::max(brightest, std::max(std::max(p.r, p.g), p.b));
+    }
+    float limit = f == Format::half ? Pixel_Formats::half_max : Pixel_Formats::rgb9e5_max;
+    fmt = f;
+    packed_scale = brightest > limit ? brightest / limit : 1.0f;
+    pack(pixels, packed);
+    for(Level& level : mips) pack(level.pixels, level.packed);
+}
 
-            resize(n_w, n_h);
+void HDR_Image::pack(std::vector<Spectrum>& px, Packed& out) const {
 
-            for(size_t j = 0; j < h; j++) {
-                for(size_t i = 0; i < w; i++) {
-                    size_t didx = 4 * (j * w + i);
-                    size_t pidx = (h - j - 1) * w + i;
-                    pixels[pidx] = Spectrum(data[didx], data[didx + 1], data[didx + 2]);
-                    if(!pixels[pidx].valid()) pixels[pidx] = {};
-                }
-            }
+    float inv = 1.0f / packed_scale;
+    if(fmt == Format::half) {
+        out.half.resize(px.size());
+        parallel_for(0, px.size(), 4096,
+                     [&](size_t i) { out.half[i] = Pixel_Formats::Half_RGB(px[i] * inv); });
+    } else {
+        out.shared.resize(px.size());
+        parallel_for(0, px.size(), 4096,
+                     [&](size_t i) { out.shared[i] = Pixel_Formats::to_rgb9e5(px[i] * inv); });
+    }
+    std::vector<Spectrum>().swap(px);
+}
+
+void HDR_Image::unpack() {
+
+    if(fmt == Format::float32) return;
+    auto expand = [this](size_t n, std::vector<Spectrum>& px, Packed& from) {
+        View src{px, from, fmt, packed_scale};
+        std::vector<Spectrum> full(n);
+        parallel_for(0, n, 4096, [&](size_t i) { full[i] = src[i]; });
+        px = std::move(full);
+        from = {};
+    };
+    expand(w * h, pixels, packed);
+    for(Level& level : mips) expand(level.w * level.h, level.pixels, level.packed);
+    fmt = Format::float32;
+    packed_scale = 1.0f;
+}
 
-            free(data);
+std::string HDR_Image::load_exr(const unsigned char* data, size_t size) {
+
+    // Rather than LoadEXR, which decodes into an interleaved RGBA copy first, the
+    // channels are decoded (in parallel, see sf_libs.cpp) and then gathered
+    // straight into the pixels.
+    EXRVersion version;
+    if(ParseEXRVersionFromMemory(&version, data, size) != TINYEXR_SUCCESS) {
+        return "Failed to read EXR version.";
+    }
+    if(version.multipart || version.non_image) {
+        return "Multipart and deep EXR images are not supported.";
+    }
+
+    EXRHeader header;
+    EXRImage image;
+    InitEXRHeader(&header);
+    InitEXRImage(&image);
+
+    const char* err = nullptr;
+    auto fail = [&](int ret) {
+        std::string err_s = err ? std::string(err) : "Unknown failure.";
+        if(err) FreeEXRErrorMessage(err);
+        if(ret == TINYEXR_SUCCESS) err_s = "EXR image has no R, G, B or single channel.";
+        FreeEXRImage(&image);
+        FreeEXRHeader(&header);
+        return err_s;
+    };
+
+    int ret = ParseEXRHeaderFromMemory(&header, &version, data, size, &err);
+    if(ret != TINYEXR_SUCCESS) return fail(ret);
+    for(int c = 0; c < header.num_channels; c++) {
+        if(header.pixel_types[c] == TINYEXR_PIXELTYPE_HALF) {
+            header.requested_pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+        }
+    }
+    ret = LoadEXRImageFromMemory(&image, &header, data, size, &err);
+    if(ret != TINYEXR_SUCCESS) return fail(ret);
+
+    // Missing color channels read as zero; a single channel is grayscale
+    int idx[3] = {-1, -1, -1};
+    for(int c = 0; c < header.num_channels; c++) {
+        if(header.requested_pixel_types[c] != TINYEXR_PIXELTYPE_FLOAT) continue;
+        std::string name = header.channels[c].name;
+        if(name == "R") idx[0] = c;
+        if(name == "G") idx[1] = c;
+        if(name == "B") idx[2] = c;
+    }
+    if(header.num_channels == 1 && header.requested_pixel_types[0] == TINYEXR_PIXELTYPE_FLOAT) {
+        idx[0] = idx[1] = idx[2] = 0;
+    }
+    if(idx[0] < 0 && idx[1] < 0 && idx[2] < 0) return fail(TINYEXR_SUCCESS);
+
+    resize(image.width, image.height);
+
+    // Copies a block of the image (at x0, y0, with rows stride floats apart)
+    auto gather = [&](unsigned char** planes, int x0, int y0, int bw, int bh, int stride) {
+        const float* src[3];
+        for(int c = 0; c < 3; c++) {
+            src[c] = idx[c] < 0 ? nullptr : reinterpret_cast<const float*>(planes[idx[c]]);
         }
+        for(int j = 0; j < bh; j++) {
+            for(int i = 0; i < bw; i++) {
+                size_t sidx = (size_t)j * stride + i;
+                Spectrum& p = pixels[(h - (y0 + j) - 1) * w + (x0 + i)];
+                p = Spectrum(src[0] ? src[0][sidx] : 0.0f, src[1] ? src[1][sidx] : 0.0f,
+                             src[2] ? src[2][sidx] : 0.0f);
+                if(!p.valid()) p = {};
+            }
+        }
+    };
+
+    if(header.tiled) {
+        for(int t = 0; t < image.num_tiles; t++) {
+            const EXRTile& tile = image.tiles[t];
+            int x0 = tile.offset_x * header.tile_size_x, y0 = tile.offset_y * header.tile_size_y;
+            int bw = std::min(tile.width, image.width - x0);
+            int bh = std::min(tile.height, image.height - y0);
+            gather(tile.images, x0, y0, bw, bh, header.tile_size_x);
+        }
+    } else {
+        gather(image.images, 0, 0, image.width, image.height, image.width);
+    }
+
+    FreeEXRImage(&image);
+    FreeEXRHeader(&header);
+    return {};
+}
+
+std::string HDR_Image::load_from(std::string file) {
+
+    // Files are decoded from a memory mapping rather than from a buffer they were
+    // first read into, which saves a file-sized allocation and copy
+    Mapped_File mapped;
+    if(!mapped.open(file)) return "Could not open " + file + ".";
+
+    EXRVersion version;
+    if(ParseEXRVersionFromMemory(&version, mapped.data(), mapped.size()) == TINYEXR_SUCCESS) {
+
+        std::string err = load_exr(mapped.data(), mapped.size());
+        if(!err.empty()) return err;
 
     } else {
 
         stbi_set_flip_vertically_on_load(true);
 
         int n_w, n_h, channels;
-        unsigned char* data = stbi_load(file.c_str(), &n_w, &n_h, &channels, 0);
+        unsigned char* data = stbi_load_from_memory(mapped.data(), (int)mapped.size(), &n_w,
+                                                    &n_h, &channels, 0);
 
         if(!data) return std::string(stbi_failure_reason());
         if(channels < 3) return "Image has less than 3 color channels.";
@@ -127,7 +298,8 @@ std::string HDR_Image::load_from(std::string file) {
     }
 
     last_path = file;
-    dirty = true;
+    mips.clear();
+    dirty = all_dirty = true;
     return {};
 }
 
@@ -135,55 +307,339 @@ std::string HDR_Image::loaded_from() const {
     return last_path;
 }
 
-void HDR_Image::tonemap(float e) const {
+std::string HDR_Image::save_exr(const std::string& file, const std::vector<Layer>& layers) const {
+
+    struct Channel {
+        std::string name;
+        const HDR_Image* image;
+        size_t component;
+    };
+    std::vector<Channel> channels;
+    auto add = [&](const std::string& prefix, const HDR_Image* image, const std::string& names) {
+        for(size_t c = 0; c < std::min(names.size(), size_t(3)); c++) {
+            channels.push_back({prefix + names[c], image, c});
+        }
+    };
+    add("", this, "RGB");
+    for(const Layer& layer : layers) {
+        if(layer.image->w != w || layer.image->h != h) {
+            return "EXR layer " + layer.name + " is not the size of the image.";
+        }
+        add(layer.name + ".", layer.image, layer.channels);
+    }
+    // Readers expect the channel list sorted by name
+    std::sort(channels.begin(), channels.end(),
+              [](const Channel& l, const Channel& r) { return l.name < r.name; });
+
+    // Planar, and top row first (the image's rows go up from the bottom)
+    size_t n = channels.size();
+    std::vector<std::vector<float>> planes(n, std::vector<float>(w * h));
+    parallel_for(0, n * h, 16, [&](size_t i) {
+        const Channel& c = channels[i / h];
+        size_t y = i % h;
+        View src = c.image->view(0);
+        float* dst = &planes[i / h][(h - y - 1) * w];
+        for(size_t x = 0; x < w; x++) {
+            Spectrum p = src[y * w + x];
+            dst[x] = c.component == 0 ? p.r : c.component == 1 ? p.g : p.b;
+        }
+    });
+
+    std::vector<EXRChannelInfo> infos(n);
+    std::vector<int> types(n, TINYEXR_PIXELTYPE_FLOAT);
+    std::vector<unsigned char*> ptrs(n);
+    for(size_t c = 0; c < n; c++) {
+        std::memset(&infos[c], 0, sizeof(EXRChannelInfo));
+        std::strncpy(infos[c].name, channels[c].name.c_str(), sizeof(infos[c].name) - 1);
+        ptrs[c] = reinterpret_cast<unsigned char*>(planes[c].data());
+    }
 
-    if(e <= 0.0f) {
-        e = exposure;
-    } else if(e != exposure) {
-        exposure = e;
-        dirty = true;
+    EXRHeader header;
+    EXRImage image;
+    InitEXRHeader(&header);
+    InitEXRImage(&image);
+    image.images = ptrs.data();
+    image.width = (int)w;
+    image.height = (int)h;
+    image.num_channels = (int)n;
+    header.num_channels = (int)n;
+    header.channels = infos.data();
+    header.pixel_types = types.data();
+    header.requested_pixel_types = types.data();
+    header.compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;
+
+    // The header and image only point into the vectors above, so aren't freed
+    const char* err = nullptr;
+    if(SaveEXRImageToFile(&image, &header, file.c_str(), &err) != TINYEXR_SUCCESS) {
+        std::string err_s = err ? std::string(err) : "Failed to write " + file + ".";
+        if(err) FreeEXRErrorMessage(err);
+        return err_s;
     }
+    return {};
+}
 
-    if(!dirty) return;
+void HDR_Image::build_mips(Thread_Pool* pool) {
+
+    mips.clear();
+    size_t pw = w, ph = h;
+    while(pw > 1 || ph > 1) {
+
+        // Levels made here stay float32 until all are done
+        View src = mips.empty() ? view(0)
+                                : View{mips.back().pixels, mips.back().packed, Format::float32,
+                                       1.0f};
+        Level next;
+        next.w = std::max(pw / 2, size_t(1));
+        next.h = std::max(ph / 2, size_t(1));
+        next.pixels.resize(next.w * next.h);
+
+        // Each texel averages the 2x2 block above it; with an odd dimension the
+        // last texel also takes in the leftover row or column
+        auto filter_rows = [&, pw, ph](size_t y0, size_t y1) {
+            for(size_t y = y0; y < y1; y++) {
+                size_t sy0 = y * 2, sy1 = y + 1 == next.h ? ph : std::min(sy0 + 2, ph);
+                for(size_t x = 0; x < next.w; x++) {
+                    size_t sx0 = x * 2, sx1 = x + 1 == next.w ? pw : std::min(sx0 + 2, pw);
+                    Spectrum sum;
+                    for(size_t sy = sy0; sy < sy1; sy++) {
+                        for(size_t sx = sx0; sx < sx1; sx++) sum += src[sy * pw + sx];
+                    }
+                    next.pixels[y * next.w + x] = sum * (1.0f / ((sy1 - sy0) * (sx1 - sx0)));
+                }
+            }
+        };
+
+        size_t band = 64;
+        if(pool && next.h > band) {
+            std::vector<Pool_Future<void>> futures((next.h + band - 1) / band);
+            for(size_t i = 0; i < futures.size(); i++) {
+                size_t y = i * band;
+                pool->submit(futures[i], [&filter_rows, y, end = std::min(y + band, next.h)]() {
+                    filter_rows(y, end);
+                });
+            }
+            for(auto& f : futures) pool->wait_for(f);
+        } else {
+            filter_rows(0, next.h);
+        }
 
-    std::vector<unsigned char> data;
-    tonemap_to(data, e);
-    render_tex.image((int)w, (int)h, data.data());
+        pw = next.w;
+        ph = next.h;
+        mips.push_back(std::move(next));
+    }
+    if(fmt != Format::float32) {
+        for(Level& level : mips) pack(level.pixels, level.packed);
+    }
+}
 
-    dirty = false;
+size_t HDR_Image::levels() const {
+    return mips.size() + 1;
 }
 
-const GL::Tex2D& HDR_Image::get_texture(float e) const {
-    tonemap(e);
-    return render_tex;
+size_t HDR_Image::bytes() const {
+    size_t total = pixels.capacity() * sizeof(Spectrum) + packed.bytes() + tonemapped.capacity() +
+                   dirty_tiles.capacity() + stale_tiles[0].capacity() + stale_tiles[1].capacity();
+    for(const Level& level : mips) {
+        total += level.pixels.capacity() * sizeof(Spectrum) + level.packed.bytes();
+    }
+    return total;
 }
 
-void HDR_Image::tonemap_to(std::vector<unsigned char>& data, float e) const {
+Spectrum HDR_Image::bilinear(const View& px, size_t w, size_t h, Vec2 uv) {
+
+    Vec2 xy = uv * Vec2(static_cast<float>(w), static_cast<float>(h)) - Vec2(0.5f);
+    float fx = std::floor(xy.x), fy = std::floor(xy.y);
+    float w_x = xy.x - fx, w_y = xy.y - fy;
+
+    int iw = static_cast<int>(w), ih = static_cast<int>(h);
+    int x0 = ((static_cast<int>(fx) % iw) + iw) % iw;
+    int x1 = (x0 + 1) % iw;
+    int y0 = std::clamp(static_cast<int>(fy), 0, ih - 1);
+    int y1 = std::clamp(static_cast<int>(fy) + 1, 0, ih - 1);
+
+    Spectrum p0 = lerp(px[y0 * w + x0], px[y1 * w + x0], w_y);
+    Spectrum p1 = lerp(px[y0 * w + x1], px[y1 * w + x1], w_y);
+    return lerp(p0, p1, w_x);
+}
+
+Spectrum HDR_Image::lookup(Vec2 uv, float lod) const {
+
+    if(w == 0 || h == 0) return {};
+
+    lod = std::clamp(lod, 0.0f, static_cast<float>(mips.size()));
+    size_t l = static_cast<size_t>(lod);
+    float t = lod - static_cast<float>(l);
+
+    auto at_level = [&](size_t i) {
+        if(i == 0) return bilinear(view(0), w, h, uv);
+        const Level& level = mips[i - 1];
+        return bilinear(view(i), level.w, level.h, uv);
+    };
+
+    Spectrum ret = at_level(l);
+    if(t > 0.0f && l < mips.size()) ret = lerp(ret, at_level(l + 1), t);
+    return ret;
+}
+
+// Tonemapped values in [0,1] to 8-bit sRGB, finely enough that the table agrees
+// with evaluating the curve to within one step of the output
+static const std::array<unsigned char, 16384>& srgb_table() {
+    static const std::array<unsigned char, 16384> table = [] {
+        std::array<unsigned char, 16384> ret;
+        for(size_t i = 0; i < ret.size(); i++) {
+            float f = Spectrum::to_srgb(static_cast<float>(i) / (ret.size() - 1));
+            ret[i] = static_cast<unsigned char>(std::round(std::clamp(f, 0.0f, 1.0f) * 255.0f));
+        }
+        return ret;
+    }();
+    return table;
+}
+
+// Tonemaps the given rows and columns of an image into an RGBA8 buffer of the same
+// size, which is flipped vertically for upload. Pixels are a vector or a View.
+template<typename Pixels>
+static void tonemap_block(const Pixels& pixels, size_t w, size_t h, float exposure,
+                          unsigned char* data, size_t x0, size_t x1, size_t y0, size_t y1) {
+
+    const auto& table = srgb_table();
+    const float scale = static_cast<float>(table.size() - 1);
+
+    for(size_t y = y0; y < y1; y++) {
+        unsigned char* dst = data + 4 * ((h - y - 1) * w);
+        for(size_t x = x0; x < x1; x++) {
+            Spectrum p = pixels[y * w + x];
+            float r = 1.0f - std::exp(-p.r * exposure);
+            float g = 1.0f - std::exp(-p.g * exposure);
+            float b = 1.0f - std::exp(-p.b * exposure);
+            dst[4 * x] = table[static_cast<size_t>(std::clamp(r, 0.0f, 1.0f) * scale + 0.5f)];
+            dst[4 * x + 1] = table[static_cast<size_t>(std::clamp(g, 0.0f, 1.0f) * scale + 0.5f)];
+            dst[4 * x + 2] = table[static_cast<size_t>(std::clamp(b, 0.0f, 1.0f) * scale + 0.5f)];
+            dst[4 * x + 3] = 255;
+        }
+    }
+}
+
+template<typename Pixels>
+static void tonemap_pixels(const Pixels& pixels, size_t w, size_t h, float exposure,
+                           std::vector<unsigned char>& data) {
+    if(data.size() != w * h * 4) data.resize(w * h * 4);
+    size_t band = 16;
+    parallel_for(0, (h + band - 1) / band, 8, [&](size_t i) {
+        tonemap_block(pixels, w, h, exposure, data.data(), 0, w, i * band,
+                      std::min(h, (i + 1) * band));
+    });
+}
+
+void HDR_Image::tonemap(float e, size_t l) const {
 
     if(e <= 0.0f) {
         e = exposure;
+    } else if(e != exposure) {
+        exposure = e;
+        dirty = all_dirty = true;
+    }
+    if(l != tex_level) {
+        tex_level = l;
+        dirty = all_dirty = true;
     }
 
-    if(data.size() != w * h * 4) data.resize(w * h * 4);
+    if(!dirty) return;
+
+    // This is on the UI thread's path to the screen, so it runs ahead of rendering
+    Thread_Pool::Scoped_Priority interactive(Thread_Pool::Priority::interactive);
+
+    if(l > 0) {
+        std::vector<unsigned char> data;
+        const Level& level = mips[l - 1];
+        tonemap_pixels(view(l), level.w, level.h, exposure, data);
+        front ^= 1;
+        render_tex[front].image((int)level.w, (int)level.h, data.data());
+        stale_all[0] = stale_all[1] = true;
+        dirty = false;
+        return;
+    }
 
-    for(size_t j = 0; j < h; j++) {
-        for(size_t i = 0; i < w; i++) {
+    // Only tiles written since the last call are tonemapped again
+    size_t tx = tiles_x(), ty = (h + tile_size - 1) / tile_size;
+    if(tonemapped.size() != w * h * 4) {
+        tonemapped.resize(w * h * 4);
+        all_dirty = true;
+    }
+    std::vector<size_t> todo;
+    for(size_t t = 0; t < tx * ty; t++) {
+        if(all_dirty || dirty_tiles[t]) todo.push_back(t);
+    }
+    parallel_for(0, todo.size(), 4, [&](size_t i) {
+        size_t x0 = (todo[i] % tx) * tile_size, y0 = (todo[i] / tx) * tile_size;
+        // Renders are always float32, and read without the View's switch
+        size_t x1 = std::min(w, x0 + tile_size), y1 = std::min(h, y0 + tile_size);
+        if(fmt == Format::float32) {
+            tonemap_block(pixels, w, h, exposure, tonemapped.data(), x0, x1, y0, y1);
+        } else {
+            tonemap_block(view(0), w, h, exposure, tonemapped.data(), x0, x1, y0, y1);
+        }
+    });
 
-            size_t pidx = (h - j - 1) * w + i;
-            const Spectrum& sample = pixels[pidx];
+    if(all_dirty) {
+        stale_all[0] = stale_all[1] = true;
+        stale_tiles[0].assign(tx * ty, 0);
+        stale_tiles[1].assign(tx * ty, 0);
+    } else {
+        for(size_t t : todo) stale_tiles[0][t] = stale_tiles[1][t] = 1;
+    }
 
-            float r = 1.0f - std::exp(-sample.r * exposure);
-            float g = 1.0f - std::exp(-sample.g * exposure);
-            float b = 1.0f - std::exp(-sample.b * exposure);
+    size_t back = front ^ 1;
+    if(stale_all[back]) {
+        render_tex[back].image((int)w, (int)h, tonemapped.data());
+    } else {
+        upload_tiles(back);
+    }
+    stale_all[back] = false;
+    stale_tiles[back].assign(tx * ty, 0);
+    front = back;
 
-            Spectrum out(r, g, b);
-            out = out.to_srgb();
+    dirty_tiles.assign(tx * ty, 0);
+    dirty = all_dirty = false;
+}
 
-            size_t didx = 4 * (j * w + i);
-            data[didx] = (unsigned char)std::round(out.r * 255.0f);
-            data[didx + 1] = (unsigned char)std::round(out.g * 255.0f);
-            data[didx + 2] = (unsigned char)std::round(out.b * 255.0f);
-            data[didx + 3] = 255;
+// Uploads the stale tiles of a texture a row of tiles at a time, one span per run
+// of neighboring tiles
+void HDR_Image::upload_tiles(size_t tex) const {
+
+    size_t tx = tiles_x(), ty = (h + tile_size - 1) / tile_size;
+    const std::vector<unsigned char>& stale = stale_tiles[tex];
+
+    std::vector<std::pair<int, int>> spans;
+    for(size_t j = 0; j < ty; j++) {
+        spans.clear();
+        for(size_t i = 0; i < tx; i++) {
+            if(!stale[j * tx + i]) continue;
+            int x0 = (int)(i * tile_size), x1 = (int)std::min(w, (i + 1) * tile_size);
+            if(!spans.empty() && spans.back().second == x0) {
+                spans.back().second = x1;
+            } else {
+                spans.push_back({x0, x1});
+            }
         }
+        // Rows are stored bottom up
+        size_t y0 = j * tile_size, y1 = std::min(h, y0 + tile_size);
+        render_tex[tex].sub_image(tonemapped.data(), (int)(h - y1), (int)(h - y0), spans);
+    }
+}
+
+const GL::Tex2D& HDR_Image::get_texture(float e, size_t max_w) const {
+    size_t l = 0;
+    if(max_w > 0) {
+        while(l < mips.size() && (l == 0 ? w : mips[l - 1].w) > max_w) l++;
+    }
+    tonemap(e, l);
+    return render_tex[front];
+}
+
+void HDR_Image::tonemap_to(std::vector<unsigned char>& data, float e) const {
+    if(fmt == Format::float32) {
+        tonemap_pixels(pixels, w, h, e > 0.0f ? e : exposure, data);
+    } else {
+        tonemap_pixels(view(0), w, h, e > 0.0f ? e : exposure, data);
     }
 }
@@ -1,13 +1,24 @@
 
 #pragma once
 
+#include <string>
 #include <vector>
 
 #include "../lib/spectrum.h"
 #include "../platform/gl.h"
+#include "pixel_formats.h"
+
+class Thread_Pool;
 
 class HDR_Image {
 public:
+    // How pixels are held. float32 is exact; half (6 bytes a pixel) and rgb9e5 (4 bytes,
+    // one exponent shared by the three channels) suit images only read once made, such
+    // as environment maps. Images brighter than those formats' range (about 65000) are
+    // scaled down to fit and back up as they are read. Writing through at() or clear()
+    // first converts an image back to float32.
+    enum class Format : uint8_t { float32, half, rgb9e5 };
+
     HDR_Image();
     HDR_Image(size_t w, size_t h);
     HDR_Image(const HDR_Image& src) = delete;
@@ -23,6 +34,12 @@ public:
     Spectrum at(size_t x, size_t y) const;
     Spectrum& at(size_t i);
     Spectrum at(size_t i) const;
+    // Rows of pixels, bottom first; null unless the format is float32
+    const Spectrum* data() const;
+
+    // Converts every mip level
+    void set_format(Format format);
+    Format format() const;
 
     void clear(Spectrum color);
     void resize(size_t w, size_t h);
@@ -31,17 +48,87 @@ public:
     std::string load_from(std::string file);
     std::string loaded_from() const;
 
+    // An image saved alongside another in one EXR, channel i of the layer holding
+    // component i of each pixel, e.g. {"normal", &n, "XYZ"} as normal.X, .Y and .Z
+    struct Layer {
+        std::string name;
+        const HDR_Image* image = nullptr;
+        std::string channels = "RGB";
+    };
+    // Writes the image as the R, G and B channels of a 32-bit float EXR, along with
+    // any layers, which must be of the same size
+    std::string save_exr(const std::string& file, const std::vector<Layer>& layers = {}) const;
+
+    // Box-filtered levels at half the resolution of the one above, down to 1x1.
+    // They are dropped whenever the image is modified, and rows of each level are
+    // filtered in parallel on the pool if one is given.
+    void build_mips(Thread_Pool* pool = nullptr);
+    size_t levels() const;
+    // Memory held on the CPU: every level's pixels and the tonemapped copy for display
+    size_t bytes() const;
+
+    // Bilinear lookup at uv in [0,1]^2, wrapping in x and clamping in y, blended
+    // between the two levels around lod (0 being the image itself)
+    Spectrum lookup(Vec2 uv, float lod = 0.0f) const;
+
     void tonemap_to(std::vector<unsigned char>& data, float exposure = 0.0f) const;
-    const GL::Tex2D& get_texture(float exposure = 0.0f) const;
+    // The texture shows the largest level at most max_w wide (0 for the image itself)
+    const GL::Tex2D& get_texture(float exposure = 0.0f, size_t max_w = 0) const;
 
 private:
-    void tonemap(float exposure = 0.0f) const;
+    // A level's pixels in the packed formats: three halfs, or one rgb9e5, per pixel
+    struct Packed {
+        std::vector<Pixel_Formats::Half_RGB> half;
+        std::vector<uint32_t> shared;
+        size_t bytes() const;
+    };
+    struct Level {
+        size_t w = 0, h = 0;
+        std::vector<Spectrum> pixels;
+        Packed packed;
+    };
+    // Reads a level's pixels by index, whatever the image's format
+    struct View {
+        const std::vector<Spectrum>& pixels;
+        const Packed& packed;
+        Format format;
+        float scale;
+        Spectrum operator[](size_t i) const;
+    };
+    View view(size_t level) const;
+    void pack(std::vector<Spectrum>& pixels, Packed& packed) const;
+    void unpack();
+
+    std::string load_exr(const unsigned char* data, size_t size);
+    void tonemap(float exposure, size_t level) const;
+    void upload_tiles(size_t tex) const;
+    void touch(size_t x, size_t y);
+    size_t tiles_x() const;
+    static Spectrum bilinear(const View& pixels, size_t w, size_t h, Vec2 uv);
 
     size_t w, h;
     std::string last_path;
     std::vector<Spectrum> pixels;
+    // Level 0 lives in w, h, pixels and packed, so this holds levels 1 and up
+    std::vector<Level> mips;
+    Format fmt = Format::float32;
+    Packed packed;
+    // Packed values times this are the pixels'
+    float packed_scale = 1.0f;
 
-    mutable GL::Tex2D render_tex;
+    // Two textures take turns being written, so uploads don't wait on draws still
+    // reading the one shown last. Each knows the tiles tonemapped since its last write.
+    mutable GL::Tex2D render_tex[2];
+    mutable size_t front = 0;
+    mutable std::vector<unsigned char> stale_tiles[2];
+    mutable bool stale_all[2] = {true, true};
     mutable float exposure = 1.0f;
+    mutable size_t tex_level = 0;
     mutable bool dirty = true;
+
+    // The level 0 texture is kept tonemapped, and retonemapped only in the tiles
+    // written since (unless all_dirty, after which every tile is)
+    static constexpr size_t tile_size = 64;
+    mutable std::vector<unsigned char> tonemapped, dirty_tiles;
+    mutable bool all_dirty = true;
 };
@@ -0,0 +1,285 @@
+
+#include "image_stream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "png_writer.h"
+
+// Defined with the rest of stb_image_write in sf_libs.cpp, but only declared there
+extern "C" unsigned char* stbi_zlib_compress(unsigned char* data, int data_len, int* out_len,
+                                             int quality);
+
+// Scanlines per chunk of a zip-compressed EXR
+static const size_t exr_lines = 16;
+// Bytes of zlib stream gathered before they go out as a PNG IDAT chunk
+static const size_t idat_size = size_t(1) << 20;
+
+template<typename T> static void put(std::vector<unsigned char>& buf, T value) {
+    unsigned char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    buf.insert(buf.end(), bytes, bytes + sizeof(T));
+}
+
+static void put_be32(std::vector<unsigned char>& buf, uint32_t value) {
+    for(int shift = 24; shift >= 0; shift -= 8) buf.push_back((unsigned char)(value >> shift));
+}
+
+Image_Stream::~Image_Stream() {
+    if(out.is_open()) close();
+}
+
+std::string Image_Stream::open(const std::string& path, size_t width, size_t height,
+                               bool as_exr, float e) {
+
+    if(out.is_open()) close();
+    file = path;
+    w = width;
+    h = height;
+    exr = as_exr;
+    exposure = e;
+    err.clear();
+    rows.clear();
+    next_row = 0;
+    offsets.clear();
+    idat.clear();
+    adler_a = 1;
+    adler_b = 0;
+
+    if(w == 0 || h == 0 || w > INT32_MAX || h > INT32_MAX) return "Invalid image size.";
+    out.open(file, std::ios::binary | std::ios::trunc);
+    if(!out) return "Could not open " + file + " for writing.";
+
+    std::vector<unsigned char> header;
+    if(exr) {
+        // Magic number and version 2 (single-part scanline), then the required attributes
+        auto attribute = [&](const char* name, const char* type, size_t size) {
+            header.insert(header.end(), name, name + std::strlen(name) + 1);
+            header.insert(header.end(), type, type + std::strlen(type) + 1);
+            put<int32_t>(header, (int32_t)size);
+        };
+        put<uint32_t>(header, 20000630u);
+        put<uint32_t>(header, 2u);
+
+        // Channels are listed by name, as FLOAT (2) and sampled at every pixel
+        attribute("channels", "chlist", 3 * 18 + 1);
+        for(const char* channel : {"B", "G", "R"}) {
+            header.push_back((unsigned char)channel[0]);
+            header.push_back(0);
+            put<int32_t>(header, 2);
+            put<uint32_t>(header, 0u);
+            put<int32_t>(header, 1);
+            put<int32_t>(header, 1);
+        }
+        header.push_back(0);
+        attribute("compression", "compression", 1);
+        header.push_back(3);
+        for(const char* window : {"dataWindow", "displayWindow"}) {
+            attribute(window, "box2i", 16);
+            put<int32_t>(header, 0);
+            put<int32_t>(header, 0);
+            put<int32_t>(header, (int32_t)w - 1);
+            put<int32_t>(header, (int32_t)h - 1);
+        }
+        attribute("lineOrder", "lineOrder", 1);
+        header.push_back(0);
+        attribute("pixelAspectRatio", "float", 4);
+        put<float>(header, 1.0f);
+        attribute("screenWindowCenter", "v2f", 8);
+        put<float>(header, 0.0f);
+        put<float>(header, 0.0f);
+        attribute("screenWindowWidth", "float", 4);
+        put<float>(header, 1.0f);
+        header.push_back(0);
+
+        // The offset table is filled in by close(), once the chunks' sizes are known
+        out.write((const char*)header.data(), header.size());
+        table = out.tellp();
+        std::vector<unsigned char> zeros(8 * ((h + exr_lines - 1) / exr_lines));
+        out.write((const char*)zeros.data(), zeros.size());
+    } else {
+        static const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        header.insert(header.end(), signature, signature + sizeof(signature));
+        std::vector<unsigned char> ihdr = {'I', 'H', 'D', 'R'};
+        put_be32(ihdr, (uint32_t)w);
+        put_be32(ihdr, (uint32_t)h);
+        // 8-bit RGB, deflate, per-row filters, not interlaced
+        ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0});
+        put_be32(header, 13);
+        header.insert(header.end(), ihdr.begin(), ihdr.end());
+        put_be32(header, Png::crc32(ihdr.data(), ihdr.size()));
+        out.write((const char*)header.data(), header.size());
+
+        // zlib header: deflate with a 32K window, no dictionary, fastest level
+        idat = {0x78, 0x01};
+    }
+
+    if(!out) err = "Failed to write " + file + ".";
+    return err;
+}
+
+bool Image_Stream::complete(size_t row) const {
+    auto entry = rows.find(row);
+    return entry != rows.end() && entry->second.filled == w;
+}
+
+void Image_Stream::add(size_t x, size_t y, size_t bw, size_t bh,
+                       const std::vector<Spectrum>& pixels) {
+
+    std::lock_guard<std::mutex> lock(mut);
+    if(!out.is_open() || x >= w || y >= h) return;
+
+    size_t cols = std::min(bw, w - x);
+    for(size_t j = 0; j < bh && y + j < h; j++) {
+        Row& row = rows[h - 1 - (y + j)];
+        if(row.pixels.empty()) row.pixels.resize(w);
+        std::copy_n(pixels.begin() + j * bw, cols, row.pixels.begin() + x);
+        row.filled += cols;
+    }
+
+    // Write out whatever now follows on from the last rows written
+    while(next_row < h) {
+        size_t n = exr ? std::min(exr_lines, h - next_row) : 1;
+        bool ready = true;
+        for(size_t r = next_row; r < next_row + n && ready; r++) ready = complete(r);
+        if(!ready) break;
+        if(exr) {
+            write_exr_chunk(n);
+        } else {
+            write_png_row();
+        }
+        for(size_t r = next_row; r < next_row + n; r++) rows.erase(r);
+        next_row += n;
+    }
+}
+
+void Image_Stream::write_exr_chunk(size_t n) {
+
+    // Per scanline, each channel's values in turn, in the channel list's order
+    std::vector<unsigned char> raw;
+    raw.reserve(n * w * 12);
+    for(size_t r = next_row; r < next_row + n; r++) {
+        const std::vector<Spectrum>& pixels = rows[r].pixels;
+        for(size_t x = 0; x < w; x++) put<float>(raw, pixels[x].b);
+        for(size_t x = 0; x < w; x++) put<float>(raw, pixels[x].g);
+        for(size_t x = 0; x < w; x++) put<float>(raw, pixels[x].r);
+    }
+
+    // As OpenEXR prepares zip data: bytes split into even and odd halves, then
+    // delta coded, so that the slowly changing high bytes of floats line up
+    size_t size = raw.size();
+    std::vector<unsigned char> split(size);
+    for(size_t i = 0; i < size; i++) split[(i & 1) ? (size + 1) / 2 + i / 2 : i / 2] = raw[i];
+    for(size_t i = size - 1; i > 0; i--) {
+        split[i] = (unsigned char)(int(split[i]) - int(split[i - 1]) + 128 + 256);
+    }
+
+    int packed_size = 0;
+    unsigned char* packed = stbi_zlib_compress(split.data(), (int)size, &packed_size, 8);
+    // Chunks that don't shrink are stored as they are, which readers recognize by size
+    const unsigned char* data = raw.data();
+    size_t data_size = size;
+    if(packed && (size_t)packed_size < size) {
+        data = packed;
+        data_size = (size_t)packed_size;
+    }
+
+    std::vector<unsigned char> chunk;
+    put<int32_t>(chunk, (int32_t)next_row);
+    put<int32_t>(chunk, (int32_t)data_size);
+    offsets.push_back((uint64_t)out.tellp());
+    out.write((const char*)chunk.data(), chunk.size());
+    out.write((const char*)data, data_size);
+    std::free(packed);
+    if(!out && err.empty()) err = "Failed to write " + file + ".";
+}
+
+void Image_Stream::write_png_row() {
+
+    // Filter type 0 (none), then the row tonemapped
+    const std::vector<Spectrum>& pixels = rows[next_row].pixels;
+    std::vector<unsigned char> line(1 + 3 * w);
+    line[0] = 0;
+    auto channel = [this](float f) {
+        float mapped = Spectrum::to_srgb(std::clamp(1.0f - std::exp(-f * exposure), 0.0f, 1.0f));
+        return (unsigned char)std::round(std::clamp(mapped, 0.0f, 1.0f) * 255.0f);
+    };
+    for(size_t x = 0; x < w; x++) {
+        line[1 + 3 * x] = channel(pixels[x].r);
+        line[2 + 3 * x] = channel(pixels[x].g);
+        line[3 + 3 * x] = channel(pixels[x].b);
+    }
+    deflate_stored(line.data(), line.size(), false);
+}
+
+void Image_Stream::deflate_stored(const unsigned char* data, size_t size, bool final) {
+
+    // Stored blocks hold at most 65535 bytes each
+    do {
+        size_t len = std::min(size, size_t(65535));
+        idat.push_back(final && len == size ? 1 : 0);
+        idat.push_back((unsigned char)(len & 0xff));
+        idat.push_back((unsigned char)(len >> 8));
+        idat.push_back((unsigned char)(~len & 0xff));
+        idat.push_back((unsigned char)((~len >> 8) & 0xff));
+        idat.insert(idat.end(), data, data + len);
+        for(size_t i = 0; i < len; i++) {
+            adler_a = (adler_a + data[i]) % 65521;
+            adler_b = (adler_b + adler_a) % 65521;
+        }
+        data += len;
+        size -= len;
+    } while(size > 0);
+
+    if(idat.size() >= idat_size) write_idat();
+}
+
+void Image_Stream::write_idat() {
+
+    std::vector<unsigned char> chunk;
+    put_be32(chunk, (uint32_t)idat.size());
+    chunk.insert(chunk.end(), {'I', 'D', 'A', 'T'});
+    chunk.insert(chunk.end(), idat.begin(), idat.end());
+    put_be32(chunk, Png::crc32(chunk.data() + 4, chunk.size() - 4));
+    out.write((const char*)chunk.data(), chunk.size());
+    idat.clear();
+    if(!out && err.empty()) err = "Failed to write " + file + ".";
+}
+
+std::string Image_Stream::close() {
+
+    std::lock_guard<std::mutex> lock(mut);
+    if(!out.is_open()) return err;
+
+    if(next_row < h && err.empty()) {
+        err = "Only " + std::to_string(next_row) + " of " + std::to_string(h) + " rows of " +
+              file + " were written.";
+    }
+    if(exr) {
+        out.seekp(table);
+        std::vector<unsigned char> buf;
+        for(uint64_t offset : offsets) put<uint64_t>(buf, offset);
+        out.write((const char*)buf.data(), buf.size());
+    } else {
+        deflate_stored(nullptr, 0, true);
+        put_be32(idat, (adler_b << 16) | adler_a);
+        write_idat();
+        static const unsigned char iend[] = {0,   0,   0,   0,    'I',  'E',
+                                             'N', 'D', 0xae, 0x42, 0x60, 0x82};
+        out.write((const char*)iend, sizeof(iend));
+    }
+    out.close();
+    if(!out && err.empty()) err = "Failed to write " + file + ".";
+
+    rows.clear();
+    offsets.clear();
+    idat = {};
+    return err;
+}
+
+size_t Image_Stream::held_rows() const {
+    std::lock_guard<std::mutex> lock(mut);
+    return rows.size();
+}
@@ -0,0 +1,70 @@
+
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../lib/spectrum.h"
+
+// Writes an image to disk a few rows at a time as blocks of it arrive, so that images
+// too large to hold in memory (e.g. print-resolution posters) can still be saved.
+// Output is either a 32-bit float RGB EXR, zip-compressed in bands of 16 scanlines,
+// or an 8-bit RGB PNG tonemapped like HDR_Image::tonemap_to. PNG rows are stored
+// without compression, as the vendored deflate only compresses whole buffers at once.
+class Image_Stream {
+public:
+    Image_Stream() = default;
+    ~Image_Stream();
+
+    Image_Stream(const Image_Stream& src) = delete;
+    Image_Stream& operator=(const Image_Stream& src) = delete;
+
+    std::string open(const std::string& file, size_t w, size_t h, bool exr, float exposure);
+
+    // Takes the pixels of the block at (x, y) from the bottom left, rows bottom first
+    // as in HDR_Image. Rows are written once every row above them has been; until
+    // then they are held, so blocks should arrive roughly from the top down. Safe to
+    // call from many threads.
+    void add(size_t x, size_t y, size_t w, size_t h, const std::vector<Spectrum>& pixels);
+
+    // Finishes the file, returning the first error met since open
+    std::string close();
+
+    // Rows received but not yet written
+    size_t held_rows() const;
+
+private:
+    struct Row {
+        std::vector<Spectrum> pixels;
+        size_t filled = 0;
+    };
+
+    bool complete(size_t row) const;
+    void write_exr_chunk(size_t rows);
+    void write_png_row();
+    void deflate_stored(const unsigned char* data, size_t size, bool final);
+    void write_idat();
+
+    mutable std::mutex mut;
+    std::ofstream out;
+    std::string file, err;
+    size_t w = 0, h = 0;
+    bool exr = false;
+    float exposure = 1.0f;
+
+    // Rows counted from the top, as both formats store them, which are yet to be written
+    std::map<size_t, Row> rows;
+    size_t next_row = 0;
+
+    // EXR: where the table of chunk offsets goes, and the offsets to patch into it
+    std::streampos table;
+    std::vector<uint64_t> offsets;
+
+    // PNG: the zlib stream not yet written as an IDAT chunk, and its running Adler-32
+    std::vector<unsigned char> idat;
+    uint32_t adler_a = 1, adler_b = 0;
+};
@@ -0,0 +1,138 @@
+
+#include "line_server.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+using Socket = SOCKET;
+static void close_socket(Socket s) {
+    closesocket(s);
+}
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+using Socket = int;
+static void close_socket(Socket s) {
+    ::close(s);
+}
+#endif
+
+#include <cerrno>
+#include <cstring>
+
+// A client that disconnects mid-reply must not raise SIGPIPE
+#ifdef MSG_NOSIGNAL
+static const int send_flags = MSG_NOSIGNAL;
+#else
+static const int send_flags = 0;
+#endif
+
+// Past this many bytes without a newline, the client is dropped rather than buffered
+static const size_t max_line = 64 * 1024;
+
+static Socket socket_of(intptr_t s) {
+    return (Socket)s;
+}
+
+Line_Server::~Line_Server() {
+    close();
+}
+
+std::string Line_Server::listen(int port) {
+
+    close();
+#ifdef _WIN32
+    static bool started = [] {
+        WSADATA data;
+        return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+    }();
+    if(!started) return "Could not start Winsock.";
+#endif
+
+    Socket s = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if((intptr_t)s == none) return "Could not create a socket.";
+    listener = (intptr_t)s;
+
+    // A server restarted on the same port need not wait out the last one's connections
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(::bind(s, (const sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(s, 4) != 0) {
+        std::string err = std::strerror(errno);
+        close();
+        return "Could not listen on port " + std::to_string(port) + ": " + err;
+    }
+    return {};
+}
+
+bool Line_Server::read(std::string& line) {
+
+    char buf[4096];
+    for(;;) {
+        size_t end = pending.find('\n');
+        if(end != std::string::npos) {
+            line = pending.substr(0, end);
+            pending.erase(0, end + 1);
+            if(!line.empty() && line.back() == '\r') line.pop_back();
+            return true;
+        }
+
+        if(client == none) {
+            if(listener == none) return false;
+            Socket s = ::accept(socket_of(listener), nullptr, nullptr);
+            if((intptr_t)s == none) return false;
+            client = (intptr_t)s;
+            pending.clear();
+#ifdef SO_NOSIGPIPE
+            int on = 1;
+            setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        }
+
+        int n = (int)::recv(socket_of(client), buf, sizeof(buf), 0);
+        if(n <= 0) {
+            drop_client();
+            continue;
+        }
+        pending.append(buf, (size_t)n);
+        if(pending.size() > max_line && pending.find('\n') == std::string::npos) {
+            write("error Line longer than " + std::to_string(max_line) + " bytes.");
+            drop_client();
+        }
+    }
+}
+
+void Line_Server::write(const std::string& line) {
+
+    if(client == none) return;
+    std::string out = line + "\n";
+    size_t sent = 0;
+    while(sent < out.size()) {
+        int n = (int)::send(socket_of(client), out.data() + sent, (int)(out.size() - sent),
+                       send_flags);
+        if(n <= 0) {
+            drop_client();
+            return;
+        }
+        sent += (size_t)n;
+    }
+}
+
+void Line_Server::drop_client() {
+    if(client != none) close_socket(socket_of(client));
+    client = none;
+    pending.clear();
+}
+
+void Line_Server::close() {
+    drop_client();
+    if(listener != none) close_socket(socket_of(listener));
+    listener = none;
+}
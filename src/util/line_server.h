@@ -0,0 +1,36 @@
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// A TCP server on the loopback interface that exchanges lines of text with one client
+// at a time. Lines end with '\n' (a '\r' before it is dropped); a client sending a line
+// over 64KB is sent an error and dropped. The next client is accepted once the last
+// disconnects.
+class Line_Server {
+public:
+    Line_Server() = default;
+    Line_Server(const Line_Server& src) = delete;
+    ~Line_Server();
+
+    void operator=(const Line_Server& src) = delete;
+
+    // Returns an error message, or nothing once listening
+    std::string listen(int port);
+    // Waits for the next line, from the client or the next to connect. Returns false
+    // if the server can no longer accept clients.
+    bool read(std::string& line);
+    // Sends a line (without its '\n') to the client the last line came from, if it is
+    // still connected
+    void write(const std::string& line);
+    void close();
+
+private:
+    void drop_client();
+
+    static constexpr intptr_t none = -1;
+    intptr_t listener = none, client = none;
+    // Received past the last line read
+    std::string pending;
+};
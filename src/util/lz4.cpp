@@ -0,0 +1,138 @@
+
+#include "lz4.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "../lib/log.h"
+
+namespace LZ4 {
+
+// The format requires the last 5 bytes to be literals, and the last match to start
+// at least 12 bytes before the end
+static constexpr size_t min_match = 4, end_literals = 5, match_limit = 12;
+static constexpr size_t max_offset = 65535;
+static constexpr unsigned int hash_bits = 16;
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t hash(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - hash_bits);
+}
+
+static void put_length(std::vector<unsigned char>& out, size_t n) {
+    for(; n >= 255; n -= 255) out.push_back(255);
+    out.push_back((unsigned char)n);
+}
+
+// One sequence: literals, then a match of match_len bytes offset back, if any
+static void put_sequence(std::vector<unsigned char>& out, const unsigned char* literals,
+                         size_t n_literals, size_t match_len, size_t offset) {
+
+    size_t token = out.size();
+    out.push_back((unsigned char)(std::min<size_t>(n_literals, 15) << 4));
+    if(n_literals >= 15) put_length(out, n_literals - 15);
+    out.insert(out.end(), literals, literals + n_literals);
+
+    if(match_len == 0) return;
+    out.push_back((unsigned char)(offset & 0xff));
+    out.push_back((unsigned char)(offset >> 8));
+    size_t m = match_len - min_match;
+    out[token] |= (unsigned char)std::min<size_t>(m, 15);
+    if(m >= 15) put_length(out, m - 15);
+}
+
+std::vector<unsigned char> compress(const unsigned char* src, size_t size) {
+
+    assert(size < (size_t(1) << 32));
+
+    std::vector<unsigned char> out;
+    out.reserve(size / 2 + 16);
+    std::vector<uint32_t> table(size_t(1) << hash_bits, UINT32_MAX);
+
+    size_t anchor = 0, i = 0;
+    size_t limit = size > match_limit ? size - match_limit : 0;
+    while(i < limit) {
+
+        uint32_t seq = read32(src + i);
+        uint32_t& slot = table[hash(seq)];
+        size_t ref = slot;
+        slot = (uint32_t)i;
+
+        if(ref >= i || i - ref > max_offset || read32(src + ref) != seq) {
+            // Skip ahead faster the longer nothing has matched
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+
+        size_t len = min_match;
+        while(i + len < size - end_literals && src[ref + len] == src[i + len]) len++;
+        while(i > anchor && ref > 0 && src[i - 1] == src[ref - 1]) {
+            i--;
+            ref--;
+            len++;
+        }
+
+        put_sequence(out, src + anchor, i - anchor, len, i - ref);
+        i += len;
+        anchor = i;
+    }
+
+    put_sequence(out, src + anchor, size - anchor, 0, 0);
+    return out;
+}
+
+static bool get_length(const unsigned char* src, size_t size, size_t& i, size_t& n) {
+    unsigned char b;
+    do {
+        if(i >= size) return false;
+        b = src[i++];
+        n += b;
+    } while(b == 255);
+    return true;
+}
+
+bool decompress(const unsigned char* src, size_t size, unsigned char* dst, size_t dst_size) {
+
+    size_t i = 0, o = 0;
+    while(i < size) {
+
+        unsigned char token = src[i++];
+
+        size_t n_literals = token >> 4;
+        if(n_literals == 15 && !get_length(src, size, i, n_literals)) return false;
+        if(n_literals > size - i || n_literals > dst_size - o) return false;
+        if(n_literals) std::memcpy(dst + o, src + i, n_literals);
+        i += n_literals;
+        o += n_literals;
+
+        // The last sequence has no match
+        if(i == size) break;
+
+        if(size - i < 2) return false;
+        size_t offset = src[i] | (size_t(src[i + 1]) << 8);
+        i += 2;
+        if(offset == 0 || offset > o) return false;
+
+        size_t len = token & 15;
+        if(len == 15 && !get_length(src, size, i, len)) return false;
+        len += min_match;
+        if(len > dst_size - o) return false;
+
+        // Matches may overlap what they copy, which repeats it
+        if(offset >= len) {
+            std::memcpy(dst + o, dst + o - offset, len);
+        } else {
+            for(size_t k = 0; k < len; k++) dst[o + k] = dst[o + k - offset];
+        }
+        o += len;
+    }
+    return o == dst_size;
+}
+
+} // namespace LZ4
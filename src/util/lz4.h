@@ -0,0 +1,17 @@
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Compression in the LZ4 block format: fast enough to run on the UI thread, at a
+// modest ratio that improves a lot on data laid out to repeat (e.g. byte planes of
+// delta-coded integers). Inputs must be under 4GB.
+namespace LZ4 {
+
+std::vector<unsigned char> compress(const unsigned char* src, size_t size);
+
+// Returns false unless src decodes to exactly dst_size bytes
+bool decompress(const unsigned char* src, size_t size, unsigned char* dst, size_t dst_size);
+
+} // namespace LZ4
@@ -0,0 +1,95 @@
+
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+Mapped_File::~Mapped_File() {
+    close();
+}
+
+#ifdef _WIN32
+
+bool Mapped_File::open(const std::string& path, bool prefetch) {
+    close();
+    DWORD flags = FILE_ATTRIBUTE_NORMAL |
+                  (prefetch ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS);
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                       flags, nullptr);
+    if(file == INVALID_HANDLE_VALUE) {
+        file = nullptr;
+        return false;
+    }
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        close();
+        return false;
+    }
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if(!mapping) {
+        close();
+        return false;
+    }
+    ptr = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if(!ptr) {
+        close();
+        return false;
+    }
+    len = static_cast<size_t>(size.QuadPart);
+    return true;
+}
+
+void Mapped_File::close() {
+    if(ptr) UnmapViewOfFile(ptr);
+    if(mapping) CloseHandle(mapping);
+    if(file) CloseHandle(file);
+    ptr = nullptr;
+    mapping = file = nullptr;
+    len = 0;
+}
+
+void Mapped_File::evict() const {
+    // Unlocked pages leave the working set; clean ones can then be reclaimed at once
+    if(ptr) VirtualUnlock(const_cast<unsigned char*>(ptr), len);
+}
+
+#else
+
+bool Mapped_File::open(const std::string& path, bool prefetch) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    // The mapping keeps the file referenced, so the descriptor can go right away
+    void* map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(map == MAP_FAILED) return false;
+    madvise(map, static_cast<size_t>(st.st_size), prefetch ? MADV_WILLNEED : MADV_RANDOM);
+    ptr = static_cast<const unsigned char*>(map);
+    len = static_cast<size_t>(st.st_size);
+    return true;
+}
+
+void Mapped_File::close() {
+    if(ptr) munmap(const_cast<unsigned char*>(ptr), len);
+    ptr = nullptr;
+    len = 0;
+}
+
+void Mapped_File::evict() const {
+    // The mapping is private but never written, so its pages are still the file's
+    if(ptr) madvise(const_cast<unsigned char*>(ptr), len, MADV_DONTNEED);
+}
+
+#endif
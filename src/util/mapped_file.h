@@ -0,0 +1,41 @@
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Read-only view of a whole file, memory-mapped so that parsers can decode it in
+// place rather than from a copy read into memory first
+class Mapped_File {
+public:
+    Mapped_File() = default;
+    ~Mapped_File();
+
+    Mapped_File(const Mapped_File& src) = delete;
+    Mapped_File& operator=(const Mapped_File& src) = delete;
+
+    // Returns false (and maps nothing) if the file could not be opened or mapped.
+    // Without prefetch, pages are only read as they are first touched, and in no
+    // particular order, as suits data far larger than what any one pass reads.
+    bool open(const std::string& path, bool prefetch = true);
+    void close();
+
+    // Drops the pages read so far from memory; they are read from the file again
+    // if touched. Safe while other threads read the mapping.
+    void evict() const;
+
+    const unsigned char* data() const {
+        return ptr;
+    }
+    size_t size() const {
+        return len;
+    }
+
+private:
+    const unsigned char* ptr = nullptr;
+    size_t len = 0;
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#endif
+};
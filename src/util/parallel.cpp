@@ -0,0 +1,52 @@
+
+#include "parallel.h"
+
+#include <atomic>
+
+static size_t pool_threads = 0;
+static bool pool_pin = false;
+
+void configure_parallel_pool(size_t threads, bool pin) {
+    pool_threads = threads;
+    pool_pin = pin;
+}
+
+Thread_Pool& parallel_pool() {
+    static Thread_Pool pool(pool_threads ? pool_threads
+                                         : std::max(1u, std::thread::hardware_concurrency()),
+                            pool_pin);
+    return pool;
+}
+
+size_t parallel_chunk_size(size_t n, size_t grain) {
+    size_t per_worker = 4 * parallel_pool().size();
+    return std::max({grain, (n + per_worker - 1) / per_worker, size_t(1)});
+}
+
+void parallel_chunks(size_t n_chunks, const std::function<void(size_t)>& chunk) {
+
+    if(n_chunks <= 1) {
+        if(n_chunks == 1) chunk(0);
+        return;
+    }
+
+    // Chunks are claimed from a shared counter by the calling thread and by helper
+    // tasks, so a slow chunk does not hold up the ones queued behind it. Every
+    // chunk is finished by the thread that claimed it, so once all helpers have
+    // returned the loop is done (and none of them still reads this frame).
+    Thread_Pool& pool = parallel_pool();
+    std::atomic<size_t> next = 0, helpers_done = 0;
+    auto work = [&]() {
+        for(size_t c; (c = next++) < n_chunks;) chunk(c);
+    };
+
+    size_t helpers = std::min(n_chunks - 1, pool.size());
+    for(size_t i = 0; i < helpers; i++) {
+        pool.spawn([&]() {
+            work();
+            helpers_done++;
+        });
+    }
+    work();
+    pool.wait_until([&]() { return helpers_done.load() == helpers; });
+}
@@ -0,0 +1,88 @@
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <vector>
+
+#include "thread_pool.h"
+
+// Chunked loops run on the pool shared by the whole application, at the priority
+// of the calling thread (see Thread_Pool::Priority). A loop may be started from
+// any thread, including from inside another loop: the calling thread runs chunks
+// too, so nothing waits on a pool with no free workers.
+
+// The shared pool, with one worker per hardware thread unless configured otherwise.
+// Rendering, simulation builds and loading all submit here, so it is never cleared
+// or stopped.
+Thread_Pool& parallel_pool();
+
+// Sets the worker count (0 for one per hardware thread) and whether workers are
+// pinned to hardware threads. Only has an effect before the first parallel_pool().
+void configure_parallel_pool(size_t threads, bool pin);
+
+// Indices per chunk for a loop over n: at least grain, and large enough that
+// each worker gets no more than a few chunks
+size_t parallel_chunk_size(size_t n, size_t grain);
+
+// Runs chunk(c) for every c in [0, n_chunks) and returns once all have finished
+void parallel_chunks(size_t n_chunks, const std::function<void(size_t)>& chunk);
+
+// Calls f(b, e) on consecutive sub-ranges covering [begin, end)
+template<typename F> void parallel_for_range(size_t begin, size_t end, size_t grain, F&& f) {
+    if(end <= begin) return;
+    size_t chunk = parallel_chunk_size(end - begin, grain);
+    size_t n_chunks = (end - begin + chunk - 1) / chunk;
+    parallel_chunks(n_chunks, [&](size_t c) {
+        size_t b = begin + c * chunk;
+        f(b, std::min(b + chunk, end));
+    });
+}
+
+// Calls f(i) for every i in [begin, end)
+template<typename F> void parallel_for(size_t begin, size_t end, size_t grain, F&& f) {
+    parallel_for_range(begin, end, grain, [&](size_t b, size_t e) {
+        for(size_t i = b; i < e; i++) f(i);
+    });
+}
+
+// Combines map(b, e) over sub-ranges covering [begin, end). Partial results are
+// combined in order, so the result does not depend on scheduling.
+template<typename T, typename Map, typename Combine>
+T parallel_reduce(size_t begin, size_t end, size_t grain, T identity, Map&& map,
+                  Combine&& combine) {
+    if(end <= begin) return identity;
+    size_t chunk = parallel_chunk_size(end - begin, grain);
+    size_t n_chunks = (end - begin + chunk - 1) / chunk;
+    std::vector<T> partial(n_chunks, identity);
+    parallel_chunks(n_chunks, [&](size_t c) {
+        size_t b = begin + c * chunk;
+        partial[c] = map(b, std::min(b + chunk, end));
+    });
+    T result = identity;
+    for(T& p : partial) result = combine(result, p);
+    return result;
+}
+
+// Sorts runs of the range in parallel, then merges pairs of runs in parallel
+// until one is left. Not stable.
+template<typename It, typename Cmp = std::less<>>
+void parallel_sort(It first, It last, Cmp cmp = {}, size_t grain = 4096) {
+    size_t n = (size_t)std::distance(first, last);
+    size_t run = parallel_chunk_size(n, grain);
+    if(run >= n) {
+        std::sort(first, last, cmp);
+        return;
+    }
+    parallel_for_range(0, n, run, [&](size_t b, size_t e) {
+        std::sort(first + b, first + e, cmp);
+    });
+    for(; run < n; run *= 2) {
+        size_t pairs = (n + 2 * run - 1) / (2 * run);
+        parallel_chunks(pairs, [&](size_t p) {
+            size_t b = p * 2 * run, m = std::min(b + run, n), e = std::min(b + 2 * run, n);
+            if(m < e) std::inplace_merge(first + b, first + m, first + e, cmp);
+        });
+    }
+}
@@ -0,0 +1,100 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "../lib/spectrum.h"
+
+// Compact encodings of non-negative color, for pixels that are stored far more than
+// they are written. Both keep about three significant decimal digits and saturate at
+// their largest finite value rather than becoming infinite.
+namespace Pixel_Formats {
+
+// Largest finite value of each
+constexpr float half_max = 65504.0f;
+constexpr float rgb9e5_max = 65408.0f;
+
+// IEEE binary16, rounding to nearest even (after F. Giesen's float_to_half_fast3_rtne)
+inline uint16_t to_half(float f) {
+    f = std::min(f, half_max);
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = x & 0x80000000u;
+    x ^= sign;
+    uint32_t out;
+    if(x > 0x7f800000u) {
+        out = 0x7e00u;
+    } else if(x < 0x38800000u) {
+        // Too small to be normal: adding 0.5 lines the mantissa up with a subnormal's
+        float t;
+        std::memcpy(&t, &x, sizeof(t));
+        t += 0.5f;
+        std::memcpy(&x, &t, sizeof(x));
+        out = x - 0x3f000000u;
+    } else {
+        uint32_t odd = (x >> 13) & 1u;
+        // Rebias the exponent from 127 to 15, and round
+        x += 0xc8000fffu + odd;
+        out = x >> 13;
+    }
+    return static_cast<uint16_t>(out | (sign >> 16));
+}
+
+inline float from_half(uint16_t h) {
+    // Shift into a float's place, then scale by 2^112 to rebias the exponent, which
+    // handles subnormals as well; infinities and NaNs keep their all-ones exponent
+    uint32_t x = static_cast<uint32_t>(h & 0x7fffu) << 13;
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    f *= 5.192296858534828e33f;
+    if(f >= 65536.0f) {
+        x |= 0x7f800000u;
+        std::memcpy(&f, &x, sizeof(f));
+    }
+    return h & 0x8000u ? -f : f;
+}
+
+struct Half_RGB {
+    uint16_t c[3] = {};
+
+    Half_RGB() = default;
+    explicit Half_RGB(Spectrum s) : c{to_half(s.r), to_half(s.g), to_half(s.b)} {
+    }
+    Spectrum spectrum() const {
+        return Spectrum(from_half(c[0]), from_half(c[1]), from_half(c[2]));
+    }
+};
+
+// Three 9-bit mantissas sharing a 5-bit exponent, as in GL_EXT_texture_shared_exponent:
+// red in the lowest bits, then green, blue and the exponent. Channels much dimmer than
+// the brightest of a pixel lose precision, which matters little to how it looks.
+inline uint32_t to_rgb9e5(Spectrum s) {
+    float r = std::clamp(s.r, 0.0f, rgb9e5_max);
+    float g = std::clamp(s.g, 0.0f, rgb9e5_max);
+    float b = std::clamp(s.b, 0.0f, rgb9e5_max);
+    float m = std::max(std::max(r, g), b);
+    if(!(m > 0.0f)) return 0;
+
+    // frexp gives m = f * 2^e with f in [0.5, 1), so e is floor(log2(m)) + 1
+    int e = 0;
+    std::frexp(m, &e);
+    e = std::max(e, -15) + 15;
+    if(std::floor(m / std::ldexp(1.0f, e - 24) + 0.5f) >= 512.0f) e++;
+    float scale = std::ldexp(1.0f, 24 - e);
+    auto mantissa = [scale](float c) {
+        return std::min(static_cast<uint32_t>(c * scale + 0.5f), 511u);
+    };
+    return mantissa(r) | mantissa(g) << 9 | mantissa(b) << 18 | static_cast<uint32_t>(e) << 27;
+}
+
+inline Spectrum from_rgb9e5(uint32_t v) {
+    float scale = std::ldexp(1.0f, static_cast<int>(v >> 27) - 24);
+    return Spectrum(static_cast<float>(v & 511u) * scale,
+                    static_cast<float>((v >> 9) & 511u) * scale,
+                    static_cast<float>((v >> 18) & 511u) * scale);
+}
+
+} // namespace Pixel_Formats
@@ -0,0 +1,343 @@
+
+#include "png_writer.h"
+
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <sf_libs/stb_image_write.h>
+
+#include "parallel.h"
+
+namespace Png {
+
+// Filtered bytes per band: enough that matches lost at the seams cost little, and
+// that a 4K frame splits into a hundred or so
+static const size_t band_bytes = size_t(1) << 18;
+// Positions hashed by their next three bytes, for finding matches
+static const int hash_bits = 15;
+
+uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> ret;
+        for(uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for(int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            ret[i] = c;
+        }
+        return ret;
+    }();
+    crc = ~crc;
+    for(size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t adler32(const unsigned char* data, size_t size) {
+    uint32_t a = 1, b = 0;
+    while(size > 0) {
+        // The largest run the sums can take before they overflow
+        size_t n = std::min(size, size_t(5552));
+        for(size_t i = 0; i < n; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += n;
+        size -= n;
+    }
+    return b << 16 | a;
+}
+
+// The Adler-32 of two runs of bytes one after the other, from those of each and the
+// length of the second (as zlib's adler32_combine)
+static uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size) {
+    const uint32_t base = 65521;
+    uint32_t rem = (uint32_t)(second_size % base);
+    uint32_t a = first & 0xffff;
+    uint32_t b = (uint32_t)((uint64_t)rem * a % base);
+    a += (second & 0xffff) + base - 1;
+    b += (first >> 16) + (second >> 16) + base - rem;
+    if(a >= base) a -= base;
+    if(a >= base) a -= base;
+    if(b >= 2 * base) b -= 2 * base;
+    if(b >= base) b -= base;
+    return b << 16 | a;
+}
+
+static int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if(pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+static unsigned char filtered(int type, const unsigned char* row, const unsigned char* prev,
+                              size_t i) {
+    int a = i >= 4 ? row[i - 4] : 0;
+    int b = prev ? prev[i] : 0;
+    int c = prev && i >= 4 ? prev[i - 4] : 0;
+    switch(type) {
+    case 1: return (unsigned char)(row[i] - a);
+    case 2: return (unsigned char)(row[i] - b);
+    case 3: return (unsigned char)(row[i] - ((a + b) >> 1));
+    case 4: return (unsigned char)(row[i] - paeth(a, b, c));
+    default: return row[i];
+    }
+}
+
+// Writes the filter type, then the row filtered by it, choosing whichever of the five
+// leaves the smallest sum of magnitudes (as stb_image_write and libpng do)
+static void filter_row(const unsigned char* row, const unsigned char* prev, size_t n,
+                       unsigned char* out) {
+    int best = 0;
+    uint64_t best_sum = UINT64_MAX;
+    for(int type = 0; type < 5; type++) {
+        uint64_t sum = 0;
+        for(size_t i = 0; i < n; i++) sum += std::abs((signed char)filtered(type, row, prev, i));
+        if(sum < best_sum) {
+            best = type;
+            best_sum = sum;
+        }
+    }
+    out[0] = (unsigned char)best;
+    for(size_t i = 0; i < n; i++) out[1 + i] = filtered(best, row, prev, i);
+}
+
+// Deflate's bit stream: values are packed from the least significant bit up
+struct Bits {
+    std::vector<unsigned char> out;
+    uint64_t acc = 0;
+    int n = 0;
+
+    void put(uint32_t bits, int count) {
+        acc |= (uint64_t)bits << n;
+        n += count;
+        while(n >= 8) {
+            out.push_back((unsigned char)acc);
+            acc >>= 8;
+            n -= 8;
+        }
+    }
+    void align() {
+        if(n > 0) put(0, 8 - n);
+    }
+};
+
+// The fixed Huffman code of each literal/length symbol, bit reversed to be put as is
+struct Code {
+    uint16_t bits = 0;
+    uint8_t len = 0;
+};
+static const std::array<Code, 288>& literal_codes() {
+    static const std::array<Code, 288> table = [] {
+        std::array<Code, 288> ret;
+        for(uint32_t v = 0; v < 288; v++) {
+            uint32_t code, len;
+            if(v < 144) {
+                code = 0x30 + v, len = 8;
+            } else if(v < 256) {
+                code = 0x190 + v - 144, len = 9;
+            } else if(v < 280) {
+                code = v - 256, len = 7;
+            } else {
+                code = 0xc0 + v - 280, len = 8;
+            }
+            uint32_t rev = 0;
+            for(uint32_t i = 0; i < len; i++) rev |= ((code >> i) & 1) << (len - 1 - i);
+            ret[v] = {(uint16_t)rev, (uint8_t)len};
+        }
+        return ret;
+    }();
+    return table;
+}
+
+static const uint16_t length_base[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,
+                                         15, 17, 19, 23, 27, 31, 35, 43, 51,  59,
+                                         67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                         2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {1,    2,    3,    4,    5,    7,     9,     13,
+                                       17,   25,   33,   49,   65,   97,    129,   193,
+                                       257,  385,  513,  769,  1025, 1537,  2049,  3073,
+                                       4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                       6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// The code a length or distance falls in: the last whose base it reaches
+template<size_t N> static int code_of(const uint16_t (&base)[N], size_t value) {
+    return (int)(std::upper_bound(base, base + N, value) - base) - 1;
+}
+
+static uint32_t hash3(const unsigned char* p) {
+    uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+// One fixed Huffman block of greedy matches, each against the last position that
+// started with the same three bytes
+static void deflate_fast(const unsigned char* data, size_t size, Bits& bits) {
+
+    const std::array<Code, 288>& lit = literal_codes();
+    auto symbol = [&](int v) { bits.put(lit[v].bits, lit[v].len); };
+
+    // Not final, fixed codes
+    bits.put(0, 1);
+    bits.put(1, 2);
+
+    std::vector<uint32_t> head(size_t(1) << hash_bits, UINT32_MAX);
+    size_t i = 0;
+    while(i < size) {
+        size_t len = 0, dist = 0;
+        if(i + 3 <= size) {
+            uint32_t h = hash3(data + i);
+            uint32_t prev = head[h];
+            head[h] = (uint32_t)i;
+            if(prev != UINT32_MAX && i - prev <= 32768 &&
+               std::memcmp(data + prev, data + i, 3) == 0) {
+                size_t max = std::min(size - i, size_t(258));
+                len = 3;
+                while(len < max && data[prev + len] == data[i + len]) len++;
+                dist = i - prev;
+            }
+        }
+
+        if(len == 0) {
+            symbol(data[i]);
+            i++;
+            continue;
+        }
+
+        int lc = code_of(length_base, len);
+        symbol(257 + lc);
+        bits.put((uint32_t)(len - length_base[lc]), length_extra[lc]);
+        int dc = code_of(dist_base, dist);
+        uint32_t rev = 0;
+        for(int b = 0; b < 5; b++) rev |= (((uint32_t)dc >> b) & 1) << (4 - b);
+        bits.put(rev, 5);
+        bits.put((uint32_t)(dist - dist_base[dc]), dist_extra[dc]);
+
+        // Positions within the match may start later ones
+        for(size_t j = i + 1; j < i + len && j + 3 <= size; j++) {
+            head[hash3(data + j)] = (uint32_t)j;
+        }
+        i += len;
+    }
+    symbol(256);
+
+    // An empty stored block brings the stream to a byte boundary
+    bits.put(0, 3);
+    bits.align();
+    bits.put(0, 16);
+    bits.put(0xffff, 16);
+}
+
+// Stored blocks, which begin and end on byte boundaries
+static void store(const unsigned char* data, size_t size, Bits& bits) {
+    while(size > 0) {
+        size_t n = std::min(size, size_t(65535));
+        bits.put(0, 3);
+        bits.align();
+        bits.put((uint32_t)n, 16);
+        bits.put((uint32_t)(~n & 0xffff), 16);
+        bits.out.insert(bits.out.end(), data, data + n);
+        data += n;
+        size -= n;
+    }
+}
+
+std::string write(const std::string& path, const unsigned char* rgba, size_t w, size_t h,
+                  bool flip, Compression compression) {
+
+    if(w == 0 || h == 0 || w > INT_MAX / 4 || h > INT_MAX) return "Invalid image size.";
+    size_t stride = 4 * w;
+    auto row = [&](size_t y) { return rgba + stride * (flip ? h - 1 - y : y); };
+
+    if(compression == Compression::best) {
+        // stb flips with a global setting, so its rows are put in order here instead
+        std::vector<unsigned char> ordered;
+        if(flip) {
+            ordered.resize(stride * h);
+            for(size_t y = 0; y < h; y++) std::memcpy(&ordered[stride * y], row(y), stride);
+            rgba = ordered.data();
+        }
+        if(!stbi_write_png(path.c_str(), (int)w, (int)h, 4, rgba, (int)stride)) {
+            return "Failed to write " + path + ".";
+        }
+        return {};
+    }
+
+    size_t band_rows = std::max(band_bytes / (stride + 1), size_t(1));
+    size_t n_bands = (h + band_rows - 1) / band_rows;
+    std::vector<std::vector<unsigned char>> bands(n_bands);
+    std::vector<uint32_t> adlers(n_bands);
+    std::vector<size_t> sizes(n_bands);
+
+    parallel_for(0, n_bands, 1, [&](size_t b) {
+        size_t y0 = b * band_rows, y1 = std::min(h, y0 + band_rows);
+        std::vector<unsigned char> filtered((y1 - y0) * (stride + 1));
+        for(size_t y = y0; y < y1; y++) {
+            filter_row(row(y), y > 0 ? row(y - 1) : nullptr, stride,
+                       &filtered[(y - y0) * (stride + 1)]);
+        }
+        adlers[b] = adler32(filtered.data(), filtered.size());
+        sizes[b] = filtered.size();
+
+        Bits bits;
+        bits.out.reserve(compression == Compression::none ? filtered.size() + 64
+                                                          : filtered.size() / 2);
+        if(compression == Compression::none) {
+            store(filtered.data(), filtered.size(), bits);
+        } else {
+            deflate_fast(filtered.data(), filtered.size(), bits);
+        }
+        bands[b] = std::move(bits.out);
+    });
+
+    uint32_t adler = adlers[0];
+    for(size_t b = 1; b < n_bands; b++) adler = adler32_combine(adler, adlers[b], sizes[b]);
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if(!out) return "Could not open " + path + " for writing.";
+
+    auto be32 = [](unsigned char* p, uint32_t v) {
+        for(int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (24 - 8 * i));
+    };
+    auto chunk = [&](const char* type, const unsigned char* data, size_t size) {
+        unsigned char head[8], tail[4];
+        be32(head, (uint32_t)size);
+        std::memcpy(head + 4, type, 4);
+        be32(tail, crc32(data, size, crc32(head + 4, 4)));
+        out.write((const char*)head, 8);
+        out.write((const char*)data, size);
+        out.write((const char*)tail, 4);
+    };
+
+    static const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    out.write((const char*)signature, sizeof(signature));
+
+    // 8-bit RGBA, deflate, per-row filters, not interlaced
+    unsigned char ihdr[13] = {0, 0, 0, 0, 0, 0, 0, 0, 8, 6, 0, 0, 0};
+    be32(ihdr, (uint32_t)w);
+    be32(ihdr + 4, (uint32_t)h);
+    chunk("IHDR", ihdr, sizeof(ihdr));
+
+    // The zlib stream may be split across IDAT chunks anywhere, so each band gets its
+    // own, between the header (32K window, fastest level) and the final empty block
+    static const unsigned char zlib_head[] = {0x78, 0x01};
+    chunk("IDAT", zlib_head, sizeof(zlib_head));
+    for(const std::vector<unsigned char>& band : bands) chunk("IDAT", band.data(), band.size());
+    unsigned char zlib_tail[9] = {1, 0, 0, 0xff, 0xff};
+    be32(zlib_tail + 5, adler);
+    chunk("IDAT", zlib_tail, sizeof(zlib_tail));
+    chunk("IEND", nullptr, 0);
+
+    if(!out) return "Failed to write " + path + ".";
+    return {};
+}
+
+} // namespace Png
@@ -0,0 +1,32 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Writes 8-bit RGBA PNGs, deflating bands of rows in parallel on the shared pool.
+// Each band is compressed on its own (matches never reach into the band before it)
+// and ends on a byte boundary with an empty stored block, so the bands join into one
+// zlib stream as they are, as pigz does.
+namespace Png {
+
+enum class Compression : int {
+    // Stored blocks: the largest files, written about as fast as the disk allows
+    none,
+    // Greedy LZ77 matches with fixed Huffman codes, in parallel
+    fast,
+    // stb_image_write's single-threaded encoder, which searches harder for matches
+    best,
+    count
+};
+inline const char* Compression_Names[(int)Compression::count] = {"None", "Fast", "Best"};
+
+// Rows are top first, or bottom first (as OpenGL reads them back) if flip is set.
+// Returns an error message, or nothing once the file is written.
+std::string write(const std::string& path, const unsigned char* rgba, size_t w, size_t h,
+                  bool flip = false, Compression compression = Compression::fast);
+
+uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc = 0);
+
+} // namespace Png
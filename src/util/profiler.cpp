@@ -0,0 +1,178 @@
+
+#include "profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+namespace Profiler {
+
+static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+// A thread's finished zones. The registry keeps it after the thread exits, until its
+// last zones are collected.
+struct Buffer {
+    std::mutex mut;
+    uint32_t id = 0;
+    std::string name;
+    std::vector<Zone> zones;
+    size_t dropped = 0;
+    // Only touched by the owning thread
+    uint32_t depth = 0;
+};
+
+struct Registry {
+    std::mutex mut;
+    std::vector<std::shared_ptr<Buffer>> buffers;
+    uint32_t next_id = 0;
+};
+
+static Registry& registry() {
+    static Registry r;
+    return r;
+}
+
+static Buffer& local() {
+    thread_local std::shared_ptr<Buffer> buffer = []() {
+        auto b = std::make_shared<Buffer>();
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mut);
+        b->id = r.next_id++;
+        b->name = "Thread " + std::to_string(b->id);
+        r.buffers.push_back(b);
+        return b;
+    }();
+    return *buffer;
+}
+
+int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - epoch)
+        .count();
+}
+
+void enable(bool on) {
+    recording.store(on, std::memory_order_relaxed);
+}
+
+void set_thread_name(std::string name) {
+    Buffer& b = local();
+    std::lock_guard<std::mutex> lock(b.mut);
+    b.name = std::move(name);
+}
+
+void Scope::begin(const char* zone) {
+    name = zone;
+    local().depth++;
+    start = now();
+}
+
+void Scope::end() {
+    int64_t finish = now();
+    Buffer& b = local();
+    b.depth--;
+    std::lock_guard<std::mutex> lock(b.mut);
+    if(b.zones.size() < max_zones) {
+        b.zones.push_back({name, start, finish, b.depth});
+    } else {
+        b.dropped++;
+    }
+}
+
+std::vector<Thread_Zones> collect() {
+
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mut);
+
+    std::vector<Thread_Zones> ret;
+    for(const auto& b : r.buffers) {
+        std::lock_guard<std::mutex> buffer_lock(b->mut);
+        if(b->zones.empty() && !b->dropped) continue;
+        Thread_Zones thread;
+        thread.id = b->id;
+        thread.name = b->name;
+        thread.zones = std::move(b->zones);
+        thread.dropped = b->dropped;
+        b->zones = {};
+        b->dropped = 0;
+        ret.push_back(std::move(thread));
+    }
+
+    // Buffers of exited threads are only held here, and now have nothing left
+    r.buffers.erase(std::remove_if(r.buffers.begin(), r.buffers.end(),
+                                   [](const auto& b) { return b.use_count() == 1; }),
+                    r.buffers.end());
+    return ret;
+}
+
+void merge(std::vector<Thread_Zones>& capture, std::vector<Thread_Zones>&& more,
+           int64_t keep_after) {
+
+    for(Thread_Zones& thread : more) {
+        auto into = std::find_if(capture.begin(), capture.end(),
+                                 [&](const Thread_Zones& t) { return t.id == thread.id; });
+        if(into == capture.end()) {
+            capture.push_back(std::move(thread));
+            continue;
+        }
+        into->name = std::move(thread.name);
+        into->zones.insert(into->zones.end(), thread.zones.begin(), thread.zones.end());
+        into->dropped += thread.dropped;
+    }
+    if(keep_after < 0) return;
+
+    for(Thread_Zones& thread : capture) {
+        auto& zones = thread.zones;
+        zones.erase(std::remove_if(zones.begin(), zones.end(),
+                                   [keep_after](const Zone& z) { return z.end < keep_after; }),
+                    zones.end());
+    }
+    capture.erase(std::remove_if(capture.begin(), capture.end(),
+                                 [](const Thread_Zones& t) { return t.zones.empty(); }),
+                  capture.end());
+}
+
+static std::string escaped(const std::string& s) {
+    std::string ret;
+    for(char c : s) {
+        if(c == '"' || c == '\\') ret += '\\';
+        if((unsigned char)c >= 0x20) ret += c;
+    }
+    return ret;
+}
+
+std::string write_chrome_trace(const std::string& file, const std::vector<Thread_Zones>& capture) {
+
+    std::ofstream out(file);
+    if(!out) return "Could not open " + file + " for writing.";
+
+    // Complete ("X") events in microseconds, after a metadata event naming each thread
+    char buf[128];
+    bool first = true;
+    out << "{\"traceEvents\":[";
+    auto sep = [&]() {
+        out << (first ? "\n" : ",\n");
+        first = false;
+    };
+    for(const Thread_Zones& thread : capture) {
+        sep();
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread.id
+            << ",\"args\":{\"name\":\"" << escaped(thread.name) << "\"}}";
+        for(const Zone& z : thread.zones) {
+            sep();
+            std::snprintf(buf, sizeof(buf), "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f", z.start / 1e3,
+                          (z.end - z.start) / 1e3);
+            out << "{\"name\":\"" << escaped(z.name) << "\"," << buf
+                << ",\"pid\":1,\"tid\":" << thread.id << "}";
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    if(!out) return "Failed to write " + file + ".";
+    return {};
+}
+
+} // namespace Profiler
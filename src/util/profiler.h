@@ -0,0 +1,82 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A hierarchical CPU profiler. PROFILE_ZONE("Name") times the rest of the enclosing
+// scope on the calling thread, nested inside any zone still open around it. Zones
+// record nothing until recording is enabled, then cost two clock reads and an append
+// to the thread's own buffer. Building without SCOTTY3D_PROFILER compiles them away.
+namespace Profiler {
+
+// Names must be string literals (or otherwise outlive the profiler)
+struct Zone {
+    const char* name = nullptr;
+    // Nanoseconds since the profiler started
+    int64_t start = 0, end = 0;
+    uint32_t depth = 0;
+};
+
+struct Thread_Zones {
+    uint32_t id = 0;
+    std::string name;
+    // In the order they ended, so children before their parents
+    std::vector<Zone> zones;
+    // Zones not kept because the thread's buffer was full
+    size_t dropped = 0;
+};
+
+// Each thread keeps at most this many zones between collect() calls
+static constexpr size_t max_zones = size_t(1) << 20;
+
+void enable(bool on);
+inline std::atomic<bool> recording = false;
+
+// Names the calling thread in captures, e.g. "Main" or "Worker 3"
+void set_thread_name(std::string name);
+
+int64_t now();
+
+// Takes the zones every thread has finished since the last call
+std::vector<Thread_Zones> collect();
+
+// Adds more zones to a capture (as taken by collect), dropping those that ended
+// before keep_after (if not negative)
+void merge(std::vector<Thread_Zones>& capture, std::vector<Thread_Zones>&& more,
+           int64_t keep_after = -1);
+
+// Writes zones in the Chrome trace event format, which chrome://tracing and
+// Perfetto open
+std::string write_chrome_trace(const std::string& file, const std::vector<Thread_Zones>& capture);
+
+class Scope {
+public:
+    explicit Scope(const char* name) {
+        if(recording.load(std::memory_order_relaxed)) begin(name);
+    }
+    ~Scope() {
+        if(name) end();
+    }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    void begin(const char* name);
+    void end();
+
+    const char* name = nullptr;
+    int64_t start = 0;
+};
+
+} // namespace Profiler
+
+#ifdef SCOTTY3D_PROFILER
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_ZONE(name) Profiler::Scope PROFILE_CONCAT(profile_zone_, __LINE__)(name)
+#else
+#define PROFILE_ZONE(name) ((void)0)
+#endif
@@ -2,22 +2,88 @@
 #include "rand.h"
 #include "../lib/mathlib.h"
 
+#include <atomic>
 #include <ctime>
 #include <random>
 #include <thread>
 
 namespace RNG {
 
-static thread_local std::mt19937 rng;
+// Counter-based generator: the state is just a stream key, the sample index
+// and the next dimension to draw. Independent draws hash the key (which then
+// includes the sample) with the dimension; Sobol draws use the sample as the
+// point index and the key to scramble it per pixel.
+struct Stream {
+    uint64_t key = 0;
+    uint32_t index = 0;
+    uint32_t counter = 0;
+    bool sobol = false;
+};
+
+static thread_local Stream rng;
+static std::atomic<int> sequence = (int)Sequence::independent;
+
+// SplitMix64 finalizer
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Hash-based nested uniform (Owen) scramble, after Burley, "Practical Hash-based
+// Owen Scrambling" (2020): each bit is flipped depending only on higher bits.
+static uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// The first two Sobol dimensions, which together form a (0,2)-sequence
+static uint32_t sobol(uint32_t index, uint32_t dim) {
+    if(dim == 0) return reverse_bits(index);
+    uint32_t x = 0;
+    for(uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if(index & 1) x ^= v;
+    }
+    return x;
+}
+
+static uint32_t next() {
+    uint32_t dim = rng.counter++;
+    if(rng.sobol) {
+        // Each pair of dimensions shuffles the point order differently, so that
+        // pairs are decorrelated from one another (and pixels from each other)
+        uint32_t pair = uint32_t(mix(rng.key ^ (dim >> 1)));
+        uint32_t index = owen_scramble(rng.index, pair);
+        return owen_scramble(sobol(index, dim & 1), uint32_t(mix(rng.key + dim) >> 32));
+    }
+    uint64_t x = rng.key + 0x9e3779b97f4a7c15ull * (uint64_t(dim) + 1);
+    return uint32_t(mix(x) >> 32);
+}
 
 float unit() {
-    std::uniform_real_distribution<float> d(0.0f, 1.0f);
-    return d(rng);
+    return float(next() >> 8) * (1.0f / 16777216.0f);
 }
 
 int integer(int min, int max) {
-    std::uniform_int_distribution<int> d(min, max - 1);
-    return d(rng);
+    uint64_t range = uint64_t(int64_t(max) - int64_t(min));
+    return min + int((uint64_t(next()) * range) >> 32);
 }
 
 bool coin_flip(float p) {
@@ -26,11 +92,31 @@ bool coin_flip(float p) {
 
 void seed() {
     std::random_device r;
-    std::random_device::result_type seed =
-        r() ^
-        (std::random_device::result_type)std::hash<std::thread::id>()(std::this_thread::get_id()) ^
-        (std::random_device::result_type)std::hash<time_t>()(std::time(nullptr));
-    rng.seed(seed);
+    uint64_t seed = (uint64_t(r()) << 32 | r()) ^
+                    uint64_t(std::hash<std::thread::id>()(std::this_thread::get_id())) ^
+                    uint64_t(std::hash<time_t>()(std::time(nullptr)));
+    RNG::seed(seed);
+}
+
+void seed(uint64_t value) {
+    rng = {};
+    rng.key = mix(value);
+}
+
+void seed(uint64_t key, uint64_t index) {
+    rng = {};
+    rng.key = mix(mix(key) ^ index);
+}
+
+void stream(uint64_t pixel, uint64_t sample, uint32_t dimension) {
+    rng.sobol = sequence.load(std::memory_order_relaxed) == (int)Sequence::sobol;
+    rng.key = rng.sobol ? mix(pixel) : mix(mix(pixel) ^ sample);
+    rng.index = uint32_t(sample);
+    rng.counter = dimension;
+}
+
+void set_sequence(Sequence s) {
+    sequence.store((int)s, std::memory_order_relaxed);
 }
 
 } // namespace RNG
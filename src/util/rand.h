@@ -3,9 +3,17 @@
 
 #include "../lib/mathlib.h"
 
+#include <cstdint>
+
 namespace RNG {
 
-// Generate random float in the range [0,1]
+// How streams started with stream() draw their values: independently, or as
+// Owen-scrambled Sobol points indexed by sample, with consecutive dimensions
+// paired up so that each pair is a well-stratified 2D point set.
+enum class Sequence : int { independent, sobol, count };
+inline const char* Sequence_Names[(int)Sequence::count] = {"Independent", "Sobol"};
+
+// Generate random float in the range [0,1)
 float unit();
 
 // Generate random integer in the range [min,max)
@@ -14,6 +22,18 @@ int integer(int min, int max);
 // Return true with probability p and false with probability 1-p
 bool coin_flip(float p = 0.5f);
 
-// Seed the current thread's PRNG
+// Seed the current thread's PRNG, from the OS, thread and time or from a fixed value
 void seed();
+void seed(uint64_t value);
+// Seed from a key and a counter: parallel work items each seeding with their own
+// index draw the same values however they are scheduled
+void seed(uint64_t key, uint64_t index);
+
+// Switch the current thread to the stream of one sample of one pixel. Every
+// draw is a hash of (pixel, sample, dimension), with the dimension counting up
+// from the one given, so renders do not depend on which thread traced what.
+void stream(uint64_t pixel, uint64_t sample, uint32_t dimension = 0);
+
+// Choose the sequence used by streams started from now on, on any thread
+void set_sequence(Sequence sequence);
 } // namespace RNG
@@ -1,8 +1,197 @@
 
 #include "thread_pool.h"
+#include "../util/profiler.h"
 #include "../util/rand.h"
 
-Thread_Pool::Thread_Pool(size_t threads) {
+#include <chrono>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Chase-Lev deque, with the memory orderings of Le et al., "Correct and Efficient
+// Work-Stealing for Weak Memory Models" (2013). Only the owning worker pushes and
+// pops at the bottom; any thread may steal from the top.
+class Task_Deque {
+public:
+    using Task = void*;
+
+    Task_Deque() : ring(new Ring(256)) {
+    }
+    ~Task_Deque() {
+        delete ring.load(std::memory_order_relaxed);
+    }
+
+    void push(Task task) {
+        long long b = bottom.load(std::memory_order_relaxed);
+        long long t = top.load(std::memory_order_acquire);
+        Ring* r = ring.load(std::memory_order_relaxed);
+        if(b - t > (long long)r->mask) r = grow(r, t, b);
+        r->put(b, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    Task pop() {
+        long long b = bottom.load(std::memory_order_relaxed) - 1;
+        Ring* r = ring.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long t = top.load(std::memory_order_relaxed);
+        if(t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        Task task = r->get(b);
+        if(t == b) {
+            // Last task: race thieves for it
+            if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                            std::memory_order_relaxed)) {
+                task = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    Task steal() {
+        long long t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long b = bottom.load(std::memory_order_acquire);
+        if(t >= b) return nullptr;
+        Task task = ring.load(std::memory_order_acquire)->get(t);
+        if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return task;
+    }
+
+private:
+    struct Ring {
+        Ring(size_t size) : mask(size - 1), slots(new std::atomic<Task>[size]) {
+        }
+        Task get(long long i) const {
+            return slots[i & mask].load(std::memory_order_acquire);
+        }
+        void put(long long i, Task task) {
+            slots[i & mask].store(task, std::memory_order_release);
+        }
+        size_t mask;
+        std::unique_ptr<std::atomic<Task>[]> slots;
+    };
+
+    Ring* grow(Ring* r, long long t, long long b) {
+        Ring* bigger = new Ring((r->mask + 1) * 2);
+        for(long long i = t; i < b; i++) bigger->put(i, r->get(i));
+        // A thief may still be reading the old ring, so it is kept until destruction
+        retired.emplace_back(r);
+        ring.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    alignas(64) std::atomic<long long> top = 0;
+    alignas(64) std::atomic<long long> bottom = 0;
+    std::atomic<Ring*> ring;
+    std::vector<std::unique_ptr<Ring>> retired;
+};
+
+struct Thread_Pool::Worker {
+    Task_Deque deques[n_priorities];
+    std::thread thread;
+    Counters counters;
+};
+
+// Nanoseconds on a monotonic clock, for profiling
+static uint64_t now() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// The pool (if any) that the current thread works for, and its index there
+static thread_local const void* current_pool = nullptr;
+static thread_local size_t current_index = 0;
+// The priority of the running task, or the one set by a Scoped_Priority
+static thread_local Thread_Pool::Priority current_level = Thread_Pool::Priority::render;
+
+Thread_Pool::Scoped_Priority::Scoped_Priority(Priority priority) : previous(current_level) {
+    current_level = priority;
+}
+
+Thread_Pool::Scoped_Priority::~Scoped_Priority() {
+    current_level = previous;
+}
+
+Thread_Pool::Priority Thread_Pool::current_priority() {
+    return current_level;
+}
+
+// Finished tasks kept by this thread for reuse, linked through their storage
+struct Task_Cache {
+    static constexpr size_t max_size = 1024;
+    ~Task_Cache() {
+        while(head) {
+            void* next = *static_cast<void**>(head);
+            ::operator delete(head);
+            head = next;
+        }
+    }
+    void* head = nullptr;
+    size_t size = 0;
+};
+static thread_local Task_Cache task_cache;
+
+Thread_Pool::Task* Thread_Pool::Task::allocate() {
+    void* memory = task_cache.head;
+    if(memory) {
+        task_cache.head = *static_cast<void**>(memory);
+        task_cache.size--;
+    } else {
+        memory = ::operator new(sizeof(Task));
+    }
+    return new(memory) Task;
+}
+
+void Thread_Pool::Task::finish(bool run) {
+    call(this, run);
+    this->~Task();
+    if(task_cache.size < Task_Cache::max_size) {
+        *static_cast<void**>(static_cast<void*>(this)) = task_cache.head;
+        task_cache.head = this;
+        task_cache.size++;
+    } else {
+        ::operator delete(this);
+    }
+}
+
+// Restricts the calling thread to one hardware thread. Consecutive indices go to
+// consecutive CPUs, which the OS numbers node by node, so a worker's tiles (and
+// the pages they first touch) stay on one NUMA node.
+static void pin_to_cpu(size_t index) {
+    size_t cpus = std::max(1u, std::thread::hardware_concurrency());
+    size_t cpu = index % cpus;
+#ifdef _WIN32
+    if(cpu < sizeof(DWORD_PTR) * 8) {
+        SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+    }
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        warn("Failed to pin worker %zu to CPU %zu.", index, cpu);
+    }
+#else
+    (void)cpu;
+#endif
+}
+
+Thread_Pool::Thread_Pool(size_t threads, bool pin) : pin(pin) {
     start(threads);
 }
 
@@ -13,60 +202,265 @@ Thread_Pool::~Thread_Pool() {
 void Thread_Pool::start(size_t threads) {
     n_threads = threads;
     stop_now = false;
-    stop_when_done = false;
+    for(size_t i = 0; i < threads; i++) workers.emplace_back(new Worker);
     for(size_t i = 0; i < threads; i++)
-        workers.emplace_back([this] {
+        workers[i]->thread = std::thread([this, i] {
+            if(pin) pin_to_cpu(i);
             RNG::seed();
+            Profiler::set_thread_name("Worker " + std::to_string(i));
+            current_pool = this;
+            current_index = i;
             for(;;) {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(this->queue_mutex);
-                    this->condition.wait(lock, [this] {
-                        return this->stop_now || this->stop_when_done || !this->tasks.empty();
-                    });
-                    if(this->stop_now || (this->stop_when_done && this->tasks.empty())) return;
-                    task = std::move(this->tasks.front());
-                    this->tasks.pop();
+                if(Task* task = take(i)) {
+                    run(task);
+                    continue;
+                }
+                uint64_t asleep = profiling.load(std::memory_order_relaxed) ? now() : 0;
+                std::unique_lock<std::mutex> lock(sleep_mutex);
+                sleepers++;
+                wake.wait(lock, [this] { return stop_now || pending.load() > 0; });
+                sleepers--;
+                if(stop_now) return;
+                if(asleep) {
+                    workers[i]->counters.idle.fetch_add(now() - asleep, std::memory_order_relaxed);
                 }
-                task();
             }
         });
 }
 
-void Thread_Pool::clear() {
-    stop();
-    start(n_threads);
+void Thread_Pool::push(Task* task, Priority priority) {
+    size_t level = (size_t)priority;
+    task->priority = priority;
+    long long depth = ++pending;
+    queued[level]++;
+    if(profiling.load(std::memory_order_relaxed)) {
+        task->queued_at = now();
+        long long deepest = max_queued.load(std::memory_order_relaxed);
+        while(depth > deepest && !max_queued.compare_exchange_weak(deepest, depth)) {
+        }
+    }
+    if(current_pool == this) {
+        workers[current_index]->deques[level].push(task);
+    } else {
+        std::lock_guard<std::mutex> lock(shared_mutex);
+        shared[level].push_back(task);
+    }
+    // A worker about to sleep checks pending under sleep_mutex, so it either sees
+    // this task or is already waiting when the notification arrives
+    if(sleepers.load() > 0) {
+        { std::lock_guard<std::mutex> lock(sleep_mutex); }
+        wake.notify_one();
+    }
 }
 
-void Thread_Pool::wait() {
+Thread_Pool::Task* Thread_Pool::take(size_t self) {
 
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop_when_done = true;
+    // Returns a task with running already counted, so that clear() never sees a
+    // task that is neither queued nor running
+    auto claim = [this](void* task, size_t level) {
+        running++;
+        pending--;
+        queued[level]--;
+        return static_cast<Task*>(task);
+    };
+
+    size_t n = workers.size();
+    for(size_t level = 0; level < n_priorities; level++) {
+        // Queues of a priority are only searched while it has tasks queued, so
+        // finding no work costs a few loads rather than a sweep of every deque
+        if(queued[level].load() <= 0) continue;
+        if(self < n) {
+            if(void* task = workers[self]->deques[level].pop()) return claim(task, level);
+        }
+        {
+            std::lock_guard<std::mutex> lock(shared_mutex);
+            if(!shared[level].empty()) {
+                Task* task = shared[level].front();
+                shared[level].pop_front();
+                return claim(task, level);
+            }
+        }
+        size_t start = self < n ? self + 1 : 0;
+        for(size_t k = 0; k < n; k++) {
+            size_t victim = (start + k) % n;
+            if(victim == self) continue;
+            if(void* task = workers[victim]->deques[level].steal()) {
+                if(profiling.load(std::memory_order_relaxed)) {
+                    counters(self).steals.fetch_add(1, std::memory_order_relaxed);
+                }
+                return claim(task, level);
+            }
+        }
     }
+    return nullptr;
+}
 
-    condition.notify_all();
-    for(std::thread& worker : workers) {
-        worker.join();
+void Thread_Pool::run(Task* task) {
+    Scoped_Priority scope(task->priority);
+    if(!profiling.load(std::memory_order_relaxed)) {
+        task->finish(true);
+        running--;
+        return;
     }
-    workers.clear();
 
-    start(n_threads);
+    // Tasks queued before profiling was enabled have no queue time to report
+    uint64_t start = now();
+    if(task->queued_at) {
+        uint64_t micros = (start - std::min(start, task->queued_at)) / 1000;
+        size_t bucket = 0;
+        while(bucket + 1 < n_wait_buckets && (uint64_t(1) << bucket) <= micros) bucket++;
+        queue_wait[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+    task->finish(true);
+    Counters& c = counters(current_pool == this ? current_index : workers.size());
+    c.tasks.fetch_add(1, std::memory_order_relaxed);
+    c.busy.fetch_add(now() - start, std::memory_order_relaxed);
+    running--;
+}
+
+Thread_Pool::Counters& Thread_Pool::counters(size_t self) {
+    return self < workers.size() ? workers[self]->counters : external;
+}
+
+void Thread_Pool::set_profiling(bool enable) {
+    if(enable) {
+        auto reset = [](Counters& c) {
+            c.tasks = 0;
+            c.steals = 0;
+            c.busy = 0;
+            c.idle = 0;
+        };
+        for(auto& worker : workers) reset(worker->counters);
+        reset(external);
+        for(auto& bucket : queue_wait) bucket = 0;
+        max_queued = 0;
+        profile_start = now();
+    }
+    profiling = enable;
+}
+
+Thread_Pool::Stats Thread_Pool::stats() const {
+    auto load = [](const Counters& c) {
+        Worker_Stats s;
+        s.tasks = c.tasks.load(std::memory_order_relaxed);
+        s.steals = c.steals.load(std::memory_order_relaxed);
+        s.busy = c.busy.load(std::memory_order_relaxed) * 1e-9;
+        s.idle = c.idle.load(std::memory_order_relaxed) * 1e-9;
+        return s;
+    };
+    Stats s;
+    s.seconds = (now() - profile_start.load()) * 1e-9;
+    for(auto& worker : workers) s.workers.push_back(load(worker->counters));
+    s.external = load(external);
+    for(auto& bucket : queue_wait) s.queue_wait.push_back(bucket.load(std::memory_order_relaxed));
+    while(!s.queue_wait.empty() && s.queue_wait.back() == 0) s.queue_wait.pop_back();
+    s.max_queued = (size_t)std::max(max_queued.load(), 0ll);
+    return s;
+}
+
+bool Thread_Pool::run_pending() {
+    Task* task = take(current_pool == this ? current_index : workers.size());
+    if(!task) return false;
+    run(task);
+    return true;
+}
+
+void Thread_Pool::drop_queued() {
+    for(size_t level = 0; level < n_priorities; level++) {
+        for(;;) {
+            void* task = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(shared_mutex);
+                if(!shared[level].empty()) {
+                    task = shared[level].front();
+                    shared[level].pop_front();
+                }
+            }
+            for(size_t i = 0; !task && i < workers.size(); i++) {
+                task = workers[i]->deques[level].steal();
+            }
+            if(!task) break;
+            pending--;
+            queued[level]--;
+            static_cast<Task*>(task)->finish(false);
+        }
+    }
+}
+
+void Thread_Pool::clear() {
+    // Running tasks may queue more before they return, so drop until quiet
+    do {
+        drop_queued();
+        while(running.load() > 0) std::this_thread::yield();
+    } while(pending.load() > 0);
+}
+
+void Thread_Pool::wait() {
+    wait_until([this]() { return pending.load() <= 0 && running.load() == 0; });
 }
 
 void Thread_Pool::stop() {
 
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::unique_lock<std::mutex> lock(sleep_mutex);
         stop_now = true;
     }
 
-    condition.notify_all();
-    for(std::thread& worker : workers) {
-        worker.join();
+    wake.notify_all();
+    for(auto& worker : workers) {
+        if(worker->thread.joinable()) worker->thread.join();
     }
+    drop_queued();
     workers.clear();
+}
 
-    std::queue<std::function<void()>> empty;
-    std::swap(tasks, empty);
+void Task_Group::submit(Thread_Pool::Task* task, Thread_Pool::Priority priority) {
+    if(limit > 0) {
+        std::lock_guard<std::mutex> lock(held_mutex);
+        if(active == limit) {
+            held.emplace_back(task, priority);
+            return;
+        }
+        active++;
+    }
+    pool.push(task, priority);
+}
+
+void Task_Group::release() {
+    // Called before the task is counted as finished, so the group is still alive,
+    // and a held task takes over the finishing task's slot
+    if(limit == 0) return;
+    std::pair<Thread_Pool::Task*, Thread_Pool::Priority> next;
+    {
+        std::lock_guard<std::mutex> lock(held_mutex);
+        if(held.empty()) {
+            active--;
+            return;
+        }
+        next = held.front();
+        held.pop_front();
+    }
+    pool.push(next.first, next.second);
+}
+
+void Task_Group::finish() {
+    // Decrements to zero happen under the mutex, which wait() takes before
+    // returning, so the group can't be destroyed while its last task still uses it
+    size_t c = count.load();
+    while(c > 1) {
+        if(count.compare_exchange_weak(c, c - 1)) return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if(--count == 0) idle.notify_all();
+}
+
+void Task_Group::wait() {
+    while(!done()) {
+        if(pool.run_pending()) continue;
+        // Nothing to help with, so sleep until the last task finishes, checking
+        // back now and then in case one of them queues more work
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait_for(lock, std::chrono::milliseconds(1), [this]() { return done(); });
+    }
+    std::lock_guard<std::mutex> lock(mutex);
 }
@@ -1,50 +1,370 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
+#include <optional>
 #include <thread>
+#include <type_traits>
 
 #include "../lib/log.h"
 
+// The result of a task submitted with Thread_Pool::submit. Unlike std::future it
+// lives wherever the caller keeps it (usually on the stack or in a vector sized up
+// front), so submitting does not allocate shared state; it must not move or go out
+// of scope until the task has finished. Tasks dropped by Thread_Pool::clear finish
+// with a broken_promise error, as with std::future.
+template<typename T> class Pool_Future {
+public:
+    Pool_Future() = default;
+    Pool_Future(const Pool_Future&) = delete;
+    Pool_Future& operator=(const Pool_Future&) = delete;
+
+    bool ready() const {
+        return done.load(std::memory_order_acquire);
+    }
+    // Only once ready; rethrows what the task threw
+    T get() {
+        assert(ready());
+        if(error) std::rethrow_exception(error);
+        if constexpr(!std::is_void_v<T>) return std::move(*value);
+    }
+
+private:
+    friend class Thread_Pool;
+
+    // Owned by the task, which fulfils the future whether it runs or is dropped
+    struct Promise {
+        Promise(Pool_Future* future) : future(future) {
+        }
+        Promise(Promise&& src) : future(src.future) {
+            src.future = nullptr;
+        }
+        ~Promise() {
+            if(!future) return;
+            future->error =
+                std::make_exception_ptr(std::future_error(std::future_errc::broken_promise));
+            future->done.store(true, std::memory_order_release);
+        }
+        template<typename F> void run(F& f) {
+            try {
+                if constexpr(std::is_void_v<T>) {
+                    f();
+                } else {
+                    future->value.emplace(f());
+                }
+            } catch(...) {
+                future->error = std::current_exception();
+            }
+            future->done.store(true, std::memory_order_release);
+            future = nullptr;
+        }
+        Pool_Future* future;
+    };
+
+    void reset() {
+        value.reset();
+        error = nullptr;
+        done.store(false, std::memory_order_relaxed);
+    }
+
+    std::optional<std::conditional_t<std::is_void_v<T>, char, T>> value;
+    std::exception_ptr error;
+    std::atomic<bool> done = true;
+};
+
+// Work-stealing pool: each worker pushes and pops the tasks it submits on its own
+// lock-free deque, and steals from the others (or from the shared queue that
+// non-worker threads submit to) when it runs out.
+//
+// Every task has a priority, and a worker picking its next task always takes one
+// of the highest priority queued anywhere. Tasks submitted without one get the
+// priority of the task submitting them, so the subtasks of a background build
+// stay in the background; other threads submit at render priority by default.
 class Thread_Pool {
 public:
-    Thread_Pool(size_t threads);
+    enum class Priority : unsigned char { interactive, render, background, count };
+
+    // Sets the priority of tasks this thread submits without one, while in scope
+    class Scoped_Priority {
+    public:
+        Scoped_Priority(Priority priority);
+        ~Scoped_Priority();
+
+    private:
+        Priority previous;
+    };
+
+    // If pin is set, worker i only runs on hardware thread i (modulo their count)
+    Thread_Pool(size_t threads, bool pin = false);
     ~Thread_Pool();
 
     void stop();
+    // Block until no tasks are queued or running, running them on the calling
+    // thread meanwhile. Not for use from inside a task; wait on a Task_Group there.
     void wait();
+
+    // Drop all queued tasks and block until running tasks return, without
+    // stopping the worker threads.
     void clear();
 
+    // Block until the future is ready, running queued tasks on the calling thread
+    // in the meantime. Tasks that wait on other tasks must use this instead of
+    // future::get, or the pool can deadlock with every worker waiting.
+    template<typename T> T wait_for(std::future<T>& future) {
+        wait_until([&future]() {
+            return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+        return future.get();
+    }
+
+    template<typename T> T wait_for(Pool_Future<T>& future) {
+        wait_until([&future]() { return future.ready(); });
+        return future.get();
+    }
+
+    // As wait_for, until done() returns true
+    template<typename P> void wait_until(P&& done) {
+        while(!done()) {
+            if(!run_pending()) std::this_thread::yield();
+        }
+    }
+
+    size_t size() const {
+        return n_threads;
+    }
+
+    // Runs f on the pool, storing its result in future. Nothing is allocated unless
+    // f is too large to store inline, and the task storage itself is recycled, so
+    // this suits fork-join code submitting many small tasks.
+    template<typename T, class F> void submit(Priority priority, Pool_Future<T>& future, F&& f) {
+        assert(!stop_now);
+        future.reset();
+        push(Task::make([promise = typename Pool_Future<T>::Promise(&future),
+                         f = std::forward<F>(f)]() mutable { promise.run(f); }),
+             priority);
+    }
+    template<typename T, class F> void submit(Pool_Future<T>& future, F&& f) {
+        submit(current_priority(), future, std::forward<F>(f));
+    }
+
+    // As submit, returning a std::future, which allocates its shared state
     template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args)
+    auto enqueue(Priority priority, F&& f, Args&&... args)
         -> std::future<typename std::invoke_result<F, Args...>::type> {
 
         using return_type = typename std::invoke_result<F, Args...>::type;
-        assert(!stop_now && !stop_when_done);
+        assert(!stop_now);
 
-        auto task = std::make_shared<std::packaged_task<return_type()>>(
+        std::packaged_task<return_type()> task(
             std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 
-        std::future<return_type> res = task->get_future();
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            tasks.emplace([task]() { (*task)(); });
-        }
-        condition.notify_one();
+        std::future<return_type> res = task.get_future();
+        push(Task::make(std::move(task)), priority);
         return res;
     }
+    template<class F, class... Args>
+    auto enqueue(F&& f, Args&&... args)
+        -> std::future<typename std::invoke_result<F, Args...>::type> {
+        return enqueue(current_priority(), std::forward<F>(f), std::forward<Args>(args)...);
+    }
+
+    // Like enqueue, for tasks nobody waits on. Without a future to share state
+    // with, submitting one does not allocate.
+    template<class F> void spawn(Priority priority, F&& f) {
+        assert(!stop_now);
+        push(Task::make(std::forward<F>(f)), priority);
+    }
+    template<class F> void spawn(F&& f) {
+        spawn(current_priority(), std::forward<F>(f));
+    }
+
+    // Priority given to tasks submitted from this thread without one
+    static Priority current_priority();
+
+    // Scheduling counters, kept while profiling is enabled. Times are in seconds;
+    // workers are idle while asleep waiting for tasks.
+    struct Worker_Stats {
+        uint64_t tasks = 0, steals = 0;
+        double busy = 0.0, idle = 0.0;
+    };
+    struct Stats {
+        double seconds = 0.0;
+        std::vector<Worker_Stats> workers;
+        // Tasks run by threads outside the pool while they wait
+        Worker_Stats external;
+        // Tasks by time spent queued: bucket i counts waits under 2^i microseconds
+        std::vector<size_t> queue_wait;
+        size_t max_queued = 0;
+    };
+
+    // Enabling profiling resets the counters. While disabled, tasks only pay for
+    // checking the flag.
+    void set_profiling(bool enable);
+    Stats stats() const;
 
 private:
+    // A type-erased callable, stored inline when it is small enough. Finished tasks
+    // are kept for reuse by the thread that ran them, so tasks spawned by other
+    // tasks (tile passes, BVH subtrees) are not allocated in steady state.
+    struct Task {
+        static constexpr size_t inline_size = 64;
+
+        template<typename F> static Task* make(F&& f) {
+            using Fn = std::decay_t<F>;
+            Task* task = allocate();
+            if constexpr(sizeof(Fn) <= inline_size && alignof(Fn) <= alignof(std::max_align_t)) {
+                new(task->storage) Fn(std::forward<F>(f));
+                task->call = [](Task* t, bool run) {
+                    Fn* fn = std::launder(reinterpret_cast<Fn*>(t->storage));
+                    if(run) (*fn)();
+                    fn->~Fn();
+                };
+            } else {
+                *reinterpret_cast<Fn**>(task->storage) = new Fn(std::forward<F>(f));
+                task->call = [](Task* t, bool run) {
+                    Fn* fn = *reinterpret_cast<Fn**>(t->storage);
+                    if(run) (*fn)();
+                    delete fn;
+                };
+            }
+            return task;
+        }
+
+        // Run the callable (or only destroy it) and return the task to the cache
+        void finish(bool run);
+
+        static Task* allocate();
+
+        alignas(std::max_align_t) unsigned char storage[inline_size];
+        void (*call)(Task*, bool) = nullptr;
+        Priority priority = Priority::render;
+        // When the task was pushed, if profiling
+        uint64_t queued_at = 0;
+    };
+    static constexpr size_t n_priorities = (size_t)Priority::count;
+    static constexpr size_t n_wait_buckets = 24;
+    struct Counters {
+        std::atomic<uint64_t> tasks = 0, steals = 0, busy = 0, idle = 0;
+    };
+    struct Worker;
+    friend class Task_Group;
+
     void start(size_t);
+    void push(Task* task, Priority priority);
+    Task* take(size_t self);
+    void run(Task* task);
+    Counters& counters(size_t self);
+    bool run_pending();
+    void drop_queued();
+
     size_t n_threads;
-    bool stop_now = true;
-    bool stop_when_done = true;
-    std::mutex queue_mutex;
-    std::condition_variable condition;
-    std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
+    bool pin = false;
+    std::atomic<bool> stop_now = true;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    // Tasks submitted from outside the pool
+    std::mutex shared_mutex;
+    std::deque<Task*> shared[n_priorities];
+
+    // Queued tasks in total and at each priority (possibly transiently negative),
+    // and tasks being run. Workers only sleep once they have seen pending at zero
+    // under sleep_mutex.
+    std::atomic<long long> pending = 0;
+    std::atomic<long long> queued[n_priorities] = {};
+    std::atomic<size_t> running = 0;
+    std::atomic<size_t> sleepers = 0;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+
+    std::atomic<bool> profiling = false;
+    std::atomic<uint64_t> profile_start = 0;
+    Counters external;
+    std::atomic<uint64_t> queue_wait[n_wait_buckets] = {};
+    std::atomic<long long> max_queued = 0;
+};
+
+// A batch of tasks on a pool that can be waited on by itself, while the pool keeps
+// running everything else. Tasks dropped by Thread_Pool::clear count as finished.
+//
+// A group may be limited to running at most max_running of its tasks at once, so a
+// subsystem can share the pool without taking all of it; the rest are held back
+// until a slot frees up. Tasks of a limited group must not wait on tasks run later
+// in the same group, since those may be held behind them.
+class Task_Group {
+public:
+    Task_Group(Thread_Pool& pool, size_t max_running = 0) : pool(pool), limit(max_running) {
+    }
+    ~Task_Group() {
+        wait();
+    }
+
+    Task_Group(const Task_Group&) = delete;
+    Task_Group& operator=(const Task_Group&) = delete;
+
+    template<class F> void run(Thread_Pool::Priority priority, F&& f) {
+        assert(!pool.stop_now);
+        count++;
+        submit(Thread_Pool::Task::make(
+                   [f = std::forward<F>(f), done = Finish{this}]() mutable { f(); }),
+               priority);
+    }
+    template<class F> void run(F&& f) {
+        run(Thread_Pool::current_priority(), std::forward<F>(f));
+    }
+
+    // Block until every task run so far has finished, running queued tasks (of
+    // any group) on the calling thread meanwhile
+    void wait();
+    bool done() const {
+        return count.load() == 0;
+    }
+
+    // Sleep until every task run so far has finished or the timeout passes,
+    // without running any; returns whether they finished
+    template<class Rep, class Period>
+    bool wait_for(const std::chrono::duration<Rep, Period>& timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return idle.wait_for(lock, timeout, [this]() { return done(); });
+    }
+
+private:
+    // Finishes the task when destroyed, whether or not it ran
+    struct Finish {
+        Finish(Task_Group* group) : group(group) {
+        }
+        Finish(Finish&& src) : group(src.group) {
+            src.group = nullptr;
+        }
+        ~Finish() {
+            if(group) {
+                group->release();
+                group->finish();
+            }
+        }
+        Task_Group* group;
+    };
+    void submit(Thread_Pool::Task* task, Thread_Pool::Priority priority);
+    void release();
+    void finish();
+
+    Thread_Pool& pool;
+    std::atomic<size_t> count = 0;
+    std::mutex mutex;
+    std::condition_variable idle;
+
+    // Tasks queued or running on the pool, and those held back, if limited
+    size_t limit;
+    size_t active = 0;
+    std::mutex held_mutex;
+    std::deque<std::pair<Thread_Pool::Task*, Thread_Pool::Priority>> held;
 };